@@ -674,7 +674,11 @@ public class CameraService: NSObject, Identifiable {
                 // Create new photo settings!
                 // self.preparePhotoSettings(exposureDuration: self.cameraState.finalExposureDuration, iso: self.cameraState.finalISO)
             }, photoCapturingHandler: { isCapturing in self.isPhotoCapturing = isCapturing
-            }, photoProcessingHandler: { isProcessing in self.shouldShowSpinner = isProcessing })
+            }, photoProcessingHandler: { isProcessing in
+                self.shouldShowSpinner = isProcessing
+                // Leave the GPU to the capture pipeline
+                BurstFusionQueue.shared.isSuspended = isProcessing
+            })
 
             // Specify the location the photo was taken
             photoCaptureProcessor.location = self.locationManager.location
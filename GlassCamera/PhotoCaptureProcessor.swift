@@ -83,6 +83,8 @@ extension RawMetadata {
         colorMatrix2 = metadata["{DNG}", "ColorMatrix2"] as [NSNumber]? ?? []
         asShotNeutral = metadata["{DNG}", "AsShotNeutral"] as [NSNumber]? ?? []
         noiseProfile = metadata["{DNG}", "NoiseProfile"] as [NSNumber]? ?? []
+        cameraModel = metadata["{TIFF}", "Model"] as String?
+        lensModel = metadata["{Exif}", "LensModel"] as String?
     }
 }
 
@@ -101,9 +103,12 @@ class PhotoCaptureProcessor: NSObject {
     private var maxPhotoProcessingTime: CMTime?
 
     private let rawProcessor = RawProcessor()
-    private var saveRawDataTasks = [Task<Bool, Never>]()
+    private var saveRawDataTasks = [Task<URL?, Never>]()
     private var processRawDataTask: Task<Data?, Never>? = nil
 
+    // The RAW frames of a burst are merged as they arrive
+    private var burstSession: BurstSession? = nil
+
     private let saveCollection: PhotoCollection
 
     // Select the image processing pipeline
@@ -142,21 +147,54 @@ class PhotoCaptureProcessor: NSObject {
     func startRawProcessingTasks(photo: AVCapturePhoto) {
         let rawIndex = ++rawCount
 
+        if rawIndex == 1 {
+            burstSession = BurstSession(outputURL: makeFusedImageURL(timestamp: timestamp)) { fusedImageURL, error in
+                if let error = error {
+                    print("Burst fusion failed: \(error)")
+                }
+            }
+        }
+        if let rawPixelBuffer = photo.pixelBuffer {
+            burstSession?.addRawPixelBuffer(rawPixelBuffer, with: RawMetadata(from: photo.metadata))
+        }
+
         if rawIndex == 1 {
             processRawDataTask = Task(priority: .userInitiated) {
                 if let displayP3 = CGColorSpace(name: CGColorSpace.displayP3), let rawPixelBuffer = photo.pixelBuffer {
                     let rawMetadata = RawMetadata(from: photo.metadata)
 
-                    let pixelBuffer = self.isNNProcessingOn
-                    ? self.rawProcessor.nnProcessRawPixelBuffer(rawPixelBuffer, with: rawMetadata).takeRetainedValue()
-                    : self.rawProcessor.convertRawPixelBuffer(rawPixelBuffer, with: rawMetadata).takeRetainedValue()
+                    if self.isNNProcessingOn {
+                        let pixelBuffer = self.rawProcessor.nnProcessRawPixelBuffer(rawPixelBuffer, with: rawMetadata).takeRetainedValue()
 
+                        let cgImage = pixelBuffer.createCGImage(colorSpace: displayP3)
 
-                    let cgImage = pixelBuffer.createCGImage(colorSpace: displayP3)
+                        return encodeImageToHeif(CIImage(cgImage: cgImage!),
+                                                 compressionQuality: 0.8, colorSpace: displayP3,
+                                                 use10BitRepresentation: false /*cgImage!.bitsPerComponent > 8*/)
+                    }
 
-                    return encodeImageToHeif(CIImage(cgImage: cgImage!),
-                                             compressionQuality: 0.8, colorSpace: displayP3,
-                                             use10BitRepresentation: false /*cgImage!.bitsPerComponent > 8*/)
+                    // The pipeline writes the encoder's native 10 bit 420 YCbCr, no CGImage conversion. The conversion
+                    // runs on the pipeline's own queue, the task doesn't hold a thread while waiting for it.
+                    return await withCheckedContinuation { (continuation: CheckedContinuation<Data?, Never>) in
+                        _ = self.rawProcessor.convertRawPixelBufferToYCbCr(rawPixelBuffer, with: rawMetadata,
+                                                                           tenBit: true) { pixelBuffer, error in
+                            guard let pixelBuffer = pixelBuffer else {
+                                print("RAW conversion failed: \(String(describing: error))")
+                                continuation.resume(returning: nil)
+                                return
+                            }
+
+                            let heifData = encodeImageToHeif(CIImage(cvPixelBuffer: pixelBuffer,
+                                                                     options: [CIImageOption.colorSpace : displayP3 as Any]),
+                                                             compressionQuality: 0.8, colorSpace: displayP3,
+                                                             use10BitRepresentation: true)
+
+                            // Hand the output buffer back to the pipeline pool
+                            self.rawProcessor.returnOutputPixelBuffer(pixelBuffer)
+
+                            continuation.resume(returning: heifData)
+                        }
+                    }
                 }
                 return nil
             }
@@ -169,13 +207,13 @@ class PhotoCaptureProcessor: NSObject {
                     if let captureData = photo.fileDataRepresentation() {
                         try captureData.write(to: self.dngFile!)
                     } else {
-                        return false
+                        return nil
                     }
                 } catch {
                     fatalError("Couldn't write DNG file to the URL.")
                 }
 
-                return true
+                return self.dngFile
             })
         } else {
             saveRawDataTasks.append(Task(priority: .userInitiated) {
@@ -186,13 +224,13 @@ class PhotoCaptureProcessor: NSObject {
                         try captureData.write(to: file)
                         try! await self.saveCollection.addImage(captureData, timestamp: self.timestamp, photoCategory: PhotoCategories.GlassRawBurst, alternateResource: nil, location: self.location, index: rawIndex)
                     } else {
-                        return false
+                        return nil
                     }
                 } catch {
                     fatalError("Couldn't write DNG file to the URL.")
                 }
 
-                return true
+                return file
             })
         }
     }
@@ -308,6 +346,11 @@ private func makeUniqueDNGFileURL() -> URL {
     return tempDir.appendingPathComponent(fileName).appendingPathExtension("dng")
 }
 
+private func makeFusedImageURL(timestamp: String) -> URL {
+    let documentsDir = FileManager.default.urls(for: .documentDirectory, in: .userDomainMask).first!
+    return documentsDir.appendingPathComponent("Fused").appendingPathComponent(timestamp).appendingPathExtension("heic")
+}
+
 extension PhotoCaptureProcessor: AVCapturePhotoCaptureDelegate {
     // This extension adopts all of the AVCapturePhotoCaptureDelegate protocol methods.
 
@@ -358,7 +401,10 @@ extension PhotoCaptureProcessor: AVCapturePhotoCaptureDelegate {
                 }
             }
 
-            for t in saveRawDataTasks { await t.value }
+            // The burst's frames were merged as they arrived, wait for their DNG files
+            for t in saveRawDataTasks {
+                _ = await t.value
+            }
             self.completionHandler(self)
         }
     }
@@ -371,10 +417,13 @@ extension PhotoCaptureProcessor: AVCapturePhotoCaptureDelegate {
 
         if let error = error {
             print("Error capturing photo: \(error)")
+            burstSession?.cancel()
             DispatchQueue.main.async {
                 self.completionHandler(self)
             }
         } else {
+            // The last frame is in, only its merge and the final render are left
+            burstSession?.finish()
             self.saveToPhotoLibrary()
         }
     }
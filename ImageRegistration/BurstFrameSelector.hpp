@@ -0,0 +1,153 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef BurstFrameSelector_hpp
+#define BurstFrameSelector_hpp
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "gls_mtl_image.hpp"
+#include "demosaic.hpp"
+#include "demosaic_kernels.hpp"
+
+// Cheap GPU pre-pass of a burst: each frame is scored on its raw green at 1/8 of the sensor's resolution before any of
+// them goes through the pipeline. The sharpest frame is the reference, the frames with much less gradient energy than
+// it are blurred and dropped, and once registered the frames with a large residual after the alignment (subject
+// motion, a wrong homography) are dropped too. Only the small levels of the frames are kept.
+class BurstFrameSelector {
+public:
+    struct Options {
+        // Frames with less gradient energy than this fraction of the sharpest one's are blurred
+        float minRelativeSharpness = 0.6;
+        // Frames whose registered mean absolute difference to the reference exceeds this fraction of its mean luma
+        float maxRelativeResidual = 0.08;
+    };
+
+    struct FrameScore {
+        // Mean gradient energy of the level and its mean luma
+        float sharpness = 0;
+        float luma = 0;
+    };
+
+private:
+    MetalContext* _context;
+    burstFrameScoreKernel _scoreKernel;
+    const Options _options;
+
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _rawImage;
+    std::vector<gls::mtl_image_2d<float>::unique_ptr> _levelImages;
+    std::vector<FrameScore> _scores;
+
+public:
+    BurstFrameSelector(MetalContext* context, const Options& options = Options()) :
+        _context(context),
+        _scoreKernel(context),
+        _options(options) { }
+
+    // Starts a new burst, the textures are kept
+    void reset() {
+        _scores.clear();
+    }
+
+    // Scores the next frame, waits for the GPU
+    const FrameScore& addFrame(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters) {
+        const int frame = (int) _scores.size();
+        const auto levelSize = burstFrameScoreKernel::levelSize(rawImage.size());
+        if (frame == (int) _levelImages.size()) {
+            _levelImages.push_back(nullptr);
+        }
+        if (!_levelImages[frame] || _levelImages[frame]->size() != levelSize) {
+            _levelImages[frame] = std::make_unique<gls::mtl_image_2d<float>>(_context->device(), levelSize);
+        }
+
+        _scoreKernel.level(_context, rawImage, _levelImages[frame].get(), demosaicParameters.bayerPattern,
+                           demosaicParameters.black_level / 0xffff, demosaicParameters.scale_mul[1]);
+        _scoreKernel.sharpness(_context, *_levelImages[frame]);
+        _context->waitForCompletion();
+
+        const auto sums = _scoreKernel.sums();
+        const float count = std::max(sums.count, 1.0f);
+        _scores.push_back({ sums.value / count, sums.luma / count });
+        return _scores.back();
+    }
+
+    // CPU raw data is copied, it can be released as soon as this returns
+    const FrameScore& addFrame(const gls::image<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters) {
+        if (!_rawImage || _rawImage->size() != rawImage.size()) {
+            _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_context->device(), rawImage.size());
+        }
+        _rawImage->copyPixelsFrom(rawImage);
+        return addFrame(*_rawImage, demosaicParameters);
+    }
+
+    int frameCount() const {
+        return (int) _scores.size();
+    }
+
+    const FrameScore& score(int frame) const {
+        return _scores[frame];
+    }
+
+    // The sharpest frame
+    int reference() const {
+        const auto sharpest = std::max_element(_scores.begin(), _scores.end(), [](const FrameScore& a, const FrameScore& b) {
+            return a.sharpness < b.sharpness;
+        });
+        return (int) (sharpest - _scores.begin());
+    }
+
+    bool sharp(int frame) const {
+        return _scores[frame].sharpness >= _options.minRelativeSharpness * _scores[reference()].sharpness;
+    }
+
+    // The frames to merge before the registration, the reference first and the other sharp frames in their order
+    std::vector<int> sharpFrames() const {
+        const int referenceFrame = reference();
+        std::vector<int> frames = { referenceFrame };
+        for (int frame = 0; frame < frameCount(); frame++) {
+            if (frame != referenceFrame && sharp(frame)) {
+                frames.push_back(frame);
+            }
+        }
+        return frames;
+    }
+
+    // Mean absolute difference of the registered frame to the reference, relative to the reference's mean luma. The
+    // homography maps the reference's raw image coordinates to the frame's. Waits for the GPU.
+    float residual(int referenceFrame, int frame, const gls::Matrix<3, 3>& homography) {
+        // The level pixel p covers the raw pixels from 8 p, its center is at 8 p + 4
+        const gls::Matrix<3, 3> levelToRaw = {
+            { 8, 0, 4 },
+            { 0, 8, 4 },
+            { 0, 0, 1 }
+        };
+        const auto levelHomography = inverse(levelToRaw) * homography * levelToRaw;
+
+        _scoreKernel.residual(_context, *_levelImages[referenceFrame], *_levelImages[frame], levelHomography);
+        _context->waitForCompletion();
+
+        const auto sums = _scoreKernel.sums();
+        return sums.luma > 0 ? sums.value / sums.luma : 1;
+    }
+
+    bool aligned(int referenceFrame, int frame, const gls::Matrix<3, 3>& homography) {
+        return residual(referenceFrame, frame, homography) <= _options.maxRelativeResidual;
+    }
+};
+
+#endif /* BurstFrameSelector_hpp */
@@ -0,0 +1,297 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BurstMerger_hpp
+#define BurstMerger_hpp
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "gls_mtl_image.hpp"
+#include "demosaic_kernels.hpp"
+
+#include "SURF.hpp"
+#include "KeypointCache.hpp"
+#include "Homography.hpp"
+
+// Streaming burst merge: the frames of a burst of any length are added one at a time, the first one is the
+// reference the others are registered to. The registered frames are accumulated fusionBatchSize at a time in a single
+// pass, see RegisterAndFuseFramesKernel. Only the accumulator, the luma and fusionBatchSize working frames are
+// resident, the textures and the feature detector are allocated with the first frames and reused for every following
+// frame and burst of the same size, so memory doesn't grow with the burst length.
+// In mesh warp mode the frames are registered with per cell homographies instead (see gls::FindMeshHomography), each
+// frame is warped to the reference's geometry as it is added, at the cost of one more full size texture.
+// With the staging targets (one more frame and luma) the next frame can be converted while the current one registers.
+class BurstMerger {
+    MetalContext* _context;
+
+    convertToGrayscale _convertToGrayscale;
+    RegisterAndFuseFramesKernel _registerAndFuseFrames;
+    RegisterImageKernel<gls::pixel_float4> _registerImage;
+
+    std::unique_ptr<gls::SURF> _surf;
+    gls::KeypointCache* _keypointCache;
+
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _fusedImage;
+    std::vector<gls::mtl_image_2d<gls::pixel_float4>::unique_ptr> _frameImages;
+    gls::mtl_image_2d<float>::unique_ptr _lumaImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _warpedImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _stagingImage;
+    gls::mtl_image_2d<float>::unique_ptr _stagingLumaImage;
+    bool _meshWarp = false;
+
+    std::vector<KeyPoint> _referenceKeypoints;
+    gls::image<float>::unique_ptr _referenceDescriptors;
+
+    // Features and inliers of the frame being registered, reused across the frames of the burst
+    std::vector<KeyPoint> _frameKeypoints;
+    gls::image<float>::unique_ptr _frameDescriptors;
+    std::vector<int> _inliers;
+    std::optional<gls::Matrix<3, 3>> _previousHomography;
+    int _frameCount = 0;
+
+    // Registered frames waiting in _frameImages to be accumulated, and the frames in _fusedImage so far
+    std::vector<gls::Matrix<3, 3>> _pendingHomographies;
+    int _fusedCount = 0;
+    const int _fusionBatchSize;
+
+    // Window of the prior seeded matching, and the inliers below which the prior is deemed wrong
+    static constexpr float kPriorSearchRadius = 48;
+    static constexpr int kMinPriorInliers = 32;
+
+    void allocate(const gls::size& imageSize) {
+        if (_fusedImage && _fusedImage->size() == imageSize) {
+            return;
+        }
+        auto device = _context->device();
+        _fusedImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(device, imageSize);
+        _frameImages.clear();
+        _warpedImage.reset();
+        _stagingImage.reset();
+        _stagingLumaImage.reset();
+        _lumaImage = std::make_unique<gls::mtl_image_2d<float>>(device, imageSize);
+        // The detector keeps the textures of the sizes it has seen, a new image size doesn't need a new instance
+        if (!_surf) {
+            _surf = gls::SURF::makeInstance(_context, imageSize.width, imageSize.height,
+                                            /*max_features=*/ 1500, /*nOctaves=*/ 4, /*nOctaveLayers=*/ 2, /*hessianThreshold=*/ 0.02);
+        }
+    }
+
+    void detectAndCompute(std::vector<KeyPoint>* keypoints, gls::image<float>::unique_ptr* descriptors) {
+        const auto luma = _lumaImage->mapImage();
+        if (_keypointCache) {
+            _keypointCache->detectAndCompute(*_surf, *luma, keypoints, descriptors);
+        } else {
+            _surf->detectAndCompute(*luma, keypoints, descriptors);
+        }
+    }
+
+public:
+    // Accumulates the pending frames in one pass, nothing waits for the GPU
+    void fusePendingFrames() {
+        if (_pendingHomographies.empty()) {
+            return;
+        }
+        std::vector<const gls::mtl_image_2d<gls::pixel_float4>*> frames;
+        for (int i = 0; i < (int) _pendingHomographies.size(); i++) {
+            frames.push_back(_frameImages[i].get());
+        }
+        _registerAndFuseFrames(_context, frames, _pendingHomographies, _fusedCount, _fusedImage.get());
+        _fusedCount += (int) _pendingHomographies.size();
+        _pendingHomographies.clear();
+    }
+
+public:
+    // The optional keypoint cache skips the detection of frames seen before, e.g. when reprocessing with new settings.
+    // Each frame of the fusion batch is a full size RGBA texture, a batch of 1 fuses every frame as it is added.
+    BurstMerger(MetalContext* context, gls::KeypointCache* keypointCache = nullptr,
+                int fusionBatchSize = RegisterAndFuseFramesKernel::kMaxFrames) :
+        _context(context),
+        _convertToGrayscale(_context),
+        _registerAndFuseFrames(_context),
+        _registerImage(_context),
+        _keypointCache(keypointCache),
+        _fusionBatchSize(std::clamp(fusionBatchSize, 1, RegisterAndFuseFramesKernel::kMaxFrames)) { }
+
+    // Starts a new burst, the textures are kept
+    void reset() {
+        _frameCount = 0;
+        _fusedCount = 0;
+        _pendingHomographies.clear();
+        _previousHomography.reset();
+        _referenceKeypoints.clear();
+        _referenceDescriptors.reset();
+    }
+
+    // Mesh warp registration of the frames added from now on, for the scenes with parallax
+    void setMeshWarp(bool meshWarp) {
+        _meshWarp = meshWarp;
+    }
+
+    bool meshWarp() const {
+        return _meshWarp;
+    }
+
+    // Checks the registration of a frame with its homography, e.g. BurstFrameSelector::aligned
+    typedef std::function<bool(const gls::Matrix<3, 3>& homography)> alignment_check_type;
+
+    // Textures of the next frame, for a RawConverter to write its RGBA output and the registration luma (see
+    // RawConverter::setExtraOutputs) in place of the copy and the grayscale pass of addFrame
+    struct FrameTargets {
+        gls::mtl_image_2d<gls::pixel_float4>* rgbImage;
+        gls::mtl_image_2d<float>* lumaImage;
+    };
+
+    FrameTargets nextFrameTargets(const gls::size& imageSize) {
+        allocate(imageSize);
+
+        // The reference frame goes straight to the accumulator
+        if (_frameCount == 0) {
+            return { _fusedImage.get(), _lumaImage.get() };
+        }
+        const int index = (int) _pendingHomographies.size();
+        if (index == (int) _frameImages.size()) {
+            _frameImages.push_back(std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_context->device(), imageSize));
+        }
+        return { _frameImages[index].get(), _lumaImage.get() };
+    }
+
+    // Textures a frame can be converted into while the previous one is still being registered, see adoptStagedFrame.
+    // The merger's GPU work is complete when this returns, the targets can be written by another context's queue.
+    FrameTargets stagingTargets(const gls::size& imageSize) {
+        allocate(imageSize);
+        _context->waitForCompletion();
+
+        if (!_stagingImage) {
+            _stagingImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_context->device(), imageSize);
+            _stagingLumaImage = std::make_unique<gls::mtl_image_2d<float>>(_context->device(), imageSize);
+        }
+        return { _stagingImage.get(), _stagingLumaImage.get() };
+    }
+
+    // Makes the frame written to the stagingTargets() the next frame of addConvertedFrame: its textures trade places
+    // with the nextFrameTargets(), without a copy. The GPU work writing them must be complete.
+    void adoptStagedFrame() {
+        if (!_stagingImage) {
+            throw std::runtime_error("BurstMerger: no staged frame");
+        }
+        nextFrameTargets(_stagingImage->size());
+
+        auto& frameImage = _frameCount == 0 ? _fusedImage : _frameImages[_pendingHomographies.size()];
+        std::swap(frameImage, _stagingImage);
+        std::swap(_lumaImage, _stagingLumaImage);
+    }
+
+    // Adds the demosaiced linear RGB frame, e.g. a RawConverter's output, which is copied and can be reused right
+    // away. The luma weights convert the frame to the grayscale image of the feature detection. The optional prior
+    // (e.g. from the gyro) maps the reference's coordinates to the frame's, by default the previous frame's homography
+    // seeds the matching and RANSAC. A prior the matches don't confirm falls back to the unseeded search.
+    bool addFrame(const gls::mtl_image_2d<gls::pixel_float4>& rgbImage, const std::array<float, 3>& lumaWeights,
+                  const gls::Matrix<3, 3>* prior = nullptr, const alignment_check_type& acceptAlignment = nullptr) {
+        const auto targets = nextFrameTargets(rgbImage.size());
+
+        // The converter's output is reused by the next frame
+        _context->enqueue([&](MTL::CommandBuffer* commandBuffer) { targets.rgbImage->copyPixelsFrom(commandBuffer, rgbImage); });
+        _convertToGrayscale(_context, *targets.rgbImage, targets.lumaImage, lumaWeights);
+        _context->waitForCompletion();
+
+        return addConvertedFrame(prior, acceptAlignment);
+    }
+
+    // Adds the frame written to the nextFrameTargets(), the GPU work writing them must be complete. A frame failing
+    // acceptAlignment is not merged, returns false then and its targets are reused by the next frame.
+    bool addConvertedFrame(const gls::Matrix<3, 3>* prior = nullptr, const alignment_check_type& acceptAlignment = nullptr) {
+        if (!_fusedImage) {
+            throw std::runtime_error("BurstMerger: no frame targets");
+        }
+
+        if (_frameCount == 0) {
+            detectAndCompute(&_referenceKeypoints, &_referenceDescriptors);
+            std::cout << "Found " << _referenceKeypoints.size() << " reference keypoints" << std::endl;
+            _fusedCount = 1;
+        } else {
+            detectAndCompute(&_frameKeypoints, &_frameDescriptors);
+
+            std::cout << "Found " << _frameKeypoints.size() << " keypoints for image " << _frameCount << std::endl;
+
+            if (!prior && _previousHomography) {
+                prior = &*_previousHomography;
+            }
+
+            _inliers.clear();
+            gls::Matrix<3, 3> homography;
+            gls::frame_vector<std::pair<Point2f, Point2f>> matches;
+            if (prior) {
+                matches = _surf->findMatches(*_referenceDescriptors, _referenceKeypoints, *_frameDescriptors, _frameKeypoints,
+                                             *prior, kPriorSearchRadius);
+                homography = gls::FindHomography(matches, /*threshold=*/ 1, /*max_iterations=*/ 2000, *prior, &_inliers);
+            }
+            if ((int) _inliers.size() < kMinPriorInliers) {
+                matches = _surf->findMatches(*_referenceDescriptors, _referenceKeypoints, *_frameDescriptors, _frameKeypoints);
+                homography = gls::FindHomography(matches, /*threshold=*/ 1, /*max_iterations=*/ 2000, &_inliers);
+            }
+            std::cout << "Homography:\n" << homography << std::endl;
+            std::cout << "Found " << _inliers.size() << " inliers." << std::endl;
+
+            if (acceptAlignment && !acceptAlignment(homography)) {
+                std::cout << "Dropping misaligned image " << _frameCount << std::endl;
+                return false;
+            }
+            _previousHomography = homography;
+
+            if (_meshWarp) {
+                // The frame is warped in place of its texture, the fusion samples it with an identity. The pixels the
+                // frame doesn't cover take its clamped edge, as with registerImage.
+                const auto mesh = gls::FindMeshHomography(matches, _inliers, homography, _fusedImage->size());
+                auto& frameImage = _frameImages[_pendingHomographies.size()];
+                if (!_warpedImage) {
+                    _warpedImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_context->device(), _fusedImage->size());
+                }
+                _registerImage(_context, *frameImage, _warpedImage.get(), MeshWarp(mesh.cells, mesh.columns, mesh.rows, mesh.imageSize));
+                std::swap(frameImage, _warpedImage);
+                homography = gls::Matrix<3, 3>::identity();
+            }
+
+            _pendingHomographies.push_back(homography);
+            if ((int) _pendingHomographies.size() == _fusionBatchSize) {
+                fusePendingFrames();
+            }
+        }
+        _frameCount++;
+        return true;
+    }
+
+    int frameCount() const {
+        return _frameCount;
+    }
+
+    // Accumulates the pending frames and waits for the GPU
+    const gls::mtl_image_2d<gls::pixel_float4>& fusedImage() {
+        if (_frameCount == 0) {
+            throw std::runtime_error("BurstMerger: no frames merged");
+        }
+        fusePendingFrames();
+        _context->waitForCompletion();
+        return *_fusedImage;
+    }
+};
+
+#endif /* BurstMerger_hpp */
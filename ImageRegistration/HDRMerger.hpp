@@ -0,0 +1,150 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef HDRMerger_hpp
+#define HDRMerger_hpp
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "gls_mtl_image.hpp"
+#include "demosaic.hpp"
+#include "demosaic_kernels.hpp"
+
+#include "SURF.hpp"
+#include "KeyPoints.hpp"
+#include "Homography.hpp"
+
+// Exposure bracket merge in the raw domain: the first bracket added is the reference, usually the metered exposure,
+// the others are registered to it on their half resolution green channel scaled to the reference's exposure, and
+// merged with the noise model weighted average of hdrMergeKernel. Only the merged raw image goes through the
+// RawConverter pipeline, with the parameters of mergedRawImage.
+class HDRMerger {
+    MetalContext* _context;
+
+    bayerToRawRGBAKernel _bayerToRawRGBA;
+    rawGreenToGrayscaleKernel _rawGreenToGrayscale;
+    hdrMergeKernel _hdrMerge;
+
+    std::unique_ptr<gls::SURF> _surf;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _rgbaImage;
+    gls::mtl_image_2d<float>::unique_ptr _lumaImage;
+
+    std::unique_ptr<KeyPoints> _referenceKeypoints;
+    std::unique_ptr<KeyPoints> _imageKeypoints;
+    float _referenceExposure = 0;
+    int _frameCount = 0;
+
+    static float exposure(const DemosaicParameters& demosaicParameters) {
+        if (demosaicParameters.exposureTime <= 0) {
+            throw std::runtime_error("HDRMerger: unknown bracket exposure time");
+        }
+        return demosaicParameters.exposureTime * (demosaicParameters.iso > 0 ? demosaicParameters.iso : 100);
+    }
+
+    void allocate(const gls::size& imageSize) {
+        const auto planeSize = imageSize / 2;
+        if (_lumaImage && _lumaImage->size() == planeSize) {
+            return;
+        }
+        auto device = _context->device();
+        _rgbaImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(device, planeSize);
+        _lumaImage = std::make_unique<gls::mtl_image_2d<float>>(device, planeSize);
+        // The detector keeps the textures of the sizes it has seen, a new image size doesn't need a new instance
+        if (!_surf) {
+            _surf = gls::SURF::makeInstance(_context, planeSize.width, planeSize.height,
+                                            /*max_features=*/ 1500, /*nOctaves=*/ 4, /*nOctaveLayers=*/ 2, /*hessianThreshold=*/ 0.02);
+        }
+    }
+
+    // The registration luma at the reference's exposure, brackets of different exposures look alike to the matcher
+    void detectAndCompute(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, const DemosaicParameters& referenceParameters,
+                          float exposureRatio, std::unique_ptr<KeyPoints>* keypoints) {
+        _bayerToRawRGBA(_context, rawImage, _rgbaImage.get(), referenceParameters.bayerPattern);
+        _rawGreenToGrayscale(_context, *_rgbaImage, _lumaImage.get(), referenceParameters.black_level / 0xffff,
+                             exposureRatio * referenceParameters.scale_mul[1]);
+        _context->waitForCompletion();
+
+        _surf->detectAndCompute(*_lumaImage->mapImage(), keypoints);
+    }
+
+public:
+    HDRMerger(MetalContext* context) :
+        _context(context),
+        _bayerToRawRGBA(context),
+        _rawGreenToGrayscale(context),
+        _hdrMerge(context) { }
+
+    // Starts a new bracket set, the textures are kept
+    void reset() {
+        _frameCount = 0;
+    }
+
+    // Adds a bracket with its own parameters, for its exposure time and ISO, the reference's parameters apply to
+    // the whole merge. The reference bracket must stay alive until mergedRawImage, the other ones until addFrame
+    // returns.
+    void addFrame(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters,
+                  const DemosaicParameters& referenceParameters) {
+        allocate(rawImage.size());
+
+        if (_frameCount == 0) {
+            _referenceExposure = exposure(demosaicParameters);
+            _hdrMerge.begin(_context, rawImage, referenceParameters.bayerPattern, referenceParameters.scale_mul,
+                            referenceParameters.black_level / 0xffff, referenceParameters.white_level / 0xffff,
+                            referenceParameters.noiseModel.rawNlf);
+            detectAndCompute(rawImage, referenceParameters, 1, &_referenceKeypoints);
+            std::cout << "Found " << _referenceKeypoints->size() << " reference keypoints" << std::endl;
+        } else {
+            const float exposureRatio = _referenceExposure / exposure(demosaicParameters);
+            detectAndCompute(rawImage, referenceParameters, exposureRatio, &_imageKeypoints);
+            std::cout << "Found " << _imageKeypoints->size() << " keypoints for bracket " << _frameCount
+                      << ", exposure ratio: " << exposureRatio << std::endl;
+
+            const auto matches = _surf->findMatches(*_referenceKeypoints, *_imageKeypoints);
+            std::vector<int> inliers;
+            const auto homography = gls::FindHomography(matches, /*threshold=*/ 1, /*max_iterations=*/ 2000, &inliers);
+            std::cout << "Found " << inliers.size() << " inliers." << std::endl;
+
+            // The homography is estimated on the half resolution planes, as the merge expects
+            _hdrMerge.merge(_context, rawImage, homography, exposureRatio);
+            _context->waitForCompletion();
+        }
+        _frameCount++;
+    }
+
+    int frameCount() const {
+        return _frameCount;
+    }
+
+    // The merged raw image, demosaicParameters are the reference's, updated for the merged image's exposure
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr mergedRawImage(DemosaicParameters* demosaicParameters) {
+        if (_frameCount == 0) {
+            throw std::runtime_error("HDRMerger: no brackets merged");
+        }
+        auto mergedImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_context->device(), _hdrMerge._referenceImage->size());
+        _hdrMerge.resolve(_context, mergedImage.get());
+        _context->waitForCompletion();
+
+        std::cout << "HDR merge of " << _frameCount << " brackets, output scale: " << _hdrMerge.outputScale() << std::endl;
+        mergedHDRParameters(demosaicParameters, _hdrMerge.outputScale());
+        _frameCount = 0;
+        return mergedImage;
+    }
+};
+
+#endif /* HDRMerger_hpp */
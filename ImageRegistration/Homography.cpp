@@ -15,11 +15,20 @@
 
 #include <float.h>
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <span>
+
 #include "RANSAC.hpp"
+#include "TaskScheduler.hpp"
+#include "gls_frame_arena.hpp"
 #include "gls_geometry.hpp"
 #include "gls_linalg.hpp"
 #include "LeastSquaresHomography.hpp"
 
+#define USE_PARALLEL_RANSAC true
 #define USE_RTL true
 #define USE_MLESAC false  // Regular RANSAC is more robust
 
@@ -27,12 +36,240 @@
 #include "RTL/RTL.hpp"
 #endif
 #include "gls_logging.h"
+#include "gls_signpost.hpp"
 
 static const char* TAG = "DEMOSAIC";
 
 namespace gls {
 
-#if USE_RTL
+#if USE_PARALLEL_RANSAC
+
+// Matches in structure of arrays layout, for the vectorized scoring of the hypotheses
+struct RansacPoints {
+    gls::frame_vector<float> x1, y1, x2, y2;
+
+    RansacPoints(std::span<const std::pair<Point2f, Point2f>> matchpoints) :
+    x1(matchpoints.size()), y1(matchpoints.size()), x2(matchpoints.size()), y2(matchpoints.size()) {
+        for (int i = 0; i < matchpoints.size(); i++) {
+            x1[i] = matchpoints[i].first.x;
+            y1[i] = matchpoints[i].first.y;
+            x2[i] = matchpoints[i].second.x;
+            y2[i] = matchpoints[i].second.y;
+        }
+    }
+
+    int size() const {
+        return (int) x1.size();
+    }
+};
+
+// Number of matches with a squared reprojection error below threshold, the loop is branchless and vectorizes
+static int countInliers(const RansacPoints& points, const gls::Matrix<3, 3>& H, float threshold) {
+    const float h00 = H[0][0], h01 = H[0][1], h02 = H[0][2];
+    const float h10 = H[1][0], h11 = H[1][1], h12 = H[1][2];
+    const float h20 = H[2][0], h21 = H[2][1], h22 = H[2][2];
+
+    const float* x1 = points.x1.data();
+    const float* y1 = points.y1.data();
+    const float* x2 = points.x2.data();
+    const float* y2 = points.y2.data();
+
+    int inliers = 0;
+    for (int i = 0; i < points.size(); i++) {
+        const float w = h20 * x1[i] + h21 * y1[i] + h22;
+        const float dx = (h00 * x1[i] + h01 * y1[i] + h02) / w - x2[i];
+        const float dy = (h10 * x1[i] + h11 * y1[i] + h12) / w - y2[i];
+        inliers += dx * dx + dy * dy < threshold;
+    }
+    return inliers;
+}
+
+// Hypotheses needed to draw an all inliers sample with probability p, given the inliers ratio
+static int adaptiveIterations(int inliers, int count, int max_iterations) {
+    const float p = 0.995;
+    const float ep = (float)(count - inliers) / count;
+
+    // avoid inf's & nan's
+    const float eps = std::numeric_limits<float>::epsilon();
+
+    const float num = log(std::max(1.f - p, eps));
+    const float denom_ = 1. - pow(1.f - ep, 4);
+    if (denom_ < eps) {
+        return 0;
+    }
+    const float denom = log(denom_);
+    return denom >= 0 || -num >= max_iterations * (-denom) ? max_iterations : (int)(num / denom);
+}
+
+// PROSAC (Chum and Matas) growth function: hypothesis t samples the top n matches, with n the first
+// index with schedule[n] >= t. The schedule covers all the matches after growthIterations hypotheses,
+// the following hypotheses sample uniformly as RANSAC.
+static gls::frame_vector<int> prosacSchedule(int count, int growthIterations) {
+    const int m = 4;
+    gls::frame_vector<int> schedule(count + 1, 0);
+
+    // T_n = growthIterations * C(n, m) / C(count, m)
+    double T_n = growthIterations;
+    for (int i = 0; i < m; i++) {
+        T_n *= (double)(m - i) / (count - i);
+    }
+
+    int T_prime = 1;
+    schedule[m] = T_prime;
+    for (int n = m; n < count; n++) {
+        const double T_n1 = T_n * (n + 1) / (n + 1 - m);
+        T_prime += (int)std::ceil(T_n1 - T_n);
+        schedule[n + 1] = T_prime;
+        T_n = T_n1;
+    }
+    return schedule;
+}
+
+// Parallel RANSAC: hypotheses are evaluated in batches on the shared TaskScheduler, each batch with its own RNG seeded
+// from the batch index. Samples follow the PROSAC ordering, so matchpoints are expected to be sorted by decreasing
+// quality, as returned by SURF::findMatches. Batches stop once the adaptive bound of the best hypothesis is reached.
+// A prior is the initial best hypothesis, it sets the adaptive bound before the first batch.
+static gls::Matrix<3, 3> ParallelRansac(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
+                                        int max_iterations, const gls::Matrix<3, 3>* prior, std::vector<int>* inlier_indices) {
+    assert(matchpoints.size() > 0);
+    gls::TraceInterval interval("RANSAC");
+
+    const int pCount = (int)matchpoints.size();
+    if (pCount < 4) {
+        LOG_INFO(TAG) << "FindHomography: not enough matches: " << pCount << std::endl;
+        return prior ? *prior : gls::Matrix<3, 3>::identity();
+    }
+
+    const RansacPoints points(matchpoints);
+    const auto schedule = prosacSchedule(pCount, /*growthIterations=*/ max_iterations / 2);
+
+    static const int batchSize = 32;
+
+    std::atomic<int> iterationLimit = max_iterations;
+    std::atomic<int> max_innerP = 0;
+    std::mutex bestMutex;
+    int bestHypothesis = max_iterations;
+    auto homography = gls::Matrix<3, 3>::identity();
+
+    if (prior) {
+        // The prior wins the ties with the sampled hypotheses
+        homography = *prior;
+        bestHypothesis = -1;
+        max_innerP = countInliers(points, *prior, threshold);
+        iterationLimit = adaptiveIterations(max_innerP, pCount, max_iterations);
+        LOG_INFO(TAG) << "RANSAC prior inliers: " << max_innerP << ", iterations: " << (int) iterationLimit << std::endl;
+    }
+
+    gls::parallel_for(0, max_iterations, batchSize, [&](int i0, int i1) {
+        if (i0 >= iterationLimit) {
+            return;
+        }
+
+        std::minstd_rand rng(0x5eed + i0);
+        std::array<Point2f, 4> selectP1;
+        std::array<Point2f, 4> selectP2;
+
+        for (int t = i0; t < i1 && t < iterationLimit; t++) {
+            // PROSAC sample: the n-th match with three others of the top n, or four of all the matches
+            const int n = (int)(std::lower_bound(schedule.begin() + 4, schedule.end(), t + 1) - schedule.begin());
+            std::array<int, 4> selectIndex;
+            int selected = 0;
+            if (n < pCount) {
+                selectIndex[selected++] = n - 1;
+            }
+            const int range = std::min(n, pCount) - (n < pCount ? 1 : 0);
+            while (selected < 4) {
+                const int index = (int)(rng() % range);
+                if (std::find(selectIndex.begin(), selectIndex.begin() + selected, index) ==
+                    selectIndex.begin() + selected) {
+                    selectIndex[selected++] = index;
+                }
+            }
+
+            for (int i = 0; i < 4; i++) {
+                const auto& p = matchpoints[selectIndex[i]];
+                selectP1[i] = p.first;
+                selectP2[i] = p.second;
+            }
+
+            gls::Matrix<3, 3> hypothesis;
+            try {
+                hypothesis = FindHomography4(selectP1, selectP2);
+            } catch (const std::range_error& e) {
+                continue;
+            }
+
+            const int innerP = countInliers(points, hypothesis, threshold);
+            if (innerP < max_innerP) {
+                continue;
+            }
+
+            // Ties go to the earliest hypothesis, independently of the scheduling
+            std::lock_guard<std::mutex> guard(bestMutex);
+            if (innerP > max_innerP || (innerP == max_innerP && t < bestHypothesis)) {
+                max_innerP = innerP;
+                bestHypothesis = t;
+                homography = hypothesis;
+
+                const int iters = adaptiveIterations(innerP, pCount, max_iterations);
+                if (iters < iterationLimit) {
+                    iterationLimit = iters;
+                    LOG_INFO(TAG) << "Updated iters to " << iters << std::endl;
+                }
+            }
+        }
+    });
+
+    LOG_INFO(TAG) << " RANSAC interior point ratio - number of loops: " << max_innerP << ", " << pCount << ", "
+                  << (int) iterationLimit << std::endl;
+
+    gls::frame_vector<int> innerPvInd;
+    innerPvInd.reserve(pCount);
+    for (int i = 0; i < pCount; i++) {
+        const auto& p = matchpoints[i];
+        const auto p1t = applyHomography(p.first, homography);
+        const auto diff = gls::Vector<2>(p1t - p.second);
+        if (dot(diff, diff) < threshold) {
+            innerPvInd.push_back(i);
+        }
+    }
+
+    if (!innerPvInd.empty()) {
+        // Copy out the inliers
+        if (inlier_indices) {
+            LOG_INFO(TAG) << "RANSAC found " << innerPvInd.size() << " inliers" << std::endl;
+            inlier_indices->assign(innerPvInd.begin(), innerPvInd.end());
+        }
+
+        // Refine the best homography with the least mean square result from the inliers
+        if (innerPvInd.size() >= 4) {
+            gls::frame_vector<Point2f> _p1(innerPvInd.size()), _p2(innerPvInd.size());
+            for (int i = 0; i < innerPvInd.size(); i++) {
+                const auto& p = matchpoints[innerPvInd[i]];
+                _p1[i] = p.first;
+                _p2[i] = p.second;
+            }
+            try {
+                homography = FindLeastSquaresHomography(_p1, _p2);
+            } catch (const std::range_error& e) {
+                LOG_INFO(TAG) << "Couldn't find homography: " << e.what() << std::endl;
+            }
+        }
+    }
+    return homography;
+}
+
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
+                                 int max_iterations, std::vector<int>* inlier_indices) {
+    return ParallelRansac(matchpoints, threshold, max_iterations, /*prior=*/ nullptr, inlier_indices);
+}
+
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
+                                 int max_iterations, const gls::Matrix<3, 3>& prior, std::vector<int>* inlier_indices) {
+    return ParallelRansac(matchpoints, threshold, max_iterations, &prior, inlier_indices);
+}
+
+#elif USE_RTL
 
 class HomographyEstimator : public RTL::Estimator<
                                 /*MODEL=*/gls::Matrix<3, 3>,
@@ -44,8 +281,8 @@ class HomographyEstimator : public RTL::Estimator<
                                            const std::set<int>& samples) {
         assert(samples.size() == 4);
 
-        std::vector<Point2f> selectP1(4);
-        std::vector<Point2f> selectP2(4);
+        std::array<Point2f, 4> selectP1;
+        std::array<Point2f, 4> selectP2;
         int i = 0;
         for (auto itr = samples.begin(); itr != samples.end(); itr++, i++) {
             const auto& p = data[*itr];
@@ -54,7 +291,7 @@ class HomographyEstimator : public RTL::Estimator<
         }
 
         try {
-            return FindLeastSquaresHomography(selectP1, selectP2);
+            return FindHomography4(selectP1, selectP2);
         } catch (const std::range_error& e) {
             LOG_ERROR(TAG) << "HomographyEstimator: " << e.what() << std::endl;
             return gls::Matrix<3, 3>::identity();
@@ -69,8 +306,9 @@ class HomographyEstimator : public RTL::Estimator<
     }
 };
 
-gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>> matchpoints, float threshold,
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
                                  int max_iterations, std::vector<int>* inlier_indices) {
+    gls::TraceInterval interval("RANSAC");
     HomographyEstimator estimator;
 #if USE_MLESAC
     RTL::MLESAC<gls::Matrix<3, 3>, std::pair<Point2f, Point2f>, std::vector<std::pair<Point2f, Point2f>>> ransac(
@@ -79,15 +317,17 @@ gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>>
     RTL::RANSAC<gls::Matrix<3, 3>, std::pair<Point2f, Point2f>, std::vector<std::pair<Point2f, Point2f>>> ransac(
         &estimator);
 #endif
+    // RTL takes its data as a vector
+    const std::vector<std::pair<Point2f, Point2f>> data(matchpoints.begin(), matchpoints.end());
     gls::Matrix<3, 3> model;
     ransac.SetParamThreshold(threshold);
     ransac.SetParamIteration(max_iterations);
-    const auto ransac_loss = ransac.FindBest(model, matchpoints, (int)matchpoints.size(), 4);
+    const auto ransac_loss = ransac.FindBest(model, data, (int)data.size(), 4);
 
     LOG_INFO(TAG) << "RTL RANSAC loss: " << ransac_loss << std::endl;
 
     // Refine RANSAC projection matrix parameters using the best interior points
-    const auto inliers = ransac.FindInliers(model, matchpoints, (int)matchpoints.size());
+    const auto inliers = ransac.FindInliers(model, data, (int)data.size());
     LOG_INFO(TAG) << "RANSAC found " << inliers.size() << " inliers" << std::endl;
 
     if (!inliers.empty()) {
@@ -117,9 +357,10 @@ gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>>
 
 #else
 
-gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>> matchpoints, float threshold,
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
                                  int max_iterations, std::vector<int>* inlier_indices) {
     assert(matchpoints.size() > 0);
+    gls::TraceInterval interval("RANSAC");
 
     // Calculate the maximum set of interior points
     int iters = max_iterations;
@@ -153,8 +394,8 @@ gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>>
     // Compute the hompgraphy
     int k = 0;
     for (; k < iters; k++) {
-        std::vector<Point2f> selectP1(4);
-        std::vector<Point2f> selectP2(4);
+        std::array<Point2f, 4> selectP1;
+        std::array<Point2f, 4> selectP2;
 
         for (int i = 0; i < 4; i++) {
             const auto& p = matchpoints[selectIndex[k][i]];
@@ -164,7 +405,7 @@ gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>>
 
         // Find the best homography with RANSAC
         try {
-            homography = FindLeastSquaresHomography(selectP1, selectP2);
+            homography = FindHomography4(selectP1, selectP2);
 
             // Calculate the model parameter error, if the error is greater than the threshold, discard
             // this set of model parameters
@@ -240,4 +481,101 @@ gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>>
 
 #endif
 
+#if !USE_PARALLEL_RANSAC
+// The RTL and serial estimators can't be seeded, the prior only helps through the windowed matching
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
+                                 int max_iterations, const gls::Matrix<3, 3>& prior, std::vector<int>* inlier_indices) {
+    return FindHomography(matchpoints, threshold, max_iterations, inlier_indices);
+}
+#endif
+
+MeshHomography FindMeshHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints,
+                                  std::span<const int> inlier_indices, const gls::Matrix<3, 3>& homography,
+                                  const gls::size& imageSize, int columns, int rows) {
+    gls::TraceInterval interval("MeshHomography");
+
+    // The matches of a cell need to pin down its eight degrees of freedom well beyond the minimal sample
+    const int kMinCellMatches = 16;
+    // A local fit moving a cell corner further than this fraction of the cell from the global homography is wrong
+    const float kMaxCornerDeviation = 0.25;
+    // Smoothing weights of each of the four neighbours and of the global homography, a cell with kMinCellMatches
+    // matches has a weight of one
+    const float kNeighbourWeight = 0.5;
+    const float kGlobalWeight = 0.25;
+    const int kSmoothingIterations = 4;
+
+    const auto normalized = [](const gls::Matrix<3, 3>& h) { return h / h[2][2]; };
+
+    const auto global = normalized(homography);
+    MeshHomography mesh = { columns, rows, imageSize, std::vector(columns * rows, global) };
+    const float cellWidth = imageSize.width / (float) columns;
+    const float cellHeight = imageSize.height / (float) rows;
+    const float maxDeviation = kMaxCornerDeviation * std::max(cellWidth, cellHeight);
+
+    std::vector<float> confidence(columns * rows, 0);
+    std::vector<Point2f> p1, p2;
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < columns; column++) {
+            const float x0 = (column - 0.5f) * cellWidth, x1 = (column + 1.5f) * cellWidth;
+            const float y0 = (row - 0.5f) * cellHeight, y1 = (row + 1.5f) * cellHeight;
+
+            p1.clear();
+            p2.clear();
+            for (const int index : inlier_indices) {
+                const auto& p = matchpoints[index];
+                if (p.first.x >= x0 && p.first.x < x1 && p.first.y >= y0 && p.first.y < y1) {
+                    p1.push_back(p.first);
+                    p2.push_back(p.second);
+                }
+            }
+            if ((int) p1.size() < kMinCellMatches) {
+                continue;
+            }
+
+            try {
+                const auto fit = normalized(FindLeastSquaresHomography(p1, p2));
+
+                bool plausible = true;
+                for (const auto& corner : { Point2f(column * cellWidth, row * cellHeight),
+                                            Point2f((column + 1) * cellWidth, row * cellHeight),
+                                            Point2f(column * cellWidth, (row + 1) * cellHeight),
+                                            Point2f((column + 1) * cellWidth, (row + 1) * cellHeight) }) {
+                    const auto diff = gls::Vector<2>(applyHomography(corner, fit) - applyHomography(corner, homography));
+                    plausible &= dot(diff, diff) < maxDeviation * maxDeviation;
+                }
+                if (plausible) {
+                    mesh.cells[row * columns + column] = fit;
+                    confidence[row * columns + column] = p1.size() / (float) kMinCellMatches;
+                }
+            } catch (const std::range_error& e) {
+                LOG_INFO(TAG) << "FindMeshHomography: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    // Jacobi iterations of the smoothing, the fits of the cells anchor them and the global homography fills in the
+    // cells without a fit of their own
+    const auto fits = mesh.cells;
+    std::vector<gls::Matrix<3, 3>> smoothed(mesh.cells.size());
+    for (int iteration = 0; iteration < kSmoothingIterations; iteration++) {
+        for (int row = 0; row < rows; row++) {
+            for (int column = 0; column < columns; column++) {
+                const int c = row * columns + column;
+                auto sum = fits[c] * confidence[c] + global * kGlobalWeight;
+                float weight = confidence[c] + kGlobalWeight;
+                for (const auto& [dx, dy] : { std::pair(-1, 0), std::pair(1, 0), std::pair(0, -1), std::pair(0, 1) }) {
+                    const int x = column + dx, y = row + dy;
+                    if (x >= 0 && x < columns && y >= 0 && y < rows) {
+                        sum = sum + mesh.cells[y * columns + x] * kNeighbourWeight;
+                        weight += kNeighbourWeight;
+                    }
+                }
+                smoothed[c] = normalized(sum / weight);
+            }
+        }
+        std::swap(mesh.cells, smoothed);
+    }
+    return mesh;
+}
+
 }  // namespace gls
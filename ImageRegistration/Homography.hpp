@@ -16,16 +16,46 @@
 #ifndef Homography_hpp
 #define Homography_hpp
 
+#include <span>
 #include <vector>
 
 #include "feature2d.hpp"
+#include "gls_geometry.hpp"
 #include "gls_linalg.hpp"
 
 namespace gls {
 
-gls::Matrix<3, 3> FindHomography(const std::vector<std::pair<Point2f, Point2f>> matchpoints, float threshold,
+// The matches are only read during the call, e.g. from a frame_vector
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
                                  int max_iterations, std::vector<int>* inlier_indices = nullptr);
 
+// RANSAC seeded with a predicted homography, e.g. from the gyro or the previous frame's motion: the prior is scored
+// first, when it already explains most matches the adaptive bound ends the search after a few dozen hypotheses
+gls::Matrix<3, 3> FindHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints, float threshold,
+                                 int max_iterations, const gls::Matrix<3, 3>& prior,
+                                 std::vector<int>* inlier_indices = nullptr);
+
+// Homographies of the cells of a columns x rows grid over the reference image, for the scenes with parallax a single
+// homography doesn't register. Each one maps the reference's coordinates to the frame's, the warp blends the ones of the
+// four nearest cell centers, see RegisterImageKernel.
+struct MeshHomography {
+    int columns = 0;
+    int rows = 0;
+    gls::size imageSize;
+    std::vector<gls::Matrix<3, 3>> cells;   // Row major
+
+    const gls::Matrix<3, 3>& cell(int column, int row) const {
+        return cells[row * columns + column];
+    }
+};
+
+// Refines the global homography of FindHomography with the inliers it found: each cell is fitted to the matches over it
+// and half of its neighbours, the cells with too few matches or an implausible fit keep the global homography, then
+// the cells are smoothed with their neighbours. Only a few small least squares fits on top of the RANSAC.
+MeshHomography FindMeshHomography(std::span<const std::pair<Point2f, Point2f>> matchpoints,
+                                  std::span<const int> inlier_indices, const gls::Matrix<3, 3>& homography,
+                                  const gls::size& imageSize, int columns = 8, int rows = 6);
+
 gls::Matrix<3, 3> ScaleHomography(const gls::Matrix<3, 3>& homography, float scale) {
     const auto scaleMatrix = gls::Matrix<3, 3> {
         {2, 0, 0},
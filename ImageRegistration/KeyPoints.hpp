@@ -0,0 +1,216 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KeyPoints_hpp
+#define KeyPoints_hpp
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+#include "feature2d.hpp"
+#include "gls_frame_arena.hpp"
+#include "gls_mtl_image.hpp"
+
+// Structure of arrays keypoints in shared Metal buffers, one array per KeyPoint field. The GPU stages bind the arrays
+// they need and update them in place: the detector's selection writes all of them, the descriptors read the position
+// and the size and write the orientation. The CPU sorts, filters and indexes the same memory, no KeyPoint vectors
+// are built between the stages. The descriptors computed for the keypoints are held in the same way, the matchers
+// read them from their buffer.
+class KeyPoints {
+    size_t _count = 0;
+    std::unique_ptr<gls::Buffer<float>> _descriptors;
+    int _descriptorSize = 0;
+
+   public:
+    const gls::Buffer<float> x;
+    const gls::Buffer<float> y;
+    const gls::Buffer<float> sizes;
+    const gls::Buffer<float> angles;
+    const gls::Buffer<float> responses;
+    const gls::Buffer<int> octaves;
+    const gls::Buffer<int> classIds;
+
+    // Metal doesn't allocate zero length buffers
+    KeyPoints(MTL::Device* device, size_t capacity) :
+        x(device, std::max(capacity, (size_t) 1)),
+        y(device, std::max(capacity, (size_t) 1)),
+        sizes(device, std::max(capacity, (size_t) 1)),
+        angles(device, std::max(capacity, (size_t) 1)),
+        responses(device, std::max(capacity, (size_t) 1)),
+        octaves(device, std::max(capacity, (size_t) 1)),
+        classIds(device, std::max(capacity, (size_t) 1)) { }
+
+    KeyPoints(MTL::Device* device, const std::vector<KeyPoint>& keypoints) : KeyPoints(device, keypoints.size()) {
+        for (const auto& kp : keypoints) {
+            push_back(kp);
+        }
+    }
+
+    size_t size() const {
+        return _count;
+    }
+
+    bool empty() const {
+        return _count == 0;
+    }
+
+    size_t capacity() const {
+        return x.size();
+    }
+
+    // E.g. to the count written by a GPU stage
+    void resize(size_t count) {
+        assert(count <= capacity());
+        _count = count;
+    }
+
+    void clear() {
+        _count = 0;
+    }
+
+    // Keeps the first count keypoints
+    void truncate(size_t count) {
+        _count = std::min(_count, count);
+    }
+
+    // Room for descriptorSize floats per keypoint, the existing descriptors are discarded. The descriptors are computed
+    // once the keypoints are final, permute and filter don't move them.
+    void allocateDescriptors(MTL::Device* device, int descriptorSize) {
+        if (!_descriptors || _descriptors->size() < capacity() * descriptorSize) {
+            _descriptors = std::make_unique<gls::Buffer<float>>(device, capacity() * descriptorSize);
+        }
+        _descriptorSize = descriptorSize;
+    }
+
+    bool hasDescriptors() const {
+        return _descriptors != nullptr;
+    }
+
+    int descriptorSize() const {
+        return _descriptorSize;
+    }
+
+    const gls::Buffer<float>& descriptors() const {
+        assert(_descriptors);
+        return *_descriptors;
+    }
+
+    float* descriptor(size_t i) const {
+        return descriptors().data() + _descriptorSize * i;
+    }
+
+    // The descriptors as an image with a row per keypoint, without a copy: the view is valid as long as the
+    // KeyPoints and its descriptors are
+    gls::image<float>::unique_ptr descriptorImage() const {
+        return std::make_unique<gls::image<float>>(_descriptorSize, (int) _count, _descriptorSize,
+                                                   std::span<float>(descriptors().data(), _descriptorSize * _count));
+    }
+
+    Point2f point(size_t i) const {
+        return Point2f(x.data()[i], y.data()[i]);
+    }
+
+    KeyPoint operator[](size_t i) const {
+        return KeyPoint(point(i), sizes.data()[i], angles.data()[i], responses.data()[i], octaves.data()[i],
+                        classIds.data()[i]);
+    }
+
+    void set(size_t i, const KeyPoint& kp) {
+        x.data()[i] = kp.pt.x;
+        y.data()[i] = kp.pt.y;
+        sizes.data()[i] = kp.size;
+        angles.data()[i] = kp.angle;
+        responses.data()[i] = kp.response;
+        octaves.data()[i] = kp.octave;
+        classIds.data()[i] = kp.class_id;
+    }
+
+    void push_back(const KeyPoint& kp) {
+        assert(_count < capacity());
+        set(_count++, kp);
+    }
+
+    void append(std::vector<KeyPoint>* keypoints) const {
+        keypoints->reserve(keypoints->size() + _count);
+        for (size_t i = 0; i < _count; i++) {
+            keypoints->push_back((*this)[i]);
+        }
+    }
+
+    void translate(const Point2f& offset) {
+        for (size_t i = 0; i < _count; i++) {
+            x.data()[i] += offset.x;
+            y.data()[i] += offset.y;
+        }
+    }
+
+    // The ordering of the keypoints by decreasing strength, as KeypointGreater of the KeyPoint vectors
+    bool greater(size_t i, size_t j) const {
+        if (responses.data()[i] != responses.data()[j]) return responses.data()[i] > responses.data()[j];
+        if (sizes.data()[i] != sizes.data()[j]) return sizes.data()[i] > sizes.data()[j];
+        if (octaves.data()[i] != octaves.data()[j]) return octaves.data()[i] > octaves.data()[j];
+        if (y.data()[i] != y.data()[j]) return y.data()[i] > y.data()[j];
+        return x.data()[i] < x.data()[j];
+    }
+
+    // Moves keypoint order[i] to position i
+    void permute(const gls::frame_vector<uint32_t>& order) {
+        assert(order.size() == _count);
+        const auto gather = [&](auto* values) {
+            using value_type = std::remove_pointer_t<decltype(values)>;
+            gls::frame_vector<value_type> permuted(_count);
+            for (size_t i = 0; i < _count; i++) {
+                permuted[i] = values[order[i]];
+            }
+            std::copy(permuted.begin(), permuted.end(), values);
+        };
+        gather(x.data());
+        gather(y.data());
+        gather(sizes.data());
+        gather(angles.data());
+        gather(responses.data());
+        gather(octaves.data());
+        gather(classIds.data());
+    }
+
+    void sortByResponse() {
+        gls::frame_vector<uint32_t> order(_count);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](uint32_t i, uint32_t j) { return greater(i, j); });
+        permute(order);
+    }
+
+    // Compacts the keypoints i for which keep(*this, i) holds, preserving their order
+    template <typename Predicate>
+    void filter(Predicate keep) {
+        size_t out = 0;
+        for (size_t i = 0; i < _count; i++) {
+            if (keep(*this, i)) {
+                if (out != i) {
+                    set(out, (*this)[i]);
+                }
+                out++;
+            }
+        }
+        _count = out;
+    }
+};
+
+#endif /* KeyPoints_hpp */
@@ -0,0 +1,317 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KeypointCache_hpp
+#define KeypointCache_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "SURF.hpp"
+#include "TaskScheduler.hpp"
+
+namespace gls {
+
+// Cache of the keypoints and descriptors computed by SURF::detectAndCompute, keyed by a hash of the image content
+// and the detector's parameters, for the reference frames aligned against many frames and the reprocessing runs of
+// the tuning loops. The entries are kept in memory, least recently used first out, and optionally in a directory
+// with one file per entry, so that later runs skip the detection altogether.
+//
+// File layout, native endian: "GLKP", version, the key (image hash, width, height, max_features, nOctaves,
+// nOctaveLayers, hessianThreshold, descriptorType, halfPrecisionScaleSpace), keypoint count, the keypoints (x, y, size, angle, response,
+// octave, class_id), then the descriptors' width and height and their values.
+class KeypointCache {
+public:
+    struct Key {
+        uint64_t imageHash = 0;
+        int width = 0;
+        int height = 0;
+        SURF::Parameters parameters;
+
+        bool operator==(const Key& other) const = default;
+    };
+
+private:
+    static constexpr uint32_t kMagic = 'G' | 'L' << 8 | 'K' << 16 | 'P' << 24;
+    static constexpr uint32_t kVersion = 2;
+    // Sanity limit for the keypoint count of a file
+    static constexpr uint32_t kMaxKeypoints = 1 << 20;
+
+    struct Entry {
+        Key key;
+        std::vector<KeyPoint> keypoints;
+        int descriptorWidth = 0;
+        int descriptorHeight = 0;
+        std::vector<float> descriptors;
+    };
+
+    const std::filesystem::path _directory;
+    const size_t _capacity;
+    std::list<Entry> _entries;
+    mutable std::mutex _mutex;
+
+    static uint64_t mix(uint64_t h, uint64_t v) {
+        // FNV-1a on 64 bit words with a final avalanche, plenty to tell images apart
+        h = (h ^ v) * 0x100000001b3ull;
+        return h ^ (h >> 29);
+    }
+
+    static uint64_t hashKey(const Key& key) {
+        uint32_t threshold;
+        std::memcpy(&threshold, &key.parameters.hessianThreshold, sizeof(threshold));
+        uint64_t h = mix(0xcbf29ce484222325ull, key.imageHash);
+        for (uint64_t v : { (uint64_t) key.width, (uint64_t) key.height, (uint64_t) key.parameters.max_features,
+                            (uint64_t) key.parameters.nOctaves, (uint64_t) key.parameters.nOctaveLayers, (uint64_t) threshold,
+                            (uint64_t) key.parameters.descriptorType, (uint64_t) key.parameters.halfPrecisionScaleSpace }) {
+            h = mix(h, v);
+        }
+        return h;
+    }
+
+    std::filesystem::path entryPath(const Key& key) const {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << hashKey(key) << ".kpc";
+        return _directory / name.str();
+    }
+
+    template <typename T>
+    static bool read(std::istream& is, T* value) {
+        return (bool) is.read(reinterpret_cast<char*>(value), sizeof(T));
+    }
+
+    template <typename T>
+    static void write(std::ostream& os, const T& value) {
+        os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void writeKey(std::ostream& os, const Key& key) {
+        write(os, key.imageHash);
+        write(os, key.width);
+        write(os, key.height);
+        write(os, key.parameters.max_features);
+        write(os, key.parameters.nOctaves);
+        write(os, key.parameters.nOctaveLayers);
+        write(os, key.parameters.hessianThreshold);
+        write(os, (int) key.parameters.descriptorType);
+        write(os, (int) key.parameters.halfPrecisionScaleSpace);
+    }
+
+    static bool readKey(std::istream& is, Key* key) {
+        int descriptorType, halfPrecisionScaleSpace;
+        if (!read(is, &key->imageHash) || !read(is, &key->width) || !read(is, &key->height) ||
+            !read(is, &key->parameters.max_features) || !read(is, &key->parameters.nOctaves) ||
+            !read(is, &key->parameters.nOctaveLayers) || !read(is, &key->parameters.hessianThreshold) ||
+            !read(is, &descriptorType) || !read(is, &halfPrecisionScaleSpace)) {
+            return false;
+        }
+        key->parameters.descriptorType = (SURF::DescriptorType) descriptorType;
+        key->parameters.halfPrecisionScaleSpace = halfPrecisionScaleSpace != 0;
+        return true;
+    }
+
+    // A missing, stale or corrupted file is just a miss
+    bool load(const Key& key, Entry* entry) const {
+        std::ifstream is(entryPath(key), std::ios::binary);
+        if (!is) {
+            return false;
+        }
+        uint32_t magic, version, count;
+        Key fileKey;
+        if (!read(is, &magic) || magic != kMagic || !read(is, &version) || version != kVersion ||
+            !readKey(is, &fileKey) || !(fileKey == key) || !read(is, &count) || count > kMaxKeypoints) {
+            return false;
+        }
+        entry->key = key;
+        entry->keypoints.resize(count);
+        for (auto& kp : entry->keypoints) {
+            if (!read(is, &kp.pt.x) || !read(is, &kp.pt.y) || !read(is, &kp.size) || !read(is, &kp.angle) ||
+                !read(is, &kp.response) || !read(is, &kp.octave) || !read(is, &kp.class_id)) {
+                return false;
+            }
+        }
+        if (!read(is, &entry->descriptorWidth) || !read(is, &entry->descriptorHeight) ||
+            entry->descriptorWidth < 0 || entry->descriptorWidth > 64 || entry->descriptorHeight != (int) count) {
+            return false;
+        }
+        entry->descriptors.resize((size_t) entry->descriptorWidth * entry->descriptorHeight);
+        return (bool) is.read(reinterpret_cast<char*>(entry->descriptors.data()), entry->descriptors.size() * sizeof(float));
+    }
+
+    // Written to a temporary file replacing the previous one, an interrupted save never leaves a corrupted entry
+    void save(const Entry& entry) const {
+        const auto path = entryPath(entry.key);
+        auto tmpPath = path;
+        tmpPath += ".tmp";
+        {
+            std::ofstream os(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!os) {
+                throw std::runtime_error("KeypointCache: can't write " + tmpPath.string());
+            }
+            write(os, kMagic);
+            write(os, kVersion);
+            writeKey(os, entry.key);
+            write(os, (uint32_t) entry.keypoints.size());
+            for (const auto& kp : entry.keypoints) {
+                write(os, kp.pt.x);
+                write(os, kp.pt.y);
+                write(os, kp.size);
+                write(os, kp.angle);
+                write(os, kp.response);
+                write(os, kp.octave);
+                write(os, kp.class_id);
+            }
+            write(os, entry.descriptorWidth);
+            write(os, entry.descriptorHeight);
+            os.write(reinterpret_cast<const char*>(entry.descriptors.data()), entry.descriptors.size() * sizeof(float));
+            if (!os) {
+                throw std::runtime_error("KeypointCache: failed writing " + tmpPath.string());
+            }
+        }
+        std::filesystem::rename(tmpPath, path);
+    }
+
+    // Moves the entry to the front of the LRU list
+    const Entry* find(const Key& key) {
+        for (auto it = _entries.begin(); it != _entries.end(); it++) {
+            if (it->key == key) {
+                _entries.splice(_entries.begin(), _entries, it);
+                return &_entries.front();
+            }
+        }
+        return nullptr;
+    }
+
+    void insert(Entry&& entry) {
+        _entries.push_front(std::move(entry));
+        while (_entries.size() > _capacity) {
+            _entries.pop_back();
+        }
+    }
+
+    static void copyOut(const Entry& entry, std::vector<KeyPoint>* keypoints, gls::image<float>::unique_ptr* descriptors) {
+        *keypoints = entry.keypoints;
+        *descriptors = std::make_unique<gls::image<float>>(entry.descriptorWidth, entry.descriptorHeight);
+        for (int y = 0; y < entry.descriptorHeight; y++) {
+            std::copy_n(&entry.descriptors[(size_t) y * entry.descriptorWidth], entry.descriptorWidth, &(**descriptors)[y][0]);
+        }
+    }
+
+public:
+    // Without a directory the cache lives in memory only
+    KeypointCache(size_t capacity = 16, const std::filesystem::path& directory = {}) :
+        _directory(directory), _capacity(std::max(capacity, (size_t) 1)) {
+        if (!_directory.empty()) {
+            std::filesystem::create_directories(_directory);
+        }
+    }
+
+    KeypointCache(const KeypointCache&) = delete;
+    KeypointCache& operator=(const KeypointCache&) = delete;
+
+    // Rows are hashed in parallel and combined in order, the hash doesn't depend on the thread count
+    static uint64_t hashImage(const gls::image<float>& image) {
+        std::vector<uint64_t> rowHashes(image.height);
+        gls::parallel_for(0, image.height, /*grain=*/ 64, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                const float* row = &image[y][0];
+                uint64_t h = 0xcbf29ce484222325ull;
+                int x = 0;
+                for (; x + 1 < image.width; x += 2) {
+                    uint64_t v;
+                    std::memcpy(&v, row + x, sizeof(v));
+                    h = mix(h, v);
+                }
+                if (x < image.width) {
+                    uint32_t v;
+                    std::memcpy(&v, row + x, sizeof(v));
+                    h = mix(h, v);
+                }
+                rowHashes[y] = h;
+            }
+        });
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (const auto rowHash : rowHashes) {
+            h = mix(h, rowHash);
+        }
+        return h;
+    }
+
+    static Key makeKey(const SURF& surf, const gls::image<float>& image) {
+        return { hashImage(image), image.width, image.height, surf.parameters() };
+    }
+
+    // Looks in memory, then on disk
+    bool lookup(const Key& key, std::vector<KeyPoint>* keypoints, gls::image<float>::unique_ptr* descriptors) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (const auto entry = find(key)) {
+            copyOut(*entry, keypoints, descriptors);
+            return true;
+        }
+        Entry entry;
+        if (!_directory.empty() && load(key, &entry)) {
+            copyOut(entry, keypoints, descriptors);
+            insert(std::move(entry));
+            return true;
+        }
+        return false;
+    }
+
+    void insert(const Key& key, const std::vector<KeyPoint>& keypoints, const gls::image<float>& descriptors) {
+        Entry entry = { key, keypoints, descriptors.width, descriptors.height, {} };
+        entry.descriptors.resize((size_t) descriptors.width * descriptors.height);
+        for (int y = 0; y < descriptors.height; y++) {
+            std::copy_n(&descriptors[y][0], descriptors.width, &entry.descriptors[(size_t) y * descriptors.width]);
+        }
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_directory.empty()) {
+            save(entry);
+        }
+        insert(std::move(entry));
+    }
+
+    // SURF::detectAndCompute through the cache, returns true on a hit
+    bool detectAndCompute(const SURF& surf, const gls::image<float>& image, std::vector<KeyPoint>* keypoints,
+                          gls::image<float>::unique_ptr* descriptors) {
+        const auto key = makeKey(surf, image);
+        if (lookup(key, keypoints, descriptors)) {
+            return true;
+        }
+        surf.detectAndCompute(image, keypoints, descriptors);
+        if (*descriptors) {
+            insert(key, *keypoints, **descriptors);
+        }
+        return false;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _entries.size();
+    }
+};
+
+}  // namespace gls
+
+#endif /* KeypointCache_hpp */
@@ -352,7 +352,7 @@ void Jacobi(const gls::Matrix<N, N, T>& A, gls::Vector<N, T>* W, gls::Matrix<N,
     }
 }
 
-gls::Matrix<3, 3> FindLeastSquaresHomography(const std::vector<Point2f>& M, const std::vector<Point2f>& m) {
+gls::Matrix<3, 3> FindLeastSquaresHomography(std::span<const Point2f> M, std::span<const Point2f> m) {
     const int count = (int)M.size();
 
     typedef gls::Vector<2, double> vec2;
@@ -422,4 +422,107 @@ gls::Matrix<3, 3> FindLeastSquaresHomography(const std::vector<Point2f>& M, cons
     return gls::Matrix<3, 3, float>(H) / (float)H[2][2];
 }
 
+// Solves A x = b in place with Gaussian elimination and partial pivoting, all on the stack.
+// Returns false for a singular system.
+template <size_t N, typename T>
+static bool SolveLinearSystem(gls::Matrix<N, N, T>& A, gls::Vector<N, T>& b) {
+    for (int k = 0; k < N; k++) {
+        int pivot = k;
+        for (int i = k + 1; i < N; i++) {
+            if (std::abs(A[i][k]) > std::abs(A[pivot][k])) {
+                pivot = i;
+            }
+        }
+        if (std::abs(A[pivot][k]) < 1e-10) {
+            return false;
+        }
+        if (pivot != k) {
+            for (int j = k; j < N; j++) {
+                std::swap(A[k][j], A[pivot][j]);
+            }
+            std::swap(b[k], b[pivot]);
+        }
+
+        for (int i = k + 1; i < N; i++) {
+            const T f = A[i][k] / A[k][k];
+            for (int j = k + 1; j < N; j++) {
+                A[i][j] -= f * A[k][j];
+            }
+            b[i] -= f * b[k];
+        }
+    }
+
+    for (int k = N - 1; k >= 0; k--) {
+        T sum = b[k];
+        for (int j = k + 1; j < N; j++) {
+            sum -= A[k][j] * b[j];
+        }
+        b[k] = sum / A[k][k];
+    }
+    return true;
+}
+
+// Same normalization as FindLeastSquaresHomography, with h22 = 1 the four correspondences give an 8x8 linear system
+gls::Matrix<3, 3> FindHomography4(const std::array<Point2f, 4>& M, const std::array<Point2f, 4>& m) {
+    typedef gls::Vector<2, double> vec2;
+
+    auto cM = vec2::zeros();
+    auto cm = vec2::zeros();
+    auto sM = vec2::zeros();
+    auto sm = vec2::zeros();
+
+    // Find the barycenter of the point set
+    for (int i = 0; i < 4; i++) {
+        cm += vec2(m[i]);
+        cM += vec2(M[i]);
+    }
+    cm /= 4.0;
+    cM /= 4.0;
+
+    // Find the mean distance from the barycenter
+    for (int i = 0; i < 4; i++) {
+        sm += abs(vec2(m[i]) - cm);
+        sM += abs(vec2(M[i]) - cM);
+    }
+    sm /= 4.0;
+    sM /= 4.0;
+
+    const auto eps = std::numeric_limits<double>::epsilon();
+    if (fabs(sm[0]) < eps || fabs(sm[1]) < eps || fabs(sM[0]) < eps || fabs(sM[1]) < eps) {
+        throw std::range_error("Can't generate homography from input points.");
+    }
+
+    gls::Matrix<8, 8, double> A;
+    gls::Vector<8, double> b;
+    for (int i = 0; i < 4; i++) {
+        // Scale and Normalize the point set coordinates
+        const auto p1 = (vec2(M[i]) - cM) / sM;
+        const auto p2 = (vec2(m[i]) - cm) / sm;
+
+        const std::array<double, 8> Lx = {p1[0], p1[1], 1, 0, 0, 0, -p2[0] * p1[0], -p2[0] * p1[1]};
+        const std::array<double, 8> Ly = {0, 0, 0, p1[0], p1[1], 1, -p2[1] * p1[0], -p2[1] * p1[1]};
+        for (int j = 0; j < 8; j++) {
+            A[2 * i][j] = Lx[j];
+            A[2 * i + 1][j] = Ly[j];
+        }
+        b[2 * i] = p2[0];
+        b[2 * i + 1] = p2[1];
+    }
+
+    if (!SolveLinearSystem(A, b)) {
+        throw std::range_error("Can't generate homography from input points.");
+    }
+
+    const gls::Matrix<3, 3, double> H0 = {b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], 1};
+
+    const gls::Matrix<3, 3, double> invHnorm = {sm[0], 0, cm[0], 0, sm[1], cm[1], 0, 0, 1};
+    const gls::Matrix<3, 3, double> Hnorm2 = {1 / sM[0], 0, -cM[0] / sM[0], 0, 1 / sM[1], -cM[1] / sM[1], 0, 0, 1};
+
+    // Invert the point set coordinates scaling
+    const auto H = invHnorm * H0 * Hnorm2;
+
+    // Convert to a float 3x3 Matrix and normalize
+    return gls::Matrix<3, 3, float>(H) / (float)H[2][2];
+}
+
 }  // namespace gls
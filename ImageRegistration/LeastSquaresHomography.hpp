@@ -16,6 +16,8 @@
 #ifndef LeastSquaresHomography_hpp
 #define LeastSquaresHomography_hpp
 
+#include <array>
+#include <span>
 #include <vector>
 
 #include "feature2d.hpp"
@@ -23,7 +25,10 @@
 
 namespace gls {
 
-Matrix<3, 3> FindLeastSquaresHomography(const std::vector<Point2f>& points1, const std::vector<Point2f>& points2);
+Matrix<3, 3> FindLeastSquaresHomography(std::span<const Point2f> points1, std::span<const Point2f> points2);
+
+// Exact homography of a minimal four points sample, allocation free for the RANSAC inner loop
+Matrix<3, 3> FindHomography4(const std::array<Point2f, 4>& points1, const std::array<Point2f, 4>& points2);
 
 gls::Matrix<3, 3> getPerspectiveTransformLSM2(const std::vector<Point2f>& src, const std::vector<Point2f>& dst);
 
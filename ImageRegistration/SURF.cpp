@@ -15,13 +15,25 @@
 
 #include <float.h>
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <mutex>
+#include <random>
 #include <simd/simd.h>
+#include <type_traits>
+
+#if __aarch64__
+#include <arm_neon.h>
+#elif __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "SURF.hpp"
-#include "ThreadPool.hpp"
+#include "TaskScheduler.hpp"
 #include "feature2d.hpp"
 #include "gls_mtl_image.hpp"
 #include "gls_logging.h"
@@ -32,6 +44,11 @@ static const char* TAG = "DEMOSAIC";
 // The integral pyramid seems to actually degrade performance
 #define USE_INTEGRAL_PYRAMID false
 #define USE_GPU_KEYPOINT_MATCH true
+// Keep only the matches passing the ratio test and the cross-check, with the tiled matcher
+#define USE_RATIO_TEST_MATCH true
+// Encode the integral, determinant/trace and maxima passes of a tile in one command buffer with a single sync
+#define USE_BATCHED_DETECTION true
+#define USE_GPU_DESCRIPTORS true
 
 namespace gls {
 
@@ -48,23 +65,147 @@ static const int SURF_HAAR_SIZE0 = 9;
 // above and below are aligned correctly.
 static const int SURF_HAAR_SIZE_INC = 6;
 
+// Vectors of consecutive samples of a row for the CPU detector: NEON on Apple silicon, AVX2 on the x86 hosts
+// running the registration without Metal, scalar otherwise
+#if __aarch64__
+#define SURF_CPU_VECTORS true
+typedef float32x4_t SurfVector;
+static constexpr int kSurfLanes = 4;
+
+static inline SurfVector surfZero() {
+    return vdupq_n_f32(0);
+}
+
+static inline SurfVector surfLoad(const float* p) {
+    return vld1q_f32(p);
+}
+
+// The samples at p[0], p[stride], p[2 * stride]...
+static inline SurfVector surfLoad(const float* p, int stride) {
+    if (stride == 1) {
+        return vld1q_f32(p);
+    }
+    const float v[kSurfLanes] = {p[0], p[stride], p[2 * stride], p[3 * stride]};
+    return vld1q_f32(v);
+}
+
+static inline void surfStore(float* p, SurfVector v) {
+    vst1q_f32(p, v);
+}
+
+static inline SurfVector surfAdd(SurfVector a, SurfVector b) {
+    return vaddq_f32(a, b);
+}
+
+static inline SurfVector surfSub(SurfVector a, SurfVector b) {
+    return vsubq_f32(a, b);
+}
+
+static inline SurfVector surfMul(SurfVector a, SurfVector b) {
+    return vmulq_f32(a, b);
+}
+
+// a + b * w
+static inline SurfVector surfMulAdd(SurfVector a, SurfVector b, float w) {
+    return vmlaq_n_f32(a, b, w);
+}
+
+static inline SurfVector surfSplat(float v) {
+    return vdupq_n_f32(v);
+}
+#elif __AVX2__
+#define SURF_CPU_VECTORS true
+typedef __m256 SurfVector;
+static constexpr int kSurfLanes = 8;
+
+static inline SurfVector surfZero() {
+    return _mm256_setzero_ps();
+}
+
+static inline SurfVector surfLoad(const float* p) {
+    return _mm256_loadu_ps(p);
+}
+
+static inline SurfVector surfLoad(const float* p, int stride) {
+    if (stride == 1) {
+        return _mm256_loadu_ps(p);
+    }
+    const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    return _mm256_i32gather_ps(p, offsets, sizeof(float));
+}
+
+static inline void surfStore(float* p, SurfVector v) {
+    _mm256_storeu_ps(p, v);
+}
+
+static inline SurfVector surfAdd(SurfVector a, SurfVector b) {
+    return _mm256_add_ps(a, b);
+}
+
+static inline SurfVector surfSub(SurfVector a, SurfVector b) {
+    return _mm256_sub_ps(a, b);
+}
+
+static inline SurfVector surfMul(SurfVector a, SurfVector b) {
+    return _mm256_mul_ps(a, b);
+}
+
+static inline SurfVector surfMulAdd(SurfVector a, SurfVector b, float w) {
+    return _mm256_add_ps(a, _mm256_mul_ps(b, _mm256_set1_ps(w)));
+}
+
+static inline SurfVector surfSplat(float v) {
+    return _mm256_set1_ps(v);
+}
+#else
+#define SURF_CPU_VECTORS false
+#endif
+
+// Rows of the CPU integral and determinant passes per TaskScheduler task
+static const int kSurfRowGrain = 16;
+
 template <typename T>
 void integral(const gls::image<float>& img, gls::image<T>* sum) {
     // Zero the first row and the first column of the sum
     for (int i = 0; i < sum->width; i++) {
         (*sum)[0][i] = 0;
     }
-    for (int j = 1; j < sum->height; j++) {
-        (*sum)[j][0] = 0;
-    }
 
-    for (int j = 1; j < sum->height; j++) {
-        for (int i = 1; i < sum->width; i++) {
-            // Use Signed Offset Pixel Representation to improve Integral Image precision
-            // See: Hensley et al.: "Fast Summed-Area Table Generation and its Applications".
-            (*sum)[j][i] = (img[j - 1][i - 1] - 0.5) + (*sum)[j][i - 1] + (*sum)[j - 1][i] - (*sum)[j - 1][i - 1];
+    // The prefix sums of the rows are independent, the rows run in parallel. Use Signed Offset Pixel Representation
+    // to improve Integral Image precision, see: Hensley et al.: "Fast Summed-Area Table Generation and its Applications".
+    gls::parallel_for(1, sum->height, kSurfRowGrain, [&](int j0, int j1) {
+        for (int j = j0; j < j1; j++) {
+            T rowSum = 0;
+            (*sum)[j][0] = 0;
+            for (int i = 1; i < sum->width; i++) {
+                rowSum += img[j - 1][i - 1] - 0.5;
+                (*sum)[j][i] = rowSum;
+            }
         }
-    }
+    });
+
+    // Then the columns, a vector of columns at a time, in strips of columns running in parallel
+    const int stripWidth = 256;
+    const int strips = (sum->width + stripWidth - 1) / stripWidth;
+    gls::parallel_for(0, strips, 1, [&](int s0, int s1) {
+        const int i0 = s0 * stripWidth;
+        const int i1 = std::min(s1 * stripWidth, sum->width);
+        for (int j = 1; j < sum->height; j++) {
+            T* row = &(*sum)[j][0];
+            const T* previousRow = &(*sum)[j - 1][0];
+            int i = i0;
+#if SURF_CPU_VECTORS
+            if constexpr (std::is_same<T, float>::value) {
+                for (; i + kSurfLanes <= i1; i += kSurfLanes) {
+                    surfStore(row + i, surfAdd(surfLoad(row + i), surfLoad(previousRow + i)));
+                }
+            }
+#endif
+            for (; i < i1; i++) {
+                row[i] += previousRow[i];
+            }
+        }
+    });
 }
 
 struct SurfHF {
@@ -113,6 +254,28 @@ static void resizeHaarPattern(const int src[N][5], std::array<SurfHF, N>* dst, i
     }
 }
 
+#if SURF_CPU_VECTORS
+// calcHaarPattern of the kSurfLanes samples starting at p, sampleStep apart
+template <size_t N>
+static inline SurfVector calcHaarPatternVector(const gls::image<float>& sum, const gls::point& p, int sampleStep,
+                                               const std::array<SurfHF, N>& f) {
+    SurfVector d = surfZero();
+    for (int k = 0; k < N; k++) {
+        const auto& fk = f[k];
+
+        const SurfVector p0 = surfLoad(&sum[p.y + fk.p[0].y][p.x + fk.p[0].x], sampleStep);
+        const SurfVector p1 = surfLoad(&sum[p.y + fk.p[1].y][p.x + fk.p[1].x], sampleStep);
+        const SurfVector p2 = surfLoad(&sum[p.y + fk.p[2].y][p.x + fk.p[2].x], sampleStep);
+        const SurfVector p3 = surfLoad(&sum[p.y + fk.p[3].y][p.x + fk.p[3].x], sampleStep);
+
+        // integralRectangle
+        const SurfVector rectangle = surfAdd(surfSplat(0.5), surfSub(surfSub(p0, p1), surfSub(p2, p3)));
+        d = surfMulAdd(d, rectangle, fk.w);
+    }
+    return d;
+}
+#endif
+
 static void calcDetAndTrace(const gls::image<float>& sum, gls::image<float>* det, gls::image<float>* trace, int x,
                             int y, int sampleStep, const std::array<SurfHF, 3>& Dx, const std::array<SurfHF, 3>& Dy,
                             const std::array<SurfHF, 4>& Dxy) {
@@ -311,11 +474,27 @@ void calcLayerDetAndTrace(const gls::image<float>& sum, int size, int sampleStep
     gls::image<float> detCpu = gls::image<float>(det, haarPattern.margin_crop);
     gls::image<float> traceCpu = gls::image<float>(*trace, haarPattern.margin_crop);
 
-    for (int y = 0; y < haarPattern.margin_crop.height; y++) {
-        for (int x = 0; x < haarPattern.margin_crop.width; x++) {
-            calcDetAndTrace(sum, &detCpu, &traceCpu, x, y, sampleStep, haarPattern.Dx, haarPattern.Dy, haarPattern.Dxy);
+    gls::parallel_for(0, haarPattern.margin_crop.height, kSurfRowGrain, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            int x = 0;
+#if SURF_CPU_VECTORS
+            // kSurfLanes samples of the row at a time, the rest of the row is scalar
+            for (; x + kSurfLanes <= haarPattern.margin_crop.width; x += kSurfLanes) {
+                const gls::point p = {x * sampleStep, y * sampleStep};
+
+                const SurfVector dx = calcHaarPatternVector(sum, p, sampleStep, haarPattern.Dx);
+                const SurfVector dy = calcHaarPatternVector(sum, p, sampleStep, haarPattern.Dy);
+                const SurfVector dxy = calcHaarPatternVector(sum, p, sampleStep, haarPattern.Dxy);
+
+                surfStore(&detCpu[y][x], surfMulAdd(surfMul(dx, dy), surfMul(dxy, dxy), -0.81f));
+                surfStore(&traceCpu[y][x], surfAdd(dx, dy));
+            }
+#endif
+            for (; x < haarPattern.margin_crop.width; x++) {
+                calcDetAndTrace(sum, &detCpu, &traceCpu, x, y, sampleStep, haarPattern.Dx, haarPattern.Dy, haarPattern.Dxy);
+            }
         }
-    }
+    });
 }
 
 void findMaximaInLayer(int width, int height, const std::array<gls::image<float>*, 3>& dets,
@@ -680,20 +859,8 @@ struct SURFInvoker {
     void run() {
         const int K = (int)keypoints->size();
 
-        if (K > 32) {
-            const int threads = 8;
-            ThreadPool threadPool(threads);
-
-            const int ranges = (int)std::ceil((float)K / threads);
-            for (int rr = 0; rr < ranges; rr++) {
-                int k1 = ranges * rr;
-                int k2 = std::min(ranges * (rr + 1), K);
-
-                threadPool.enqueue([this, k1, k2]() { computeRange(k1, k2); });
-            }
-        } else {
-            computeRange(0, K);
-        }
+        // Up to 32 keypoints per task
+        gls::parallel_for(0, K, 32, [this](int k1, int k2) { computeRange(k1, k2); });
     }
 };
 
@@ -722,15 +889,15 @@ void SURFBuild(const gls::image<float>& sum, const std::vector<int>& sizes,
     int N = (int)sizes.size();
     LOG_INFO(TAG) << "enqueueing " << N << " calcLayerDetAndTrace" << std::endl;
 
-    ThreadPool threadPool(8);
-
     const int layers = nOctaveLayers + 2;
 
     assert(nOctaves * layers == N);
 
-    for (int octave = 0; octave < nOctaves; octave++) {
-        for (int layer = 0; layer < layers; layer++) {
-            const int i = octave * layers + layer;
+    auto t_start = std::chrono::high_resolution_clock::now();
+
+    // The layers and the rows of each layer are tasks of the shared scheduler, idle workers steal the rows
+    gls::parallel_for(0, N, 1, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
             /*
                  RANSAC interior point ratio - number of loops: 121 150 39
                   Transformation matrix parameter:
@@ -738,11 +905,19 @@ void SURFBuild(const gls::image<float>& sum, const std::vector<int>& sizes,
                 -0.030334 0.993164 119.187500
                 -0.000002 -0.000002 1
              */
-            threadPool.enqueue([&sum, &dets, &traces, &sizes, &sampleSteps, i]() {
-                calcLayerDetAndTrace(sum, sizes[i], sampleSteps[i], dets[i].get(), traces[i].get());
-            });
+            calcLayerDetAndTrace(sum, sizes[i], sampleSteps[i], dets[i].get(), traces[i].get());
         }
+    });
+
+    // Throughput as the determinant samples of all the layers per second
+    size_t samples = 0;
+    for (int i = 0; i < N; i++) {
+        samples += (size_t) ((sum.width - 1) / sampleSteps[i]) * ((sum.height - 1) / sampleSteps[i]);
     }
+    const double elapsed_time_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count();
+    LOG_INFO(TAG) << "SURFBuild: " << elapsed_time_ms << "ms, " << samples / (1000 * std::max(elapsed_time_ms, 1e-3))
+                  << " Msamples/s, " << (SURF_CPU_VECTORS ? "vector" : "scalar") << std::endl;
 }
 
 void SURFFind(const gls::image<float>& sum, const std::vector<gls::image<float>::unique_ptr>& dets,
@@ -750,16 +925,14 @@ void SURFFind(const gls::image<float>& sum, const std::vector<gls::image<float>:
               const std::vector<int>& sampleSteps, const std::vector<int>& middleIndices,
               std::vector<KeyPoint>* keypoints, int nOctaveLayers, float hessianThreshold) {
     std::mutex keypointsMutex;
-    ThreadPool threadPool(8);
 
     int M = (int)middleIndices.size();
     LOG_INFO(TAG) << "enqueueing " << M << " findMaximaInLayer" << std::endl;
-    for (int i = 0; i < M; i++) {
-        const int layer = middleIndices[i];
-        const int octave = i / nOctaveLayers;
+    gls::parallel_for(0, M, 1, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            const int layer = middleIndices[i];
+            const int octave = i / nOctaveLayers;
 
-        threadPool.enqueue([&sum, &dets, &traces, &sizes, &sampleSteps, &keypoints, &keypointsMutex, layer, octave,
-                            hessianThreshold]() {
             auto dets0 = dets[layer - 1].get();
             auto dets1 = dets[layer].get();
             auto dets2 = dets[layer + 1].get();
@@ -769,41 +942,54 @@ void SURFFind(const gls::image<float>& sum, const std::vector<gls::image<float>:
             findMaximaInLayer(sum.width - 1, sum.height - 1, {dets0, dets1, dets2}, *traceImage,
                               {sizes[layer - 1], sizes[layer], sizes[layer + 1]}, keypoints, octave, hessianThreshold,
                               sampleSteps[layer], keypointsMutex);
-        });
-    }
+        }
+    });
 }
 
 struct integralImageKernel {
     const gls::size imageSize;
-    const gls::size tmpSize;
-    static const int tileSize = 8;
-
-    NS::SharedPtr<MTL::Buffer> _integralTmpBuffer;
+    // Must match INTEGRAL_TILE_SIZE in SURF.metal
+    static const int tileSize = 32;
+    static const int scanThreads = 256;
+
+    const int tileStatusCount;
+    gls::Buffer<float> _rowSums;
+    gls::Buffer<uint32_t> _tileStatus;
+    gls::Buffer<uint32_t> _tileCounter;
     gls::mtl_image_2d<float>::unique_ptr _integralInputImage = nullptr;
 
     Kernel<
         MTL::Texture*,  // sourceImage
-        MTL::Buffer*,   // buf_ptr
-        int             // buf_width
-    > integral_sum_cols;
+        MTL::Buffer*,   // rowSums
+        MTL::Buffer*,   // tileStatus
+        int,            // tileStatusCount
+        MTL::Buffer*    // tileCounter
+    > integral_scan_rows;
 
     Kernel<
-        MTL::Buffer*,   // buf_ptr
-        int,            // buf_width
+        MTL::Buffer*,   // rowSums
+        MTL::Buffer*,   // tileStatus
+        MTL::Buffer*,   // tileCounter
         MTL::Texture*,  // sum0
         MTL::Texture*,  // sum1
         MTL::Texture*,  // sum2
         MTL::Texture*   // sum3
-    > integral_sum_rows;
+    > integral_scan_cols;
+
+    static int tileCount(gls::size size) {
+        return ((size.width + tileSize - 1) / tileSize) * ((size.height + tileSize - 1) / tileSize);
+    }
 
     integralImageKernel(MetalContext* context, gls::size _imageSize) :
     imageSize(_imageSize),
-    tmpSize(((_imageSize.height + tileSize - 1) / tileSize) * tileSize,
-                      ((_imageSize.width + tileSize - 1) / tileSize) * tileSize),
-    integral_sum_cols(context, "integral_sum_cols_image"),
-    integral_sum_rows(context, "integral_sum_rows_image")
+    // Aggregate and inclusive prefix of every column of every tile
+    tileStatusCount(2 * tileSize * tileCount(_imageSize)),
+    _rowSums(context->device(), (size_t) _imageSize.width * _imageSize.height),
+    _tileStatus(context->device(), (size_t) tileStatusCount),
+    _tileCounter(context->device(), (size_t) 1),
+    integral_scan_rows(context, "integral_scan_rows"),
+    integral_scan_cols(context, "integral_scan_cols")
     {
-        _integralTmpBuffer = NS::TransferPtr(context->device()->newBuffer(sizeof(float) * tmpSize.width * tmpSize.height, MTL::ResourceStorageModeShared));
         _integralInputImage = std::make_unique<gls::mtl_image_2d<float>>(context->device(), _imageSize.width, _imageSize.height);
     }
 
@@ -813,20 +999,22 @@ struct integralImageKernel {
 
         _integralInputImage->copyPixelsFrom(inputImage);
 
-        integral_sum_cols(context, /*gridSize=*/ MTL::Size(imageSize.width, 1, 1), /*threadGroupSize=*/ MTL::Size(tileSize, 1, 1),
-                          _integralInputImage->texture(), _integralTmpBuffer.get(), tmpSize.width);
+        // One threadgroup per row
+        integral_scan_rows(context, /*gridSize=*/ MTL::Size(scanThreads * imageSize.height, 1, 1), /*threadGroupSize=*/ MTL::Size(scanThreads, 1, 1),
+                           _integralInputImage->texture(), _rowSums.buffer(), _tileStatus.buffer(), tileStatusCount, _tileCounter.buffer());
 
-        integral_sum_rows(context, /*gridSize=*/ MTL::Size(imageSize.height, 1, 1), /*threadGroupSize=*/ MTL::Size(tileSize, 1, 1),
-                          _integralTmpBuffer.get(), tmpSize.width, sum[0]->texture(), sum[1]->texture(), sum[2]->texture(), sum[3]->texture());
+        // One threadgroup per tile, all four sum images are written in this pass
+        integral_scan_cols(context, /*gridSize=*/ MTL::Size(scanThreads * tileCount(imageSize), 1, 1), /*threadGroupSize=*/ MTL::Size(scanThreads, 1, 1),
+                           _rowSums.buffer(), _tileStatus.buffer(), _tileCounter.buffer(), sum[0]->texture(), sum[1]->texture(), sum[2]->texture(), sum[3]->texture());
 
-        // TODO: verify that this is a good idea
-        context->waitForCompletion();
+        // In a batch the caller syncs once all the detection passes are encoded
+        if (!context->isBatching()) {
+            context->waitForCompletion();
+        }
     }
 };
 
 struct calcDetAndTraceKernel {
-    NS::SharedPtr<MTL::Buffer> _surfHFDataBuffer;
-
     Kernel<
         MTL::Texture*,  // sumImage
         MTL::Texture*,  // detImage
@@ -834,20 +1022,18 @@ struct calcDetAndTraceKernel {
         int,            // sampleStep
         simd::float2,   // w
         simd::int2,     // margin
-        MTL::Buffer*    // surfHFData
+        BufferSlice     // surfHFData
     > calcDetAndTrace;
 
     calcDetAndTraceKernel(MetalContext* context) :
     calcDetAndTrace(context, "calcDetAndTrace")
-    {
-        _surfHFDataBuffer = NS::TransferPtr(context->device()->newBuffer(sizeof(gpuSurfHF), MTL::ResourceStorageModeShared));
-    }
+    { }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<float>& sumImage,
                      gls::mtl_image_2d<float>* detImage, gls::mtl_image_2d<float>* traceImage,
                      const int sampleStep, const DetAndTraceHaarPattern& haarPattern) const {
-        const gpuSurfHF surfHFData(haarPattern.Dx, haarPattern.Dy, haarPattern.Dxy);
-        std::memmove(_surfHFDataBuffer->contents(), &surfHFData, sizeof(gpuSurfHF));
+        // Each dispatch gets its own copy of the pattern, no need to wait for the previous one to complete
+        const auto surfHFData = context->parameters(gpuSurfHF(haarPattern.Dx, haarPattern.Dy, haarPattern.Dxy));
 
         const auto& margin_crop = haarPattern.margin_crop;
 
@@ -855,10 +1041,7 @@ struct calcDetAndTraceKernel {
                         sumImage.texture(), detImage->texture(), traceImage->texture(), sampleStep,
                         simd::float2 {haarPattern.Dx[0].w, haarPattern.Dxy[0].w},
                         simd::int2 {margin_crop.x, margin_crop.y},
-                        _surfHFDataBuffer.get());
-
-        // TODO: verify that this is a good idea
-        context->waitForCompletion();
+                        surfHFData);
     }
 };
 
@@ -873,9 +1056,25 @@ typedef struct KeyPointMaxima {
     KeyPoint keyPoints[MaxCount];
 } KeyPointMaxima;
 
+// The count of the strongest keypoints of a KeyPointMaxima, see keypointSelectionThreshold in SURF.metal. The
+// keypoints themselves are written to the kernel's selectedKeyPoints arrays.
+typedef struct KeyPointSelection {
+    uint32_t thresholdBin;
+    int count;
+} KeyPointSelection;
+
 struct findMaximaInLayerKernel {
+    // Must match KEYPOINT_HISTOGRAM_BINS in SURF.metal
+    static constexpr int kHistogramBins = 4096;
+
     const gls::size imageSize;
     NS::SharedPtr<MTL::Buffer> _keyPointsBuffer;
+    NS::SharedPtr<MTL::Buffer> _selectedKeyPointsBuffer;
+    std::array<gls::GPUMemoryTracker::Allocation, 2> _bufferAllocations;
+    const gls::Buffer<uint32_t> _histogram;
+    const gls::Buffer<uint32_t> _coarseHistogram;
+    const gls::Buffer<float> _detectionThreshold;
+    KeyPoints _selectedKeyPoints;
 
     Kernel<
         MTL::Texture*,  // detImage0
@@ -887,13 +1086,114 @@ struct findMaximaInLayerKernel {
         int,            // margin
         int,            // octave
         float,          // hessianThreshold
-        int             // sampleStep
+        int,            // sampleStep
+        MTL::Buffer*    // detectionThreshold
     > findMaximaInLayer;
 
+    Kernel<
+        MTL::Buffer*,   // keypoints
+        simd::int4,     // core
+        MTL::Buffer*    // histogram
+    > keypointResponseHistogram;
+
+    Kernel<
+        MTL::Buffer*,   // histogram
+        float,          // octaveScale
+        int,            // targetCount
+        MTL::Buffer*    // detectionThreshold
+    > keypointDetectionThreshold;
+
+    Kernel<
+        MTL::Buffer*,   // histogram
+        int,            // maxFeatures
+        MTL::Buffer*,   // selection
+        MTL::Buffer*    // detectionThreshold
+    > keypointSelectionThreshold;
+
+    Kernel<
+        MTL::Buffer*,   // keypoints
+        simd::int4,     // core
+        MTL::Buffer*,   // selection
+        MTL::Buffer*,   // keypointX
+        MTL::Buffer*,   // keypointY
+        MTL::Buffer*,   // keypointSize
+        MTL::Buffer*,   // keypointAngle
+        MTL::Buffer*,   // keypointResponse
+        MTL::Buffer*,   // keypointOctave
+        MTL::Buffer*    // keypointClassId
+    > compactKeyPoints;
+
     findMaximaInLayerKernel(MetalContext* context, gls::size _imageSize) :
     imageSize(_imageSize),
-    findMaximaInLayer(context, "findMaximaInLayer") {
+    _histogram(context->device(), std::vector<uint32_t>(kHistogramBins, 0)),
+    _coarseHistogram(context->device(), std::vector<uint32_t>(kHistogramBins, 0)),
+    _detectionThreshold(context->device(), std::vector<float>(1, 0)),
+    _selectedKeyPoints(context->device(), KeyPointMaxima::MaxCount),
+    findMaximaInLayer(context, "findMaximaInLayer"),
+    keypointResponseHistogram(context, "keypointResponseHistogram"),
+    keypointDetectionThreshold(context, "keypointDetectionThreshold"),
+    keypointSelectionThreshold(context, "keypointSelectionThreshold"),
+    compactKeyPoints(context, "compactKeyPoints") {
         _keyPointsBuffer = NS::TransferPtr(context->device()->newBuffer(sizeof(KeyPointMaxima), MTL::ResourceStorageModeShared));
+        _selectedKeyPointsBuffer = NS::TransferPtr(context->device()->newBuffer(sizeof(KeyPointSelection), MTL::ResourceStorageModeShared));
+        _bufferAllocations = {
+            context->memoryTracker().track(_keyPointsBuffer->allocatedSize()),
+            context->memoryTracker().track(_selectedKeyPointsBuffer->allocatedSize())
+        };
+    }
+
+    // Encodes the estimate of the detection threshold of the layers found after this call, for about targetCount
+    // maxima in core overall, from the maxima found so far: the coarsest octave's, octaveScale times fewer than the
+    // whole scale space's. The threshold is reset by selectKeyPoints.
+    void estimateDetectionThreshold(MetalContext* context, int targetCount, float octaveScale, const gls::rectangle& core) const {
+        const auto coreRect = simd::int4 {core.x, core.y, core.width, core.height};
+
+        keypointResponseHistogram(context, /*gridSize=*/ MTL::Size(KeyPointMaxima::MaxCount, 1, 1),
+                                  _keyPointsBuffer.get(), coreRect, _coarseHistogram.buffer());
+
+        keypointDetectionThreshold(context, /*gridSize=*/ MTL::Size(1, 1, 1),
+                                   _coarseHistogram.buffer(), octaveScale, targetCount, _detectionThreshold.buffer());
+    }
+
+    // Encodes the selection of the (at least) maxFeatures strongest maxima in core, in layer coordinates. The
+    // keypoints of the threshold's histogram bin are all kept, the caller sorts and truncates the selection.
+    void selectKeyPoints(MetalContext* context, int maxFeatures, const gls::rectangle& core) const {
+        const auto coreRect = simd::int4 {core.x, core.y, core.width, core.height};
+
+        keypointResponseHistogram(context, /*gridSize=*/ MTL::Size(KeyPointMaxima::MaxCount, 1, 1),
+                                  _keyPointsBuffer.get(), coreRect, _histogram.buffer());
+
+        keypointSelectionThreshold(context, /*gridSize=*/ MTL::Size(1, 1, 1),
+                                   _histogram.buffer(), maxFeatures, _selectedKeyPointsBuffer.get(), _detectionThreshold.buffer());
+
+        const auto& kps = _selectedKeyPoints;
+        compactKeyPoints(context, /*gridSize=*/ MTL::Size(KeyPointMaxima::MaxCount, 1, 1),
+                         _keyPointsBuffer.get(), coreRect, _selectedKeyPointsBuffer.get(),
+                         kps.x.buffer(), kps.y.buffer(), kps.sizes.buffer(), kps.angles.buffer(),
+                         kps.responses.buffer(), kps.octaves.buffer(), kps.classIds.buffer());
+
+        // In a batch the caller syncs once all the detection passes are encoded
+        if (!context->isBatching()) {
+            context->waitForCompletion();
+        }
+    }
+
+    // Once the GPU is done with selectKeyPoints
+    int selectedCount() const {
+        const auto selection = (const KeyPointSelection*) _selectedKeyPointsBuffer->contents();
+        return std::min(selection->count, KeyPointMaxima::MaxCount);
+    }
+
+    const KeyPoints& selectedKeyPoints() const {
+        return _selectedKeyPoints;
+    }
+
+    // The selection sized to its count, the caller can sort, filter and update it in place until the next detection.
+    // As collectKeyPoints, resets the maxima for the next detection.
+    KeyPoints* selectedKeyPoints() {
+        _selectedKeyPoints.resize(selectedCount());
+        ((KeyPointMaxima*) _keyPointsBuffer->contents())->count = 0;
+        return &_selectedKeyPoints;
     }
 
     void operator() (MetalContext* context, const std::array<const gls::mtl_image_2d<float>*, 3>& dets,
@@ -907,10 +1207,13 @@ struct findMaximaInLayerKernel {
 
         findMaximaInLayer(context, /*gridSize=*/ MTL::Size(layer_width - 2 * margin, layer_height - 2 * margin, 1),
                           dets[0]->texture(), dets[1]->texture(), dets[2]->texture(), traceImage.texture(),
-                          simd::int3 {sizes[0], sizes[1], sizes[2]}, _keyPointsBuffer.get(), margin, octave, hessianThreshold, sampleStep);
+                          simd::int3 {sizes[0], sizes[1], sizes[2]}, _keyPointsBuffer.get(), margin, octave, hessianThreshold, sampleStep,
+                          _detectionThreshold.buffer());
 
-        // TODO: verify that this is a good idea
-        context->waitForCompletion();
+        // In a batch the caller syncs once all the detection passes are encoded
+        if (!context->isBatching()) {
+            context->waitForCompletion();
+        }
     }
 };
 
@@ -928,6 +1231,27 @@ struct refineMatch {
     }
 };
 
+// The matchers' buffers are kept across calls and only reallocated to grow, so that matching a burst against its
+// reference frame doesn't allocate. Matching waits for the GPU, the buffers are free again when a match returns.
+template <typename T>
+static gls::Buffer<T>& pooledBuffer(std::unique_ptr<gls::Buffer<T>>* buffer, MTL::Device* device, size_t size) {
+    // Metal doesn't allocate zero length buffers
+    size = std::max(size, (size_t) 1);
+    if (!*buffer || (*buffer)->size() < size) {
+        *buffer = std::make_unique<gls::Buffer<T>>(device, size);
+    }
+    return **buffer;
+}
+
+// Host descriptors are copied in a pooled buffer, the KeyPoints descriptors are bound as they are
+static const gls::Buffer<float>& stagedDescriptors(std::unique_ptr<gls::Buffer<float>>* buffer, MTL::Device* device,
+                                                   const gls::image<float>& descriptors) {
+    auto& staging = pooledBuffer(buffer, device, (size_t) descriptors.stride * descriptors.height);
+    const auto pixels = descriptors.pixels();
+    std::copy(pixels.begin(), pixels.end(), staging.data());
+    return staging;
+}
+
 struct matchKeyPointsKernel {
     Kernel<
         MTL::Buffer*,   // descriptor1
@@ -938,32 +1262,43 @@ struct matchKeyPointsKernel {
 
     static constexpr int match_block_size = 24;
 
+    mutable std::unique_ptr<gls::Buffer<float>> _descriptor1;
+    mutable std::unique_ptr<gls::Buffer<float>> _descriptor2;
+    mutable std::unique_ptr<gls::Buffer<DMatch>> _matches;
+
     matchKeyPointsKernel(MetalContext* context) : matchKeyPoints(context, "matchKeyPoints") { }
 
-    std::vector<DMatch> operator() (MetalContext* context, const gls::image<float>& descriptor1, const gls::image<float>& descriptor2) const {
+    gls::frame_vector<DMatch> operator() (MetalContext* context, const gls::image<float>& descriptor1, const gls::image<float>& descriptor2) const {
         assert(descriptor1.stride == 64 && descriptor2.stride == 64);
 
-        std::cout << "Matching descriptors " << descriptor1.height << ", " << descriptor2.height << std::endl;
+        const auto& descriptor1Buffer = stagedDescriptors(&_descriptor1, context->device(), descriptor1);
+        const auto& descriptor2Buffer = stagedDescriptors(&_descriptor2, context->device(), descriptor2);
+
+        return (*this)(context, descriptor1Buffer, descriptor1.height, descriptor2Buffer, descriptor2.height);
+    }
 
-        auto descriptor1Buffer = gls::Buffer<float>(context->device(), descriptor1.pixels());
-        auto descriptor2Buffer = gls::Buffer<float>(context->device(), descriptor2.pixels());
-        auto matchesBuffer = gls::Buffer<DMatch>(context->device(), descriptor1.height);
+    // Matches descriptors already in GPU buffers, e.g. the output of surfDescriptorsKernel
+    gls::frame_vector<DMatch> operator() (MetalContext* context, const gls::Buffer<float>& descriptor1, int descriptor1Count,
+                                    const gls::Buffer<float>& descriptor2, int descriptor2Count) const {
+        std::cout << "Matching descriptors " << descriptor1Count << ", " << descriptor2Count << std::endl;
+
+        const auto& matchesBuffer = pooledBuffer(&_matches, context->device(), descriptor1Count);
 
         matchKeyPoints(context,
-                       /*gridSize=*/ MTL::Size(descriptor1.height, match_block_size, 1),
+                       /*gridSize=*/ MTL::Size(descriptor1Count, match_block_size, 1),
                        /*threadGroupSize=*/ MTL::Size(1, match_block_size, 1),
-                       descriptor1Buffer.buffer(),
-                       descriptor2Buffer.buffer(),
-                       descriptor2.height, matchesBuffer.buffer());
+                       descriptor1.buffer(),
+                       descriptor2.buffer(),
+                       descriptor2Count, matchesBuffer.buffer());
 
         // TODO: verify that this is a good idea
         context->waitForCompletion();
 
         // Collect results
-        const std::span<DMatch> newElements(matchesBuffer.data(), descriptor1.height);
+        const std::span<DMatch> newElements(matchesBuffer.data(), descriptor1Count);
 
         // Build result vector
-        std::vector<DMatch> matchedPoints(begin(newElements), end(newElements));
+        gls::frame_vector<DMatch> matchedPoints(begin(newElements), end(newElements));
 
         // cl::enqueueUnmapMemObject(matchesBuffer, (void*)matches);
 
@@ -973,6 +1308,393 @@ struct matchKeyPointsKernel {
     }
 };
 
+// Tiled matcher: train descriptors are staged through threadgroup memory, optionally as fp16, and only the matches
+// passing Lowe's ratio test (and the cross-check if requested) are compacted in the output
+struct ratioTestMatchKernel {
+    // Must match MatchCandidate in SURF.metal
+    struct MatchCandidate {
+        uint32_t trainIdx;
+        float distance;
+        float secondDistance;
+    };
+
+    // Must match MatchRange in SURF.metal
+    struct MatchRange {
+        uint32_t queryOffset;
+        uint32_t queryCount;
+        uint32_t trainOffset;
+        uint32_t trainCount;
+        uint32_t matchesOffset;
+    };
+
+    // Must match MATCH_TILE_SIZE in SURF.metal
+    static constexpr int kTileSize = 64;
+
+    typedef Kernel<
+        MTL::Buffer*,   // descriptor1
+        MTL::Buffer*,   // descriptor2
+        uint32_t,       // descriptor1Count
+        uint32_t,       // descriptor2Count
+        MTL::Buffer*    // matches
+    > matchKernel;
+
+    matchKernel matchKeyPointsTiled;
+    matchKernel matchKeyPointsTiledHalf;
+    matchKernel matchKeyPointsHamming;
+
+    typedef Kernel<
+        MTL::Buffer*,   // descriptor1
+        MTL::Buffer*,   // descriptor2
+        MTL::Buffer*,   // ranges
+        MTL::Buffer*    // matches
+    > batchKernel;
+
+    batchKernel matchKeyPointsTiledBatch;
+    batchKernel matchKeyPointsHammingBatch;
+
+    Kernel<
+        MTL::Buffer*,   // matches12
+        MTL::Buffer*,   // matches21
+        uint32_t,       // descriptor1Count
+        float,          // ratio
+        int,            // crossCheck
+        MTL::Buffer*,   // matchesCount
+        MTL::Buffer*    // matchedPoints
+    > compactMatches;
+
+    Kernel<
+        MTL::Buffer*,   // matches12
+        MTL::Buffer*,   // matches21
+        MTL::Buffer*,   // ranges
+        float,          // ratio
+        int,            // crossCheck
+        MTL::Buffer*,   // matchesCounts
+        MTL::Buffer*    // matchedPoints
+    > compactMatchesBatch;
+
+    mutable std::unique_ptr<gls::Buffer<float>> _descriptor1;
+    mutable std::unique_ptr<gls::Buffer<float>> _descriptor2;
+    mutable std::unique_ptr<gls::Buffer<MatchCandidate>> _matches12;
+    mutable std::unique_ptr<gls::Buffer<MatchCandidate>> _matches21;
+    mutable std::unique_ptr<gls::Buffer<uint32_t>> _matchesCount;
+    mutable std::unique_ptr<gls::Buffer<DMatch>> _matchedPoints;
+
+    // The frames' descriptors of a batch, one after the other, and its ranges in the two directions
+    mutable std::unique_ptr<gls::Buffer<float>> _batchDescriptors;
+    mutable std::unique_ptr<gls::Buffer<MatchRange>> _ranges12;
+    mutable std::unique_ptr<gls::Buffer<MatchRange>> _ranges21;
+
+    ratioTestMatchKernel(MetalContext* context) :
+    matchKeyPointsTiled(context, "matchKeyPointsTiled"),
+    matchKeyPointsTiledHalf(context, "matchKeyPointsTiledHalf"),
+    matchKeyPointsHamming(context, "matchKeyPointsHamming"),
+    matchKeyPointsTiledBatch(context, "matchKeyPointsTiledBatch"),
+    matchKeyPointsHammingBatch(context, "matchKeyPointsHammingBatch"),
+    compactMatches(context, "compactMatches"),
+    compactMatchesBatch(context, "compactMatchesBatch")
+    { }
+
+    void match(MetalContext* context, const matchKernel& kernel, const gls::Buffer<float>& descriptor1,
+               int descriptor1Count, const gls::Buffer<float>& descriptor2, int descriptor2Count,
+               const gls::Buffer<MatchCandidate>& matches) const {
+        // Whole tiles, all threads of a threadgroup take part in the staging
+        const int gridSize = kTileSize * ((descriptor1Count + kTileSize - 1) / kTileSize);
+
+        kernel(context, /*gridSize=*/ MTL::Size(gridSize, 1, 1), /*threadGroupSize=*/ MTL::Size(kTileSize, 1, 1),
+               descriptor1.buffer(), descriptor2.buffer(), descriptor1Count, descriptor2Count, matches.buffer());
+    }
+
+    gls::frame_vector<DMatch> operator() (MetalContext* context, const gls::Buffer<float>& descriptor1, int descriptor1Count,
+                                    const gls::Buffer<float>& descriptor2, int descriptor2Count,
+                                    float ratio = 0.8, bool crossCheck = true, bool fp16 = false) const {
+        return match(context, fp16 ? matchKeyPointsTiledHalf : matchKeyPointsTiled, descriptor1, descriptor1Count,
+                     descriptor2, descriptor2Count, ratio, crossCheck);
+    }
+
+    gls::frame_vector<DMatch> match(MetalContext* context, const matchKernel& kernel,
+                              const gls::Buffer<float>& descriptor1, int descriptor1Count,
+                              const gls::Buffer<float>& descriptor2, int descriptor2Count,
+                              float ratio, bool crossCheck) const {
+        if (descriptor1Count == 0 || descriptor2Count == 0) {
+            return {};
+        }
+
+        const auto& matches12 = pooledBuffer(&_matches12, context->device(), descriptor1Count);
+        const auto& matches21 = pooledBuffer(&_matches21, context->device(), crossCheck ? descriptor2Count : 1);
+        const auto& matchesCount = pooledBuffer(&_matchesCount, context->device(), 1);
+        const auto& matchedPoints = pooledBuffer(&_matchedPoints, context->device(), descriptor1Count);
+        *matchesCount.data() = 0;
+
+        {
+            MetalContext::BatchScope batch(context);
+
+            {
+                // The two directions are independent
+                MetalContext::ConcurrentScope concurrent(context);
+
+                match(context, kernel, descriptor1, descriptor1Count, descriptor2, descriptor2Count, matches12);
+                if (crossCheck) {
+                    match(context, kernel, descriptor2, descriptor2Count, descriptor1, descriptor1Count, matches21);
+                }
+            }
+
+            compactMatches(context, /*gridSize=*/ MTL::Size(descriptor1Count, 1, 1),
+                           matches12.buffer(), matches21.buffer(), descriptor1Count, ratio, (int) crossCheck,
+                           matchesCount.buffer(), matchedPoints.buffer());
+        }
+        context->waitForCompletion();
+
+        gls::frame_vector<DMatch> result(matchedPoints.data(), matchedPoints.data() + *matchesCount.data());
+        std::sort(result.begin(), result.end(), refineMatch());
+        return result;
+    }
+
+    // The descriptors of a frame of a batch, descriptorSize floats per keypoint
+    struct BatchFrame {
+        const gls::Buffer<float>* descriptors;
+        int count;
+    };
+
+    // Matches descriptor1 against the descriptors of every frame, e.g. the reference of a burst against all its other
+    // frames: the frames are staged in one buffer and both directions of all the frames are matched in one dispatch
+    // each, with a single wait. Returns the matches of each frame, as match would.
+    std::vector<gls::frame_vector<DMatch>> matchBatch(MetalContext* context, const batchKernel& kernel, int descriptorSize,
+                                                      const gls::Buffer<float>& descriptor1, int descriptor1Count,
+                                                      std::span<const BatchFrame> frames, float ratio, bool crossCheck) const {
+        std::vector<gls::frame_vector<DMatch>> result(frames.size());
+        if (descriptor1Count == 0 || frames.empty()) {
+            return result;
+        }
+
+        const int frameCount = (int) frames.size();
+        int totalCount = 0, maxCount = 0;
+        for (const auto& frame : frames) {
+            totalCount += frame.count;
+            maxCount = std::max(maxCount, frame.count);
+        }
+
+        const auto& descriptors = pooledBuffer(&_batchDescriptors, context->device(), (size_t) totalCount * descriptorSize);
+        const auto& ranges12 = pooledBuffer(&_ranges12, context->device(), frameCount);
+        const auto& ranges21 = pooledBuffer(&_ranges21, context->device(), frameCount);
+        uint32_t offset = 0;
+        for (int f = 0; f < frameCount; f++) {
+            const auto& frame = frames[f];
+            std::copy(frame.descriptors->data(), frame.descriptors->data() + (size_t) frame.count * descriptorSize,
+                      descriptors.data() + (size_t) offset * descriptorSize);
+            ranges12.data()[f] = { 0, (uint32_t) descriptor1Count, offset, (uint32_t) frame.count,
+                                   (uint32_t) (f * descriptor1Count) };
+            ranges21.data()[f] = { offset, (uint32_t) frame.count, 0, (uint32_t) descriptor1Count, offset };
+            offset += frame.count;
+        }
+
+        const auto& matches12 = pooledBuffer(&_matches12, context->device(), (size_t) frameCount * descriptor1Count);
+        const auto& matches21 = pooledBuffer(&_matches21, context->device(), crossCheck ? totalCount : 1);
+        const auto& matchesCounts = pooledBuffer(&_matchesCount, context->device(), frameCount);
+        const auto& matchedPoints = pooledBuffer(&_matchedPoints, context->device(), (size_t) frameCount * descriptor1Count);
+        std::fill(matchesCounts.data(), matchesCounts.data() + frameCount, 0);
+
+        {
+            MetalContext::BatchScope batch(context);
+
+            {
+                // The two directions are independent
+                MetalContext::ConcurrentScope concurrent(context);
+
+                const auto wholeTiles = [](int count) { return kTileSize * ((count + kTileSize - 1) / kTileSize); };
+                kernel(context, /*gridSize=*/ MTL::Size(wholeTiles(descriptor1Count), frameCount, 1),
+                       /*threadGroupSize=*/ MTL::Size(kTileSize, 1, 1),
+                       descriptor1.buffer(), descriptors.buffer(), ranges12.buffer(), matches12.buffer());
+                if (crossCheck && maxCount > 0) {
+                    kernel(context, /*gridSize=*/ MTL::Size(wholeTiles(maxCount), frameCount, 1),
+                           /*threadGroupSize=*/ MTL::Size(kTileSize, 1, 1),
+                           descriptors.buffer(), descriptor1.buffer(), ranges21.buffer(), matches21.buffer());
+                }
+            }
+
+            compactMatchesBatch(context, /*gridSize=*/ MTL::Size(descriptor1Count, frameCount, 1),
+                                matches12.buffer(), matches21.buffer(), ranges12.buffer(), ratio, (int) crossCheck,
+                                matchesCounts.buffer(), matchedPoints.buffer());
+        }
+        context->waitForCompletion();
+
+        for (int f = 0; f < frameCount; f++) {
+            const DMatch* frameMatches = matchedPoints.data() + (size_t) f * descriptor1Count;
+            result[f] = gls::frame_vector<DMatch>(frameMatches, frameMatches + matchesCounts.data()[f]);
+            std::sort(result[f].begin(), result[f].end(), refineMatch());
+        }
+        return result;
+    }
+
+    gls::frame_vector<DMatch> operator() (MetalContext* context, const gls::image<float>& descriptor1,
+                                    const gls::image<float>& descriptor2, float ratio = 0.8,
+                                    bool crossCheck = true, bool fp16 = false) const {
+        assert(descriptor1.stride == 64 && descriptor2.stride == 64);
+
+        const auto& descriptor1Buffer = stagedDescriptors(&_descriptor1, context->device(), descriptor1);
+        const auto& descriptor2Buffer = stagedDescriptors(&_descriptor2, context->device(), descriptor2);
+
+        return (*this)(context, descriptor1Buffer, descriptor1.height, descriptor2Buffer, descriptor2.height,
+                       ratio, crossCheck, fp16);
+    }
+
+    // Matching of BRIEF descriptors, 8 words per row
+    gls::frame_vector<DMatch> hamming(MetalContext* context, const gls::image<float>& descriptor1,
+                                const gls::image<float>& descriptor2, float ratio = 0.8, bool crossCheck = true) const {
+        assert(descriptor1.stride == 8 && descriptor2.stride == 8);
+
+        const auto& descriptor1Buffer = stagedDescriptors(&_descriptor1, context->device(), descriptor1);
+        const auto& descriptor2Buffer = stagedDescriptors(&_descriptor2, context->device(), descriptor2);
+
+        return match(context, matchKeyPointsHamming, descriptor1Buffer, descriptor1.height, descriptor2Buffer,
+                     descriptor2.height, ratio, crossCheck);
+    }
+};
+
+// BRIEF descriptors from the integral image, see briefDescriptors in SURF.metal
+struct briefDescriptorsKernel {
+    // Must match BRIEF_WORDS in SURF.metal
+    static constexpr int kWords = 8;
+
+    Kernel<
+        MTL::Texture*,  // sumImage
+        MTL::Buffer*,   // keypointX
+        MTL::Buffer*,   // keypointY
+        MTL::Buffer*,   // keypointSize
+        int,            // keypointsCount
+        MTL::Buffer*,   // pattern
+        MTL::Buffer*    // descriptors
+    > briefDescriptors;
+
+    const gls::Buffer<simd::float4> _pattern;
+
+    // The 256 test pairs, isotropic Gaussian samples of the patch (BRIEF's G II pattern) with a fixed seed
+    static std::vector<simd::float4> testPattern() {
+        std::mt19937 generator(0x5eed);
+        std::normal_distribution<float> gaussian(0, 0.2);
+        const auto sample = [&]() { return std::clamp(gaussian(generator), -0.5f, 0.5f); };
+
+        std::vector<simd::float4> pattern(32 * kWords);
+        for (auto& test : pattern) {
+            test = {sample(), sample(), sample(), sample()};
+        }
+        return pattern;
+    }
+
+    briefDescriptorsKernel(MetalContext* context) :
+    briefDescriptors(context, "briefDescriptors"),
+    _pattern(context->device(), testPattern())
+    { }
+
+    // Encodes the computation, descriptors holds 8 words per keypoint
+    void operator() (MetalContext* context, const gls::mtl_image_2d<float>& sumImage, const KeyPoints& keypoints,
+                     const gls::Buffer<float>& descriptors) const {
+        const int keypointsCount = (int) keypoints.size();
+        assert(descriptors.size() >= kWords * keypointsCount);
+
+        briefDescriptors(context, /*gridSize=*/ MTL::Size(kWords * keypointsCount, 1, 1),
+                         sumImage.texture(), keypoints.x.buffer(), keypoints.y.buffer(), keypoints.sizes.buffer(),
+                         keypointsCount, _pattern.buffer(), descriptors.buffer());
+    }
+};
+
+// GPU version of SURFInvoker: keypoint orientation and 64-float descriptors from the integral image,
+// one SIMD-group per keypoint
+struct surfDescriptorsKernel {
+    enum { ORI_RADIUS = 6, PATCH_SZ = 20 };
+
+    // Must match SURF_SIMD_WIDTH in SURF.metal
+    static constexpr int kSimdWidth = 32;
+    static constexpr int kKeypointsPerThreadgroup = 4;
+
+    Kernel<
+        MTL::Texture*,  // sumImage
+        MTL::Buffer*,   // keypointX
+        MTL::Buffer*,   // keypointY
+        MTL::Buffer*,   // keypointSize
+        MTL::Buffer*,   // keypointAngle
+        int,            // keypointsCount
+        MTL::Buffer*,   // oriSamples
+        int,            // oriSamplesCount
+        MTL::Buffer*,   // descriptorWeights
+        MTL::Buffer*    // descriptors
+    > surfDescriptors;
+
+    const gls::Buffer<simd::float3> _oriSamples;
+    const gls::Buffer<float> _descriptorWeights;
+
+    // Coordinates and weights of the samples used to calculate the orientation, as in SURFInvoker
+    static std::vector<simd::float3> orientationSamples() {
+        const auto G_ori = getGaussianKernel(2 * ORI_RADIUS + 1, SURF_ORI_SIGMA);
+        std::vector<simd::float3> samples;
+        for (int i = -ORI_RADIUS; i <= ORI_RADIUS; i++) {
+            for (int j = -ORI_RADIUS; j <= ORI_RADIUS; j++) {
+                if (i * i + j * j <= ORI_RADIUS * ORI_RADIUS) {
+                    samples.push_back({(float)i, (float)j, G_ori[i + ORI_RADIUS] * G_ori[j + ORI_RADIUS]});
+                }
+            }
+        }
+        return samples;
+    }
+
+    // Gaussian used to weight the descriptor samples
+    static std::vector<float> descriptorWeights() {
+        const auto G_desc = getGaussianKernel(PATCH_SZ, SURF_DESC_SIGMA);
+        std::vector<float> weights(PATCH_SZ * PATCH_SZ);
+        for (int i = 0; i < PATCH_SZ; i++) {
+            for (int j = 0; j < PATCH_SZ; j++) {
+                weights[i * PATCH_SZ + j] = G_desc[i] * G_desc[j];
+            }
+        }
+        return weights;
+    }
+
+    surfDescriptorsKernel(MetalContext* context) :
+    surfDescriptors(context, "surfDescriptors"),
+    _oriSamples(context->device(), orientationSamples()),
+    _descriptorWeights(context->device(), descriptorWeights())
+    { }
+
+    // Encodes the computation, the keypoints' angles (and the sizes of the ones which can't be sampled) are updated
+    // in place and descriptors holds 64 floats per keypoint
+    void operator() (MetalContext* context, const gls::mtl_image_2d<float>& sumImage, const KeyPoints& keypoints,
+                     const gls::Buffer<float>& descriptors) const {
+        const int keypointsCount = (int) keypoints.size();
+        assert(descriptors.size() >= 64 * keypointsCount);
+
+        surfDescriptors(context, /*gridSize=*/ MTL::Size(kSimdWidth * keypointsCount, 1, 1),
+                        /*threadGroupSize=*/ MTL::Size(kSimdWidth * kKeypointsPerThreadgroup, 1, 1),
+                        sumImage.texture(), keypoints.x.buffer(), keypoints.y.buffer(), keypoints.sizes.buffer(),
+                        keypoints.angles.buffer(), keypointsCount,
+                        _oriSamples.buffer(), (int) _oriSamples.size(), _descriptorWeights.buffer(),
+                        descriptors.buffer());
+    }
+
+    // Same interface as descriptor(), with the integral image on the GPU
+    void operator() (MetalContext* context, const gls::mtl_image_2d<float>& sumImage,
+                     std::vector<KeyPoint>* keypoints, gls::image<float>* descriptors) const {
+        const int K = (int)keypoints->size();
+        if (K == 0) {
+            return;
+        }
+
+        KeyPoints keypointsBuffer(context->device(), *keypoints);
+        gls::Buffer<float> descriptorsBuffer(context->device(), 64 * K);
+
+        (*this)(context, sumImage, keypointsBuffer, descriptorsBuffer);
+
+        context->waitForCompletion();
+
+        for (int k = 0; k < K; k++) {
+            (*keypoints)[k] = keypointsBuffer[k];
+        }
+        if (descriptors) {
+            for (int k = 0; k < K; k++) {
+                std::copy(descriptorsBuffer.data() + 64 * k, descriptorsBuffer.data() + 64 * (k + 1), (*descriptors)[k]);
+            }
+        }
+    }
+};
+
 static inline float L2Norm(const std::array<float, 64>& p1, const std::array<float, 64>& p2) {
     float sum = 0;
     for (uint i = 0; i < p1.size(); i++) {
@@ -984,7 +1706,7 @@ static inline float L2Norm(const std::array<float, 64>& p1, const std::array<flo
 
 // Brute force CPU kerypoint matching
 void matchKeyPoints(const gls::image<float>& descriptor1, const gls::image<float>& descriptor2,
-                    std::vector<DMatch>* matchedPoints) {
+                    gls::frame_vector<DMatch>* matchedPoints) {
     assert(descriptor1.width == 64 && descriptor2.width == 64);
 
     for (int i = 0; i < descriptor1.height; i++) {
@@ -1013,59 +1735,151 @@ class SURFGPU : public SURF {
    private:
     MetalContext* _gpuContext;
 
-    const int _width;
-    const int _height;
     const int _max_features;
     const int _nOctaves;
     const int _nOctaveLayers;
     const float _hessianThreshold;
+    const DescriptorType _descriptorType;
+    const bool _halfPrecisionScaleSpace;
 
-    integralImageKernel _integralImage;
     calcDetAndTraceKernel _calcDetAndTrace;
-    findMaximaInLayerKernel _findMaximaInLayer;
     matchKeyPointsKernel _matchKeyPoints;
-
-    std::vector<gls::mtl_image_2d<float>::unique_ptr> _dets;
-    std::vector<gls::mtl_image_2d<float>::unique_ptr> _traces;
+    ratioTestMatchKernel _ratioTestMatch;
+    surfDescriptorsKernel _surfDescriptors;
+    briefDescriptorsKernel _briefDescriptors;
 
     /* Sampling step along image x and y axes at first octave. This is doubled
     for each additional octave. WARNING: Increasing this improves speed,
     however keypoint extraction becomes unreliable. */
     static const int SAMPLE_STEP0 = 1;
 
+    // A section of the image processed by detectAndCompute, extended by a skirt overlapping its neighbors so
+    // that the detector sees the full support of its filters near the seams. Every tile has its own integral
+    // images, Hessian layers and maxima buffer, so that the detection passes of all the tiles can be encoded
+    // in a single submission.
+    struct SURFTile {
+        // The tile with its skirt, and the part of the image whose keypoints belong to this tile
+        const gls::rectangle region;
+        const gls::rectangle core;
+
+        integralImageKernel integralImage;
+        findMaximaInLayerKernel findMaximaInLayer;
+
+        const std::array<gls::mtl_image_2d<float>::unique_ptr, 4> sum;
+        std::vector<gls::mtl_image_2d<float>::unique_ptr> dets;
+        std::vector<gls::mtl_image_2d<float>::unique_ptr> traces;
+
+        SURFTile(MetalContext* context, const gls::rectangle& _region, const gls::rectangle& _core, int nOctaves,
+                 int nOctaveLayers, bool halfPrecisionScaleSpace) :
+        region(_region),
+        core(_core),
+        integralImage(context, {region.width, region.height}),
+        findMaximaInLayer(context, {region.width, region.height}),
+        sum(sumImageStack<float>(context, region.width + 1, region.height + 1)) {
+            for (int octave = 0, step = SAMPLE_STEP0; octave < nOctaves; octave++, step *= 2) {
+                for (int layer = 0; layer < nOctaveLayers + 2; layer++) {
+                    dets.push_back(scaleSpaceLayer(context, region.width / step, region.height / step, halfPrecisionScaleSpace));
+                    traces.push_back(scaleSpaceLayer(context, region.width / step, region.height / step, halfPrecisionScaleSpace));
+                }
+            }
+        }
+
+        // The half precision layers are GPU only, the kernels read and write them as float textures
+        static gls::mtl_image_2d<float>::unique_ptr scaleSpaceLayer(MetalContext* context, int width, int height,
+                                                                    bool halfPrecision) {
+            if (halfPrecision) {
+                return std::make_unique<gls::mtl_private_image_2d<float>>(context->device(), width, height,
+                                                                          gls::texture_precision::fp16);
+            }
+            return std::make_unique<gls::mtl_image_2d<float>>(context->device(), width, height);
+        }
+
+        // The core in tile coordinates
+        gls::rectangle localCore() const {
+            return gls::rectangle({core.x - region.x, core.y - region.y, core.width, core.height});
+        }
+
+        // Keypoints found in the skirt are left to the neighboring tile owning them
+        bool owns(const KeyPoint& kp) const {
+            const float x = kp.pt.x + region.x;
+            const float y = kp.pt.y + region.y;
+            return x >= core.x && x < core.x + core.width && y >= core.y && y < core.y + core.height;
+        }
+    };
+
+    // The tiles of an image geometry, with their scale space textures
+    struct TileSet {
+        gls::size imageSize;
+        gls::size sections;
+        std::vector<std::unique_ptr<SURFTile>> tiles;
+    };
+
+    // Tile sets of the recently seen image geometries, most recently used first: registering the frames of mixed
+    // cameras, or the integral() and detect() images next to detectAndCompute's, reuses them instead of reallocating
+    static const int kMaxTileSets = 3;
+    mutable std::vector<std::unique_ptr<TileSet>> _tileSets;
+
+    // Merged keypoints of the last detectAndCompute into a KeyPoint vector
+    mutable std::unique_ptr<KeyPoints> _keypointArrays;
+
+    const std::vector<std::unique_ptr<SURFTile>>& tiles(const gls::size& imageSize, const gls::size& sections) const;
+
+    // The single tile covering an image of imageSize, for integral() and detect()
+    SURFTile* wholeImageTile(const gls::size& imageSize) const {
+        return tiles(imageSize, /*sections=*/ {1, 1})[0].get();
+    }
+
     void calcDetAndTrace(const gls::mtl_image_2d<float>& sumImage, gls::mtl_image_2d<float>* detImage,
                          gls::mtl_image_2d<float>* traceImage, const int sampleStep,
                          const DetAndTraceHaarPattern& haarPattern) const {
         _calcDetAndTrace(_gpuContext, sumImage, detImage, traceImage, sampleStep, haarPattern);
     }
 
-    void findMaximaInLayer(const std::array<const gls::mtl_image_2d<float>*, 3>& dets,
-                           const gls::mtl_image_2d<float>& traceImage, const std::array<int, 3>& sizes, int octave,
-                           float hessianThreshold, int sampleStep) const;
-
     void Build(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum, const std::vector<int>& sizes,
                const std::vector<int>& sampleSteps, const std::vector<gls::mtl_image_2d<float>::unique_ptr>& dets,
                const std::vector<gls::mtl_image_2d<float>::unique_ptr>& traces) const;
 
+    // Maxima detected beyond the requested features, for the adaptive threshold's estimation error
+    static const int kDetectionThresholdMargin = 2;
+
     void Find(const std::vector<gls::mtl_image_2d<float>::unique_ptr>& dets,
               const std::vector<gls::mtl_image_2d<float>::unique_ptr>& traces, const std::vector<int>& sizes,
               const std::vector<int>& sampleSteps, const std::vector<int>& middleIndices,
-              std::vector<KeyPoint>* keypoints, int nOctaveLayers, float hessianThreshold) const;
+              int nOctaveLayers, float hessianThreshold, const findMaximaInLayerKernel& findMaximaInLayer,
+              const gls::rectangle& core) const;
 
-    void fastHessianDetector(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum,
+    void collectKeyPoints(const findMaximaInLayerKernel& findMaximaInLayer, std::vector<KeyPoint>* keypoints) const;
+
+    static void layerGeometry(int nOctaves, int nOctaveLayers, std::vector<int>* sizes, std::vector<int>* sampleSteps,
+                              std::vector<int>* middleIndices);
+
+    void encodeHessianDetector(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum,
+                               const std::vector<gls::mtl_image_2d<float>::unique_ptr>& dets,
+                               const std::vector<gls::mtl_image_2d<float>::unique_ptr>& traces,
+                               const findMaximaInLayerKernel& findMaximaInLayer, const gls::rectangle& core) const;
+
+    // The Hessian layers and the maxima of sum go in the tile's textures
+    void fastHessianDetector(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum, const SURFTile& tile,
                              std::vector<KeyPoint>* keypoints, int nOctaves, int nOctaveLayers, float hessianThreshold) const;
 
    public:
     SURFGPU(MetalContext* glsContext, int width, int height, int max_features = -1, int nOctaves = 4,
-                int nOctaveLayers = 2, float hessianThreshold = 0.02);
+                int nOctaveLayers = 2, float hessianThreshold = 0.02,
+                DescriptorType descriptorType = DescriptorType::SURF, bool halfPrecisionScaleSpace = false);
+
+    Parameters parameters() const override {
+        return { _max_features, _nOctaves, _nOctaveLayers, _hessianThreshold, _descriptorType, _halfPrecisionScaleSpace };
+    }
 
     void integral(const gls::image<float>& inputImage, const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum) const override  {
-        _integralImage(_gpuContext, inputImage, sum);
+        wholeImageTile(inputImage.size())->integralImage(_gpuContext, inputImage, sum);
     }
 
     void detect(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& integralSum,
                 std::vector<KeyPoint>* keypoints) const override {
-        fastHessianDetector(integralSum, keypoints, _nOctaves, _nOctaveLayers, _hessianThreshold);
+        // The integral image sum is one pixel bigger than the source image
+        const auto tile = wholeImageTile({integralSum[0]->width - 1, integralSum[0]->height - 1});
+        fastHessianDetector(integralSum, *tile, keypoints, _nOctaves, _nOctaveLayers, _hessianThreshold);
     }
 
     void detectAndCompute(const gls::image<float>& img, std::vector<KeyPoint>* keypoints,
@@ -1073,65 +1887,117 @@ class SURFGPU : public SURF {
         detectAndCompute(img, keypoints, _descriptors, /*sections=*/ {1, 1});
     }
 
+    void detectAndCompute(const gls::image<float>& img, std::unique_ptr<KeyPoints>* keypoints) const override {
+        detectAndCompute(img, keypoints, /*sections=*/ {1, 1});
+    }
+
     void detectAndCompute(const gls::image<float>& img, std::vector<KeyPoint>* keypoints,
                           gls::image<float>::unique_ptr* _descriptors, gls::size sections) const;
 
-    std::vector<DMatch> matchKeyPoints(const gls::image<float>& descriptor1,
+    void detectAndCompute(const gls::image<float>& img, std::unique_ptr<KeyPoints>* keypoints,
+                          gls::size sections) const;
+
+    gls::frame_vector<DMatch> matchKeyPoints(const gls::image<float>& descriptor1,
                                        const gls::image<float>& descriptor2) const override {
-#if USE_GPU_KEYPOINT_MATCH
+        if (_descriptorType == DescriptorType::BRIEF) {
+            return _ratioTestMatch.hamming(_gpuContext, descriptor1, descriptor2);
+        }
+#if USE_GPU_KEYPOINT_MATCH && USE_RATIO_TEST_MATCH
+        return _ratioTestMatch(_gpuContext, descriptor1, descriptor2);
+#elif USE_GPU_KEYPOINT_MATCH
         return _matchKeyPoints(_gpuContext, descriptor1, descriptor2);
 #else
-        std::vector<DMatch> matchedPoints;
+        gls::frame_vector<DMatch> matchedPoints;
         gls::matchKeyPoints(descriptor1, descriptor2, &matchedPoints);
         return matchedPoints;
 #endif
     }
+
+    gls::frame_vector<DMatch> matchKeyPoints(const KeyPoints& keypoints1, const KeyPoints& keypoints2) const override {
+        if (!keypoints1.hasDescriptors() || !keypoints2.hasDescriptors()) {
+            throw std::runtime_error("matchKeyPoints: the keypoints have no descriptors");
+        }
+        if (_descriptorType == DescriptorType::BRIEF) {
+            return _ratioTestMatch.match(_gpuContext, _ratioTestMatch.matchKeyPointsHamming, keypoints1.descriptors(),
+                                         (int) keypoints1.size(), keypoints2.descriptors(), (int) keypoints2.size(),
+                                         /*ratio=*/ 0.8, /*crossCheck=*/ true);
+        }
+#if USE_GPU_KEYPOINT_MATCH && USE_RATIO_TEST_MATCH
+        return _ratioTestMatch(_gpuContext, keypoints1.descriptors(), (int) keypoints1.size(),
+                               keypoints2.descriptors(), (int) keypoints2.size());
+#elif USE_GPU_KEYPOINT_MATCH
+        return _matchKeyPoints(_gpuContext, keypoints1.descriptors(), (int) keypoints1.size(),
+                               keypoints2.descriptors(), (int) keypoints2.size());
+#else
+        return matchKeyPoints(*keypoints1.descriptorImage(), *keypoints2.descriptorImage());
+#endif
+    }
+
+    std::vector<gls::frame_vector<DMatch>> matchKeyPoints(const KeyPoints& keypoints1,
+                                                          std::span<const KeyPoints* const> frames) const override {
+        const bool brief = _descriptorType == DescriptorType::BRIEF;
+        if (brief || (USE_GPU_KEYPOINT_MATCH && USE_RATIO_TEST_MATCH)) {
+            if (!keypoints1.hasDescriptors()) {
+                throw std::runtime_error("matchKeyPoints: the keypoints have no descriptors");
+            }
+            std::vector<ratioTestMatchKernel::BatchFrame> batch;
+            for (const auto* frame : frames) {
+                if (!frame->hasDescriptors()) {
+                    throw std::runtime_error("matchKeyPoints: the keypoints have no descriptors");
+                }
+                batch.push_back({ &frame->descriptors(), (int) frame->size() });
+            }
+            return _ratioTestMatch.matchBatch(_gpuContext, brief ? _ratioTestMatch.matchKeyPointsHammingBatch
+                                                                 : _ratioTestMatch.matchKeyPointsTiledBatch,
+                                              descriptorSize(_descriptorType), keypoints1.descriptors(),
+                                              (int) keypoints1.size(), batch, /*ratio=*/ 0.8, /*crossCheck=*/ true);
+        }
+        std::vector<gls::frame_vector<DMatch>> matches;
+        for (const auto* frame : frames) {
+            matches.push_back(matchKeyPoints(keypoints1, *frame));
+        }
+        return matches;
+    }
 };
 
 std::unique_ptr<SURF> SURF::makeInstance(MetalContext* glsContext, int width, int height, int max_features,
-                                         int nOctaves, int nOctaveLayers, float hessianThreshold) {
+                                         int nOctaves, int nOctaveLayers, float hessianThreshold,
+                                         DescriptorType descriptorType, bool halfPrecisionScaleSpace) {
+    gls::GPUMemoryTracker::Scope scope("SURF");
     return std::make_unique<SURFGPU>(glsContext, width, height, max_features, nOctaves, nOctaveLayers,
-                                         hessianThreshold);
+                                         hessianThreshold, descriptorType, halfPrecisionScaleSpace);
 }
 
 SURFGPU::SURFGPU(MetalContext* glsContext, int width, int height, int max_features, int nOctaves,
-                         int nOctaveLayers, float hessianThreshold)
+                         int nOctaveLayers, float hessianThreshold, DescriptorType descriptorType,
+                         bool halfPrecisionScaleSpace)
     : _gpuContext(glsContext),
-      _width(width),
-      _height(height),
       _max_features(max_features),
       _nOctaves(nOctaves),
       _nOctaveLayers(nOctaveLayers),
       _hessianThreshold(hessianThreshold),
-      _integralImage(glsContext, {width, height}),
+      _descriptorType(descriptorType),
+      _halfPrecisionScaleSpace(halfPrecisionScaleSpace),
       _calcDetAndTrace(glsContext),
-      _findMaximaInLayer(glsContext, {width, height}),
-      _matchKeyPoints(glsContext)
+      _matchKeyPoints(glsContext),
+      _ratioTestMatch(glsContext),
+      _surfDescriptors(glsContext),
+      _briefDescriptors(glsContext)
 {
-    int nTotalLayers = (nOctaveLayers + 2) * nOctaves;
-
-    if (_dets.size() != nTotalLayers) {
-        LOG_INFO(TAG) << "resizing dets and traces vectors to " << nTotalLayers << std::endl;
-        _dets.resize(nTotalLayers);
-        _traces.resize(nTotalLayers);
+#if !USE_GPU_DESCRIPTORS
+    if (descriptorType == DescriptorType::BRIEF) {
+        throw std::runtime_error("BRIEF descriptors require USE_GPU_DESCRIPTORS");
     }
-
-    // Allocate space for each layer
-    int index = 0, step = SAMPLE_STEP0;
-
-    for (int octave = 0; octave < nOctaves; octave++) {
-        for (int layer = 0; layer < nOctaveLayers + 2; layer++) {
-            /* The integral image sum is one pixel bigger than the source image*/
-            if (_dets[index] == nullptr) {
-                _dets[index] = std::make_unique<gls::mtl_image_2d<float>>(_gpuContext->device(), width / step,
-                                                                                height / step);
-                _traces[index] = std::make_unique<gls::mtl_image_2d<float>>(_gpuContext->device(),
-                                                                                  width / step, height / step);
-            }
-            index++;
-        }
-        step *= 2;
+#endif
+#if !USE_GPU_HESSIAN_DETECTOR
+    // The CPU detector maps the layers
+    if (halfPrecisionScaleSpace) {
+        throw std::runtime_error("Half precision scale space requires USE_GPU_HESSIAN_DETECTOR");
     }
+#endif
+
+    // The textures of the instance's image size are allocated upfront, other sizes on first use
+    tiles({width, height}, /*sections=*/ {1, 1});
 }
 
 void SURFGPU::Build(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum, const std::vector<int>& sizes,
@@ -1170,41 +2036,60 @@ void SURFGPU::Build(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& s
     }
 }
 
-void SURFGPU::findMaximaInLayer(const std::array<const gls::mtl_image_2d<float>*, 3>& dets,
-                                const gls::mtl_image_2d<float>& traceImage, const std::array<int, 3>& sizes,
-                                int octave, float hessianThreshold, int sampleStep) const {
-    _findMaximaInLayer(_gpuContext, dets, traceImage, sizes, octave, hessianThreshold, sampleStep);
-}
-
 void SURFGPU::Find(const std::vector<gls::mtl_image_2d<float>::unique_ptr>& dets,
                        const std::vector<gls::mtl_image_2d<float>::unique_ptr>& traces, const std::vector<int>& sizes,
                        const std::vector<int>& sampleSteps, const std::vector<int>& middleIndices,
-                       std::vector<KeyPoint>* keypoints, int nOctaveLayers, float hessianThreshold) const {
+                       int nOctaveLayers, float hessianThreshold,
+                       const findMaximaInLayerKernel& findMaximaInLayer, const gls::rectangle& core) const {
     int M = (int)middleIndices.size();
     LOG_INFO(TAG) << "enqueueing " << M << " findMaximaInLayer" << std::endl;
-    for (int i = 0; i < M; i++) {
-        const int layer = middleIndices[i];
-        const int octave = i / nOctaveLayers;
+    const int nOctaves = M / nOctaveLayers;
+
+    // The coarsest octave first, its maxima set the threshold of the finer ones so that a textured scene doesn't
+    // interpolate and select many times the maxima kept, see estimateDetectionThreshold
+    for (int octave = nOctaves - 1; octave >= 0; octave--) {
+        for (int i = octave * nOctaveLayers; i < (octave + 1) * nOctaveLayers; i++) {
+            const int layer = middleIndices[i];
 
-        const std::array<const gls::mtl_image_2d<float>*, 3> detImages = {dets[layer - 1].get(), dets[layer].get(),
-                                                                         dets[layer + 1].get()};
+            const std::array<const gls::mtl_image_2d<float>*, 3> detImages = {dets[layer - 1].get(), dets[layer].get(),
+                                                                             dets[layer + 1].get()};
 
-        const auto traceImage = traces[layer].get();
+            const auto traceImage = traces[layer].get();
 
-        findMaximaInLayer(detImages, *traceImage, {sizes[layer - 1], sizes[layer], sizes[layer + 1]}, octave,
-                          hessianThreshold, sampleSteps[layer]);
+            findMaximaInLayer(_gpuContext, detImages, *traceImage, {sizes[layer - 1], sizes[layer], sizes[layer + 1]},
+                              octave, hessianThreshold, sampleSteps[layer]);
+        }
+
+        if (octave == nOctaves - 1 && nOctaves > 1 && _max_features > 0) {
+            // Samples of the whole scale space per sample of the coarsest octave
+            float octaveScale = 0;
+            for (int o = 0; o < nOctaves; o++) {
+                octaveScale += (float) (1 << (2 * (nOctaves - 1 - o)));
+            }
+            // The estimate is rough, keep a margin for the exact selection of selectKeyPoints
+            findMaximaInLayer.estimateDetectionThreshold(_gpuContext, kDetectionThresholdMargin * _max_features,
+                                                         octaveScale, core);
+        }
     }
+}
 
+// Reads back the maxima found by Find, the GPU work must have completed
+void SURFGPU::collectKeyPoints(const findMaximaInLayerKernel& findMaximaInLayer,
+                               std::vector<KeyPoint>* keypoints) const {
     // Collect results
     // FIXME: make a proper accessor for _keyPointsBuffer
-    const auto keyPointMaxima = (KeyPointMaxima*)_findMaximaInLayer._keyPointsBuffer->contents();
+    const auto keyPointMaxima = (KeyPointMaxima*)findMaximaInLayer._keyPointsBuffer->contents();
 //    const auto keyPointMaxima = (KeyPointMaxima*)cl::enqueueMapBuffer(
 //        _keyPointsBuffer, true, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(KeyPointMaxima));
 
-    LOG_INFO(TAG) << "keyPointMaxima: " << keyPointMaxima->count << std::endl;
-    std::span<KeyPoint> newElements(keyPointMaxima->keyPoints,
-                                    std::min(keyPointMaxima->count, KeyPointMaxima::MaxCount));
-    keypoints->insert(end(*keypoints), begin(newElements), end(newElements));
+    const int selectedCount = findMaximaInLayer.selectedCount();
+    LOG_INFO(TAG) << "keyPointMaxima: " << keyPointMaxima->count << ", selected: " << selectedCount << std::endl;
+    // Only the selected keypoints are read back
+    const auto& selected = findMaximaInLayer.selectedKeyPoints();
+    keypoints->reserve(keypoints->size() + selectedCount);
+    for (int i = 0; i < selectedCount; i++) {
+        keypoints->push_back(selected[i]);
+    }
 
     // Reset count
     keyPointMaxima->count = 0;
@@ -1226,48 +2111,86 @@ struct KeypointGreater {
     }
 };
 
-void SURFGPU::fastHessianDetector(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum,
-                                  std::vector<KeyPoint>* keypoints, int nOctaves, int nOctaveLayers,
-                                  float hessianThreshold) const {
+// Filter sizes and sampling steps of each layer, and the indices of the layers searched for maxima
+void SURFGPU::layerGeometry(int nOctaves, int nOctaveLayers, std::vector<int>* sizes, std::vector<int>* sampleSteps,
+                            std::vector<int>* middleIndices) {
     int nTotalLayers = (nOctaveLayers + 2) * nOctaves;
     int nMiddleLayers = nOctaveLayers * nOctaves;
 
-    std::vector<int> sizes(nTotalLayers);
-    std::vector<int> sampleSteps(nTotalLayers);
-    std::vector<int> middleIndices(nMiddleLayers);
+    sizes->resize(nTotalLayers);
+    sampleSteps->resize(nTotalLayers);
+    middleIndices->resize(nMiddleLayers);
 
     // Calculate properties of each layer
     int index = 0, middleIndex = 0, step = SAMPLE_STEP0;
 
     for (int octave = 0; octave < nOctaves; octave++) {
         for (int layer = 0; layer < nOctaveLayers + 2; layer++) {
-            sizes[index] = (SURF_HAAR_SIZE0 + SURF_HAAR_SIZE_INC * layer) << octave;
-            sampleSteps[index] = step;
+            (*sizes)[index] = (SURF_HAAR_SIZE0 + SURF_HAAR_SIZE_INC * layer) << octave;
+            (*sampleSteps)[index] = step;
 
             if (0 < layer && layer <= nOctaveLayers) {
-                middleIndices[middleIndex++] = index;
+                (*middleIndices)[middleIndex++] = index;
             }
             index++;
         }
         step *= 2;
     }
+}
+
+// Encodes the Hessian layers, the maxima search and the selection of the strongest keypoints in core, the
+// keypoints are available with collectKeyPoints once the GPU work has completed
+void SURFGPU::encodeHessianDetector(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum,
+                                    const std::vector<gls::mtl_image_2d<float>::unique_ptr>& dets,
+                                    const std::vector<gls::mtl_image_2d<float>::unique_ptr>& traces,
+                                    const findMaximaInLayerKernel& findMaximaInLayer,
+                                    const gls::rectangle& core) const {
+    std::vector<int> sizes, sampleSteps, middleIndices;
+    layerGeometry(_nOctaves, _nOctaveLayers, &sizes, &sampleSteps, &middleIndices);
+
+    MetalContext::BatchScope batch(_gpuContext);
+    {
+        // The layers are independent, their passes can overlap
+        MetalContext::ConcurrentScope concurrent(_gpuContext);
+
+        // Calculate hessian determinant and trace samples in each layer
+        Build(sum, sizes, sampleSteps, dets, traces);
+    }
+
+    // Find maxima in the determinant of the hessian
+    Find(dets, traces, sizes, sampleSteps, middleIndices, _nOctaveLayers, _hessianThreshold, findMaximaInLayer, core);
+
+    findMaximaInLayer.selectKeyPoints(_gpuContext, _max_features > 0 ? _max_features : KeyPointMaxima::MaxCount, core);
+}
 
+void SURFGPU::fastHessianDetector(const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum, const SURFTile& tile,
+                                  std::vector<KeyPoint>* keypoints, int nOctaves, int nOctaveLayers,
+                                  float hessianThreshold) const {
     auto t_start = std::chrono::high_resolution_clock::now();
 
 #if USE_GPU_HESSIAN_DETECTOR
-    // Calculate hessian determinant and trace samples in each layer
-    Build(sum, sizes, sampleSteps, _dets, _traces);
+    {
+        MetalContext::BatchScope batch(_gpuContext);
 
-    // Find maxima in the determinant of the hessian
-    Find(_dets, _traces, sizes, sampleSteps, middleIndices, keypoints, nOctaveLayers, hessianThreshold);
+        encodeHessianDetector(sum, tile.dets, tile.traces, tile.findMaximaInLayer,
+                              gls::rectangle({0, 0, sum[0]->width - 1, sum[0]->height - 1}));
+
+        // Single sync for all the octaves, it also commits the integral passes of an enclosing batch
+        _gpuContext->waitForCompletion();
+    }
+
+    collectKeyPoints(tile.findMaximaInLayer, keypoints);
 #else
+    std::vector<int> sizes, sampleSteps, middleIndices;
+    layerGeometry(nOctaves, nOctaveLayers, &sizes, &sampleSteps, &middleIndices);
+
     const auto sumCpu = sum[0]->mapImage();
     std::vector<gls::image<float>::unique_ptr> detsCpu;
-    for (auto& mtl_det : _dets) {
+    for (auto& mtl_det : tile.dets) {
         detsCpu.push_back(mtl_det->mapImage());
     }
     std::vector<gls::image<float>::unique_ptr> tracesCpu;
-    for (auto& mtl_trace : _traces) {
+    for (auto& mtl_trace : tile.traces) {
         tracesCpu.push_back(mtl_trace->mapImage());
     }
 
@@ -1295,7 +2218,7 @@ double timeDiff(time_point t_start, time_point t_end) {
     return std::chrono::duration<double, std::milli>(t_end - t_start).count();
 }
 
-static bool keypointsAvailable(const std::vector<size_t>& kptIndices, const std::vector<size_t>& kptSizes) {
+static bool keypointsAvailable(const gls::frame_vector<size_t>& kptIndices, const gls::frame_vector<size_t>& kptSizes) {
     for (int i = 0; i < kptIndices.size(); i++) {
         if (kptIndices[i] < kptSizes[i]) {
             return true;
@@ -1304,8 +2227,7 @@ static bool keypointsAvailable(const std::vector<size_t>& kptIndices, const std:
     return false;
 }
 
-static int maxKeypointIndex(const std::vector<size_t>& kptIndices,
-                            const std::vector<std::unique_ptr<std::vector<KeyPoint>>>& allKeypoints) {
+static int maxKeypointIndex(const gls::frame_vector<size_t>& kptIndices, const gls::frame_vector<KeyPoints*>& allKeypoints) {
     int maxIndex = -1;
     for (int i = 0; i < kptIndices.size(); i++) {
         if (kptIndices[i] < allKeypoints[i]->size()) {
@@ -1321,38 +2243,27 @@ static int maxKeypointIndex(const std::vector<size_t>& kptIndices,
     return maxIndex;
 }
 
-// Merge individually sorted keypoint vectors into a single keypoint vector
-static void mergeKeypoints(const std::vector<std::unique_ptr<std::vector<KeyPoint>>>& allKeypoints,
-                           std::vector<KeyPoint>* keypoints,
-                           const std::vector<gls::image<float>::unique_ptr>& allDescriptors,
-                           gls::image<float>::unique_ptr* descriptors) {
+// Merge individually sorted keypoint arrays, and their descriptors, into a single keypoint array. The result reuses
+// the arrays of *keypoints when they are large enough.
+static void mergeKeypoints(MTL::Device* device, const gls::frame_vector<KeyPoints*>& allKeypoints,
+                           std::unique_ptr<KeyPoints>* keypoints, int descriptorSize) {
     // Find out how many keypoints we have
     int keypointsCount = 0;
     for (const auto& kps : allKeypoints) {
+        // Make sure we have corresponding descriptors for all keypoints
+        assert(kps->empty() || (kps->hasDescriptors() && kps->descriptorSize() == descriptorSize));
         keypointsCount += kps->size();
     }
 
-    // Make sure we have corresponding descriptors for all keypoints
-    if (descriptors) {
-        assert(allKeypoints.size() == allDescriptors.size());
-
-        int descriptorsCount = 0;
-        for (const auto& d : allDescriptors) {
-            descriptorsCount += d->height;
-        }
-        assert(keypointsCount == descriptorsCount);
-    }
-
     // Allocate space for the result
-    keypoints->clear();
-    keypoints->resize(keypointsCount);
-
-    if (descriptors != nullptr) {
-        *descriptors = std::make_unique<gls::image<float>>(64, keypointsCount);
+    if (!*keypoints || (*keypoints)->capacity() < keypointsCount) {
+        *keypoints = std::make_unique<KeyPoints>(device, keypointsCount);
     }
+    (*keypoints)->resize(keypointsCount);
+    (*keypoints)->allocateDescriptors(device, descriptorSize);
 
-    std::vector<size_t> kptIndices(allKeypoints.size());
-    std::vector<size_t> kptSizes(allKeypoints.size());
+    gls::frame_vector<size_t> kptIndices(allKeypoints.size());
+    gls::frame_vector<size_t> kptSizes(allKeypoints.size());
     for (int i = 0; i < allKeypoints.size(); i++) {
         kptIndices[i] = 0;
         kptSizes[i] = allKeypoints[i]->size();
@@ -1365,16 +2276,11 @@ static void mergeKeypoints(const std::vector<std::unique_ptr<std::vector<KeyPoin
         // Find max keypoint index
         int maxIndex = maxKeypointIndex(kptIndices, allKeypoints);
 
-        // Copy keypoint to output
-        (*keypoints)[outIndex] = (*allKeypoints[maxIndex])[kptIndices[maxIndex]];
-
-        // Copy descriptor to output
-        if (descriptors != nullptr) {
-            float* outPtr = (**descriptors)[outIndex];
-            float* descPtr = (*allDescriptors[maxIndex])[(int)kptIndices[maxIndex]];
+        // Copy keypoint and descriptor to output
+        (*keypoints)->set(outIndex, (*allKeypoints[maxIndex])[kptIndices[maxIndex]]);
+        memcpy((*keypoints)->descriptor(outIndex), allKeypoints[maxIndex]->descriptor(kptIndices[maxIndex]),
+               descriptorSize * sizeof(float));
 
-            memcpy(outPtr, descPtr, 64 * sizeof(float));
-        }
         kptIndices[maxIndex]++;
         outIndex++;
     }
@@ -1382,61 +2288,174 @@ static void mergeKeypoints(const std::vector<std::unique_ptr<std::vector<KeyPoin
     assert(outIndex == keypointsCount);
 }
 
-void SURFGPU::detectAndCompute(const gls::image<float>& img, std::vector<KeyPoint>* keypoints,
-                               gls::image<float>::unique_ptr* descriptors, gls::size sections) const {
-    std::vector<gls::rectangle> tiles(sections.width * sections.height);
+const std::vector<std::unique_ptr<SURFGPU::SURFTile>>& SURFGPU::tiles(const gls::size& imageSize,
+                                                                      const gls::size& sections) const {
+    const auto cached = std::find_if(_tileSets.begin(), _tileSets.end(), [&](const std::unique_ptr<TileSet>& tileSet) {
+        return tileSet->imageSize == imageSize && tileSet->sections == sections;
+    });
+    if (cached != _tileSets.end()) {
+        std::rotate(_tileSets.begin(), cached, cached + 1);
+        return _tileSets.front()->tiles;
+    }
 
-    const int tile_width = img.width / sections.width;
-    const int tile_height = img.height / sections.height;
+    // The skirt covers half the largest Haar filter and the 3x3 neighborhood of the maxima search. Tile origins
+    // are multiples of the coarsest sampling step, so that the sampling grids of overlapping tiles coincide.
+    const int maxStep = SAMPLE_STEP0 << (_nOctaves - 1);
+    const int maxSize = (SURF_HAAR_SIZE0 + SURF_HAAR_SIZE_INC * (_nOctaveLayers + 1)) << (_nOctaves - 1);
+    const int skirt = maxStep * ((maxSize / 2 + 2 * maxStep - 1) / maxStep);
 
-    LOG_INFO(TAG) << "Tile size: " << tile_width << " x " << tile_height << std::endl;
+    const int tile_width = maxStep * (imageSize.width / sections.width / maxStep);
+    const int tile_height = maxStep * (imageSize.height / sections.height / maxStep);
+
+    LOG_INFO(TAG) << "Tile size: " << tile_width << " x " << tile_height << ", skirt: " << skirt << std::endl;
+
+    // The evicted tile set may still be in use by the GPU
+    if (_tileSets.size() >= kMaxTileSets) {
+        _gpuContext->waitForCompletion();
+        _tileSets.pop_back();
+    }
 
-    // TODO: Add a skirt overlap between tiles
-    int y_pos = 0;
+    gls::GPUMemoryTracker::Scope scope("SURF");
+    auto tileSet = std::make_unique<TileSet>(TileSet { imageSize, sections, {} });
     for (int j = 0; j < sections.height; j++) {
-        int x_pos = 0;
         for (int i = 0; i < sections.width; i++) {
-            tiles[j * sections.width + i] = gls::rectangle({x_pos, y_pos, tile_width, tile_height});
-            x_pos += tile_width;
+            // The last row and column of tiles extend to the image edges
+            const int x0 = i * tile_width;
+            const int y0 = j * tile_height;
+            const int x1 = i == sections.width - 1 ? imageSize.width : x0 + tile_width;
+            const int y1 = j == sections.height - 1 ? imageSize.height : y0 + tile_height;
+
+            const int rx0 = std::max(x0 - skirt, 0);
+            const int ry0 = std::max(y0 - skirt, 0);
+            const int rx1 = std::min(x1 + skirt, imageSize.width);
+            const int ry1 = std::min(y1 + skirt, imageSize.height);
+
+            tileSet->tiles.push_back(std::make_unique<SURFTile>(_gpuContext, gls::rectangle({rx0, ry0, rx1 - rx0, ry1 - ry0}),
+                                                        gls::rectangle({x0, y0, x1 - x0, y1 - y0}), _nOctaves,
+                                                        _nOctaveLayers, _halfPrecisionScaleSpace));
         }
-        y_pos += tile_height;
     }
+    _tileSets.insert(_tileSets.begin(), std::move(tileSet));
 
-    std::vector<gls::image<float>::unique_ptr> allDescriptors;
-    std::vector<std::unique_ptr<std::vector<KeyPoint>>> allKeypoints;
+    return _tileSets.front()->tiles;
+}
+
+void SURFGPU::detectAndCompute(const gls::image<float>& img, std::vector<KeyPoint>* keypoints,
+                               gls::image<float>::unique_ptr* descriptors, gls::size sections) const {
+    // The merged arrays are kept for the next call, the vector and the descriptors are reused when large enough
+    detectAndCompute(img, &_keypointArrays, sections);
 
-    auto sum = sumImageStack<float>(_gpuContext, tile_width + 1, tile_height + 1);
+    keypoints->clear();
+    _keypointArrays->append(keypoints);
 
-    for (const auto& tile : tiles) {
-        const auto tileImage = gls::image<float>(img, tile);
+    // The host image owns its copy of the descriptors, the KeyPoints are overwritten by the next detection
+    if (descriptors != nullptr) {
+        const auto view = _keypointArrays->descriptorImage();
+        if (!*descriptors || (*descriptors)->width != view->width || (*descriptors)->height != view->height) {
+            *descriptors = std::make_unique<gls::image<float>>(view->width, view->height);
+        }
+        const auto pixels = view->pixels();
+        std::copy(pixels.begin(), pixels.end(), (*descriptors)->pixels().begin());
+    }
+}
 
-        integral(tileImage, sum);
+void SURFGPU::detectAndCompute(const gls::image<float>& img, std::unique_ptr<KeyPoints>* keypoints,
+                               gls::size sections) const {
+    MetalContext::TraceScope trace(_gpuContext, "SURF");
+    const auto& tiles = this->tiles(img.size(), sections);
 
-        auto tileKeypoints = std::make_unique<std::vector<KeyPoint>>();
+    auto t_start_detection = std::chrono::high_resolution_clock::now();
 
-        fastHessianDetector(sum, tileKeypoints.get(), _nOctaves, _nOctaveLayers, _hessianThreshold);
+    {
+#if USE_BATCHED_DETECTION && USE_GPU_HESSIAN_DETECTOR
+        // The integral images and the detection passes of all the tiles go in a single command buffer
+        MetalContext::BatchScope batch(_gpuContext);
+#endif
+        for (const auto& tile : tiles) {
+            tile->integralImage(_gpuContext, gls::image<float>(img, tile->region), tile->sum);
+#if USE_GPU_HESSIAN_DETECTOR
+            encodeHessianDetector(tile->sum, tile->dets, tile->traces, tile->findMaximaInLayer, tile->localCore());
+#endif
+        }
+    }
+    _gpuContext->waitForCompletion();
+
+    // The keypoints of each tile stay in the arrays they are detected in, up to the merge
+    gls::frame_vector<KeyPoints*> allKeypoints;
+    allKeypoints.reserve(tiles.size());
+#if !USE_GPU_HESSIAN_DETECTOR
+    std::vector<std::unique_ptr<KeyPoints>> detectedKeypoints;
+#endif
+
+    for (const auto& tile : tiles) {
+#if USE_GPU_HESSIAN_DETECTOR
+        // The GPU only returns the strongest keypoints of the tile's core
+        KeyPoints* tileKeypoints = tile->findMaximaInLayer.selectedKeyPoints();
+        tileKeypoints->sortByResponse();
+#else
+        std::vector<KeyPoint> detected;
+        fastHessianDetector(tile->sum, *tile, &detected, _nOctaves, _nOctaveLayers, _hessianThreshold);
+        detectedKeypoints.push_back(std::make_unique<KeyPoints>(_gpuContext->device(), detected));
+        KeyPoints* tileKeypoints = detectedKeypoints.back().get();
+
+        // Keypoints of the overlapping skirts are only kept by the tile owning them
+        tileKeypoints->filter([&tile](const KeyPoints& kps, size_t i) { return tile->owns(kps[i]); });
+#endif
 
         // Limit the max number of feature points
         if (tileKeypoints->size() > _max_features) {
             LOG_INFO(TAG) << "detectAndCompute - dropping: " << (int)tileKeypoints->size() - _max_features
                           << " features out of " << (int)tileKeypoints->size() << std::endl;
-            tileKeypoints->erase(tileKeypoints->begin() + _max_features, tileKeypoints->end());
+            tileKeypoints->truncate(_max_features);
         }
 
-        int N = (int)tileKeypoints->size();
+        LOG_INFO(TAG) << "tileKeypoints: " << tileKeypoints->size() << std::endl;
 
-        LOG_INFO(TAG) << "tileKeypoints: " << N << std::endl;
+        allKeypoints.push_back(tileKeypoints);
+    }
 
-        auto tileDescriptors = descriptors != nullptr ? std::make_unique<gls::image<float>>(64, N) : nullptr;
+    auto t_start_descriptor = std::chrono::high_resolution_clock::now();
+    LOG_INFO(TAG) << "--> detection Time: " << timeDiff(t_start_detection, t_start_descriptor) << std::endl;
 
-        auto t_start_descriptor = std::chrono::high_resolution_clock::now();
+    // The descriptors of each tile are written next to its keypoints, the tile arrays keep their buffers
+    const int descriptorSize = SURF::descriptorSize(_descriptorType);
+    for (auto tileKeypoints : allKeypoints) {
+        tileKeypoints->allocateDescriptors(_gpuContext->device(), descriptorSize);
+    }
 
-        const auto integralSumCpu = sum[0]->mapImage();
+#if USE_GPU_DESCRIPTORS
+    // Orientation and descriptors of all the tiles in a single submission
+    {
+        MetalContext::BatchScope batch(_gpuContext);
+        for (int t = 0; t < tiles.size(); t++) {
+            const auto& tileKeypoints = *allKeypoints[t];
 
-        // we call SURFInvoker in any case, even if we do not need descriptors,
-        // since it computes orientation of each feature.
-        descriptor(tileImage, *integralSumCpu, tileKeypoints.get(),
-                   descriptors != nullptr ? tileDescriptors.get() : nullptr);
+            if (tileKeypoints.empty()) {
+                continue;
+            }
+            // The kernels read the keypoints and write their orientation in place
+            if (_descriptorType == DescriptorType::BRIEF) {
+                _briefDescriptors(_gpuContext, *tiles[t]->sum[0], tileKeypoints, tileKeypoints.descriptors());
+            } else {
+                _surfDescriptors(_gpuContext, *tiles[t]->sum[0], tileKeypoints, tileKeypoints.descriptors());
+            }
+        }
+    }
+    _gpuContext->waitForCompletion();
+#else
+    for (int t = 0; t < tiles.size(); t++) {
+        const auto& tile = tiles[t];
+        std::vector<KeyPoint> tileKeypoints;
+        allKeypoints[t]->append(&tileKeypoints);
+        const auto tileDescriptors = allKeypoints[t]->descriptorImage();
+
+        const auto integralSumCpu = tile->sum[0]->mapImage();
+
+        // SURFInvoker computes the orientation of each feature along with its descriptor
+        descriptor(gls::image<float>(img, tile->region), *integralSumCpu, &tileKeypoints, tileDescriptors.get());
+        for (int k = 0; k < tileKeypoints.size(); k++) {
+            allKeypoints[t]->set(k, tileKeypoints[k]);
+        }
 
 #if DEBUG_RECONSTRUCTED_IMAGE
         static int count = 0;
@@ -1448,29 +2467,162 @@ void SURFGPU::detectAndCompute(const gls::image<float>& img, std::vector<KeyPoin
         });
         reconstructed.write_png_file("/Users/fabio/reconstructed" + std::to_string(count++) + ".png");
 #endif
-        // sum[0]->unmapImage(integralSumCpu);
+    }
+#endif
+
+    auto t_end_descriptor = std::chrono::high_resolution_clock::now();
+    LOG_INFO(TAG) << "--> descriptor Time: " << timeDiff(t_start_descriptor, t_end_descriptor) << std::endl;
+
+    // Translate tile keypoints to their full image locations
+    for (int t = 0; t < tiles.size(); t++) {
+        allKeypoints[t]->translate(Point2f(tiles[t]->region.x, tiles[t]->region.y));
+    }
+
+    mergeKeypoints(_gpuContext->device(), allKeypoints, keypoints, descriptorSize);
+
+    LOG_INFO(TAG) << "Collected " << (*keypoints)->size() << " keypoints" << std::endl;
+}
+
+// The prior seeded matching of SURF::findMatches over the keypoint positions point1(i) and point2(j)
+template <typename Point1, typename Point2>
+static gls::frame_vector<std::pair<Point2f, Point2f>> findMatchesWithPrior(bool hamming,
+                                                                      const gls::image<float>& descriptors1, int count1, Point1 point1,
+                                                                      const gls::image<float>& descriptors2, int count2, Point2 point2,
+                                                                      const gls::Matrix<3, 3>& prior, float searchRadius, float ratio) {
+    const int descriptorSize = descriptors1.width;
+    assert(descriptors2.width == descriptorSize);
+
+    // Squared L2 for SURF, Hamming for the BRIEF bits stored in the floats
+    const auto distance = [&](int i, int j) -> float {
+        const float* d1 = &descriptors1[i][0];
+        const float* d2 = &descriptors2[j][0];
+        if (hamming) {
+            int bits = 0;
+            for (int k = 0; k < descriptorSize; k++) {
+                bits += std::popcount(std::bit_cast<uint32_t>(d1[k]) ^ std::bit_cast<uint32_t>(d2[k]));
+            }
+            return bits;
+        }
+        float sum = 0;
+        for (int k = 0; k < descriptorSize; k++) {
+            const float diff = d1[k] - d2[k];
+            sum += diff * diff;
+        }
+        return sum;
+    };
+    const float ratioThreshold = hamming ? ratio : ratio * ratio;
+
+    // Bucket the keypoints2 in a grid of searchRadius cells, a window spans at most 3x3 cells
+    const float cellSize = std::max(searchRadius, 1.0f);
+    float maxX = 0, maxY = 0;
+    for (int j = 0; j < count2; j++) {
+        const auto pt = point2(j);
+        maxX = std::max(maxX, pt.x);
+        maxY = std::max(maxY, pt.y);
+    }
+    const int gridWidth = (int) (maxX / cellSize) + 1;
+    const int gridHeight = (int) (maxY / cellSize) + 1;
+    const auto cellIndex = [&](int j) {
+        const auto pt = point2(j);
+        return (int) (pt.y / cellSize) * gridWidth + (int) (pt.x / cellSize);
+    };
+    // The keypoints of cell c are cellItems[cellStart[c]...cellStart[c + 1]), two flat arrays counting sorted
+    gls::frame_vector<int> cellStart(gridWidth * gridHeight + 1, 0);
+    gls::frame_vector<int> cellItems(count2);
+    for (int j = 0; j < count2; j++) {
+        cellStart[cellIndex(j) + 1]++;
+    }
+    for (int c = 0; c < gridWidth * gridHeight; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+    {
+        gls::frame_vector<int> cellFill(cellStart.begin(), cellStart.end() - 1);
+        for (int j = 0; j < count2; j++) {
+            cellItems[cellFill[cellIndex(j)]++] = j;
+        }
+    }
 
-        // Translate tile keypoints to their full image locations
-        for (auto& kp : *tileKeypoints) {
-            kp.pt += Point2f(tile.x, tile.y);
+    const float radius2 = searchRadius * searchRadius;
+    gls::frame_vector<DMatch> candidates(count1);
+    gls::parallel_for(0, count1, /*grain=*/ 64, [&](int i0, int i1) {
+        for (int i = i0; i < i1; i++) {
+            const auto pt = point1(i);
+            const float w = prior[2][0] * pt.x + prior[2][1] * pt.y + prior[2][2];
+            const float px = (prior[0][0] * pt.x + prior[0][1] * pt.y + prior[0][2]) / w;
+            const float py = (prior[1][0] * pt.x + prior[1][1] * pt.y + prior[1][2]) / w;
+
+            float best = FLT_MAX, second = FLT_MAX;
+            int bestIndex = -1;
+            const int cx0 = std::max((int) std::floor((px - searchRadius) / cellSize), 0);
+            const int cx1 = std::min((int) std::floor((px + searchRadius) / cellSize), gridWidth - 1);
+            const int cy0 = std::max((int) std::floor((py - searchRadius) / cellSize), 0);
+            const int cy1 = std::min((int) std::floor((py + searchRadius) / cellSize), gridHeight - 1);
+            for (int cy = cy0; cy <= cy1; cy++) {
+                for (int cx = cx0; cx <= cx1; cx++) {
+                    for (int k = cellStart[cy * gridWidth + cx]; k < cellStart[cy * gridWidth + cx + 1]; k++) {
+                        const int j = cellItems[k];
+                        const auto pt2 = point2(j);
+                        const float dx = pt2.x - px;
+                        const float dy = pt2.y - py;
+                        if (dx * dx + dy * dy > radius2) {
+                            continue;
+                        }
+                        const float d = distance(i, j);
+                        if (d < best) {
+                            second = best;
+                            best = d;
+                            bestIndex = j;
+                        } else if (d < second) {
+                            second = d;
+                        }
+                    }
+                }
+            }
+            // A lone candidate in the window passes the ratio test
+            candidates[i] = bestIndex >= 0 && best < ratioThreshold * second ? DMatch(i, bestIndex, best) : DMatch();
         }
-        allKeypoints.push_back(std::move(tileKeypoints));
+    });
 
-        if (descriptors != nullptr) {
-            allDescriptors.push_back(std::move(tileDescriptors));
+    // Each keypoints2 keeps only its best match
+    gls::frame_vector<int> owner(count2, -1);
+    for (const auto& m : candidates) {
+        if (m.queryIdx >= 0 && (owner[m.trainIdx] < 0 || m.distance < candidates[owner[m.trainIdx]].distance)) {
+            owner[m.trainIdx] = m.queryIdx;
+        }
+    }
+    gls::frame_vector<DMatch> matchedPoints;
+    for (int j = 0; j < owner.size(); j++) {
+        if (owner[j] >= 0) {
+            matchedPoints.push_back(candidates[owner[j]]);
         }
+    }
+    std::stable_sort(matchedPoints.begin(), matchedPoints.end());
 
-        auto t_end_descriptor = std::chrono::high_resolution_clock::now();
-        LOG_INFO(TAG) << "--> descriptor Time: " << timeDiff(t_start_descriptor, t_end_descriptor) << std::endl;
+    gls::frame_vector<std::pair<Point2f, Point2f>> matches(matchedPoints.size());
+    for (int i = 0; i < matchedPoints.size(); i++) {
+        matches[i] = std::pair{point1(matchedPoints[i].queryIdx), point2(matchedPoints[i].trainIdx)};
     }
+    return matches;
+}
 
-    mergeKeypoints(allKeypoints, keypoints, allDescriptors, descriptors);
+gls::frame_vector<std::pair<Point2f, Point2f>> SURF::findMatches(const gls::image<float>& descriptors1, const std::vector<KeyPoint>& keypoints1,
+                                                           const gls::image<float>& descriptors2, const std::vector<KeyPoint>& keypoints2,
+                                                           const gls::Matrix<3, 3>& prior, float searchRadius, float ratio) const {
+    return findMatchesWithPrior(parameters().descriptorType == DescriptorType::BRIEF,
+                                descriptors1, (int) keypoints1.size(), [&](int i) { return keypoints1[i].pt; },
+                                descriptors2, (int) keypoints2.size(), [&](int j) { return keypoints2[j].pt; },
+                                prior, searchRadius, ratio);
+}
 
-    LOG_INFO(TAG) << "Collected " << keypoints->size() << " keypoints and " << (**descriptors).height << " descriptors"
-                  << std::endl;
+gls::frame_vector<std::pair<Point2f, Point2f>> SURF::findMatches(const KeyPoints& keypoints1, const KeyPoints& keypoints2,
+                                                           const gls::Matrix<3, 3>& prior, float searchRadius, float ratio) const {
+    return findMatchesWithPrior(parameters().descriptorType == DescriptorType::BRIEF,
+                                *keypoints1.descriptorImage(), (int) keypoints1.size(), [&](int i) { return keypoints1.point(i); },
+                                *keypoints2.descriptorImage(), (int) keypoints2.size(), [&](int j) { return keypoints2.point(j); },
+                                prior, searchRadius, ratio);
 }
 
-std::vector<std::pair<Point2f, Point2f>> SURF::detection(MetalContext* cLContext, const gls::image<float>& image1,
+gls::frame_vector<std::pair<Point2f, Point2f>> SURF::detection(MetalContext* cLContext, const gls::image<float>& image1,
                                                          const gls::image<float>& image2) {
     auto t_start = std::chrono::high_resolution_clock::now();
 
@@ -1480,6 +2632,13 @@ std::vector<std::pair<Point2f, Point2f>> SURF::detection(MetalContext* cLContext
     auto t_surf = std::chrono::high_resolution_clock::now();
     LOG_INFO(TAG) << "--> SURF Creation Time: " << timeDiff(t_start, t_surf) << std::endl;
 
+    return surf->detection(image1, image2);
+}
+
+gls::frame_vector<std::pair<Point2f, Point2f>> SURF::detection(const gls::image<float>& image1,
+                                                         const gls::image<float>& image2) const {
+    auto t_surf = std::chrono::high_resolution_clock::now();
+
     auto keypoints1 = std::make_unique<std::vector<KeyPoint>>();
     auto keypoints2 = std::make_unique<std::vector<KeyPoint>>();
     gls::image<float>::unique_ptr descriptor1, descriptor2;
@@ -1494,7 +2653,7 @@ std::vector<std::pair<Point2f, Point2f>> SURF::detection(MetalContext* cLContext
                   << std::endl;
 
     // (4) Match feature points
-    std::vector<DMatch> matchedPoints = surf->matchKeyPoints(*descriptor1, *descriptor2);
+    gls::frame_vector<DMatch> matchedPoints = surf->matchKeyPoints(*descriptor1, *descriptor2);
 
     auto t_match = std::chrono::high_resolution_clock::now();
     LOG_INFO(TAG) << "--> Keypoint Matching: " << timeDiff(t_detect, t_match) << std::endl;
@@ -1503,7 +2662,7 @@ std::vector<std::pair<Point2f, Point2f>> SURF::detection(MetalContext* cLContext
     LOG_INFO(TAG) << "--> Keypoint Sorting: " << timeDiff(t_match, t_sort) << std::endl;
 
     // Convert to Point2D format
-    std::vector<std::pair<Point2f, Point2f>> result(matchedPoints.size());
+    gls::frame_vector<std::pair<Point2f, Point2f>> result(matchedPoints.size());
     for (int i = 0; i < matchedPoints.size(); i++) {
         result[i] = std::pair{(*keypoints1)[matchedPoints[i].queryIdx].pt, (*keypoints2)[matchedPoints[i].trainIdx].pt};
     }
@@ -1511,7 +2670,7 @@ std::vector<std::pair<Point2f, Point2f>> SURF::detection(MetalContext* cLContext
     auto t_end = std::chrono::high_resolution_clock::now();
     LOG_INFO(TAG) << "--> Keypoint Matching & Sorting Time: " << timeDiff(t_detect, t_end) << std::endl;
 
-    double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+    double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_surf).count();
     LOG_INFO(TAG) << "--> Features Finding Time: " << elapsed_time_ms << std::endl;
 
     return result;
@@ -18,7 +18,12 @@
 
 #include <float.h>
 
+#include <span>
+#include <vector>
+
+#include "KeyPoints.hpp"
 #include "feature2d.hpp"
+#include "gls_frame_arena.hpp"
 #include "gls_mtl.hpp"
 #include "gls_mtl_image.hpp"
 #include "gls_linalg.hpp"
@@ -44,12 +49,40 @@ class DMatch {
 
 class SURF {
    public:
+    // Descriptors computed by detectAndCompute: SURF's 64 floats per keypoint, or 256 BRIEF tests for the
+    // alignment of burst frames, stored as 8 floats per keypoint holding the bits and matched with the Hamming
+    // distance. BRIEF descriptors require the GPU descriptors path.
+    enum class DescriptorType { SURF, BRIEF };
+
+    // The textures of a width x height image are allocated upfront, the instance detects on images of any size:
+    // the textures of the most recently used sizes are kept. With halfPrecisionScaleSpace the Hessian determinant
+    // and trace layers are fp16, half the memory and the bandwidth of the maxima search, requires the GPU detector.
     static std::unique_ptr<SURF> makeInstance(MetalContext* glsContext, int width, int height,
                                               int max_features = -1, int nOctaves = 4, int nOctaveLayers = 2,
-                                              float hessianThreshold = 0.02);
+                                              float hessianThreshold = 0.02,
+                                              DescriptorType descriptorType = DescriptorType::SURF,
+                                              bool halfPrecisionScaleSpace = false);
+
+    static int descriptorSize(DescriptorType descriptorType) {
+        return descriptorType == DescriptorType::BRIEF ? 8 : 64;
+    }
+
+    // The detection parameters the instance was created with
+    struct Parameters {
+        int max_features;
+        int nOctaves;
+        int nOctaveLayers;
+        float hessianThreshold;
+        DescriptorType descriptorType;
+        bool halfPrecisionScaleSpace = false;
+
+        bool operator==(const Parameters& other) const = default;
+    };
 
     virtual ~SURF() {}
 
+    virtual Parameters parameters() const = 0;
+
     virtual void integral(const gls::image<float>& img,
                           const std::array<gls::mtl_image_2d<float>::unique_ptr, 4>& sum) const = 0;
 
@@ -59,24 +92,79 @@ class SURF {
     virtual void detectAndCompute(const gls::image<float>& img, std::vector<KeyPoint>* keypoints,
                                   gls::image<float>::unique_ptr* _descriptors) const = 0;
 
-    virtual std::vector<DMatch> matchKeyPoints(const gls::image<float>& descriptor1,
+    // The keypoints in the structure of arrays the detection and the descriptors work on, without converting them to
+    // a KeyPoint vector, and with their descriptors in a Metal buffer. The arrays of *keypoints are reused when they
+    // are large enough, e.g. for the frames of a burst.
+    virtual void detectAndCompute(const gls::image<float>& img, std::unique_ptr<KeyPoints>* keypoints) const = 0;
+
+    virtual frame_vector<DMatch> matchKeyPoints(const gls::image<float>& descriptor1,
                                                const gls::image<float>& descriptor2) const = 0;
 
-    std::vector<std::pair<Point2f, Point2f>> findMatches(const gls::image<float>& descriptors1, const std::vector<KeyPoint>& keypoints1,
+    // Matches the descriptors of the KeyPoints in place, without staging them
+    virtual frame_vector<DMatch> matchKeyPoints(const KeyPoints& keypoints1, const KeyPoints& keypoints2) const = 0;
+
+    // Matches keypoints1, e.g. the reference of a burst, against the keypoints of every frame with one upload, one
+    // dispatch per direction and one wait for all of them, instead of a matchKeyPoints per frame. Returns the matches
+    // of each frame.
+    virtual std::vector<frame_vector<DMatch>> matchKeyPoints(const KeyPoints& keypoints1,
+                                                             std::span<const KeyPoints* const> frames) const = 0;
+
+    frame_vector<std::pair<Point2f, Point2f>> findMatches(const gls::image<float>& descriptors1, const std::vector<KeyPoint>& keypoints1,
                                                          const gls::image<float>& descriptors2, const std::vector<KeyPoint>& keypoints2) const {
-        std::vector<gls::DMatch> matchedPoints = matchKeyPoints(descriptors1, descriptors2);
+        frame_vector<gls::DMatch> matchedPoints = matchKeyPoints(descriptors1, descriptors2);
 
         // Convert to Point2D format
-        std::vector<std::pair<Point2f, Point2f>> matches(matchedPoints.size());
+        frame_vector<std::pair<Point2f, Point2f>> matches(matchedPoints.size());
         for (int i = 0; i < matchedPoints.size(); i++) {
             matches[i] = std::pair{keypoints1[matchedPoints[i].queryIdx].pt, keypoints2[matchedPoints[i].trainIdx].pt};
         }
         return matches;
     }
 
-    static std::vector<std::pair<Point2f, Point2f>> detection(MetalContext* cLContext,
+    std::vector<frame_vector<std::pair<Point2f, Point2f>>> findMatches(const KeyPoints& keypoints1,
+                                                                       std::span<const KeyPoints* const> frames) const {
+        const auto matchedPoints = matchKeyPoints(keypoints1, frames);
+
+        std::vector<frame_vector<std::pair<Point2f, Point2f>>> matches(frames.size());
+        for (int f = 0; f < frames.size(); f++) {
+            matches[f].resize(matchedPoints[f].size());
+            for (int i = 0; i < matchedPoints[f].size(); i++) {
+                matches[f][i] = std::pair{keypoints1.point(matchedPoints[f][i].queryIdx), frames[f]->point(matchedPoints[f][i].trainIdx)};
+            }
+        }
+        return matches;
+    }
+
+    frame_vector<std::pair<Point2f, Point2f>> findMatches(const KeyPoints& keypoints1, const KeyPoints& keypoints2) const {
+        frame_vector<gls::DMatch> matchedPoints = matchKeyPoints(keypoints1, keypoints2);
+
+        frame_vector<std::pair<Point2f, Point2f>> matches(matchedPoints.size());
+        for (int i = 0; i < matchedPoints.size(); i++) {
+            matches[i] = std::pair{keypoints1.point(matchedPoints[i].queryIdx), keypoints2.point(matchedPoints[i].trainIdx)};
+        }
+        return matches;
+    }
+
+    // Matching seeded by a predicted homography, e.g. from the gyro or the previous frame's motion, mapping the
+    // keypoints1 coordinates to the keypoints2's: every keypoint is only matched against the keypoints within
+    // searchRadius of its predicted location, with the ratio test among those. The matches are sorted by
+    // increasing descriptor distance, as FindHomography expects.
+    frame_vector<std::pair<Point2f, Point2f>> findMatches(const gls::image<float>& descriptors1, const std::vector<KeyPoint>& keypoints1,
+                                                         const gls::image<float>& descriptors2, const std::vector<KeyPoint>& keypoints2,
+                                                         const gls::Matrix<3, 3>& prior, float searchRadius, float ratio = 0.8) const;
+
+    frame_vector<std::pair<Point2f, Point2f>> findMatches(const KeyPoints& keypoints1, const KeyPoints& keypoints2,
+                                                         const gls::Matrix<3, 3>& prior, float searchRadius, float ratio = 0.8) const;
+
+    // Matched keypoints of two images with a new instance, e.g. for a one-off registration
+    static frame_vector<std::pair<Point2f, Point2f>> detection(MetalContext* cLContext,
                                                               const gls::image<float>& image1,
                                                               const gls::image<float>& image2);
+
+    // The same with this instance: repeated registrations keep an instance, its scale space textures are pooled by
+    // image size and nothing is allocated once the sizes have been seen
+    frame_vector<std::pair<Point2f, Point2f>> detection(const gls::image<float>& image1,
+                                                       const gls::image<float>& image2) const;
 };
 
 }  // namespace gls
@@ -262,6 +262,7 @@ kernel void findMaximaInLayer(texture2d<float> detImage0        [[texture(0)]],
                               constant int& octave              [[buffer(7)]],
                               constant float& hessianThreshold  [[buffer(8)]],
                               constant int& sampleStep          [[buffer(9)]],
+                              device const float* detectionThreshold [[buffer(10)]],
                               uint2 index                       [[thread_position_in_grid]]) {
     const int2 p = int2(index) + margin;
 
@@ -269,7 +270,8 @@ kernel void findMaximaInLayer(texture2d<float> detImage0        [[texture(0)]],
 
     const float val0 = N9(1, 0, 0);
 
-    if (val0 > hessianThreshold) {
+    // The adaptive threshold of keypointDetectionThreshold, zero until it is estimated
+    if (val0 > max(hessianThreshold, *detectionThreshold)) {
         /* Coordinates for the start of the wavelet in the sum image. There
            is some integer division involved, so don't try to simplify this
            (cancel out sampleStep) without checking the result is the same */
@@ -312,112 +314,515 @@ kernel void findMaximaInLayer(texture2d<float> detImage0        [[texture(0)]],
     }
 }
 
+// Top-K selection of the keypoints by response: a histogram of the responses gives the lowest bin keeping at least
+// maxFeatures keypoints, then the keypoints in that bin or above are compacted. Only the survivors are read back,
+// the CPU sorts them and drops the extra keypoints of the threshold bin.
+
+#define KEYPOINT_HISTOGRAM_BINS     4096
+
+typedef struct KeyPointSelection {
+    uint thresholdBin;
+    int count;
+} KeyPointSelection;
+
+// Positive floats sort like their bits: the exponent and the top four bits of the mantissa select the bin
+inline uint keypointResponseBin(float response) {
+    return as_type<uint>(max(response, 0.0f)) >> 19;
+}
+
+// The keypoints of a tile's skirt belong to the neighboring tile
+inline bool keypointInCore(KeyPoint kp, int4 core) {
+    return kp.pt.x >= core.x && kp.pt.x < core.x + core.z && kp.pt.y >= core.y && kp.pt.y < core.y + core.w;
+}
+
+kernel void keypointResponseHistogram(device const KeyPointMaxima* keypoints    [[buffer(0)]],
+                                      constant int4& core                       [[buffer(1)]],
+                                      device atomic_uint* histogram             [[buffer(2)]],
+                                      uint index                                [[thread_position_in_grid]]) {
+    if (index < (uint) min(keypoints->count, KeyPointMaxima_MaxCount)) {
+        const KeyPoint kp = keypoints->keyPoints[index];
+        if (keypointInCore(kp, core)) {
+            atomic_fetch_add_explicit(&histogram[keypointResponseBin(kp.response)], 1, memory_order_relaxed);
+        }
+    }
+}
+
+// The lowest response of a histogram bin
+inline float keypointBinResponse(uint bin) {
+    return as_type<float>(bin << 19);
+}
+
+// Adaptive detection threshold: from the histogram of the coarsest octave's maxima, the response above which the
+// whole scale space is expected to have about targetCount maxima, the layers of an octave finer by a factor of two
+// having four times as many samples. The finer octaves only interpolate and append the maxima above it.
+kernel void keypointDetectionThreshold(device atomic_uint* histogram            [[buffer(0)]],
+                                       constant float& octaveScale              [[buffer(1)]],
+                                       constant int& targetCount                [[buffer(2)]],
+                                       device float* detectionThreshold         [[buffer(3)]]) {
+    uint bin = KEYPOINT_HISTOGRAM_BINS;
+    float total = 0;
+    while (bin > 0 && total < (float) targetCount) {
+        bin--;
+        total += octaveScale * atomic_load_explicit(&histogram[bin], memory_order_relaxed);
+    }
+    // Too few maxima to estimate from, keep them all
+    *detectionThreshold = total < (float) targetCount ? 0 : keypointBinResponse(bin);
+
+    for (uint i = 0; i < KEYPOINT_HISTOGRAM_BINS; i++) {
+        atomic_store_explicit(&histogram[i], 0, memory_order_relaxed);
+    }
+}
+
+// A single thread walks the histogram from the top, it is tiny compared to the keypoint passes
+kernel void keypointSelectionThreshold(device atomic_uint* histogram            [[buffer(0)]],
+                                       constant int& maxFeatures                [[buffer(1)]],
+                                       device KeyPointSelection* selection      [[buffer(2)]],
+                                       device float* detectionThreshold         [[buffer(3)]]) {
+    uint bin = KEYPOINT_HISTOGRAM_BINS;
+    uint total = 0;
+    while (bin > 0 && total < (uint) maxFeatures) {
+        bin--;
+        total += atomic_load_explicit(&histogram[bin], memory_order_relaxed);
+    }
+    selection->thresholdBin = bin;
+    selection->count = 0;
+
+    // Ready for the next detection
+    *detectionThreshold = 0;
+    for (uint i = 0; i < KEYPOINT_HISTOGRAM_BINS; i++) {
+        atomic_store_explicit(&histogram[i], 0, memory_order_relaxed);
+    }
+}
+
+// The selected keypoints are scattered to the arrays of a KeyPoints container, the stages downstream use them in place
+kernel void compactKeyPoints(device const KeyPointMaxima* keypoints     [[buffer(0)]],
+                             constant int4& core                        [[buffer(1)]],
+                             device KeyPointSelection* selection        [[buffer(2)]],
+                             device float* keypointX                    [[buffer(3)]],
+                             device float* keypointY                    [[buffer(4)]],
+                             device float* keypointSize                 [[buffer(5)]],
+                             device float* keypointAngle                [[buffer(6)]],
+                             device float* keypointResponse             [[buffer(7)]],
+                             device int* keypointOctave                 [[buffer(8)]],
+                             device int* keypointClassId                [[buffer(9)]],
+                             uint index                                 [[thread_position_in_grid]]) {
+    if (index < (uint) min(keypoints->count, KeyPointMaxima_MaxCount)) {
+        const KeyPoint kp = keypoints->keyPoints[index];
+        if (keypointInCore(kp, core) && keypointResponseBin(kp.response) >= selection->thresholdBin) {
+            int ind = atomic_fetch_add_explicit((device atomic_int*) &selection->count, 1, memory_order_relaxed);
+            keypointX[ind] = kp.pt.x;
+            keypointY[ind] = kp.pt.y;
+            keypointSize[ind] = kp.size;
+            keypointAngle[ind] = kp.angle;
+            keypointResponse[ind] = kp.response;
+            keypointOctave[ind] = kp.octave;
+            keypointClassId[ind] = kp.class_id;
+        }
+    }
+}
+
 // Integral Image
 
-#define LOCAL_SUM_SIZE      8U
+// The integral image is computed in two work-efficient scans: integral_scan_rows computes the prefix sums of the image
+// rows, one threadgroup per row, then integral_scan_cols scans the columns in tiles, chaining the tiles of a column
+// with a decoupled look-back, and writes the four decimated sum images in the same pass.
+
+#define INTEGRAL_TILE_SIZE      32U          // One lane per row of the tile, the SIMD-group width
+#define INTEGRAL_NOT_READY      0xFFFFFFFFU  // A NaN, never the value of a sum
+
+// Inclusive prefix sum of value over the threadgroup, total receives the sum of all the values. The threadgroup must
+// be a multiple of the SIMD-group size, simdTotals needs one entry per SIMD-group. Reusable for box filters.
+template <typename T>
+T threadgroup_prefix_inclusive_sum(T value, threadgroup T* simdTotals, thread T* total,
+                                   uint simd_lane, uint simd_size, uint simd_group, uint simd_groups) {
+    T scan = simd_prefix_inclusive_sum(value);
+    if (simd_lane == simd_size - 1) {
+        simdTotals[simd_group] = scan;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
 
-kernel void integral_sum_cols_image(texture2d<float> sourceImage    [[texture(0)]],
-                                    device float *buf_ptr           [[buffer(1)]],
-                                    constant int& buf_width         [[buffer(2)]],
-                                    uint lid                        [[thread_position_in_threadgroup]],
-                                    uint gid                        [[threadgroup_position_in_grid]],
-                                    uint x                          [[thread_position_in_grid]]) {
-    threadgroup float lm_sum[LOCAL_SUM_SIZE][LOCAL_SUM_SIZE];
+    if (simd_group == 0) {
+        const T simdTotal = simd_lane < simd_groups ? simdTotals[simd_lane] : T(0);
+        const T simdScan = simd_prefix_inclusive_sum(simdTotal);
+        if (simd_lane < simd_groups) {
+            simdTotals[simd_lane] = simdScan;
+        }
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
 
-    float accum = 0;
-    for (uint y = 0; y < get_image_height(sourceImage); y += LOCAL_SUM_SIZE) {
-#pragma unroll
-        for (uint yin = 0; yin < LOCAL_SUM_SIZE; yin++) {
+    if (simd_group > 0) {
+        scan += simdTotals[simd_group - 1];
+    }
+    *total = simdTotals[simd_groups - 1];
+
+    // simdTotals can be reused after this
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    return scan;
+}
+
+kernel void integral_scan_rows(texture2d<float> sourceImage        [[texture(0)]],
+                               device float* rowSums               [[buffer(1)]],
+                               device atomic_uint* tileStatus      [[buffer(2)]],
+                               constant int& tileStatusCount       [[buffer(3)]],
+                               device atomic_uint* tileCounter     [[buffer(4)]],
+                               uint y                              [[threadgroup_position_in_grid]],
+                               uint lid                            [[thread_position_in_threadgroup]],
+                               uint tg_size                        [[threads_per_threadgroup]],
+                               uint simd_lane                      [[thread_index_in_simdgroup]],
+                               uint simd_size                      [[threads_per_simdgroup]],
+                               uint simd_group                     [[simdgroup_index_in_threadgroup]],
+                               uint simd_groups                    [[simdgroups_per_threadgroup]],
+                               uint index                          [[thread_position_in_grid]],
+                               uint grid_size                      [[threads_per_grid]]) {
+    // Reset the state of the column pass
+    for (uint i = index; i < (uint) tileStatusCount; i += grid_size) {
+        atomic_store_explicit(&tileStatus[i], INTEGRAL_NOT_READY, memory_order_relaxed);
+    }
+    if (index == 0) {
+        atomic_store_explicit(tileCounter, 0, memory_order_relaxed);
+    }
+
+    threadgroup float simdTotals[32];
+
+    const uint width = get_image_width(sourceImage);
+    device float* rowSum = rowSums + y * width;
+
+    // Every thread scans four consecutive pixels, the threadgroup covers 4 * tg_size pixels of the row at a time
+    float carry = 0;
+    for (uint x0 = 0; x0 < width; x0 += 4 * tg_size) {
+        const uint x = x0 + 4 * lid;
+
+        float4 v;
+        for (uint i = 0; i < 4; i++) {
             // Use Signed Offset Pixel Representation to improve Integral Image precision
             // See: Hensley et al.: "Fast Summed-Area Table Generation and its Applications".
-            accum += read_imagef(sourceImage, int2(x, y + yin)).x - 0.5;
-            lm_sum[yin][lid] = accum;
+            v[i] = x + i < width ? read_imagef(sourceImage, int2(x + i, y)).x - 0.5 : 0;
         }
-        threadgroup_barrier(mem_flags::mem_threadgroup);
-
-        int buf_index = buf_width * LOCAL_SUM_SIZE * gid + (lid + y);
-#pragma unroll
-        for (uint yin = 0; yin < LOCAL_SUM_SIZE; yin++, buf_index += buf_width) {
-            buf_ptr[buf_index] = lm_sum[lid][yin];
+        v.y += v.x;
+        v.z += v.y;
+        v.w += v.z;
+
+        float total;
+        const float prefix = threadgroup_prefix_inclusive_sum(v.w, simdTotals, &total, simd_lane, simd_size,
+                                                              simd_group, simd_groups) - v.w + carry;
+        for (uint i = 0; i < 4; i++) {
+            if (x + i < width) {
+                rowSum[x + i] = prefix + v[i];
+            }
         }
-        threadgroup_barrier(mem_flags::mem_threadgroup);
+        carry += total;
     }
 }
 
-kernel void integral_sum_rows_image(constant float* buf_ptr                     [[buffer(0)]],
-                                    constant int& buf_width                     [[buffer(1)]],
-                                    texture2d<float, access::write> sumImage0   [[texture(2)]],
-                                    texture2d<float, access::write> sumImage1   [[texture(3)]],
-                                    texture2d<float, access::write> sumImage2   [[texture(4)]],
-                                    texture2d<float, access::write> sumImage3   [[texture(5)]],
-                                    uint lid                                    [[thread_position_in_threadgroup]],
-                                    uint gid                                    [[threadgroup_position_in_grid]],
-                                    uint gs                                     [[threads_per_grid]],
-                                    uint x                                      [[thread_position_in_grid]]) {
-    uint dst_width = get_image_width(sumImage0);
-    uint dst_height = get_image_height(sumImage0);
+inline void write_integral(texture2d<float, access::write> sumImage0,
+                           texture2d<float, access::write> sumImage1,
+                           texture2d<float, access::write> sumImage2,
+                           texture2d<float, access::write> sumImage3,
+                           int2 outCoords, float value) {
+    write_imagef(sumImage0, outCoords, value);
 
-    threadgroup float lm_sum[LOCAL_SUM_SIZE][LOCAL_SUM_SIZE];
+    if (all((outCoords & 1) == 0)) {
+        write_imagef(sumImage1, outCoords / 2, value);
+    }
+    if (all((outCoords & 3) == 0)) {
+        write_imagef(sumImage2, outCoords / 4, value);
+    }
+    if (all((outCoords & 7) == 0)) {
+        write_imagef(sumImage3, outCoords / 8, value);
+    }
+}
 
-    for (uint xin = x; xin < dst_width; xin += gs) {
-        write_imagef(sumImage0, int2(xin, 0), 0);
+// Status slots of a tile column, the aggregate of the tile followed by its inclusive prefix
+inline device atomic_uint* integral_tile_status(device atomic_uint* tileStatus, uint tilesX, uint tileX, uint tileY,
+                                                uint column) {
+    return tileStatus + 2 * ((tileY * tilesX + tileX) * INTEGRAL_TILE_SIZE + column);
+}
 
-        if ((xin & 1) == 0) {
-            write_imagef(sumImage1, int2(xin / 2, 0), 0);
+kernel void integral_scan_cols(device const float* rowSums                 [[buffer(0)]],
+                               device atomic_uint* tileStatus              [[buffer(1)]],
+                               device atomic_uint* tileCounter             [[buffer(2)]],
+                               texture2d<float, access::write> sumImage0   [[texture(3)]],
+                               texture2d<float, access::write> sumImage1   [[texture(4)]],
+                               texture2d<float, access::write> sumImage2   [[texture(5)]],
+                               texture2d<float, access::write> sumImage3   [[texture(6)]],
+                               uint lid                                    [[thread_position_in_threadgroup]],
+                               uint simd_lane                              [[thread_index_in_simdgroup]],
+                               uint simd_group                             [[simdgroup_index_in_threadgroup]],
+                               uint simd_groups                            [[simdgroups_per_threadgroup]]) {
+    // The sum images are one pixel bigger than the source image
+    const uint width = get_image_width(sumImage0) - 1;
+    const uint height = get_image_height(sumImage0) - 1;
+    const uint tilesX = (width + INTEGRAL_TILE_SIZE - 1) / INTEGRAL_TILE_SIZE;
+
+    threadgroup float tile[INTEGRAL_TILE_SIZE][INTEGRAL_TILE_SIZE + 1];
+    threadgroup float carry[INTEGRAL_TILE_SIZE];
+    threadgroup uint ticket;
+
+    // Tiles are numbered in the order their threadgroups start: the tiles above this one are always running or
+    // done, so the look-back can't wait on a threadgroup that never gets scheduled
+    if (lid == 0) {
+        ticket = atomic_fetch_add_explicit(tileCounter, 1, memory_order_relaxed);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const uint tileX = ticket % tilesX;
+    const uint tileY = ticket / tilesX;
+    const uint x = INTEGRAL_TILE_SIZE * tileX + simd_lane;
+    const uint y0 = INTEGRAL_TILE_SIZE * tileY;
+
+    // Coalesced load of the tile's rows
+    for (uint r = simd_group; r < INTEGRAL_TILE_SIZE; r += simd_groups) {
+        tile[r][simd_lane] = x < width && y0 + r < height ? rowSums[(y0 + r) * width + x] : 0;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Scan of the tile's columns, one SIMD-group per column and one lane per row
+    for (uint c = simd_group; c < INTEGRAL_TILE_SIZE; c += simd_groups) {
+        tile[simd_lane][c] = simd_prefix_inclusive_sum(tile[simd_lane][c]);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Decoupled look-back, one lane per column: publish the tile's aggregate, then accumulate the aggregates of the
+    // tiles above until one of them has its inclusive prefix available
+    if (simd_group == 0) {
+        const uint c = simd_lane;
+        const float aggregate = tile[INTEGRAL_TILE_SIZE - 1][c];
+        device atomic_uint* status = integral_tile_status(tileStatus, tilesX, tileX, tileY, c);
+
+        float prefix = 0;
+        if (tileY > 0) {
+            atomic_store_explicit(&status[0], as_type<uint>(aggregate), memory_order_relaxed);
+
+            for (int ty = tileY - 1; ty >= 0; ty--) {
+                device atomic_uint* previous = integral_tile_status(tileStatus, tilesX, tileX, ty, c);
+
+                uint inclusive, previousAggregate;
+                do {
+                    inclusive = atomic_load_explicit(&previous[1], memory_order_relaxed);
+                    previousAggregate = atomic_load_explicit(&previous[0], memory_order_relaxed);
+                } while (inclusive == INTEGRAL_NOT_READY && previousAggregate == INTEGRAL_NOT_READY);
+
+                if (inclusive != INTEGRAL_NOT_READY) {
+                    prefix += as_type<float>(inclusive);
+                    break;
+                }
+                prefix += as_type<float>(previousAggregate);
+            }
+        }
+        atomic_store_explicit(&status[1], as_type<uint>(prefix + aggregate), memory_order_relaxed);
+        carry[c] = prefix;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    for (uint r = simd_group; r < INTEGRAL_TILE_SIZE; r += simd_groups) {
+        if (x < width && y0 + r < height) {
+            write_integral(sumImage0, sumImage1, sumImage2, sumImage3, int2(x + 1, y0 + r + 1),
+                           tile[r][simd_lane] + carry[simd_lane]);
+        }
+    }
+
+    // The first row and column of the integral image are zero
+    if (simd_group == 0) {
+        if (tileY == 0 && x < width) {
+            write_integral(sumImage0, sumImage1, sumImage2, sumImage3, int2(x + 1, 0), 0);
         }
-        if ((xin & 3) == 0) {
-            write_imagef(sumImage2, int2(xin / 4, 0), 0);
+        if (tileX == 0 && y0 + simd_lane < height) {
+            write_integral(sumImage0, sumImage1, sumImage2, sumImage3, int2(0, y0 + simd_lane + 1), 0);
         }
-        if ((xin & 7) == 0) {
-            write_imagef(sumImage3, int2(xin / 8, 0), 0);
+        if (tileX == 0 && tileY == 0 && simd_lane == 0) {
+            write_integral(sumImage0, sumImage1, sumImage2, sumImage3, int2(0, 0), 0);
         }
     }
+}
+
+// SURF orientation and descriptors, see SURFInvoker in SURF.cpp
+
+#define SURF_SIMD_WIDTH             32
+#define SURF_ORI_WIN                60
+#define SURF_ORI_SEARCH_INC         5
+#define SURF_PATCH_SZ               20
+// Orientation samples per SIMD lane, the samples are at most (2 * ORI_RADIUS + 1)^2 = 169
+#define SURF_ORI_SAMPLES_PER_LANE   6
+
+// Sum of the rectangle [p0, p1) of the integral image, undoing the Signed Offset Pixel Representation
+float integralBox(texture2d<float> sumImage, int2 p0, int2 p1) {
+    const float area = (p1.x - p0.x) * (p1.y - p0.y);
+    return 0.5 * area + read_imagef(sumImage, p1).x - read_imagef(sumImage, int2(p0.x, p1.y)).x
+                      - read_imagef(sumImage, int2(p1.x, p0.y)).x + read_imagef(sumImage, p0).x;
+}
+
+// Image mean in a square of the given size around center, clipped to the image
+float integralBoxMean(texture2d<float> sumImage, float2 center, float size) {
+    const int2 maxCoord = get_image_dim(sumImage) - 1;
+    const int2 q0 = int2(rint(center - size / 2));
+    const int2 p0 = clamp(q0, 0, maxCoord - 1);
+    const int2 p1 = clamp(q0 + max(int(rint(size)), 1), p0 + 1, maxCoord);
+    return integralBox(sumImage, p0, p1) / ((p1.x - p0.x) * (p1.y - p0.y));
+}
+
+// Cell (i, j) of the rotated (SURF_PATCH_SZ + 1)^2 patch of cells of size s around the keypoint,
+// the box filtered equivalent of resizeVV applied to the mwin window of SURFInvoker
+float surfPatchCell(texture2d<float> sumImage, float2 center, float sinDir, float cosDir, float s, int i, int j) {
+    const float u = (j - SURF_PATCH_SZ / 2) * s;
+    const float v = (i - SURF_PATCH_SZ / 2) * s;
+    const float2 p = center + float2(u * cosDir + v * sinDir, v * cosDir - u * sinDir);
+    return integralBoxMean(sumImage, p, s);
+}
+
+// One SIMD-group per keypoint: the lanes share the orientation samples and the descriptor's subregions,
+// two lanes per subregion. Keypoints that can't be sampled are marked with a negative size.
+kernel void surfDescriptors(texture2d<float> sumImage               [[texture(0)]],
+                            device const float* keypointX           [[buffer(1)]],
+                            device const float* keypointY           [[buffer(2)]],
+                            device float* keypointSize              [[buffer(3)]],
+                            device float* keypointAngle             [[buffer(4)]],
+                            constant int& keypointsCount            [[buffer(5)]],
+                            constant float3* oriSamples             [[buffer(6)]],
+                            constant int& oriSamplesCount           [[buffer(7)]],
+                            constant float* descriptorWeights       [[buffer(8)]],
+                            device array<float4, 16>* descriptors   [[buffer(9)]],
+                            uint lane                               [[thread_index_in_simdgroup]],
+                            uint index                              [[thread_position_in_grid]]) {
+    const int k = index / SURF_SIMD_WIDTH;
+    if (k >= keypointsCount) {
+        return;
+    }
 
-    if (x < dst_height - 1) {
-        write_imagef(sumImage0, int2(0, x + 1), 0);
+    const float2 center = float2(keypointX[k], keypointY[k]);
+    const float s = keypointSize[k] * 1.2 / 9.0;
 
-        if (((x + 1) & 1) == 0) {
-            write_imagef(sumImage1, int2(0, (x + 1) / 2), 0);
+    // Gradient wavelets of even size 4s
+    const int gradWavSize = 2 * int(rint(2 * s));
+    const int halfWavSize = gradWavSize / 2;
+    const int2 sumSize = get_image_dim(sumImage);
+    if (sumSize.x < gradWavSize || sumSize.y < gradWavSize) {
+        if (lane == 0) {
+            keypointSize[k] = -1;
         }
-        if (((x + 1) & 3) == 0) {
-            write_imagef(sumImage2, int2(0, (x + 1) / 4), 0);
+        return;
+    }
+    const float haarWeight = 1.0 / (halfWavSize * gradWavSize);
+
+    float X[SURF_ORI_SAMPLES_PER_LANE];
+    float Y[SURF_ORI_SAMPLES_PER_LANE];
+    float angle[SURF_ORI_SAMPLES_PER_LANE];
+    int nangle = 0;
+    for (int i = 0; i < SURF_ORI_SAMPLES_PER_LANE; i++) {
+        const int kk = lane + SURF_SIMD_WIDTH * i;
+        X[i] = Y[i] = angle[i] = 0;
+        if (kk < oriSamplesCount) {
+            const float3 sample = oriSamples[kk];
+            const int2 p = int2(rint(center + sample.xy * s - (gradWavSize - 1) / 2.0));
+            if (all(p >= 0) && all(p < sumSize - gradWavSize)) {
+                const float vx = integralBox(sumImage, p + int2(halfWavSize, 0), p + gradWavSize) -
+                                 integralBox(sumImage, p, p + int2(halfWavSize, gradWavSize));
+                const float vy = integralBox(sumImage, p, p + int2(gradWavSize, halfWavSize)) -
+                                 integralBox(sumImage, p + int2(0, halfWavSize), p + gradWavSize);
+                X[i] = haarWeight * vx * sample.z;
+                Y[i] = haarWeight * vy * sample.z;
+                const float a = atan2(Y[i], X[i]) * (180 / M_PI_F);
+                angle[i] = a < 0 ? a + 360 : a;
+                nangle++;
+            }
         }
-        if (((x + 1) & 7) == 0) {
-            write_imagef(sumImage3, int2(0, (x + 1) / 8), 0);
+    }
+    if (simd_sum(nangle) == 0) {
+        // The keypoint is too close to the image boundary to find a dominant direction
+        if (lane == 0) {
+            keypointSize[k] = -1;
         }
+        return;
     }
 
-    int buf_index = x;
-    float accum = 0;
-    for (uint y = 1; y < dst_width; y += LOCAL_SUM_SIZE) {
-#pragma unroll
-        for (uint yin = 0; yin < LOCAL_SUM_SIZE; yin++, buf_index += buf_width) {
-            accum += buf_ptr[buf_index];
-            lm_sum[yin][lid] = accum;
+    // Sliding orientation window, the sums are uniform across the SIMD-group
+    float bestx = 0, besty = 0, descriptorMod = 0;
+    for (int a = 0; a < 360; a += SURF_ORI_SEARCH_INC) {
+        float sumx = 0, sumy = 0;
+        for (int i = 0; i < SURF_ORI_SAMPLES_PER_LANE; i++) {
+            const float d = fabs(rint(angle[i]) - a);
+            if (d < SURF_ORI_WIN / 2 || d > 360 - SURF_ORI_WIN / 2) {
+                sumx += X[i];
+                sumy += Y[i];
+            }
         }
-        threadgroup_barrier(mem_flags::mem_threadgroup);
+        sumx = simd_sum(sumx);
+        sumy = simd_sum(sumy);
+        const float mod = sumx * sumx + sumy * sumy;
+        if (mod > descriptorMod) {
+            descriptorMod = mod;
+            bestx = sumx;
+            besty = sumy;
+        }
+    }
+    const float descriptorDir = atan2(-besty, bestx);
+    if (lane == 0) {
+        keypointAngle[k] = descriptorDir;
+    }
 
-        if (y + lid < dst_width) {
-            // FIXME: is dst_height > LOCAL_SUM_SIZE + 1?
-            uint yin_max = min(dst_height - 1 - LOCAL_SUM_SIZE * gid, LOCAL_SUM_SIZE);
-#pragma unroll
-            for (uint yin = 0; yin < yin_max; yin++) {
-                int2 outCoords = int2(y + lid, yin + LOCAL_SUM_SIZE * gid + 1);
-                write_imagef(sumImage0, outCoords, lm_sum[lid][yin]);
+    // As in SURFInvoker the angle is converted to radians as if it was in degrees
+    const float dir = descriptorDir * (M_PI_F / 180);
+    const float sinDir = -sin(dir);
+    const float cosDir = cos(dir);
+
+    // Gradients of every other sample of the lane's 5x5 subregion, with wavelets of size 2s
+    const int region = lane / 2;
+    const int ri = 5 * (region / 4);
+    const int rj = 5 * (region % 4);
+    float4 d = 0;
+    for (int n = lane & 1; n < 25; n += 2) {
+        const int y = ri + n / 5;
+        const int x = rj + n % 5;
+        const float p00 = surfPatchCell(sumImage, center, sinDir, cosDir, s, y, x);
+        const float p01 = surfPatchCell(sumImage, center, sinDir, cosDir, s, y, x + 1);
+        const float p10 = surfPatchCell(sumImage, center, sinDir, cosDir, s, y + 1, x);
+        const float p11 = surfPatchCell(sumImage, center, sinDir, cosDir, s, y + 1, x + 1);
+        const float dw = descriptorWeights[y * SURF_PATCH_SZ + x];
+        const float tx = (p01 - p00 + p11 - p10) * dw;
+        const float ty = (p10 - p00 + p11 - p01) * dw;
+        d += float4(tx, ty, fabs(tx), fabs(ty));
+    }
+    d += simd_shuffle_xor(d, 1);
 
-                if (all((outCoords & 1) == 0)) {
-                    write_imagef(sumImage1, outCoords / 2, lm_sum[lid][yin]);
-                }
-                if (all((outCoords & 3) == 0)) {
-                    write_imagef(sumImage2, outCoords / 4, lm_sum[lid][yin]);
-                }
-                if (all((outCoords & 7) == 0)) {
-                    write_imagef(sumImage3, outCoords / 8, lm_sum[lid][yin]);
-                }
-            }
-        }
-        threadgroup_barrier(mem_flags::mem_threadgroup);
+    // Unit vector for contrast invariance
+    const float squareMag = simd_sum((lane & 1) == 0 ? dot(d, d) : 0.0);
+    if ((lane & 1) == 0) {
+        descriptors[k][region] = d / (sqrt(squareMag) + FLT_EPSILON);
+    }
+}
+
+// BRIEF descriptors (Calonder et al.) for the alignment of burst frames: 256 comparisons of box filtered samples
+// around the keypoint, on the SURF descriptor window. The pattern is not steered, the frames of a burst are barely
+// rotated with respect to each other. One thread per 32 bits word of a descriptor.
+
+#define BRIEF_WORDS                 8
+
+kernel void briefDescriptors(texture2d<float> sumImage               [[texture(0)]],
+                             device const float* keypointX           [[buffer(1)]],
+                             device const float* keypointY           [[buffer(2)]],
+                             device const float* keypointSize        [[buffer(3)]],
+                             constant int& keypointsCount            [[buffer(4)]],
+                             constant float4* pattern                [[buffer(5)]],
+                             device uint* descriptors                [[buffer(6)]],
+                             uint index                              [[thread_position_in_grid]]) {
+    const int k = index / BRIEF_WORDS;
+    const int word = index % BRIEF_WORDS;
+    if (k >= keypointsCount) {
+        return;
     }
+
+    const float2 center = float2(keypointX[k], keypointY[k]);
+    const float s = keypointSize[k] * 1.2 / 9.0;
+    const float patchSize = SURF_PATCH_SZ * s;
+
+    // The pattern points are in units of the patch size, each sample is the mean of a 2s box
+    uint bits = 0;
+    for (int b = 0; b < 32; b++) {
+        const float4 test = pattern[32 * word + b];
+        const float v0 = integralBoxMean(sumImage, center + patchSize * test.xy, 2 * s);
+        const float v1 = integralBoxMean(sumImage, center + patchSize * test.zw, 2 * s);
+        bits |= (v0 < v1 ? 1u : 0u) << b;
+    }
+    descriptors[index] = bits;
 }
 
 float L2Norm(constant array<float4, 16>& p1, constant array<float4, 16>& p2) {
@@ -486,6 +891,215 @@ kernel void matchKeyPoints(constant array<float4, 16>* descriptor1  [[buffer(0)]
     }
 }
 
+// Tiled matcher with ratio test and cross-check: every thread matches one query descriptor against tiles of
+// train descriptors staged in threadgroup memory, tracking the best and second best distance.
+
+#define MATCH_TILE_SIZE 64
+
+typedef struct MatchCandidate {
+    uint trainIdx;
+    float distance;
+    float secondDistance;
+} MatchCandidate;
+
+template <typename T>
+void matchKeyPointsTile(device const array<float4, 16>* descriptor1, device const array<float4, 16>* descriptor2,
+                        uint descriptor1Count, uint descriptor2Count, device MatchCandidate* matches,
+                        threadgroup array<vec<T, 4>, 16>* tile, uint lid, uint i) {
+    array<vec<T, 4>, 16> p1;
+    for (int k = 0; k < 16; k++) {
+        p1[k] = i < descriptor1Count ? vec<T, 4>(descriptor1[i][k]) : vec<T, 4>(0);
+    }
+
+    float best = MAXFLOAT, secondBest = MAXFLOAT;
+    uint bestIdx = 0;
+    for (uint j0 = 0; j0 < descriptor2Count; j0 += MATCH_TILE_SIZE) {
+        // Each thread stages one train descriptor
+        if (j0 + lid < descriptor2Count) {
+            for (int k = 0; k < 16; k++) {
+                tile[lid][k] = vec<T, 4>(descriptor2[j0 + lid][k]);
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+
+        const uint tileSize = min((uint) MATCH_TILE_SIZE, descriptor2Count - j0);
+        for (uint j = 0; j < tileSize; j++) {
+            float distance = 0;
+            for (int k = 0; k < 16; k++) {
+                const vec<T, 4> diff = p1[k] - tile[j][k];
+                distance += float(dot(diff, diff));
+            }
+            if (distance < best) {
+                secondBest = best;
+                best = distance;
+                bestIdx = j0 + j;
+            } else if (distance < secondBest) {
+                secondBest = distance;
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    if (i < descriptor1Count) {
+        matches[i] = { bestIdx, sqrt(best), sqrt(secondBest) };
+    }
+}
+
+kernel void matchKeyPointsTiled(device const array<float4, 16>* descriptor1  [[buffer(0)]],
+                                device const array<float4, 16>* descriptor2  [[buffer(1)]],
+                                constant uint& descriptor1Count              [[buffer(2)]],
+                                constant uint& descriptor2Count              [[buffer(3)]],
+                                device MatchCandidate* matches               [[buffer(4)]],
+                                uint lid                                     [[thread_position_in_threadgroup]],
+                                uint i                                       [[thread_position_in_grid]]) {
+    threadgroup array<float4, 16> tile[MATCH_TILE_SIZE];
+    matchKeyPointsTile<float>(descriptor1, descriptor2, descriptor1Count, descriptor2Count, matches, tile, lid, i);
+}
+
+// Half the threadgroup memory traffic, the distances are still accumulated in fp32
+kernel void matchKeyPointsTiledHalf(device const array<float4, 16>* descriptor1  [[buffer(0)]],
+                                    device const array<float4, 16>* descriptor2  [[buffer(1)]],
+                                    constant uint& descriptor1Count              [[buffer(2)]],
+                                    constant uint& descriptor2Count              [[buffer(3)]],
+                                    device MatchCandidate* matches               [[buffer(4)]],
+                                    uint lid                                     [[thread_position_in_threadgroup]],
+                                    uint i                                       [[thread_position_in_grid]]) {
+    threadgroup array<half4, 16> tile[MATCH_TILE_SIZE];
+    matchKeyPointsTile<half>(descriptor1, descriptor2, descriptor1Count, descriptor2Count, matches, tile, lid, i);
+}
+
+// Brute force matching of the BRIEF descriptors with the Hamming distance, tiled as matchKeyPointsTile
+void matchKeyPointsHammingTile(device const array<uint4, 2>* descriptor1, device const array<uint4, 2>* descriptor2,
+                               uint descriptor1Count, uint descriptor2Count, device MatchCandidate* matches,
+                               threadgroup array<uint4, 2>* tile, uint lid, uint i) {
+    const array<uint4, 2> p1 = i < descriptor1Count ? descriptor1[i] : array<uint4, 2> { uint4(0), uint4(0) };
+
+    uint best = UINT_MAX, secondBest = UINT_MAX;
+    uint bestIdx = 0;
+    for (uint j0 = 0; j0 < descriptor2Count; j0 += MATCH_TILE_SIZE) {
+        // Each thread stages one train descriptor
+        if (j0 + lid < descriptor2Count) {
+            tile[lid] = descriptor2[j0 + lid];
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+
+        const uint tileSize = min((uint) MATCH_TILE_SIZE, descriptor2Count - j0);
+        for (uint j = 0; j < tileSize; j++) {
+            const uint4 bits = popcount(p1[0] ^ tile[j][0]) + popcount(p1[1] ^ tile[j][1]);
+            const uint distance = bits.x + bits.y + bits.z + bits.w;
+            if (distance < best) {
+                secondBest = best;
+                best = distance;
+                bestIdx = j0 + j;
+            } else if (distance < secondBest) {
+                secondBest = distance;
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    if (i < descriptor1Count) {
+        matches[i] = { bestIdx, best == UINT_MAX ? MAXFLOAT : float(best),
+                       secondBest == UINT_MAX ? MAXFLOAT : float(secondBest) };
+    }
+}
+
+kernel void matchKeyPointsHamming(device const array<uint4, 2>* descriptor1  [[buffer(0)]],
+                                  device const array<uint4, 2>* descriptor2  [[buffer(1)]],
+                                  constant uint& descriptor1Count            [[buffer(2)]],
+                                  constant uint& descriptor2Count            [[buffer(3)]],
+                                  device MatchCandidate* matches             [[buffer(4)]],
+                                  uint lid                                   [[thread_position_in_threadgroup]],
+                                  uint i                                     [[thread_position_in_grid]]) {
+    threadgroup array<uint4, 2> tile[MATCH_TILE_SIZE];
+    matchKeyPointsHammingTile(descriptor1, descriptor2, descriptor1Count, descriptor2Count, matches, tile, lid, i);
+}
+
+// Batched matching, e.g. of the reference of a burst against all its frames: row r of the grid matches the query
+// descriptors of ranges[r] against its train descriptors, the layout matches ratioTestMatchKernel::MatchRange
+typedef struct {
+    uint queryOffset;
+    uint queryCount;
+    uint trainOffset;
+    uint trainCount;
+    uint matchesOffset;
+} MatchRange;
+
+kernel void matchKeyPointsTiledBatch(device const array<float4, 16>* descriptor1  [[buffer(0)]],
+                                     device const array<float4, 16>* descriptor2  [[buffer(1)]],
+                                     constant MatchRange* ranges                  [[buffer(2)]],
+                                     device MatchCandidate* matches               [[buffer(3)]],
+                                     uint2 lid                                    [[thread_position_in_threadgroup]],
+                                     uint2 index                                  [[thread_position_in_grid]]) {
+    threadgroup array<float4, 16> tile[MATCH_TILE_SIZE];
+    constant MatchRange& range = ranges[index.y];
+
+    // The grid covers the largest range, whole threadgroups past this one's queries have nothing to do
+    if (index.x - lid.x >= range.queryCount) {
+        return;
+    }
+    matchKeyPointsTile<float>(descriptor1 + range.queryOffset, descriptor2 + range.trainOffset, range.queryCount,
+                              range.trainCount, matches + range.matchesOffset, tile, lid.x, index.x);
+}
+
+kernel void matchKeyPointsHammingBatch(device const array<uint4, 2>* descriptor1  [[buffer(0)]],
+                                       device const array<uint4, 2>* descriptor2  [[buffer(1)]],
+                                       constant MatchRange* ranges                [[buffer(2)]],
+                                       device MatchCandidate* matches             [[buffer(3)]],
+                                       uint2 lid                                  [[thread_position_in_threadgroup]],
+                                       uint2 index                                [[thread_position_in_grid]]) {
+    threadgroup array<uint4, 2> tile[MATCH_TILE_SIZE];
+    constant MatchRange& range = ranges[index.y];
+
+    if (index.x - lid.x >= range.queryCount) {
+        return;
+    }
+    matchKeyPointsHammingTile(descriptor1 + range.queryOffset, descriptor2 + range.trainOffset, range.queryCount,
+                              range.trainCount, matches + range.matchesOffset, tile, lid.x, index.x);
+}
+
+// Keeps the matches passing Lowe's ratio test and, with crossCheck, whose train descriptor matches back to the query
+kernel void compactMatches(device const MatchCandidate* matches12   [[buffer(0)]],
+                           device const MatchCandidate* matches21   [[buffer(1)]],
+                           constant uint& descriptor1Count          [[buffer(2)]],
+                           constant float& ratio                    [[buffer(3)]],
+                           constant int& crossCheck                 [[buffer(4)]],
+                           device atomic_uint* matchesCount         [[buffer(5)]],
+                           device DMatch* matchedPoints             [[buffer(6)]],
+                           uint i                                   [[thread_position_in_grid]]) {
+    if (i >= descriptor1Count) {
+        return;
+    }
+    const MatchCandidate match = matches12[i];
+    if (match.distance < ratio * match.secondDistance && (!crossCheck || matches21[match.trainIdx].trainIdx == i)) {
+        const uint index = atomic_fetch_add_explicit(matchesCount, 1, memory_order_relaxed);
+        matchedPoints[index] = { i, match.trainIdx, match.distance };
+    }
+}
+
+// compactMatches of the ranges of a batch: the matches12 of row r of the grid are at ranges[r].matchesOffset, the
+// matches21 of its train descriptors at ranges[r].trainOffset. The matches and their count are per range.
+kernel void compactMatchesBatch(device const MatchCandidate* matches12   [[buffer(0)]],
+                                device const MatchCandidate* matches21   [[buffer(1)]],
+                                constant MatchRange* ranges              [[buffer(2)]],
+                                constant float& ratio                    [[buffer(3)]],
+                                constant int& crossCheck                 [[buffer(4)]],
+                                device atomic_uint* matchesCounts        [[buffer(5)]],
+                                device DMatch* matchedPoints             [[buffer(6)]],
+                                uint2 index                              [[thread_position_in_grid]]) {
+    constant MatchRange& range = ranges[index.y];
+    const uint i = index.x;
+    if (i >= range.queryCount) {
+        return;
+    }
+    const MatchCandidate match = matches12[range.matchesOffset + i];
+    if (match.distance < ratio * match.secondDistance &&
+        (!crossCheck || matches21[range.trainOffset + match.trainIdx].trainIdx == i)) {
+        const uint k = atomic_fetch_add_explicit(&matchesCounts[index.y], 1, memory_order_relaxed);
+        matchedPoints[range.matchesOffset + k] = { i, match.trainIdx, match.distance };
+    }
+}
+
 typedef struct {
     float3 m[3];
 } Matrix3x3;
@@ -515,9 +1129,88 @@ kernel void registerAndFuse(texture2d<float> fusedImage                     [[te
     write_imagef(newFusedImage, imageCoordinates, ((count - 1) * input0 + input1) / count);
 }
 
+// Frames of registerAndFuseFrames, the layout matches RegisterAndFuseFramesKernel::Frames
+constant int kMaxFusedFrames = 8;
+
+struct FusedFrames {
+    array<texture2d<float>, kMaxFusedFrames> images;
+};
+
+struct FusedFrameHomographies {
+    Matrix3x3 homography[kMaxFusedFrames];
+};
+
+// Warps and accumulates frameCount frames in one pass, each homography maps the fused image's coordinates to its
+// frame's. The fused image so far counts for priorCount frames, the pixels a frame doesn't cover keep the average
+// of the others. fusedImage and newFusedImage can be the same texture, each pixel is read before it is written.
+kernel void registerAndFuseFrames(constant FusedFrames& frames                       [[buffer(0)]],
+                                  texture2d<float> fusedImage                        [[texture(1)]],
+                                  texture2d<float, access::write> newFusedImage      [[texture(2)]],
+                                  constant FusedFrameHomographies& homographies      [[buffer(3)]],
+                                  constant int& frameCount                           [[buffer(4)]],
+                                  constant int& priorCount                           [[buffer(5)]],
+                                  uint2 index                                        [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = int2(index);
+
+    constexpr sampler linear_sampler(filter::linear);
+
+    float4 sum = 0;
+    float weight = 0;
+    if (priorCount > 0) {
+        sum = priorCount * read_imagef(fusedImage, imageCoordinates);
+        weight = priorCount;
+    }
+
+    float3 p(imageCoordinates.x, imageCoordinates.y, 1);
+    for (int i = 0; i < frameCount; i++) {
+        constant Matrix3x3& homography = homographies.homography[i];
+        const float w = dot(homography.m[2], p);
+        const float2 xy = float2(dot(homography.m[0], p), dot(homography.m[1], p)) / w;
+
+        const float2 inputDim = float2(get_image_dim(frames.images[i]));
+        if (all(xy >= -0.5) && all(xy <= inputDim - 0.5)) {
+            sum += read_imagef(frames.images[i], linear_sampler, (xy + 0.5) / inputDim);
+            weight += 1;
+        }
+    }
+
+    write_imagef(newFusedImage, imageCoordinates, weight > 0 ? sum / weight : 0);
+}
+
+// Make sure this struct is in sync with the declaration in demosaic_kernels.hpp
+typedef struct {
+    Matrix3x3 homography;
+    float4 radial;
+    float2 tangential;
+    float2 center;
+    float radius;
+    int lensCorrection;
+} WarpTransform;
+
+// The lens distortion model of LensDistortion (lens_distortion.hpp) followed by the homography
+float2 warpPosition(constant WarpTransform& transform, float2 position) {
+    if (transform.lensCorrection) {
+        const float2 d = (position - transform.center) / transform.radius;
+        const float r2 = dot(d, d);
+        const float4 radial = transform.radial;
+        const float f = radial[0] + r2 * (radial[1] + r2 * (radial[2] + r2 * radial[3]));
+        const float kt0 = transform.tangential[0], kt1 = transform.tangential[1];
+        const float2 t = float2(kt0 * 2 * d.x * d.y + kt1 * (r2 + 2 * d.x * d.x),
+                                kt1 * 2 * d.x * d.y + kt0 * (r2 + 2 * d.y * d.y));
+        position = transform.center + transform.radius * (f * d + t);
+    }
+
+    float3 p(position, 1);
+    float u = dot(transform.homography.m[0], p);
+    float v = dot(transform.homography.m[1], p);
+    float w = dot(transform.homography.m[2], p);
+    return float2(u / w, v / w);
+}
+
 kernel void registerImage(texture2d<float> inputImage                   [[texture(0)]],
                           texture2d<float, access::write> outputImage   [[texture(1)]],
-                          constant Matrix3x3& homography                [[buffer(2)]],
+                          constant WarpTransform& transform             [[buffer(2)]],
                           uint2 index                                   [[thread_position_in_grid]])
 {
     const int2 imageCoordinates = int2(index);
@@ -525,27 +1218,104 @@ kernel void registerImage(texture2d<float> inputImage                   [[textur
 
     constexpr sampler linear_sampler(filter::linear);
 
-    float3 p(imageCoordinates.x, imageCoordinates.y, 1);
-    float u = dot(homography.m[0], p);
-    float v = dot(homography.m[1], p);
-    float w = dot(homography.m[2], p);
-    float xx = u / w;
-    float yy = v / w;
+    const float2 position = warpPosition(transform, float2(imageCoordinates));
+
+    float4 input = read_imagef(inputImage, linear_sampler, (position + 0.5) * input_norm);
+
+    write_imagef(outputImage, imageCoordinates, input);
+}
+
+// Warps inputImage with a per tile motion field, see alignTiles in demosaic.metal. The offsets map the output pixel
+// coordinates to the input's, bilinear sampling of the field interpolates them between the tile centers.
+kernel void registerImageMotionField(texture2d<float> inputImage                   [[texture(0)]],
+                                     texture2d<float, access::write> outputImage   [[texture(1)]],
+                                     texture2d<float> motionField                  [[texture(2)]],
+                                     constant int& tileSize                        [[buffer(3)]],
+                                     uint2 index                                   [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = int2(index);
+    const float2 input_norm = 1.0 / float2(get_image_dim(inputImage));
+    const float2 field_norm = 1.0 / float2(get_image_dim(motionField));
+
+    constexpr sampler linear_sampler(filter::linear, address::clamp_to_edge);
+
+    const float2 fieldPosition = (float2(imageCoordinates) + 0.5) / tileSize;
+    const float2 offset = read_imagef(motionField, linear_sampler, fieldPosition * field_norm).xy;
 
-    float4 input = read_imagef(inputImage, linear_sampler, (float2(xx, yy) + 0.5) * input_norm);
+    float4 input = read_imagef(inputImage, linear_sampler, (float2(imageCoordinates) + offset + 0.5) * input_norm);
+
+    write_imagef(outputImage, imageCoordinates, input);
+}
+
+// Mesh of registerImageMesh, the layout matches MeshWarp in demosaic_kernels.hpp
+constant int kMaxMeshCells = 64;
+
+struct MeshWarp {
+    Matrix3x3 cells[kMaxMeshCells];
+    int2 meshSize;
+    float2 cellSize;
+};
+
+float2 meshCellPosition(constant MeshWarp& mesh, int2 cell, float3 p) {
+    constant Matrix3x3& homography = mesh.cells[cell.y * mesh.meshSize.x + cell.x];
+    const float w = dot(homography.m[2], p);
+    return float2(dot(homography.m[0], p), dot(homography.m[1], p)) / w;
+}
+
+// Warps inputImage with the per cell homographies of a MeshHomography: the pixel's positions mapped by the homographies
+// of the four nearest cell centers are blended bilinearly, so the warp is continuous across the cell boundaries.
+kernel void registerImageMesh(texture2d<float> inputImage                   [[texture(0)]],
+                              texture2d<float, access::write> outputImage   [[texture(1)]],
+                              constant MeshWarp& mesh                       [[buffer(2)]],
+                              uint2 index                                   [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = int2(index);
+    const float2 input_norm = 1.0 / float2(get_image_dim(inputImage));
+
+    constexpr sampler linear_sampler(filter::linear);
+
+    const float2 cell = (float2(imageCoordinates) + 0.5) / mesh.cellSize - 0.5;
+    const int2 c0 = clamp(int2(floor(cell)), 0, mesh.meshSize - 1);
+    const int2 c1 = min(c0 + 1, mesh.meshSize - 1);
+    const float2 f = clamp(cell - float2(c0), 0.0, 1.0);
+
+    const float3 p(float2(imageCoordinates), 1);
+    const float2 top = mix(meshCellPosition(mesh, c0, p), meshCellPosition(mesh, int2(c1.x, c0.y), p), f.x);
+    const float2 bottom = mix(meshCellPosition(mesh, int2(c0.x, c1.y), p), meshCellPosition(mesh, c1, p), f.x);
+    const float2 position = mix(top, bottom, f.y);
+
+    float4 input = read_imagef(inputImage, linear_sampler, (position + 0.5) * input_norm);
 
     write_imagef(outputImage, imageCoordinates, input);
 }
 
 kernel void registerBayerImage(texture2d<float> inputImage                   [[texture(0)]],
                                texture2d<float, access::write> outputImage   [[texture(1)]],
-                               constant Matrix3x3& homography                [[buffer(2)]],
+                               constant WarpTransform& transform             [[buffer(2)]],
                                uint2 index                                   [[thread_position_in_grid]])
 {
     const int2 imageCoordinates = int2(index);
 
     // Nearest neighbor interpolation of the individual color planes
 
+    const float2 position = warpPosition(transform, float2(imageCoordinates / 2));
+
+    float input = read_imagef(inputImage, 2 * int2(round(position)) + imageCoordinates % 2).x;
+
+    write_imagef(outputImage, imageCoordinates, input);
+}
+
+kernel void registerAndFuseBayer(texture2d<float> fusedImage                     [[texture(0)]],
+                                 texture2d<float> inputImage                     [[texture(1)]],
+                                 texture2d<float, access::write> newFusedImage   [[texture(2)]],
+                                 constant Matrix3x3& homography                  [[buffer(3)]],
+                                 constant int& count                             [[buffer(4)]],
+                                 uint2 index                                     [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = int2(index);
+
+    // The homography works on the half resolution color planes, nearest neighbor interpolation keeps the CFA phase
+
     float3 p(imageCoordinates.x / 2, imageCoordinates.y / 2, 1);
     float u = dot(homography.m[0], p);
     float v = dot(homography.m[1], p);
@@ -553,7 +1323,16 @@ kernel void registerBayerImage(texture2d<float> inputImage                   [[t
     float xx = u / w;
     float yy = v / w;
 
-    float input = read_imagef(inputImage, 2 * int2(round(xx), round(yy)) + imageCoordinates % 2).x;
+    const int2 inputCoordinates = 2 * int2(round(xx), round(yy)) + imageCoordinates % 2;
+    const int2 inputDim = int2(get_image_dim(inputImage));
 
-    write_imagef(outputImage, imageCoordinates, input);
+    float input0 = read_imagef(fusedImage, imageCoordinates).x;
+
+    // Pixels not covered by the frame keep the fused value
+    if (all(inputCoordinates >= 0) && all(inputCoordinates < inputDim)) {
+        float input1 = read_imagef(inputImage, inputCoordinates).x;
+        write_imagef(newFusedImage, imageCoordinates, ((count - 1) * input0 + input1) / count);
+    } else {
+        write_imagef(newFusedImage, imageCoordinates, input0);
+    }
 }
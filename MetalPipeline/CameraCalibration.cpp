@@ -24,16 +24,16 @@ static const char* TAG = "DEMOSAIC";
 
 template <size_t levels>
 std::unique_ptr<DemosaicParameters>
-    CameraCalibration<levels>::getDemosaicParameters(const gls::image<gls::luma_pixel_16>& inputImage,
+    CameraCalibration<levels>::getDemosaicParameters(const gls::size& imageSize,
                                                      const gls::Matrix<3, 3>& xyz_rgb,
                                                      gls::tiff_metadata* dng_metadata,
-                                                     gls::tiff_metadata* exif_metadata) const {
+                                                     gls::tiff_metadata* exif_metadata,
+                                                     const NoiseModelCache* noiseModelCache) const {
     auto demosaicParameters = std::make_unique<DemosaicParameters>();
 
     *demosaicParameters = buildDemosaicParameters();
 
-    unpackDNGMetadata(inputImage, dng_metadata, demosaicParameters.get(), xyz_rgb,
-                      /*auto_white_balance=*/false, /* &gmb_position */ nullptr, /*rotate_180=*/false);
+    unpackDNGMetadata(imageSize, dng_metadata, demosaicParameters.get(), xyz_rgb);
 
     uint32_t iso = 0;
     std::vector<uint16_t> iso_16;
@@ -47,16 +47,124 @@ std::unique_ptr<DemosaicParameters>
 
     LOG_INFO(TAG) << "EXIF ISO: " << iso << std::endl;
 
-    const auto nlfParams = nlfFromIso(iso);
+    std::string cameraModel;
+    if (!getValue(*dng_metadata, TIFFTAG_UNIQUECAMERAMODEL, &cameraModel)) {
+        getValue(*dng_metadata, TIFFTAG_MODEL, &cameraModel);
+    }
+    const auto exposureTime = getVector<float>(*exif_metadata, EXIFTAG_EXPOSURETIME);
+    demosaicParameters->cameraModel = cameraModel;
+    demosaicParameters->exposureTime = exposureTime.empty() ? 0 : exposureTime[0];
+
+    auto nlfParams = nlfFromIso(iso);
+    if (noiseModelCache) {
+        nlfParams = noiseModelCache->blend(nlfParams, { cameraModel, (int) iso, demosaicParameters->exposureTime });
+    }
     const auto denoiseParameters = getDenoiseParameters(iso);
     demosaicParameters->noiseModel = nlfParams;
     demosaicParameters->rawDenoiseParameters = denoiseParameters.first;
     demosaicParameters->denoiseParameters = denoiseParameters.second;
+    demosaicParameters->denoisePyramidConfig = denoisePyramidConfigFromIso(iso);
     demosaicParameters->iso = iso;
 
     return demosaicParameters;
 }
 
 template std::unique_ptr<DemosaicParameters> CameraCalibration<5>::getDemosaicParameters(
-    const gls::image<gls::luma_pixel_16>& inputImage, const gls::Matrix<3, 3>& xyz_rgb,
-    gls::tiff_metadata* dng_metadata, gls::tiff_metadata* exif_metadata) const;
+    const gls::size& imageSize, const gls::Matrix<3, 3>& xyz_rgb,
+    gls::tiff_metadata* dng_metadata, gls::tiff_metadata* exif_metadata, const NoiseModelCache* noiseModelCache) const;
+
+// clang-format off
+
+static const struct {
+    const char* cameraModel;
+    const char* lensModel;  // Empty for the camera's default
+    std::unique_ptr<CameraCalibration<5>> (*factory)();
+} calibrationTable[] = {
+    { "iPhone 14 Pro",      "iPhone 14 Pro back camera 9mm f/2.8",              getiPhone14TeleCalibration },
+    { "iPhone 14 Pro",      "iPhone 14 Pro back camera 6.86mm f/1.78",          getiPhone14WideCalibration },
+    { "iPhone 14 Pro",      "iPhone 14 Pro back camera 2.22mm f/2.2",           getiPhone14UltraWideCalibration },
+    { "iPhone 14 Pro",      "iPhone 14 Pro front camera 2.69mm f/1.9",          getiPhone14SelfieCalibration },
+    { "iPhone 14 Pro",      "",                                                 getiPhone14WideCalibration },
+    { "iPhone 14 Pro Max",  "iPhone 14 Pro Max back camera 9mm f/2.8",          getiPhone14TeleCalibration },
+    { "iPhone 14 Pro Max",  "iPhone 14 Pro Max back camera 6.86mm f/1.78",      getiPhone14WideCalibration },
+    { "iPhone 14 Pro Max",  "iPhone 14 Pro Max back camera 2.22mm f/2.2",       getiPhone14UltraWideCalibration },
+    { "iPhone 14 Pro Max",  "iPhone 14 Pro Max front camera 2.69mm f/1.9",      getiPhone14SelfieCalibration },
+    { "iPhone 14 Pro Max",  "",                                                 getiPhone14WideCalibration },
+    { "iPhone 11",          "",                                                 getiPhone11Calibration },
+    { "ILCE-6400",          "",                                                 getSonya6400Calibration },
+    { "Canon EOS R6m2",     "",                                                 getCanonEOSR6IICalibration },
+    { "Canon EOS RP",       "",                                                 getCanonEOSRPCalibration },
+    { "LEICA Q2",           "",                                                 getLeicaQ2Calibration },
+};
+
+// clang-format on
+
+CameraCalibrationRegistry::CameraCalibrationRegistry() : _defaultCalibration(getiPhone11Calibration()) {
+    for (const auto& entry : calibrationTable) {
+        _calibrations[key(entry.cameraModel, entry.lensModel)] = entry.factory();
+    }
+}
+
+const CameraCalibrationRegistry& CameraCalibrationRegistry::shared() {
+    static const CameraCalibrationRegistry registry;
+    return registry;
+}
+
+const CameraCalibration<5>* CameraCalibrationRegistry::find(const std::string& cameraModel, const std::string& lensModel) const {
+    auto entry = _calibrations.find(key(cameraModel, lensModel));
+    if (entry == _calibrations.end()) {
+        entry = _calibrations.find(key(cameraModel, ""));
+    }
+    return entry != _calibrations.end() ? entry->second.get() : nullptr;
+}
+
+const CameraCalibration<5>& CameraCalibrationRegistry::calibration(gls::tiff_metadata* dng_metadata,
+                                                                   gls::tiff_metadata* exif_metadata) const {
+    std::string cameraModel, lensModel;
+    getValue(*dng_metadata, TIFFTAG_MODEL, &cameraModel);
+    getValue(*exif_metadata, EXIFTAG_LENSMODEL, &lensModel);
+
+    if (const auto calibration = find(cameraModel, lensModel)) {
+        return *calibration;
+    }
+    LOG_INFO(TAG) << "No calibration for camera: " << cameraModel << ", lens: " << lensModel << " - using the default" << std::endl;
+    return *_defaultCalibration;
+}
+
+BurstCalibration::Signature BurstCalibration::signature(const gls::tiff_metadata& dng_metadata,
+                                                        const gls::tiff_metadata& exif_metadata) {
+    Signature signature;
+    getValue(dng_metadata, TIFFTAG_MODEL, &signature.cameraModel);
+    getValue(exif_metadata, EXIFTAG_LENSMODEL, &signature.lensModel);
+    signature.iso = getVector<uint16_t>(exif_metadata, EXIFTAG_ISOSPEEDRATINGS);
+    getValue(exif_metadata, EXIFTAG_RECOMMENDEDEXPOSUREINDEX, &signature.exposureIndex);
+    signature.dngIso = getVector<uint16_t>(dng_metadata, TIFFTAG_ISO);
+    signature.blackLevel = getVector<float>(dng_metadata, TIFFTAG_BLACKLEVEL);
+    signature.whiteLevel = getVector<uint32_t>(dng_metadata, TIFFTAG_WHITELEVEL);
+    signature.cfaPattern = getVector<uint8_t>(dng_metadata, TIFFTAG_CFAPATTERN);
+    signature.colorMatrix1 = getVector<float>(dng_metadata, TIFFTAG_COLORMATRIX1);
+    signature.colorMatrix2 = getVector<float>(dng_metadata, TIFFTAG_COLORMATRIX2);
+    return signature;
+}
+
+BurstCalibration::BurstCalibration(const gls::size& imageSize, const gls::Matrix<3, 3>& xyz_rgb,
+                                   gls::tiff_metadata* dng_metadata, gls::tiff_metadata* exif_metadata,
+                                   const NoiseModelCache* noiseModelCache) :
+    _imageSize(imageSize), _xyz_rgb(xyz_rgb), _noiseModelCache(noiseModelCache),
+    _reference(signature(*dng_metadata, *exif_metadata)),
+    _parameters(CameraCalibrationRegistry::shared().getDemosaicParameters(imageSize, xyz_rgb, dng_metadata, exif_metadata,
+                                                                          noiseModelCache)) { }
+
+std::unique_ptr<DemosaicParameters> BurstCalibration::frameParameters(const gls::size& imageSize,
+                                                                      gls::tiff_metadata* dng_metadata,
+                                                                      gls::tiff_metadata* exif_metadata) const {
+    if (!matches(imageSize, *dng_metadata, *exif_metadata)) {
+        LOG_INFO(TAG) << "Burst frame doesn't match its reference, computing its own parameters" << std::endl;
+        return CameraCalibrationRegistry::shared().getDemosaicParameters(imageSize, _xyz_rgb, dng_metadata, exif_metadata,
+                                                                         _noiseModelCache);
+    }
+    auto parameters = std::make_unique<DemosaicParameters>(*_parameters);
+    const auto exposureTime = getVector<float>(*exif_metadata, EXIFTAG_EXPOSURETIME);
+    parameters->exposureTime = exposureTime.empty() ? 0 : exposureTime[0];
+    return parameters;
+}
@@ -16,11 +16,64 @@
 #ifndef CameraCalibration_hpp
 #define CameraCalibration_hpp
 
+#include <algorithm>
 #include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "demosaic.hpp"
+#include "noise_model_cache.hpp"
 #include "raw_converter.hpp"
 
+// Noise models measured at increasing ISOs, linearly interpolated in between and clamped at the ends. The slopes of
+// the segments are computed once, a lookup is a bracket search and a multiply-add per coefficient.
+template <size_t levels, size_t N>
+class NoiseModelTable {
+    std::array<int, N> _isos;
+    std::array<NoiseModel<levels>, N> _models;
+    std::array<NoiseModel<levels>, N - 1> _slopes;
+
+    // f applied to the corresponding coefficients of nm0 and nm1
+    template <typename F>
+    static NoiseModel<levels> combine(const NoiseModel<levels>& nm0, const NoiseModel<levels>& nm1, F f) {
+        NoiseModel<levels> result;
+        for (int i = 0; i < 4; i++) {
+            result.rawNlf.first[i] = f(nm0.rawNlf.first[i], nm1.rawNlf.first[i]);
+            result.rawNlf.second[i] = f(nm0.rawNlf.second[i], nm1.rawNlf.second[i]);
+        }
+        for (size_t j = 0; j < levels; j++) {
+            for (int i = 0; i < 3; i++) {
+                result.pyramidNlf[j].first[i] = f(nm0.pyramidNlf[j].first[i], nm1.pyramidNlf[j].first[i]);
+                result.pyramidNlf[j].second[i] = f(nm0.pyramidNlf[j].second[i], nm1.pyramidNlf[j].second[i]);
+            }
+        }
+        return result;
+    }
+
+   public:
+    NoiseModelTable(const std::array<int, N>& isos, const std::array<NoiseModel<levels>, N>& models) :
+        _isos(isos), _models(models) {
+        for (int i = 0; i < (int) N - 1; i++) {
+            const float scale = 1.0f / (isos[i + 1] - isos[i]);
+            _slopes[i] = combine(models[i], models[i + 1], [scale](float v0, float v1) { return (v1 - v0) * scale; });
+        }
+    }
+
+    NoiseModel<levels> operator() (int iso) const {
+        if (iso <= _isos.front()) {
+            return _models.front();
+        }
+        if (iso >= _isos.back()) {
+            return _models.back();
+        }
+        const int i = (int) (std::upper_bound(_isos.begin(), _isos.end(), iso) - _isos.begin()) - 1;
+        const float delta = (float) (iso - _isos[i]);
+        return combine(_models[i], _slopes[i], [delta](float v, float slope) { return v + slope * delta; });
+    }
+};
+
 template <size_t levels = 5>
 class CameraCalibration {
    public:
@@ -32,10 +85,21 @@ class CameraCalibration {
 
     virtual DemosaicParameters buildDemosaicParameters() const = 0;
 
+    // The static noise model is refined with the measurements in noiseModelCache, if given
     std::unique_ptr<DemosaicParameters> getDemosaicParameters(const gls::image<gls::luma_pixel_16>& inputImage,
                                                               const gls::Matrix<3, 3>& xyz_rgb,
                                                               gls::tiff_metadata* dng_metadata,
-                                                              gls::tiff_metadata* exif_metadata) const;
+                                                              gls::tiff_metadata* exif_metadata,
+                                                              const NoiseModelCache* noiseModelCache = nullptr) const {
+        return getDemosaicParameters(inputImage.size(), xyz_rgb, dng_metadata, exif_metadata, noiseModelCache);
+    }
+
+    // The parameters only depend on the metadata and the image size, the pixels can be elsewhere (e.g. on the GPU)
+    std::unique_ptr<DemosaicParameters> getDemosaicParameters(const gls::size& imageSize,
+                                                              const gls::Matrix<3, 3>& xyz_rgb,
+                                                              gls::tiff_metadata* dng_metadata,
+                                                              gls::tiff_metadata* exif_metadata,
+                                                              const NoiseModelCache* noiseModelCache = nullptr) const;
 };
 
 std::unique_ptr<DemosaicParameters> unpackSonya6400RawImage(const gls::image<gls::luma_pixel_16>& inputImage,
@@ -88,8 +152,109 @@ std::unique_ptr<DemosaicParameters> unpackLeicaQ2RawImage(const gls::image<gls::
                                                           gls::tiff_metadata* dng_metadata,
                                                           gls::tiff_metadata* exif_metadata);
 
+std::unique_ptr<CameraCalibration<5>> getSonya6400Calibration();
+
+std::unique_ptr<CameraCalibration<5>> getCanonEOSR6IICalibration();
+
+std::unique_ptr<CameraCalibration<5>> getCanonEOSRPCalibration();
+
 std::unique_ptr<CameraCalibration<5>> getLeicaQ2Calibration();
 
+std::unique_ptr<CameraCalibration<5>> getiPhone11Calibration();
+
+std::unique_ptr<CameraCalibration<5>> getiPhone14WideCalibration();
+
+std::unique_ptr<CameraCalibration<5>> getiPhone14UltraWideCalibration();
+
+std::unique_ptr<CameraCalibration<5>> getiPhone14SelfieCalibration();
+
 std::unique_ptr<CameraCalibration<5>> getiPhone14TeleCalibration();
 
+// Calibrations by camera model (TIFF Model) and lens model (EXIF LensModel), created once and shared. A camera's
+// entry without a lens model covers its other lenses, the iPhone 11 calibration covers the unknown cameras.
+// Supporting a new camera is an entry in the table of CameraCalibration.cpp.
+class CameraCalibrationRegistry {
+    std::unordered_map<std::string, std::unique_ptr<CameraCalibration<5>>> _calibrations;
+    std::unique_ptr<CameraCalibration<5>> _defaultCalibration;
+
+    static std::string key(const std::string& cameraModel, const std::string& lensModel) {
+        return cameraModel + '\n' + lensModel;
+    }
+
+    CameraCalibrationRegistry();
+
+   public:
+    static const CameraCalibrationRegistry& shared();
+
+    // Null for unknown cameras
+    const CameraCalibration<5>* find(const std::string& cameraModel, const std::string& lensModel) const;
+
+    const CameraCalibration<5>& calibration(gls::tiff_metadata* dng_metadata, gls::tiff_metadata* exif_metadata) const;
+
+    std::unique_ptr<DemosaicParameters> getDemosaicParameters(const gls::image<gls::luma_pixel_16>& inputImage,
+                                                              const gls::Matrix<3, 3>& xyz_rgb,
+                                                              gls::tiff_metadata* dng_metadata,
+                                                              gls::tiff_metadata* exif_metadata,
+                                                              const NoiseModelCache* noiseModelCache = nullptr) const {
+        return calibration(dng_metadata, exif_metadata).getDemosaicParameters(inputImage, xyz_rgb, dng_metadata, exif_metadata,
+                                                                              noiseModelCache);
+    }
+
+    std::unique_ptr<DemosaicParameters> getDemosaicParameters(const gls::size& imageSize,
+                                                              const gls::Matrix<3, 3>& xyz_rgb,
+                                                              gls::tiff_metadata* dng_metadata,
+                                                              gls::tiff_metadata* exif_metadata,
+                                                              const NoiseModelCache* noiseModelCache = nullptr) const {
+        return calibration(dng_metadata, exif_metadata).getDemosaicParameters(imageSize, xyz_rgb, dng_metadata, exif_metadata,
+                                                                              noiseModelCache);
+    }
+};
+
+// Demosaic parameters of the frames of a burst. The frames share the camera, the ISO, the black and white levels
+// and the color calibration, so the reference's parameters are computed once and every frame gets a copy with its
+// own exposure time: the white balance and the noise model are the reference's. A frame whose metadata doesn't match
+// the reference's gets its own parameters from the registry.
+class BurstCalibration {
+    struct Signature {
+        std::string cameraModel;
+        std::string lensModel;
+        std::vector<uint16_t> iso;
+        uint32_t exposureIndex = 0;
+        std::vector<uint16_t> dngIso;
+        std::vector<float> blackLevel;
+        std::vector<uint32_t> whiteLevel;
+        std::vector<uint8_t> cfaPattern;
+        std::vector<float> colorMatrix1;
+        std::vector<float> colorMatrix2;
+
+        bool operator==(const Signature& other) const = default;
+    };
+
+    static Signature signature(const gls::tiff_metadata& dng_metadata, const gls::tiff_metadata& exif_metadata);
+
+    const gls::size _imageSize;
+    const gls::Matrix<3, 3> _xyz_rgb;
+    const NoiseModelCache* const _noiseModelCache;
+    const Signature _reference;
+    const std::unique_ptr<DemosaicParameters> _parameters;
+
+public:
+    BurstCalibration(const gls::size& imageSize, const gls::Matrix<3, 3>& xyz_rgb, gls::tiff_metadata* dng_metadata,
+                     gls::tiff_metadata* exif_metadata, const NoiseModelCache* noiseModelCache = nullptr);
+
+    const DemosaicParameters& reference() const {
+        return *_parameters;
+    }
+
+    // True if the frame can share the reference's parameters
+    bool matches(const gls::size& imageSize, const gls::tiff_metadata& dng_metadata,
+                 const gls::tiff_metadata& exif_metadata) const {
+        return imageSize.width == _imageSize.width && imageSize.height == _imageSize.height &&
+               signature(dng_metadata, exif_metadata) == _reference;
+    }
+
+    std::unique_ptr<DemosaicParameters> frameParameters(const gls::size& imageSize, gls::tiff_metadata* dng_metadata,
+                                                        gls::tiff_metadata* exif_metadata) const;
+};
+
 #endif /* CameraCalibration_hpp */
@@ -31,38 +31,8 @@ class CanonEOSR6IICalibration : public CameraCalibration<levels> {
 
 public:
     NoiseModel<levels> nlfFromIso(int iso) const override {
-        iso = std::clamp(iso, 100, 102400);
-        if (iso >= 100 && iso < 200) {
-            float a = (iso - 100) / 100;
-            return lerp<levels>(NLFData[0], NLFData[1], a);
-        } else if (iso >= 200 && iso < 400) {
-            float a = (iso - 200) / 200;
-            return lerp<levels>(NLFData[1], NLFData[2], a);
-        } else if (iso >= 400 && iso < 800) {
-            float a = (iso - 400) / 400;
-            return lerp<levels>(NLFData[2], NLFData[3], a);
-        } else if (iso >= 800 && iso < 1600) {
-            float a = (iso - 800) / 800;
-            return lerp<levels>(NLFData[3], NLFData[4], a);
-        } else if (iso >= 1600 && iso < 3200) {
-            float a = (iso - 1600) / 1600;
-            return lerp<levels>(NLFData[4], NLFData[5], a);
-        } else if (iso >= 3200 && iso < 6400) {
-            float a = (iso - 3200) / 3200;
-            return lerp<levels>(NLFData[5], NLFData[6], a);
-        } else if (iso >= 6400 && iso < 12800) {
-            float a = (iso - 6400) / 6400;
-            return lerp<levels>(NLFData[6], NLFData[7], a);
-        } else if (iso >= 12800 && iso < 25600) {
-            float a = (iso - 12800) / 12800;
-            return lerp<levels>(NLFData[7], NLFData[8], a);
-        } else if (iso >= 25600 && iso < 51200) {
-            float a = (iso - 25600) / 25600;
-            return lerp<levels>(NLFData[8], NLFData[9], a);
-        } else /* if (iso >= 51200 && iso <= 102400) */ {
-            float a = (iso - 51200) / 51200;
-            return lerp<levels>(NLFData[9], NLFData[10], a);
-        }
+        static const NoiseModelTable<levels, 11> nlfTable({ 100, 200, 400, 800, 1600, 3200, 6400, 12800, 25600, 51200, 102400 }, NLFData);
+        return nlfTable(iso);
     }
 
     std::pair<RAWDenoiseParameters, std::array<DenoiseParameters, levels>> getDenoiseParameters(int iso) const override {
@@ -151,6 +121,9 @@ std::unique_ptr<DemosaicParameters> unpackCanonEOSR6IIRawImage(const gls::image<
     return demosaicParameters;
 }
 
+std::unique_ptr<CameraCalibration<5>> getCanonEOSR6IICalibration() {
+    return std::make_unique<CanonEOSR6IICalibration<5>>();
+}
 
 // --- NLFData ---
 
@@ -30,35 +30,8 @@ class LeicaQ2Calibration : public CameraCalibration<levels> {
 
 public:
     NoiseModel<levels> nlfFromIso(int iso) const override {
-        iso = std::clamp(iso, 100, 50000);
-        if (iso >= 100 && iso < 200) {
-            float a = (iso - 100) / 100;
-            return lerp<levels>(NLFData[0], NLFData[1], a);
-        } else if (iso >= 200 && iso < 400) {
-            float a = (iso - 200) / 200;
-            return lerp<levels>(NLFData[1], NLFData[2], a);
-        } else if (iso >= 400 && iso < 800) {
-            float a = (iso - 400) / 400;
-            return lerp<levels>(NLFData[2], NLFData[3], a);
-        } else if (iso >= 800 && iso < 1600) {
-            float a = (iso - 800) / 800;
-            return lerp<levels>(NLFData[3], NLFData[4], a);
-        } else if (iso >= 1600 && iso < 3200) {
-            float a = (iso - 1600) / 1600;
-            return lerp<levels>(NLFData[4], NLFData[5], a);
-        } else if (iso >= 3200 && iso < 6400) {
-            float a = (iso - 3200) / 3200;
-            return lerp<levels>(NLFData[5], NLFData[6], a);
-        } else if (iso >= 6400 && iso < 12500) {
-            float a = (iso - 6100) / 6100;
-            return lerp<levels>(NLFData[6], NLFData[7], a);
-        } else if (iso >= 12500 && iso < 25000) {
-            float a = (iso - 12500) / 12500;
-            return lerp<levels>(NLFData[7], NLFData[8], a);
-        } else /* if (iso >= 25000 && iso <= 50000) */ {
-            float a = (iso - 25000) / 25000;
-            return lerp<levels>(NLFData[8], NLFData[9], a);
-        }
+        static const NoiseModelTable<levels, 10> nlfTable({ 100, 200, 400, 800, 1600, 3200, 6400, 12500, 25000, 50000 }, NLFData);
+        return nlfTable(iso);
     }
 
     std::pair<RAWDenoiseParameters, std::array<DenoiseParameters, levels>> getDenoiseParameters(int iso) const override {
@@ -6,6 +6,9 @@
 //
 
 #include <algorithm>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
 
 #define EIGEN_NO_DEBUG 1
 #include <Eigen/Dense>
@@ -16,41 +19,138 @@ namespace egn = Eigen;
 
 #include "gls_image.hpp"
 
-#include "ThreadPool.hpp"
+#include "TaskScheduler.hpp"
 
 typedef egn::Map<egn::Matrix<float, egn::Dynamic, egn::Dynamic, egn::RowMajor>> MatrixXf_rm;
 
+// Covariance of the patches from the sums of their values and of their outer products, offset by the first patch so
+// that the variance of flat images doesn't cancel out. Slices of the patches are accumulated in parallel straight
+// from the patch data, no centered copy of the samples is made and the matrices are fixed size.
+template <size_t components>
+egn::Matrix<double, components, components> patch_covariance(const std::span<std::array<float, components>>& patches) {
+    typedef egn::Matrix<double, components, 1> Vector;
+    typedef egn::Matrix<double, components, components> Matrix;
+
+    const auto& reference = patches[0];
+    Vector sum = Vector::Zero();
+    Matrix sum2 = Matrix::Zero();
+    std::mutex sumMutex;
+
+    gls::parallel_for(0, (int) patches.size(), /*grain=*/ 4096, [&](int i0, int i1) {
+        // Float accumulation over blocks of samples, the blocks are added up in double precision
+        constexpr int block = 256;
+        Vector sliceSum = Vector::Zero();
+        Matrix sliceSum2 = Matrix::Zero();
+        for (int b0 = i0; b0 < i1; b0 += block) {
+            std::array<float, components> blockSum = {};
+            std::array<std::array<float, components>, components> blockSum2 = {};
+            for (int i = b0; i < std::min(b0 + block, i1); i++) {
+                std::array<float, components> v;
+                for (int p = 0; p < components; p++) {
+                    v[p] = patches[i][p] - reference[p];
+                    blockSum[p] += v[p];
+                }
+                // Lower triangle only, the matrix is symmetric
+                for (int p = 0; p < components; p++) {
+                    for (int q = 0; q <= p; q++) {
+                        blockSum2[p][q] += v[p] * v[q];
+                    }
+                }
+            }
+            for (int p = 0; p < components; p++) {
+                sliceSum[p] += blockSum[p];
+                for (int q = 0; q <= p; q++) {
+                    sliceSum2(p, q) += blockSum2[p][q];
+                }
+            }
+        }
+        std::lock_guard<std::mutex> guard(sumMutex);
+        sum += sliceSum;
+        sum2 += sliceSum2;
+    });
+
+    const double n = patches.size();
+    Matrix covariance;
+    for (int p = 0; p < components; p++) {
+        for (int q = 0; q <= p; q++) {
+            covariance(p, q) = covariance(q, p) = (sum2(p, q) - sum[p] * sum[q] / n) / std::max(n - 1, 1.0);
+        }
+    }
+    return covariance;
+}
+
+// Cyclic Jacobi eigen decomposition of a symmetric matrix, the same as the GPU's pcaSolve: on return the diagonal of A
+// holds the eigenvalues and the columns of V the corresponding normalized eigenvectors.
+template <int N>
+void jacobi_eigen(egn::Matrix<double, N, N>* A, egn::Matrix<double, N, N>* V, int maxSweeps = 12) {
+    auto& a = *A;
+    auto& v = *V;
+    v.setIdentity();
+
+    for (int sweep = 0; sweep < maxSweeps; sweep++) {
+        const double diagonal = a.diagonal().squaredNorm();
+        const double offDiagonal = a.squaredNorm() - diagonal;
+        if (offDiagonal <= 1e-24 * diagonal) {
+            break;
+        }
+
+        for (int p = 0; p < N - 1; p++) {
+            for (int q = p + 1; q < N; q++) {
+                // Rotation annihilating a(p, q)
+                const double apq = a(p, q);
+                if (std::abs(apq) <= 1e-30) {
+                    continue;
+                }
+                const double theta = (a(q, q) - a(p, p)) / (2 * apq);
+                const double t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                const double c = 1 / std::sqrt(t * t + 1);
+                const double s = t * c;
+
+                // A = J^T A J, V = V J
+                for (int k = 0; k < N; k++) {
+                    const double akp = a(k, p), akq = a(k, q);
+                    a(k, p) = c * akp - s * akq;
+                    a(k, q) = s * akp + c * akq;
+                    const double vkp = v(k, p), vkq = v(k, q);
+                    v(k, p) = c * vkp - s * vkq;
+                    v(k, q) = s * vkp + c * vkq;
+                }
+                for (int k = 0; k < N; k++) {
+                    const double apk = a(p, k), aqk = a(q, k);
+                    a(p, k) = c * apk - s * aqk;
+                    a(q, k) = s * apk + c * aqk;
+                }
+            }
+        }
+    }
+}
+
 template <size_t components, size_t principalComponents>
 void build_pca_space(const std::span<std::array<float, components>>& patches,
                      std::array<std::array<float16_t, principalComponents>, components>* pcaSpace) {
+    static_assert(principalComponents <= components);
+    if (patches.empty()) {
+        throw std::runtime_error("build_pca_space: no patches");
+    }
     auto t_start = std::chrono::high_resolution_clock::now();
 
-    MatrixXf_rm vectors((float *) patches.data(), patches.size(), components);
+    egn::Matrix<double, components, components> covariance = patch_covariance(patches);
 
-    // Compute covariance matrix for the patch data
-    egn::MatrixXf centered = vectors.rowwise() - vectors.colwise().mean();
-    egn::MatrixXf covariance = (centered.adjoint() * centered) / (vectors.rows() - 1);
-
-    // Note: The eigenvectors are the *columns* of the principal_components matrix and they are already normalized
-    egn::SelfAdjointEigenSolver<egn::MatrixXf> solver(covariance);
-    egn::VectorXf variances = solver.eigenvalues();
-    egn::MatrixXf eigenvectors = solver.eigenvectors();
-
-//    for (int i = variances.size() - 1; i > 0; i--) {
-//        std::cout << variances.size() - i - 1 << " : " << std::scientific << variances[i] << ", delta: " << variances[i] - variances[i-1] << std::endl;
-//    }
-//    std::cout << variances.size() - 1 << " : " << std::scientific << variances[0] << std::endl;
+    egn::Matrix<double, components, components> eigenvectors;
+    jacobi_eigen(&covariance, &eigenvectors);
 
     auto t_end = std::chrono::high_resolution_clock::now();
     auto elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
-    std::cout << "PCA Execution Time: " << (int)elapsed_time_ms << std::endl;
+    std::cout << "PCA Execution Time: " << elapsed_time_ms << std::endl;
 
-    // Select the largest eigenvectors in decreasing order
-    egn::MatrixXf main_components(components, principalComponents);
+    // Select the largest eigenvectors in decreasing order, the eigenvalues are on the diagonal
+    std::array<int, components> order;
+    std::iota(order.begin(), order.end(), 0);
+    std::partial_sort(order.begin(), order.begin() + principalComponents, order.end(),
+                      [&](int a, int b) { return covariance(a, a) > covariance(b, b); });
     for (int c = 0; c < principalComponents; c++) {
-        const auto& pci = eigenvectors.innerVector(components - 1 - c);
         for (int r = 0; r < components; r++) {
-            (*pcaSpace)[r][c] = pci[r];
+            (*pcaSpace)[r][c] = eigenvectors(r, order[c]);
         }
     }
 }
@@ -151,29 +251,23 @@ void pca(const gls::image<pixel_type>& input, int channel, int patch_size, gls::
     const int slices = input.height % 8 == 0 ? 8 : input.height % 4 == 0 ? 4 : input.height % 2 == 0 ? 2 : 1;
     const int slice_size = input.height / slices;
 
-    {
-        ThreadPool threadPool(slices);
-
-        for (int s = 0; s < slices; s++) {
-            threadPool.enqueue([s, slices, slice_size, patch_size, radius, &input, &vectors, &vectorsSmall](){
-                for (int y = s * slice_size; y < (s + 1) * slice_size; y++) {
-                    for (int x = 0; x < input.width; x++) {
-                        const int patch_index = y * input.width + x;
-                        const int small_patch_index = y * input.width / 64 + x / 8;
-                        for (int j = 0; j < patch_size; j++) {
-                            for (int i = 0; i < patch_size; i++) {
-                                const auto& p = input.getPixel(x + i - radius, y + j - radius);
-                                vectors(patch_index, j * patch_size + i) = p.x;
-                                if (x % 8 == 0 && y % 8 == 0) {
-                                    vectorsSmall(small_patch_index, j * patch_size + i) = p.x;
-                                }
-                            }
+    gls::parallel_for(0, slices * slice_size, slice_size, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < input.width; x++) {
+                const int patch_index = y * input.width + x;
+                const int small_patch_index = y * input.width / 64 + x / 8;
+                for (int j = 0; j < patch_size; j++) {
+                    for (int i = 0; i < patch_size; i++) {
+                        const auto& p = input.getPixel(x + i - radius, y + j - radius);
+                        vectors(patch_index, j * patch_size + i) = p.x;
+                        if (x % 8 == 0 && y % 8 == 0) {
+                            vectorsSmall(small_patch_index, j * patch_size + i) = p.x;
                         }
                     }
                 }
-            });
+            }
         }
-    }
+    });
 
     auto t_patches_end = std::chrono::high_resolution_clock::now();
     double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_patches_end - t_start).count();
@@ -0,0 +1,261 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TaskScheduler_hpp
+#define TaskScheduler_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gls_frame_arena.hpp"
+#include "gls_qos.hpp"
+
+namespace gls {
+
+// Process-wide scheduler for the short data parallel CPU phases of the pipeline (feature detection, NLF regression,
+// PCA, RANSAC...). The worker threads are created once, every worker has its own task deque and idle workers steal
+// from the others, so unrelated phases running at the same time don't contend on a single queue.
+//
+// The tasks run at the QoS class of the thread calling parallel_for, the workers switch to it for the task: a stage
+// sets its class with a QoSScope, e.g. user interactive for the capture path or utility for a batch conversion, and
+// its helpers follow on the performance or the efficiency cores alike. Idle workers are user initiated. The tasks also
+// allocate their frame containers from the caller's current FrameArena.
+class TaskScheduler {
+    struct Task {
+        std::function<void()> run;
+        QoS qos = QoS::userInitiated;
+        FrameArena* frameArena = nullptr;
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> _queues;
+    std::vector<std::thread> _workers;
+
+    std::atomic<int> _queuedTasks = 0;
+    std::atomic<unsigned> _nextQueue = 0;
+
+    std::mutex _sleepMutex;
+    std::condition_variable _wakeup;
+    bool _stop = false;
+
+    // Index of the worker running on this thread, -1 on the other threads
+    static int& workerIndex() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // Class the worker thread currently runs at, saves asking the kernel
+    static QoS& workerQoS() {
+        static thread_local QoS qos = QoS::userInitiated;
+        return qos;
+    }
+
+    explicit TaskScheduler(int threads) {
+        for (int i = 0; i < threads; i++) {
+            _queues.push_back(std::make_unique<WorkQueue>());
+        }
+        for (int i = 0; i < threads; i++) {
+            _workers.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    // Workers push on their own deque, the other threads distribute their tasks round robin
+    void push(Task task) {
+        const int worker = workerIndex();
+        auto& queue = *_queues[worker >= 0 ? worker : _nextQueue++ % _queues.size()];
+        {
+            std::lock_guard<std::mutex> guard(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        _queuedTasks++;
+        {
+            // Pairs with the predicate check of the sleeping workers
+            std::lock_guard<std::mutex> guard(_sleepMutex);
+        }
+        _wakeup.notify_one();
+    }
+
+    // Workers take the class of the task, nested tasks run by a worker waiting on its own parallel_for restore its
+    // class after them. The other threads keep theirs.
+    static void runTask(const Task& task, int worker, bool nested) {
+        FrameArena* const previousArena = FrameArena::current();
+        FrameArena::current() = task.frameArena;
+        runTaskWithQoS(task, worker, nested);
+        FrameArena::current() = previousArena;
+    }
+
+    static void runTaskWithQoS(const Task& task, int worker, bool nested) {
+        if (worker < 0 || task.qos == workerQoS()) {
+            task.run();
+            return;
+        }
+        const QoS previous = workerQoS();
+        setThreadQoS(workerQoS() = task.qos);
+        task.run();
+        if (nested) {
+            setThreadQoS(workerQoS() = previous);
+        }
+    }
+
+    // Pops the most recent task of the worker's own deque or steals the oldest one of another deque
+    bool tryRunTask(int worker, bool nested) {
+        const int queues = (int) _queues.size();
+        const int first = worker >= 0 ? worker : (int) (_nextQueue % queues);
+        for (int i = 0; i < queues; i++) {
+            auto& queue = *_queues[(first + i) % queues];
+            Task task;
+            {
+                std::lock_guard<std::mutex> guard(queue.mutex);
+                if (queue.tasks.empty()) {
+                    continue;
+                }
+                if (i == 0 && worker >= 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+            }
+            _queuedTasks--;
+            runTask(task, worker, nested);
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int index) {
+        setThreadQoS(workerQoS());
+        workerIndex() = index;
+
+        while (true) {
+            if (tryRunTask(index, /*nested=*/ false)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            _wakeup.wait(lock, [this]() { return _stop || _queuedTasks > 0; });
+            if (_stop) {
+                return;
+            }
+        }
+    }
+
+public:
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    ~TaskScheduler() {
+        {
+            std::lock_guard<std::mutex> guard(_sleepMutex);
+            _stop = true;
+        }
+        _wakeup.notify_all();
+        for (auto& worker : _workers) {
+            worker.join();
+        }
+    }
+
+    // The calling thread takes part in the work, so one core is left to it
+    static TaskScheduler& shared() {
+        static TaskScheduler scheduler(std::max((int) std::thread::hardware_concurrency() - 1, 1));
+        return scheduler;
+    }
+
+    int threadCount() const {
+        return (int) _workers.size() + 1;
+    }
+
+    // Runs process(i0, i1) on the sub-ranges [i0, i1) of [begin, end) of grain elements, the last one possibly
+    // shorter. The calling thread works on the range too and returns once all of it is done, nested calls from
+    // the tasks themselves are fine. The helpers run at the caller's QoS class. The first exception thrown by
+    // process is rethrown.
+    template <typename F>
+    void parallel_for(int begin, int end, int grain, F process) {
+        grain = std::max(grain, 1);
+        const int chunks = (end - begin + grain - 1) / grain;
+        if (chunks <= 1) {
+            if (end > begin) {
+                process(begin, end);
+            }
+            return;
+        }
+
+        // Chunks are claimed dynamically, the tasks only let the workers join in. Helpers running after the
+        // range is done find no chunk left and never touch process, which lives on this stack frame.
+        struct State {
+            std::atomic<int> nextChunk = 0;
+            std::atomic<int> remainingChunks;
+            std::mutex exceptionMutex;
+            std::exception_ptr exception;
+        };
+        auto state = std::make_shared<State>();
+        state->remainingChunks = chunks;
+
+        const auto work = [state, chunks, begin, end, grain, &process]() {
+            for (int c = state->nextChunk++; c < chunks; c = state->nextChunk++) {
+                const int i0 = begin + c * grain;
+                try {
+                    process(i0, std::min(i0 + grain, end));
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(state->exceptionMutex);
+                    if (!state->exception) {
+                        state->exception = std::current_exception();
+                    }
+                }
+                state->remainingChunks--;
+            }
+        };
+
+        const QoS qos = workerIndex() >= 0 ? workerQoS() : threadQoS();
+        const int helpers = std::min(chunks - 1, (int) _workers.size());
+        for (int i = 0; i < helpers; i++) {
+            push({ work, qos, FrameArena::current() });
+        }
+        work();
+
+        // Help with other work while the chunks claimed by the workers complete
+        while (state->remainingChunks > 0) {
+            if (!tryRunTask(workerIndex(), /*nested=*/ true)) {
+                std::this_thread::yield();
+            }
+        }
+
+        if (state->exception) {
+            std::rethrow_exception(state->exception);
+        }
+    }
+};
+
+// Shorthand for TaskScheduler::shared().parallel_for
+template <typename F>
+inline void parallel_for(int begin, int end, int grain, F process) {
+    TaskScheduler::shared().parallel_for(begin, end, grain, process);
+}
+
+}  // namespace gls
+
+#endif /* TaskScheduler_hpp */
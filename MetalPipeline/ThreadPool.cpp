@@ -19,14 +19,18 @@ freely, subject to the following restrictions:
 
    3. This notice may not be removed or altered from any source
    distribution.
+ *
+ * Modified by Glass Imaging: QoS class of the worker threads.
  */
 
 #include "ThreadPool.hpp"
 
 // the constructor just launches some amount of workers
-ThreadPool::ThreadPool(size_t threads) : stop(false) {
+ThreadPool::ThreadPool(size_t threads, gls::QoS qos) : stop(false) {
     for (size_t i = 0; i < threads; ++i)
-        workers.emplace_back([this] {
+        workers.emplace_back([this, qos] {
+            gls::setThreadQoS(qos);
+
             for (;;) {
                 std::packaged_task<void()> task;
 
@@ -19,6 +19,8 @@ freely, subject to the following restrictions:
 
    3. This notice may not be removed or altered from any source
    distribution.
+ *
+ * Modified by Glass Imaging: QoS class of the worker threads.
  */
 
 #ifndef THREAD_POOL_HPP
@@ -28,9 +30,12 @@ freely, subject to the following restrictions:
 #include <future>
 #include <queue>
 
+#include "gls_qos.hpp"
+
 class ThreadPool {
    public:
-    explicit ThreadPool(size_t);
+    // The workers run at the given QoS class, e.g. utility for the encoders of a batch conversion
+    explicit ThreadPool(size_t, gls::QoS qos = gls::QoS::userInitiated);
     template <class F, class... Args>
     decltype(auto) enqueue(F&& f, Args&&... args);
     ~ThreadPool();
@@ -0,0 +1,100 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef capture_telemetry_hpp
+#define capture_telemetry_hpp
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace gls {
+
+// Field performance record of a capture, plain data so it can be copied in and out of the telemetry ring
+struct CaptureTelemetry {
+    double timestamp;           // Completion, seconds since the epoch
+    int width;
+    int height;
+    int preset;                 // PipelinePreset::Name
+    int pyramidLevels;
+    int thermalState;           // NSProcessInfoThermalState at submission
+    double leaseWaitMs;         // Waiting for a converter
+    double calibrationMs;       // Camera calibration, white balance and noise estimation, CPU
+    double encodeMs;            // Pipeline encoding and submission, CPU
+    double totalMs;             // From the start of the conversion to the result
+    double gpuMs;               // GPU execution time of the conversion
+    uint64_t gpuLiveBytes;      // Tracked device memory at completion
+    uint64_t gpuPeakBytes;      // Process-wide high-water mark of the tracked device memory
+};
+
+// Fixed size, lock-free ring of the most recent records: any number of threads record, the oldest records are
+// overwritten, a reader collects the records since its cursor without stopping the writers. Each slot is a seqlock:
+// its sequence is odd while being written, a reader keeps a copy only if the sequence was even and unchanged
+// around it. Records overwritten before being read are lost, readers should drain well within capacity records.
+template <typename T, size_t capacity>
+class telemetry_ring {
+    static_assert(std::is_trivially_copyable_v<T>, "telemetry_ring records are copied while being written");
+
+    struct Slot {
+        std::atomic<uint64_t> sequence = 0;
+        T record;
+    };
+
+    std::array<Slot, capacity> _slots;
+    std::atomic<uint64_t> _next = 0;
+
+public:
+    void record(const T& record) {
+        const uint64_t n = _next.fetch_add(1);
+        auto& slot = _slots[n % capacity];
+        slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.record = record;
+        slot.sequence.store(2 * n + 2, std::memory_order_release);
+    }
+
+    // Appends the records from *cursor on to records and advances the cursor, stops at a record still being written
+    void read(uint64_t* cursor, std::vector<T>* records) const {
+        const uint64_t next = _next.load(std::memory_order_acquire);
+        uint64_t n = std::max(*cursor, next > capacity ? next - capacity : 0);
+        for (; n < next; n++) {
+            const auto& slot = _slots[n % capacity];
+            const uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            if (before < 2 * n + 2) {
+                break;  // Not written yet
+            }
+            T record = slot.record;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (before == 2 * n + 2 && slot.sequence.load(std::memory_order_relaxed) == before) {
+                records->push_back(record);
+            }
+            // Otherwise overwritten by a newer record, lost
+        }
+        *cursor = n;
+    }
+
+    // Records made so far, including the overwritten ones
+    uint64_t count() const {
+        return _next.load(std::memory_order_acquire);
+    }
+};
+
+}  // namespace gls
+
+#endif /* capture_telemetry_hpp */
@@ -0,0 +1,131 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef color_profile_cache_hpp
+#define color_profile_cache_hpp
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "demosaic.hpp"
+
+// Process-wide cache of the parsed ICC profiles and of the camera to YCbCr transforms derived from them. Profiles
+// are keyed by a hash of their data, and optionally by a name (a color space or a file path) which skips loading
+// the data at all. All the converters share the profile's bytes and its xyz_rgb matrix, the transforms are computed
+// once per (camera matrix, profile) pair, the frames of a burst share their rgb_cam.
+class ColorProfileCache {
+public:
+    struct Profile {
+        std::vector<uint8_t> data;
+        gls::Matrix<3, 3> xyz_rgb;
+    };
+
+    struct YCbCrTransforms {
+        gls::Matrix<3, 3> cam_to_ycbcr;
+        gls::Matrix<3, 3> ycbcr_to_cam;
+    };
+
+private:
+    // Recent transforms, the camera matrices change with the white balance of every capture
+    static constexpr size_t kTransformsCapacity = 16;
+
+    struct TransformsEntry {
+        gls::Matrix<3, 3> rgb_cam;
+        gls::Matrix<3, 3> xyz_rgb;
+        YCbCrTransforms transforms;
+    };
+
+    std::unordered_map<uint64_t, std::vector<std::shared_ptr<const Profile>>> _profiles;
+    std::unordered_map<std::string, std::shared_ptr<const Profile>> _namedProfiles;
+    std::list<TransformsEntry> _transforms;
+    std::mutex _mutex;
+
+    static uint64_t hash(const std::vector<uint8_t>& data) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (const auto byte : data) {
+            h = (h ^ byte) * 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    static bool equal(const gls::Matrix<3, 3>& a, const gls::Matrix<3, 3>& b) {
+        for (int j = 0; j < 3; j++) {
+            for (int i = 0; i < 3; i++) {
+                if (a[j][i] != b[j][i]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Called with _mutex held
+    std::shared_ptr<const Profile> findOrParse(const std::vector<uint8_t>& icc_profile_data) {
+        auto& bucket = _profiles[hash(icc_profile_data)];
+        for (const auto& profile : bucket) {
+            if (profile->data == icc_profile_data) {
+                return profile;
+            }
+        }
+        auto profile = std::make_shared<const Profile>(Profile { icc_profile_data, icc_profile_xyz_matrix(icc_profile_data) });
+        bucket.push_back(profile);
+        return profile;
+    }
+
+public:
+    static ColorProfileCache& shared() {
+        static ColorProfileCache cache;
+        return cache;
+    }
+
+    std::shared_ptr<const Profile> profile(const std::vector<uint8_t>& icc_profile_data) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return findOrParse(icc_profile_data);
+    }
+
+    // load is only called the first time the name is seen
+    std::shared_ptr<const Profile> profile(const std::string& name, const std::function<std::vector<uint8_t>()>& load) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto& profile = _namedProfiles[name];
+        if (!profile) {
+            profile = findOrParse(load());
+        }
+        return profile;
+    }
+
+    YCbCrTransforms ycbcrTransforms(const gls::Matrix<3, 3>& rgb_cam, const gls::Matrix<3, 3>& xyz_rgb) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (auto it = _transforms.begin(); it != _transforms.end(); it++) {
+            if (equal(it->rgb_cam, rgb_cam) && equal(it->xyz_rgb, xyz_rgb)) {
+                _transforms.splice(_transforms.begin(), _transforms, it);
+                return it->transforms;
+            }
+        }
+        const auto cam_to_ycbcr = cam_ycbcr(rgb_cam, xyz_rgb);
+        _transforms.push_front({ rgb_cam, xyz_rgb, { cam_to_ycbcr, inverse(cam_to_ycbcr) } });
+        if (_transforms.size() > kTransformsCapacity) {
+            _transforms.pop_back();
+        }
+        return _transforms.front().transforms;
+    }
+};
+
+#endif /* color_profile_cache_hpp */
@@ -0,0 +1,402 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef cpu_pyramid_levels_hpp
+#define cpu_pyramid_levels_hpp
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#if __aarch64__
+#include <arm_neon.h>
+#endif
+
+#include "gls_image.hpp"
+#include "float16.hpp"
+#include "PCA.hpp"
+#include "TaskScheduler.hpp"
+#include "gls_frame_arena.hpp"
+
+// CPU versions of the kernels denoising the smallest pyramid levels, see PyramidProcessor::cpuLevels: the
+// subtractNoiseImage, pcaSpace, pcaProjection, blockMatchingDenoiseImage and denoiseImage kernels of demosaic.metal
+// on planar float copies of the levels. The PCA distances and projections are NEON vectorized on Apple silicon, the
+// rows run in parallel on the TaskScheduler. Reads outside of the levels are clamped to their edges.
+namespace cpu_pyramid {
+
+// A plane per channel, with the bilinear sampling of the GPU's linear sampler with clamp to edge addressing
+struct PlanarImage {
+    int width = 0;
+    int height = 0;
+    std::vector<std::vector<float>> planes;
+
+    PlanarImage() = default;
+
+    PlanarImage(int _width, int _height, int channels) : width(_width), height(_height),
+        planes(channels, std::vector<float>(_width * _height)) { }
+
+    float& operator()(int c, int x, int y) {
+        return planes[c][y * width + x];
+    }
+
+    float operator()(int c, int x, int y) const {
+        return planes[c][y * width + x];
+    }
+
+    float clamped(int c, int x, int y) const {
+        return planes[c][std::clamp(y, 0, height - 1) * width + std::clamp(x, 0, width - 1)];
+    }
+
+    // x and y in texels, the texel centers are at the integer coordinates
+    float sample(int c, float x, float y) const {
+        const float x0 = std::floor(x), y0 = std::floor(y);
+        const float fx = x - x0, fy = y - y0;
+        const int ix = (int) x0, iy = (int) y0;
+        const float top = (1 - fx) * clamped(c, ix, iy) + fx * clamped(c, ix + 1, iy);
+        const float bottom = (1 - fx) * clamped(c, ix, iy + 1) + fx * clamped(c, ix + 1, iy + 1);
+        return (1 - fy) * top + fy * bottom;
+    }
+};
+
+template <typename T>
+PlanarImage toPlanar(const gls::image<T>& image) {
+    PlanarImage planar(image.width, image.height, T::channels);
+    gls::parallel_for(0, image.height, /*grain=*/ 16, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < image.width; x++) {
+                for (int c = 0; c < T::channels; c++) {
+                    planar(c, x, y) = (float) image[y][x][c];
+                }
+            }
+        }
+    });
+    return planar;
+}
+
+template <typename T>
+void fromPlanar(const PlanarImage& planar, gls::image<T>* image) {
+    gls::parallel_for(0, image->height, /*grain=*/ 16, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < image->width; x++) {
+                for (int c = 0; c < T::channels; c++) {
+                    (*image)[y][x][c] = planar(c, x, y);
+                }
+            }
+        }
+    });
+}
+
+// Gradients at the level's resolution, the half resolution ones are upsampled like GradientView does
+inline PlanarImage levelGradients(PlanarImage gradients, int width, int height) {
+    if (gradients.width >= width) {
+        return gradients;
+    }
+    PlanarImage upsampled(width, height, 2);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 2; c++) {
+                upsampled(c, x, y) = gradients.sample(c, 0.5f * x - 0.25f, 0.5f * y - 0.25f);
+            }
+        }
+    }
+    return upsampled;
+}
+
+// Green channel gain of the lens shading at each pixel of a level, see lensShadingGain in demosaic.metal
+inline std::vector<float> lensShadingGains(const gls::image<gls::pixel_float4>* gainMap, const std::array<float, 4>& geometry,
+                                           bool enabled, int width, int height) {
+    std::vector<float> gains(width * height, 1);
+    if (!enabled || !gainMap) {
+        return gains;
+    }
+    const auto map = toPlanar(*gainMap);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float tx = ((x + 0.5f) * geometry[0] + geometry[2]) * map.width - 0.5f;
+            const float ty = ((y + 0.5f) * geometry[1] + geometry[3]) * map.height - 0.5f;
+            gains[y * width + x] = map.sample(/*raw_green=*/ 1, tx, ty);
+        }
+    }
+    return gains;
+}
+
+inline float smoothstep(float edge0, float edge1, float x) {
+    const float t = std::clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+    return t * t * (3 - 2 * t);
+}
+
+inline float gaussian(float x) {
+    return std::exp(-2 * x * x);
+}
+
+// subtractNoiseImage: the noise of the coarser level, its input minus its denoised version, is removed from the level
+inline PlanarImage subtractNoise(const PlanarImage& input, const PlanarImage& input1, const PlanarImage& denoised1,
+                                 const PlanarImage& gradients, float lumaWeight, float sharpening,
+                                 const std::array<float, 2>& nlf) {
+    PlanarImage output(input.width, input.height, 4);
+    const float sx = input1.width / (float) input.width, sy = input1.height / (float) input.height;
+    gls::parallel_for(0, input.height, /*grain=*/ 8, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < input.width; x++) {
+                const float px = (x + 0.5f) * sx - 0.5f, py = (y + 0.5f) * sy - 0.5f;
+
+                std::array<float, 3> denoised1Pixel, pixel;
+                for (int c = 0; c < 3; c++) {
+                    denoised1Pixel[c] = denoised1.sample(c, px, py);
+                    const float noise = input1.sample(c, px, py) - denoised1Pixel[c];
+                    pixel[c] = input(c, x, y) - (c == 0 ? lumaWeight : 1) * noise;
+                }
+
+                float alpha = sharpening;
+                if (alpha > 1) {
+                    const float gradient = std::hypot(gradients(0, x, y), gradients(1, x, y));
+                    const float sigma = std::sqrt(nlf[0] + nlf[1] * denoised1Pixel[0]);
+                    const float detail = smoothstep(sigma, 4 * sigma, gradient)
+                                         * (1 - smoothstep(0.75, 0.95, denoised1Pixel[0]))
+                                         * smoothstep(0.05, 0.1, denoised1Pixel[0]);
+                    alpha = 1 + (alpha - 1) * detail;
+                }
+
+                for (int c = 0; c < 3; c++) {
+                    output(c, x, y) = denoised1Pixel[c] + alpha * (pixel[c] - denoised1Pixel[c]);
+                }
+                output(0, x, y) = std::max(output(0, x, y), 0.0f);
+                output(3, x, y) = input.planes.size() > 3 ? input(3, x, y) : 0;
+            }
+        }
+    });
+    return output;
+}
+
+// denoiseImage: edge directed bilateral filter, the output's w is the gradient magnitude
+inline PlanarImage denoise(const PlanarImage& input, const PlanarImage& gradients, const std::array<float, 3>& var_a,
+                           const std::array<float, 3>& var_b, const std::array<float, 3>& thresholdMultipliers,
+                           float chromaBoost, float gradientBoost, float gradientThreshold) {
+    PlanarImage output(input.width, input.height, 4);
+    const int size = gradientBoost > 0 ? 4 : 2;
+    gls::parallel_for(0, input.height, /*grain=*/ 4, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < input.width; x++) {
+                const std::array<float, 3> inputYCC = { input(0, x, y), input(1, x, y), input(2, x, y) };
+
+                std::array<float, 3> sigma, diffMultiplier;
+                for (int c = 0; c < 3; c++) {
+                    sigma[c] = std::sqrt(var_a[c] + var_b[c] * inputYCC[0]);
+                    diffMultiplier[c] = 1 / (thresholdMultipliers[c] * sigma[c]);
+                }
+
+                const float gx = gradients(0, x, y), gy = gradients(1, x, y);
+                const float angle = std::atan2(gy, gx);
+                const float cosAngle = std::cos(angle), sinAngle = std::sin(angle);
+                const float magnitude = std::hypot(gx, gy);
+                const float edge = smoothstep(4, 16, gradientThreshold * magnitude / sigma[0]);
+
+                std::array<float, 3> filtered = { 0, 0, 0 }, norm = { 0, 0, 0 };
+                for (int j = -size; j <= size; j++) {
+                    for (int i = -size; i <= size; i++) {
+                        const std::array<float, 3> sampleYCC = { input.clamped(0, x + i, y + j), input.clamped(1, x + i, y + j),
+                                                                 input.clamped(2, x + i, y + j) };
+                        const float gdx = (gradients.clamped(0, x + i, y + j) - gx) / sigma[0];
+                        const float gdy = (gradients.clamped(1, x + i, y + j) - gy) / sigma[0];
+
+                        const float dy = (sampleYCC[0] - inputYCC[0]) * diffMultiplier[0];
+                        const float dcb = (sampleYCC[1] - inputYCC[1]) * diffMultiplier[1];
+                        const float dcr = (sampleYCC[2] - inputYCC[2]) * diffMultiplier[2];
+
+                        const float a = i * cosAngle + j * sinAngle;
+                        const float directionWeight = 1 + (std::exp(-(a * a) / 0.25f) - 1) * edge;
+                        const float gradientWeight = 1 - smoothstep(2, 8, std::hypot(gdx, gdy));
+
+                        const float lumaWeight = std::abs(dy) < 1 + gradientBoost * edge ? 1 : 0;
+                        const float chromaWeight = std::sqrt(dy * dy + dcb * dcb + dcr * dcr) < chromaBoost ? 1 : 0;
+
+                        const std::array<float, 3> weight = { directionWeight * gradientWeight * lumaWeight, chromaWeight, chromaWeight };
+                        for (int c = 0; c < 3; c++) {
+                            filtered[c] += weight[c] * sampleYCC[c];
+                            norm[c] += weight[c];
+                        }
+                    }
+                }
+                for (int c = 0; c < 3; c++) {
+                    output(c, x, y) = filtered[c] / norm[c];
+                }
+                output(3, x, y) = magnitude;
+            }
+        }
+    });
+    return output;
+}
+
+static constexpr int kPatchSize = 25;
+static constexpr int kComponents = 8;
+typedef std::array<std::array<float16_t, kComponents>, kPatchSize> PCABasis;
+
+// pcaSpace: the basis of the 5x5 luma patches, one patch per cell of a grid of about sampleBudget cells
+inline PCABasis pcaBasis(const PlanarImage& input, int sampleBudget) {
+    const int stride = std::max(1, (int) std::sqrt(input.width * input.height / (float) std::max(sampleBudget, 1)));
+    gls::frame_vector<std::array<float, kPatchSize>> patches;
+    patches.reserve(((input.width + stride - 1) / stride) * ((input.height + stride - 1) / stride));
+    for (int y = stride / 2; y < input.height; y += stride) {
+        for (int x = stride / 2; x < input.width; x += stride) {
+            auto& patch = patches.emplace_back();
+            for (int j = -2, k = 0; j <= 2; j++) {
+                for (int i = -2; i <= 2; i++, k++) {
+                    patch[k] = input.clamped(0, x + i, y + j);
+                }
+            }
+        }
+    }
+    PCABasis basis;
+    build_pca_space<kPatchSize, kComponents>(std::span(patches), &basis);
+    return basis;
+}
+
+// pcaProjection: the components of the 5x5 luma patch of every pixel, the unused components are zero
+inline std::vector<std::array<float, kComponents>> pcaProjection(const PlanarImage& input, const PCABasis& basis) {
+    std::array<std::array<float, kComponents>, kPatchSize> basis32;
+    for (int r = 0; r < kPatchSize; r++) {
+        for (int c = 0; c < kComponents; c++) {
+            basis32[r][c] = (float) basis[r][c];
+        }
+    }
+
+    std::vector<std::array<float, kComponents>> projection(input.width * input.height);
+    gls::parallel_for(0, input.height, /*grain=*/ 8, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < input.width; x++) {
+#if __aarch64__
+                float32x4_t lo = vdupq_n_f32(0), hi = vdupq_n_f32(0);
+                for (int j = -2, k = 0; j <= 2; j++) {
+                    for (int i = -2; i <= 2; i++, k++) {
+                        const float value = input.clamped(0, x + i, y + j);
+                        lo = vmlaq_n_f32(lo, vld1q_f32(&basis32[k][0]), value);
+                        hi = vmlaq_n_f32(hi, vld1q_f32(&basis32[k][4]), value);
+                    }
+                }
+                auto& result = projection[y * input.width + x];
+                vst1q_f32(&result[0], lo);
+                vst1q_f32(&result[4], hi);
+#else
+                std::array<float, kComponents> result = {};
+                for (int j = -2, k = 0; j <= 2; j++) {
+                    for (int i = -2; i <= 2; i++, k++) {
+                        const float value = input.clamped(0, x + i, y + j);
+                        for (int c = 0; c < kComponents; c++) {
+                            result[c] += basis32[k][c] * value;
+                        }
+                    }
+                }
+                projection[y * input.width + x] = result;
+#endif
+            }
+        }
+    });
+    return projection;
+}
+
+// Distance of two PCA vectors over their first components
+inline float pcaDistance(const std::array<float, kComponents>& a, const std::array<float, kComponents>& b, int components) {
+#if __aarch64__
+    if (components == kComponents) {
+        const float32x4_t dlo = vsubq_f32(vld1q_f32(&a[0]), vld1q_f32(&b[0]));
+        const float32x4_t dhi = vsubq_f32(vld1q_f32(&a[4]), vld1q_f32(&b[4]));
+        return std::sqrt(vaddvq_f32(vmlaq_f32(vmulq_f32(dlo, dlo), dhi, dhi)));
+    }
+#endif
+    float sum = 0;
+    for (int c = 0; c < components; c++) {
+        const float d = a[c] - b[c];
+        sum += d * d;
+    }
+    return std::sqrt(sum);
+}
+
+// blockMatchingDenoiseImage: non local means over a 21x21 window with the PCA distance of the luma patches, the
+// output's w is the luma kernel norm
+inline PlanarImage blockMatchingDenoise(const PlanarImage& input, const PlanarImage& gradients,
+                                        const std::vector<std::array<float, kComponents>>& projection, int components,
+                                        const std::array<float, 3>& var_a, const std::array<float, 3>& var_b,
+                                        const std::array<float, 3>& thresholdMultipliers, float chromaBoost,
+                                        float gradientBoost, float gradientThreshold, const std::vector<float>& lensShading) {
+    constexpr int radius = 10;  // kBlockMatchingRadius in demosaic.metal
+
+    // The spatial weights of the window
+    std::array<float, (2 * radius + 1) * (2 * radius + 1)> directionWeights;
+    for (int j = -radius, k = 0; j <= radius; j++) {
+        for (int i = -radius; i <= radius; i++, k++) {
+            directionWeights[k] = gaussian(0.1f * std::hypot((float) i, (float) j));
+        }
+    }
+
+    PlanarImage output(input.width, input.height, 4);
+    gls::parallel_for(0, input.height, /*grain=*/ 2, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < input.width; x++) {
+                const std::array<float, 3> inputYCC = { input(0, x, y), input(1, x, y), input(2, x, y) };
+                const auto& inputPCA = projection[y * input.width + x];
+                const float gain = lensShading[y * input.width + x];
+
+                std::array<float, 3> diffMultiplier;
+                float lumaSigma = 0;
+                for (int c = 0; c < 3; c++) {
+                    const float sigma = std::sqrt(var_a[c] + var_b[c] * gain * inputYCC[0]);
+                    diffMultiplier[c] = 1 / (thresholdMultipliers[c] * sigma);
+                    if (c == 0) {
+                        lumaSigma = sigma;
+                    }
+                }
+
+                const float magnitude = std::hypot(gradients(0, x, y), gradients(1, x, y));
+                const float edge = smoothstep(2, 16, gradientThreshold * magnitude / lumaSigma);
+                const float lumaScale = diffMultiplier[0] / (1 + gradientBoost * edge);
+
+                std::array<float, 3> filtered = { 0, 0, 0 }, norm = { 0, 0, 0 };
+                for (int j = -radius, k = 0; j <= radius; j++) {
+                    const int sy = std::clamp(y + j, 0, input.height - 1);
+                    for (int i = -radius; i <= radius; i++, k++) {
+                        const int sx = std::clamp(x + i, 0, input.width - 1);
+                        const int s = sy * input.width + sx;
+
+                        const float pcaDiff = pcaDistance(projection[s], inputPCA, components);
+                        const float dcb = (input.planes[1][s] - inputYCC[1]) * diffMultiplier[1] / chromaBoost;
+                        const float dcr = (input.planes[2][s] - inputYCC[2]) * diffMultiplier[2] / chromaBoost;
+
+                        const float lumaWeight = gaussian(pcaDiff * lumaScale);
+                        const float chromaWeight = gaussian(std::sqrt(lumaWeight * lumaWeight + dcb * dcb + dcr * dcr));
+
+                        const float directionWeight = directionWeights[k];
+                        filtered[0] += directionWeight * lumaWeight * input.planes[0][s];
+                        filtered[1] += directionWeight * chromaWeight * input.planes[1][s];
+                        filtered[2] += directionWeight * chromaWeight * input.planes[2][s];
+                        norm[0] += directionWeight * lumaWeight;
+                        norm[1] += directionWeight * chromaWeight;
+                    }
+                }
+                norm[2] = norm[1];
+                for (int c = 0; c < 3; c++) {
+                    output(c, x, y) = filtered[c] / norm[c];
+                }
+                output(3, x, y) = norm[0];
+            }
+        }
+    });
+    return output;
+}
+
+}  // namespace cpu_pyramid
+
+#endif /* cpu_pyramid_levels_hpp */
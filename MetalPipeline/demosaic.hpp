@@ -16,12 +16,21 @@
 #ifndef demosaic_hpp
 #define demosaic_hpp
 
+#include <functional>
 #include <iomanip>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "gls_image.hpp"
 #include "gls_linalg.hpp"
 #include "gls_tiff_metadata.hpp"
 
+#include "lens_distortion.hpp"
+#include "lens_shading.hpp"
+
 enum BayerPattern { grbg = 0, gbrg = 1, rggb = 2, bggr = 3 };
 
 static const char* BayerPatternName[4] = {"GRBG", "GBRG", "RGGB", "BGGR"};
@@ -40,6 +49,42 @@ typedef struct DenoiseParameters {
     float sharpening = 1.0;
 } DenoiseParameters;
 
+// Denoising pyramid depth and number of PCA components used for block matching: low noise images can use a
+// shallower pyramid and fewer components. The depth is at most the calibrated 5 levels, the components at most 8.
+//
+// The noise thresholds plan each level from its noise, the standard deviation at mid grey of the level's NLF scaled
+// by the luma and chroma multipliers: below blockMatchingNoise a level is denoised without PCA and block matching,
+// below copyNoise it is passed through. Level 0 is always denoised, zero thresholds run every level in full.
+//
+// The PCA basis of a level is computed from at most pcaSampleBudget patches, stratified over the level. With a
+// non-negative pcaBasisLevel the finer levels reuse the basis of that level instead of computing their own.
+// chroma420 denoises the chroma of all levels below the coarsest at half resolution, see PyramidProcessor.
+typedef struct DenoisePyramidConfig {
+    int levels = 5;
+    int pcaComponents = 8;
+    float blockMatchingNoise = 0;
+    float copyNoise = 0;
+    int pcaSampleBudget = 64 * 1024;
+    int pcaBasisLevel = -1;
+    bool chroma420 = false;
+} DenoisePyramidConfig;
+
+// ISO driven pyramid configuration, the full pyramid above ISO 400 or when the ISO is unknown
+inline DenoisePyramidConfig denoisePyramidConfigFromIso(int iso) {
+    static const std::array<std::pair<int, DenoisePyramidConfig>, 2> configTable = {{
+        { 100, { .levels = 3, .pcaComponents = 4, .blockMatchingNoise = 2e-3, .copyNoise = 5e-4 } },
+        { 400, { .levels = 4, .pcaComponents = 6, .blockMatchingNoise = 1e-3 } },
+    }};
+    if (iso > 0) {
+        for (const auto& [maxIso, config] : configTable) {
+            if (iso <= maxIso) {
+                return config;
+            }
+        }
+    }
+    return DenoisePyramidConfig();
+}
+
 typedef struct RGBConversionParameters {
     float contrast = 1.05;
     float saturation = 1.0;
@@ -92,21 +137,67 @@ void dumpNoiseModel(const std::array<CalibrationEntry, N>& calibration_files,
     std::cout << "}};" << std::endl;
 }
 
+// The noise models of a calibration series as the ISO list and the NLFData table of the calibration sources, e.g.
+// Sonya6400Calibration.cpp, ready to paste. The models must be sorted by ISO.
+template <size_t levels>
+void writeNLFData(std::ostream& os, const std::string& calibrationName,
+                  const std::vector<std::pair<int, NoiseModel<levels>>>& noiseModels) {
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+
+    os << "// nlfFromIso: { ";
+    for (int i = 0; i < noiseModels.size(); i++) {
+        os << (i > 0 ? ", " : "") << noiseModels[i].first;
+    }
+    os << " }" << std::endl << std::endl;
+
+    os << "// --- NLFData ---" << std::endl << std::endl;
+    os << "template<>" << std::endl;
+    os << "const std::array<NoiseModel<" << levels << ">, " << noiseModels.size() << "> " << calibrationName << "<"
+       << levels << ">::NLFData = {{" << std::endl;
+    os << std::scientific << std::setprecision(3);
+    for (const auto& [iso, noiseModel] : noiseModels) {
+        os << "    // ISO " << iso << std::endl;
+        os << "    {" << std::endl;
+        os << "        {{" << noiseModel.rawNlf.first << "}, {" << noiseModel.rawNlf.second << "}}," << std::endl;
+        os << "        {{" << std::endl;
+        for (const auto& nlf : noiseModel.pyramidNlf) {
+            os << "            {{" << nlf.first << "}, {" << nlf.second << "}}," << std::endl;
+        }
+        os << "        }}" << std::endl;
+        os << "    }," << std::endl;
+    }
+    os << "}};" << std::endl;
+
+    os.flags(flags);
+    os.precision(precision);
+}
+
 typedef struct LTMParameters {
     float eps = 0.01;
     float shadows = 0.8;
     float highlights = 1.05;
     float detail[3] = {1.1, 1.2, 1.3};
+    // Guided filter radius of the low, medium and high frequency bands, the cost doesn't depend on it
+    int radius[3] = {2, 2, 2};
 } LTMParameters;
 
 typedef struct DemosaicParameters {
     // Basic Debayering Parameters
     BayerPattern bayerPattern;
+    // Quad Bayer sensor data, bayerPattern is the layout of its 2x2 blocks of the same color, see
+    // RawConverter::setQuadBayerMode
+    bool quadBayer = false;
     float black_level = 0;
     float white_level = 1;
     float exposure_multiplier = 1;
     float raw_exposure_multiplier = 1;
+    // Radial falloff of the calibration, used without a DNG gain map
     float lensShadingCorrection = 0;
+    // The DNG's OpcodeList2 gain maps, if any
+    std::shared_ptr<const LensShadingGainMap> lensShadingGainMap;
+    // The DNG's OpcodeList3 WarpRectilinear, if any, for the registration warps to correct, see WarpTransform
+    std::optional<LensDistortion> lensDistortion;
     gls::Vector<4> scale_mul;
     gls::Matrix<3, 3> rgb_cam;
 
@@ -114,7 +205,11 @@ typedef struct DemosaicParameters {
     RAWDenoiseParameters rawDenoiseParameters;
     NoiseModel<5> noiseModel;
     std::array<DenoiseParameters, 5> denoiseParameters;
+    DenoisePyramidConfig denoisePyramidConfig;
     int iso;
+    // Capture identification for the noise model cache
+    std::string cameraModel;
+    float exposureTime = 0;
 
     // Camera Color Space to RGB Parameters
     RGBConversionParameters rgbConversionParameters;
@@ -178,6 +273,38 @@ NoiseModel<levels> lerp(const NoiseModel<levels>& nm0, const NoiseModel<levels>&
     return {lerp(nm0.rawNlf, nm1.rawNlf, a), lerp<levels>(nm0.pyramidNlf, nm1.pyramidNlf, a)};
 }
 
+// A burst merged from effectiveFrames frames has a fraction of the single frame noise variance: scale the noise
+// model accordingly and pick the denoising pyramid configuration of the equivalent ISO, a merged burst needs a
+// much lighter denoise than any of its frames
+inline void mergedBurstParameters(DemosaicParameters* demosaicParameters, float effectiveFrames) {
+    const float scale = 1 / std::max(effectiveFrames, 1.0f);
+
+    auto& noiseModel = demosaicParameters->noiseModel;
+    for (int c = 0; c < 4; c++) {
+        noiseModel.rawNlf.first[c] *= scale;
+        noiseModel.rawNlf.second[c] *= scale;
+    }
+    for (auto& nlf : noiseModel.pyramidNlf) {
+        for (int c = 0; c < 3; c++) {
+            nlf.first[c] *= scale;
+            nlf.second[c] *= scale;
+        }
+    }
+    if (demosaicParameters->iso > 0) {
+        demosaicParameters->denoisePyramidConfig = denoisePyramidConfigFromIso(std::max((int) (demosaicParameters->iso * scale), 1));
+    }
+}
+
+// An exposure bracket merge is written in the units of its shortest exposure, outputScale darker than the reference:
+// render it as a DNG with outputScale more baseline exposure, see unpackDNGMetadata. The reference's noise model is
+// kept, the merge only lowers the noise of the reference's shadows and highlights.
+inline void mergedHDRParameters(DemosaicParameters* demosaicParameters, float outputScale) {
+    for (int c = 0; c < 4; c++) {
+        demosaicParameters->scale_mul[c] *= outputScale;
+    }
+    demosaicParameters->raw_exposure_multiplier *= outputScale;
+}
+
 inline static float smoothstep(float edge0, float edge1, float x) {
     float t = std::clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
     return t * t * (3.0f - 2.0f * t);
@@ -212,10 +339,21 @@ gls::Matrix<3, 3> cam_xyz_coeff(gls::Vector<3>* pre_mul, const gls::Matrix<3, 3>
 void colorcheck(const gls::image<gls::luma_pixel_16>& rawImage, BayerPattern bayerPattern, uint32_t black,
                 std::array<gls::rectangle, 24> gmb_samples);
 
+// Signature of autoWhiteBalance, for alternative implementations like RawConverter::autoWhiteBalance on the GPU
+typedef std::function<gls::Vector<3>(const gls::image<gls::luma_pixel_16>& rawImage, const gls::Matrix<3, 3>& rgb_ycbcr,
+                                     const gls::Vector<4>& scale_mul, float white, float black, BayerPattern bayerPattern,
+                                     float* highlights)> AutoWhiteBalanceFunction;
+
+// With auto_white_balance the white point is estimated by awbFunction, autoWhiteBalance if null
 float unpackDNGMetadata(const gls::image<gls::luma_pixel_16>& rawImage, gls::tiff_metadata* dng_metadata,
                         DemosaicParameters* demosaicParameters, const gls::Matrix<3, 3>& xyz_rgb,
                         bool auto_white_balance, const gls::rectangle* gmb_position, bool rotate_180,
-                        float* highlights = nullptr);
+                        float* highlights = nullptr, const AutoWhiteBalanceFunction& awbFunction = nullptr);
+
+// Metadata only, for raw data that is not on the CPU (e.g. a StreamedRawImage): the as shot white balance and the
+// DNG color matrices, neither the auto white balance nor the color checker calibration need the pixels
+float unpackDNGMetadata(const gls::size& imageSize, gls::tiff_metadata* dng_metadata,
+                        DemosaicParameters* demosaicParameters, const gls::Matrix<3, 3>& xyz_rgb);
 
 gls::Matrix<3, 3> cam_ycbcr(const gls::Matrix<3, 3>& rgb_cam, const gls::Matrix<3, 3>& xyz_rgb);
 
@@ -270,6 +408,32 @@ struct RawPatchStats {
     gls::Vector<4> variance;
 };
 
+// Raw data packed at its sensor bit depth, as in the uncompressed DNG strips of BitsPerSample 10, 12 or 14: each row
+// is a big-endian, most significant bit first bitstream of width samples starting on a byte boundary, rowBytes apart.
+// The payload needs kPadding readable bytes past the last row, the GPU unpacker loads three bytes per sample.
+// littleEndian 16 bit samples are the ones of little-endian DNGs, in byte order.
+struct PackedRawImage {
+    static constexpr int kPadding = 4;
+
+    int width = 0;
+    int height = 0;
+    int bitsPerSample = 16;
+    size_t rowBytes = 0;
+    bool littleEndian = false;
+    std::span<const uint8_t> data;
+
+    static size_t packedRowBytes(int width, int bitsPerSample) {
+        return ((size_t) width * bitsPerSample + 7) / 8;
+    }
+
+    size_t payloadBytes() const {
+        return rowBytes * height + kPadding;
+    }
+};
+
+// Packs the low bitsPerSample bits of the samples of rawImage into data, resized to the payload size
+PackedRawImage packRawImage(const gls::image<gls::luma_pixel_16>& rawImage, int bitsPerSample, std::vector<uint8_t>* data);
+
 void colorCheckerRawStats(const gls::image<gls::luma_pixel_16>& rawImage, float black_level, float white_level,
                           BayerPattern bayerPattern, const gls::rectangle& gmb_position, bool rotate_180,
                           std::array<RawPatchStats, 24>* stats);
@@ -37,6 +37,59 @@ constant const int2 bayerOffsets[4][4] = {
     { {1, 1}, {0, 1}, {0, 0}, {1, 0} }  // bggr
 };
 
+// Function constants for pipeline specialization, indices match FunctionConstantIndex in demosaic_kernels.hpp.
+// When a constant is not defined the kernels fall back to their runtime arguments.
+constant int bayerPatternConstant [[function_constant(0)]];
+constant bool hasBayerPatternConstant = is_function_constant_defined(bayerPatternConstant);
+
+constant bool lensShadingConstant [[function_constant(1)]];
+constant bool hasLensShadingConstant = is_function_constant_defined(lensShadingConstant);
+
+// PCA components used for block matching, at most 8
+constant int pcaComponentsConstant [[function_constant(2)]];
+constant int pcaActiveComponents = is_function_constant_defined(pcaComponentsConstant) ? pcaComponentsConstant : 8;
+
+// convertTosRGB and convertToYCbCr420 with the frame's color and tone curve baked in lookup tables
+constant bool colorLutConstant [[function_constant(3)]];
+constant bool useColorLut = is_function_constant_defined(colorLutConstant) && colorLutConstant;
+
+// Extra outputs of convertTosRGBMultiOutput, always defined by convertTosRGBKernel
+constant bool lumaOutputConstant [[function_constant(4)]];
+constant bool displayOutputConstant [[function_constant(5)]];
+constant bool thumbnailOutputConstant [[function_constant(6)]];
+
+// blockMatchingDenoiseImage projects the patches of its tile on pcaSpace itself instead of reading pcaImage
+constant bool fusedProjectionConstant [[function_constant(7)]];
+constant bool fusedProjection = is_function_constant_defined(fusedProjectionConstant) && fusedProjectionConstant;
+constant bool separateProjection = !fusedProjection;
+
+// Highlights blending at the demosaic output, see blendHighlightsInline
+constant bool inlineHighlightsConstant [[function_constant(8)]];
+constant bool inlineHighlights = is_function_constant_defined(inlineHighlightsConstant) && inlineHighlightsConstant;
+
+// patchCovariance, pcaProjection and blockMatchingDenoiseImage subtract the noise of the coarser level from their
+// input as they load it, instead of reading the level written by subtractNoiseImage
+constant bool fusedSubtractionConstant [[function_constant(9)]];
+constant bool fusedSubtraction = is_function_constant_defined(fusedSubtractionConstant) && fusedSubtractionConstant;
+
+// The demosaic writes YCbCr for the denoiser, and convertTosRGB reads it, with the color transform of their argument
+constant bool ycbcrOutputConstant [[function_constant(10)]];
+constant bool ycbcrOutput = is_function_constant_defined(ycbcrOutputConstant) && ycbcrOutputConstant;
+constant bool ycbcrInputConstant [[function_constant(11)]];
+constant bool ycbcrInput = is_function_constant_defined(ycbcrInputConstant) && ycbcrInputConstant;
+
+typedef struct {
+    float3 m[3];
+} Matrix3x3;
+
+float3 transformPixel(constant Matrix3x3& transform, float3 pixel) {
+    return float3(dot(transform.m[0], pixel), dot(transform.m[1], pixel), dot(transform.m[2], pixel));
+}
+
+constant const int2* bayerPatternOffsets(int bayerPattern) {
+    return bayerOffsets[hasBayerPatternConstant ? bayerPatternConstant : bayerPattern];
+}
+
 constant half2 sobelKernel2D[3][3] = {
     { { 1,  1 }, { 0,  2 }, { -1,  1 } },
     { { 2,  0 }, { 0,  0 }, { -2,  0 } },
@@ -88,54 +141,81 @@ half gaussian(half x) {
     return exp(- 2 * x * x);
 }
 
-half lensShading(half lensShadingCorrection, half distance_from_center) {
-    return 1 + lensShadingCorrection * distance_from_center * distance_from_center;
+// Lens shading gains of the raw channels at a position of the processed image, in pixels. The gain map spans the
+// frame, the geometry maps the position to the map's normalized coordinates: regions of the frame (tiles, crops) and
+// its downsampled versions pass their own, see LensShading in demosaic_kernels.hpp. The map is a 32 bit float
+// texture, not filterable on all GPUs, the bilinear interpolation is explicit.
+float4 lensShadingGain(texture2d<float> gainMap, float4 lensShadingGeometry, float2 position) {
+    const int2 dimensions = get_image_dim(gainMap);
+    const float2 t = (position * lensShadingGeometry.xy + lensShadingGeometry.zw) * float2(dimensions) - 0.5;
+    const float2 p0 = floor(t);
+    const float2 f = t - p0;
+    const int2 i0 = clamp(int2(p0), 0, dimensions - 1);
+    const int2 i1 = clamp(int2(p0) + 1, 0, dimensions - 1);
+
+    const float4 top = mix(read_imagef(gainMap, i0), read_imagef(gainMap, int2(i1.x, i0.y)), f.x);
+    const float4 bottom = mix(read_imagef(gainMap, int2(i0.x, i1.y)), read_imagef(gainMap, i1), f.x);
+    return mix(top, bottom, f.y);
+}
+
+// Without the function constant the map is always sampled, a disabled lens shading binds a unity map
+bool lensShadingEnabled() {
+    return hasLensShadingConstant ? lensShadingConstant : true;
 }
 
+// Make sure this struct is in sync with the PackedArguments of scaleRawDataKernel in demosaic_kernels.hpp
+struct ScaleRawDataArguments {
+    int bayerPattern;
+    half4 scaleMul;
+    half blackLevel;
+    float4 lensShadingGeometry;
+};
+
 // Work on one Quad (2x2) at a time
 kernel void scaleRawData(texture2d<half> rawImage                       [[texture(0)]],
                          texture2d<half, access::write> scaledRawImage  [[texture(1)]],
-                         constant int& bayerPattern                     [[buffer(2)]],
-                         constant half4& scaleMul                       [[buffer(3)]],
-                         constant half& blackLevel                      [[buffer(4)]],
-                         constant half& lensShadingCorrection           [[buffer(5)]],
+                         constant ScaleRawDataArguments& arguments      [[buffer(2)]],
+                         texture2d<float> lensShadingMap                [[texture(3)]],
                          uint2 index                                    [[thread_position_in_grid]])
 {
+    constant int& bayerPattern = arguments.bayerPattern;
+    constant half4& scaleMul = arguments.scaleMul;
+    constant half& blackLevel = arguments.blackLevel;
+    constant float4& lensShadingGeometry = arguments.lensShadingGeometry;
+
     const int2 imageCoordinates = 2 * (int2) index;
 
-    half lens_shading = 1;
-    if (lensShadingCorrection > 0) {
-        float2 imageCenter = float2(get_image_dim(rawImage) / 2);
-        float distance_from_center = length(float2(imageCoordinates) - imageCenter) / length(imageCenter);
-        lens_shading = lensShading(lensShadingCorrection, distance_from_center);
+    // Same correction for the whole quad, at its center
+    half4 lens_shading = 1;
+    if (lensShadingEnabled()) {
+        lens_shading = half4(lensShadingGain(lensShadingMap, lensShadingGeometry, float2(imageCoordinates) + 1));
     }
 
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
     for (int c = 0; c < 4; c++) {
-        int2 o = bayerOffsets[bayerPattern][c];
+        int2 o = offsets[c];
         write_imageh(scaledRawImage, imageCoordinates + o,
-                     max(lens_shading * scaleMul[c] * (read_imageh(rawImage, imageCoordinates + o).x - blackLevel) * 0.9 + 0.1, 0.0));
-    }
-}
-
-half2 sobel(texture2d<half> inputImage, int x, int y) {
-    half2 value = 0;
-    for (int j = -1; j <= 1; j++) {
-        for (int i = -1; i <= 1; i++) {
-            half sample = read_imageh(inputImage, int2(x + i, y + j)).x;
-            value += sobelKernel2D[j+1][i+1] * sample;
-        }
+                     max(lens_shading[c] * scaleMul[c] * (read_imageh(rawImage, imageCoordinates + o).x - blackLevel) * 0.9 + 0.1, 0.0));
     }
-    return value / sqrt(4.5);
 }
 
-kernel void rawImageSobel(texture2d<half> inputImage                    [[texture(0)]],
-                          texture2d<half, access::write> gradientImage  [[texture(1)]],
+// Unpacks a PackedRawImage payload into the 16 bit raw texture, see demosaic.hpp: the samples are MSB first bitstreams
+// of bitsPerSample bits per row. Each thread gathers the (at most) three bytes spanned by its sample.
+kernel void unpackRawData(device const uchar* packedData                [[buffer(0)]],
+                          texture2d<float, access::write> rawImage       [[texture(1)]],
+                          constant int& bitsPerSample                   [[buffer(2)]],
+                          constant uint& rowBytes                       [[buffer(3)]],
+                          constant bool& littleEndian                   [[buffer(4)]],
                           uint2 index                                   [[thread_position_in_grid]])
 {
-    const int2 imageCoordinates = (int2) index;
-    half2 gradient = sobel(inputImage, imageCoordinates.x, imageCoordinates.y);
-
-    write_imageh(gradientImage, imageCoordinates, half4(gradient, abs(gradient)));
+    const uint bitOffset = index.x * bitsPerSample;
+    device const uchar* p = packedData + index.y * rowBytes + bitOffset / 8;
+    const uint bits = (uint(p[0]) << 16) | (uint(p[1]) << 8) | uint(p[2]);
+    const uint value = littleEndian ? (uint(p[1]) << 8) | uint(p[0])
+                                    : (bits >> (24 - (bitOffset % 8) - bitsPerSample)) & ((1u << bitsPerSample) - 1);
+
+    // Float to unorm16 conversion is exact, half would drop the low bits of 12 and 14 bit data
+    rawImage.write(float(value) / 65535.0, index);
 }
 
 float sampledConvolutionLuma(texture2d<float> inputImage,
@@ -172,147 +252,317 @@ kernel void hfNoiseTransferImage(texture2d<float> inputImage
     write_imagef(outputImage, imageCoordinates, float4(input.x + hf_luma_noise, input.yz, 0));
 }
 
-float4 sampledConvolution(texture2d<float> inputImage,
-                          int2 imageCoordinates, float2 inputNorm,
-                          int samples, constant float *weights) {
-    const float2 inputPos = (float2(imageCoordinates)) * inputNorm;
+// Fused raw front-end: scaleRawData, the raw Sobel gradient and its noise adaptive blur computed from one threadgroup
+// tile, only the scaled raw data and the blurred gradient are written out. The tile halo covers blur offsets of up to
+// kFrontEndSobelHalo - 1 pixels, rawFrontEndKernel checks the weights against it.
 
-    constexpr sampler linear_sampler(filter::linear);
+#define kFrontEndTile       16
+#define kFrontEndSobelHalo  6
+#define kFrontEndRawHalo    (kFrontEndSobelHalo + 1)
+#define kFrontEndSobelTile  (kFrontEndTile + 2 * kFrontEndSobelHalo)
+#define kFrontEndRawTile    (kFrontEndTile + 2 * kFrontEndRawHalo)
+
+half scaledRawValue(texture2d<half> rawImage, int2 imageCoordinates, constant const int2* offsets,
+                    half4 scaleMul, half blackLevel, texture2d<float> lensShadingMap, float4 lensShadingGeometry) {
+    int channel = 0;
+    for (int c = 0; c < 4; c++) {
+        if (all(offsets[c] == (imageCoordinates & 1))) {
+            channel = c;
+        }
+    }
+
+    half lens_shading = 1;
+    if (lensShadingEnabled()) {
+        // Same correction for the whole quad, as in scaleRawData
+        lens_shading = half(lensShadingGain(lensShadingMap, lensShadingGeometry, float2(imageCoordinates & ~1) + 1)[channel]);
+    }
+    return max(lens_shading * scaleMul[channel] * (read_imageh(rawImage, imageCoordinates).x - blackLevel) * 0.9 + 0.1, 0.0);
+}
+
+// Bilinear sample of the Sobel tile, equivalent to a linear sampler read of the full resolution Sobel image
+float4 sampleSobelTile(threadgroup const half4* sobelTile, float2 tileCoordinates) {
+    const float2 p0 = floor(tileCoordinates);
+    const float2 f = tileCoordinates - p0;
+    const int i = (int) p0.y * kFrontEndSobelTile + (int) p0.x;
 
+    const float4 top = mix(float4(sobelTile[i]), float4(sobelTile[i + 1]), f.x);
+    const float4 bottom = mix(float4(sobelTile[i + kFrontEndSobelTile]), float4(sobelTile[i + kFrontEndSobelTile + 1]), f.x);
+    return mix(top, bottom, f.y);
+}
+
+float4 sampledConvolutionSobelTile(threadgroup const half4* sobelTile, float2 tileCoordinates,
+                                   int samples, constant float *weights) {
     float4 sum = 0;
     float norm = 0;
     for (int i = 0; i < samples; i++) {
         float w = weights[3 * i];
         float2 off = float2(weights[3 * i + 1], weights[3 * i + 2]);
-        sum += w * read_imagef(inputImage, linear_sampler, inputPos + (off + 0.5) * inputNorm);
+        sum += w * sampleSobelTile(sobelTile, tileCoordinates + off);
         norm += w;
     }
     return sum / norm;
 }
 
-kernel void sampledConvolutionSobel(texture2d<float> rawImage                   [[texture(0)]],
-                                    texture2d<float> sobelImage                 [[texture(1)]],
-                                    constant int& samples1                      [[buffer(2)]],
-                                    constant float *weights1                    [[buffer(3)]],
-                                    constant int& samples2                      [[buffer(4)]],
-                                    constant float *weights2                    [[buffer(5)]],
-                                    constant float2& rawVariance                [[buffer(6)]],
-                                    texture2d<float, access::write> outputImage [[texture(7)]],
-                                    uint2 index                                 [[thread_position_in_grid]]) {
+kernel void rawFrontEnd(texture2d<half> rawImage                        [[texture(0)]],
+                        texture2d<float, access::write> scaledRawImage  [[texture(1)]],
+                        texture2d<float, access::write> gradientImage   [[texture(2)]],
+                        constant int& bayerPattern                      [[buffer(3)]],
+                        constant half4& scaleMul                        [[buffer(4)]],
+                        constant half& blackLevel                       [[buffer(5)]],
+                        texture2d<float> lensShadingMap                 [[texture(6)]],
+                        constant int& samples1                          [[buffer(7)]],
+                        constant float *weights1                        [[buffer(8)]],
+                        constant int& samples2                          [[buffer(9)]],
+                        constant float *weights2                        [[buffer(10)]],
+                        constant float2& rawVariance                    [[buffer(11)]],
+                        constant float4& lensShadingGeometry            [[buffer(12)]],
+                        uint2 index                                     [[thread_position_in_grid]],
+                        uint2 groupPosition                             [[threadgroup_position_in_grid]],
+                        uint2 localIndex                                [[thread_position_in_threadgroup]],
+                        uint2 groupSize                                 [[threads_per_threadgroup]])
+{
+    threadgroup float rawTile[kFrontEndRawTile * kFrontEndRawTile];
+    threadgroup half4 sobelTile[kFrontEndSobelTile * kFrontEndSobelTile];
+
+    const int2 imageDimensions = get_image_dim(rawImage);
+    const int2 tileOrigin = kFrontEndTile * (int2) groupPosition;
+    // Edge threadgroups can be partial
+    const int threadCount = groupSize.x * groupSize.y;
+    const int threadIndex = localIndex.y * groupSize.x + localIndex.x;
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+
+    // Scaled raw data of the tile and its halo, clamped to the image edges
+    for (int i = threadIndex; i < kFrontEndRawTile * kFrontEndRawTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kFrontEndRawTile, i / kFrontEndRawTile);
+        const int2 imageCoordinates = clamp(tileOrigin + tileCoordinates - kFrontEndRawHalo, int2(0), imageDimensions - 1);
+        rawTile[i] = scaledRawValue(rawImage, imageCoordinates, offsets, scaleMul, blackLevel,
+                                    lensShadingMap, lensShadingGeometry);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Sobel gradient, outside the image it replicates the edge value as the linear sampler would
+    for (int i = threadIndex; i < kFrontEndSobelTile * kFrontEndSobelTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kFrontEndSobelTile, i / kFrontEndSobelTile);
+        const int2 imageCoordinates = clamp(tileOrigin + tileCoordinates - kFrontEndSobelHalo, int2(0), imageDimensions - 1);
+        const int2 rawCoordinates = imageCoordinates - tileOrigin + kFrontEndRawHalo;
+
+        half2 gradient = 0;
+        for (int y = -1; y <= 1; y++) {
+            for (int x = -1; x <= 1; x++) {
+                half sample = rawTile[(rawCoordinates.y + y) * kFrontEndRawTile + rawCoordinates.x + x];
+                gradient += sobelKernel2D[y + 1][x + 1] * sample;
+            }
+        }
+        gradient /= sqrt(4.5);
+        sobelTile[i] = half4(gradient, abs(gradient));
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
     const int2 imageCoordinates = (int2) index;
+    const int2 localCoordinates = (int2) localIndex;
 
-    const float2 inputNorm = 1.0 / float2(get_image_dim(outputImage));
-    float4 result = sampledConvolution(sobelImage, imageCoordinates, inputNorm, samples1, weights1);
+    const float rawValue = rawTile[(localCoordinates.y + kFrontEndRawHalo) * kFrontEndRawTile + localCoordinates.x + kFrontEndRawHalo];
+    write_imagef(scaledRawImage, imageCoordinates, rawValue);
+
+    // A half resolution gradient image gets one gradient per 2x2 block, blurred at the block's center
+    const bool halfResolution = (int) gradientImage.get_width() < imageDimensions.x;
+    if (halfResolution && any((imageCoordinates & 1) != 0)) {
+        return;
+    }
+    const int2 gradientCoordinates = halfResolution ? imageCoordinates / 2 : imageCoordinates;
+    if (any(gradientCoordinates >= int2(gradientImage.get_width(), gradientImage.get_height()))) {
+        return;
+    }
 
-    float sigma = sqrt(rawVariance.x + rawVariance.y * read_imagef(rawImage, imageCoordinates).x);
+    float blockValue = rawValue;
+    float2 sobelCoordinates = float2(localCoordinates + kFrontEndSobelHalo);
+    if (halfResolution) {
+        const int i = (localCoordinates.y + kFrontEndRawHalo) * kFrontEndRawTile + localCoordinates.x + kFrontEndRawHalo;
+        blockValue = 0.25 * (rawTile[i] + rawTile[i + 1] + rawTile[i + kFrontEndRawTile] + rawTile[i + kFrontEndRawTile + 1]);
+        sobelCoordinates += 0.5;
+    }
+
+    float4 result = sampledConvolutionSobelTile(sobelTile, sobelCoordinates, samples1, weights1);
+
+    float sigma = sqrt(rawVariance.x + rawVariance.y * blockValue);
     if (length(result.xy) < 4 * sigma) {
-        result = sampledConvolution(sobelImage, imageCoordinates, inputNorm, samples2, weights2);
+        result = sampledConvolutionSobelTile(sobelTile, sobelCoordinates, samples2, weights2);
     }
 
-    write_imagef(outputImage, imageCoordinates, float4(copysign(result.zw, result.xy), 0, 0));
+    write_imagef(gradientImage, gradientCoordinates, float4(copysign(result.zw, result.xy), 0, 0));
 }
 
 // Modified Hamilton-Adams green channel interpolation
 
 constant const float kHighNoiseVariance = 1e-3;
 
-#define RAW(i, j) read_imagef(rawImage, imageCoordinates + int2(i, j)).x
+// The interpolation functions read their inputs either from full resolution textures (the three pass demosaic)
+// or from threadgroup tiles (demosaicTiled), a tile is addressed with image coordinates
 
-kernel void interpolateGreen(texture2d<float> rawImage                  [[texture(0)]],
-                             texture2d<float> gradientImage             [[texture(1)]],
-                             texture2d<float, access::write> greenImage [[texture(2)]],
-                             constant int& bayerPattern                 [[buffer(3)]],
-                             constant float2& greenVariance             [[buffer(4)]],
-                             uint2 index                                [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+template <typename T>
+struct TileView {
+    threadgroup const T* data;
+    int2 origin;
+    int width;
+
+    T read(int2 imageCoordinates) const {
+        const int2 t = imageCoordinates - origin;
+        return data[t.y * width + t.x];
+    }
+};
+
+// Gradient images are either at the resolution of their image or at half of it, see
+// RawConverter::setHalfResolutionGradients: the half resolution ones are upsampled bilinearly on read.
+template <typename T>
+struct GradientView {
+    texture2d<T> image;
+    bool halfResolution;
+
+    vec<T, 4> read(int2 imageCoordinates) const {
+        if (halfResolution) {
+            constexpr sampler linear_sampler(filter::linear);
+            const float2 dimensions = float2(image.get_width(), image.get_height());
+            return image.sample(linear_sampler, (0.5 * float2(imageCoordinates) + 0.25) / dimensions);
+        }
+        return image.read(static_cast<uint2>(imageCoordinates));
+    }
+};
+
+template <typename T>
+GradientView<T> gradientView(texture2d<T> gradientImage, int2 imageDimensions) {
+    return { gradientImage, (int) gradientImage.get_width() < imageDimensions.x };
+}
+
+float sampleRaw(texture2d<float> image, int2 imageCoordinates) {
+    return read_imagef(image, imageCoordinates).x;
+}
+
+float sampleRaw(TileView<float> tile, int2 imageCoordinates) {
+    return tile.read(imageCoordinates);
+}
+
+float3 sampleRGB(texture2d<float> image, int2 imageCoordinates) {
+    return read_imagef(image, imageCoordinates).xyz;
+}
+
+float3 sampleRGB(TileView<float4> tile, int2 imageCoordinates) {
+    return tile.read(imageCoordinates).xyz;
+}
 
-    const int x = imageCoordinates.x;
-    const int y = imageCoordinates.y;
+bool isRedOrBluePixel(constant const int2* offsets, int2 imageCoordinates) {
+    const int2 r = offsets[raw_red];
+    const int2 b = offsets[raw_blue];
 
-    const int2 r = bayerOffsets[bayerPattern][raw_red];
-    const int2 b = bayerOffsets[bayerPattern][raw_blue];
+    const bool red_pixel = all((r & 1) == (imageCoordinates & 1));
+    const bool blue_pixel = all((b & 1) == (imageCoordinates & 1));
+    return red_pixel || blue_pixel;
+}
 
-    const bool red_pixel = (r.x & 1) == (x & 1) && (r.y & 1) == (y & 1);
-    const bool blue_pixel = (b.x & 1) == (x & 1) && (b.y & 1) == (y & 1);
+#define RAW(i, j) sampleRaw(rawImage, imageCoordinates + int2(i, j))
 
+// Green estimate at Red and Blue pixel locations
+template <typename RawImage>
+float interpolateGreenPixel(RawImage rawImage, GradientView<float> gradientImage, float2 greenVariance, int2 imageCoordinates) {
     const float lowNoise = 1 - smoothstep(3.5e-4, 2e-3, greenVariance.y);
 
-    if (red_pixel || blue_pixel) {
-        // Red and Blue pixel locations
-        float g_left  = RAW(-1, 0);
-        float g_right = RAW(1, 0);
-        float g_up    = RAW(0, -1);
-        float g_down  = RAW(0, 1);
+    float g_left  = RAW(-1, 0);
+    float g_right = RAW(1, 0);
+    float g_up    = RAW(0, -1);
+    float g_down  = RAW(0, 1);
 
-        float c_xy    = RAW(0, 0);
+    float c_xy    = RAW(0, 0);
 
-        float c_left  = RAW(-2, 0);
-        float c_right = RAW(2, 0);
-        float c_up    = RAW(0, -2);
-        float c_down  = RAW(0, 2);
+    float c_left  = RAW(-2, 0);
+    float c_right = RAW(2, 0);
+    float c_up    = RAW(0, -2);
+    float c_down  = RAW(0, 2);
+
+    float c2_top_left = RAW(-1, -1);
+    float c2_top_right = RAW(1, -1);
+    float c2_bottom_left = RAW(-1, 1);
+    float c2_bottom_right = RAW(1, 1);
+    float c2_ave = (c2_top_left + c2_top_right + c2_bottom_left + c2_bottom_right) / 4;
 
-        float c2_top_left = RAW(-1, -1);
-        float c2_top_right = RAW(1, -1);
-        float c2_bottom_left = RAW(-1, 1);
-        float c2_bottom_right = RAW(1, 1);
-        float c2_ave = (c2_top_left + c2_top_right + c2_bottom_left + c2_bottom_right) / 4;
+    // Estimate gradient intensity and direction
+    float g_ave = (g_left + g_right + g_up + g_down) / 4;
+    float2 gradient = abs(gradientImage.read(imageCoordinates).xy);
 
-        // Estimate gradient intensity and direction
-        float g_ave = (g_left + g_right + g_up + g_down) / 4;
-        float2 gradient = abs(read_imagef(gradientImage, imageCoordinates).xy);
+    // Hamilton-Adams second order Laplacian Interpolation
+    float2 g_lf = { (g_left + g_right) / 2, (g_up + g_down) / 2 };
+    float2 g_hf = { ((c_left + c_right) - 2 * c_xy) / 4, ((c_up + c_down) - 2 * c_xy) / 4 };
 
-        // Hamilton-Adams second order Laplacian Interpolation
-        float2 g_lf = { (g_left + g_right) / 2, (g_up + g_down) / 2 };
-        float2 g_hf = { ((c_left + c_right) - 2 * c_xy) / 4, ((c_up + c_down) - 2 * c_xy) / 4 };
+    // Minimum gradient threshold wrt the noise model
+    float rawStdDev = sqrt(greenVariance.x + greenVariance.y * g_ave);
+    float gradient_threshold = smoothstep(rawStdDev, 4 * rawStdDev, length(gradient));
+    float low_gradient_threshold = 1 - smoothstep(2 * rawStdDev, 8 * rawStdDev, length(gradient));
 
-        // Minimum gradient threshold wrt the noise model
-        float rawStdDev = sqrt(greenVariance.x + greenVariance.y * g_ave);
-        float gradient_threshold = smoothstep(rawStdDev, 4 * rawStdDev, length(gradient));
-        float low_gradient_threshold = 1 - smoothstep(2 * rawStdDev, 8 * rawStdDev, length(gradient));
+    // Sharpen low contrast areas
+    float sharpening = (0.5 + 0.5 * lowNoise) * gradient_threshold * (1 + lowNoise * low_gradient_threshold);
 
-        // Sharpen low contrast areas
-        float sharpening = (0.5 + 0.5 * lowNoise) * gradient_threshold * (1 + lowNoise * low_gradient_threshold);
+    // Edges that are in strong highlights tend to exagerate the gradient
+    float highlights_edge = 1 - smoothstep(0.25, 1.0, max(c_xy, max(max(c_left, c_right), max(c_up, c_down))));
 
-        // Edges that are in strong highlights tend to exagerate the gradient
-        float highlights_edge = 1 - smoothstep(0.25, 1.0, max(c_xy, max(max(c_left, c_right), max(c_up, c_down))));
+    // Gradient direction in [0..1]
+    float direction = 2 * atan2(gradient.y, gradient.x) / M_PI_F;
 
-        // Gradient direction in [0..1]
-        float direction = 2 * atan2(gradient.y, gradient.x) / M_PI_F;
+    if (greenVariance.y < kHighNoiseVariance) {
+        // Bias result towards vertical and horizontal lines
+        direction = direction < 0.5 ? mix(direction, 0, 1 - smoothstep(0.3, 0.45, direction))
+                                    : mix(direction, 1, smoothstep((1 - 0.45), (1 - 0.3), direction));
+    }
 
-        if (greenVariance.y < kHighNoiseVariance) {
-            // Bias result towards vertical and horizontal lines
-            direction = direction < 0.5 ? mix(direction, 0, 1 - smoothstep(0.3, 0.45, direction))
-                                        : mix(direction, 1, smoothstep((1 - 0.45), (1 - 0.3), direction));
-        }
+    // TODO: Doesn't seem like a good idea, maybe for high noise images?
+    // If the gradient is below threshold interpolate against the grain
+    // direction = mix(1 - direction, direction, gradient_threshold);
 
-        // TODO: Doesn't seem like a good idea, maybe for high noise images?
-        // If the gradient is below threshold interpolate against the grain
-        // direction = mix(1 - direction, direction, gradient_threshold);
+    // Estimate the degree of correlation between channels to drive the amount of HF extraction
+    const float cmin = min(c_xy, min(g_ave, c2_ave));
+    const float cmax = max(c_xy, max(g_ave, c2_ave));
+    float whiteness = cmin / cmax;
 
-        // Estimate the degree of correlation between channels to drive the amount of HF extraction
-        const float cmin = min(c_xy, min(g_ave, c2_ave));
-        const float cmax = max(c_xy, max(g_ave, c2_ave));
-        float whiteness = cmin / cmax;
+    // Modulate the HF component of the reconstructed green using the whiteness and the gradient magnitude
+    float2 g_est = g_lf - highlights_edge * whiteness * sharpening * g_hf;
 
-        // Modulate the HF component of the reconstructed green using the whiteness and the gradient magnitude
-        float2 g_est = g_lf - highlights_edge * whiteness * sharpening * g_hf;
+    // Green pixel estimation
+    float green = mix(g_est.y, g_est.x, direction);
 
-        // Green pixel estimation
-        float green = mix(g_est.y, g_est.x, direction);
+    // Limit the range of HF correction to something reasonable
+    float max_overshoot = mix(1.0, 1.5, whiteness);
+    float min_overshoot = mix(1.0, 0.5, whiteness);
 
-        // Limit the range of HF correction to something reasonable
-        float max_overshoot = mix(1.0, 1.5, whiteness);
-        float min_overshoot = mix(1.0, 0.5, whiteness);
+    float gmax = max(max(g_left, g_right), max(g_up, g_down));
+    float gmin = min(min(g_left, g_right), min(g_up, g_down));
+    green = clamp(green, min_overshoot * gmin, max_overshoot * gmax);
 
-        float gmax = max(max(g_left, g_right), max(g_up, g_down));
-        float gmin = min(min(g_left, g_right), min(g_up, g_down));
-        green = clamp(green, min_overshoot * gmin, max_overshoot * gmax);
+    return green;
+}
 
-        write_imagef(greenImage, imageCoordinates, green);
-    } else {
-        // Green pixel locations
-        write_imagef(greenImage, imageCoordinates, read_imagef(rawImage, imageCoordinates).x);
-    }
+// Work on one Quad (2x2) at a time: the CFA layout is resolved once per thread from the Bayer
+// pattern offsets, so there is no per pixel branching on the color of the site and the four
+// outputs of the quad share the same neighbourhood reads.
+kernel void interpolateGreen(texture2d<float> rawImage                  [[texture(0)]],
+                             texture2d<float> gradientImage             [[texture(1)]],
+                             texture2d<float, access::write> greenImage [[texture(2)]],
+                             constant int& bayerPattern                 [[buffer(3)]],
+                             constant float2& greenVariance             [[buffer(4)]],
+                             uint2 index                                [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = 2 * (int2) index;
+    const auto gradients = gradientView(gradientImage, get_image_dim(rawImage));
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 r = offsets[raw_red];
+    const int2 g = offsets[raw_green];
+    const int2 b = offsets[raw_blue];
+    const int2 g2 = offsets[raw_green2];
+
+    // Red and Blue pixel locations
+    write_imagef(greenImage, imageCoordinates + r, interpolateGreenPixel(rawImage, gradients, greenVariance, imageCoordinates + r));
+    write_imagef(greenImage, imageCoordinates + b, interpolateGreenPixel(rawImage, gradients, greenVariance, imageCoordinates + b));
+
+    // Green pixel locations
+    write_imagef(greenImage, imageCoordinates + g, read_imagef(rawImage, imageCoordinates + g).x);
+    write_imagef(greenImage, imageCoordinates + g2, read_imagef(rawImage, imageCoordinates + g2).x);
 }
 
 /*
@@ -320,16 +570,16 @@ kernel void interpolateGreen(texture2d<float> rawImage                  [[textur
     Green locations are interpolated next as they use the data from the previous step
 */
 
-#define GREEN(i, j) read_imagef(greenImage, imageCoordinates + int2(i, j)).x
+#define GREEN(i, j) sampleRaw(greenImage, imageCoordinates + int2(i, j))
 
 // Interpolate the other color at Red and Blue RAW locations
 
-void interpolateRedBluePixel(texture2d<float> rawImage,
-                             texture2d<float> greenImage,
-                             texture2d<float> gradientImage,
-                             texture2d<float, access::write> rgbImage,
-                             float2 redVariance, float2 blueVariance,
-                             bool red_pixel, int2 imageCoordinates) {
+template <typename RawImage, typename GreenImage>
+float3 interpolateRedBluePixel(RawImage rawImage,
+                               GreenImage greenImage,
+                               GradientView<float> gradientImage,
+                               float2 redVariance, float2 blueVariance,
+                               bool red_pixel, int2 imageCoordinates) {
     float green = GREEN(0, 0);
     float c1 = RAW(0, 0);
 
@@ -367,7 +617,7 @@ void interpolateRedBluePixel(texture2d<float> rawImage,
     // Estimate the (diagonal) gradient direction taking into account the raw noise model
     float2 variance = red_pixel ? redVariance : blueVariance;
     float rawStdDev = sqrt(variance.x + variance.y * c2_ave);
-    float2 gradient = abs(read_imagef(gradientImage, imageCoordinates).xy);
+    float2 gradient = abs(gradientImage.read(imageCoordinates).xy);
     float direction = 1 - 2 * atan2(gradient.y, gradient.x) / M_PI_F;
     float gradient_threshold = smoothstep(rawStdDev, 4 * rawStdDev, length(gradient));
     // If the gradient is below threshold go flat
@@ -385,9 +635,7 @@ void interpolateRedBluePixel(texture2d<float> rawImage,
     float c2min = min(min(c2_top_left, c2_top_right), min(c2_bottom_left, c2_bottom_right));
     c2 = clamp(c2, c2min, c2max);
 
-    float3 output = red_pixel ? float3(c1, green, c2) : float3(c2, green, c1);
-
-    write_imagef(rgbImage, imageCoordinates, float4(output, 0));
+    return red_pixel ? float3(c1, green, c2) : float3(c2, green, c1);
 }
 
 kernel void interpolateRedBlue(texture2d<float> rawImage                [[texture(0)]],
@@ -399,14 +647,18 @@ kernel void interpolateRedBlue(texture2d<float> rawImage                [[textur
                                constant float2& blueVariance            [[buffer(6)]],
                                uint2 index                              [[thread_position_in_grid]]) {
     const int2 imageCoordinates = 2 * (int2) index;
+    const auto gradients = gradientView(gradientImage, get_image_dim(rawImage));
 
-    const int2 r = bayerOffsets[bayerPattern][raw_red];
-    const int2 g = bayerOffsets[bayerPattern][raw_green];
-    const int2 b = bayerOffsets[bayerPattern][raw_blue];
-    const int2 g2 = bayerOffsets[bayerPattern][raw_green2];
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 r = offsets[raw_red];
+    const int2 g = offsets[raw_green];
+    const int2 b = offsets[raw_blue];
+    const int2 g2 = offsets[raw_green2];
 
-    interpolateRedBluePixel(rawImage, greenImage, gradientImage, rgbImage, redVariance, blueVariance, true, imageCoordinates + r);
-    interpolateRedBluePixel(rawImage, greenImage, gradientImage, rgbImage, redVariance, blueVariance, false, imageCoordinates + b);
+    write_imagef(rgbImage, imageCoordinates + r,
+                 float4(interpolateRedBluePixel(rawImage, greenImage, gradients, redVariance, blueVariance, true, imageCoordinates + r), 0));
+    write_imagef(rgbImage, imageCoordinates + b,
+                 float4(interpolateRedBluePixel(rawImage, greenImage, gradients, redVariance, blueVariance, false, imageCoordinates + b), 0));
 
     write_imagef(rgbImage, imageCoordinates + g,
                  float4(0, read_imagef(greenImage, imageCoordinates + g).x, 0, 0));
@@ -415,15 +667,15 @@ kernel void interpolateRedBlue(texture2d<float> rawImage                [[textur
 }
 #undef GREEN
 
-#define RGB(i, j) read_imagef(rgbImageIn, imageCoordinates + int2(i, j)).xyz
+#define RGB(i, j) sampleRGB(rgbImageIn, imageCoordinates + int2(i, j))
 
 // Interpolate Red and Blue colors at Green RAW locations
 
-void interpolateRedBlueAtGreenPixel(texture2d<float> rgbImageIn,
-                                    texture2d<float> gradientImage,
-                                    texture2d<float, access::write> rgbImageOut,
-                                    float2 redVariance, float2 blueVariance,
-                                    int2 imageCoordinates) {
+template <typename RGBImage>
+float3 interpolateRedBlueAtGreenPixel(RGBImage rgbImageIn,
+                                      GradientView<float> gradientImage,
+                                      float2 redVariance, float2 blueVariance,
+                                      int2 imageCoordinates) {
     float3 rgb = RGB(0, 0);
 
     // Green pixel locations
@@ -461,7 +713,7 @@ void interpolateRedBlueAtGreenPixel(texture2d<float> rgbImageIn,
     float gblue_down3   = rgb_down3.y  - rgb_down3.z;
 
     // Gradient direction in [0..1]
-    float2 gradient = abs(read_imagef(gradientImage, imageCoordinates).xy);
+    float2 gradient = abs(gradientImage.read(imageCoordinates).xy);
     float direction = 2 * atan2(gradient.y, gradient.x) / M_PI_F;
 
     float redStdDev = sqrt(redVariance.x + redVariance.y * red_ave);
@@ -495,29 +747,7 @@ void interpolateRedBlueAtGreenPixel(texture2d<float> rgbImageIn,
     float blue_max = max(max(rgb_left.z, rgb_right.z), max(rgb_up.z, rgb_down.z));
     rgb.z = clamp(blue, blue_min, blue_max);
 
-    write_imagef(rgbImageOut, imageCoordinates, float4(rgb, 0));
-}
-
-kernel void interpolateRedBlueAtGreen(texture2d<float> rgbImageIn                   [[texture(0)]],
-                                      texture2d<float> gradientImage                [[texture(1)]],
-                                      texture2d<float, access::write> rgbImageOut   [[texture(2)]],
-                                      constant int& bayerPattern                    [[buffer(3)]],
-                                      constant float2& redVariance                  [[buffer(4)]],
-                                      constant float2& blueVariance                 [[buffer(5)]],
-                                      uint2 index                                   [[thread_position_in_grid]])
-{
-    const int2 imageCoordinates = 2 * (int2) index;
-
-    const int2 r = bayerOffsets[bayerPattern][raw_red];
-    const int2 g = bayerOffsets[bayerPattern][raw_green];
-    const int2 g2 = bayerOffsets[bayerPattern][raw_green2];
-    const int2 b = bayerOffsets[bayerPattern][raw_blue];
-
-    interpolateRedBlueAtGreenPixel(rgbImageIn, gradientImage, rgbImageOut, redVariance, blueVariance, imageCoordinates + g);
-    interpolateRedBlueAtGreenPixel(rgbImageIn, gradientImage, rgbImageOut, redVariance, blueVariance, imageCoordinates + g2);
-
-    write_imagef(rgbImageOut, imageCoordinates + r, read_imagef(rgbImageIn, imageCoordinates + r));
-    write_imagef(rgbImageOut, imageCoordinates + b, read_imagef(rgbImageIn, imageCoordinates + b));
+    return rgb;
 }
 
 #define M_SQRT3_F 1.7320508f
@@ -533,14 +763,7 @@ constant float3 itrans[3] = {
     { 1,              0,  1   },
 };
 
-kernel void blendHighlightsImage(texture2d<float> inputImage                    [[texture(0)]],
-                                 constant float& clip                           [[buffer(1)]],
-                                 texture2d<float, access::write> outputImage    [[texture(2)]],
-                                 uint2 index                                    [[thread_position_in_grid]])
-{
-    const int2 imageCoordinates = (int2) index;
-
-    float3 pixel = read_imagef(inputImage, imageCoordinates).xyz;
+float3 blendHighlights(float3 pixel, float clip) {
     if (any(pixel > clip)) {
         float3 cam[2] = {pixel, min(pixel, clip)};
 
@@ -559,6 +782,180 @@ kernel void blendHighlightsImage(texture2d<float> inputImage
                        dot(itrans[1], lab[0]),
                        dot(itrans[2], lab[0])) / 3;
     }
+    return pixel;
+}
+
+// Highlights reconstruction as the demosaic writes its output, the clipped pixels are counted in clippedCount
+float3 blendHighlightsInline(float3 rgb, float clip, thread uint& clippedCount) {
+    const bool clipped = any(rgb > clip);
+    clippedCount += clipped;
+    return clipped ? blendHighlights(rgb, clip) : rgb;
+}
+
+// One atomic per SIMD group with clipped pixels, a frame without clipping doesn't touch clippedPixels
+void addClippedPixels(device atomic_uint* clippedPixels, uint clippedCount) {
+    const uint clippedSum = simd_sum(clippedCount);
+    if (simd_is_first() && clippedSum > 0) {
+        atomic_fetch_add_explicit(clippedPixels, clippedSum, memory_order_relaxed);
+    }
+}
+
+kernel void interpolateRedBlueAtGreen(texture2d<float> rgbImageIn                   [[texture(0)]],
+                                      texture2d<float> gradientImage                [[texture(1)]],
+                                      texture2d<float, access::write> rgbImageOut   [[texture(2)]],
+                                      constant int& bayerPattern                    [[buffer(3)]],
+                                      constant float2& redVariance                  [[buffer(4)]],
+                                      constant float2& blueVariance                 [[buffer(5)]],
+                                      constant float& clip                          [[buffer(6), function_constant(inlineHighlights)]],
+                                      device atomic_uint* clippedPixels             [[buffer(7), function_constant(inlineHighlights)]],
+                                      constant Matrix3x3& ycbcrTransform            [[buffer(8), function_constant(ycbcrOutput)]],
+                                      uint2 index                                   [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = 2 * (int2) index;
+    const auto gradients = gradientView(gradientImage, get_image_dim(rgbImageIn));
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 r = offsets[raw_red];
+    const int2 g = offsets[raw_green];
+    const int2 g2 = offsets[raw_green2];
+    const int2 b = offsets[raw_blue];
+
+    float3 rgbG = interpolateRedBlueAtGreenPixel(rgbImageIn, gradients, redVariance, blueVariance, imageCoordinates + g);
+    float3 rgbG2 = interpolateRedBlueAtGreenPixel(rgbImageIn, gradients, redVariance, blueVariance, imageCoordinates + g2);
+    float3 rgbR = read_imagef(rgbImageIn, imageCoordinates + r).xyz;
+    float3 rgbB = read_imagef(rgbImageIn, imageCoordinates + b).xyz;
+
+    if (inlineHighlights) {
+        uint clippedCount = 0;
+        rgbG = blendHighlightsInline(rgbG, clip, clippedCount);
+        rgbG2 = blendHighlightsInline(rgbG2, clip, clippedCount);
+        rgbR = blendHighlightsInline(rgbR, clip, clippedCount);
+        rgbB = blendHighlightsInline(rgbB, clip, clippedCount);
+        addClippedPixels(clippedPixels, clippedCount);
+    }
+
+    if (ycbcrOutput) {
+        rgbG = transformPixel(ycbcrTransform, rgbG);
+        rgbG2 = transformPixel(ycbcrTransform, rgbG2);
+        rgbR = transformPixel(ycbcrTransform, rgbR);
+        rgbB = transformPixel(ycbcrTransform, rgbB);
+    }
+
+    write_imagef(rgbImageOut, imageCoordinates + g, float4(rgbG, 0));
+    write_imagef(rgbImageOut, imageCoordinates + g2, float4(rgbG2, 0));
+    write_imagef(rgbImageOut, imageCoordinates + r, float4(rgbR, 0));
+    write_imagef(rgbImageOut, imageCoordinates + b, float4(rgbB, 0));
+}
+
+// Single pass demosaic: the green and the red/blue estimates of a tile and its halo are kept in threadgroup memory,
+// only the final RGB is written out. Same interpolation as the three pass path, except at the image borders.
+
+#define kDemosaicTile       16
+#define kDemosaicRGBHalo    3
+#define kDemosaicGreenHalo  (kDemosaicRGBHalo + 2)
+#define kDemosaicRawHalo    (kDemosaicGreenHalo + 2)
+#define kDemosaicRGBTile    (kDemosaicTile + 2 * kDemosaicRGBHalo)
+#define kDemosaicGreenTile  (kDemosaicTile + 2 * kDemosaicGreenHalo)
+#define kDemosaicRawTile    (kDemosaicTile + 2 * kDemosaicRawHalo)
+
+// Clamp to the image preserving the Bayer phase, the image dimensions are even
+int2 bayerClamp(int2 imageCoordinates, int2 imageDimensions) {
+    const int2 parity = imageCoordinates & 1;
+    return select(select(imageCoordinates, imageDimensions - 2 + parity, imageCoordinates >= imageDimensions),
+                  parity, imageCoordinates < 0);
+}
+
+kernel void demosaicTiled(texture2d<float> rawImage                 [[texture(0)]],
+                          texture2d<float> gradientImage            [[texture(1)]],
+                          texture2d<float, access::write> rgbImage  [[texture(2)]],
+                          constant int& bayerPattern                [[buffer(3)]],
+                          constant float2& redVariance              [[buffer(4)]],
+                          constant float2& greenVariance            [[buffer(5)]],
+                          constant float2& blueVariance             [[buffer(6)]],
+                          constant float& clip                      [[buffer(7), function_constant(inlineHighlights)]],
+                          device atomic_uint* clippedPixels         [[buffer(8), function_constant(inlineHighlights)]],
+                          constant Matrix3x3& ycbcrTransform        [[buffer(9), function_constant(ycbcrOutput)]],
+                          uint2 index                               [[thread_position_in_grid]],
+                          uint2 groupPosition                       [[threadgroup_position_in_grid]],
+                          uint2 localIndex                          [[thread_position_in_threadgroup]],
+                          uint2 groupSize                           [[threads_per_threadgroup]])
+{
+    threadgroup float rawTile[kDemosaicRawTile * kDemosaicRawTile];
+    threadgroup float greenTile[kDemosaicGreenTile * kDemosaicGreenTile];
+    threadgroup float4 rgbTile[kDemosaicRGBTile * kDemosaicRGBTile];
+
+    const int2 imageDimensions = get_image_dim(rawImage);
+    const auto gradients = gradientView(gradientImage, imageDimensions);
+    const int2 tileOrigin = kDemosaicTile * (int2) groupPosition;
+    // Edge threadgroups can be partial
+    const int threadCount = groupSize.x * groupSize.y;
+    const int threadIndex = localIndex.y * groupSize.x + localIndex.x;
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 r = offsets[raw_red];
+
+    // Tile entries outside of the image hold the values of their Bayer clamped location
+    for (int i = threadIndex; i < kDemosaicRawTile * kDemosaicRawTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kDemosaicRawTile, i / kDemosaicRawTile);
+        const int2 imageCoordinates = bayerClamp(tileOrigin + tileCoordinates - kDemosaicRawHalo, imageDimensions);
+        rawTile[i] = read_imagef(rawImage, imageCoordinates).x;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const TileView<float> rawView = { rawTile, tileOrigin - kDemosaicRawHalo, kDemosaicRawTile };
+
+    for (int i = threadIndex; i < kDemosaicGreenTile * kDemosaicGreenTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kDemosaicGreenTile, i / kDemosaicGreenTile);
+        const int2 imageCoordinates = bayerClamp(tileOrigin + tileCoordinates - kDemosaicGreenHalo, imageDimensions);
+        greenTile[i] = isRedOrBluePixel(offsets, imageCoordinates)
+                           ? interpolateGreenPixel(rawView, gradients, greenVariance, imageCoordinates)
+                           : rawView.read(imageCoordinates);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const TileView<float> greenView = { greenTile, tileOrigin - kDemosaicGreenHalo, kDemosaicGreenTile };
+
+    for (int i = threadIndex; i < kDemosaicRGBTile * kDemosaicRGBTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kDemosaicRGBTile, i / kDemosaicRGBTile);
+        const int2 imageCoordinates = bayerClamp(tileOrigin + tileCoordinates - kDemosaicRGBHalo, imageDimensions);
+        if (isRedOrBluePixel(offsets, imageCoordinates)) {
+            const bool red_pixel = all((r & 1) == (imageCoordinates & 1));
+            rgbTile[i] = float4(interpolateRedBluePixel(rawView, greenView, gradients, redVariance, blueVariance,
+                                                        red_pixel, imageCoordinates), 0);
+        } else {
+            rgbTile[i] = float4(0, greenView.read(imageCoordinates), 0, 0);
+        }
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const TileView<float4> rgbView = { rgbTile, tileOrigin - kDemosaicRGBHalo, kDemosaicRGBTile };
+
+    const int2 imageCoordinates = (int2) index;
+    float3 rgb = isRedOrBluePixel(offsets, imageCoordinates)
+                     ? rgbView.read(imageCoordinates).xyz
+                     : interpolateRedBlueAtGreenPixel(rgbView, gradients, redVariance, blueVariance, imageCoordinates);
+
+    if (inlineHighlights) {
+        uint clippedCount = 0;
+        rgb = blendHighlightsInline(rgb, clip, clippedCount);
+        addClippedPixels(clippedPixels, clippedCount);
+    }
+
+    if (ycbcrOutput) {
+        rgb = transformPixel(ycbcrTransform, rgb);
+    }
+
+    write_imagef(rgbImage, imageCoordinates, float4(rgb, 0));
+}
+
+kernel void blendHighlightsImage(texture2d<float> inputImage                    [[texture(0)]],
+                                 constant float& clip                           [[buffer(1)]],
+                                 texture2d<float, access::write> outputImage    [[texture(2)]],
+                                 uint2 index                                    [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = (int2) index;
+
+    const float3 pixel = blendHighlights(read_imagef(inputImage, imageCoordinates).xyz, clip);
 
     write_imagef(outputImage, imageCoordinates, float4(pixel, 0.0));
 }
@@ -642,10 +1039,6 @@ typedef struct RGBConversionParameters {
     bool localToneMapping;
 } RGBConversionParameters;
 
-typedef struct {
-    float3 m[3];
-} Matrix3x3;
-
 kernel void transformImage(texture2d<float> inputImage                  [[texture(0)]],
                            texture2d<float, access::write> outputImage  [[texture(1)]],
                            constant Matrix3x3& transform                [[buffer(2)]],
@@ -661,6 +1054,105 @@ kernel void transformImage(texture2d<float> inputImage                  [[textur
     write_imagef(outputImage, imageCoordinates, float4(outputPixel, 0.0));
 }
 
+// ---- Pointwise stage fusion ----
+
+// Parameters of all the stages of a pointwise chain, see pointwiseChainKernel::Parameters
+typedef struct PointwiseParameters {
+    Matrix3x3 transform;
+    float clip;
+} PointwiseParameters;
+
+float4 blendHighlightsPixel(float4 pixel, constant PointwiseParameters& parameters) {
+    return float4(blendHighlights(pixel.xyz, parameters.clip), 0.0);
+}
+
+float4 transformPixel(float4 pixel, constant PointwiseParameters& parameters) {
+    constant Matrix3x3& transform = parameters.transform;
+    return float4(dot(transform.m[0], pixel.xyz), dot(transform.m[1], pixel.xyz), dot(transform.m[2], pixel.xyz), 0.0);
+}
+
+// The stages of a chain, stitched into pointwiseStages by MetalContext::newStitchedPipelineState
+[[stitchable]] float4 blendHighlightsStage(float4 pixel, constant PointwiseParameters* parameters) {
+    return blendHighlightsPixel(pixel, *parameters);
+}
+
+[[stitchable]] float4 transformStage(float4 pixel, constant PointwiseParameters* parameters) {
+    return transformPixel(pixel, *parameters);
+}
+
+[[visible]] float4 pointwiseStages(float4 pixel, constant PointwiseParameters* parameters);
+
+// A chain of pointwise stages in a single pass, the intermediate pixels never leave the registers
+kernel void pointwiseChain(texture2d<float> inputImage                  [[texture(0)]],
+                           texture2d<float, access::write> outputImage  [[texture(1)]],
+                           constant PointwiseParameters& parameters     [[buffer(2)]],
+                           uint2 index                                  [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
+
+    const float4 pixel = read_imagef(inputImage, imageCoordinates);
+    write_imagef(outputImage, imageCoordinates, pointwiseStages(pixel, &parameters));
+}
+
+// ---- Pointwise stages in tile memory ----
+
+// The pixel of the render target in the imageblock of a tile pass, see pointwiseTileChainKernel
+typedef struct {
+    float4 color [[color(0)]];
+} PointwiseTilePixel;
+
+typedef imageblock<PointwiseTilePixel, imageblock_layout_implicit> PointwiseImageblock;
+
+// First dispatch of a chain whose input isn't the render target, which the pass doesn't load then
+kernel void loadPointwiseTile(PointwiseImageblock block,
+                              texture2d<float> inputImage   [[texture(0)]],
+                              ushort2 tileIndex             [[thread_position_in_threadgroup]],
+                              uint2 index                   [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
+
+    if (all(imageCoordinates < get_image_dim(inputImage))) {
+        PointwiseTilePixel pixel;
+        pixel.color = read_imagef(inputImage, imageCoordinates);
+        block.write(pixel, tileIndex);
+    }
+}
+
+// The stages of a tile chain, each one a tile dispatch updating the imageblock in place
+kernel void blendHighlightsTile(PointwiseImageblock block,
+                                constant PointwiseParameters& parameters    [[buffer(0)]],
+                                ushort2 tileIndex                           [[thread_position_in_threadgroup]]) {
+    PointwiseTilePixel pixel = block.read(tileIndex);
+    pixel.color = blendHighlightsPixel(pixel.color, parameters);
+    block.write(pixel, tileIndex);
+}
+
+kernel void transformTile(PointwiseImageblock block,
+                          constant PointwiseParameters& parameters  [[buffer(0)]],
+                          ushort2 tileIndex                         [[thread_position_in_threadgroup]]) {
+    PointwiseTilePixel pixel = block.read(tileIndex);
+    pixel.color = transformPixel(pixel.color, parameters);
+    block.write(pixel, tileIndex);
+}
+
+// Input normalization of the postprocess path fused with the conversion to YCbCr: black level subtraction,
+// exposure and white balance scaling and the pipeline's [0.1, 1] value range
+kernel void normalizeRGBToYCbCr(texture2d<float> inputImage                  [[texture(0)]],
+                                texture2d<float, access::write> outputImage  [[texture(1)]],
+                                constant float3& scaleMul                    [[buffer(2)]],
+                                constant float& blackLevel                   [[buffer(3)]],
+                                constant Matrix3x3& transform                [[buffer(4)]],
+                                uint2 index                                  [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
+
+    const float3 inputValue = read_imagef(inputImage, imageCoordinates).xyz;
+    const float3 normalizedValue = clamp(scaleMul * max(inputValue - blackLevel, 0.0) * 0.9 + 0.1, 0.0, 1.0);
+    float3 outputPixel = float3(
+        dot(transform.m[0], normalizedValue),
+        dot(transform.m[1], normalizedValue),
+        dot(transform.m[2], normalizedValue)
+    );
+    write_imagef(outputImage, imageCoordinates, float4(outputPixel, 0.0));
+}
+
 half tunnel(half x, half y, half angle, half sigma) {
     half a = x * cos(angle) + y * sin(angle);
     return exp(-(a * a) / sigma);
@@ -679,11 +1171,12 @@ kernel void denoiseImage(texture2d<half> inputImage                     [[textur
     const int2 imageCoordinates = (int2) index;
 
     const half3 inputYCC = read_imageh(inputImage, imageCoordinates).xyz;
+    const auto gradients = gradientView(gradientImage, get_image_dim(inputImage));
 
     half3 sigma = half3(sqrt(var_a + var_b * inputYCC.x));
     half3 diffMultiplier = 1 / (half3(thresholdMultipliers) * sigma);
 
-    half2 gradient = read_imageh(gradientImage, imageCoordinates).xy;
+    half2 gradient = gradients.read(imageCoordinates).xy;
     half angle = atan2(gradient.y, gradient.x);
     half magnitude = length(gradient);
     half edge = smoothstep(4, 16, gradientThreshold * magnitude / sigma.x);
@@ -696,7 +1189,7 @@ kernel void denoiseImage(texture2d<half> inputImage                     [[textur
     for (int y = -size; y <= size; y++) {
         for (int x = -size; x <= size; x++) {
             half3 inputSampleYCC = read_imageh(inputImage, imageCoordinates + (int2){x, y}).xyz;
-            half2 gradientSample = read_imageh(gradientImage, imageCoordinates + (int2){x, y}).xy;
+            half2 gradientSample = gradients.read(imageCoordinates + (int2){x, y}).xy;
 
             half3 inputDiff = (inputSampleYCC - inputYCC) * diffMultiplier;
             half2 gradientDiff = (gradientSample - gradient) / sigma.x;
@@ -752,46 +1245,532 @@ half length(_half8 x, int components) {
     return sqrt(sum);
 }
 
-kernel void collectPatches(texture2d<half> inputImage         [[texture(0)]],
-                            device array<float, 25>* patches  [[buffer(1)]],
-                            uint2 index                       [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+// The noise of the coarser level, its input minus its denoised version, subtracted from a pixel of the finer level
+template <typename T>
+float3 subtractNoisePixel(texture2d<T> inputImage, texture2d<T> inputImage1, texture2d<T> inputImageDenoised1,
+                          texture2d<T> gradientImage, float luma_weight, float sharpening, float2 nlf,
+                          int2 output_pos, int2 outputDimensions) {
+    const float2 inputNorm = 1.0 / float2(outputDimensions);
+    const float2 input_pos = (float2(output_pos) + 0.5) * inputNorm;
 
-    const int x = imageCoordinates.x;
-    const int y = imageCoordinates.y;
-    const int width = inputImage.get_width();
+    constexpr sampler linear_sampler(filter::linear);
 
-    for (int j = -2; j <= 2; j++) {
-        for (int i = -2; i <= 2; i++) {
-            const half inputLuma = read_imageh(inputImage, 8 * imageCoordinates + int2(i, j)).x;
+    float3 inputPixel = float3(inputImage.read(static_cast<uint2>(output_pos)).xyz);
 
-            const int patch_index = y * width / 8 + x;
-            patches[patch_index][(j + 2) * 5 + (i + 2)] = inputLuma;
-        }
+    float3 inputPixel1 = float3(inputImage1.sample(linear_sampler, input_pos).xyz);
+    float3 inputPixelDenoised1 = float3(inputImageDenoised1.sample(linear_sampler, input_pos).xyz);
+
+    float3 denoisedPixel = inputPixel - float3(luma_weight, 1, 1) * (inputPixel1 - inputPixelDenoised1);
+
+    float alpha = sharpening;
+    if (alpha > 1.0) {
+        float gradient = length(float2(gradientView(gradientImage, outputDimensions).read(output_pos).xy));
+        float sigma = sqrt(nlf.x + nlf.y * inputPixelDenoised1.x);
+        float detail = smoothstep(sigma, 4 * sigma, gradient)
+                       * (1.0 - smoothstep(0.75, 0.95, inputPixelDenoised1.x))        // Highlights ringing protection
+                       * smoothstep(0.05, 0.1, inputPixelDenoised1.x);                // Shadows ringing protection
+        alpha = 1 + (alpha - 1) * detail;
     }
+
+    // Sharpen all components
+    denoisedPixel = mix(inputPixelDenoised1, denoisedPixel, alpha);
+    denoisedPixel.x = max(denoisedPixel.x, 0.0);
+    return denoisedPixel;
 }
 
-kernel void pcaProjection(texture2d<half> inputImage                        [[texture(0)]],
-                            constant array<array<half, 8>, 25>* pcaSpace    [[buffer(1)]],
-                            texture2d<uint, access::write> projectedImage   [[texture(2)]],
-                            uint2 index                                     [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+// The arguments of subtractNoisePixel besides the textures, matching SubtractNoiseParameters in demosaic_kernels.hpp
+struct SubtractNoiseParameters {
+    float lumaWeight;
+    float sharpening;
+    float2 nlf;
+};
 
-    _half8 v_result(0);
-    thread array<half, 8>* result = (thread array<half, 8>*) &v_result;
+// A pixel of the level with the noise of the coarser level subtracted, as subtractNoiseImage writes it, for the
+// kernels with fusedSubtraction. The level and its gradients are the kernel's own inputs.
+half3 subtractedPixel(texture2d<half> inputImage, texture2d<half> inputImage1, texture2d<half> inputImageDenoised1,
+                      texture2d<half> gradientImage, constant SubtractNoiseParameters& parameters, int2 imageCoordinates) {
+    return half3(subtractNoisePixel(inputImage, inputImage1, inputImageDenoised1, gradientImage, parameters.lumaWeight,
+                                    parameters.sharpening, parameters.nlf, imageCoordinates, get_image_dim(inputImage)));
+}
 
-    int row = 0;
+// PCA of the 5x5 luma patches, stratified: one patch per sampleStride x sampleStride cell of the image, at a
+// hashed position within the cell. The host picks the stride to fit the sample budget, so the work and the
+// partial sums stay bounded at any sensor size. patchCovariance accumulates, for each threadgroup, the sums
+// of the patch values and of their outer products, pcaSolve reduces the partial sums to the covariance
+// matrix and extracts its principal components, all without CPU round trips.
+// The threadgroup size must match kPatchCovarianceGroupSize in the kernel wrappers.
+
+constant constexpr int kPCAPatchSize = 25;
+constant constexpr int kPCAComponents = 8;
+constant constexpr int kPatchCovarianceGroupSize = 16 * 16;
+// Partial sums per threadgroup: the patch sum followed by the full outer product matrix
+constant constexpr int kPatchCovarianceEntries = kPCAPatchSize + kPCAPatchSize * kPCAPatchSize;
+
+// Deterministic position within a stratum, the basis doesn't change between runs of the same image
+uint2 stratumJitter(uint2 cell, int stride) {
+    uint h = cell.x * 0x8da6b343u ^ cell.y * 0xd8163841u;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return uint2(h % stride, (h >> 16) % stride);
+}
+
+// The 5x5 patch of a stratum sample, read from the kernel's inputs
+void loadCovariancePatch(texture2d<half> inputImage, texture2d<half> gradientImage, texture2d<half> inputImage1,
+                         texture2d<half> inputImageDenoised1, constant SubtractNoiseParameters& subtraction,
+                         int2 center, thread half patch[kPCAPatchSize]) {
+    for (int j = -2; j <= 2; j++) {
+        for (int i = -2; i <= 2; i++) {
+            patch[(j + 2) * 5 + (i + 2)] = fusedSubtraction
+                ? subtractedPixel(inputImage, inputImage1, inputImageDenoised1, gradientImage, subtraction,
+                                  clamp(center + int2(i, j), 0, get_image_dim(inputImage) - 1)).x
+                : read_imageh(inputImage, center + int2(i, j)).x;
+        }
+    }
+}
+
+kernel void patchCovariance(texture2d<half> inputImage          [[texture(0)]],
+                            device float* partialSums           [[buffer(1)]],
+                            constant int& sampleStride          [[buffer(2)]],
+                            texture2d<half> gradientImage       [[texture(3), function_constant(fusedSubtraction)]],
+                            texture2d<half> inputImage1         [[texture(4), function_constant(fusedSubtraction)]],
+                            texture2d<half> inputImageDenoised1 [[texture(5), function_constant(fusedSubtraction)]],
+                            constant SubtractNoiseParameters& subtraction [[buffer(6), function_constant(fusedSubtraction)]],
+                            uint2 index                         [[thread_position_in_grid]],
+                            uint2 groupPosition                 [[threadgroup_position_in_grid]],
+                            uint2 groupCount                    [[threadgroups_per_grid]],
+                            uint2 localIndex                    [[thread_position_in_threadgroup]],
+                            uint2 groupSize                     [[threads_per_threadgroup]]) {
+    threadgroup half patches[kPatchCovarianceGroupSize][kPCAPatchSize];
+
+    // Edge threadgroups can be partial
+    const int samples = groupSize.x * groupSize.y;
+    const int sample = localIndex.y * groupSize.x + localIndex.x;
+
+    const int2 center = sampleStride * (int2) index + (int2) stratumJitter(index, sampleStride);
+    half patch[kPCAPatchSize];
+    loadCovariancePatch(inputImage, gradientImage, inputImage1, inputImageDenoised1, subtraction, center, patch);
+    for (int e = 0; e < kPCAPatchSize; e++) {
+        patches[sample][e] = patch[e];
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    device float* groupSums = partialSums + (groupPosition.y * groupCount.x + groupPosition.x) * kPatchCovarianceEntries;
+    for (int e = sample; e < kPatchCovarianceEntries; e += samples) {
+        float sum = 0;
+        if (e < kPCAPatchSize) {
+            for (int n = 0; n < samples; n++) {
+                sum += patches[n][e];
+            }
+        } else {
+            const int p = (e - kPCAPatchSize) / kPCAPatchSize;
+            const int q = (e - kPCAPatchSize) % kPCAPatchSize;
+            for (int n = 0; n < samples; n++) {
+                sum += (float) patches[n][p] * (float) patches[n][q];
+            }
+        }
+        groupSums[e] = sum;
+    }
+}
+
+// The patch matrices of the simdgroup_matrix kernels: the 25 patch values, a column of ones and zero padding to
+// whole 8x8 blocks
+constant constexpr int kPatchMatrixColumns = 32;
+constant constexpr int kPatchMatrixOnes = kPCAPatchSize;
+// patchCovarianceMatrix accumulates the product in halves of the threadgroup's patches, in float
+constant constexpr int kPatchMatrixRows = kPatchCovarianceGroupSize / 2;
+
+// patchCovariance with simdgroup matrices, see pcaSpaceKernel: the partial sums of a threadgroup are P^T P, the rows
+// of P being its patches, the column of ones gives the patch sums. The grid is rounded up to whole threadgroups, the
+// patches beyond the sample grid are zero.
+kernel void patchCovarianceMatrix(texture2d<half> inputImage          [[texture(0)]],
+                                  device float* partialSums           [[buffer(1)]],
+                                  constant int& sampleStride          [[buffer(2)]],
+                                  texture2d<half> gradientImage       [[texture(3), function_constant(fusedSubtraction)]],
+                                  texture2d<half> inputImage1         [[texture(4), function_constant(fusedSubtraction)]],
+                                  texture2d<half> inputImageDenoised1 [[texture(5), function_constant(fusedSubtraction)]],
+                                  constant SubtractNoiseParameters& subtraction [[buffer(6), function_constant(fusedSubtraction)]],
+                                  uint2 index                         [[thread_position_in_grid]],
+                                  uint2 groupPosition                 [[threadgroup_position_in_grid]],
+                                  uint2 groupCount                    [[threadgroups_per_grid]],
+                                  uint localIndex                     [[thread_index_in_threadgroup]],
+                                  uint simdgroupIndex                 [[simdgroup_index_in_threadgroup]],
+                                  uint simdgroups                     [[simdgroups_per_threadgroup]]) {
+    threadgroup float patches[kPatchMatrixRows][kPatchMatrixColumns];
+    threadgroup float products[kPatchMatrixColumns][kPatchMatrixColumns];
+
+    half patch[kPatchMatrixColumns] = { 0 };
+    const int2 sampleGrid = max(get_image_dim(inputImage) / sampleStride, 1);
+    if (all((int2) index < sampleGrid)) {
+        const int2 center = sampleStride * (int2) index + (int2) stratumJitter(index, sampleStride);
+        loadCovariancePatch(inputImage, gradientImage, inputImage1, inputImageDenoised1, subtraction, center, patch);
+        patch[kPatchMatrixOnes] = 1;
+    }
+
+    for (int e = localIndex; e < kPatchMatrixColumns * kPatchMatrixColumns; e += kPatchCovarianceGroupSize) {
+        products[e / kPatchMatrixColumns][e % kPatchMatrixColumns] = 0;
+    }
+
+    for (int part = 0; part < kPatchCovarianceGroupSize / kPatchMatrixRows; part++) {
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        if (localIndex / kPatchMatrixRows == (uint) part) {
+            for (int e = 0; e < kPatchMatrixColumns; e++) {
+                patches[localIndex % kPatchMatrixRows][e] = patch[e];
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+
+        // The 16 8x8 blocks of the product, each simdgroup accumulates its blocks over the patches
+        for (int block = simdgroupIndex; block < 16; block += simdgroups) {
+            const int p = 8 * (block / 4);
+            const int q = 8 * (block % 4);
+
+            simdgroup_float8x8 sum;
+            simdgroup_load(sum, &products[p][q], kPatchMatrixColumns);
+            for (int k = 0; k < kPatchMatrixRows; k += 8) {
+                simdgroup_float8x8 a, b;
+                simdgroup_load(a, &patches[k][p], kPatchMatrixColumns, ulong2(0, 0), /*transpose=*/ true);
+                simdgroup_load(b, &patches[k][q], kPatchMatrixColumns);
+                simdgroup_multiply_accumulate(sum, a, b, sum);
+            }
+            simdgroup_store(sum, &products[p][q], kPatchMatrixColumns);
+        }
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    device float* groupSums = partialSums + (groupPosition.y * groupCount.x + groupPosition.x) * kPatchCovarianceEntries;
+    for (int e = localIndex; e < kPatchCovarianceEntries; e += kPatchCovarianceGroupSize) {
+        if (e < kPCAPatchSize) {
+            groupSums[e] = products[e][kPatchMatrixOnes];
+        } else {
+            groupSums[e] = products[(e - kPCAPatchSize) / kPCAPatchSize][(e - kPCAPatchSize) % kPCAPatchSize];
+        }
+    }
+}
+
+// Cached basis bookkeeping, see pcaSolve
+struct pca_basis_state {
+    // Fraction of the patch variance captured by the basis when it was computed
+    float capturedVariance;
+    // Number of times the basis was recomputed
+    uint32_t refreshes;
+};
+
+// Single threadgroup kernel: covariance reduction and cyclic Jacobi eigen decomposition of the 25x25 matrix.
+// The cached basis is kept unless forceRefresh is set or the fraction of the variance it captures on the
+// current patches dropped by more than driftThreshold relative to when it was computed.
+kernel void pcaSolve(device const float* partialSums                                [[buffer(0)]],
+                     constant int& groups                                           [[buffer(1)]],
+                     constant int& samples                                          [[buffer(2)]],
+                     device array<array<half, kPCAComponents>, kPCAPatchSize>* pcaSpace [[buffer(3)]],
+                     constant float& driftThreshold                                 [[buffer(4)]],
+                     constant int& forceRefresh                                     [[buffer(5)]],
+                     device pca_basis_state* basisState                             [[buffer(6)]],
+                     uint localIndex                                                [[thread_position_in_threadgroup]],
+                     uint groupSize                                                 [[threads_per_threadgroup]]) {
+    threadgroup float sums[kPatchCovarianceEntries];
+    threadgroup float A[kPCAPatchSize][kPCAPatchSize];
+    threadgroup float V[kPCAPatchSize][kPCAPatchSize];
+    threadgroup float componentVariance[kPCAComponents];
+    threadgroup float rotation[2];
+    threadgroup bool converged;
+    threadgroup bool refresh;
+
+    for (int e = localIndex; e < kPatchCovarianceEntries; e += groupSize) {
+        float sum = 0;
+        for (int g = 0; g < groups; g++) {
+            sum += partialSums[g * kPatchCovarianceEntries + e];
+        }
+        sums[e] = sum;
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const float n = samples;
+    for (int e = localIndex; e < kPCAPatchSize * kPCAPatchSize; e += groupSize) {
+        const int p = e / kPCAPatchSize;
+        const int q = e % kPCAPatchSize;
+        A[p][q] = (sums[kPCAPatchSize + e] - sums[p] * sums[q] / n) / (n - 1);
+        V[p][q] = p == q ? 1 : 0;
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Drift metric: the variance of the current patches along the cached components
+    if (!forceRefresh && localIndex < kPCAComponents) {
+        const int c = localIndex;
+        float variance = 0;
+        for (int p = 0; p < kPCAPatchSize; p++) {
+            float projection = 0;
+            for (int q = 0; q < kPCAPatchSize; q++) {
+                projection += A[p][q] * (*pcaSpace)[q][c];
+            }
+            variance += (*pcaSpace)[p][c] * projection;
+        }
+        componentVariance[c] = variance;
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    if (localIndex == 0) {
+        float trace = 0;
+        for (int k = 0; k < kPCAPatchSize; k++) {
+            trace += A[k][k];
+        }
+        float captured = 0;
+        for (int c = 0; c < kPCAComponents; c++) {
+            captured += componentVariance[c];
+        }
+        refresh = forceRefresh || trace <= 0 ||
+                  captured / trace < basisState->capturedVariance * (1 - driftThreshold);
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    if (!refresh) {
+        return;
+    }
+
+    for (int sweep = 0; sweep < 12; sweep++) {
+        if (localIndex == 0) {
+            float offDiagonal = 0, diagonal = 0;
+            for (int p = 0; p < kPCAPatchSize; p++) {
+                for (int q = 0; q < kPCAPatchSize; q++) {
+                    if (p != q) {
+                        offDiagonal += A[p][q] * A[p][q];
+                    } else {
+                        diagonal += A[p][p] * A[p][p];
+                    }
+                }
+            }
+            converged = offDiagonal <= 1e-12 * diagonal;
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        if (converged) {
+            break;
+        }
+
+        for (int p = 0; p < kPCAPatchSize - 1; p++) {
+            for (int q = p + 1; q < kPCAPatchSize; q++) {
+                // Rotation annihilating A[p][q]
+                if (localIndex == 0) {
+                    const float apq = A[p][q];
+                    if (abs(apq) > 1e-20) {
+                        const float theta = (A[q][q] - A[p][p]) / (2 * apq);
+                        const float t = sign(theta) / (abs(theta) + sqrt(theta * theta + 1));
+                        const float c = rsqrt(t * t + 1);
+                        rotation[0] = c;
+                        rotation[1] = t * c;
+                    } else {
+                        rotation[0] = 1;
+                        rotation[1] = 0;
+                    }
+                }
+                threadgroup_barrier(mem_flags::mem_threadgroup);
+
+                const float c = rotation[0];
+                const float s = rotation[1];
+                if (s != 0) {
+                    // A = J^T A J, V = V J
+                    if (localIndex < kPCAPatchSize) {
+                        const int k = localIndex;
+                        const float akp = A[k][p], akq = A[k][q];
+                        A[k][p] = c * akp - s * akq;
+                        A[k][q] = s * akp + c * akq;
+                        const float vkp = V[k][p], vkq = V[k][q];
+                        V[k][p] = c * vkp - s * vkq;
+                        V[k][q] = s * vkp + c * vkq;
+                    }
+                    threadgroup_barrier(mem_flags::mem_threadgroup);
+                    if (localIndex < kPCAPatchSize) {
+                        const int k = localIndex;
+                        const float apk = A[p][k], aqk = A[q][k];
+                        A[p][k] = c * apk - s * aqk;
+                        A[q][k] = s * apk + c * aqk;
+                    }
+                }
+                threadgroup_barrier(mem_flags::mem_threadgroup);
+            }
+        }
+    }
+
+    // The eigenvectors with the largest eigenvalues, in decreasing order
+    if (localIndex == 0) {
+        float trace = 0;
+        for (int k = 0; k < kPCAPatchSize; k++) {
+            trace += A[k][k];
+        }
+        float captured = 0;
+
+        bool selected[kPCAPatchSize] = { false };
+        for (int c = 0; c < kPCAComponents; c++) {
+            int largest = -1;
+            for (int k = 0; k < kPCAPatchSize; k++) {
+                if (!selected[k] && (largest < 0 || A[k][k] > A[largest][largest])) {
+                    largest = k;
+                }
+            }
+            selected[largest] = true;
+            captured += A[largest][largest];
+            for (int r = 0; r < kPCAPatchSize; r++) {
+                (*pcaSpace)[r][c] = V[r][largest];
+            }
+        }
+
+        basisState->capturedVariance = trace > 0 ? captured / trace : 0;
+        basisState->refreshes++;
+    }
+}
+
+// PCA components of the 5x5 luma patch centered at imageCoordinates, packed as in pcaImage
+uint4 projectPatch(texture2d<half> inputImage, constant array<array<half, 8>, 25>* pcaSpace, int2 imageCoordinates) {
+    _half8 v_result(0);
+    thread array<half, 8>* result = (thread array<half, 8>*) &v_result;
+
+    int row = 0;
     for (int j = -2; j <= 2; j++) {
         for (int i = -2; i <= 2; i++) {
             const half val = read_imageh(inputImage, imageCoordinates + int2(i, j)).x;
 
-            for (int c = 0; c < 8; c++) {
+            for (int c = 0; c < pcaActiveComponents; c++) {
+                (*result)[c] += (*pcaSpace)[row][c] * val;
+            }
+            row++;
+        }
+    }
+    return uint4(v_result);
+}
+
+// With fusedSubtraction the luma of the threadgroup's tile and of its 2 pixel apron is subtracted once and staged in
+// threadgroup memory, the patches are projected from there. The threadgroup size is kProjectionTile x kProjectionTile,
+// see pcaProjectionKernel.
+constant constexpr int kProjectionTile = 16;
+constant constexpr int kProjectionCache = kProjectionTile + 4;
+
+// The luma of a threadgroup's tile and of its apron, subtracted with fusedSubtraction
+void loadProjectionTile(texture2d<half> inputImage, texture2d<half> gradientImage, texture2d<half> inputImage1,
+                        texture2d<half> inputImageDenoised1, constant SubtractNoiseParameters& subtraction,
+                        uint2 groupPosition, uint localIndex,
+                        threadgroup half (&lumaTile)[kProjectionCache][kProjectionCache]) {
+    const int2 imageDimensions = get_image_dim(inputImage);
+    const int2 tileOrigin = int2(groupPosition) * kProjectionTile - 2;
+    for (int i = localIndex; i < kProjectionCache * kProjectionCache; i += kProjectionTile * kProjectionTile) {
+        const int2 t = int2(i % kProjectionCache, i / kProjectionCache);
+        lumaTile[t.y][t.x] = fusedSubtraction
+            ? subtractedPixel(inputImage, inputImage1, inputImageDenoised1, gradientImage, subtraction,
+                              clamp(tileOrigin + t, 0, imageDimensions - 1)).x
+            : read_imageh(inputImage, tileOrigin + t).x;
+    }
+}
+
+kernel void pcaProjection(texture2d<half> inputImage                        [[texture(0)]],
+                            constant array<array<half, 8>, 25>* pcaSpace    [[buffer(1)]],
+                            texture2d<uint, access::write> projectedImage   [[texture(2)]],
+                            texture2d<half> gradientImage                   [[texture(3), function_constant(fusedSubtraction)]],
+                            texture2d<half> inputImage1                     [[texture(4), function_constant(fusedSubtraction)]],
+                            texture2d<half> inputImageDenoised1             [[texture(5), function_constant(fusedSubtraction)]],
+                            constant SubtractNoiseParameters& subtraction   [[buffer(6), function_constant(fusedSubtraction)]],
+                            uint2 index                                     [[thread_position_in_grid]],
+                            uint2 groupPosition                             [[threadgroup_position_in_grid]],
+                            uint2 localPosition                             [[thread_position_in_threadgroup]],
+                            uint localIndex                                 [[thread_index_in_threadgroup]]) {
+    threadgroup half lumaTile[kProjectionCache][kProjectionCache];
+
+    const int2 imageCoordinates = (int2) index;
+
+    if (!fusedSubtraction) {
+        write_imageui(projectedImage, imageCoordinates, projectPatch(inputImage, pcaSpace, imageCoordinates));
+        return;
+    }
+
+    loadProjectionTile(inputImage, gradientImage, inputImage1, inputImageDenoised1, subtraction, groupPosition,
+                       localIndex, lumaTile);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // The grid is rounded up to whole threadgroups
+    if (any(imageCoordinates >= get_image_dim(inputImage))) {
+        return;
+    }
+
+    _half8 v_result(0);
+    thread array<half, 8>* result = (thread array<half, 8>*) &v_result;
+    int row = 0;
+    for (int j = 0; j < 5; j++) {
+        for (int i = 0; i < 5; i++) {
+            const half val = lumaTile[localPosition.y + j][localPosition.x + i];
+            for (int c = 0; c < pcaActiveComponents; c++) {
                 (*result)[c] += (*pcaSpace)[row][c] * val;
             }
             row++;
         }
     }
+    write_imageui(projectedImage, imageCoordinates, uint4(v_result));
+}
+
+// pcaProjection with simdgroup matrices, see pcaProjectionKernel: the patches of the threadgroup's tile are the rows
+// of a patch matrix, each simdgroup projects 32 of them with 8x8 block products by the 32x8 zero padded basis. Whole
+// threadgroups of kProjectionTile x kProjectionTile.
+kernel void pcaProjectionMatrix(texture2d<half> inputImage                        [[texture(0)]],
+                                constant array<array<half, 8>, 25>* pcaSpace    [[buffer(1)]],
+                                texture2d<uint, access::write> projectedImage   [[texture(2)]],
+                                texture2d<half> gradientImage                   [[texture(3), function_constant(fusedSubtraction)]],
+                                texture2d<half> inputImage1                     [[texture(4), function_constant(fusedSubtraction)]],
+                                texture2d<half> inputImageDenoised1             [[texture(5), function_constant(fusedSubtraction)]],
+                                constant SubtractNoiseParameters& subtraction   [[buffer(6), function_constant(fusedSubtraction)]],
+                                uint2 index                                     [[thread_position_in_grid]],
+                                uint2 groupPosition                             [[threadgroup_position_in_grid]],
+                                uint2 localPosition                             [[thread_position_in_threadgroup]],
+                                uint localIndex                                 [[thread_index_in_threadgroup]],
+                                uint simdgroupIndex                             [[simdgroup_index_in_threadgroup]]) {
+    threadgroup half lumaTile[kProjectionCache][kProjectionCache];
+    threadgroup half patchMatrix[kProjectionTile * kProjectionTile][kPatchMatrixColumns];
+    threadgroup half basis[kPatchMatrixColumns][kPCAComponents];
+
+    loadProjectionTile(inputImage, gradientImage, inputImage1, inputImageDenoised1, subtraction, groupPosition,
+                       localIndex, lumaTile);
+    for (int e = localIndex; e < kPatchMatrixColumns * kPCAComponents; e += kProjectionTile * kProjectionTile) {
+        const int r = e / kPCAComponents;
+        const int c = e % kPCAComponents;
+        basis[r][c] = r < kPCAPatchSize && c < pcaActiveComponents ? (*pcaSpace)[r][c] : 0;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // The thread's patch is its row of the patch matrix
+    for (int e = 0; e < kPatchMatrixColumns; e++) {
+        patchMatrix[localIndex][e] = e < kPCAPatchSize ? lumaTile[localPosition.y + e / 5][localPosition.x + e % 5] : 0;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    simdgroup_half8x8 basisBlocks[kPatchMatrixColumns / 8];
+    for (int k = 0; k < kPatchMatrixColumns / 8; k++) {
+        simdgroup_load(basisBlocks[k], &basis[8 * k][0], kPCAComponents);
+    }
+
+    // The projections overwrite the first 8 columns of their patches
+    const int firstRow = 32 * simdgroupIndex;
+    for (int row = firstRow; row < firstRow + 32; row += 8) {
+        simdgroup_half8x8 projection = make_filled_simdgroup_matrix<half, 8, 8>(0);
+        for (int k = 0; k < kPatchMatrixColumns / 8; k++) {
+            simdgroup_half8x8 patches;
+            simdgroup_load(patches, &patchMatrix[row][8 * k], kPatchMatrixColumns);
+            simdgroup_multiply_accumulate(projection, patches, basisBlocks[k], projection);
+        }
+        simdgroup_store(projection, &patchMatrix[row][0], kPatchMatrixColumns);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
 
+    const int2 imageCoordinates = (int2) index;
+    if (any(imageCoordinates >= get_image_dim(inputImage))) {
+        return;
+    }
+
+    _half8 v_result;
+    thread array<half, 8>* result = (thread array<half, 8>*) &v_result;
+    for (int c = 0; c < kPCAComponents; c++) {
+        (*result)[c] = patchMatrix[localIndex][c];
+    }
     write_imageui(projectedImage, imageCoordinates, uint4(v_result));
 }
 
@@ -803,42 +1782,101 @@ half steer(half x, half y, half angle, half s1, half s2) {
     return exp(-((a * a) / s1 + (b * b) / s2));
 }
 
+// blockMatchingDenoiseImage stages the PCA vectors and the YCbCr values of its tile, plus the search radius, in
+// threadgroup memory: each cached pixel is otherwise read by (2 * radius + 1)^2 threads. The threadgroup size is
+// kBlockMatchingTile x kBlockMatchingTile, see blockMatchingDenoiseImageKernel.
+// With fusedProjection the PCA vectors of the tile are projected while staging it, the small levels skip the
+// pcaProjection dispatch and the round trip through pcaImage for a few redundant projections in the aprons.
+// pcaImage can also be a two channel texture holding only the first 4 components, for pcaActiveComponents <= 4: the
+// other components read as garbage and are never used.
+// With fusedSubtraction inputImage is the level before the noise subtraction, the YCbCr values of the tile are
+// subtracted as they are staged. It excludes fusedProjection, whose patches would be projected from inputImage.
+constant constexpr int kBlockMatchingTile = 16;
+constant constexpr int kBlockMatchingRadius = 10;
+constant constexpr int kBlockMatchingCache = kBlockMatchingTile + 2 * kBlockMatchingRadius;
+
+// Make sure this struct is in sync with the PackedArguments of blockMatchingDenoiseImageKernel and
+// blockMatchingDenoiseImage420Kernel in demosaic_kernels.hpp
+struct BlockMatchingArguments {
+    float3 var_a;
+    float3 var_b;
+    float3 thresholdMultipliers;
+    float chromaBoost;
+    float gradientBoost;
+    float gradientThreshold;
+    float4 lensShadingGeometry;
+};
+
+#define BLOCK_MATCHING_ARGUMENTS(arguments)                                 \
+    constant float3& var_a = arguments.var_a;                               \
+    constant float3& var_b = arguments.var_b;                               \
+    constant float3& thresholdMultipliers = arguments.thresholdMultipliers; \
+    constant float& chromaBoost = arguments.chromaBoost;                    \
+    constant float& gradientBoost = arguments.gradientBoost;                \
+    constant float& gradientThreshold = arguments.gradientThreshold;        \
+    constant float4& lensShadingGeometry = arguments.lensShadingGeometry;
+
 kernel void blockMatchingDenoiseImage(texture2d<half> inputImage                     [[texture(0)]],
                                       texture2d<half> gradientImage                  [[texture(1)]],
-                                      texture2d<uint> pcaImage                       [[texture(2)]],
-                                      constant float3& var_a                         [[buffer(3)]],
-                                      constant float3& var_b                         [[buffer(4)]],
-                                      constant float3& thresholdMultipliers          [[buffer(5)]],
-                                      constant float& chromaBoost                    [[buffer(6)]],
-                                      constant float& gradientBoost                  [[buffer(7)]],
-                                      constant float& gradientThreshold              [[buffer(8)]],
-                                      constant float& lensShadingCorrection          [[buffer(9)]],
-                                      texture2d<half, access::write> denoisedImage   [[texture(10)]],
-                                      uint2 index                                    [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+                                      texture2d<uint> pcaImage                       [[texture(2), function_constant(separateProjection)]],
+                                      constant BlockMatchingArguments& arguments     [[buffer(3)]],
+                                      texture2d<float> lensShadingMap                [[texture(4)]],
+                                      texture2d<half, access::write> denoisedImage   [[texture(5)]],
+                                      constant array<array<half, 8>, 25>* pcaSpace   [[buffer(6), function_constant(fusedProjection)]],
+                                      texture2d<half> inputImage1                    [[texture(7), function_constant(fusedSubtraction)]],
+                                      texture2d<half> inputImageDenoised1            [[texture(8), function_constant(fusedSubtraction)]],
+                                      constant SubtractNoiseParameters& subtraction  [[buffer(9), function_constant(fusedSubtraction)]],
+                                      uint2 groupPosition                            [[threadgroup_position_in_grid]],
+                                      uint2 localPosition                            [[thread_position_in_threadgroup]],
+                                      uint localIndex                                [[thread_index_in_threadgroup]]) {
+    BLOCK_MATCHING_ARGUMENTS(arguments)
+
+    threadgroup uint4 pcaTile[kBlockMatchingCache][kBlockMatchingCache];
+    threadgroup half4 yccTile[kBlockMatchingCache][kBlockMatchingCache];
+
+    const int2 imageDimensions = get_image_dim(inputImage);
+    const int2 tileOrigin = int2(groupPosition) * kBlockMatchingTile - kBlockMatchingRadius;
+
+    // Cooperative load of the tile and its apron, with clamped edges
+    for (int i = localIndex; i < kBlockMatchingCache * kBlockMatchingCache; i += kBlockMatchingTile * kBlockMatchingTile) {
+        const int2 t = int2(i % kBlockMatchingCache, i / kBlockMatchingCache);
+        const int2 c = clamp(tileOrigin + t, 0, imageDimensions - 1);
+        if (fusedProjection) {
+            pcaTile[t.y][t.x] = projectPatch(inputImage, pcaSpace, c);
+        } else {
+            pcaTile[t.y][t.x] = read_imageui(pcaImage, c);
+        }
+        yccTile[t.y][t.x] = fusedSubtraction
+            ? half4(subtractedPixel(inputImage, inputImage1, inputImageDenoised1, gradientImage, subtraction, c), 0)
+            : read_imageh(inputImage, c);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
 
-    const half3 inputYCC = read_imageh(inputImage, imageCoordinates).xyz;
-    const _half8 inputPCA = _half8(read_imageui(pcaImage, imageCoordinates));
+    const int2 imageCoordinates = int2(groupPosition) * kBlockMatchingTile + int2(localPosition);
+    // The grid is rounded up to whole threadgroups, the extra threads only take part in the load
+    if (any(imageCoordinates >= imageDimensions)) {
+        return;
+    }
+
+    const int2 tileCenter = int2(localPosition) + kBlockMatchingRadius;
+    const half3 inputYCC = yccTile[tileCenter.y][tileCenter.x].xyz;
+    const _half8 inputPCA = _half8(pcaTile[tileCenter.y][tileCenter.x]);
 
     half blueBoost = 1; // + (gradientBoost > 0 && inputYCC.y > 0.01 && inputYCC.z < 0.01 ? cos(M_PI_4_H - atan2(inputYCC.z, inputYCC.y)) : 0);
 
-    half lens_shading = 1;
-    if (lensShadingCorrection > 0) {
-        float2 imageCenter = float2(get_image_dim(inputImage) / 2);
-        float distance_from_center = length(float2(imageCoordinates) - imageCenter) / length(imageCenter);
-        lens_shading = lensShading(lensShadingCorrection, distance_from_center);
-    }
+    // The noise follows the green channel's gain
+    const half lens_shading = half(lensShadingGain(lensShadingMap, lensShadingGeometry, float2(imageCoordinates) + 0.5)[raw_green]);
 
     half3 sigma = half3(sqrt(var_a + var_b * lens_shading * inputYCC.x));
     half3 diffMultiplier = 1 / (blueBoost * half3(thresholdMultipliers) * sigma);
 
-    half2 gradient = read_imageh(gradientImage, imageCoordinates).xy;
+    half2 gradient = gradientView(gradientImage, imageDimensions).read(imageCoordinates).xy;
     // half angle = atan2(gradient.y, gradient.x);
     half magnitude = length(gradient); // / (1 - 0.5 * smoothstep(0.125h, 0.25h, inputYCC.x));
     half edge = smoothstep(2, 16, gradientThreshold * magnitude / sigma.x);
 
     // Dynamic PCA components
-    int pcaComponents = 8;
+    int pcaComponents = pcaActiveComponents;
 //    half pca02 = inputPCA.v[0] * inputPCA.v[0];
 //    half pca_sum = pca02;
 //    half sigma2_pca = 4 * sigma.x * sigma.x * pca02;
@@ -850,15 +1888,15 @@ kernel void blockMatchingDenoiseImage(texture2d<half> inputImage
 //        }
 //    }
 
-    const int size = 10;
+    const int size = kBlockMatchingRadius;
 
     // Use high precision accumulator
     float3 filtered_pixel = 0;
     float3 kernel_norm = 0;
     for (int y = -size; y <= size; y++) {
         for (int x = -size; x <= size; x++) {
-            half3 inputSampleYCC = read_imageh(inputImage, imageCoordinates + int2(x, y)).xyz;
-            _half8 samplePCA = _half8(read_imageui(pcaImage, imageCoordinates + int2(x, y)));
+            half3 inputSampleYCC = yccTile[tileCenter.y + y][tileCenter.x + x].xyz;
+            _half8 samplePCA = _half8(pcaTile[tileCenter.y + y][tileCenter.x + x]);
 
             half pcaDiff = length(samplePCA - inputPCA, pcaComponents) * diffMultiplier.x;
             half2 inputChromaDiff = (inputSampleYCC.yz - inputYCC.yz) * diffMultiplier.yz;
@@ -883,6 +1921,148 @@ kernel void blockMatchingDenoiseImage(texture2d<half> inputImage
     write_imageh(denoisedImage, imageCoordinates, half4(denoisedPixel, kernel_norm.x));
 }
 
+// blockMatchingDenoiseImage of a 4:2:0 level: the luma is block matched at full resolution, the chroma at the
+// half resolution sites weighing their neighbors by the patch similarity of the sites' top left pixels. The tile's
+// pixels interpolate the denoised sites [tile / 2 - 1, tile / 2 + kChromaTile], staged in threadgroup memory.
+constant constexpr int kChromaTile = kBlockMatchingTile / 2;
+constant constexpr int kChromaRadius = kBlockMatchingRadius / 2;
+constant constexpr int kChromaSites = kChromaTile + 2;
+constant constexpr int kChromaCache = kChromaSites + 2 * kChromaRadius;
+
+kernel void blockMatchingDenoiseImage420(texture2d<half> lumaImage                      [[texture(0)]],
+                                         texture2d<half> chromaImage                    [[texture(1)]],
+                                         texture2d<half> gradientImage                  [[texture(2)]],
+                                         texture2d<uint> pcaImage                       [[texture(3), function_constant(separateProjection)]],
+                                         constant BlockMatchingArguments& arguments     [[buffer(4)]],
+                                         texture2d<float> lensShadingMap                [[texture(5)]],
+                                         texture2d<half, access::write> denoisedImage   [[texture(6)]],
+                                         constant array<array<half, 8>, 25>* pcaSpace   [[buffer(7), function_constant(fusedProjection)]],
+                                         uint2 groupPosition                            [[threadgroup_position_in_grid]],
+                                         uint2 localPosition                            [[thread_position_in_threadgroup]],
+                                         uint localIndex                                [[thread_index_in_threadgroup]]) {
+    BLOCK_MATCHING_ARGUMENTS(arguments)
+
+    threadgroup uint4 pcaTile[kBlockMatchingCache][kBlockMatchingCache];
+    threadgroup half lumaTile[kBlockMatchingCache][kBlockMatchingCache];
+    threadgroup half2 chromaTile[kChromaCache][kChromaCache];
+    threadgroup half2 denoisedChroma[kChromaSites][kChromaSites];
+
+    const int2 imageDimensions = get_image_dim(lumaImage);
+    const int2 chromaDimensions = get_image_dim(chromaImage);
+    const int2 tileOrigin = int2(groupPosition) * kBlockMatchingTile - kBlockMatchingRadius;
+    const int2 sitesOrigin = int2(groupPosition) * kChromaTile - 1;
+    const int2 chromaOrigin = sitesOrigin - kChromaRadius;
+
+    // Cooperative load of the tiles and their aprons, with clamped edges
+    for (int i = localIndex; i < kBlockMatchingCache * kBlockMatchingCache; i += kBlockMatchingTile * kBlockMatchingTile) {
+        const int2 t = int2(i % kBlockMatchingCache, i / kBlockMatchingCache);
+        const int2 c = clamp(tileOrigin + t, 0, imageDimensions - 1);
+        if (fusedProjection) {
+            pcaTile[t.y][t.x] = projectPatch(lumaImage, pcaSpace, c);
+        } else {
+            pcaTile[t.y][t.x] = read_imageui(pcaImage, c);
+        }
+        lumaTile[t.y][t.x] = read_imageh(lumaImage, c).x;
+    }
+    for (int i = localIndex; i < kChromaCache * kChromaCache; i += kBlockMatchingTile * kBlockMatchingTile) {
+        const int2 t = int2(i % kChromaCache, i / kChromaCache);
+        chromaTile[t.y][t.x] = read_imageh(chromaImage, clamp(chromaOrigin + t, 0, chromaDimensions - 1)).xy;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const auto gradients = gradientView(gradientImage, imageDimensions);
+
+    if (localIndex < kChromaSites * kChromaSites) {
+        const int2 site = int2(localIndex % kChromaSites, localIndex / kChromaSites);
+        const int2 siteCenter = site + kChromaRadius;
+        // The site's top left pixel, the far neighbors at the apron's edges are clamped to it
+        const int2 sitePixel = 2 * (sitesOrigin + site);
+        const int2 pixel = clamp(sitePixel - tileOrigin, 0, kBlockMatchingCache - 1);
+
+        const half siteLuma = lumaTile[pixel.y][pixel.x];
+        const half2 siteChroma = chromaTile[siteCenter.y][siteCenter.x];
+        const _half8 sitePCA = _half8(pcaTile[pixel.y][pixel.x]);
+
+        const half lens_shading = half(lensShadingGain(lensShadingMap, lensShadingGeometry, float2(sitePixel) + 1)[raw_green]);
+        half3 sigma = half3(sqrt(var_a + var_b * lens_shading * siteLuma));
+        // The sites average 2x2 pixels, half the chroma noise of the pixels
+        half3 diffMultiplier = 1 / (half3(thresholdMultipliers) * sigma * half3(1, 0.5, 0.5));
+
+        half magnitude = length(gradients.read(clamp(sitePixel, 0, imageDimensions - 1)).xy);
+        half edge = smoothstep(2, 16, gradientThreshold * magnitude / sigma.x);
+
+        float2 filtered_chroma = 0;
+        float chroma_norm = 0;
+        for (int y = -kChromaRadius; y <= kChromaRadius; y++) {
+            for (int x = -kChromaRadius; x <= kChromaRadius; x++) {
+                const half2 sampleChroma = chromaTile[siteCenter.y + y][siteCenter.x + x];
+                const int2 samplePixel = clamp(pixel + 2 * int2(x, y), 0, kBlockMatchingCache - 1);
+                _half8 samplePCA = _half8(pcaTile[samplePixel.y][samplePixel.x]);
+
+                half pcaDiff = length(samplePCA - sitePCA, pcaActiveComponents) * diffMultiplier.x;
+                half2 inputChromaDiff = (sampleChroma - siteChroma) * diffMultiplier.yz;
+
+                half lumaWeight = gaussian(pcaDiff / (1 + gradientBoost * edge));
+                half chromaWeight = gaussian(length(half3(lumaWeight, inputChromaDiff / chromaBoost)));
+                // The sites are two pixels apart
+                half directionWeight = gaussian(0.2 * length(float2(x, y)));
+
+                filtered_chroma += float2(directionWeight * chromaWeight * sampleChroma);
+                chroma_norm += directionWeight * chromaWeight;
+            }
+        }
+        denoisedChroma[site.y][site.x] = half2(filtered_chroma / chroma_norm);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const int2 imageCoordinates = int2(groupPosition) * kBlockMatchingTile + int2(localPosition);
+    // The grid is rounded up to whole threadgroups, the extra threads only take part in the load
+    if (any(imageCoordinates >= imageDimensions)) {
+        return;
+    }
+
+    const int2 tileCenter = int2(localPosition) + kBlockMatchingRadius;
+    const half inputLuma = lumaTile[tileCenter.y][tileCenter.x];
+    const _half8 inputPCA = _half8(pcaTile[tileCenter.y][tileCenter.x]);
+
+    // The noise follows the green channel's gain
+    const half lens_shading = half(lensShadingGain(lensShadingMap, lensShadingGeometry, float2(imageCoordinates) + 0.5)[raw_green]);
+
+    half sigma = half(sqrt(var_a.x + var_b.x * lens_shading * inputLuma));
+    half diffMultiplier = 1 / (half(thresholdMultipliers.x) * sigma);
+
+    half magnitude = length(gradients.read(imageCoordinates).xy);
+    half edge = smoothstep(2, 16, gradientThreshold * magnitude / sigma);
+
+    const int size = kBlockMatchingRadius;
+
+    // Use high precision accumulator
+    float filtered_luma = 0;
+    float luma_norm = 0;
+    for (int y = -size; y <= size; y++) {
+        for (int x = -size; x <= size; x++) {
+            _half8 samplePCA = _half8(pcaTile[tileCenter.y + y][tileCenter.x + x]);
+
+            half pcaDiff = length(samplePCA - inputPCA, pcaActiveComponents) * diffMultiplier;
+
+            half lumaWeight = gaussian(pcaDiff / (1 + gradientBoost * edge));
+            half directionWeight = gaussian(0.1 * length(float2(x, y)));
+
+            filtered_luma += float(directionWeight * lumaWeight * lumaTile[tileCenter.y + y][tileCenter.x + x]);
+            luma_norm += float(directionWeight * lumaWeight);
+        }
+    }
+
+    // Bilinear interpolation of the denoised sites
+    const float2 t = 0.5 * float2(imageCoordinates) - 0.25 - float2(sitesOrigin);
+    const int2 s0 = int2(floor(t));
+    const half2 f = half2(t - floor(t));
+    const half2 top = mix(denoisedChroma[s0.y][s0.x], denoisedChroma[s0.y][s0.x + 1], f.x);
+    const half2 bottom = mix(denoisedChroma[s0.y + 1][s0.x], denoisedChroma[s0.y + 1][s0.x + 1], f.x);
+
+    write_imageh(denoisedImage, imageCoordinates, half4(half(filtered_luma / luma_norm), mix(top, bottom, f.y), luma_norm));
+}
+
 kernel void downsampleImageXYZ(texture2d<float> inputImage                  [[texture(0)]],
                                texture2d<float, access::write> outputImage  [[texture(1)]],
                                uint2 index                                  [[thread_position_in_grid]]) {
@@ -919,6 +2099,559 @@ kernel void downsampleImageXY(texture2d<float> inputImage                    [[t
     write_imagef(outputImage, output_pos, float4(0.25 * outputPixel, 0, 0));
 }
 
+// Single pass construction of the four lower levels of the image and gradient pyramids. As in downsampleImageXYZ
+// each level is a stride 2 4x4 box filter of the level above, with clamped edges. A threadgroup covers a tile of
+// kPyramidTile pixels of the lowest level and computes the matching tiles of the levels above, with the halos the
+// filter needs, in threadgroup memory: only the first level samples the source textures.
+// The threadgroup size is 16x16, see buildPyramidsKernel.
+
+constant constexpr int kPyramidTile = 4;
+constant constexpr int kPyramidTile3 = 2 * kPyramidTile + 2;
+constant constexpr int kPyramidTile2 = 2 * kPyramidTile3 + 2;
+constant constexpr int kPyramidTile1 = 2 * kPyramidTile2 + 2;
+
+// Fill the tile of a level starting at dstOrigin from the tile of the level above starting at 2 * dstOrigin - 1,
+// entries outside of the level hold the values of the closest edge pixels
+template <typename T>
+void downsamplePyramidTile(threadgroup const T* src, int srcSize, threadgroup T* dst, int dstSize,
+                           int2 dstOrigin, int2 dstDimensions, uint thread, uint threads) {
+    const int2 srcOrigin = 2 * dstOrigin - 1;
+    for (int e = thread; e < dstSize * dstSize; e += threads) {
+        const int2 q = clamp(dstOrigin + int2(e % dstSize, e / dstSize), 0, dstDimensions - 1);
+        const int2 tap = 2 * q - 1 - srcOrigin;
+        T sum = 0;
+        for (int j = 0; j < 4; j++) {
+            for (int i = 0; i < 4; i++) {
+                sum += src[(tap.y + j) * srcSize + tap.x + i];
+            }
+        }
+        dst[e] = sum / 16;
+    }
+}
+
+// Write the kPyramidTile << shift pixels of a level owned by the threadgroup
+void writePyramidTile(threadgroup const half4* imageTile, threadgroup const half2* gradientTile, int tileSize,
+                      int2 tileOrigin, int2 outputOrigin, int outputSize,
+                      texture2d<float, access::write> image, texture2d<float, access::write> gradient,
+                      bool writeGradient, uint thread, uint threads) {
+    const int2 dimensions = int2(image.get_width(), image.get_height());
+    for (int e = thread; e < outputSize * outputSize; e += threads) {
+        const int2 q = outputOrigin + int2(e % outputSize, e / outputSize);
+        if (all(q < dimensions)) {
+            const int2 t = q - tileOrigin;
+            write_imagef(image, q, float4(float3(imageTile[t.y * tileSize + t.x].xyz), 0));
+            if (writeGradient) {
+                write_imagef(gradient, q, float4(float2(gradientTile[t.y * tileSize + t.x]), 0, 0));
+            }
+        }
+    }
+}
+
+kernel void buildPyramids(texture2d<float> inputImage                  [[texture(0)]],
+                          texture2d<float> gradientImage               [[texture(1)]],
+                          texture2d<float, access::write> image1       [[texture(2)]],
+                          texture2d<float, access::write> image2       [[texture(3)]],
+                          texture2d<float, access::write> image3       [[texture(4)]],
+                          texture2d<float, access::write> image4       [[texture(5)]],
+                          texture2d<float, access::write> gradient1    [[texture(6)]],
+                          texture2d<float, access::write> gradient2    [[texture(7)]],
+                          texture2d<float, access::write> gradient3    [[texture(8)]],
+                          texture2d<float, access::write> gradient4    [[texture(9)]],
+                          constant bool& buildGradients                [[buffer(10)]],
+                          uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                          uint2 localIndex                             [[thread_position_in_threadgroup]],
+                          uint2 groupSize                              [[threads_per_threadgroup]]) {
+    threadgroup half4 imageTile1[kPyramidTile1 * kPyramidTile1];
+    threadgroup half2 gradientTile1[kPyramidTile1 * kPyramidTile1];
+    threadgroup half4 imageTile2[kPyramidTile2 * kPyramidTile2];
+    threadgroup half2 gradientTile2[kPyramidTile2 * kPyramidTile2];
+    // The third level reuses the first level's storage
+    threadgroup half4* imageTile3 = imageTile1;
+    threadgroup half2* gradientTile3 = gradientTile1;
+
+    const uint thread = localIndex.y * groupSize.x + localIndex.x;
+    const uint threads = groupSize.x * groupSize.y;
+
+    // Tile origins of each level, including the filter halos
+    const int2 origin4 = int2(groupPosition) * kPyramidTile;
+    const int2 origin3 = 2 * origin4 - 1;
+    const int2 origin2 = 2 * origin3 - 1;
+    const int2 origin1 = 2 * origin2 - 1;
+
+    const int2 dimensions1 = int2(image1.get_width(), image1.get_height());
+    const int2 dimensions2 = int2(image2.get_width(), image2.get_height());
+    const int2 dimensions3 = int2(image3.get_width(), image3.get_height());
+    const int2 dimensions4 = int2(image4.get_width(), image4.get_height());
+
+    // First level: four bilinear samples on the pixel corners of each 4x4 block of the source
+    constexpr sampler linear_sampler(filter::linear);
+    const float2 inputNorm = 1.0 / float2(get_image_dim(inputImage));
+    for (int e = thread; e < kPyramidTile1 * kPyramidTile1; e += threads) {
+        const int2 q = clamp(origin1 + int2(e % kPyramidTile1, e / kPyramidTile1), 0, dimensions1 - 1);
+        const float2 pos = float2(2 * q + 1) * inputNorm;
+
+        float3 imageValue = 0;
+        float2 gradientValue = 0;
+        for (int j = -1; j <= 1; j += 2) {
+            for (int i = -1; i <= 1; i += 2) {
+                const float2 samplePos = pos + float2(i, j) * inputNorm;
+                imageValue += read_imagef(inputImage, linear_sampler, samplePos).xyz;
+                if (buildGradients) {
+                    gradientValue += read_imagef(gradientImage, linear_sampler, samplePos).xy;
+                }
+            }
+        }
+        imageTile1[e] = half4(half3(0.25 * imageValue), 0);
+        gradientTile1[e] = half2(0.25 * gradientValue);
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    downsamplePyramidTile(imageTile1, kPyramidTile1, imageTile2, kPyramidTile2, origin2, dimensions2, thread, threads);
+    if (buildGradients) {
+        downsamplePyramidTile(gradientTile1, kPyramidTile1, gradientTile2, kPyramidTile2, origin2, dimensions2, thread, threads);
+    }
+    writePyramidTile(imageTile1, gradientTile1, kPyramidTile1, origin1, origin4 * 8, kPyramidTile * 8,
+                     image1, gradient1, buildGradients, thread, threads);
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    downsamplePyramidTile(imageTile2, kPyramidTile2, imageTile3, kPyramidTile3, origin3, dimensions3, thread, threads);
+    if (buildGradients) {
+        downsamplePyramidTile(gradientTile2, kPyramidTile2, gradientTile3, kPyramidTile3, origin3, dimensions3, thread, threads);
+    }
+    writePyramidTile(imageTile2, gradientTile2, kPyramidTile2, origin2, origin4 * 4, kPyramidTile * 4,
+                     image2, gradient2, buildGradients, thread, threads);
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    writePyramidTile(imageTile3, gradientTile3, kPyramidTile3, origin3, origin4 * 2, kPyramidTile * 2,
+                     image3, gradient3, buildGradients, thread, threads);
+
+    // Last level, straight to the output
+    if (thread < kPyramidTile * kPyramidTile) {
+        const int2 q = origin4 + int2(thread % kPyramidTile, thread / kPyramidTile);
+        if (all(q < dimensions4)) {
+            const int2 tap = 2 * q - 1 - origin3;
+            half4 imageValue = 0;
+            half2 gradientValue = 0;
+            for (int j = 0; j < 4; j++) {
+                for (int i = 0; i < 4; i++) {
+                    imageValue += imageTile3[(tap.y + j) * kPyramidTile3 + tap.x + i];
+                    gradientValue += gradientTile3[(tap.y + j) * kPyramidTile3 + tap.x + i];
+                }
+            }
+            write_imagef(image4, q, float4(float3(imageValue.xyz) / 16, 0));
+            if (buildGradients) {
+                write_imagef(gradient4, q, float4(float2(gradientValue) / 16, 0, 0));
+            }
+        }
+    }
+}
+
+// Running average of the frames of a burst at one pyramid level, each frame is registered to the reference frame
+// with the level's homography. The first frame (count == 1) initializes the average, fusedImage is not read.
+kernel void fusePyramidLevel(texture2d<float> fusedImage                     [[texture(0)]],
+                             texture2d<float> inputImage                     [[texture(1)]],
+                             texture2d<float, access::write> newFusedImage   [[texture(2)]],
+                             constant Matrix3x3& homography                  [[buffer(3)]],
+                             constant int& count                             [[buffer(4)]],
+                             uint2 index                                     [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
+    const float2 input_norm = 1.0 / float2(get_image_dim(inputImage));
+
+    constexpr sampler linear_sampler(filter::linear);
+
+    const float3 p(imageCoordinates.x, imageCoordinates.y, 1);
+    const float w = dot(homography.m[2], p);
+    const float2 inputPosition = float2(dot(homography.m[0], p), dot(homography.m[1], p)) / w;
+
+    float4 result = read_imagef(inputImage, linear_sampler, (inputPosition + 0.5) * input_norm);
+    if (count > 1) {
+        const float4 fused = read_imagef(fusedImage, imageCoordinates);
+        result = ((count - 1) * fused + result) / count;
+    }
+    write_imagef(newFusedImage, imageCoordinates, result);
+}
+
+// Coarse-to-fine tile alignment in the style of HDR+: every tile of a reference pyramid level searches the frame's
+// level around the offset found at the coarser level. One SIMD-group per tile, the lanes split the candidate offsets.
+// The motion field holds the offset of each tile in level pixels, and its matching cost.
+
+#define ALIGN_TILE_SIZE     16
+
+kernel void alignTiles(texture2d<float> referenceImage              [[texture(0)]],
+                       texture2d<float> frameImage                  [[texture(1)]],
+                       texture2d<float> coarseMotionField           [[texture(2)]],
+                       texture2d<float, access::write> motionField  [[texture(3)]],
+                       constant int& searchRadius                   [[buffer(4)]],
+                       constant int& useCoarseMotionField           [[buffer(5)]],
+                       constant int& l1Norm                         [[buffer(6)]],
+                       uint lane                                    [[thread_index_in_simdgroup]],
+                       uint simd_size                               [[threads_per_simdgroup]],
+                       uint2 tile                                   [[threadgroup_position_in_grid]]) {
+    const int2 tileOrigin = int2(tile) * ALIGN_TILE_SIZE;
+    const int2 referenceMax = get_image_dim(referenceImage) - 1;
+    const int2 frameMax = get_image_dim(frameImage) - 1;
+
+    // The coarser level's offset, in this level's pixels
+    int2 initialOffset = 0;
+    if (useCoarseMotionField) {
+        const int2 coarseTile = min(int2(tile) / 2, get_image_dim(coarseMotionField) - 1);
+        initialOffset = 2 * int2(round(read_imagef(coarseMotionField, coarseTile).xy));
+    }
+
+    const int side = 2 * searchRadius + 1;
+    const int candidates = side * side;
+
+    // Ties go to the smallest displacement from the initial offset, flat areas don't drift
+    float bestCost = INFINITY;
+    int bestKey = INT_MAX;
+    for (int c = lane; c < candidates; c += simd_size) {
+        const int2 displacement = int2(c % side, c / side) - searchRadius;
+        const int2 offset = initialOffset + displacement;
+
+        float cost = 0;
+        for (int y = 0; y < ALIGN_TILE_SIZE; y++) {
+            for (int x = 0; x < ALIGN_TILE_SIZE; x++) {
+                const int2 p = min(tileOrigin + int2(x, y), referenceMax);
+                const float r = read_imagef(referenceImage, p).x;
+                const float f = read_imagef(frameImage, clamp(p + offset, 0, frameMax)).x;
+                cost += l1Norm ? abs(r - f) : (r - f) * (r - f);
+            }
+        }
+
+        const int key = (displacement.x * displacement.x + displacement.y * displacement.y) * candidates + c;
+        if (cost < bestCost || (cost == bestCost && key < bestKey)) {
+            bestCost = cost;
+            bestKey = key;
+        }
+    }
+
+    const float minCost = simd_min(bestCost);
+    const int winnerKey = simd_min(bestCost == minCost ? bestKey : INT_MAX);
+    if (lane == 0) {
+        const int c = winnerKey % candidates;
+        const int2 offset = initialOffset + int2(c % side, c / side) - searchRadius;
+        write_imagef(motionField, int2(tile), float4(offset.x, offset.y, minCost, 0));
+    }
+}
+
+// Robust burst merge in the raw domain, in the style of HDR+: every 16x16 tile of the four half resolution color
+// planes of a frame is pulled towards the reference by a Wiener filter of their difference in the DCT domain.
+// Differences explained by the raw NLF are averaged away, motion and misalignment fall back to the reference.
+// The tiles overlap by half and their sin^2 windows sum to one, same parity tiles don't overlap and are dispatched
+// together so that they can accumulate without atomics. The merge runs on the scaled raw values, where the NLF lives.
+
+#define MERGE_TILE_SIZE     16
+
+typedef struct RawMergeParameters {
+    float4 scaleMul;
+    float4 nlfA;
+    float4 nlfB;
+    float blackLevel;
+    float mergeStrength;
+    int bayerPattern;
+} RawMergeParameters;
+
+float4 readScaledRawPlanes(texture2d<float> rawImage, int2 planeCoordinates, constant RawMergeParameters& parameters) {
+    constant const int2* offsets = bayerPatternOffsets(parameters.bayerPattern);
+    const int2 p = 2 * planeCoordinates;
+    const float4 raw = float4(read_imagef(rawImage, p + offsets[raw_red]).x,
+                              read_imagef(rawImage, p + offsets[raw_green]).x,
+                              read_imagef(rawImage, p + offsets[raw_blue]).x,
+                              read_imagef(rawImage, p + offsets[raw_green2]).x);
+    return parameters.scaleMul * (raw - parameters.blackLevel) * 0.9 + 0.1;
+}
+
+kernel void rawMergeInit(texture2d<float> referenceImage                [[texture(0)]],
+                         device float4* accumulator                     [[buffer(1)]],
+                         constant RawMergeParameters& parameters        [[buffer(2)]],
+                         uint2 index                                    [[thread_position_in_grid]]) {
+    const int planeWidth = get_image_dim(referenceImage).x / 2;
+    accumulator[index.y * planeWidth + index.x] = readScaledRawPlanes(referenceImage, int2(index), parameters);
+}
+
+kernel void rawMergeFrame(texture2d<float> referenceImage               [[texture(0)]],
+                          texture2d<float> frameImage                   [[texture(1)]],
+                          device float4* accumulator                    [[buffer(2)]],
+                          device atomic_uint* acceptance                [[buffer(3)]],
+                          constant RawMergeParameters& parameters       [[buffer(4)]],
+                          constant Matrix3x3& homography                [[buffer(5)]],
+                          constant int2& tileParity                     [[buffer(6)]],
+                          uint2 tile                                    [[threadgroup_position_in_grid]],
+                          uint2 local                                   [[thread_position_in_threadgroup]],
+                          uint simd_lane                                [[thread_index_in_simdgroup]],
+                          uint simd_group                               [[simdgroup_index_in_threadgroup]],
+                          uint simd_groups                              [[simdgroups_per_threadgroup]]) {
+    threadgroup float dct[MERGE_TILE_SIZE][MERGE_TILE_SIZE];
+    threadgroup float4 block[MERGE_TILE_SIZE][MERGE_TILE_SIZE];
+    threadgroup float4 scratch[MERGE_TILE_SIZE][MERGE_TILE_SIZE];
+    threadgroup float4 partialSums[32];
+
+    const int2 planeDim = get_image_dim(referenceImage) / 2;
+    const int2 tileOrigin = (2 * int2(tile) + tileParity) * (MERGE_TILE_SIZE / 2) - MERGE_TILE_SIZE / 2;
+    if (any(tileOrigin >= planeDim)) {
+        return;
+    }
+
+    const int x = local.x;
+    const int y = local.y;
+
+    // Orthonormal DCT-II basis, dct[k][n]
+    dct[y][x] = (y == 0 ? sqrt(1.0 / MERGE_TILE_SIZE) : sqrt(2.0 / MERGE_TILE_SIZE)) *
+                cos(M_PI_F * (2 * x + 1) * y / (2 * MERGE_TILE_SIZE));
+
+    const int2 p = tileOrigin + int2(x, y);
+    const bool inside = all(p >= 0) && all(p < planeDim);
+    const int2 pc = clamp(p, 0, planeDim - 1);
+
+    const float4 r = readScaledRawPlanes(referenceImage, pc, parameters);
+
+    // Nearest neighbor registration of the color planes, the reference fills in where the frame doesn't cover it
+    float3 hp(pc.x, pc.y, 1);
+    float u = dot(homography.m[0], hp);
+    float v = dot(homography.m[1], hp);
+    float w = dot(homography.m[2], hp);
+    const int2 q = int2(round(u / w), round(v / w));
+    const float4 f = all(q >= 0) && all(q < get_image_dim(frameImage) / 2) ? readScaledRawPlanes(frameImage, q, parameters) : r;
+
+    block[y][x] = r - f;
+
+    // The noise level of the tile, from its mean reference value
+    const float4 rSum = simd_sum(r);
+    if (simd_lane == 0) {
+        partialSums[simd_group] = rSum;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    float4 mean = 0;
+    for (uint i = 0; i < simd_groups; i++) {
+        mean += partialSums[i];
+    }
+    mean /= MERGE_TILE_SIZE * MERGE_TILE_SIZE;
+    // Both frames contribute to the noise of the difference
+    const float4 sigma2 = 2 * max(parameters.nlfA + parameters.nlfB * mean, 1e-8f);
+
+    // Forward transform, rows then columns
+    float4 sum = 0;
+    for (int n = 0; n < MERGE_TILE_SIZE; n++) {
+        sum += dct[x][n] * block[y][n];
+    }
+    scratch[y][x] = sum;
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    sum = 0;
+    for (int n = 0; n < MERGE_TILE_SIZE; n++) {
+        sum += dct[y][n] * scratch[n][x];
+    }
+
+    // Wiener shrinkage of the difference: noise-like coefficients keep the frame, large ones take the reference's
+    const float4 d2 = sum * sum;
+    const float4 a = d2 / (d2 + parameters.mergeStrength * sigma2);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    block[y][x] = a * sum;
+
+    // Fraction of the frame's coefficients accepted, for the effective frame count
+    const float4 acceptedSum = simd_sum(1 - a);
+    if (simd_lane == 0) {
+        partialSums[simd_group] = acceptedSum;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    if (x == 0 && y == 0) {
+        float4 accepted = 0;
+        for (uint i = 0; i < simd_groups; i++) {
+            accepted += partialSums[i];
+        }
+        const float meanAccepted = dot(accepted, float4(0.25)) / (MERGE_TILE_SIZE * MERGE_TILE_SIZE);
+        atomic_fetch_add_explicit(acceptance, (uint) round(1024 * meanAccepted), memory_order_relaxed);
+    }
+
+    // Inverse transform, columns then rows
+    sum = 0;
+    for (int k = 0; k < MERGE_TILE_SIZE; k++) {
+        sum += dct[k][y] * block[k][x];
+    }
+    scratch[y][x] = sum;
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    sum = 0;
+    for (int k = 0; k < MERGE_TILE_SIZE; k++) {
+        sum += dct[k][x] * scratch[y][k];
+    }
+
+    if (inside) {
+        const float2 window = sin(M_PI_F * (float2(x, y) + 0.5) / MERGE_TILE_SIZE);
+        accumulator[p.y * planeDim.x + p.x] += window.x * window.x * window.y * window.y * (f + sum);
+    }
+}
+
+kernel void rawMergeResolve(device float4* accumulator                  [[buffer(0)]],
+                            texture2d<float, access::write> rawImage    [[texture(1)]],
+                            constant RawMergeParameters& parameters     [[buffer(2)]],
+                            constant int& frames                        [[buffer(3)]],
+                            uint2 index                                 [[thread_position_in_grid]]) {
+    const int planeWidth = get_image_dim(rawImage).x / 2;
+    const float4 scaled = accumulator[index.y * planeWidth + index.x] / frames;
+    const float4 raw = saturate((scaled - 0.1) / (0.9 * parameters.scaleMul) + parameters.blackLevel);
+
+    constant const int2* offsets = bayerPatternOffsets(parameters.bayerPattern);
+    const int2 p = 2 * int2(index);
+    write_imagef(rawImage, p + offsets[raw_red], raw.x);
+    write_imagef(rawImage, p + offsets[raw_green], raw.y);
+    write_imagef(rawImage, p + offsets[raw_blue], raw.z);
+    write_imagef(rawImage, p + offsets[raw_green2], raw.w);
+}
+
+// Exposure bracket merge in the raw domain: the registered brackets are averaged per pixel in the reference frame's
+// radiance units, each weighted by the inverse of its noise variance from the raw NLF scaled by its exposure ratio,
+// so that the longer exposures dominate the shadows. The weights roll off to zero as a frame approaches clipping,
+// and where the reference isn't clipped a frame is rejected as ghosting when it differs from it by more than its
+// noise explains. The merged image is written in the units of the shortest exposure, so that nothing clips.
+
+typedef struct HDRMergeParameters {
+    RawMergeParameters raw;
+    float clipLevel;
+    float outputScale;
+} HDRMergeParameters;
+
+typedef struct HDRAccumulator {
+    float4 sum;
+    float4 weight;
+} HDRAccumulator;
+
+// Weight of a bracket sample, in the reference's radiance units
+float4 hdrSampleWeight(float4 scaled, float4 clipScaled, float exposureRatio, constant HDRMergeParameters& parameters) {
+    const float4 variance = exposureRatio * exposureRatio * max(parameters.raw.nlfA + parameters.raw.nlfB * scaled, 1e-8f);
+    // Smooth roll off over the last 10% below the clipping level
+    const float4 clipWeight = saturate((clipScaled - scaled) / (0.1 * clipScaled));
+    // A tiny floor favoring the shortest exposure where every frame is clipped
+    return clipWeight * clipWeight / variance + 1e-6 * exposureRatio;
+}
+
+float4 hdrClipScaled(constant HDRMergeParameters& parameters) {
+    return parameters.raw.scaleMul * (parameters.clipLevel - parameters.raw.blackLevel) * 0.9 + 0.1;
+}
+
+kernel void hdrMergeInit(texture2d<float> referenceImage                [[texture(0)]],
+                         device HDRAccumulator* accumulator             [[buffer(1)]],
+                         constant HDRMergeParameters& parameters        [[buffer(2)]],
+                         uint2 index                                    [[thread_position_in_grid]]) {
+    const int planeWidth = get_image_dim(referenceImage).x / 2;
+    const float4 scaled = readScaledRawPlanes(referenceImage, int2(index), parameters.raw);
+    const float4 weight = hdrSampleWeight(scaled, hdrClipScaled(parameters), 1, parameters);
+    accumulator[index.y * planeWidth + index.x] = { weight * (scaled - 0.1), weight };
+}
+
+kernel void hdrMergeFrame(texture2d<float> referenceImage               [[texture(0)]],
+                          texture2d<float> frameImage                   [[texture(1)]],
+                          device HDRAccumulator* accumulator            [[buffer(2)]],
+                          constant HDRMergeParameters& parameters       [[buffer(3)]],
+                          constant Matrix3x3& homography                [[buffer(4)]],
+                          constant float& exposureRatio                 [[buffer(5)]],
+                          uint2 index                                   [[thread_position_in_grid]]) {
+    const int2 planeCoordinates = int2(index);
+    const int planeWidth = get_image_dim(referenceImage).x / 2;
+
+    // Nearest neighbor registration of the color planes, as registerBayerImage
+    float3 p(planeCoordinates.x, planeCoordinates.y, 1);
+    float u = dot(homography.m[0], p);
+    float v = dot(homography.m[1], p);
+    float w = dot(homography.m[2], p);
+    const int2 q = int2(round(u / w), round(v / w));
+    if (any(q < 0) || any(q >= int2(get_image_dim(frameImage)) / 2)) {
+        return;
+    }
+
+    const float4 clipScaled = hdrClipScaled(parameters);
+    const float4 scaled = readScaledRawPlanes(frameImage, q, parameters.raw);
+    float4 weight = hdrSampleWeight(scaled, clipScaled, exposureRatio, parameters);
+    const float4 radiance = exposureRatio * (scaled - 0.1);
+
+    // Ghost rejection against the unclipped reference
+    const float4 referenceScaled = readScaledRawPlanes(referenceImage, planeCoordinates, parameters.raw);
+    const float4 referenceVariance = max(parameters.raw.nlfA + parameters.raw.nlfB * referenceScaled, 1e-8f);
+    const float4 frameVariance = exposureRatio * exposureRatio * max(parameters.raw.nlfA + parameters.raw.nlfB * scaled, 1e-8f);
+    const float4 d = radiance - (referenceScaled - 0.1);
+    const float4 rejection = d * d / (d * d + parameters.raw.mergeStrength * (referenceVariance + frameVariance));
+    weight *= select(1 - rejection, float4(1), referenceScaled >= 0.9 * clipScaled);
+
+    device HDRAccumulator& a = accumulator[planeCoordinates.y * planeWidth + planeCoordinates.x];
+    a.sum += weight * radiance;
+    a.weight += weight;
+}
+
+kernel void hdrMergeResolve(device HDRAccumulator* accumulator          [[buffer(0)]],
+                            texture2d<float, access::write> rawImage    [[texture(1)]],
+                            constant HDRMergeParameters& parameters     [[buffer(2)]],
+                            uint2 index                                 [[thread_position_in_grid]]) {
+    const int planeWidth = get_image_dim(rawImage).x / 2;
+    const HDRAccumulator a = accumulator[index.y * planeWidth + index.x];
+    const float4 radiance = a.sum / max(a.weight, 1e-12f);
+    const float4 raw = saturate(radiance / (0.9 * parameters.outputScale * parameters.raw.scaleMul) + parameters.raw.blackLevel);
+
+    constant const int2* offsets = bayerPatternOffsets(parameters.raw.bayerPattern);
+    const int2 p = 2 * int2(index);
+    write_imagef(rawImage, p + offsets[raw_red], raw.x);
+    write_imagef(rawImage, p + offsets[raw_green], raw.y);
+    write_imagef(rawImage, p + offsets[raw_blue], raw.z);
+    write_imagef(rawImage, p + offsets[raw_green2], raw.w);
+}
+
+// Motion compensated recursive temporal denoise of the YCbCr input of the denoising pyramid: the previous frame's
+// output, warped by the coarse motion field of alignTiles, is blended with the current frame. The blend weight falls
+// off as the 3x3 mean difference of the two exceeds what the YCbCr NLF explains, moving and misaligned areas keep the
+// current frame. The motion field maps the current frame's coordinates to the history's, in units of its level.
+
+typedef struct TemporalDenoiseParameters {
+    float3 nlfA;
+    float3 nlfB;
+    float historyWeight;
+    float rejectionStrength;
+    float motionScale;
+} TemporalDenoiseParameters;
+
+kernel void temporalDenoiseImage(texture2d<float> inputImage                        [[texture(0)]],
+                                 texture2d<float> historyImage                      [[texture(1)]],
+                                 texture2d<float> motionField                       [[texture(2)]],
+                                 texture2d<float, access::write> outputImage        [[texture(3)]],
+                                 constant TemporalDenoiseParameters& parameters     [[buffer(4)]],
+                                 uint2 index                                        [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = int2(index);
+    const float2 imageNorm = 1.0 / float2(get_image_dim(inputImage));
+    const float2 fieldNorm = 1.0 / float2(get_image_dim(motionField));
+
+    constexpr sampler linear_sampler(filter::linear, address::clamp_to_edge);
+
+    const float2 fieldPosition = (float2(imageCoordinates) / parameters.motionScale + 0.5) / ALIGN_TILE_SIZE;
+    const float2 offset = parameters.motionScale * read_imagef(motionField, linear_sampler, fieldPosition * fieldNorm).xy;
+
+    float3 inputMean = 0;
+    float3 historyMean = 0;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            const float2 p = float2(imageCoordinates + int2(x, y)) + 0.5;
+            inputMean += read_imagef(inputImage, linear_sampler, p * imageNorm).xyz;
+            historyMean += read_imagef(historyImage, linear_sampler, (p + offset) * imageNorm).xyz;
+        }
+    }
+    inputMean /= 9;
+    historyMean /= 9;
+
+    const float3 input = read_imagef(inputImage, imageCoordinates).xyz;
+    const float3 history = read_imagef(historyImage, linear_sampler, (float2(imageCoordinates) + offset + 0.5) * imageNorm).xyz;
+
+    // Normalized squared difference of the means, around 2 where the difference is noise
+    const float3 variance = max(parameters.nlfA + parameters.nlfB * input.x, 1e-8f) / 9;
+    const float3 d = inputMean - historyMean;
+    const float distance = dot(d * d / variance, float3(1.0 / 3));
+
+    const float weight = parameters.historyWeight * parameters.rejectionStrength / (parameters.rejectionStrength + max(distance - 2, 0.0));
+
+    write_imagef(outputImage, imageCoordinates, float4(mix(input, history, weight), 0));
+}
+
 kernel void subtractNoiseImage(texture2d<float> inputImage                      [[texture(0)]],
                                texture2d<float> inputImage1                     [[texture(1)]],
                                texture2d<float> inputImageDenoised1             [[texture(2)]],
@@ -929,33 +2662,70 @@ kernel void subtractNoiseImage(texture2d<float> inputImage
                                texture2d<float, access::write> outputImage      [[texture(7)]],
                                uint2 index                                      [[thread_position_in_grid]]) {
     const int2 output_pos = (int2) index;
-    const float2 inputNorm = 1.0 / float2(get_image_dim(outputImage));
-    const float2 input_pos = (float2(output_pos) + 0.5) * inputNorm;
-
-    constexpr sampler linear_sampler(filter::linear);
-
-    float4 inputPixel = read_imagef(inputImage, output_pos);
 
-    float3 inputPixel1 = read_imagef(inputImage1, linear_sampler, input_pos).xyz;
-    float3 inputPixelDenoised1 = read_imagef(inputImageDenoised1, linear_sampler, input_pos).xyz;
+    const float3 denoisedPixel = subtractNoisePixel(inputImage, inputImage1, inputImageDenoised1, gradientImage,
+                                                    luma_weight, sharpening, nlf, output_pos, get_image_dim(outputImage));
 
-    float3 denoisedPixel = inputPixel.xyz - float3(luma_weight, 1, 1) * (inputPixel1 - inputPixelDenoised1);
+    write_imagef(outputImage, output_pos, float4(denoisedPixel, read_imagef(inputImage, output_pos).w));
+}
 
-    float alpha = sharpening;
-    if (alpha > 1.0) {
-        float gradient = length(read_imagef(gradientImage, output_pos).xy);
-        float sigma = sqrt(nlf.x + nlf.y * inputPixelDenoised1.x);
-        float detail = smoothstep(sigma, 4 * sigma, gradient)
-                       * (1.0 - smoothstep(0.75, 0.95, inputPixelDenoised1.x))        // Highlights ringing protection
-                       * smoothstep(0.05, 0.1, inputPixelDenoised1.x);                // Shadows ringing protection
-        alpha = 1 + (alpha - 1) * detail;
+// subtractNoiseImage to the 4:2:0 representation of the level: full resolution luma and the chroma averaged over
+// 2x2 pixels, a thread per chroma site
+kernel void subtractNoiseImage420(texture2d<float> inputImage                       [[texture(0)]],
+                                  texture2d<float> inputImage1                      [[texture(1)]],
+                                  texture2d<float> inputImageDenoised1              [[texture(2)]],
+                                  texture2d<float> gradientImage                    [[texture(3)]],
+                                  constant float& luma_weight                       [[buffer(4)]],
+                                  constant float& sharpening                        [[buffer(5)]],
+                                  constant float2& nlf                              [[buffer(6)]],
+                                  texture2d<float, access::write> lumaImage         [[texture(7)]],
+                                  texture2d<float, access::write> chromaImage       [[texture(8)]],
+                                  uint2 index                                       [[thread_position_in_grid]]) {
+    const int2 site = (int2) index;
+    const int2 outputDimensions = get_image_dim(lumaImage);
+
+    // The last row and column of odd sized levels have half sites
+    float2 chroma = 0;
+    int pixels = 0;
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            const int2 output_pos = 2 * site + int2(i, j);
+            if (all(output_pos < outputDimensions)) {
+                const float3 denoisedPixel = subtractNoisePixel(inputImage, inputImage1, inputImageDenoised1, gradientImage,
+                                                                luma_weight, sharpening, nlf, output_pos, outputDimensions);
+                write_imagef(lumaImage, output_pos, float4(denoisedPixel.x, 0, 0, 0));
+                chroma += denoisedPixel.yz;
+                pixels++;
+            }
+        }
     }
+    write_imagef(chromaImage, site, float4(chroma / pixels, 0, 0));
+}
 
-    // Sharpen all components
-    denoisedPixel = mix(inputPixelDenoised1, denoisedPixel, alpha);
-    denoisedPixel.x = max(denoisedPixel.x, 0.0);
+// Chroma of a 4:2:0 image at a full resolution pixel, the sites are at the centers of their 2x2 pixels. Chroma
+// images can be 32 bit float, not filterable on all GPUs, the bilinear interpolation is explicit.
+float2 sampleChroma420(texture2d<float> chromaImage, int2 imageCoordinates) {
+    const int2 dimensions = get_image_dim(chromaImage);
+    const float2 t = 0.5 * float2(imageCoordinates) - 0.25;
+    const float2 p0 = floor(t);
+    const float2 f = t - p0;
+    const int2 i0 = clamp(int2(p0), 0, dimensions - 1);
+    const int2 i1 = clamp(int2(p0) + 1, 0, dimensions - 1);
+
+    const float2 top = mix(read_imagef(chromaImage, i0).xy, read_imagef(chromaImage, int2(i1.x, i0.y)).xy, f.x);
+    const float2 bottom = mix(read_imagef(chromaImage, int2(i0.x, i1.y)).xy, read_imagef(chromaImage, i1).xy, f.x);
+    return mix(top, bottom, f.y);
+}
+
+// Back to YCbCr at full resolution, e.g. for the levels of a 4:2:0 pyramid that are not block matched
+kernel void mergeYCbCr420(texture2d<float> lumaImage                    [[texture(0)]],
+                          texture2d<float> chromaImage                  [[texture(1)]],
+                          texture2d<float, access::write> outputImage   [[texture(2)]],
+                          uint2 index                                   [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
 
-    write_imagef(outputImage, output_pos, float4(denoisedPixel, inputPixel.w));
+    const float luma = read_imagef(lumaImage, imageCoordinates).x;
+    write_imagef(outputImage, imageCoordinates, float4(luma, sampleChroma420(chromaImage, imageCoordinates), 0));
 }
 
 kernel void bayerToRawRGBA(texture2d<float> rawImage                    [[texture(0)]],
@@ -964,10 +2734,11 @@ kernel void bayerToRawRGBA(texture2d<float> rawImage                    [[textur
                            uint2 index                                  [[thread_position_in_grid]]) {
     const int2 imageCoordinates = (int2) index;
 
-    const int2 r = bayerOffsets[bayerPattern][raw_red];
-    const int2 g = bayerOffsets[bayerPattern][raw_green];
-    const int2 b = bayerOffsets[bayerPattern][raw_blue];
-    const int2 g2 = bayerOffsets[bayerPattern][raw_green2];
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 r = offsets[raw_red];
+    const int2 g = offsets[raw_green];
+    const int2 b = offsets[raw_blue];
+    const int2 g2 = offsets[raw_green2];
 
     float red    = read_imagef(rawImage, 2 * imageCoordinates + r).x;
     float green  = read_imagef(rawImage, 2 * imageCoordinates + g).x;
@@ -985,10 +2756,11 @@ kernel void rawRGBAToBayer(texture2d<float> rgbaImage                   [[textur
 
     float4 rgba = read_imagef(rgbaImage, imageCoordinates);
 
-    const int2 r = bayerOffsets[bayerPattern][raw_red];
-    const int2 g = bayerOffsets[bayerPattern][raw_green];
-    const int2 b = bayerOffsets[bayerPattern][raw_blue];
-    const int2 g2 = bayerOffsets[bayerPattern][raw_green2];
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 r = offsets[raw_red];
+    const int2 g = offsets[raw_green];
+    const int2 b = offsets[raw_blue];
+    const int2 g2 = offsets[raw_green2];
 
     write_imagef(rawImage, 2 * imageCoordinates + r, rgba.x);
     write_imagef(rawImage, 2 * imageCoordinates + g, rgba.y);
@@ -996,6 +2768,82 @@ kernel void rawRGBAToBayer(texture2d<float> rgbaImage                   [[textur
     write_imagef(rawImage, 2 * imageCoordinates + g2, rgba.w);
 }
 
+// 2x2 binning of each color of the Bayer data, the result is a half resolution Bayer image with the same pattern.
+// A thread per quad of the binned image, the samples of a color are two pixels apart in the source.
+kernel void binBayerImage(texture2d<float> rawImage                     [[texture(0)]],
+                          texture2d<float, access::write> binnedImage   [[texture(1)]],
+                          uint2 index                                   [[thread_position_in_grid]]) {
+    const int2 quadCoordinates = 4 * (int2) index;
+
+    for (int y = 0; y < 2; y++) {
+        for (int x = 0; x < 2; x++) {
+            const int2 p = quadCoordinates + int2(x, y);
+            const float sum = read_imagef(rawImage, p).x + read_imagef(rawImage, p + int2(2, 0)).x +
+                              read_imagef(rawImage, p + int2(0, 2)).x + read_imagef(rawImage, p + int2(2, 2)).x;
+            write_imagef(binnedImage, 2 * (int2) index + int2(x, y), 0.25 * sum);
+        }
+    }
+}
+
+// The raw channel of the Bayer pixel at imageCoordinates, the greens of both rows are raw_green
+int bayerChannel(constant const int2* offsets, int2 imageCoordinates) {
+    const int2 phase = imageCoordinates & 1;
+    for (int c = raw_red; c <= raw_blue; c++) {
+        if (all(offsets[c] == phase)) {
+            return c;
+        }
+    }
+    return raw_green;
+}
+
+// Quad Bayer data: each color of the Bayer pattern covers a 2x2 block. Binning averages the blocks into a half
+// resolution Bayer image with the same pattern.
+kernel void binQuadBayer(texture2d<float> rawImage                      [[texture(0)]],
+                         texture2d<float, access::write> bayerImage     [[texture(1)]],
+                         uint2 index                                    [[thread_position_in_grid]]) {
+    const int2 blockCoordinates = 2 * (int2) index;
+
+    const float sum = read_imagef(rawImage, blockCoordinates).x + read_imagef(rawImage, blockCoordinates + int2(1, 0)).x +
+                      read_imagef(rawImage, blockCoordinates + int2(0, 1)).x + read_imagef(rawImage, blockCoordinates + int2(1, 1)).x;
+    write_imagef(bayerImage, (int2) index, 0.25 * sum);
+}
+
+// Remosaic of quad Bayer data to a full resolution Bayer image with the same pattern: the pixels whose color is the
+// same in both layouts are copied, the others are interpolated from the samples of their color in the 5x5 window
+// weighted by their inverse squared distance. Any 3x3 window has samples of every color, also at the image's edges.
+kernel void remosaicQuadBayer(texture2d<float> rawImage                     [[texture(0)]],
+                              texture2d<float, access::write> bayerImage    [[texture(1)]],
+                              constant int& bayerPattern                    [[buffer(2)]],
+                              uint2 index                                   [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
+    const int2 imageSize = int2(rawImage.get_width(), rawImage.get_height());
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int channel = bayerChannel(offsets, imageCoordinates);
+
+    if (bayerChannel(offsets, imageCoordinates >> 1) == channel) {
+        write_imagef(bayerImage, imageCoordinates, read_imagef(rawImage, imageCoordinates).x);
+        return;
+    }
+
+    float sum = 0;
+    float weight = 0;
+    for (int y = -2; y <= 2; y++) {
+        for (int x = -2; x <= 2; x++) {
+            const int2 p = clamp(imageCoordinates + int2(x, y), 0, imageSize - 1);
+            const int2 d = p - imageCoordinates;
+            // The center isn't of the channel, d is never zero
+            if (bayerChannel(offsets, p >> 1) != channel) {
+                continue;
+            }
+            const float w = 1.0 / (d.x * d.x + d.y * d.y);
+            sum += w * read_imagef(rawImage, p).x;
+            weight += w;
+        }
+    }
+    write_imagef(bayerImage, imageCoordinates, sum / weight);
+}
+
 kernel void crossDenoiseRawRGBAImage(texture2d<half> inputImage                    [[texture(0)]],
                                      constant half4& rawVariance                   [[buffer(1)]],
                                      constant half& strength                       [[buffer(2)]],
@@ -1022,25 +2870,59 @@ kernel void crossDenoiseRawRGBAImage(texture2d<half> inputImage
     write_imageh(denoisedImage, imageCoordinates, half4(sum / sumW));
 }
 
-half4 despeckle_3x3x4(texture2d<half> inputImage, half4 rawVariance, half gradient, int2 imageCoordinates) {
-    half4 sample = 0, firstMax = 0, secondMax = 0;
-    half4 firstMin = (half) HALF_MAX, secondMin = (half) HALF_MAX;
+// 3x3 rank filters on sorted columns (the separable median): the neighbourhood of a pixel is made of the sorted
+// three pixel columns at x - 1, x and x + 1, which the neighbouring pixels of a row share. The tiled kernels sort
+// each column once in threadgroup memory. Sorting is per channel.
 
-    for (int x = -1; x <= 1; x++) {
-        for (int y = -1; y <= 1; y++) {
-            half4 v = read_imageh(inputImage, imageCoordinates + (int2){x, y});
+template <typename T>
+struct SortedColumn {
+    T lo, mid, hi;
+};
 
-            secondMax = select(max(v, secondMax), firstMax, v >= firstMax);
-            firstMax = max(v, firstMax);
+template <typename T>
+SortedColumn<T> sortColumn(T a, T b, T c) {
+    return { min3(a, b, c), median3(a, b, c), max3(a, b, c) };
+}
 
-            secondMin = select(min(v, secondMin), firstMin, v <= firstMin);
-            firstMin = min(v, firstMin);
+// The three smallest (largest) values of two sorted columns: min(a[i], b[2 - i]) is a bitonic sequence of them
+template <typename T>
+SortedColumn<T> lowest3(SortedColumn<T> a, SortedColumn<T> b) {
+    return sortColumn(min(a.lo, b.hi), min(a.mid, b.mid), min(a.hi, b.lo));
+}
 
-            if (x == 0 && y == 0) {
-                sample = v;
-            }
-        }
-    }
+template <typename T>
+SortedColumn<T> highest3(SortedColumn<T> a, SortedColumn<T> b) {
+    return sortColumn(max(a.lo, b.hi), max(a.mid, b.mid), max(a.hi, b.lo));
+}
+
+template <typename T>
+T median3x3(SortedColumn<T> left, SortedColumn<T> center, SortedColumn<T> right) {
+    return median3(max3(left.lo, center.lo, right.lo),
+                   median3(left.mid, center.mid, right.mid),
+                   min3(left.hi, center.hi, right.hi));
+}
+
+half4 sampleQuad(texture2d<half> image, int2 imageCoordinates) {
+    return read_imageh(image, imageCoordinates);
+}
+
+half4 sampleQuad(TileView<half4> tile, int2 imageCoordinates) {
+    return tile.read(imageCoordinates);
+}
+
+template <typename QuadImage>
+SortedColumn<half4> sortedQuadColumn(QuadImage image, int2 imageCoordinates) {
+    return sortColumn(sampleQuad(image, imageCoordinates + int2(0, -1)),
+                      sampleQuad(image, imageCoordinates),
+                      sampleQuad(image, imageCoordinates + int2(0, 1)));
+}
+
+half4 despeckle_3x3x4(half4 sample, SortedColumn<half4> left, SortedColumn<half4> center, SortedColumn<half4> right,
+                      half4 rawVariance, half gradient) {
+    const SortedColumn<half4> lowest = lowest3(lowest3(left, center), right);
+    const SortedColumn<half4> highest = highest3(highest3(left, center), right);
+    const half4 firstMin = lowest.lo, secondMin = lowest.mid;
+    const half4 firstMax = highest.hi, secondMax = highest.mid;
 
     half4 sigma = sqrt(rawVariance * sample);
     half4 texture = 1 - 0.5 * smoothstep(1, 2, gradient / sigma);
@@ -1049,27 +2931,12 @@ half4 despeckle_3x3x4(texture2d<half> inputImage, half4 rawVariance, half gradie
     return clamp(sample, minVal, maxVal);
 }
 
-half4 despeckle_3x3x4_strong(texture2d<half> inputImage, half4 rawVariance, half gradient, int2 imageCoordinates) {
-    half4 sample = 0, firstMax = 0, secondMax = 0, thirdMax = 0;
-    half4 firstMin = (half) HALF_MAX, secondMin = (half) HALF_MAX, thirdMin = (half) HALF_MAX;
-
-    for (int x = -1; x <= 1; x++) {
-        for (int y = -1; y <= 1; y++) {
-            half4 v = read_imageh(inputImage, imageCoordinates + (int2){x, y});
-
-            thirdMax = select(max(v, thirdMax), secondMax, v >= secondMax);
-            secondMax = select(max(v, secondMax), firstMax, v >= firstMax);
-            firstMax = max(v, firstMax);
-
-            thirdMin = select(min(v, thirdMin), secondMin, v <= secondMin);
-            secondMin = select(min(v, secondMin), firstMin, v <= firstMin);
-            firstMin = min(v, firstMin);
-
-            if (x == 0 && y == 0) {
-                sample = v;
-            }
-        }
-    }
+half4 despeckle_3x3x4_strong(half4 sample, SortedColumn<half4> left, SortedColumn<half4> center, SortedColumn<half4> right,
+                             half4 rawVariance, half gradient) {
+    const SortedColumn<half4> lowest = lowest3(lowest3(left, center), right);
+    const SortedColumn<half4> highest = highest3(highest3(left, center), right);
+    const half4 firstMin = lowest.lo, secondMin = lowest.mid, thirdMin = lowest.hi;
+    const half4 firstMax = highest.hi, secondMax = highest.mid, thirdMax = highest.lo;
 
     half4 sigma = sqrt(rawVariance * sample);
     half4 texture = smoothstep(1, 4, gradient / sigma);
@@ -1078,6 +2945,25 @@ half4 despeckle_3x3x4_strong(texture2d<half> inputImage, half4 rawVariance, half
     return clamp(sample, minVal, maxVal);
 }
 
+// Reads a half resolution RGBA raw image, or a tile of it
+template <typename QuadImage>
+half4 despeckle_3x3x4(QuadImage inputImage, half4 rawVariance, half gradient, int2 imageCoordinates) {
+    return despeckle_3x3x4(sampleQuad(inputImage, imageCoordinates),
+                           sortedQuadColumn(inputImage, imageCoordinates + int2(-1, 0)),
+                           sortedQuadColumn(inputImage, imageCoordinates),
+                           sortedQuadColumn(inputImage, imageCoordinates + int2(1, 0)),
+                           rawVariance, gradient);
+}
+
+template <typename QuadImage>
+half4 despeckle_3x3x4_strong(QuadImage inputImage, half4 rawVariance, half gradient, int2 imageCoordinates) {
+    return despeckle_3x3x4_strong(sampleQuad(inputImage, imageCoordinates),
+                                  sortedQuadColumn(inputImage, imageCoordinates + int2(-1, 0)),
+                                  sortedQuadColumn(inputImage, imageCoordinates),
+                                  sortedQuadColumn(inputImage, imageCoordinates + int2(1, 0)),
+                                  rawVariance, gradient);
+}
+
 kernel void despeckleRawRGBAImage(texture2d<half> inputImage                    [[texture(0)]],
                                   texture2d<half> gradientImage                 [[texture(1)]],
                                   constant float4& rawVariance                  [[buffer(2)]],
@@ -1085,7 +2971,7 @@ kernel void despeckleRawRGBAImage(texture2d<half> inputImage
                                   uint2 index                                   [[thread_position_in_grid]]) {
     const int2 imageCoordinates = (int2) index;
 
-    const half gradient = length(read_imageh(gradientImage, 2 * imageCoordinates).xy);
+    const half gradient = length(gradientView(gradientImage, 2 * get_image_dim(inputImage)).read(2 * imageCoordinates).xy);
     half4 despeckledPixel = despeckle_3x3x4(inputImage, half4(rawVariance), gradient, imageCoordinates);
 
     write_imageh(denoisedImage, imageCoordinates, despeckledPixel);
@@ -1107,6 +2993,100 @@ float4 readRAWQuad(texture2d<float> rawImage,
     return float4(red, green, blue, green2);
 }
 
+// Fused high noise raw denoise: bayerToRawRGBA, despeckleRawRGBAImage, crossDenoiseRawRGBAImage and rawRGBAToBayer
+// on a threadgroup tile of Bayer quads. The raw data is read once, the sorted columns and the despeckled quads stay
+// in threadgroup memory for the 5x5 cross denoise and the result is written out as a mosaic. One thread per quad,
+// tiles are addressed in quad coordinates and clamped to the image edges.
+
+#define kRawDenoiseTile             16
+#define kRawDenoiseHalo             2
+#define kRawDenoiseQuadHalo         (kRawDenoiseHalo + 1)
+#define kRawDenoiseDespeckleTile    (kRawDenoiseTile + 2 * kRawDenoiseHalo)
+#define kRawDenoiseQuadTile         (kRawDenoiseTile + 2 * kRawDenoiseQuadHalo)
+
+kernel void highNoiseRawDenoise(texture2d<float> rawImage                       [[texture(0)]],
+                                texture2d<half> gradientImage                   [[texture(1)]],
+                                texture2d<float, access::write> denoisedImage   [[texture(2)]],
+                                constant int& bayerPattern                      [[buffer(3)]],
+                                constant float4& rawVariance                    [[buffer(4)]],
+                                constant float& strength                        [[buffer(5)]],
+                                uint2 index                                     [[thread_position_in_grid]],
+                                uint2 groupPosition                             [[threadgroup_position_in_grid]],
+                                uint2 localIndex                                [[thread_position_in_threadgroup]],
+                                uint2 groupSize                                 [[threads_per_threadgroup]])
+{
+    threadgroup half4 quadTile[kRawDenoiseQuadTile * kRawDenoiseQuadTile];
+    threadgroup SortedColumn<half4> columnTile[kRawDenoiseQuadTile * kRawDenoiseDespeckleTile];
+    threadgroup half4 despeckleTile[kRawDenoiseDespeckleTile * kRawDenoiseDespeckleTile];
+
+    const int2 quadDimensions = get_image_dim(rawImage) / 2;
+    const int2 tileOrigin = kRawDenoiseTile * (int2) groupPosition;
+    // Edge threadgroups can be partial
+    const int threadCount = groupSize.x * groupSize.y;
+    const int threadIndex = localIndex.y * groupSize.x + localIndex.x;
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const half4 variance = half4(rawVariance);
+
+    // Bayer quads of the tile and its halo
+    for (int i = threadIndex; i < kRawDenoiseQuadTile * kRawDenoiseQuadTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kRawDenoiseQuadTile, i / kRawDenoiseQuadTile);
+        const int2 quadCoordinates = clamp(tileOrigin + tileCoordinates - kRawDenoiseQuadHalo, int2(0), quadDimensions - 1);
+        quadTile[i] = half4(readRAWQuad(rawImage, 2 * quadCoordinates, offsets));
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Sorted columns of the despeckle rows, shared by the three despeckle neighbourhoods reading them
+    const TileView<half4> quads = { quadTile, tileOrigin - kRawDenoiseQuadHalo, kRawDenoiseQuadTile };
+    const int2 columnsOrigin = tileOrigin - int2(kRawDenoiseQuadHalo, kRawDenoiseHalo);
+    for (int i = threadIndex; i < kRawDenoiseQuadTile * kRawDenoiseDespeckleTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kRawDenoiseQuadTile, i / kRawDenoiseQuadTile);
+        columnTile[i] = sortedQuadColumn(quads, columnsOrigin + tileCoordinates);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Despeckle of the tile and of the cross denoise halo, outside the image it replicates the edge value
+    const TileView<SortedColumn<half4>> columns = { columnTile, columnsOrigin, kRawDenoiseQuadTile };
+    const auto gradients = gradientView(gradientImage, get_image_dim(rawImage));
+    for (int i = threadIndex; i < kRawDenoiseDespeckleTile * kRawDenoiseDespeckleTile; i += threadCount) {
+        const int2 tileCoordinates = int2(i % kRawDenoiseDespeckleTile, i / kRawDenoiseDespeckleTile);
+        const int2 quadCoordinates = clamp(tileOrigin + tileCoordinates - kRawDenoiseHalo, int2(0), quadDimensions - 1);
+
+        const half gradient = length(gradients.read(2 * quadCoordinates).xy);
+        despeckleTile[i] = despeckle_3x3x4(quads.read(quadCoordinates),
+                                           columns.read(quadCoordinates + int2(-1, 0)),
+                                           columns.read(quadCoordinates),
+                                           columns.read(quadCoordinates + int2(1, 0)),
+                                           variance, gradient);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const int2 quadCoordinates = (int2) index;
+    const int2 localCoordinates = (int2) localIndex + kRawDenoiseHalo;
+
+    half4 inputPixel = despeckleTile[localCoordinates.y * kRawDenoiseDespeckleTile + localCoordinates.x];
+    half4 inv_sigma = 1 / ((half) strength * sqrt(variance * (inputPixel + 0.0001)));
+
+    float4 sum = 0;
+    float4 sumW = 0;
+    for (int y = -2; y <= 2; y++) {
+        for (int x = -2; x <= 2; x++) {
+            half4 samplePixel = despeckleTile[(localCoordinates.y + y) * kRawDenoiseDespeckleTile + localCoordinates.x + x];
+
+            half4 w = gaussian(length((inputPixel - samplePixel) * inv_sigma));
+
+            sum += float4(w * samplePixel);
+            sumW += float4(w);
+        }
+    }
+    const float4 denoisedPixel = sum / sumW;
+
+    write_imagef(denoisedImage, 2 * quadCoordinates + offsets[raw_red], denoisedPixel.x);
+    write_imagef(denoisedImage, 2 * quadCoordinates + offsets[raw_green], denoisedPixel.y);
+    write_imagef(denoisedImage, 2 * quadCoordinates + offsets[raw_blue], denoisedPixel.z);
+    write_imagef(denoisedImage, 2 * quadCoordinates + offsets[raw_green2], denoisedPixel.w);
+}
+
 kernel void basicRawNoiseStatistics(texture2d<float> rawImage                   [[texture(0)]],
                                     constant int& bayerPattern                  [[buffer(1)]],
                                     texture2d<float, access::write> meanImage   [[texture(2)]],
@@ -1114,7 +3094,7 @@ kernel void basicRawNoiseStatistics(texture2d<float> rawImage
                                     uint2 index                                 [[thread_position_in_grid]]) {
     const int2 imageCoordinates = (int2) index;
 
-    constant const int2* offsets = bayerOffsets[bayerPattern];
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
 
     int radius = 4;
     const float count = (2 * radius + 1) * (2 * radius + 1);
@@ -1158,201 +3138,503 @@ kernel void basicNoiseStatistics(texture2d<float> inputImage
     write_imagef(statisticsImage, imageCoordinates, float4(mean.x, var));
 }
 
-/// ---- Median Filter 3x3 ----
+// GPU reduction of the noise statistics measured by basicRawNoiseStatistics and basicNoiseStatistics, the
+// linear noise model regressions of MeasureRawNLF and MeasureYCbCrNLF only read back the reduced sums.
+// noiseStatisticsPartialSums reduces each threadgroup to kNoiseStatisticsEntries sums, according to the stage:
+//  - histogram: entries 0-5 count the pixels by decade of their largest variance, 1e-6 ... 1e-1
+//  - regression: entries 0-15 are s_x, s_y, s_xx and s_xy of the pixels in range, entry 20 their number
+//  - error: entries 16-19 are the squared residuals of the model nlfA + nlfB * m, entry 20 the pixels
+//  - refit: as regression, restricted to the pixels with squared residuals below errorThreshold, which
+//    also adds their squared residuals in entries 16-19
+// noiseStatisticsSum reduces the partial sums of all the threadgroups with a pairwise sum.
+// With packedStatistics both textures are the basicNoiseStatistics output: the mean in x, the variances in yzw.
+
+constant constexpr int kNoiseStatisticsGroupSize = 16 * 16;
+constant constexpr int kNoiseStatisticsEntries = 21;
+constant constexpr int kNoiseStatisticsSumGroupSize = 256;
+
+enum NoiseStatisticsStage {
+    kNoiseStatisticsHistogram = 0,
+    kNoiseStatisticsRegression = 1,
+    kNoiseStatisticsError = 2,
+    kNoiseStatisticsRefit = 3
+};
 
-#define s(a, b)                         \
-  ({ typedef __typeof__ (a) type_of_a;  \
-     type_of_a temp = a;                \
-     a = min(a, b);                     \
-     b = max(temp, b); })
-
-#define minMax6(a0,a1,a2,a3,a4,a5) s(a0,a1);s(a2,a3);s(a4,a5);s(a0,a2);s(a1,a3);s(a0,a4);s(a3,a5);
-#define minMax5(a0,a1,a2,a3,a4) s(a0,a1);s(a2,a3);s(a0,a2);s(a1,a3);s(a0,a4);s(a3,a4);
-#define minMax4(a0,a1,a2,a3) s(a0,a1);s(a2,a3);s(a0,a2);s(a1,a3);
-#define minMax3(a0,a1,a2) s(a0,a1);s(a0,a2);s(a1,a2);
-
-#define fast_median3x3(inputImage, imageCoordinates)               \
-({                                                                 \
-    medianPixelType a0, a1, a2, a3, a4, a5;                        \
-                                                                   \
-    a0 = readImage(inputImage, imageCoordinates + int2(0, -1));    \
-    a1 = readImage(inputImage, imageCoordinates + int2(1, -1));    \
-    a2 = readImage(inputImage, imageCoordinates + int2(0, 0));     \
-    a3 = readImage(inputImage, imageCoordinates + int2(1, 0));     \
-    a4 = readImage(inputImage, imageCoordinates + int2(0, 1));     \
-    a5 = readImage(inputImage, imageCoordinates + int2(1, 1));     \
-    minMax6(a0, a1, a2, a3, a4, a5);                               \
-    a0 = readImage(inputImage, imageCoordinates + int2(-1, 1));    \
-    minMax5(a0, a1, a2, a3, a4);                                   \
-    a0 = readImage(inputImage, imageCoordinates + int2(-1, 0));    \
-    minMax4(a0, a1, a2, a3);                                       \
-    a0 = readImage(inputImage, imageCoordinates + int2(-1, -1));   \
-    minMax3(a0, a1, a2);                                           \
-    a1;                                                            \
-})
-
-#define readImage(image, pos)  read_imageh(image, pos).xy;
+typedef struct NoiseStatisticsParameters {
+    float4 varianceMax;
+    float4 nlfA;
+    float4 nlfB;
+    float4 errorThreshold;
+    float minValue;
+    float maxValue;
+    int stage;
+    int packedStatistics;
+} NoiseStatisticsParameters;
+
+kernel void noiseStatisticsPartialSums(texture2d<float> meanImage                          [[texture(0)]],
+                                       texture2d<float> varImage                           [[texture(1)]],
+                                       constant NoiseStatisticsParameters& parameters      [[buffer(2)]],
+                                       device float* partialSums                           [[buffer(3)]],
+                                       uint2 index                                         [[thread_position_in_grid]],
+                                       uint2 groupPosition                                 [[threadgroup_position_in_grid]],
+                                       uint2 groupCount                                    [[threadgroups_per_grid]],
+                                       uint2 localIndex                                    [[thread_position_in_threadgroup]],
+                                       uint2 groupSize                                     [[threads_per_threadgroup]]) {
+    threadgroup float values[kNoiseStatisticsGroupSize][kNoiseStatisticsEntries];
+
+    // Edge threadgroups can be partial
+    const int samples = groupSize.x * groupSize.y;
+    const int sample = localIndex.y * groupSize.x + localIndex.x;
+
+    float4 m, v;
+    if (parameters.packedStatistics) {
+        const float4 statistics = read_imagef(meanImage, (int2) index);
+        m = statistics.x;
+        v = float4(statistics.yzw, statistics.y);
+    } else {
+        m = read_imagef(meanImage, (int2) index);
+        v = read_imagef(varImage, (int2) index);
+    }
+    const bool validStats = !(any(isnan(m)) || any(isnan(v)));
 
-kernel void medianFilterImage3x3x2(texture2d<half> inputImage                   [[texture(0)]],
-                                   texture2d<half, access::write> denoisedImage [[texture(1)]],
-                                   uint2 index                                  [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+    threadgroup float* value = values[sample];
+    for (int e = 0; e < kNoiseStatisticsEntries; e++) {
+        value[e] = 0;
+    }
 
-    typedef half2 medianPixelType;
+    if (parameters.stage == kNoiseStatisticsHistogram) {
+        if (validStats && (!parameters.packedStatistics || all(v > 0))) {
+            const float4 scale = log10(v);
+            const int entry = 6 + (int) clamp(max(max(scale.x, scale.y), max(scale.z, scale.w)), -6.0f, -1.0f);
+            value[entry] = 1;
+        }
+    } else if (validStats && all(m >= parameters.minValue) && all(m <= parameters.maxValue) && all(v <= parameters.varianceMax)) {
+        const float4 diff = parameters.nlfA + parameters.nlfB * m - v;
+        const float4 diffSquare = diff * diff;
 
-    half2 median = fast_median3x3(inputImage, imageCoordinates);
+        if (parameters.stage == kNoiseStatisticsError) {
+            for (int c = 0; c < 4; c++) {
+                value[16 + c] = diffSquare[c];
+            }
+            value[20] = 1;
+        } else if (parameters.stage == kNoiseStatisticsRegression ||
+                   all(diffSquare <= parameters.errorThreshold)) {
+            for (int c = 0; c < 4; c++) {
+                value[c] = m[c];
+                value[4 + c] = v[c];
+                value[8 + c] = m[c] * m[c];
+                value[12 + c] = m[c] * v[c];
+                value[16 + c] = parameters.stage == kNoiseStatisticsRefit ? diffSquare[c] : 0;
+            }
+            value[20] = 1;
+        }
+    }
 
-    write_imageh(denoisedImage, imageCoordinates, half4(median, 0, 0));
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    device float* groupSums = partialSums + (groupPosition.y * groupCount.x + groupPosition.x) * kNoiseStatisticsEntries;
+    for (int e = sample; e < kNoiseStatisticsEntries; e += samples) {
+        float sum = 0;
+        for (int n = 0; n < samples; n++) {
+            sum += values[n][e];
+        }
+        groupSums[e] = sum;
+    }
 }
 
-#undef readImage
+// Single threadgroup of kNoiseStatisticsSumGroupSize threads
+kernel void noiseStatisticsSum(device const float* partialSums     [[buffer(0)]],
+                               constant int& groups                [[buffer(1)]],
+                               device float* sums                  [[buffer(2)]],
+                               uint localIndex                     [[thread_position_in_threadgroup]]) {
+    threadgroup float threadSums[kNoiseStatisticsSumGroupSize];
+
+    for (int e = 0; e < kNoiseStatisticsEntries; e++) {
+        float sum = 0;
+        for (int g = localIndex; g < groups; g += kNoiseStatisticsSumGroupSize) {
+            sum += partialSums[g * kNoiseStatisticsEntries + e];
+        }
+        threadSums[localIndex] = sum;
 
-#define readImage(image, pos)  read_imageh(image, pos).xyz;
+        threadgroup_barrier(mem_flags::mem_threadgroup);
 
-kernel void medianFilterImage3x3x3(texture2d<half> inputImage                   [[texture(0)]],
-                                   texture2d<half, access::write> filteredImage [[texture(1)]],
-                                   uint2 index                                  [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+        for (int stride = kNoiseStatisticsSumGroupSize / 2; stride > 0; stride /= 2) {
+            if (localIndex < (uint) stride) {
+                threadSums[localIndex] += threadSums[localIndex + stride];
+            }
+            threadgroup_barrier(mem_flags::mem_threadgroup);
+        }
+
+        if (localIndex == 0) {
+            sums[e] = threadSums[0];
+        }
+
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+}
+
+/// ---- Image Quality ----
+
+// PSNR and SSIM of an image against a reference of the same size, to score the runs of a parameter sweep. Each
+// thread scores a kImageQualityBlock square block: the squared error of the clamped RGB values, and the SSIM of the
+// block's luma. The SSIM windows are the non-overlapping blocks rather than a sliding window, every pixel is read
+// once. imageQualityPartialSums reduces each threadgroup to kImageQualityEntries sums: the squared error, the
+// number of samples, the SSIM sum and the number of blocks. imageQualitySum reduces the partial sums into a slot of
+// the scores buffer, the scores of a batch of images accumulate in stream and are read back once.
+
+constant constexpr int kImageQualityBlock = 8;
+constant constexpr int kImageQualityGroupSize = 16 * 16;
+constant constexpr int kImageQualityEntries = 4;
+constant constexpr int kImageQualitySumGroupSize = 256;
+
+kernel void imageQualityPartialSums(texture2d<float> image                 [[texture(0)]],
+                                    texture2d<float> reference             [[texture(1)]],
+                                    device float* partialSums              [[buffer(2)]],
+                                    uint2 index                            [[thread_position_in_grid]],
+                                    uint2 groupPosition                    [[threadgroup_position_in_grid]],
+                                    uint2 groupCount                       [[threadgroups_per_grid]],
+                                    uint2 localIndex                       [[thread_position_in_threadgroup]],
+                                    uint2 groupSize                        [[threads_per_threadgroup]]) {
+    threadgroup float values[kImageQualityGroupSize][kImageQualityEntries];
+
+    // Edge threadgroups can be partial
+    const int samples = groupSize.x * groupSize.y;
+    const int sample = localIndex.y * groupSize.x + localIndex.x;
+
+    const int2 imageSize = int2(image.get_width(), image.get_height());
+    const int2 blockOrigin = (int2) index * kImageQualityBlock;
+    const int2 blockEnd = min(blockOrigin + kImageQualityBlock, imageSize);
+
+    constexpr float3 lumaWeights = float3(0.2126, 0.7152, 0.0722);
+
+    float squaredError = 0;
+    float sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+    for (int y = blockOrigin.y; y < blockEnd.y; y++) {
+        for (int x = blockOrigin.x; x < blockEnd.x; x++) {
+            const float3 p = saturate(read_imagef(image, int2(x, y)).xyz);
+            const float3 r = saturate(read_imagef(reference, int2(x, y)).xyz);
+            const float3 diff = p - r;
+            squaredError += dot(diff, diff);
+
+            const float lp = dot(p, lumaWeights);
+            const float lr = dot(r, lumaWeights);
+            sx += lp;
+            sy += lr;
+            sxx += lp * lp;
+            syy += lr * lr;
+            sxy += lp * lr;
+        }
+    }
+
+    threadgroup float* value = values[sample];
+    const int2 blockSize = max(blockEnd - blockOrigin, 0);
+    const float pixels = blockSize.x * blockSize.y;
+    if (pixels > 0) {
+        // SSIM constants for a dynamic range of 1
+        constexpr float c1 = 0.01 * 0.01;
+        constexpr float c2 = 0.03 * 0.03;
+
+        const float mx = sx / pixels;
+        const float my = sy / pixels;
+        const float vx = max(sxx / pixels - mx * mx, 0.0f);
+        const float vy = max(syy / pixels - my * my, 0.0f);
+        const float cxy = sxy / pixels - mx * my;
+
+        value[0] = squaredError;
+        value[1] = 3 * pixels;
+        value[2] = ((2 * mx * my + c1) * (2 * cxy + c2)) / ((mx * mx + my * my + c1) * (vx + vy + c2));
+        value[3] = 1;
+    } else {
+        for (int e = 0; e < kImageQualityEntries; e++) {
+            value[e] = 0;
+        }
+    }
+
+    threadgroup_barrier(mem_flags::mem_threadgroup);
 
-    typedef half3 medianPixelType;
+    device float* groupSums = partialSums + (groupPosition.y * groupCount.x + groupPosition.x) * kImageQualityEntries;
+    for (int e = sample; e < kImageQualityEntries; e += samples) {
+        float sum = 0;
+        for (int n = 0; n < samples; n++) {
+            sum += values[n][e];
+        }
+        groupSums[e] = sum;
+    }
+}
+
+// Single threadgroup of kImageQualitySumGroupSize threads
+kernel void imageQualitySum(device const float* partialSums     [[buffer(0)]],
+                            constant int& groups                [[buffer(1)]],
+                            constant int& slot                  [[buffer(2)]],
+                            device float* scores                [[buffer(3)]],
+                            uint localIndex                     [[thread_position_in_threadgroup]]) {
+    threadgroup float threadSums[kImageQualitySumGroupSize];
+
+    for (int e = 0; e < kImageQualityEntries; e++) {
+        float sum = 0;
+        for (int g = localIndex; g < groups; g += kImageQualitySumGroupSize) {
+            sum += partialSums[g * kImageQualityEntries + e];
+        }
+        threadSums[localIndex] = sum;
+
+        threadgroup_barrier(mem_flags::mem_threadgroup);
 
-    half3 median = fast_median3x3(inputImage, imageCoordinates);
+        for (int stride = kImageQualitySumGroupSize / 2; stride > 0; stride /= 2) {
+            if (localIndex < (uint) stride) {
+                threadSums[localIndex] += threadSums[localIndex + stride];
+            }
+            threadgroup_barrier(mem_flags::mem_threadgroup);
+        }
 
-    write_imageh(filteredImage, imageCoordinates, half4(median, 0));
+        if (localIndex == 0) {
+            scores[slot * kImageQualityEntries + e] = threadSums[0];
+        }
+
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
 }
 
-#undef readImage
+/// ---- Median Filter 3x3 ----
 
-#define readImage(image, pos)  read_imageh(image, pos);
+// The median filters work on tiles of kRankFilterTile square threadgroups, see SortedColumn. The edge threadgroups
+// can be partial.
 
-kernel void medianFilterImage3x3x4(texture2d<half> inputImage                   [[texture(0)]],
+#define kRankFilterTile         16
+#define kRankFilterPixelTile    (kRankFilterTile + 2)
+
+template <typename T>
+T readChannels(texture2d<half> image, int2 imageCoordinates);
+
+template <>
+half2 readChannels<half2>(texture2d<half> image, int2 imageCoordinates) {
+    return read_imageh(image, imageCoordinates).xy;
+}
+
+template <>
+half3 readChannels<half3>(texture2d<half> image, int2 imageCoordinates) {
+    return read_imageh(image, imageCoordinates).xyz;
+}
+
+template <>
+half4 readChannels<half4>(texture2d<half> image, int2 imageCoordinates) {
+    return read_imageh(image, imageCoordinates);
+}
+
+template <typename T>
+struct RankFilterTile {
+    threadgroup T* pixels;                  // kRankFilterPixelTile x kRankFilterPixelTile
+    threadgroup SortedColumn<T>* columns;   // kRankFilterPixelTile x kRankFilterTile
+
+    // Loads the tile and its one pixel halo, clamped to the image edges, and sorts the columns of the tile rows
+    void load(texture2d<half> image, uint2 groupPosition, uint2 localIndex, uint2 groupSize) {
+        const int2 imageDimensions = get_image_dim(image);
+        const int2 tileOrigin = kRankFilterTile * (int2) groupPosition - 1;
+        const int threadCount = groupSize.x * groupSize.y;
+        const int threadIndex = localIndex.y * groupSize.x + localIndex.x;
+
+        for (int i = threadIndex; i < kRankFilterPixelTile * kRankFilterPixelTile; i += threadCount) {
+            const int2 tileCoordinates = int2(i % kRankFilterPixelTile, i / kRankFilterPixelTile);
+            pixels[i] = readChannels<T>(image, clamp(tileOrigin + tileCoordinates, int2(0), imageDimensions - 1));
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+
+        for (int i = threadIndex; i < kRankFilterPixelTile * kRankFilterTile; i += threadCount) {
+            const int x = i % kRankFilterPixelTile;
+            const int y = i / kRankFilterPixelTile;
+            columns[i] = sortColumn(pixels[y * kRankFilterPixelTile + x],
+                                    pixels[(y + 1) * kRankFilterPixelTile + x],
+                                    pixels[(y + 2) * kRankFilterPixelTile + x]);
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    T sample(uint2 localIndex) const {
+        return pixels[(localIndex.y + 1) * kRankFilterPixelTile + localIndex.x + 1];
+    }
+
+    // The sorted column at x + dx
+    SortedColumn<T> column(uint2 localIndex, int dx) const {
+        return columns[localIndex.y * kRankFilterPixelTile + localIndex.x + 1 + dx];
+    }
+
+    T median(uint2 localIndex) const {
+        return median3x3(column(localIndex, -1), column(localIndex, 0), column(localIndex, 1));
+    }
+};
+
+kernel void medianFilterImage3x3x2(texture2d<half> inputImage                   [[texture(0)]],
+                                   texture2d<half, access::write> denoisedImage [[texture(1)]],
+                                   uint2 index                                  [[thread_position_in_grid]],
+                                   uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                                   uint2 localIndex                             [[thread_position_in_threadgroup]],
+                                   uint2 groupSize                              [[threads_per_threadgroup]]) {
+    threadgroup half2 pixels[kRankFilterPixelTile * kRankFilterPixelTile];
+    threadgroup SortedColumn<half2> columns[kRankFilterPixelTile * kRankFilterTile];
+
+    RankFilterTile<half2> tile = { pixels, columns };
+    tile.load(inputImage, groupPosition, localIndex, groupSize);
+
+    half2 median = tile.median(localIndex);
+
+    write_imageh(denoisedImage, (int2) index, half4(median, 0, 0));
+}
+
+kernel void medianFilterImage3x3x3(texture2d<half> inputImage                   [[texture(0)]],
                                    texture2d<half, access::write> filteredImage [[texture(1)]],
-                                   uint2 index                                  [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+                                   uint2 index                                  [[thread_position_in_grid]],
+                                   uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                                   uint2 localIndex                             [[thread_position_in_threadgroup]],
+                                   uint2 groupSize                              [[threads_per_threadgroup]]) {
+    threadgroup half3 pixels[kRankFilterPixelTile * kRankFilterPixelTile];
+    threadgroup SortedColumn<half3> columns[kRankFilterPixelTile * kRankFilterTile];
 
-    typedef half4 medianPixelType;
+    RankFilterTile<half3> tile = { pixels, columns };
+    tile.load(inputImage, groupPosition, localIndex, groupSize);
 
-    half4 median = fast_median3x3(inputImage, imageCoordinates);
+    half3 median = tile.median(localIndex);
 
-    write_imageh(filteredImage, imageCoordinates, median);
+    write_imageh(filteredImage, (int2) index, half4(median, 0));
 }
 
-#undef readImage
+kernel void medianFilterImage3x3x4(texture2d<half> inputImage                   [[texture(0)]],
+                                   texture2d<half, access::write> filteredImage [[texture(1)]],
+                                   uint2 index                                  [[thread_position_in_grid]],
+                                   uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                                   uint2 localIndex                             [[thread_position_in_threadgroup]],
+                                   uint2 groupSize                              [[threads_per_threadgroup]]) {
+    threadgroup half4 pixels[kRankFilterPixelTile * kRankFilterPixelTile];
+    threadgroup SortedColumn<half4> columns[kRankFilterPixelTile * kRankFilterTile];
+
+    RankFilterTile<half4> tile = { pixels, columns };
+    tile.load(inputImage, groupPosition, localIndex, groupSize);
+
+    half4 median = tile.median(localIndex);
 
-#define readImage(image, pos)                              \
-    ({                                                     \
-        half3 p = read_imageh(image, pos).xyz;             \
-                                                           \
-        half v = p.x;                                      \
-        secMax = v <= firstMax && v > secMax ? v : secMax; \
-        secMax = v > firstMax ? firstMax : secMax;         \
-        firstMax = v > firstMax ? v : firstMax;            \
-                                                           \
-        secMin = v >= firstMin && v < secMin ? v : secMin; \
-        secMin = v < firstMin ? firstMin : secMin;         \
-        firstMin = v < firstMin ? v : firstMin;            \
-                                                           \
-        if (all(pos == imageCoordinates)) {                \
-            sample = v;                                    \
-        }                                                  \
-                                                           \
-        p.yz;                                              \
-    })
+    write_imageh(filteredImage, (int2) index, median);
+}
 
+// Luma despeckle, with the two smallest and largest values of the 3x3 luma neighbourhood, and chroma median
 kernel void despeckleLumaMedianChromaImage(texture2d<half> inputImage                   [[texture(0)]],
                                            constant float3& var_a                       [[buffer(1)]],
                                            constant float3& var_b                       [[buffer(2)]],
                                            texture2d<half, access::write> denoisedImage [[texture(3)]],
-                                           uint2 index                                  [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+                                           uint2 index                                  [[thread_position_in_grid]],
+                                           uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                                           uint2 localIndex                             [[thread_position_in_threadgroup]],
+                                           uint2 groupSize                              [[threads_per_threadgroup]]) {
+    threadgroup half3 pixels[kRankFilterPixelTile * kRankFilterPixelTile];
+    threadgroup SortedColumn<half3> columns[kRankFilterPixelTile * kRankFilterTile];
 
-    half sample = 0, firstMax = 0, secMax = 0;
-    half firstMin = (float) 0xffff, secMin = (float) 0xffff;
+    RankFilterTile<half3> tile = { pixels, columns };
+    tile.load(inputImage, groupPosition, localIndex, groupSize);
 
-    // Median filtering of the chroma
-    typedef half2 medianPixelType;
-    half2 median = fast_median3x3(inputImage, imageCoordinates);
+    const SortedColumn<half3> left = tile.column(localIndex, -1);
+    const SortedColumn<half3> center = tile.column(localIndex, 0);
+    const SortedColumn<half3> right = tile.column(localIndex, 1);
 
+    // Median filtering of the chroma
+    half2 median = median3x3(left, center, right).yz;
+
+    // The sort is per channel, the luma components are the sorted luma columns
+    const SortedColumn<half> lumaLeft = { left.lo.x, left.mid.x, left.hi.x };
+    const SortedColumn<half> lumaCenter = { center.lo.x, center.mid.x, center.hi.x };
+    const SortedColumn<half> lumaRight = { right.lo.x, right.mid.x, right.hi.x };
+    const SortedColumn<half> lowest = lowest3(lowest3(lumaLeft, lumaCenter), lumaRight);
+    const SortedColumn<half> highest = highest3(highest3(lumaLeft, lumaCenter), lumaRight);
+    half firstMin = lowest.lo, secMin = lowest.mid;
+    half firstMax = highest.hi, secMax = highest.mid;
+
+    half sample = tile.sample(localIndex).x;
     half sigma = sqrt(var_a.x + var_b.x * sample);
     half minVal = mix(secMin, firstMin, smoothstep(sigma, 4 * sigma, secMin - firstMin));
     half maxVal = mix(secMax, firstMax, smoothstep(sigma, 4 * sigma, firstMax - secMax));
 
     sample = clamp(sample, minVal, maxVal);
 
-    write_imageh(denoisedImage, imageCoordinates, half4(sample, median, 0));
+    write_imageh(denoisedImage, (int2) index, half4(sample, median, 0));
 }
 
-#undef readImage
-
-#undef minMax6
-#undef minMax5
-#undef minMax4
-#undef minMax3
-#undef s
-
 // Local Tone Mapping - guideImage can be a downsampled version of inputImage
+//
+// The guided filter's box means are separable running sums: each thread filters a segment of
+// kBoxFilterSegment pixels of a row or a column, sliding the window sum by one pixel at a time,
+// so that the cost per pixel doesn't depend on the filter radius. The sums are only over the
+// window, with none of the precision loss of a whole image integral.
 
-kernel void GuidedFilterABImage(texture2d<float> guideImage                 [[texture(0)]],
-                                texture2d<float, access::write> abImage     [[texture(1)]],
-                                constant float& eps                         [[buffer(2)]],
-                                uint2 index                                 [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
-    const float2 inputNorm = 1.0 / float2(get_image_dim(guideImage));
-    const float2 pos = float2(imageCoordinates) * inputNorm;
+constant constexpr int kBoxFilterSegment = 32;
 
-    constexpr sampler linear_sampler(filter::linear);
+float2 boxFilterSample(texture2d<float> inputImage, int2 coordinates, bool moments) {
+    const float2 value = read_imagef(inputImage, coordinates).xy;
+    return moments ? float2(value.x, value.x * value.x) : value;
+}
 
-    float sum = 0;
-    float sumSq = 0;
-    for (int y = -2; y <= 2; y++) {
-        for (int x = -2; x <= 2; x++) {
-            float sample = read_imagef(guideImage, linear_sampler, pos + (float2(x, y) + 0.5f) * inputNorm).x;
-            sum += sample;
-            sumSq += sample * sample;
-        }
+// Box filter of a segment along direction, with clamped edges. With moments the input is the guide
+// image and the means are of its values and of their squares, with guidedAB the input holds such
+// means and the output are the guided filter's a and b coefficients.
+void boxFilterSegment(texture2d<float> inputImage, texture2d<float, access::write> outputImage,
+                      int2 start, int2 direction, int radius, bool moments, bool guidedAB, float eps) {
+    const int2 lastPixel = get_image_dim(inputImage) - 1;
+    if (any(start > lastPixel)) {
+        return;
     }
-    float mean = sum / 25;
-    float var = (sumSq - sum * sum / 25) / 25;
 
-    float a = var / (var + eps);
-    float b = mean * (1 - a);
-
-    write_imagef(abImage, imageCoordinates, float4(a, b, 0, 0));
-}
+    float2 sum = 0;
+    for (int i = -radius; i <= radius; i++) {
+        sum += boxFilterSample(inputImage, clamp(start + i * direction, 0, lastPixel), moments);
+    }
+    const float norm = 1.0 / (2 * radius + 1);
 
-// Fast 5x5 box filtering with linear subsampling
-typedef struct ConvolutionParameters {
-    float weight;
-    float2 offset;
-} ConvolutionParameters;
+    for (int i = 0; i < kBoxFilterSegment; i++) {
+        const int2 p = start + i * direction;
+        if (any(p > lastPixel)) {
+            break;
+        }
 
-constant ConvolutionParameters boxFilter5x5[9] = {
-    { 0.1600, { -1.5000, -1.5000 } },
-    { 0.1600, {  0.5000, -1.5000 } },
-    { 0.0800, {  2.0000, -1.5000 } },
-    { 0.1600, { -1.5000,  0.5000 } },
-    { 0.1600, {  0.5000,  0.5000 } },
-    { 0.0800, {  2.0000,  0.5000 } },
-    { 0.0800, { -1.5000,  2.0000 } },
-    { 0.0800, {  0.5000,  2.0000 } },
-    { 0.0400, {  2.0000,  2.0000 } },
-};
+        float2 result = sum * norm;
+        if (guidedAB) {
+            const float mean = result.x;
+            const float var = max(result.y - mean * mean, 0.0);
 
-kernel void BoxFilterGFImage(texture2d<float> inputImage                    [[texture(0)]],
-                             texture2d<float, access::write> outputImage    [[texture(1)]],
-                             uint2 index                                    [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
-    const float2 inputNorm = 1.0 / float2(get_image_dim(inputImage));
-    const float2 pos = float2(imageCoordinates) * inputNorm;
+            const float a = var / (var + eps);
+            const float b = mean * (1 - a);
+            result = float2(a, b);
+        }
+        write_imagef(outputImage, p, float4(result, 0, 0));
 
-    constexpr sampler linear_sampler(filter::linear);
-    float2 meanAB = 0;
-    for (int i = 0; i < 9; i++) {
-        constant ConvolutionParameters* cp = &boxFilter5x5[i];
-        meanAB += cp->weight * read_imagef(inputImage, linear_sampler, pos + (cp->offset + 0.5f) * inputNorm).xy;
+        sum += boxFilterSample(inputImage, clamp(p + (radius + 1) * direction, 0, lastPixel), moments) -
+               boxFilterSample(inputImage, clamp(p - radius * direction, 0, lastPixel), moments);
     }
+}
+
+kernel void boxFilterRows(texture2d<float> inputImage                    [[texture(0)]],
+                          texture2d<float, access::write> outputImage    [[texture(1)]],
+                          constant int& radius                           [[buffer(2)]],
+                          constant int& moments                          [[buffer(3)]],
+                          uint2 index                                    [[thread_position_in_grid]]) {
+    boxFilterSegment(inputImage, outputImage, int2(index.x * kBoxFilterSegment, index.y), int2(1, 0),
+                     radius, moments, /*guidedAB=*/ false, /*eps=*/ 0);
+}
+
+kernel void boxFilterColumns(texture2d<float> inputImage                 [[texture(0)]],
+                             texture2d<float, access::write> outputImage [[texture(1)]],
+                             constant int& radius                        [[buffer(2)]],
+                             constant int& guidedAB                      [[buffer(3)]],
+                             constant float& eps                         [[buffer(4)]],
+                             uint2 index                                 [[thread_position_in_grid]]) {
+    boxFilterSegment(inputImage, outputImage, int2(index.x, index.y * kBoxFilterSegment), int2(0, 1),
+                     radius, /*moments=*/ false, guidedAB, eps);
+}
 
-    write_imagef(outputImage, imageCoordinates, float4(meanAB, 0, 0));
+// Exponential moving average of the guided filter's mean coefficients across frames
+kernel void temporalBlendImage(texture2d<float> inputImage                 [[texture(0)]],
+                               texture2d<float> historyImage               [[texture(1)]],
+                               texture2d<float, access::write> outputImage [[texture(2)]],
+                               constant float& weight                      [[buffer(3)]],
+                               uint2 index                                 [[thread_position_in_grid]]) {
+    const int2 imageCoordinates = (int2) index;
+    const float2 input = read_imagef(inputImage, imageCoordinates).xy;
+    const float2 history = read_imagef(historyImage, imageCoordinates).xy;
+    write_imagef(outputImage, imageCoordinates, float4(mix(history, input, weight), 0, 0));
 }
 
 constant int histogramSize = 256;
@@ -1366,64 +3648,117 @@ struct histogram_data {
     float highlights;
     float mean;
     float median;
+    // Threadgroups of histogramImage done merging their histogram
+    atomic<uint32_t> groups_done;
 };
 
 constant constexpr float kHistogramScale = 2;
 
+// The histogram is privatized in threadgroup memory and merged once per threadgroup: the midtone
+// bins of a typical image would otherwise see heavy contention on the device atomics. Each of the
+// kHistogramGroupSize x kHistogramGroupSize threads accumulates kHistogramPixelsPerThread pixels
+// of a row of the threadgroup's tile, see histogramImageKernel.
+//
+// The last threadgroup to merge its histogram computes the statistics, with one thread per bin.
+// The SIMD groups of Apple GPUs are 32 wide: each SIMD group covers one of the 8 bands, and the
+// cumulative distribution is the SIMD prefix sum plus the totals of the preceding SIMD groups.
+constant constexpr int kHistogramGroupSize = 16;
+constant constexpr int kHistogramPixelsPerThread = 4;
+constant constexpr int kHistogramSimdGroups = histogramSize / 32;
+
 kernel void histogramImage(texture2d<float> inputImage              [[texture(0)]],
                            device histogram_data& histogram_data    [[buffer(1)]],
-                           uint2 index                              [[thread_position_in_grid]]) {
-    const int2 imageCoordinates = (int2) index;
+                           uint2 groupPosition                      [[threadgroup_position_in_grid]],
+                           uint2 groupCount                         [[threadgroups_per_grid]],
+                           uint2 localPosition                      [[thread_position_in_threadgroup]],
+                           uint localIndex                          [[thread_index_in_threadgroup]],
+                           uint simdLane                            [[thread_index_in_simdgroup]],
+                           uint simdGroup                           [[simdgroup_index_in_threadgroup]]) {
+    threadgroup atomic_uint localHistogram[histogramSize];
+    threadgroup uint32_t simdTotals[kHistogramSimdGroups];
+    threadgroup float simdMeans[kHistogramSimdGroups];
+    threadgroup int median_index, black_index, white_index;
+    threadgroup bool lastGroup;
+
+    // One bin per thread
+    atomic_store_explicit(&localHistogram[localIndex], 0, memory_order_relaxed);
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const int2 imageDimensions = get_image_dim(inputImage);
+    const int2 tileOrigin = int2(groupPosition) * int2(kHistogramGroupSize * kHistogramPixelsPerThread, kHistogramGroupSize);
+
+    for (int i = 0; i < kHistogramPixelsPerThread; i++) {
+        const int2 imageCoordinates = tileOrigin + int2(localPosition.x + i * kHistogramGroupSize, localPosition.y);
+        if (all(imageCoordinates < imageDimensions)) {
+            float3 pixelValue = read_imagef(inputImage, imageCoordinates).xyz;
+
+            int histogram_index = clamp((int) ((histogramSize - 1) * sqrt(pixelValue.x / kHistogramScale)), 0, (histogramSize - 1));
+
+            atomic_fetch_add_explicit(&localHistogram[histogram_index], 1, memory_order_relaxed);
+        }
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    const uint32_t count = atomic_load_explicit(&localHistogram[localIndex], memory_order_relaxed);
+    if (count > 0) {
+        atomic_fetch_add_explicit(&histogram_data.histogram[localIndex], count, memory_order_relaxed);
+    }
 
-    float3 pixelValue = read_imagef(inputImage, imageCoordinates).xyz;
+    // Make the merge visible before counting this threadgroup as done
+    threadgroup_barrier(mem_flags::mem_device);
+    if (localIndex == 0) {
+        const uint32_t groups = groupCount.x * groupCount.y;
+        lastGroup = atomic_fetch_add_explicit(&histogram_data.groups_done, 1, memory_order_relaxed) == groups - 1;
+        median_index = 0;
+        black_index = 0;
+        white_index = 0;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (!lastGroup) {
+        return;
+    }
 
-    int histogram_index = clamp((int) ((histogramSize - 1) * sqrt(pixelValue.x / kHistogramScale)), 0, (histogramSize - 1));
+    // --- Histogram Statistics ---
 
-    atomic_fetch_add_explicit(&histogram_data.histogram[histogram_index], 1, memory_order_relaxed);
-}
+    const uint32_t image_size = imageDimensions.x * imageDimensions.y;
+    const int bin = localIndex;
 
-kernel void histogramStatistics(device histogram_data& histogram_data [[buffer(0)]],
-                                constant uint2& image_dimensions      [[buffer(1)]],
-                                uint2 index                           [[thread_position_in_grid]]) {
-    if (index.x == 0 && index.y == 0) {
-        device array<uint32_t, histogramSize>* plain_histogram = (device array<uint32_t, histogramSize>*) &histogram_data.histogram;
+    const uint32_t entry = atomic_load_explicit(&histogram_data.histogram[bin], memory_order_relaxed);
+    const uint32_t prefix = simd_prefix_inclusive_sum(entry);
+    const float binMean = simd_sum(entry * (bin + 1) / (float) histogramSize);
+    if (simdLane == 31) {
+        simdTotals[simdGroup] = prefix;
+        simdMeans[simdGroup] = binMean;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
 
-        const uint32_t image_size = image_dimensions.x * image_dimensions.y;
+    uint32_t sum = prefix;
+    for (uint g = 0; g < simdGroup; g++) {
+        sum += simdTotals[g];
+    }
+    const uint32_t previous = sum - entry;
 
-        const int band_width = histogram_data.histogram.size() / histogram_data.bands.size();
+    // The first bins where the cumulative function crosses the thresholds, empty bins never do
+    const uint32_t median_threshold = (image_size + 1) / 2;
+    if (sum >= median_threshold && previous < median_threshold) {
+        median_index = bin;
+    }
+    if (sum >= 0.001 * image_size && previous < 0.001 * image_size) {
+        black_index = bin;
+    }
+    if (sum >= 0.999 * image_size && previous < 0.999 * image_size) {
+        white_index = bin;
+    }
+    if (simdLane == 0) {
+        histogram_data.bands[simdGroup] = simdTotals[simdGroup];
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup | mem_flags::mem_device);
 
+    if (localIndex == 0) {
+        // Compute average image value
         float mean = 0;
-        bool found_median = false;
-        bool found_black = false;
-        bool found_white = false;
-        int median_index = 0;
-        int black_index = 0;
-        int white_index = 0;
-        uint32_t sum = 0;
-        for (int band = 0; band < 8; band++) {
-            for (int i = 0; i < band_width; i++) {
-                int index = band * band_width + i;
-                const uint32_t entry = (*plain_histogram)[index];
-                histogram_data.bands[band] += entry;
-
-                // Compute average image value
-                mean += entry * (index + 1) / (float) histogramSize;
-
-                // Compute cumulative function statistics
-                sum += entry;
-                if (!found_median && (sum >= (image_size + 1) / 2)) {
-                    median_index = index;
-                    found_median = true;
-                }
-                if (!found_black && sum >= 0.001 * image_size) {
-                    black_index = index;
-                    found_black = true;
-                }
-                if (!found_white && sum >= 0.999 * image_size) {
-                    white_index = index;
-                    found_white = true;
-                }
-            }
+        for (int g = 0; g < kHistogramSimdGroups; g++) {
+            mean += simdMeans[g];
         }
         mean /= image_size;
 
@@ -1454,6 +3789,399 @@ kernel void histogramStatistics(device histogram_data& histogram_data [[buffer(0
     }
 }
 
+// Image statistics in a single read of a subsampled raw image: the luma histogram, per channel
+// clipping counts, gray world accumulators and the moments of the green split (the difference of
+// the two greens of a Bayer quad, whose variance is twice the raw noise variance).
+//
+// The counts are privatized in threadgroup memory as in histogramImage, the float sums of each
+// threadgroup go to partialSums and the last threadgroup reduces them in image_statistics.
+
+constant constexpr int kImageStatisticsGroupSize = 16;
+constant constexpr int kImageStatisticsSums = 6;  // gray world r, g, b, samples, green split sum and sum of squares
+
+struct image_statistics {
+    array<atomic<uint32_t>, histogramSize> histogram;
+    array<atomic<uint32_t>, 4> clipped;
+    // Quads with a channel above half the clipping level
+    atomic<uint32_t> highlights;
+    // Sampled quads
+    atomic<uint32_t> samples;
+    atomic<uint32_t> groups_done;
+    array<float, 3> grayWorld;
+    float grayWorldSamples;
+    float greenSplitMean;
+    float greenSplitVariance;
+};
+
+typedef struct ImageStatisticsParameters {
+    float4 scaleMul;
+    float4 lumaWeights;
+    float blackLevel;
+    float clipLevel;
+    int bayerPattern;
+    int sampleStride;
+} ImageStatisticsParameters;
+
+kernel void imageStatistics(texture2d<float> rawImage                       [[texture(0)]],
+                            constant ImageStatisticsParameters& parameters  [[buffer(1)]],
+                            device image_statistics& statistics             [[buffer(2)]],
+                            device float* partialSums                       [[buffer(3)]],
+                            uint2 index                                     [[thread_position_in_grid]],
+                            uint2 groupPosition                             [[threadgroup_position_in_grid]],
+                            uint2 groupCount                                [[threadgroups_per_grid]],
+                            uint localIndex                                 [[thread_index_in_threadgroup]]) {
+    threadgroup atomic_uint localHistogram[histogramSize];
+    // Per channel clipping, highlights and samples
+    threadgroup atomic_uint localCounts[6];
+    threadgroup float localSums[kImageStatisticsGroupSize * kImageStatisticsGroupSize][kImageStatisticsSums];
+    threadgroup bool lastGroup;
+
+    atomic_store_explicit(&localHistogram[localIndex], 0, memory_order_relaxed);
+    if (localIndex < 6) {
+        atomic_store_explicit(&localCounts[localIndex], 0, memory_order_relaxed);
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Each thread samples one Bayer quad every sampleStride quads
+    const int2 imageDimensions = get_image_dim(rawImage);
+    const int2 quadCoordinates = 2 * parameters.sampleStride * (int2) index;
+
+    float sums[kImageStatisticsSums] = { 0, 0, 0, 0, 0, 0 };
+    if (all(quadCoordinates + 1 < imageDimensions)) {
+        constant const int2* offsets = bayerPatternOffsets(parameters.bayerPattern);
+        float4 raw;
+        for (int c = 0; c < 4; c++) {
+            raw[c] = parameters.scaleMul[c] * (read_imagef(rawImage, quadCoordinates + offsets[c]).x - parameters.blackLevel);
+        }
+        const float3 rgb = float3(raw.x, (raw.y + raw.w) / 2, raw.z);
+
+        bool clipped = false;
+        for (int c = 0; c < 4; c++) {
+            if (raw[c] >= parameters.clipLevel) {
+                atomic_fetch_add_explicit(&localCounts[c], 1, memory_order_relaxed);
+                clipped = true;
+            }
+        }
+        if (any(rgb > 0.5 * parameters.clipLevel)) {
+            atomic_fetch_add_explicit(&localCounts[4], 1, memory_order_relaxed);
+        }
+        atomic_fetch_add_explicit(&localCounts[5], 1, memory_order_relaxed);
+
+        const float luma = dot(parameters.lumaWeights.xyz, min(rgb, parameters.clipLevel));
+        int histogram_index = clamp((int) ((histogramSize - 1) * sqrt(max(luma, 0.0) / kHistogramScale)), 0, (histogramSize - 1));
+        atomic_fetch_add_explicit(&localHistogram[histogram_index], 1, memory_order_relaxed);
+
+        // Clipped quads carry no color information
+        if (!clipped) {
+            sums[0] = rgb.r;
+            sums[1] = rgb.g;
+            sums[2] = rgb.b;
+            sums[3] = 1;
+            const float greenSplit = raw.y - raw.w;
+            sums[4] = greenSplit;
+            sums[5] = greenSplit * greenSplit;
+        }
+    }
+    for (int e = 0; e < kImageStatisticsSums; e++) {
+        localSums[localIndex][e] = sums[e];
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    // Pairwise reduction of the threadgroup's sums
+    for (int stride = kImageStatisticsGroupSize * kImageStatisticsGroupSize / 2; stride > 0; stride /= 2) {
+        if (localIndex < (uint) stride) {
+            for (int e = 0; e < kImageStatisticsSums; e++) {
+                localSums[localIndex][e] += localSums[localIndex + stride][e];
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    const uint32_t group = groupPosition.y * groupCount.x + groupPosition.x;
+    const uint32_t groups = groupCount.x * groupCount.y;
+    if (localIndex < kImageStatisticsSums) {
+        partialSums[group * kImageStatisticsSums + localIndex] = localSums[0][localIndex];
+    }
+    const uint32_t count = atomic_load_explicit(&localHistogram[localIndex], memory_order_relaxed);
+    if (count > 0) {
+        atomic_fetch_add_explicit(&statistics.histogram[localIndex], count, memory_order_relaxed);
+    }
+    if (localIndex < 6) {
+        const uint32_t localCount = atomic_load_explicit(&localCounts[localIndex], memory_order_relaxed);
+        if (localCount > 0) {
+            device atomic_uint* counter = localIndex < 4 ? &statistics.clipped[localIndex] :
+                                          localIndex == 4 ? &statistics.highlights : &statistics.samples;
+            atomic_fetch_add_explicit(counter, localCount, memory_order_relaxed);
+        }
+    }
+
+    threadgroup_barrier(mem_flags::mem_device);
+    if (localIndex == 0) {
+        lastGroup = atomic_fetch_add_explicit(&statistics.groups_done, 1, memory_order_relaxed) == groups - 1;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (!lastGroup) {
+        return;
+    }
+
+    // The last threadgroup reduces the partial sums of all threadgroups
+    for (int e = 0; e < kImageStatisticsSums; e++) {
+        float sum = 0;
+        for (uint32_t g = localIndex; g < groups; g += kImageStatisticsGroupSize * kImageStatisticsGroupSize) {
+            sum += partialSums[g * kImageStatisticsSums + e];
+        }
+        localSums[localIndex][e] = sum;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    for (int stride = kImageStatisticsGroupSize * kImageStatisticsGroupSize / 2; stride > 0; stride /= 2) {
+        if (localIndex < (uint) stride) {
+            for (int e = 0; e < kImageStatisticsSums; e++) {
+                localSums[localIndex][e] += localSums[localIndex + stride][e];
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    if (localIndex == 0) {
+        const float samples = localSums[0][3];
+        statistics.grayWorldSamples = samples;
+        for (int c = 0; c < 3; c++) {
+            statistics.grayWorld[c] = samples > 0 ? localSums[0][c] / samples : 0;
+        }
+        const float mean = samples > 0 ? localSums[0][4] / samples : 0;
+        statistics.greenSplitMean = mean;
+        statistics.greenSplitVariance = samples > 1 ? max(localSums[0][5] / samples - mean * mean, 0.0) : 0;
+    }
+}
+
+// GPU version of autoWhiteBalanceKernel in demosaic_utils.cpp, operating on the raw image's Bayer quads
+// (half resolution RGB) without any intermediate image. The raw image is split in kWhiteBalanceTiles x
+// kWhiteBalanceTiles tiles with their own white point estimate, the gains are averaged on the CPU.
+// Each tile is covered by kWhiteBalanceTileGroups x kWhiteBalanceTileGroups threadgroups, whose threads
+// loop over the tile's quads.
+//
+// whiteBalanceStatistics runs in three stages, each reading the tile statistics of the previous ones:
+//  - mean: sums of the quads' YCbCr values and count of the highlight quads
+//  - deviation: sums of the absolute deviations from the tile's mean YCbCr
+//  - white: luma histogram of the near white quads' unscaled RGB and their maximum luma
+// whiteBalanceGains reduces the white stage with one threadgroup per tile and one thread per histogram bin.
+
+constant constexpr int kWhiteBalanceTiles = 4;
+constant constexpr int kWhiteBalanceTileGroups = 4;
+constant constexpr int kWhiteBalanceGroupSize = 16;
+constant constexpr int kWhiteBalanceHistogramSize = 128;
+// Partial sums per threadgroup: YCbCr and highlights, or the YCbCr deviations
+constant constexpr int kWhiteBalancePartials = 4;
+// Partial sums per threadgroup of the white stage: RGB and count per histogram bin, maximum luma
+constant constexpr int kWhiteBalanceWhitePartials = 4 * kWhiteBalanceHistogramSize + 1;
+// Fixed point scale of the threadgroup RGB sums of the white stage
+constant constexpr float kWhiteBalanceFixedPoint = 4096;
+
+enum WhiteBalanceStage {
+    kWhiteBalanceMean = 0,
+    kWhiteBalanceDeviation = 1,
+    kWhiteBalanceWhite = 2
+};
+
+typedef struct WhiteBalanceParameters {
+    Matrix3x3 rgb_ycbcr;
+    float4 scaleMul;        // Relative to green
+    float white;
+    float black;
+    float highlightsFraction;
+    int bayerPattern;
+    int stage;
+    int2 tileSize;          // Pixels, even
+} WhiteBalanceParameters;
+
+kernel void whiteBalanceStatistics(texture2d<float> rawImage                     [[texture(0)]],
+                                   constant WhiteBalanceParameters& parameters  [[buffer(1)]],
+                                   device float* meanSums                       [[buffer(2)]],
+                                   device float* deviationSums                  [[buffer(3)]],
+                                   device float* whiteSums                      [[buffer(4)]],
+                                   uint2 index                                  [[thread_position_in_grid]],
+                                   uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                                   uint2 groupCount                             [[threadgroups_per_grid]],
+                                   uint localIndex                              [[thread_index_in_threadgroup]],
+                                   uint simdLane                                [[thread_index_in_simdgroup]],
+                                   uint simdGroup                               [[simdgroup_index_in_threadgroup]]) {
+    threadgroup float4 simdSums[kWhiteBalanceGroupSize * kWhiteBalanceGroupSize / 32];
+    threadgroup atomic_uint whiteHistogram[kWhiteBalanceHistogramSize][4];
+    threadgroup atomic_uint whiteMax;
+
+    const int stage = parameters.stage;
+    const int tileThreads = kWhiteBalanceTileGroups * kWhiteBalanceGroupSize;
+    const int2 tile = int2(groupPosition) / kWhiteBalanceTileGroups;
+    const int2 tileThread = int2(index) % tileThreads;
+    const int2 tileQuads = parameters.tileSize / 2;
+    const int2 tileOrigin = tile * parameters.tileSize;
+    const float quadCount = tileQuads.x * tileQuads.y;
+    const uint32_t group = groupPosition.y * groupCount.x + groupPosition.x;
+
+    // The tile's statistics from the partial sums of its threadgroups
+    float3 M = 0;
+    float3 D = 0;
+    if (stage > kWhiteBalanceMean) {
+        for (int gy = 0; gy < kWhiteBalanceTileGroups; gy++) {
+            for (int gx = 0; gx < kWhiteBalanceTileGroups; gx++) {
+                const int g = (tile.y * kWhiteBalanceTileGroups + gy) * groupCount.x + tile.x * kWhiteBalanceTileGroups + gx;
+                for (int c = 0; c < 3; c++) {
+                    M[c] += meanSums[g * kWhiteBalancePartials + c];
+                    if (stage > kWhiteBalanceDeviation) {
+                        D[c] += deviationSums[g * kWhiteBalancePartials + c];
+                    }
+                }
+            }
+        }
+        M /= quadCount;
+        D /= quadCount;
+    }
+
+    if (stage == kWhiteBalanceWhite) {
+        for (int i = localIndex; i < kWhiteBalanceHistogramSize * 4; i += kWhiteBalanceGroupSize * kWhiteBalanceGroupSize) {
+            atomic_store_explicit(&whiteHistogram[i / 4][i % 4], 0, memory_order_relaxed);
+        }
+        if (localIndex == 0) {
+            atomic_store_explicit(&whiteMax, 0, memory_order_relaxed);
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+
+    const float Wr = 1.5;
+    const float WCr = 1.5;
+
+    constant const int2* offsets = bayerPatternOffsets(parameters.bayerPattern);
+    float4 sums = 0;
+    for (int y = tileThread.y; y < tileQuads.y; y += tileThreads) {
+        for (int x = tileThread.x; x < tileQuads.x; x += tileThreads) {
+            const int2 quad = tileOrigin + 2 * int2(x, y);
+            const float3 raw = float3(read_imagef(rawImage, quad + offsets[raw_red]).x,
+                                      (read_imagef(rawImage, quad + offsets[raw_green]).x +
+                                       read_imagef(rawImage, quad + offsets[raw_green2]).x) / 2,
+                                      read_imagef(rawImage, quad + offsets[raw_blue]).x);
+
+            // The RGB value in the target color space clipping the highlights to white
+            float3 rgb = parameters.scaleMul.xyz * (raw - parameters.black);
+            bool highlights = false;
+            for (int c = 0; c < 3; c++) {
+                if (rgb[c] > 1.0) {
+                    rgb[c] = 1.0;
+                } else if (rgb[c] > 0.5) {
+                    highlights = true;
+                }
+            }
+            const float3 ycbcr = float3(dot(parameters.rgb_ycbcr.m[0], rgb),
+                                        dot(parameters.rgb_ycbcr.m[1], rgb),
+                                        dot(parameters.rgb_ycbcr.m[2], rgb));
+
+            if (stage == kWhiteBalanceMean) {
+                sums += float4(ycbcr, highlights ? 1 : 0);
+            } else if (stage == kWhiteBalanceDeviation) {
+                sums.xyz += abs(ycbcr - M);
+            } else if (abs(ycbcr.y - (M.y + copysign(D.y, M.y))) < Wr * D.y &&
+                       abs(ycbcr.z - (WCr * M.z + copysign(D.z, M.z))) < Wr * D.z) {
+                // Near white region pixels
+                const float3 white = max((raw - parameters.black) / parameters.white, 0.0);
+                const float Y = max(ycbcr.x, 0.0);
+                atomic_fetch_max_explicit(&whiteMax, as_type<uint>(Y), memory_order_relaxed);
+
+                const int histEntry = clamp((int) round((kWhiteBalanceHistogramSize - 1) * Y), 0, kWhiteBalanceHistogramSize - 1);
+                for (int c = 0; c < 3; c++) {
+                    atomic_fetch_add_explicit(&whiteHistogram[histEntry][c], (uint) (kWhiteBalanceFixedPoint * white[c]),
+                                              memory_order_relaxed);
+                }
+                atomic_fetch_add_explicit(&whiteHistogram[histEntry][3], 1, memory_order_relaxed);
+            }
+        }
+    }
+
+    if (stage == kWhiteBalanceWhite) {
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+        device float* partial = whiteSums + group * kWhiteBalanceWhitePartials;
+        for (int i = localIndex; i < kWhiteBalanceHistogramSize * 4; i += kWhiteBalanceGroupSize * kWhiteBalanceGroupSize) {
+            const uint32_t value = atomic_load_explicit(&whiteHistogram[i / 4][i % 4], memory_order_relaxed);
+            partial[i] = i % 4 < 3 ? value / kWhiteBalanceFixedPoint : value;
+        }
+        if (localIndex == 0) {
+            partial[4 * kWhiteBalanceHistogramSize] = as_type<float>(atomic_load_explicit(&whiteMax, memory_order_relaxed));
+        }
+        return;
+    }
+
+    sums = simd_sum(sums);
+    if (simdLane == 0) {
+        simdSums[simdGroup] = sums;
+    }
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (localIndex == 0) {
+        float4 sum = 0;
+        for (int i = 0; i < kWhiteBalanceGroupSize * kWhiteBalanceGroupSize / 32; i++) {
+            sum += simdSums[i];
+        }
+        device float* partial = (stage == kWhiteBalanceMean ? meanSums : deviationSums) + group * kWhiteBalancePartials;
+        for (int c = 0; c < 4; c++) {
+            partial[c] = sum[c];
+        }
+    }
+}
+
+kernel void whiteBalanceGains(device const float* meanSums                   [[buffer(0)]],
+                              device const float* whiteSums                  [[buffer(1)]],
+                              constant WhiteBalanceParameters& parameters    [[buffer(2)]],
+                              device float4* tileGains                       [[buffer(3)]],
+                              uint tileIndex                                 [[threadgroup_position_in_grid]],
+                              uint bin                                       [[thread_index_in_threadgroup]]) {
+    threadgroup float4 histogram[kWhiteBalanceHistogramSize];
+
+    const int groupsX = kWhiteBalanceTiles * kWhiteBalanceTileGroups;
+    const int2 tile = int2(tileIndex % kWhiteBalanceTiles, tileIndex / kWhiteBalanceTiles);
+
+    float4 entry = 0;
+    float yMax = 0;
+    float highlights = 0;
+    for (int gy = 0; gy < kWhiteBalanceTileGroups; gy++) {
+        for (int gx = 0; gx < kWhiteBalanceTileGroups; gx++) {
+            const int g = (tile.y * kWhiteBalanceTileGroups + gy) * groupsX + tile.x * kWhiteBalanceTileGroups + gx;
+            device const float* partial = whiteSums + g * kWhiteBalanceWhitePartials;
+            entry += float4(partial[4 * bin], partial[4 * bin + 1], partial[4 * bin + 2], partial[4 * bin + 3]);
+            yMax = max(yMax, partial[4 * kWhiteBalanceHistogramSize]);
+            highlights += meanSums[g * kWhiteBalancePartials + 3];
+        }
+    }
+    histogram[bin] = entry;
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+
+    if (bin == 0) {
+        const int histMaxEntry = clamp((int) round((kWhiteBalanceHistogramSize - 1) * yMax),
+                                       0, kWhiteBalanceHistogramSize - 1);
+        if (histMaxEntry == 0) {
+            tileGains[tileIndex] = float4(1, 1, 1, 0);
+            return;
+        }
+
+        float whitePixelsCount = 0;
+        for (int i = 0; i < kWhiteBalanceHistogramSize; i++) {
+            whitePixelsCount += histogram[i].w;
+        }
+
+        // Only consider the top highlightsFraction of whitePixelsCount
+        float3 rgbWhite90Average = 0;
+        float white90PixelsCount = 0;
+        for (int i = histMaxEntry; i >= 0; i--) {
+            rgbWhite90Average += histogram[i].xyz;
+            white90PixelsCount += histogram[i].w;
+
+            if (white90PixelsCount > parameters.highlightsFraction * whitePixelsCount) {
+                break;
+            }
+        }
+        rgbWhite90Average /= white90PixelsCount;
+
+        const float3 wbGain = yMax / rgbWhite90Average;
+        tileGains[tileIndex] = float4(wbGain / wbGain.g, highlights);
+    }
+}
+
 float computeLtmMultiplier(float3 input, float illuminance, float shadows, float highlights, float detail) {
     // Midtones point to split shadows and highlights adjystments
     const float kLtmMidtones = 0.22;
@@ -1476,6 +4204,7 @@ typedef struct LTMParameters {
     float shadows;
     float highlights;
     float detail[3];
+    int radius[3];
 } LTMParameters;
 
 kernel void localToneMappingMaskImage(texture2d<float> inputImage                   [[texture(0)]],
@@ -1532,7 +4261,7 @@ kernel void localToneMappingMaskImage(texture2d<float> inputImage
 
     float hfDetail = ltmParameters.detail[2];
     if (hfDetail > 1.0) {
-        float gradient = length(read_imagef(gradientImage, imageCoordinates).xy);
+        float gradient = length(gradientView(gradientImage, get_image_dim(inputImage)).read(imageCoordinates).xy);
 
         float sigma = sqrt(nlf.x + nlf.y * hfIlluminance);
         float detail = smoothstep(2 * sigma, 8 * sigma, gradient)                   // Don't sharpen noise
@@ -1552,9 +4281,11 @@ static inline float2 s_curve(float2 t) {
 
 static constant int noiseGradSize = 514;
 
-float noise(float2 pos, constant array<int, noiseGradSize>& p, constant array<float2, noiseGradSize>& g2) {
+// With a latticeMask smaller than 0xff the noise is periodic, with a period of latticeMask + 1 lattice cells
+float noise(float2 pos, constant array<int, noiseGradSize>& p, constant array<float2, noiseGradSize>& g2,
+            int latticeMask = 0xff) {
     // setup
-    const int BM = 0xff;
+    const int BM = latticeMask;
     const int N = 0x1000;
 
     float2 t = pos + N;
@@ -1584,33 +4315,46 @@ float noise(float2 pos, constant array<int, noiseGradSize>& p, constant array<fl
     return mix(a, b, s.y);
 }
 
-float octaveNoise(float2 pos, int octaves, float persistence, float lacunarity,
-                  constant array<int, noiseGradSize>& p, constant array<float2, noiseGradSize>& g2) {
-    float freq = 1.0f;
-    float amp = 1.0f;
-    float norm = 1.0f;
-    float sum = noise(pos, p, g2);
-    int i;
+// Film grain: four octaves of gradient noise at half the pixel frequency, tileable over the grain image's width
+// (a power of two), generated once per seed: each octave's lattice wraps at the tile size. The pipeline samples
+// the tile with an offset derived from each image's noise seed, so the pattern stays stable for a given image.
+kernel void generateGrainImage(texture2d<float, access::write> grainImage   [[texture(0)]],
+                               constant array<int, noiseGradSize>& p        [[buffer(1)]],
+                               constant array<float2, noiseGradSize>& g2    [[buffer(2)]],
+                               uint2 index                                  [[thread_position_in_grid]])
+{
+    const int tileSize = grainImage.get_width();
+    const float2 pos = 0.5 * float2(index);
 
-    for (i = 1; i < octaves; ++i) {
-        freq *= lacunarity;
-        amp *= persistence;
+    float freq = 1;
+    float amp = 1;
+    float norm = 0;
+    float sum = 0;
+    for (int i = 0; i < 4; i++) {
+        const int period = int(0.5 * freq * tileSize);
+        sum += noise(pos * freq, p, g2, period - 1) * amp;
         norm += amp;
-        sum += noise(pos * freq, p, g2) * amp;
+        freq *= 0.5;
+        amp *= 0.5;
     }
-    return sum / norm;
+    write_imagef(grainImage, (int2) index, float4(sum / norm, 0, 0, 0));
+}
+
+float grainNoise(texture2d<float> grainImage, int2 imageCoordinates, int2 grainOffset) {
+    const int2 tileMask = int2(grainImage.get_width(), grainImage.get_height()) - 1;
+    return read_imagef(grainImage, (imageCoordinates + grainOffset) & tileMask).x;
 }
 
 kernel void simplex_noise(texture2d<float> inputImage                   [[texture(0)]],
-                          constant array<int, noiseGradSize>& p         [[buffer(1)]],
-                          constant array<float2, noiseGradSize>& g2     [[buffer(2)]],
+                          texture2d<float> grainImage                   [[texture(1)]],
+                          constant int2& grainOffset                    [[buffer(2)]],
                           constant float2& variance                     [[buffer(3)]],
                           texture2d<float, access::write> outputImage   [[texture(4)]],
                           uint2 index                                   [[thread_position_in_grid]])
 {
     const int2 imageCoordinates = (int2) index;
 
-    float noise = octaveNoise(0.5 * float2(imageCoordinates), 4, 0.5, 0.5, p, g2);
+    float noise = grainNoise(grainImage, imageCoordinates, grainOffset);
 
     float4 pixel = read_imagef(inputImage, imageCoordinates);
     float sigma = sqrt(variance.x + variance.y * pixel.x);
@@ -1618,30 +4362,18 @@ kernel void simplex_noise(texture2d<float> inputImage                   [[textur
     write_imagef(outputImage, imageCoordinates, pixel);
 }
 
-kernel void convertTosRGB(texture2d<float> linearImage                  [[texture(0)]],
-                          texture2d<float> ltmMaskImage                 [[texture(1)]],
-                          texture2d<float, access::write> rgbImage      [[texture(2)]],
-                          constant Matrix3x3& transform                 [[buffer(3)]],
-                          constant RGBConversionParameters& parameters  [[buffer(4)]],
-                          constant histogram_data& histogram_data       [[buffer(5)]],
-                          constant float2& lumaVariance                 [[buffer(6)]],
-                          constant array<int, noiseGradSize>& p         [[buffer(7)]],
-                          constant array<float2, noiseGradSize>& g2     [[buffer(8)]],
-                          uint2 index                                   [[thread_position_in_grid]])
-{
-    const int2 imageCoordinates = (int2) index;
+// Color and tone conversion of convertTosRGB, split around the local tone mapping and the noise addition
 
-    float black_level = histogram_data.black_level;
+float3 cameraToOutputRGB(float3 inputPixel, float black_level, float mean,
+                         constant Matrix3x3& transform, constant RGBConversionParameters& parameters) {
     float white_level = 1; // - 0.25 * (1 - smoothstep(0.375, 0.625, histogram_data.white_level));
 
     float brightening = 1; // + 0.5 * smoothstep(0, 0.1, histogram_data.mean - histogram_data.median);
-    if (histogram_data.mean > 0.22) {
-        brightening *= 0.22 / histogram_data.mean;
+    if (mean > 0.22) {
+        brightening *= 0.22 / mean;
     }
 
     // FIXME: Compute the black and white levels dynamically
-    float3 inputPixel = read_imagef(linearImage, imageCoordinates).xyz;
-
     float3 pixel_value = brightening * max(inputPixel - black_level, 0) / (white_level - black_level);
 
     // Exposure Bias
@@ -1654,11 +4386,98 @@ kernel void convertTosRGB(texture2d<float> linearImage                  [[textur
     pixel_value = parameters.contrast != 1.0 ? contrastBoost(pixel_value, parameters.contrast) : pixel_value;
 
     // Conversion to target color space, ensure definite positiveness
-    float3 rgb = max(float3(
+    return max(float3(
         dot(transform.m[0], pixel_value),
         dot(transform.m[1], pixel_value),
         dot(transform.m[2], pixel_value)
     ), 0);
+}
+
+float3 outputToneCurve(float3 rgb, constant RGBConversionParameters& parameters) {
+    // Tone Curve
+    rgb = toneCurve(max(rgb, 0), parameters.toneCurveSlope);
+
+    // Black Level Adjustment
+    if (parameters.blacks > 0) {
+        rgb = (rgb - parameters.blacks) / (1 - parameters.blacks);
+    }
+
+    return clamp(rgb, 0.0, 1.0);
+}
+
+// Baked color pipeline: the spatially invariant parts of convertTosRGB, cameraToOutputRGB and outputToneCurve, are
+// evaluated once per frame in lookup tables, only the local tone mapping and the grain stay per pixel. Both tables
+// are indexed by the square root of their input, which matches the tone curve's shape and favors the shadows.
+constant int kColorLutSize = 33;
+constant float kColorLutInputRange = 2;       // Camera linear RGB, clamped above
+constant int kToneCurveLutSize = 1024;
+constant float kToneCurveLutInputRange = 1.125;   // Above 1 / 0.95 the tone curve clips to white
+
+kernel void bakeColorLut(texture3d<float, access::write> colorLut        [[texture(0)]],
+                         constant Matrix3x3& transform                   [[buffer(1)]],
+                         constant RGBConversionParameters& parameters    [[buffer(2)]],
+                         constant histogram_data& histogram_data         [[buffer(3)]],
+                         uint3 index                                     [[thread_position_in_grid]]) {
+    const float3 u = float3(index) / (kColorLutSize - 1);
+    const float3 inputPixel = kColorLutInputRange * u * u;
+
+    const float3 rgb = cameraToOutputRGB(inputPixel, histogram_data.black_level, histogram_data.mean, transform, parameters);
+    colorLut.write(float4(rgb, 0), index);
+}
+
+kernel void bakeToneCurveLut(texture1d<float, access::write> toneCurveLut   [[texture(0)]],
+                             constant RGBConversionParameters& parameters   [[buffer(1)]],
+                             uint index                                     [[thread_position_in_grid]]) {
+    const float u = index / float(kToneCurveLutSize - 1);
+
+    const float3 rgb = outputToneCurve(float3(kToneCurveLutInputRange * u * u), parameters);
+    toneCurveLut.write(rgb.x, index);
+}
+
+float3 cameraToOutputRGBLut(float3 inputPixel, texture3d<float> colorLut) {
+    constexpr sampler lut_sampler(filter::linear, address::clamp_to_edge, coord::normalized);
+
+    const float3 u = sqrt(saturate(inputPixel / kColorLutInputRange));
+    return colorLut.sample(lut_sampler, (u * (kColorLutSize - 1) + 0.5) / kColorLutSize).xyz;
+}
+
+float3 outputToneCurveLut(float3 rgb, texture1d<float> toneCurveLut) {
+    constexpr sampler lut_sampler(filter::linear, address::clamp_to_edge, coord::normalized);
+
+    const float3 u = (sqrt(saturate(rgb / kToneCurveLutInputRange)) * (kToneCurveLutSize - 1) + 0.5) / kToneCurveLutSize;
+    return clamp(float3(toneCurveLut.sample(lut_sampler, u.x).x,
+                        toneCurveLut.sample(lut_sampler, u.y).x,
+                        toneCurveLut.sample(lut_sampler, u.z).x), 0.0, 1.0);
+}
+
+float3 applyLocalToneMapping(float3 rgb, float ltmBoost) {
+    if (ltmBoost > 1) {
+        // Modified Naik and Murthy’s method for preserving hue/saturation under luminance changes
+        const float luma = 0.2126 * rgb.x + 0.7152 * rgb.y + 0.0722 * rgb.z; // BT.709-2 (sRGB) luma primaries
+        // rgb = mix(1 - (1.0 - rgb) * (1 - ltmBoost * luma) / (1 - luma), rgb * ltmBoost, smoothstep(0.125, 0.25, luma));
+        return mix(rgb * ltmBoost,
+                   mix(1 - (1.0 - rgb) * (1 - ltmBoost * luma) / (1 - luma), rgb * ltmBoost, smoothstep(0.5, 0.8, luma)),
+                   min(pow(luma, 0.5), 1.0));
+    } else if (ltmBoost < 1) {
+        return rgb * ltmBoost;
+    }
+    return rgb;
+}
+
+// Final output pixel: color conversion, local tone mapping, film grain and tone curve
+float3 convertTosRGBPixel(texture2d<float> linearImage, texture2d<float> ltmMaskImage,
+                          texture3d<float> colorLut, texture1d<float> toneCurveLut,
+                          constant Matrix3x3& transform, constant RGBConversionParameters& parameters,
+                          constant histogram_data& histogram_data, constant float2& lumaVariance,
+                          texture2d<float> grainImage, int2 grainOffset, constant Matrix3x3& inputTransform,
+                          int2 imageCoordinates) {
+    float3 inputPixel = read_imagef(linearImage, imageCoordinates).xyz;
+    if (ycbcrInput) {
+        inputPixel = transformPixel(inputTransform, inputPixel);
+    }
+
+    float3 rgb = useColorLut ? cameraToOutputRGBLut(inputPixel, colorLut)
+                             : cameraToOutputRGB(inputPixel, histogram_data.black_level, histogram_data.mean, transform, parameters);
 
     // Sigma of perlin noise to add to the image
     float lumaSigma = 0;
@@ -1667,16 +4486,7 @@ kernel void convertTosRGB(texture2d<float> linearImage                  [[textur
     if (parameters.localToneMapping) {
         float ltmBoost = read_imagef(ltmMaskImage, imageCoordinates).x;
 
-        if (ltmBoost > 1) {
-            // Modified Naik and Murthy’s method for preserving hue/saturation under luminance changes
-            const float luma = 0.2126 * rgb.x + 0.7152 * rgb.y + 0.0722 * rgb.z; // BT.709-2 (sRGB) luma primaries
-            // rgb = mix(1 - (1.0 - rgb) * (1 - ltmBoost * luma) / (1 - luma), rgb * ltmBoost, smoothstep(0.125, 0.25, luma));
-            rgb = mix(rgb * ltmBoost,
-                      mix(1 - (1.0 - rgb) * (1 - ltmBoost * luma) / (1 - luma), rgb * ltmBoost, smoothstep(0.5, 0.8, luma)),
-                      min(pow(luma, 0.5), 1.0));
-        } else if (ltmBoost < 1) {
-            rgb *= ltmBoost;
-        }
+        rgb = applyLocalToneMapping(rgb, ltmBoost);
 
         if (any(lumaVariance != 0)) {
             lumaSigma = sqrt(lumaVariance.x + lumaVariance.y * ltmBoost * inputPixel.y);
@@ -1689,19 +4499,211 @@ kernel void convertTosRGB(texture2d<float> linearImage                  [[textur
 
     // Add back some good looking noise
     if (lumaSigma > 0) {
-        float noise = octaveNoise(0.5 * float2(imageCoordinates), 4, 0.5, 0.5, p, g2);
+        float noise = grainNoise(grainImage, imageCoordinates, grainOffset);
         rgb += lumaSigma * noise;
     }
 
-    // Tone Curve
-    rgb = toneCurve(max(rgb, 0), parameters.toneCurveSlope);
+    return useColorLut ? outputToneCurveLut(rgb, toneCurveLut) : outputToneCurve(rgb, parameters);
+}
 
-    // Black Level Adjustment
-    if (parameters.blacks > 0) {
-        rgb = (rgb - parameters.blacks) / (1 - parameters.blacks);
+// Argument buffer of the inputs of convertTosRGB and convertToYCbCr420, they are the same from one frame to the
+// next: the layout matches convertTosRGBKernel::Resources, see ArgumentTable
+struct ConvertTosRGBResources {
+    texture2d<float> linearImage;
+    texture2d<float> ltmMaskImage;
+    texture2d<float> grainImage;
+    texture3d<float> colorLut;
+    texture1d<float> toneCurveLut;
+    constant histogram_data* histogram;
+};
+
+// With ycbcrInput the linear image is the denoiser's YCbCr, inputTransform converts it to camera RGB
+float3 convertTosRGBPixel(constant ConvertTosRGBResources& resources, constant Matrix3x3& transform,
+                          constant RGBConversionParameters& parameters, constant float2& lumaVariance,
+                          int2 grainOffset, constant Matrix3x3& inputTransform, int2 imageCoordinates) {
+    return convertTosRGBPixel(resources.linearImage, resources.ltmMaskImage, resources.colorLut, resources.toneCurveLut,
+                              transform, parameters, *resources.histogram, lumaVariance, resources.grainImage,
+                              grainOffset, inputTransform, imageCoordinates);
+}
+
+kernel void convertTosRGB(constant ConvertTosRGBResources& resources    [[buffer(0)]],
+                          texture2d<float, access::write> rgbImage      [[texture(1)]],
+                          constant Matrix3x3& transform                 [[buffer(2)]],
+                          constant RGBConversionParameters& parameters  [[buffer(3)]],
+                          constant float2& lumaVariance                 [[buffer(4)]],
+                          constant int2& grainOffset                    [[buffer(5)]],
+                          constant Matrix3x3& inputTransform            [[buffer(6), function_constant(ycbcrInput)]],
+                          uint2 index                                   [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = (int2) index;
+
+    const float3 rgb = convertTosRGBPixel(resources, transform, parameters, lumaVariance, grainOffset, inputTransform, imageCoordinates);
+
+    write_imagef(rgbImage, imageCoordinates, float4(rgb, 1.0));
+}
+
+// convertTosRGB with extra outputs written in the same pass, selected by the function constants: the registration
+// luma (convertToGrayscale of the sRGB pixel), an 8 bit display copy and a box filtered thumbnail. Each thread
+// processes a blockSize x blockSize block and writes its average to the thumbnail, the blocks are clamped at the edges.
+kernel void convertTosRGBMultiOutput(constant ConvertTosRGBResources& resources                [[buffer(0)]],
+                                     texture2d<float, access::write> rgbImage                  [[texture(1)]],
+                                     texture2d<float, access::write> lumaImage                 [[texture(2), function_constant(lumaOutputConstant)]],
+                                     texture2d<float, access::write> displayImage              [[texture(3), function_constant(displayOutputConstant)]],
+                                     texture2d<float, access::write> thumbnailImage            [[texture(4), function_constant(thumbnailOutputConstant)]],
+                                     constant Matrix3x3& transform                             [[buffer(5)]],
+                                     constant RGBConversionParameters& parameters              [[buffer(6)]],
+                                     constant float2& lumaVariance                             [[buffer(7)]],
+                                     constant int2& grainOffset                                [[buffer(8)]],
+                                     constant float3& lumaWeights                              [[buffer(9)]],
+                                     constant int& blockSize                                   [[buffer(10)]],
+                                     constant Matrix3x3& inputTransform                        [[buffer(11), function_constant(ycbcrInput)]],
+                                     uint2 index                                               [[thread_position_in_grid]])
+{
+    const int2 imageSize = int2(rgbImage.get_width(), rgbImage.get_height());
+    const int2 origin = blockSize * (int2) index;
+    const int2 blockEnd = min(origin + blockSize, imageSize);
+
+    float3 rgbSum = 0;
+    for (int y = origin.y; y < blockEnd.y; y++) {
+        for (int x = origin.x; x < blockEnd.x; x++) {
+            const int2 imageCoordinates = int2(x, y);
+            const float3 rgb = convertTosRGBPixel(resources, transform, parameters, lumaVariance, grainOffset, inputTransform, imageCoordinates);
+
+            write_imagef(rgbImage, imageCoordinates, float4(rgb, 1.0));
+            if (lumaOutputConstant) {
+                const float grayscale = max(dot(lumaWeights, (rgb - 0.1) / 0.9), 0.0);
+                write_imagef(lumaImage, imageCoordinates, float4(grayscale, 0, 0, 0));
+            }
+            if (displayOutputConstant) {
+                write_imagef(displayImage, imageCoordinates, float4(rgb, 1.0));
+            }
+            rgbSum += rgb;
+        }
+    }
+
+    if (thumbnailOutputConstant) {
+        const int2 blockExtent = blockEnd - origin;
+        write_imagef(thumbnailImage, (int2) index, float4(rgbSum / (blockExtent.x * blockExtent.y), 1.0));
+    }
+}
+
+// Full range samples of a bitDepth bit plane in a unorm texture, the 10 bit samples are MSB aligned in 16 bits
+float quantizeSample(float value, int bitDepth) {
+    const float levels = (1 << bitDepth) - 1;
+    const float q = round(saturate(value) * levels);
+    return bitDepth > 8 ? q * (1 << (16 - bitDepth)) / 65535.0 : q / 255.0;
+}
+
+// convertTosRGB writing a full range bi-planar 4:2:0 YCbCr image (BT.709 matrix) for the HEVC encoders.
+// Each thread processes a 2x2 quad, the chroma is the YCbCr of the quad's average, clamped at odd edges.
+kernel void convertToYCbCr420(constant ConvertTosRGBResources& resources    [[buffer(0)]],
+                              texture2d<float, access::write> lumaImage     [[texture(1)]],
+                              texture2d<float, access::write> chromaImage   [[texture(2)]],
+                              constant Matrix3x3& transform                 [[buffer(3)]],
+                              constant RGBConversionParameters& parameters  [[buffer(4)]],
+                              constant float2& lumaVariance                 [[buffer(5)]],
+                              constant int2& grainOffset                    [[buffer(6)]],
+                              constant int& bitDepth                        [[buffer(7)]],
+                              constant Matrix3x3& inputTransform            [[buffer(8), function_constant(ycbcrInput)]],
+                              uint2 index                                   [[thread_position_in_grid]])
+{
+    const float3 lumaWeights = float3(0.2126, 0.7152, 0.0722); // BT.709-2 luma primaries
+    const int2 imageSize = int2(lumaImage.get_width(), lumaImage.get_height());
+    const int2 chromaCoordinates = (int2) index;
+
+    float3 rgbSum = 0;
+    for (int y = 0; y < 2; y++) {
+        for (int x = 0; x < 2; x++) {
+            const int2 imageCoordinates = min(2 * chromaCoordinates + int2(x, y), imageSize - 1);
+            const float3 rgb = convertTosRGBPixel(resources, transform, parameters, lumaVariance, grainOffset, inputTransform, imageCoordinates);
+            rgbSum += rgb;
+            lumaImage.write(quantizeSample(dot(rgb, lumaWeights), bitDepth), uint2(imageCoordinates));
+        }
+    }
+
+    const float3 rgb = rgbSum / 4;
+    const float luma = dot(rgb, lumaWeights);
+    const float cb = (rgb.z - luma) / 1.8556 + 0.5;
+    const float cr = (rgb.x - luma) / 1.5748 + 0.5;
+    chromaImage.write(float4(quantizeSample(cb, bitDepth), quantizeSample(cr, bitDepth), 0, 0), index);
+}
+
+// ---- Low latency preview pipeline ----
+
+// 2x2 binning of the raw data to half resolution YCbCr, with the scaling of scaleRawData
+kernel void previewRawToYCbCr(texture2d<half> rawImage                      [[texture(0)]],
+                              texture2d<float, access::write> ycbcrImage    [[texture(1)]],
+                              constant int& bayerPattern                    [[buffer(2)]],
+                              constant half4& scaleMul                      [[buffer(3)]],
+                              constant half& blackLevel                     [[buffer(4)]],
+                              texture2d<float> lensShadingMap               [[texture(5)]],
+                              constant Matrix3x3& transform                 [[buffer(6)]],
+                              constant float4& lensShadingGeometry          [[buffer(7)]],
+                              uint2 index                                   [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = (int2) index;
+    const int2 rawCoordinates = 2 * imageCoordinates;
+
+    half4 lens_shading = 1;
+    if (lensShadingEnabled()) {
+        lens_shading = half4(lensShadingGain(lensShadingMap, lensShadingGeometry, float2(rawCoordinates) + 1));
+    }
+
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    float4 raw;
+    for (int c = 0; c < 4; c++) {
+        raw[c] = max(lens_shading[c] * scaleMul[c] * (read_imageh(rawImage, rawCoordinates + offsets[c]).x - blackLevel) * 0.9 + 0.1, 0.0);
+    }
+    const float3 rgb = float3(raw[raw_red], (raw[raw_green] + raw[raw_green2]) / 2, raw[raw_blue]);
+
+    write_imagef(ycbcrImage, imageCoordinates, float4(dot(transform.m[0], rgb), dot(transform.m[1], rgb), dot(transform.m[2], rgb), 0));
+}
+
+// Back to camera RGB and color conversion with the tone curve, no local tone mapping and no added noise
+kernel void previewTosRGB(texture2d<float> ycbcrImage                   [[texture(0)]],
+                          texture2d<float, access::write> rgbImage      [[texture(1)]],
+                          constant Matrix3x3& ycbcrToCam                [[buffer(2)]],
+                          constant Matrix3x3& transform                 [[buffer(3)]],
+                          constant RGBConversionParameters& parameters  [[buffer(4)]],
+                          constant float2& levels                       [[buffer(5)]],
+                          uint2 index                                   [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = (int2) index;
+
+    const float3 ycbcr = read_imagef(ycbcrImage, imageCoordinates).xyz;
+    const float3 inputPixel = float3(dot(ycbcrToCam.m[0], ycbcr), dot(ycbcrToCam.m[1], ycbcr), dot(ycbcrToCam.m[2], ycbcr));
+
+    const float3 rgb = cameraToOutputRGB(inputPixel, /*black_level=*/ levels.x, /*mean=*/ levels.y, transform, parameters);
+
+    write_imagef(rgbImage, imageCoordinates, float4(outputToneCurve(rgb, parameters), 1.0));
+}
+
+// Gallery rendition: a denoised pyramid level resampled to the rendition's size, with the color conversion, local tone
+// mapping and tone curve of convertTosRGB and without grain. The LTM mask is sampled at the same relative position,
+// the level is chosen to be at most twice the rendition's size so the bilinear sampling covers all of its pixels.
+kernel void renditionTosRGB(texture2d<float> ycbcrImage                   [[texture(0)]],
+                            texture2d<float> ltmMaskImage                 [[texture(1)]],
+                            texture2d<float, access::write> rgbImage      [[texture(2)]],
+                            constant Matrix3x3& ycbcrToCam                [[buffer(3)]],
+                            constant Matrix3x3& transform                 [[buffer(4)]],
+                            constant RGBConversionParameters& parameters  [[buffer(5)]],
+                            constant histogram_data& histogram_data       [[buffer(6)]],
+                            uint2 index                                   [[thread_position_in_grid]])
+{
+    constexpr sampler linear_sampler(filter::linear, address::clamp_to_edge, coord::normalized);
+
+    const float2 uv = (float2(index) + 0.5) / float2(rgbImage.get_width(), rgbImage.get_height());
+
+    const float3 ycbcr = ycbcrImage.sample(linear_sampler, uv).xyz;
+    const float3 inputPixel = float3(dot(ycbcrToCam.m[0], ycbcr), dot(ycbcrToCam.m[1], ycbcr), dot(ycbcrToCam.m[2], ycbcr));
+
+    float3 rgb = cameraToOutputRGB(inputPixel, histogram_data.black_level, histogram_data.mean, transform, parameters);
+
+    if (parameters.localToneMapping) {
+        rgb = applyLocalToneMapping(rgb, ltmMaskImage.sample(linear_sampler, uv).x);
     }
 
-    write_imagef(rgbImage, imageCoordinates, float4(clamp(rgb, 0.0, 1.0), 1.0));
+    write_imagef(rgbImage, (int2) index, float4(outputToneCurve(rgb, parameters), 1.0));
 }
 
 kernel void convertToGrayscale(texture2d<float> linearImage                     [[texture(0)]],
@@ -1721,3 +4723,199 @@ kernel void convertToGrayscale(texture2d<float> linearImage
 
     write_imagef(grayscaleImage, imageCoordinates, float4(grayscale, 0, 0, 0));
 }
+
+// Alignment luma straight from the raw data: the mean of the two green planes of a bayerToRawRGBA image, scaled
+// like scaleRawData does and tone mapped for the feature detector
+kernel void rawGreenToGrayscale(texture2d<float> rawRGBAImage                   [[texture(0)]],
+                                texture2d<float, access::write> grayscaleImage  [[texture(1)]],
+                                constant float2& levels                         [[buffer(2)]],  // black level, green scale
+                                uint2 index                                     [[thread_position_in_grid]])
+{
+    const int2 imageCoordinates = int2(index);
+
+    const float4 rgba = read_imagef(rawRGBAImage, imageCoordinates);
+    const float green = 0.5 * (rgba.y + rgba.w);
+
+    float grayscale = toneCurve(clamp(levels.y * (green - levels.x), 0.0, 1.0), 3.5);
+
+    write_imagef(grayscaleImage, imageCoordinates, float4(grayscale, 0, 0, 0));
+}
+
+// Burst frame selection, see BurstFrameSelector: the frames are scored on their raw green at 1/8 of the sensor's
+// resolution, where the noise doesn't hide the blur. Each threadgroup writes its sums to partialSums.
+constant constexpr int kFrameScoreGroupSize = 16;
+constant constexpr int kFrameScoreSums = 3;
+
+// The scaled and tone mapped mean of the greens of the 4x4 Bayer quads of each pixel
+kernel void frameScoreLevel(texture2d<float> rawImage                   [[texture(0)]],
+                            texture2d<float, access::write> levelImage  [[texture(1)]],
+                            constant int& bayerPattern                  [[buffer(2)]],
+                            constant float2& levels                     [[buffer(3)]],  // black level, green scale
+                            uint2 index                                 [[thread_position_in_grid]]) {
+    constant const int2* offsets = bayerPatternOffsets(bayerPattern);
+    const int2 g = offsets[raw_green];
+    const int2 g2 = offsets[raw_green2];
+
+    const int2 origin = 8 * (int2) index;
+    float green = 0;
+    for (int y = 0; y < 8; y += 2) {
+        for (int x = 0; x < 8; x += 2) {
+            green += read_imagef(rawImage, origin + int2(x, y) + g).x + read_imagef(rawImage, origin + int2(x, y) + g2).x;
+        }
+    }
+    green /= 32;
+
+    write_imagef(levelImage, (int2) index, toneCurve(clamp(levels.y * (green - levels.x), 0.0, 1.0), 3.5));
+}
+
+// Pairwise reduction of the threadgroup's sums to partialSums
+void reduceFrameScoreSums(threadgroup float (*localSums)[kFrameScoreSums], uint localIndex, uint2 groupPosition,
+                          uint2 groupCount, device float* partialSums) {
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    for (uint stride = kFrameScoreGroupSize * kFrameScoreGroupSize / 2; stride > 0; stride /= 2) {
+        if (localIndex < stride) {
+            for (int i = 0; i < kFrameScoreSums; i++) {
+                localSums[localIndex][i] += localSums[localIndex + stride][i];
+            }
+        }
+        threadgroup_barrier(mem_flags::mem_threadgroup);
+    }
+    if (localIndex < kFrameScoreSums) {
+        const uint group = groupPosition.y * groupCount.x + groupPosition.x;
+        partialSums[group * kFrameScoreSums + localIndex] = localSums[0][localIndex];
+    }
+}
+
+// Sharpness: the gradient energy of the level, with its luma and pixel count
+kernel void frameSharpness(texture2d<float> levelImage                  [[texture(0)]],
+                           device float* partialSums                    [[buffer(1)]],
+                           uint2 index                                  [[thread_position_in_grid]],
+                           uint2 groupPosition                          [[threadgroup_position_in_grid]],
+                           uint2 groupCount                             [[threadgroups_per_grid]],
+                           uint localIndex                              [[thread_index_in_threadgroup]]) {
+    threadgroup float localSums[kFrameScoreGroupSize * kFrameScoreGroupSize][kFrameScoreSums];
+
+    const int2 p = (int2) index;
+    const int2 size = int2(levelImage.get_width(), levelImage.get_height());
+    float3 sums = 0;
+    if (all(p + 1 < size)) {
+        const float luma = read_imagef(levelImage, p).x;
+        const float dx = read_imagef(levelImage, p + int2(1, 0)).x - luma;
+        const float dy = read_imagef(levelImage, p + int2(0, 1)).x - luma;
+        sums = float3(dx * dx + dy * dy, luma, 1);
+    }
+    for (int i = 0; i < kFrameScoreSums; i++) {
+        localSums[localIndex][i] = sums[i];
+    }
+    reduceFrameScoreSums(localSums, localIndex, groupPosition, groupCount, partialSums);
+}
+
+// Alignment residual: the absolute difference of the reference level and of the registered frame level, over the
+// pixels the homography maps inside the frame, with the reference's luma and the pixel count
+kernel void frameResidual(texture2d<float> referenceImage               [[texture(0)]],
+                          texture2d<float> frameImage                   [[texture(1)]],
+                          constant Matrix3x3& homography                [[buffer(2)]],
+                          device float* partialSums                     [[buffer(3)]],
+                          uint2 index                                   [[thread_position_in_grid]],
+                          uint2 groupPosition                           [[threadgroup_position_in_grid]],
+                          uint2 groupCount                              [[threadgroups_per_grid]],
+                          uint localIndex                               [[thread_index_in_threadgroup]]) {
+    constexpr sampler linear_sampler(filter::linear, address::clamp_to_edge, coord::pixel);
+
+    threadgroup float localSums[kFrameScoreGroupSize * kFrameScoreGroupSize][kFrameScoreSums];
+
+    const int2 p = (int2) index;
+    float3 sums = 0;
+    if (all(p < int2(referenceImage.get_width(), referenceImage.get_height()))) {
+        const float3 hp = float3(p.x, p.y, 1);
+        const float2 q = float2(dot(homography.m[0], hp), dot(homography.m[1], hp)) / dot(homography.m[2], hp);
+        if (all(q >= 0) && all(q <= float2(frameImage.get_width(), frameImage.get_height()) - 1)) {
+            const float reference = read_imagef(referenceImage, p).x;
+            const float frame = frameImage.sample(linear_sampler, q + 0.5).x;
+            sums = float3(abs(frame - reference), reference, 1);
+        }
+    }
+    for (int i = 0; i < kFrameScoreSums; i++) {
+        localSums[localIndex][i] = sums[i];
+    }
+    reduceFrameScoreSums(localSums, localIndex, groupPosition, groupCount, partialSums);
+}
+
+// Layout conversion between images and the tensors of the Core ML models, see imageToTensorKernel. A grid index g
+// maps to the tensor element t = tensorOffset + g and to the image pixel origin + t, or origin + t.yx with transpose
+typedef struct TensorLayout {
+    int2 origin;
+    int2 tensorOffset;
+    int channels;
+    int channelStride;
+    int rowStride;
+    int columnStride;
+    int transpose;
+    float scale;
+    float offset;
+} TensorLayout;
+
+int2 tensorImageCoordinates(int2 tensorCoordinates, constant TensorLayout& layout) {
+    return layout.origin + (layout.transpose ? tensorCoordinates.yx : tensorCoordinates);
+}
+
+// Reads outside of the image are clamped to its edges, the tensor values are scale * pixel + offset
+template <typename T>
+void imageToTensor(texture2d<float> image, device T* tensor, constant TensorLayout& layout, uint2 index) {
+    const int2 tensorCoordinates = layout.tensorOffset + int2(index);
+    const int2 imageCoordinates = clamp(tensorImageCoordinates(tensorCoordinates, layout), 0, get_image_dim(image) - 1);
+
+    const float4 pixel = layout.scale * read_imagef(image, imageCoordinates) + layout.offset;
+
+    const int element = tensorCoordinates.y * layout.rowStride + tensorCoordinates.x * layout.columnStride;
+    for (int c = 0; c < layout.channels; c++) {
+        tensor[element + c * layout.channelStride] = (T) pixel[c];
+    }
+}
+
+// The inverse transform, (tensor - offset) / scale, pixels outside of the image are skipped and missing channels
+// are zero, alpha is one
+template <typename T>
+void tensorToImage(device const T* tensor, texture2d<float, access::write> image, constant TensorLayout& layout, uint2 index) {
+    const int2 tensorCoordinates = layout.tensorOffset + int2(index);
+    const int2 imageCoordinates = tensorImageCoordinates(tensorCoordinates, layout);
+    if (any(imageCoordinates < 0) || any(imageCoordinates >= get_image_dim(image))) {
+        return;
+    }
+
+    float4 pixel = float4(0, 0, 0, 1);
+    const int element = tensorCoordinates.y * layout.rowStride + tensorCoordinates.x * layout.columnStride;
+    for (int c = 0; c < layout.channels; c++) {
+        pixel[c] = ((float) tensor[element + c * layout.channelStride] - layout.offset) / layout.scale;
+    }
+
+    write_imagef(image, imageCoordinates, pixel);
+}
+
+kernel void imageToTensorFloat(texture2d<float> image                                  [[texture(0)]],
+                               device float* tensor                                    [[buffer(1)]],
+                               constant TensorLayout& layout                           [[buffer(2)]],
+                               uint2 index                                             [[thread_position_in_grid]]) {
+    imageToTensor(image, tensor, layout, index);
+}
+
+kernel void imageToTensorHalf(texture2d<float> image                                   [[texture(0)]],
+                              device half* tensor                                      [[buffer(1)]],
+                              constant TensorLayout& layout                            [[buffer(2)]],
+                              uint2 index                                              [[thread_position_in_grid]]) {
+    imageToTensor(image, tensor, layout, index);
+}
+
+kernel void tensorToImageFloat(device const float* tensor                              [[buffer(0)]],
+                               texture2d<float, access::write> image                   [[texture(1)]],
+                               constant TensorLayout& layout                           [[buffer(2)]],
+                               uint2 index                                             [[thread_position_in_grid]]) {
+    tensorToImage(tensor, image, layout, index);
+}
+
+kernel void tensorToImageHalf(device const half* tensor                                [[buffer(0)]],
+                              texture2d<float, access::write> image                    [[texture(1)]],
+                              constant TensorLayout& layout                            [[buffer(2)]],
+                              uint2 index                                              [[thread_position_in_grid]]) {
+    tensorToImage(tensor, image, layout, index);
+}
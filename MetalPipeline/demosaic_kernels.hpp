@@ -16,8 +16,16 @@
 #ifndef demosaic_kernels_h
 #define demosaic_kernels_h
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <simd/simd.h>
+#include <vector>
 
 #include "float16.hpp"
 
@@ -26,73 +34,258 @@
 #include "gls_mtl.hpp"
 
 #include "SimplexNoise.hpp"
+#include "lens_distortion.hpp"
+#include "lens_shading.hpp"
+
+// Function constant indices, must match the declarations in demosaic.metal
+enum FunctionConstantIndex {
+    kBayerPatternConstant = 0,
+    kLensShadingConstant = 1,
+    kPCAComponentsConstant = 2,
+    kColorLutConstant = 3,
+    kLumaOutputConstant = 4,
+    kDisplayOutputConstant = 5,
+    kThumbnailOutputConstant = 6,
+    kFusedProjectionConstant = 7,
+    kInlineHighlightsConstant = 8,
+    kFusedSubtractionConstant = 9,
+    kYCbCrOutputConstant = 10,
+    kYCbCrInputConstant = 11,
+};
+
+inline FunctionConstants bayerPatternConstants(BayerPattern bayerPattern) {
+    return FunctionConstants().set(kBayerPatternConstant, (int) bayerPattern);
+}
+
+// Lens shading of an image processed by the pipeline: the frame's gain map and the transform from the image's pixel
+// positions to the map's normalized coordinates, see lensShadingGain in demosaic.metal. A disabled lens shading binds a
+// unity map, the specialized kernels skip it.
+struct LensShading {
+    const gls::mtl_image_2d<gls::pixel_float4>* gainMap = nullptr;
+    simd::float4 geometry = { 0, 0, 0, 0 };
+    bool enabled = false;
+
+    // The lens shading of a level of an image pyramid, scale is the level's downsampling factor
+    LensShading downsampled(float scale) const {
+        return { gainMap, simd::float4 { geometry.x * scale, geometry.y * scale, geometry.z, geometry.w }, enabled };
+    }
+};
+
+// Gain map geometry of a region of the frame starting at regionOrigin, downsampled by scale: the map coordinates of
+// the image position p are p * geometry.xy + geometry.zw
+inline simd::float4 lensShadingGeometry(const gls::size& frameSize, const gls::point& regionOrigin = { 0, 0 }, float scale = 1) {
+    return simd::float4 { scale / frameSize.width, scale / frameSize.height,
+                          regionOrigin.x / (float) frameSize.width, regionOrigin.y / (float) frameSize.height };
+}
+
+// The noise subtraction of subtractNoiseImageKernel evaluated by the kernels reading the subtracted level, see
+// fusedSubtraction in demosaic.metal: the kernels take the level itself as their input, the coarser level, its denoised
+// version and the level's gradients are bound from here. Default constructed it is disabled.
+struct SubtractNoiseSource {
+    // Mirrors SubtractNoiseParameters in demosaic.metal
+    struct Parameters {
+        float lumaWeight = 1;
+        float sharpening = 1;
+        simd::float2 nlf = 0;
+    };
+
+    const gls::mtl_image_2d<gls::pixel_float4>* inputImage1 = nullptr;
+    const gls::mtl_image_2d<gls::pixel_float4>* inputImageDenoised1 = nullptr;
+    const gls::mtl_image_2d<gls::pixel_float2>* gradientImage = nullptr;
+    Parameters parameters;
+
+    bool enabled() const {
+        return inputImage1 != nullptr;
+    }
+
+    FunctionConstants functionConstants() const {
+        return FunctionConstants().set(kFusedSubtractionConstant, enabled());
+    }
+
+    MTL::Texture* inputTexture1() const {
+        return inputImage1 ? inputImage1->texture() : nullptr;
+    }
+
+    MTL::Texture* inputTextureDenoised1() const {
+        return inputImageDenoised1 ? inputImageDenoised1->texture() : nullptr;
+    }
+
+    MTL::Texture* gradientTexture() const {
+        return gradientImage ? gradientImage->texture() : nullptr;
+    }
+};
+
+// The lens shading gain map texture of the current camera, built on the CPU from the DNG gain maps or from the
+// calibration's radial falloff and only rebuilt when the camera or the frame size (the crop) change. A few thousand
+// texels replace the per-pixel falloff evaluation, and non-radial shading can be corrected.
+class LensShadingMap {
+    MTL::Device* _device;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _gainMap;
+    bool _enabled = false;
+
+    // What the map was built from
+    gls::size _frameSize = { 0, 0 };
+    float _lensShadingCorrection = 0;
+    std::shared_ptr<const LensShadingGainMap> _dngGainMap;
+
+    // A new texture every time, the command buffers in flight retain the previous one
+    void upload(const LensShadingGainMap& map) {
+        gls::GPUMemoryTracker::Scope scope("LensShadingMap");
+        _gainMap = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_device, map.width, map.height);
+        _gainMap->apply([&](gls::pixel_float4* p, int x, int y) {
+            const auto& gains = map(x, y);
+            for (int c = 0; c < 4; c++) {
+                (*p)[c] = gains[c];
+            }
+        });
+    }
+
+public:
+    LensShadingMap(MTL::Device* device) : _device(device) {
+        upload(LensShadingGainMap(1, 1));
+    }
+
+    void update(const gls::size& frameSize, float lensShadingCorrection,
+                const std::shared_ptr<const LensShadingGainMap>& dngGainMap) {
+        if (frameSize == _frameSize && lensShadingCorrection == _lensShadingCorrection && dngGainMap == _dngGainMap) {
+            return;
+        }
+        _frameSize = frameSize;
+        _lensShadingCorrection = lensShadingCorrection;
+        _dngGainMap = dngGainMap;
+
+        _enabled = dngGainMap || lensShadingCorrection > 0;
+        upload(dngGainMap ? *dngGainMap : _enabled ? LensShadingGainMap::radial(frameSize, lensShadingCorrection)
+                                                   : LensShadingGainMap(1, 1));
+    }
+
+    LensShading lensShading(const simd::float4& geometry) const {
+        return { _gainMap.get(), geometry, _enabled };
+    }
+};
+
+// Bilinear Gaussian weights buffers cached for the lifetime of the process and shared by all the kernel instances,
+// so that building a RawConverter doesn't rerun KernelOptimizeBilinear2d. The buffers are never written after creation.
+inline gls::Buffer<std::array<float, 3>> gaussianKernelBilinearWeightsBuffer(MTL::Device* device, float radius) {
+    static std::mutex cacheMutex;
+    static std::map<std::pair<MTL::Device*, float>, gls::Buffer<std::array<float, 3>>> cache;
+
+    std::lock_guard<std::mutex> guard(cacheMutex);
+    const auto key = std::make_pair(device, radius);
+    auto entry = cache.find(key);
+    if (entry == cache.end()) {
+        entry = cache.emplace(key, gls::Buffer<std::array<float, 3>>(device, gaussianKernelBilinearWeights(radius))).first;
+    }
+    return entry->second;
+}
 
 struct scaleRawDataKernel {
-    Kernel<MTL::Texture*,     // rawImage
+    SpecializedKernel<MTL::Texture*,     // rawImage
            MTL::Texture*,     // scaledRawImage
-           int,               // bayerPattern
-           simd::half4,       // scaleMul
-           half,              // blackLevel
-           half               // lensShadingCorrection
+           PackedArguments<int,           // bayerPattern
+                           simd::half4,   // scaleMul
+                           half,          // blackLevel
+                           simd::float4   // lensShadingGeometry
+           >,                 // ScaleRawDataArguments
+           MTL::Texture*      // lensShadingMap
     > kernel;
 
     scaleRawDataKernel(MetalContext* context) : kernel(context, "scaleRawData") { }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
                      gls::mtl_image_2d<gls::pixel_float>* scaledRawImage, BayerPattern bayerPattern,
-                     gls::Vector<4> scaleMul, float blackLevel, float lensShadingCorrection) const {
-        kernel(context, /*gridSize=*/ MTL::Size(scaledRawImage->width / 2, scaledRawImage->height / 2, 1),
-               rawImage.texture(), scaledRawImage->texture(), bayerPattern,
-               simd::half4 { (half) scaleMul[0], (half) scaleMul[1], (half) scaleMul[2], (half) scaleMul[3] },
-               blackLevel, lensShadingCorrection);
+                     gls::Vector<4> scaleMul, float blackLevel, const LensShading& lensShading) const {
+        const auto functionConstants = bayerPatternConstants(bayerPattern).set(kLensShadingConstant, lensShading.enabled);
+
+        kernel[functionConstants](context, /*gridSize=*/ MTL::Size(scaledRawImage->width / 2, scaledRawImage->height / 2, 1),
+               rawImage.texture(), scaledRawImage->texture(),
+               { (int) bayerPattern, simd::half4 { (half) scaleMul[0], (half) scaleMul[1], (half) scaleMul[2], (half) scaleMul[3] },
+                 (half) blackLevel, lensShading.geometry },
+               lensShading.gainMap->texture());
     }
 };
 
-struct rawImageSobelKernel {
-    Kernel<MTL::Texture*,  // rawImage
-           MTL::Texture*   // gradientImage
+// Packed raw upload, see PackedRawImage
+struct unpackRawDataKernel {
+    Kernel<MTL::Buffer*,      // packedData
+           MTL::Texture*,     // rawImage
+           int,               // bitsPerSample
+           uint32_t,          // rowBytes
+           bool               // littleEndian
     > kernel;
 
-    rawImageSobelKernel(MetalContext* context) : kernel(context, "rawImageSobel") { }
+    unpackRawDataKernel(MetalContext* context) : kernel(context, "unpackRawData") { }
 
-    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& rawImage,
-                     gls::mtl_image_2d<gls::pixel_float4>* gradientImage) const {
-        kernel(context, /*gridSize=*/ MTL::Size(gradientImage->width, gradientImage->height, 1),
-               rawImage.texture(),
-               gradientImage->texture());
+    void operator() (MetalContext* context, const gls::Buffer<uint8_t>& packedData, const PackedRawImage& packed,
+                     gls::mtl_image_2d<gls::luma_pixel_16>* rawImage) const {
+        assert(rawImage->width == packed.width && rawImage->height == packed.height);
+        assert(packedData.size() >= packed.payloadBytes());
+
+        kernel(context, /*gridSize=*/ MTL::Size(rawImage->width, rawImage->height, 1),
+               packedData.buffer(), rawImage->texture(), packed.bitsPerSample, (uint32_t) packed.rowBytes,
+               packed.littleEndian);
     }
 };
 
-struct gaussianBlurSobelImageKernel {
-    Kernel<MTL::Texture*,  // rawImage
-           MTL::Texture*,  // sobelImage
-           int,            // samples1
-           MTL::Buffer*,   // weights1
-           int,            // samples2
-           MTL::Buffer*,   // weights2
-           simd::float2,   // rawVariance
-           MTL::Texture*   // outputImage
+// Fused scaleRawData, raw Sobel and gradient blur, see rawFrontEnd in demosaic.metal
+struct rawFrontEndKernel {
+    SpecializedKernel<MTL::Texture*,     // rawImage
+           MTL::Texture*,     // scaledRawImage
+           MTL::Texture*,     // gradientImage
+           int,               // bayerPattern
+           simd::half4,       // scaleMul
+           half,              // blackLevel
+           MTL::Texture*,     // lensShadingMap
+           int,               // samples1
+           MTL::Buffer*,      // weights1
+           int,               // samples2
+           MTL::Buffer*,      // weights2
+           simd::float2,      // rawVariance
+           simd::float4       // lensShadingGeometry
     > kernel;
 
-    gls::Buffer<std::array<float, 3>> weightsBuffer1, weightsBuffer2;
+    // Must match kFrontEndTile and kFrontEndSobelHalo in demosaic.metal
+    static constexpr int kTileSize = 16;
+    static constexpr int kSobelHalo = 6;
 
-    gaussianBlurSobelImageKernel(MetalContext* context, float radius1, float radius2) :
-    kernel(context, "sampledConvolutionSobel"),
-    weightsBuffer1(context->device(), gaussianKernelBilinearWeights(radius1)),
-    weightsBuffer2(context->device(), gaussianKernelBilinearWeights(radius2))
-    { }
+    std::optional<gls::Buffer<std::array<float, 3>>> weightsBuffer1, weightsBuffer2;
 
-    void operator() (MetalContext* context,
-                     const gls::mtl_image_2d<gls::pixel_float>& rawImage,
-                     const gls::mtl_image_2d<gls::pixel_float4>& sobelImage,
-                     std::array<float, 2> rawNoiseModel,
-                     gls::mtl_image_2d<gls::pixel_float2>* outputImage) const {
-        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
-               rawImage.texture(), sobelImage.texture(),
-               (int) weightsBuffer1.size(), weightsBuffer1.buffer(),
-               (int) weightsBuffer2.size(), weightsBuffer2.buffer(),
-               simd::float2 { rawNoiseModel[0], rawNoiseModel[1] },
-               outputImage->texture());
+    static gls::Buffer<std::array<float, 3>> checkTileHalo(const gls::Buffer<std::array<float, 3>>& weights) {
+        for (int i = 0; i < (int) weights.size(); i++) {
+            const auto& w = weights.data()[i];
+            if (std::abs(w[1]) > kSobelHalo - 1 || std::abs(w[2]) > kSobelHalo - 1) {
+                throw std::runtime_error("rawFrontEndKernel: blur radius exceeds the tile halo");
+            }
+        }
+        return weights;
+    }
+
+    rawFrontEndKernel(MetalContext* context, float radius1, float radius2) : kernel(context, "rawFrontEnd") {
+        setBlurRadii(context, radius1, radius2);
+    }
+
+    // The command buffers already encoded keep the previous weights
+    void setBlurRadii(MetalContext* context, float radius1, float radius2) {
+        weightsBuffer1.emplace(checkTileHalo(gaussianKernelBilinearWeightsBuffer(context->device(), radius1)));
+        weightsBuffer2.emplace(checkTileHalo(gaussianKernelBilinearWeightsBuffer(context->device(), radius2)));
+    }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                     gls::mtl_image_2d<gls::pixel_float>* scaledRawImage, BayerPattern bayerPattern,
+                     gls::Vector<4> scaleMul, float blackLevel, const LensShading& lensShading,
+                     std::array<float, 2> rawNoiseModel, gls::mtl_image_2d<gls::pixel_float2>* gradientImage) const {
+        const auto functionConstants = bayerPatternConstants(bayerPattern).set(kLensShadingConstant, lensShading.enabled);
+
+        // The kernel derives its tile origin from the threadgroup position. The grid covers the raw image, with a
+        // half resolution gradientImage the blur is sampled half a pixel off the tile grid, still inside the halo.
+        kernel[functionConstants](context, /*gridSize=*/ MTL::Size(scaledRawImage->width, scaledRawImage->height, 1),
+               /*threadGroupSize=*/ MTL::Size(kTileSize, kTileSize, 1),
+               rawImage.texture(), scaledRawImage->texture(), gradientImage->texture(), bayerPattern,
+               simd::half4 { (half) scaleMul[0], (half) scaleMul[1], (half) scaleMul[2], (half) scaleMul[3] },
+               blackLevel, lensShading.gainMap->texture(),
+               (int) weightsBuffer1->size(), weightsBuffer1->buffer(),
+               (int) weightsBuffer2->size(), weightsBuffer2->buffer(),
+               simd::float2 { rawNoiseModel[0], rawNoiseModel[1] }, lensShading.geometry);
     }
 };
 
@@ -108,7 +301,7 @@ struct hfNoiseTransferImageKernel {
 
     hfNoiseTransferImageKernel(MetalContext* context, float radius) :
     kernel(context, "hfNoiseTransferImage"),
-    weightsBuffer(context->device(), gaussianKernelBilinearWeights(radius))
+    weightsBuffer(gaussianKernelBilinearWeightsBuffer(context->device(), radius))
     { }
 
     void operator() (MetalContext* context,
@@ -121,15 +314,78 @@ struct hfNoiseTransferImageKernel {
     }
 };
 
+struct Matrix3x3 {
+    simd::float3 m[3];
+
+    Matrix3x3(const gls::Matrix<3, 3>& transform) {
+        m[0] = {transform[0][0], transform[0][1], transform[0][2]};
+        m[1] = {transform[1][0], transform[1][1], transform[1][2]};
+        m[2] = {transform[2][0], transform[2][1], transform[2][2]};
+    }
+};
+
+// The warp of registerImage and registerBayerImage: the output pixel is first moved by the lens distortion model,
+// if any, then mapped by the homography, so that correcting the distortion costs no extra resampling of the frame.
+// Make sure this struct is in sync with the declaration in SURF.metal
+struct WarpTransform {
+    Matrix3x3 homography;
+    simd::float4 radial = { 1, 0, 0, 0 };
+    simd::float2 tangential = { 0, 0 };
+    simd::float2 center = { 0, 0 };     // Pixels
+    float radius = 1;                   // Distance from the center to the farthest corner, pixels
+    int lensCorrection = false;
+
+    WarpTransform(const gls::Matrix<3, 3>& homography) : homography(homography) { }
+
+    // The distortion model is evaluated in the coordinates of an image of the given size
+    WarpTransform(const gls::Matrix<3, 3>& homography, const std::optional<LensDistortion>& distortion,
+                  const gls::size& size) : homography(homography) {
+        if (distortion && !distortion->isIdentity()) {
+            radial = { distortion->radial[0], distortion->radial[1], distortion->radial[2], distortion->radial[3] };
+            tangential = { distortion->tangential[0], distortion->tangential[1] };
+            center = { distortion->center[0] * (size.width - 1), distortion->center[1] * (size.height - 1) };
+            const float dx = std::max(center.x, size.width - 1 - center.x);
+            const float dy = std::max(center.y, size.height - 1 - center.y);
+            radius = std::max(std::sqrt(dx * dx + dy * dy), 1.0f);
+            lensCorrection = true;
+        }
+    }
+};
+
+// The cells of registerImageMesh, see gls::MeshHomography.
+// Make sure this struct is in sync with the declaration in SURF.metal
+struct MeshWarp {
+    static constexpr int kMaxCells = 64;
+
+    simd::float3 cells[kMaxCells][3];
+    simd::int2 meshSize;
+    simd::float2 cellSize;     // Pixels
+
+    // The row major homographies of a columns x rows mesh over an image of the given size
+    MeshWarp(const std::vector<gls::Matrix<3, 3>>& homographies, int columns, int rows, const gls::size& imageSize) {
+        if (columns * rows > kMaxCells || (int) homographies.size() != columns * rows) {
+            throw std::runtime_error("MeshWarp: invalid mesh size");
+        }
+        for (int i = 0; i < (int) homographies.size(); i++) {
+            const auto& homography = homographies[i];
+            for (int j = 0; j < 3; j++) {
+                cells[i][j] = { homography[j][0], homography[j][1], homography[j][2] };
+            }
+        }
+        meshSize = { columns, rows };
+        cellSize = { imageSize.width / (float) columns, imageSize.height / (float) rows };
+    }
+};
+
 struct demosaicImageKernel {
-    Kernel<MTL::Texture*,  // rawImage
+    SpecializedKernel<MTL::Texture*,  // rawImage
            MTL::Texture*,  // gradientImage
            MTL::Texture*,  // greenImage
            int,            // bayerPattern
            simd::float2    // greenVariance
     > interpolateGreenKernel;
 
-    Kernel<MTL::Texture*,  // rawImage
+    SpecializedKernel<MTL::Texture*,  // rawImage
            MTL::Texture*,  // greenImage
            MTL::Texture*,  // gradientImage
            MTL::Texture*,  // rgbImage
@@ -138,25 +394,89 @@ struct demosaicImageKernel {
            simd::float2    // blueVariance
     > interpolateRedBlueKernel;
 
-    Kernel<MTL::Texture*,  // rgbImageIn
+    SpecializedKernel<MTL::Texture*,  // rgbImageIn
            MTL::Texture*,  // gradientImage
            MTL::Texture*,  // rgbImageOut
            int,            // bayerPattern
            simd::float2,   // redVariance
-           simd::float2    // blueVariance
+           simd::float2,   // blueVariance
+           float,          // clip
+           MTL::Buffer*,   // clippedPixels
+           Matrix3x3       // ycbcrTransform
     > interpolateRedBlueAtGreenKernel;
 
+    SpecializedKernel<MTL::Texture*,  // rawImage
+           MTL::Texture*,  // gradientImage
+           MTL::Texture*,  // rgbImage
+           int,            // bayerPattern
+           simd::float2,   // redVariance
+           simd::float2,   // greenVariance
+           simd::float2,   // blueVariance
+           float,          // clip
+           MTL::Buffer*,   // clippedPixels
+           Matrix3x3       // ycbcrTransform
+    > demosaicTiledKernel;
+
+    // Must match kDemosaicTile in demosaic.metal
+    static constexpr int kTileSize = 16;
+
+    // Highlights reconstruction as the RGB output is written, in place of a blendHighlightsImageKernel pass: the
+    // pixels above clip are blended and added to the uint32_t count in clippedPixels
+    struct InlineHighlights {
+        float clip;
+        MTL::Buffer* clippedPixels;
+    };
+
+    // With ycbcrTransform the output is converted to YCbCr for the denoiser as it is written, after the highlights
+    // blending, in place of a transformImageKernel pass
+    static FunctionConstants outputConstants(BayerPattern bayerPattern, const InlineHighlights* highlights,
+                                             const gls::Matrix<3, 3>* ycbcrTransform) {
+        return bayerPatternConstants(bayerPattern).set(kInlineHighlightsConstant, highlights != nullptr)
+                                                  .set(kYCbCrOutputConstant, ycbcrTransform != nullptr);
+    }
+
+    static Matrix3x3 outputTransform(const gls::Matrix<3, 3>* ycbcrTransform) {
+        return Matrix3x3(ycbcrTransform ? *ycbcrTransform : gls::Matrix<3, 3>::identity());
+    }
+
     demosaicImageKernel(MetalContext* context) :
         interpolateGreenKernel(context, "interpolateGreen"),
         interpolateRedBlueKernel(context, "interpolateRedBlue"),
-        interpolateRedBlueAtGreenKernel(context, "interpolateRedBlueAtGreen") { }
+        interpolateRedBlueAtGreenKernel(context, "interpolateRedBlueAtGreen"),
+        demosaicTiledKernel(context, "demosaicTiled") { }
+
+    // Single pass variant, doesn't use the green and the temporary RGB images
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& rawImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                     gls::mtl_image_2d<gls::pixel_float4>* rgbImageOut,
+                     BayerPattern bayerPattern, std::array<gls::Vector<2>, 3> rawVariance,
+                     const InlineHighlights* highlights = nullptr, const gls::Matrix<3, 3>* ycbcrTransform = nullptr) const {
+        assert(rawImage.size() == gradientImage.size());
+        assert(rawImage.size() == rgbImageOut->size());
+        assert(rawImage.width % 2 == 0 && rawImage.height % 2 == 0);
+
+        const auto& redVariance = rawVariance[0];
+        const auto& greenVariance = rawVariance[1];
+        const auto& blueVariance = rawVariance[2];
+
+        // The kernel derives its tile origin from the threadgroup position
+        demosaicTiledKernel[outputConstants(bayerPattern, highlights, ycbcrTransform)](context,
+                            /*gridSize=*/ MTL::Size(rgbImageOut->width, rgbImageOut->height, 1),
+                            /*threadGroupSize=*/ MTL::Size(kTileSize, kTileSize, 1),
+                            rawImage.texture(), gradientImage.texture(), rgbImageOut->texture(), bayerPattern,
+                            simd::float2 {redVariance[0], redVariance[1]}, simd::float2 {greenVariance[0], greenVariance[1]},
+                            simd::float2 {blueVariance[0], blueVariance[1]},
+                            highlights ? highlights->clip : 0.0f, highlights ? highlights->clippedPixels : nullptr,
+                            outputTransform(ycbcrTransform));
+    }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& rawImage,
                      const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
                      gls::mtl_image_2d<gls::pixel_float>* greenImage,
                      gls::mtl_image_2d<gls::pixel_float4>* rgbImageTmp,
                      gls::mtl_image_2d<gls::pixel_float4>* rgbImageOut,
-                     BayerPattern bayerPattern, std::array<gls::Vector<2>, 3> rawVariance) const {
+                     BayerPattern bayerPattern, std::array<gls::Vector<2>, 3> rawVariance,
+                     const InlineHighlights* highlights = nullptr, const gls::Matrix<3, 3>* ycbcrTransform = nullptr) const {
         assert(rawImage.size() == gradientImage.size());
         assert(rawImage.size() == greenImage->size());
         assert(rawImage.size() == rgbImageTmp->size());
@@ -166,39 +486,46 @@ struct demosaicImageKernel {
         const auto& greenVariance = rawVariance[1];
         const auto& blueVariance = rawVariance[2];
 
-        interpolateGreenKernel(context, /*gridSize=*/ MTL::Size(greenImage->width, greenImage->height, 1),
+        const auto functionConstants = bayerPatternConstants(bayerPattern);
+
+        interpolateGreenKernel[functionConstants](context, /*gridSize=*/ MTL::Size(greenImage->width / 2, greenImage->height / 2, 1),
                                rawImage.texture(), gradientImage.texture(), greenImage->texture(),
                                bayerPattern, simd::float2 {greenVariance[0], greenVariance[1]});
 
-        interpolateRedBlueKernel(context, /*gridSize=*/ MTL::Size(rgbImageTmp->width / 2, rgbImageTmp->height / 2, 1),
+        interpolateRedBlueKernel[functionConstants](context, /*gridSize=*/ MTL::Size(rgbImageTmp->width / 2, rgbImageTmp->height / 2, 1),
                                  rawImage.texture(), greenImage->texture(), gradientImage.texture(), rgbImageTmp->texture(), bayerPattern,
                                  simd::float2 {redVariance[0], redVariance[1]}, simd::float2 {blueVariance[0], blueVariance[1]});
 
-        interpolateRedBlueAtGreenKernel(context, /*gridSize=*/ MTL::Size(rgbImageOut->width / 2, rgbImageOut->height / 2, 1),
+        interpolateRedBlueAtGreenKernel[outputConstants(bayerPattern, highlights, ycbcrTransform)](context,
+                                        /*gridSize=*/ MTL::Size(rgbImageOut->width / 2, rgbImageOut->height / 2, 1),
                                         rgbImageTmp->texture(), gradientImage.texture(), rgbImageOut->texture(), bayerPattern,
-                                        simd::float2 {redVariance[0], redVariance[1]}, simd::float2 {blueVariance[0], blueVariance[1]});
+                                        simd::float2 {redVariance[0], redVariance[1]}, simd::float2 {blueVariance[0], blueVariance[1]},
+                                        highlights ? highlights->clip : 0.0f, highlights ? highlights->clippedPixels : nullptr,
+                                        outputTransform(ycbcrTransform));
     }
 };
 
 struct bayerToRawRGBAKernel {
-    Kernel<MTL::Texture*,  // rawImage
+    SpecializedKernel<MTL::Texture*,  // rawImage
            MTL::Texture*,  // rgbaImage
            int             // bayerPattern
     > kernel;
 
     bayerToRawRGBAKernel(MetalContext* context) : kernel(context, "bayerToRawRGBA") { }
 
-    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& rawImage,
+    // Works on the scaled raw data as well as on the sensor's luma_pixel_16 data
+    template <typename T>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& rawImage,
                      gls::mtl_image_2d<gls::pixel_float4>* rgbaImage, BayerPattern bayerPattern) const {
         assert(rawImage.width == 2 * rgbaImage->width && rawImage.height == 2 * rgbaImage->height);
 
-        kernel(context, /*gridSize=*/ MTL::Size(rgbaImage->width, rgbaImage->height, 1), rawImage.texture(),
+        kernel[bayerPatternConstants(bayerPattern)](context, /*gridSize=*/ MTL::Size(rgbaImage->width, rgbaImage->height, 1), rawImage.texture(),
                rgbaImage->texture(), bayerPattern);
     }
 };
 
 struct rawRGBAToBayerKernel {
-    Kernel<MTL::Texture*,  // rgbaImage
+    SpecializedKernel<MTL::Texture*,  // rgbaImage
            MTL::Texture*,  // rawImage
            int             // bayerPattern
     > kernel;
@@ -209,11 +536,62 @@ struct rawRGBAToBayerKernel {
                      gls::mtl_image_2d<gls::pixel_float>* rawImage, BayerPattern bayerPattern) const {
         assert(rawImage->width == 2 * rgbaImage.width && rawImage->height == 2 * rgbaImage.height);
 
-        kernel(context, /*gridSize=*/ MTL::Size(rgbaImage.width, rgbaImage.height, 1), rgbaImage.texture(),
+        kernel[bayerPatternConstants(bayerPattern)](context, /*gridSize=*/ MTL::Size(rgbaImage.width, rgbaImage.height, 1), rgbaImage.texture(),
                rawImage->texture(), bayerPattern);
     }
 };
 
+// Half resolution Bayer data, for outputs not needing the sensor's resolution
+struct binBayerImageKernel {
+    Kernel<MTL::Texture*,  // rawImage
+           MTL::Texture*   // binnedImage
+    > kernel;
+
+    binBayerImageKernel(MetalContext* context) : kernel(context, "binBayerImage") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                     gls::mtl_image_2d<gls::luma_pixel_16>* binnedImage) const {
+        assert(binnedImage->width == 2 * (rawImage.width / 4) && binnedImage->height == 2 * (rawImage.height / 4));
+
+        kernel(context, /*gridSize=*/ MTL::Size(binnedImage->width / 2, binnedImage->height / 2, 1),
+               rawImage.texture(), binnedImage->texture());
+    }
+};
+
+// Quad Bayer data to the standard Bayer front-end, see RawConverter::setQuadBayerMode
+struct binQuadBayerKernel {
+    Kernel<MTL::Texture*,  // rawImage
+           MTL::Texture*   // bayerImage
+    > kernel;
+
+    binQuadBayerKernel(MetalContext* context) : kernel(context, "binQuadBayer") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                     gls::mtl_image_2d<gls::luma_pixel_16>* bayerImage) const {
+        assert(bayerImage->width == 2 * (rawImage.width / 4) && bayerImage->height == 2 * (rawImage.height / 4));
+
+        kernel(context, /*gridSize=*/ MTL::Size(bayerImage->width, bayerImage->height, 1),
+               rawImage.texture(), bayerImage->texture());
+    }
+};
+
+struct remosaicQuadBayerKernel {
+    SpecializedKernel<MTL::Texture*,  // rawImage
+           MTL::Texture*,  // bayerImage
+           int             // bayerPattern
+    > kernel;
+
+    remosaicQuadBayerKernel(MetalContext* context) : kernel(context, "remosaicQuadBayer") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                     gls::mtl_image_2d<gls::luma_pixel_16>* bayerImage, BayerPattern bayerPattern) const {
+        assert(bayerImage->size() == rawImage.size());
+
+        kernel[bayerPatternConstants(bayerPattern)](context, /*gridSize=*/ MTL::Size(bayerImage->width, bayerImage->height, 1),
+               rawImage.texture(), bayerImage->texture(), bayerPattern);
+    }
+};
+
 struct crossDenoiseRawRGBAImageKernel {
     Kernel<MTL::Texture*,  // inputImage
            simd::half4,    // rawVariance
@@ -252,6 +630,39 @@ struct despeckleRawRGBAImageKernel {
     }
 };
 
+// Fused bayerToRawRGBA, despeckleRawRGBAImage, crossDenoiseRawRGBAImage and rawRGBAToBayer, see highNoiseRawDenoise
+// in demosaic.metal. The output can't be the input image, the tiles read the neighbouring tiles' halos.
+struct highNoiseRawDenoiseKernel {
+    SpecializedKernel<MTL::Texture*,  // rawImage
+           MTL::Texture*,  // gradientImage
+           MTL::Texture*,  // denoisedImage
+           int,            // bayerPattern
+           simd::float4,   // rawVariance
+           float           // strength
+    > kernel;
+
+    // Must match kRawDenoiseTile in demosaic.metal
+    static constexpr int kTileSize = 16;
+
+    highNoiseRawDenoiseKernel(MetalContext* context) : kernel(context, "highNoiseRawDenoise") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& rawImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, BayerPattern bayerPattern,
+                     const gls::Vector<4>& rawVariance, float strength,
+                     gls::mtl_image_2d<gls::pixel_float>* denoisedImage) const {
+        assert(rawImage.width == denoisedImage->width && rawImage.height == denoisedImage->height);
+        assert(rawImage.texture() != denoisedImage->texture());
+
+        std::cout << "Denoising RAW image with strength: " << strength << std::endl;
+
+        // One thread per Bayer quad, the kernel derives its tile origin from the threadgroup position
+        kernel[bayerPatternConstants(bayerPattern)](context, /*gridSize=*/ MTL::Size(rawImage.width / 2, rawImage.height / 2, 1),
+               /*threadGroupSize=*/ MTL::Size(kTileSize, kTileSize, 1),
+               rawImage.texture(), gradientImage.texture(), denoisedImage->texture(), bayerPattern,
+               simd::float4 { rawVariance[0], rawVariance[1], rawVariance[2], rawVariance[3] }, strength);
+    }
+};
+
 struct blendHighlightsImageKernel {
     Kernel<MTL::Texture*,  // inputImage
            float,          // clip
@@ -268,16 +679,6 @@ struct blendHighlightsImageKernel {
     }
 };
 
-struct Matrix3x3 {
-    simd::float3 m[3];
-
-    Matrix3x3(const gls::Matrix<3, 3>& transform) {
-        m[0] = {transform[0][0], transform[0][1], transform[0][2]};
-        m[1] = {transform[1][0], transform[1][1], transform[1][2]};
-        m[2] = {transform[2][0], transform[2][1], transform[2][2]};
-    }
-};
-
 struct transformImageKernel {
     Kernel<MTL::Texture*,  // linearImage
            MTL::Texture*,  // rgbImage
@@ -292,6 +693,151 @@ struct transformImageKernel {
                rgbImage->texture(), transform);
     }
 
+    // Two channel images go through the upper left block of the transform, e.g. the identity copy of gradients
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float2>& inputImage,
+                     gls::mtl_image_2d<gls::pixel_float2>* outputImage, const gls::Matrix<3, 3>& transform) const {
+        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1), inputImage.texture(),
+               outputImage->texture(), transform);
+    }
+
+};
+
+// Consecutive pointwise stages fused into one pass at pipeline build time with function stitching: the chain is
+// the stage functions in demosaic.metal, in order, and the intermediate images between them go away.
+struct pointwiseChainKernel {
+    enum class Stage {
+        blendHighlights,    // Highlights reconstruction at parameters.clip, see blendHighlightsImageKernel
+        transform           // Color transform by parameters.transform, see transformImageKernel
+    };
+
+    // PointwiseParameters in demosaic.metal
+    struct Parameters {
+        Matrix3x3 transform;
+        float clip;
+    };
+
+    Kernel<MTL::Texture*,  // inputImage
+           MTL::Texture*,  // outputImage
+           Parameters      // parameters
+    > kernel;
+
+    static std::string stageFunction(Stage stage) {
+        switch (stage) {
+            case Stage::blendHighlights:
+                return "blendHighlightsStage";
+            case Stage::transform:
+                return "transformStage";
+        }
+        throw std::runtime_error("pointwiseChainKernel: unknown stage");
+    }
+
+    static std::vector<std::string> stageFunctions(const std::vector<Stage>& stages) {
+        std::vector<std::string> functions;
+        for (const auto stage : stages) {
+            functions.push_back(stageFunction(stage));
+        }
+        return functions;
+    }
+
+    pointwiseChainKernel(MetalContext* context, const std::vector<Stage>& stages) :
+        kernel(context->newStitchedPipelineState("pointwiseChain", "pointwiseStages", stageFunctions(stages)),
+               "pointwiseChain") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     gls::mtl_image_2d<gls::pixel_float4>* outputImage, const Parameters& parameters) const {
+        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1), inputImage.texture(),
+               outputImage->texture(), parameters);
+    }
+};
+
+// The same chains as a render pass of tile dispatches, one per stage: the pixels stay in the tiles' imageblocks from
+// the first stage to the last, the output image is written once when the pass ends. The stage pipelines don't depend
+// on the chain, there is no stitching at build time. Needs MetalContext::supportsTileShaders.
+struct pointwiseTileChainKernel {
+    using Stage = pointwiseChainKernel::Stage;
+    using Parameters = pointwiseChainKernel::Parameters;
+
+    pointwiseTileChainKernel(MetalContext* context, const std::vector<Stage>& stages) : _stages(stages) {
+        if (!context->supportsTileShaders()) {
+            throw std::runtime_error("pointwiseTileChainKernel: tile shaders are not supported");
+        }
+        if (stages.empty()) {
+            throw std::runtime_error("pointwiseTileChainKernel: no stages");
+        }
+    }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     gls::mtl_image_2d<gls::pixel_float4>* outputImage, const Parameters& parameters) {
+        MTL::Texture* target = outputImage->texture();
+        const auto& pipelines = pipelinesFor(context, target->pixelFormat());
+
+        // An in place chain loads its input with the pass, otherwise the first dispatch reads it
+        const bool inPlace = inputImage.texture() == target;
+        context->enqueueTilePass(target, /*loadTarget=*/ inPlace, [&](MTL::RenderCommandEncoder* encoder) {
+            const MTL::Size tileSize(encoder->tileWidth(), encoder->tileHeight(), 1);
+            if (!inPlace) {
+                encoder->setRenderPipelineState(pipelines.load.get());
+                encoder->setTileTexture(inputImage.texture(), 0);
+                encoder->dispatchThreadsPerTile(tileSize);
+            }
+            encoder->setTileBytes(&parameters, sizeof(parameters), 0);
+            for (const auto& stage : pipelines.stages) {
+                encoder->setRenderPipelineState(stage.get());
+                encoder->dispatchThreadsPerTile(tileSize);
+            }
+        });
+    }
+
+private:
+    struct Pipelines {
+        NS::SharedPtr<MTL::RenderPipelineState> load;
+        std::vector<NS::SharedPtr<MTL::RenderPipelineState>> stages;
+    };
+
+    const std::vector<Stage> _stages;
+    // The tile pipelines are specific to the render target's format, see texture_precision
+    std::map<MTL::PixelFormat, Pipelines> _pipelines;
+
+    static std::string tileFunction(Stage stage) {
+        switch (stage) {
+            case Stage::blendHighlights:
+                return "blendHighlightsTile";
+            case Stage::transform:
+                return "transformTile";
+        }
+        throw std::runtime_error("pointwiseTileChainKernel: unknown stage");
+    }
+
+    const Pipelines& pipelinesFor(MetalContext* context, MTL::PixelFormat pixelFormat) {
+        auto entry = _pipelines.find(pixelFormat);
+        if (entry == _pipelines.end()) {
+            Pipelines pipelines;
+            pipelines.load = context->newTilePipelineState("loadPointwiseTile", pixelFormat);
+            for (const auto stage : _stages) {
+                pipelines.stages.push_back(context->newTilePipelineState(tileFunction(stage), pixelFormat));
+            }
+            entry = _pipelines.emplace(pixelFormat, std::move(pipelines)).first;
+        }
+        return entry->second;
+    }
+};
+
+struct normalizeRGBToYCbCrKernel {
+    Kernel<MTL::Texture*,  // inputImage
+           MTL::Texture*,  // outputImage
+           simd::float3,   // scaleMul
+           float,          // blackLevel
+           Matrix3x3       // transform
+    > kernel;
+
+    normalizeRGBToYCbCrKernel(MetalContext* context) : kernel(context, "normalizeRGBToYCbCr") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     const gls::Vector<3>& scaleMul, float blackLevel, const gls::Matrix<3, 3>& transform,
+                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1), inputImage.texture(),
+               outputImage->texture(), simd::float3 { scaleMul[0], scaleMul[1], scaleMul[2] }, blackLevel, transform);
+    }
 };
 
 struct despeckleImageKernel {
@@ -301,6 +847,9 @@ struct despeckleImageKernel {
            MTL::Texture*   // outputImage
     > kernel;
 
+    // Must match kRankFilterTile in demosaic.metal
+    static constexpr int kTileSize = 16;
+
     despeckleImageKernel(MetalContext* context) : kernel(context, "despeckleLumaMedianChromaImage") { }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
@@ -309,7 +858,9 @@ struct despeckleImageKernel {
         simd::float3 cl_var_a = {var_a[0], var_a[1], var_a[2]};
         simd::float3 cl_var_b = {var_b[0], var_b[1], var_b[2]};
 
+        // The kernel derives its tile origin from the threadgroup position
         kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
+               /*threadGroupSize=*/ MTL::Size(kTileSize, kTileSize, 1),
                inputImage.texture(), cl_var_a, cl_var_b, outputImage->texture());
     }
 };
@@ -343,77 +894,320 @@ struct denoiseImageKernel {
 };
 
 struct blockMatchingDenoiseImageKernel {
-    Kernel<MTL::Texture*,  // inputImage
+    // BlockMatchingArguments in demosaic.metal
+    typedef PackedArguments<simd::float3,   // var_a
+                            simd::float3,   // var_b
+                            simd::float3,   // thresholdMultipliers
+                            float,          // chromaBoost
+                            float,          // gradientBoost
+                            float,          // gradientThreshold
+                            simd::float4    // lensShadingGeometry
+    > Arguments;
+
+    static Arguments arguments(const gls::Vector<3>& var_a, const gls::Vector<3>& var_b,
+                               const gls::Vector<3>& thresholdMultipliers, float chromaBoost, float gradientBoost,
+                               float gradientThreshold, const LensShading& lensShading) {
+        return { simd::float3 { var_a[0], var_a[1], var_a[2] },
+                 simd::float3 { var_b[0], var_b[1], var_b[2] },
+                 simd::float3 { thresholdMultipliers[0], thresholdMultipliers[1], thresholdMultipliers[2] },
+                 chromaBoost, gradientBoost, gradientThreshold, lensShading.geometry };
+    }
+
+    SpecializedKernel<MTL::Texture*,  // inputImage
            MTL::Texture*,  // gradientImage
            MTL::Texture*,  // pcaImage
-           simd::float3,   // var_a
-           simd::float3,   // var_b
-           simd::float3,   // thresholdMultipliers
-           float,          // chromaBoost
-           float,          // gradientBoost
-           float,          // gradientThreshold
-           float,          // lensShadingCorrection
-           MTL::Texture*   // outputImage
+           Arguments,      // BlockMatchingArguments
+           MTL::Texture*,  // lensShadingMap
+           MTL::Texture*,  // outputImage
+           MTL::Buffer*,   // pcaSpace
+           MTL::Texture*,  // inputImage1
+           MTL::Texture*,  // inputImageDenoised1
+           SubtractNoiseSource::Parameters  // subtraction
     > kernel;
 
+    // kBlockMatchingTile in demosaic.metal, the kernel caches its tile in threadgroup memory
+    static constexpr int kThreadGroupSize = 16;
+
     blockMatchingDenoiseImageKernel(MetalContext* context) : kernel(context, "blockMatchingDenoiseImage") { }
 
+    // The patch image holds 8 components in pixel<uint32_t, 4> or the first 4 in pixel<uint32_t, 2>. With an enabled
+    // subtraction the input is the level before subtractNoiseImage, the patch image is projected from the subtracted
+    // level by pcaProjectionKernel with the same subtraction.
+    template <typename P>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                     const gls::mtl_image_2d<P>& patchImage, const gls::Vector<3>& var_a,
+                     const gls::Vector<3>& var_b, const gls::Vector<3> thresholdMultipliers,
+                     float chromaBoost, float gradientBoost, float gradientThreshold, const LensShading& lensShading,
+                     int pcaComponents,
+                     gls::mtl_image_2d<gls::pixel_float4>* outputImage, const SubtractNoiseSource& subtraction = {}) const {
+        dispatch(context, inputImage, gradientImage, patchImage.texture(), /*pcaSpace=*/ nullptr, var_a, var_b,
+                 thresholdMultipliers, chromaBoost, gradientBoost, gradientThreshold, lensShading, pcaComponents,
+                 outputImage, subtraction);
+    }
+
+    // Projects the patches on pcaSpace in the same dispatch, see pcaProjectionKernel
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
                      const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
-                     const gls::mtl_image_2d<gls::pixel<uint32_t, 4>>& patchImage, const gls::Vector<3>& var_a,
+                     MTL::Buffer* pcaSpace, const gls::Vector<3>& var_a,
                      const gls::Vector<3>& var_b, const gls::Vector<3> thresholdMultipliers,
-                     float chromaBoost, float gradientBoost, float gradientThreshold, float lensShadingCorrection,
+                     float chromaBoost, float gradientBoost, float gradientThreshold, const LensShading& lensShading,
+                     int pcaComponents,
                      gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        dispatch(context, inputImage, gradientImage, /*patchImage=*/ nullptr, pcaSpace, var_a, var_b,
+                 thresholdMultipliers, chromaBoost, gradientBoost, gradientThreshold, lensShading, pcaComponents,
+                 outputImage, /*subtraction=*/ {});
+    }
 
-        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
-               inputImage.texture(), gradientImage.texture(), patchImage.texture(),
-               simd::float3 { var_a[0], var_a[1], var_a[2] },
-               simd::float3 { var_b[0], var_b[1], var_b[2] },
-               simd::float3 { thresholdMultipliers[0], thresholdMultipliers[1], thresholdMultipliers[2] },
-               chromaBoost, gradientBoost, gradientThreshold, lensShadingCorrection, outputImage->texture());
+private:
+    void dispatch(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                  const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, MTL::Texture* patchImage,
+                  MTL::Buffer* pcaSpace, const gls::Vector<3>& var_a, const gls::Vector<3>& var_b,
+                  const gls::Vector<3> thresholdMultipliers, float chromaBoost, float gradientBoost,
+                  float gradientThreshold, const LensShading& lensShading, int pcaComponents,
+                  gls::mtl_image_2d<gls::pixel_float4>* outputImage, const SubtractNoiseSource& subtraction) const {
+        // The fused projection reads its patches from the unsubtracted input
+        assert(!(pcaSpace && subtraction.enabled()));
+        const auto functionConstants = subtraction.functionConstants().set(kPCAComponentsConstant, pcaComponents)
+                                                                      .set(kFusedProjectionConstant, pcaSpace != nullptr);
+
+        // Whole threadgroups, the kernel derives its tile origin from the threadgroup position
+        const int groupsX = (outputImage->width + kThreadGroupSize - 1) / kThreadGroupSize;
+        const int groupsY = (outputImage->height + kThreadGroupSize - 1) / kThreadGroupSize;
+
+        kernel[functionConstants](context, /*gridSize=*/ MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1),
+               /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+               inputImage.texture(), gradientImage.texture(), patchImage,
+               arguments(var_a, var_b, thresholdMultipliers, chromaBoost, gradientBoost, gradientThreshold, lensShading),
+               lensShading.gainMap->texture(), outputImage->texture(), pcaSpace, subtraction.inputTexture1(),
+               subtraction.inputTextureDenoised1(), subtraction.parameters);
     }
 };
 
-struct collectPatchesKernel {
-    Kernel<MTL::Texture*, // inputImage
-           MTL::Buffer*   // patches
+// blockMatchingDenoiseImage of a 4:2:0 level, the chroma is denoised at half resolution and interpolated back
+struct blockMatchingDenoiseImage420Kernel {
+    SpecializedKernel<MTL::Texture*,  // lumaImage
+           MTL::Texture*,  // chromaImage
+           MTL::Texture*,  // gradientImage
+           MTL::Texture*,  // pcaImage
+           blockMatchingDenoiseImageKernel::Arguments,
+           MTL::Texture*,  // lensShadingMap
+           MTL::Texture*,  // outputImage
+           MTL::Buffer*    // pcaSpace
     > kernel;
 
-    collectPatchesKernel(MetalContext* context) : kernel(context, "collectPatches") { }
+    static constexpr int kThreadGroupSize = blockMatchingDenoiseImageKernel::kThreadGroupSize;
 
-    void operator() (MetalContext* context,
-                     const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
-                     MTL::Buffer* patches) const {
+    blockMatchingDenoiseImage420Kernel(MetalContext* context) : kernel(context, "blockMatchingDenoiseImage420") { }
+
+    // The projected patches, see blockMatchingDenoiseImageKernel
+    template <typename P>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& lumaImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& chromaImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                     const gls::mtl_image_2d<P>& patchImage,
+                     const gls::Vector<3>& var_a, const gls::Vector<3>& var_b, const gls::Vector<3> thresholdMultipliers,
+                     float chromaBoost, float gradientBoost, float gradientThreshold, const LensShading& lensShading,
+                     int pcaComponents, gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        dispatch(context, lumaImage, chromaImage, gradientImage, patchImage.texture(), /*pcaSpace=*/ nullptr, var_a, var_b,
+                 thresholdMultipliers, chromaBoost, gradientBoost, gradientThreshold, lensShading, pcaComponents, outputImage);
+    }
 
-        kernel(context, /*gridSize=*/ MTL::Size(inputImage.width / 8, inputImage.height / 8, 1),
-               inputImage.texture(), patches);
+    // Projects the patches on pcaSpace in the same dispatch
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& lumaImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& chromaImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, MTL::Buffer* pcaSpace,
+                     const gls::Vector<3>& var_a, const gls::Vector<3>& var_b, const gls::Vector<3> thresholdMultipliers,
+                     float chromaBoost, float gradientBoost, float gradientThreshold, const LensShading& lensShading,
+                     int pcaComponents, gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        dispatch(context, lumaImage, chromaImage, gradientImage, /*patchImage=*/ nullptr, pcaSpace, var_a, var_b,
+                 thresholdMultipliers, chromaBoost, gradientBoost, gradientThreshold, lensShading, pcaComponents, outputImage);
+    }
+
+private:
+    void dispatch(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& lumaImage,
+                  const gls::mtl_image_2d<gls::pixel_float2>& chromaImage,
+                  const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, MTL::Texture* patchImage, MTL::Buffer* pcaSpace,
+                  const gls::Vector<3>& var_a, const gls::Vector<3>& var_b, const gls::Vector<3> thresholdMultipliers,
+                  float chromaBoost, float gradientBoost, float gradientThreshold, const LensShading& lensShading,
+                  int pcaComponents, gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        const auto functionConstants = FunctionConstants().set(kPCAComponentsConstant, pcaComponents)
+                                                          .set(kFusedProjectionConstant, pcaSpace != nullptr);
+
+        const int groupsX = (outputImage->width + kThreadGroupSize - 1) / kThreadGroupSize;
+        const int groupsY = (outputImage->height + kThreadGroupSize - 1) / kThreadGroupSize;
+
+        kernel[functionConstants](context, /*gridSize=*/ MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1),
+               /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+               lumaImage.texture(), chromaImage.texture(), gradientImage.texture(), patchImage,
+               blockMatchingDenoiseImageKernel::arguments(var_a, var_b, thresholdMultipliers, chromaBoost, gradientBoost,
+                                                          gradientThreshold, lensShading),
+               lensShading.gainMap->texture(), outputImage->texture(), pcaSpace);
     }
 };
 
-struct pcaProjectionKernel {
-    Kernel<MTL::Texture*,                         // inputImage
-           std::array<std::array<half, 8>, 25>,   // pcaSpace
-           MTL::Texture*                          // projectedImage
-    > kernel;
+// GPU PCA of the image's luma patches, see patchCovariance and pcaSolve in demosaic.metal
+struct pcaSpaceKernel {
+    SpecializedKernel<MTL::Texture*, // inputImage
+           MTL::Buffer*,  // partialSums
+           int,           // sampleStride
+           MTL::Texture*, // gradientImage
+           MTL::Texture*, // inputImage1
+           MTL::Texture*, // inputImageDenoised1
+           SubtractNoiseSource::Parameters  // subtraction
+    > patchCovariance;
+
+    // The same accumulation as a product of simdgroup matrices, on GPUs supporting them
+    SpecializedKernel<MTL::Texture*, // inputImage
+           MTL::Buffer*,  // partialSums
+           int,           // sampleStride
+           MTL::Texture*, // gradientImage
+           MTL::Texture*, // inputImage1
+           MTL::Texture*, // inputImageDenoised1
+           SubtractNoiseSource::Parameters  // subtraction
+    > patchCovarianceMatrix;
+
+    Kernel<MTL::Buffer*,  // partialSums
+           int,           // groups
+           int,           // samples
+           MTL::Buffer*,  // pcaSpace
+           float,         // driftThreshold
+           int,           // forceRefresh
+           MTL::Buffer*   // basisState
+    > pcaSolve;
+
+    struct pca_basis_state {
+        float capturedVariance;
+        uint32_t refreshes;
+    };
 
-    pcaProjectionKernel(MetalContext* context) : kernel(context, "pcaProjection") { }
+    // Must match kPatchCovarianceGroupSize and kPatchCovarianceEntries in demosaic.metal
+    static constexpr int kGroupSize = 16;
+    static constexpr int kEntries = 25 + 25 * 25;
 
-    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
-                     const std::array<std::array<half, 8>, 25>& pcaSpace,
-                     gls::mtl_image_2d<gls::pixel<uint32_t, 4>>* projectedImage) const {
+    pcaSpaceKernel(MetalContext* context) : patchCovariance(context, "patchCovariance"),
+        patchCovarianceMatrix(context, "patchCovarianceMatrix"), pcaSolve(context, "pcaSolve") { }
 
-        kernel(context, /*gridSize=*/ MTL::Size(inputImage.width, inputImage.height, 1),
-               inputImage.texture(), pcaSpace, projectedImage->texture());
+    // Default number of patches sampled per level, the covariance of the 25 patch values converges well before
+    static constexpr int kDefaultSampleBudget = 64 * 1024;
+
+    // Side of the stratification cells, at least 8 pixels and wide enough for the sample budget
+    static int sampleStride(const gls::size& imageSize, int sampleBudget) {
+        int stride = 8;
+        while ((size_t) (imageSize.width / stride) * (imageSize.height / stride) > std::max(sampleBudget, 1)) {
+            stride++;
+        }
+        return stride;
     }
-};
 
-struct subtractNoiseImageKernel {
-    Kernel<MTL::Texture*,  // inputImage
-           MTL::Texture*,  // inputImage1
-           MTL::Texture*,  // inputImageDenoised1
-           MTL::Texture*,  // gradientImage
-           float,          // luma_weight
-           float,          // sharpening
+    static MTL::Size samplesGrid(const gls::size& imageSize, int sampleStride) {
+        return MTL::Size(std::max(imageSize.width / sampleStride, 1), std::max(imageSize.height / sampleStride, 1), 1);
+    }
+
+    // Size of the partial sums buffer for an image, in floats
+    static size_t partialSumsSize(const gls::size& imageSize, int sampleBudget) {
+        const auto grid = samplesGrid(imageSize, sampleStride(imageSize, sampleBudget));
+        const size_t groups = ((grid.width + kGroupSize - 1) / kGroupSize) * ((grid.height + kGroupSize - 1) / kGroupSize);
+        return groups * kEntries;
+    }
+
+    // The basis in pcaSpace is only recomputed if forceRefresh is set or if its captured variance drifted by more
+    // than driftThreshold, the previous basis must be valid otherwise
+    // Only the first channel of the image is read, e.g. the luma of a 4:2:0 level. With an enabled subtraction the
+    // patches are sampled from the input with the noise of the coarser level subtracted.
+    template <typename T>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
+                     gls::Buffer<float>* partialSums, MTL::Buffer* pcaSpace, MTL::Buffer* basisState,
+                     float driftThreshold, bool forceRefresh, int sampleBudget = kDefaultSampleBudget,
+                     const SubtractNoiseSource& subtraction = {}) const {
+        const int stride = sampleStride(inputImage.size(), sampleBudget);
+        const auto grid = samplesGrid(inputImage.size(), stride);
+        const int groups = (int) (partialSumsSize(inputImage.size(), sampleBudget) / kEntries);
+        assert(partialSums->size() >= partialSumsSize(inputImage.size(), sampleBudget));
+
+        // patchCovariance derives the partial sums location from the threadgroup position
+        if (context->supportsSimdgroupMatrix()) {
+            // Whole threadgroups, the samples beyond the grid are zero
+            const auto groupsGrid = MTL::Size(((grid.width + kGroupSize - 1) / kGroupSize) * kGroupSize,
+                                              ((grid.height + kGroupSize - 1) / kGroupSize) * kGroupSize, 1);
+            patchCovarianceMatrix[subtraction.functionConstants()](context, /*gridSize=*/ groupsGrid,
+                            /*threadGroupSize=*/ MTL::Size(kGroupSize, kGroupSize, 1),
+                            inputImage.texture(), partialSums->buffer(), stride, subtraction.gradientTexture(),
+                            subtraction.inputTexture1(), subtraction.inputTextureDenoised1(), subtraction.parameters);
+        } else {
+            patchCovariance[subtraction.functionConstants()](context, /*gridSize=*/ grid,
+                            /*threadGroupSize=*/ MTL::Size(kGroupSize, kGroupSize, 1),
+                            inputImage.texture(), partialSums->buffer(), stride, subtraction.gradientTexture(),
+                            subtraction.inputTexture1(), subtraction.inputTextureDenoised1(), subtraction.parameters);
+        }
+        context->barrier();
+        pcaSolve(context, /*gridSize=*/ MTL::Size(32, 1, 1), /*threadGroupSize=*/ MTL::Size(32, 1, 1),
+                 partialSums->buffer(), groups, (int) (grid.width * grid.height), pcaSpace,
+                 driftThreshold, (int) forceRefresh, basisState);
+    }
+};
+
+struct pcaProjectionKernel {
+    SpecializedKernel<MTL::Texture*,  // inputImage
+           MTL::Buffer*,   // pcaSpace
+           MTL::Texture*,  // projectedImage
+           MTL::Texture*,  // gradientImage
+           MTL::Texture*,  // inputImage1
+           MTL::Texture*,  // inputImageDenoised1
+           SubtractNoiseSource::Parameters  // subtraction
+    > kernel;
+
+    // The projection of a threadgroup's patches as a product of simdgroup matrices, on GPUs supporting them
+    SpecializedKernel<MTL::Texture*,  // inputImage
+           MTL::Buffer*,   // pcaSpace
+           MTL::Texture*,  // projectedImage
+           MTL::Texture*,  // gradientImage
+           MTL::Texture*,  // inputImage1
+           MTL::Texture*,  // inputImageDenoised1
+           SubtractNoiseSource::Parameters  // subtraction
+    > matrixKernel;
+
+    // kProjectionTile in demosaic.metal, the subtracted luma of the tile is staged in threadgroup memory
+    static constexpr int kThreadGroupSize = 16;
+
+    pcaProjectionKernel(MetalContext* context) : kernel(context, "pcaProjection"), matrixKernel(context, "pcaProjectionMatrix") { }
+
+    // Only the first pcaComponents of the projection are computed, the others are zero. The patches are read from
+    // the image's first channel, the projection is pixel<uint32_t, 4> or pixel<uint32_t, 2> for at most 4 components.
+    // With an enabled subtraction the patches are projected from the input with the noise of the coarser level
+    // subtracted.
+    template <typename T, typename P>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
+                     MTL::Buffer* pcaSpace, int pcaComponents, gls::mtl_image_2d<P>* projectedImage,
+                     const SubtractNoiseSource& subtraction = {}) const {
+        assert(P::channels == 4 || pcaComponents <= 4);
+        const auto functionConstants = subtraction.functionConstants().set(kPCAComponentsConstant, pcaComponents);
+
+        const bool simdgroupMatrix = context->supportsSimdgroupMatrix();
+        if (subtraction.enabled() || simdgroupMatrix) {
+            // Whole threadgroups, the kernels derive their tile origin from the threadgroup position
+            const int groupsX = (inputImage.width + kThreadGroupSize - 1) / kThreadGroupSize;
+            const int groupsY = (inputImage.height + kThreadGroupSize - 1) / kThreadGroupSize;
+            (simdgroupMatrix ? matrixKernel : kernel)[functionConstants](context,
+                   /*gridSize=*/ MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1),
+                   /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+                   inputImage.texture(), pcaSpace, projectedImage->texture(), subtraction.gradientTexture(),
+                   subtraction.inputTexture1(), subtraction.inputTextureDenoised1(), subtraction.parameters);
+        } else {
+            kernel[functionConstants](context, /*gridSize=*/ MTL::Size(inputImage.width, inputImage.height, 1),
+                   inputImage.texture(), pcaSpace, projectedImage->texture(), /*gradientImage=*/ nullptr,
+                   /*inputImage1=*/ nullptr, /*inputImageDenoised1=*/ nullptr, subtraction.parameters);
+        }
+    }
+};
+
+struct subtractNoiseImageKernel {
+    Kernel<MTL::Texture*,  // inputImage
+           MTL::Texture*,  // inputImage1
+           MTL::Texture*,  // inputImageDenoised1
+           MTL::Texture*,  // gradientImage
+           float,          // luma_weight
+           float,          // sharpening
            simd::float2,   // nlf
            MTL::Texture*   // outputImage
     > kernel;
@@ -435,6 +1229,53 @@ struct subtractNoiseImageKernel {
 
 };
 
+// subtractNoiseImage to a 4:2:0 level, see PyramidProcessor::chroma420
+struct subtractNoiseImage420Kernel {
+    Kernel<MTL::Texture*,  // inputImage
+           MTL::Texture*,  // inputImage1
+           MTL::Texture*,  // inputImageDenoised1
+           MTL::Texture*,  // gradientImage
+           float,          // luma_weight
+           float,          // sharpening
+           simd::float2,   // nlf
+           MTL::Texture*,  // lumaImage
+           MTL::Texture*   // chromaImage
+    > kernel;
+
+    subtractNoiseImage420Kernel(MetalContext* context) : kernel(context, "subtractNoiseImage420") { }
+
+    // The chroma image is half the size of the luma, rounded up
+    void operator() (MetalContext* context,
+                     const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     const gls::mtl_image_2d<gls::pixel_float4>& inputImage1,
+                     const gls::mtl_image_2d<gls::pixel_float4>& inputImageDenoised1,
+                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                     float luma_weight, float sharpening, const gls::Vector<2>& nlf,
+                     gls::mtl_image_2d<gls::pixel_float>* lumaImage, gls::mtl_image_2d<gls::pixel_float2>* chromaImage) const {
+        assert(chromaImage->width == (lumaImage->width + 1) / 2 && chromaImage->height == (lumaImage->height + 1) / 2);
+        kernel(context, /*gridSize=*/ MTL::Size(chromaImage->width, chromaImage->height, 1),
+               inputImage.texture(), inputImage1.texture(), inputImageDenoised1.texture(),
+               gradientImage.texture(), luma_weight, sharpening, simd::float2 { nlf[0], nlf[1] },
+               lumaImage->texture(), chromaImage->texture());
+    }
+};
+
+struct mergeYCbCr420Kernel {
+    Kernel<MTL::Texture*,  // lumaImage
+           MTL::Texture*,  // chromaImage
+           MTL::Texture*   // outputImage
+    > kernel;
+
+    mergeYCbCr420Kernel(MetalContext* context) : kernel(context, "mergeYCbCr420") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& lumaImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& chromaImage,
+                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
+               lumaImage.texture(), chromaImage.texture(), outputImage->texture());
+    }
+};
+
 struct basicNoiseStatisticsKernel {
     Kernel<MTL::Texture*,   // inputImage
            MTL::Texture*    // statisticsImage
@@ -450,7 +1291,7 @@ struct basicNoiseStatisticsKernel {
 };
 
 struct basicRawNoiseStatisticsKernel {
-    Kernel<MTL::Texture*,   // rawImage
+    SpecializedKernel<MTL::Texture*,   // rawImage
            int,             // bayerPattern
            MTL::Texture*,   // meanImage
            MTL::Texture*    // varImage
@@ -462,11 +1303,176 @@ struct basicRawNoiseStatisticsKernel {
                      int bayerPattern,
                      gls::mtl_image_2d<gls::pixel_float4>* meanImage,
                      gls::mtl_image_2d<gls::pixel_float4>* varImage) const {
-        kernel(context, /*gridSize=*/ MTL::Size(meanImage->width, meanImage->height, 1),
+        kernel[bayerPatternConstants((BayerPattern) bayerPattern)](context, /*gridSize=*/ MTL::Size(meanImage->width, meanImage->height, 1),
                rawImage.texture(), bayerPattern, meanImage->texture(), varImage->texture());
     }
 };
 
+// GPU reduction of the noise statistics images, see noiseStatisticsPartialSums and noiseStatisticsSum in demosaic.metal
+struct noiseStatisticsReductionKernel {
+    enum Stage {
+        histogram = 0,
+        regression = 1,
+        error = 2,
+        refit = 3
+    };
+
+    // Mirrors NoiseStatisticsParameters in demosaic.metal
+    struct Parameters {
+        simd::float4 varianceMax = 1;
+        simd::float4 nlfA = 0;
+        simd::float4 nlfB = 0;
+        simd::float4 errorThreshold = 0;
+        float minValue = 0;
+        float maxValue = 1;
+        int stage = histogram;
+        int packedStatistics = 0;
+    };
+
+    // Must match kNoiseStatisticsGroupSize, kNoiseStatisticsEntries and kNoiseStatisticsSumGroupSize in demosaic.metal
+    static constexpr int kGroupSize = 16;
+    static constexpr int kEntries = 21;
+    static constexpr int kSumGroupSize = 256;
+
+    // Layout of the reduced sums, the histogram stage only uses the first six entries
+    static constexpr int kSumX = 0;
+    static constexpr int kSumY = 4;
+    static constexpr int kSumXX = 8;
+    static constexpr int kSumXY = 12;
+    static constexpr int kSumError = 16;
+    static constexpr int kCount = 20;
+
+    typedef std::array<double, kEntries> Sums;
+
+    Kernel<MTL::Texture*,   // meanImage
+           MTL::Texture*,   // varImage
+           Parameters,      // parameters
+           MTL::Buffer*     // partialSums
+    > partialSums;
+
+    Kernel<MTL::Buffer*,    // partialSums
+           int,             // groups
+           MTL::Buffer*     // sums
+    > sum;
+
+    std::unique_ptr<gls::Buffer<float>> _partialSums;
+    std::unique_ptr<gls::Buffer<float>> _sums;
+
+    noiseStatisticsReductionKernel(MetalContext* context) :
+        partialSums(context, "noiseStatisticsPartialSums"), sum(context, "noiseStatisticsSum") {
+        _sums = std::make_unique<gls::Buffer<float>>(context->device(), kEntries);
+    }
+
+    // Reduces meanImage and varImage, or with packedStatistics the basicNoiseStatistics image given as both,
+    // and waits for the result. Only the reduced sums are read back.
+    Sums operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& meanImage,
+                     const gls::mtl_image_2d<gls::pixel_float4>& varImage, const Parameters& parameters) {
+        const int groups = ((meanImage.width + kGroupSize - 1) / kGroupSize) * ((meanImage.height + kGroupSize - 1) / kGroupSize);
+        if (!_partialSums || _partialSums->size() < groups * kEntries) {
+            _partialSums = std::make_unique<gls::Buffer<float>>(context->device(), groups * kEntries);
+        }
+
+        {
+            MetalContext::ConcurrentScope concurrent(context);
+
+            // noiseStatisticsPartialSums derives the partial sums location from the threadgroup position
+            partialSums(context, /*gridSize=*/ MTL::Size(meanImage.width, meanImage.height, 1),
+                        /*threadGroupSize=*/ MTL::Size(kGroupSize, kGroupSize, 1),
+                        meanImage.texture(), varImage.texture(), parameters, _partialSums->buffer());
+            context->barrier();
+            sum(context, /*gridSize=*/ MTL::Size(kSumGroupSize, 1, 1), /*threadGroupSize=*/ MTL::Size(kSumGroupSize, 1, 1),
+                _partialSums->buffer(), groups, _sums->buffer());
+        }
+        context->submit().get();
+
+        Sums sums;
+        const float* data = _sums->data();
+        for (int e = 0; e < kEntries; e++) {
+            sums[e] = data[e];
+        }
+        return sums;
+    }
+
+    template <int N>
+    static gls::DVector<N> vector(const Sums& sums, int entry) {
+        gls::DVector<N> v;
+        for (int c = 0; c < N; c++) {
+            v[c] = sums[entry + c];
+        }
+        return v;
+    }
+};
+
+// PSNR and SSIM of images against a reference, see imageQualityPartialSums in demosaic.metal. Each image is scored
+// into its own slot of the scores buffer, on the GPU and in stream: a batch of images is read back with a single wait.
+struct imageQualityKernel {
+    // Must match kImageQualityBlock, kImageQualityGroupSize, kImageQualityEntries and kImageQualitySumGroupSize in demosaic.metal
+    static constexpr int kBlock = 8;
+    static constexpr int kGroupSize = 16;
+    static constexpr int kEntries = 4;
+    static constexpr int kSumGroupSize = 256;
+
+    struct Score {
+        double psnr = 0;
+        double ssim = 0;
+    };
+
+    Kernel<MTL::Texture*,   // image
+           MTL::Texture*,   // reference
+           MTL::Buffer*     // partialSums
+    > partialSums;
+
+    Kernel<MTL::Buffer*,    // partialSums
+           int,             // groups
+           int,             // slot
+           MTL::Buffer*     // scores
+    > sum;
+
+    std::unique_ptr<gls::Buffer<float>> _partialSums;
+    std::unique_ptr<gls::Buffer<float>> _scores;
+
+    imageQualityKernel(MetalContext* context) :
+        partialSums(context, "imageQualityPartialSums"), sum(context, "imageQualitySum") { }
+
+    // Scores buffer for the given number of slots
+    void reserve(MetalContext* context, int slots) {
+        if (!_scores || _scores->size() < slots * kEntries) {
+            _scores = std::make_unique<gls::Buffer<float>>(context->device(), slots * kEntries);
+        }
+    }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& image,
+                     const gls::mtl_image_2d<gls::pixel_float4>& reference, int slot) {
+        assert(image.size() == reference.size());
+        assert(_scores && (slot + 1) * kEntries <= _scores->size());
+
+        const MTL::Size blocks((image.width + kBlock - 1) / kBlock, (image.height + kBlock - 1) / kBlock, 1);
+        const int groups = (int) (((blocks.width + kGroupSize - 1) / kGroupSize) * ((blocks.height + kGroupSize - 1) / kGroupSize));
+        if (!_partialSums || _partialSums->size() < groups * kEntries) {
+            _partialSums = std::make_unique<gls::Buffer<float>>(context->device(), groups * kEntries);
+        }
+
+        MetalContext::ConcurrentScope concurrent(context);
+
+        // imageQualityPartialSums derives the partial sums location from the threadgroup position
+        partialSums(context, /*gridSize=*/ blocks, /*threadGroupSize=*/ MTL::Size(kGroupSize, kGroupSize, 1),
+                    image.texture(), reference.texture(), _partialSums->buffer());
+        context->barrier();
+        sum(context, /*gridSize=*/ MTL::Size(kSumGroupSize, 1, 1), /*threadGroupSize=*/ MTL::Size(kSumGroupSize, 1, 1),
+            _partialSums->buffer(), groups, slot, _scores->buffer());
+    }
+
+    // Valid once the GPU work scoring the slot has completed
+    Score score(int slot) const {
+        const float* scores = _scores->data() + slot * kEntries;
+        const double mse = scores[1] > 0 ? scores[0] / scores[1] : 0;
+        return {
+            .psnr = mse > 0 ? 10 * std::log10(1 / mse) : std::numeric_limits<double>::infinity(),
+            .ssim = scores[3] > 0 ? scores[2] / scores[3] : 0
+        };
+    }
+};
+
 struct resampleImageKernel {
     Kernel<MTL::Texture*,   // inputImage
            MTL::Texture*    // outputImage
@@ -482,15 +1488,358 @@ struct resampleImageKernel {
     }
 };
 
+// Builds the four lower levels of an image pyramid and of its gradient pyramid in a single dispatch
+struct buildPyramidsKernel {
+    Kernel<MTL::Texture*,   // inputImage
+           MTL::Texture*,   // gradientImage
+           MTL::Texture*,   // image1
+           MTL::Texture*,   // image2
+           MTL::Texture*,   // image3
+           MTL::Texture*,   // image4
+           MTL::Texture*,   // gradient1
+           MTL::Texture*,   // gradient2
+           MTL::Texture*,   // gradient3
+           MTL::Texture*,   // gradient4
+           bool             // buildGradients
+    > kernel;
+
+    // Pixels of the first downsampled level per threadgroup side, kPyramidTile << 3 in demosaic.metal
+    static constexpr int kTileSize = 32;
+    static constexpr int kThreadGroupSize = 16;
+
+    buildPyramidsKernel(MetalContext* context) : kernel(context, "buildPyramids") { }
+
+    template <typename imageType, typename gradientType>
+    void operator() (MetalContext* context, const imageType& inputImage, const gradientType& gradientImage,
+                     const std::array<typename imageType::unique_ptr, 4>& imagePyramid,
+                     const std::array<typename gradientType::unique_ptr, 4>& gradientPyramid,
+                     bool buildGradients = true) const {
+        const auto& firstLevel = *imagePyramid[0];
+        const int groupsX = (firstLevel.width + kTileSize - 1) / kTileSize;
+        const int groupsY = (firstLevel.height + kTileSize - 1) / kTileSize;
+
+        // The kernel derives its tile origin from the threadgroup position
+        kernel(context, /*gridSize=*/ MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1),
+               /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+               inputImage.texture(), gradientImage.texture(),
+               imagePyramid[0]->texture(), imagePyramid[1]->texture(), imagePyramid[2]->texture(), imagePyramid[3]->texture(),
+               gradientPyramid[0]->texture(), gradientPyramid[1]->texture(), gradientPyramid[2]->texture(),
+               gradientPyramid[3]->texture(), buildGradients);
+    }
+};
+
+// Running average of the registered frames of a burst, see fusePyramidLevel in demosaic.metal
+struct fusePyramidLevelKernel {
+    Kernel<MTL::Texture*,   // fusedImage
+           MTL::Texture*,   // inputImage
+           MTL::Texture*,   // newFusedImage
+           Matrix3x3,       // homography
+           int              // count
+    > kernel;
+
+    fusePyramidLevelKernel(MetalContext* context) : kernel(context, "fusePyramidLevel") { }
+
+    template <typename T>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& fusedImage, const gls::mtl_image_2d<T>& inputImage,
+                     const gls::Matrix<3, 3>& homography, int count, gls::mtl_image_2d<T>* outputImage) const {
+        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
+               fusedImage.texture(), inputImage.texture(), outputImage->texture(), homography, count);
+    }
+};
+
+// Tile search of a pyramid level for the coarse-to-fine burst alignment, see alignTiles in demosaic.metal
+struct alignTilesKernel {
+    // Must match ALIGN_TILE_SIZE in demosaic.metal
+    static constexpr int tileSize = 16;
+
+    Kernel<MTL::Texture*,   // referenceImage
+           MTL::Texture*,   // frameImage
+           MTL::Texture*,   // coarseMotionField
+           MTL::Texture*,   // motionField
+           int,             // searchRadius
+           int,             // useCoarseMotionField
+           int              // l1Norm
+    > kernel;
+
+    alignTilesKernel(MetalContext* context) : kernel(context, "alignTiles") { }
+
+    // Size of the motion field of an image
+    static gls::size motionFieldSize(int width, int height) {
+        return { (width + tileSize - 1) / tileSize, (height + tileSize - 1) / tileSize };
+    }
+
+    // Without coarseMotionField the search is centered on zero motion
+    template <typename T>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& referenceImage, const gls::mtl_image_2d<T>& frameImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>* coarseMotionField, int searchRadius, bool l1Norm,
+                     gls::mtl_image_2d<gls::pixel_float2>* motionField) const {
+        // One SIMD-group per tile
+        kernel(context, /*gridSize=*/ MTL::Size(32 * motionField->width, motionField->height, 1), /*threadGroupSize=*/ MTL::Size(32, 1, 1),
+               referenceImage.texture(), frameImage.texture(), coarseMotionField ? coarseMotionField->texture() : motionField->texture(),
+               motionField->texture(), searchRadius, (int) (coarseMotionField != nullptr), (int) l1Norm);
+    }
+};
+
+// Robust DCT domain burst merge on the raw data, see rawMergeFrame in demosaic.metal. begin starts a burst with its
+// reference frame, every merge call adds a registered frame and resolve writes the merged Bayer image.
+struct rawMergeKernel {
+    // Must match MERGE_TILE_SIZE in demosaic.metal
+    static constexpr int tileSize = 16;
+
+    // Mirrors RawMergeParameters in demosaic.metal
+    struct Parameters {
+        simd::float4 scaleMul = 1;
+        simd::float4 nlfA = 0;
+        simd::float4 nlfB = 0;
+        float blackLevel = 0;
+        float mergeStrength = 8;
+        int bayerPattern = 0;
+    };
+
+    Kernel<MTL::Texture*,   // referenceImage
+           MTL::Buffer*,    // accumulator
+           Parameters       // parameters
+    > mergeInit;
+
+    Kernel<MTL::Texture*,   // referenceImage
+           MTL::Texture*,   // frameImage
+           MTL::Buffer*,    // accumulator
+           MTL::Buffer*,    // acceptance
+           Parameters,      // parameters
+           Matrix3x3,       // homography
+           simd::int2       // tileParity
+    > mergeFrame;
+
+    Kernel<MTL::Buffer*,    // accumulator
+           MTL::Texture*,   // rawImage
+           Parameters,      // parameters
+           int              // frames
+    > mergeResolve;
+
+    std::unique_ptr<gls::Buffer<simd::float4>> _accumulator;
+    gls::Buffer<uint32_t> _acceptance;
+    Parameters _parameters;
+    const gls::mtl_image_2d<gls::luma_pixel_16>* _referenceImage = nullptr;
+    gls::size _planeSize = { 0, 0 };
+    int _frames = 0;
+
+    rawMergeKernel(MetalContext* context) :
+        mergeInit(context, "rawMergeInit"),
+        mergeFrame(context, "rawMergeFrame"),
+        mergeResolve(context, "rawMergeResolve"),
+        _acceptance(context->device(), 1) { }
+
+    // Overlapping tiles along an axis of the color planes, the first one starts half a tile before the image
+    static int tileCount(int planeSize) {
+        return (planeSize - 1) / (tileSize / 2) + 2;
+    }
+
+    // The reference frame must stay alive until the burst is resolved. A higher mergeStrength averages more
+    // aggressively, at the price of more ghosting on motion the Wiener filter can't tell from noise.
+    void begin(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& referenceImage, BayerPattern bayerPattern,
+               const gls::Vector<4>& scaleMul, float blackLevel, const RawNLF& rawNlf, float mergeStrength = 8) {
+        _planeSize = referenceImage.size() / 2;
+        const size_t planePixels = _planeSize.width * _planeSize.height;
+        if (!_accumulator || _accumulator->size() < planePixels) {
+            _accumulator = std::make_unique<gls::Buffer<simd::float4>>(context->device(), planePixels);
+        }
+        _parameters = {
+            .scaleMul = { scaleMul[0], scaleMul[1], scaleMul[2], scaleMul[3] },
+            .nlfA = { rawNlf.first[0], rawNlf.first[1], rawNlf.first[2], rawNlf.first[3] },
+            .nlfB = { rawNlf.second[0], rawNlf.second[1], rawNlf.second[2], rawNlf.second[3] },
+            .blackLevel = blackLevel,
+            .mergeStrength = mergeStrength,
+            .bayerPattern = bayerPattern
+        };
+        _referenceImage = &referenceImage;
+        _frames = 1;
+        // The previous burst is resolved and waited for before a new one starts
+        _acceptance.data()[0] = 0;
+
+        mergeInit(context, /*gridSize=*/ MTL::Size(_planeSize.width, _planeSize.height, 1),
+                  referenceImage.texture(), _accumulator->buffer(), _parameters);
+    }
+
+    // The homography maps the reference's color plane coordinates to the frame's, frameImage must stay alive
+    // until the GPU is done with it
+    void merge(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& frameImage, const gls::Matrix<3, 3>& homography) {
+        assert(_referenceImage && frameImage.size() == _referenceImage->size());
+
+        const int groupsX = (tileCount(_planeSize.width) + 1) / 2;
+        const int groupsY = (tileCount(_planeSize.height) + 1) / 2;
+        // Four passes of non overlapping tiles, the serial dispatches order the accumulation
+        for (int parity = 0; parity < 4; parity++) {
+            mergeFrame(context, /*gridSize=*/ MTL::Size(groupsX * tileSize, groupsY * tileSize, 1),
+                       /*threadGroupSize=*/ MTL::Size(tileSize, tileSize, 1),
+                       _referenceImage->texture(), frameImage.texture(), _accumulator->buffer(), _acceptance.buffer(),
+                       _parameters, homography, simd::int2 { parity % 2, parity / 2 });
+        }
+        _frames++;
+    }
+
+    void resolve(MetalContext* context, gls::mtl_image_2d<gls::luma_pixel_16>* rawImage) const {
+        assert(rawImage->size() == _referenceImage->size());
+
+        mergeResolve(context, /*gridSize=*/ MTL::Size(_planeSize.width, _planeSize.height, 1),
+                     _accumulator->buffer(), rawImage->texture(), _parameters, _frames);
+    }
+
+    // Once the GPU is done: the reference plus the fraction of the frames' content the merge accepted. The noise
+    // variance of the merged image is roughly the single frame's divided by this.
+    float effectiveFrames() const {
+        const int tiles = tileCount(_planeSize.width) * tileCount(_planeSize.height);
+        return 1 + _acceptance.data()[0] / (1024.0f * tiles);
+    }
+};
+
+// Exposure bracket merge on the raw data, see hdrMergeFrame in demosaic.metal. begin starts with the reference
+// bracket, every merge call adds a registered bracket with its exposure relative to the reference, and resolve writes
+// the merged Bayer image in the units of the shortest exposure.
+struct hdrMergeKernel {
+    // Mirrors HDRMergeParameters in demosaic.metal
+    struct Parameters {
+        rawMergeKernel::Parameters raw;
+        float clipLevel = 1;
+        float outputScale = 1;
+    };
+
+    // Mirrors HDRAccumulator in demosaic.metal
+    struct Accumulator {
+        simd::float4 sum;
+        simd::float4 weight;
+    };
+
+    Kernel<MTL::Texture*,   // referenceImage
+           MTL::Buffer*,    // accumulator
+           Parameters       // parameters
+    > mergeInit;
+
+    Kernel<MTL::Texture*,   // referenceImage
+           MTL::Texture*,   // frameImage
+           MTL::Buffer*,    // accumulator
+           Parameters,      // parameters
+           Matrix3x3,       // homography
+           float            // exposureRatio
+    > mergeFrame;
+
+    Kernel<MTL::Buffer*,    // accumulator
+           MTL::Texture*,   // rawImage
+           Parameters       // parameters
+    > mergeResolve;
+
+    std::unique_ptr<gls::Buffer<Accumulator>> _accumulator;
+    Parameters _parameters;
+    const gls::mtl_image_2d<gls::luma_pixel_16>* _referenceImage = nullptr;
+    gls::size _planeSize = { 0, 0 };
+    float _maxExposureRatio = 1;
+
+    hdrMergeKernel(MetalContext* context) :
+        mergeInit(context, "hdrMergeInit"),
+        mergeFrame(context, "hdrMergeFrame"),
+        mergeResolve(context, "hdrMergeResolve") { }
+
+    // The reference bracket must stay alive until the merge is resolved. The NLF is the reference's, the brackets
+    // are assumed to share its ISO. clipLevel is the raw white level, normalized as the black level. A higher
+    // mergeStrength rejects less ghosting.
+    void begin(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& referenceImage, BayerPattern bayerPattern,
+               const gls::Vector<4>& scaleMul, float blackLevel, float clipLevel, const RawNLF& rawNlf, float mergeStrength = 8) {
+        _planeSize = referenceImage.size() / 2;
+        const size_t planePixels = _planeSize.width * _planeSize.height;
+        if (!_accumulator || _accumulator->size() < planePixels) {
+            _accumulator = std::make_unique<gls::Buffer<Accumulator>>(context->device(), planePixels);
+        }
+        _parameters = {
+            .raw = {
+                .scaleMul = { scaleMul[0], scaleMul[1], scaleMul[2], scaleMul[3] },
+                .nlfA = { rawNlf.first[0], rawNlf.first[1], rawNlf.first[2], rawNlf.first[3] },
+                .nlfB = { rawNlf.second[0], rawNlf.second[1], rawNlf.second[2], rawNlf.second[3] },
+                .blackLevel = blackLevel,
+                .mergeStrength = mergeStrength,
+                .bayerPattern = bayerPattern
+            },
+            .clipLevel = clipLevel
+        };
+        _referenceImage = &referenceImage;
+        _maxExposureRatio = 1;
+
+        mergeInit(context, /*gridSize=*/ MTL::Size(_planeSize.width, _planeSize.height, 1),
+                  referenceImage.texture(), _accumulator->buffer(), _parameters);
+    }
+
+    // The homography maps the reference's color plane coordinates to the frame's, exposureRatio is the reference's
+    // exposure over the frame's (e.g. 4 for a bracket two stops under). frameImage must stay alive until the GPU
+    // is done with it.
+    void merge(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& frameImage,
+               const gls::Matrix<3, 3>& homography, float exposureRatio) {
+        assert(_referenceImage && frameImage.size() == _referenceImage->size());
+
+        mergeFrame(context, /*gridSize=*/ MTL::Size(_planeSize.width, _planeSize.height, 1),
+                   _referenceImage->texture(), frameImage.texture(), _accumulator->buffer(), _parameters,
+                   homography, exposureRatio);
+        _maxExposureRatio = std::max(_maxExposureRatio, exposureRatio);
+    }
+
+    void resolve(MetalContext* context, gls::mtl_image_2d<gls::luma_pixel_16>* rawImage) {
+        assert(rawImage->size() == _referenceImage->size());
+
+        _parameters.outputScale = _maxExposureRatio;
+        mergeResolve(context, /*gridSize=*/ MTL::Size(_planeSize.width, _planeSize.height, 1),
+                     _accumulator->buffer(), rawImage->texture(), _parameters);
+    }
+
+    // The merged image is in the units of the shortest exposure, the reference's values divided by outputScale()
+    float outputScale() const {
+        return _maxExposureRatio;
+    }
+};
+
+// Recursive temporal denoise of a YCbCr frame against the motion compensated previous output, see
+// temporalDenoiseImage in demosaic.metal
+struct temporalDenoiseImageKernel {
+    // Mirrors TemporalDenoiseParameters in demosaic.metal
+    struct Parameters {
+        simd::float3 nlfA;
+        simd::float3 nlfB;
+        float historyWeight;
+        float rejectionStrength;
+        float motionScale;
+    };
+
+    Kernel<MTL::Texture*,   // inputImage
+           MTL::Texture*,   // historyImage
+           MTL::Texture*,   // motionField
+           MTL::Texture*,   // outputImage
+           Parameters       // parameters
+    > kernel;
+
+    temporalDenoiseImageKernel(MetalContext* context) : kernel(context, "temporalDenoiseImage") { }
+
+    // The motion field is the one of an image motionScale times smaller than the frame, historyWeight is the largest
+    // weight of the history, a higher rejectionStrength tolerates more difference before falling back to the input
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     const gls::mtl_image_2d<gls::pixel_float4>& historyImage,
+                     const gls::mtl_image_2d<gls::pixel_float2>& motionField, const YCbCrNLF& nlf,
+                     float historyWeight, float rejectionStrength, int motionScale,
+                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
+        assert(inputImage.size() == historyImage.size() && inputImage.size() == outputImage->size());
+
+        const Parameters parameters = {
+            .nlfA = { nlf.first[0], nlf.first[1], nlf.first[2] },
+            .nlfB = { nlf.second[0], nlf.second[1], nlf.second[2] },
+            .historyWeight = historyWeight,
+            .rejectionStrength = rejectionStrength,
+            .motionScale = (float) motionScale
+        };
+        kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
+               inputImage.texture(), historyImage.texture(), motionField.texture(), outputImage->texture(), parameters);
+    }
+};
+
 struct histogramImageKernel {
     Kernel<MTL::Texture*,  // inputImage
            MTL::Buffer*    // histogramBuffer
     > histogramImage;
 
-    Kernel<MTL::Buffer*,  // histogramBuffer
-           simd::uint2    // imageDimensions
-    > histogramStatistics;
-
     struct histogram_data {
         std::array<uint32_t, 256> histogram;
         std::array<uint32_t, 8> bands;
@@ -500,6 +1849,7 @@ struct histogramImageKernel {
         float highlights;
         float mean;
         float median;
+        uint32_t groups_done;
     };
 
     gls::Buffer<histogram_data> histogramBuffer;
@@ -518,31 +1868,236 @@ struct histogramImageKernel {
 
     histogramImageKernel(MetalContext* context) :
         histogramImage(context, "histogramImage"),
-        histogramStatistics(context, "histogramStatistics"),
         histogramBuffer(context->device(), 1)
         { }
 
+    // kHistogramGroupSize and kHistogramPixelsPerThread in demosaic.metal, one thread per histogram bin.
+    // The last threadgroup also computes the histogram statistics, the buffer must be reset before each run.
+    static constexpr int kThreadGroupSize = 16;
+    static constexpr int kPixelsPerThread = 4;
+
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage) const {
-        histogramImage(context, /*gridSize=*/ MTL::Size(inputImage.width, inputImage.height, 1),
-               inputImage.texture(), histogramBuffer.buffer());
+        const int tileWidth = kThreadGroupSize * kPixelsPerThread;
+        const int groupsX = (inputImage.width + tileWidth - 1) / tileWidth;
+        const int groupsY = (inputImage.height + kThreadGroupSize - 1) / kThreadGroupSize;
+
+        // The kernel derives its tile origin from the threadgroup position
+        histogramImage(context, /*gridSize=*/ MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1),
+                       /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+                       inputImage.texture(), histogramBuffer.buffer());
     }
+};
+
+// Combined statistics of the raw image in a single read of its subsampled Bayer quads: luma histogram,
+// clipping counts, gray world averages and green split noise moments, see imageStatistics in demosaic.metal
+struct imageStatisticsKernel {
+    // Mirrors ImageStatisticsParameters in demosaic.metal
+    struct Parameters {
+        simd::float4 scaleMul;
+        simd::float4 lumaWeights;
+        float blackLevel;
+        float clipLevel;
+        int bayerPattern;
+        int sampleStride;
+    };
+
+    // Mirrors image_statistics in demosaic.metal, the histogram bins follow histogramImage
+    struct image_statistics {
+        std::array<uint32_t, 256> histogram;
+        // Raw channels in red, green, blue, second green order
+        std::array<uint32_t, 4> clipped;
+        uint32_t highlights;
+        uint32_t samples;
+        uint32_t groups_done;
+        // Average camera RGB of the unclipped samples
+        std::array<float, 3> grayWorld;
+        float grayWorldSamples;
+        float greenSplitMean;
+        float greenSplitVariance;
+    };
+
+    // kImageStatisticsGroupSize and kImageStatisticsSums in demosaic.metal
+    static constexpr int kThreadGroupSize = 16;
+    static constexpr int kSums = 6;
+
+    Kernel<MTL::Texture*,   // rawImage
+           Parameters,      // parameters
+           MTL::Buffer*,    // statistics
+           MTL::Buffer*     // partialSums
+    > kernel;
+
+    gls::Buffer<image_statistics> statisticsBuffer;
+    std::unique_ptr<gls::Buffer<float>> _partialSums;
+
+    imageStatisticsKernel(MetalContext* context) :
+        kernel(context, "imageStatistics"),
+        statisticsBuffer(context->device(), 1)
+        { }
+
+    void reset() {
+        bzero(statisticsBuffer.data(), sizeof(image_statistics));
+    }
+
+    // Valid once the command buffer of the dispatch has completed
+    const image_statistics* statistics() const {
+        return statisticsBuffer.data();
+    }
+
+    MTL::Buffer* buffer() const {
+        return statisticsBuffer.buffer();
+    }
+
+    // Samples one Bayer quad every sampleStride quads, the buffer must be reset before each run
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                     BayerPattern bayerPattern, const gls::Vector<4>& scaleMul, float blackLevel,
+                     const gls::Vector<3>& lumaWeights, int sampleStride) {
+        const int samplesX = rawImage.width / (2 * sampleStride);
+        const int samplesY = rawImage.height / (2 * sampleStride);
+        const int groupsX = (samplesX + kThreadGroupSize - 1) / kThreadGroupSize;
+        const int groupsY = (samplesY + kThreadGroupSize - 1) / kThreadGroupSize;
+        if (!_partialSums || _partialSums->size() < groupsX * groupsY * kSums) {
+            _partialSums = std::make_unique<gls::Buffer<float>>(context->device(), groupsX * groupsY * kSums);
+        }
+
+        const Parameters parameters = {
+            .scaleMul = { scaleMul[0], scaleMul[1], scaleMul[2], scaleMul[3] },
+            .lumaWeights = { lumaWeights[0], lumaWeights[1], lumaWeights[2], 0 },
+            .blackLevel = blackLevel,
+            .clipLevel = 1,
+            .bayerPattern = bayerPattern,
+            .sampleStride = sampleStride
+        };
+
+        // Whole threadgroups, one thread per histogram bin
+        kernel(context, /*gridSize=*/ MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1),
+               /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+               rawImage.texture(), parameters, statisticsBuffer.buffer(), _partialSums->buffer());
+    }
+};
+
+// GPU auto white balance, see whiteBalanceStatistics and whiteBalanceGains in demosaic.metal
+struct whiteBalanceKernel {
+    enum Stage {
+        mean = 0,
+        deviation = 1,
+        white = 2
+    };
+
+    // Must match the constants in demosaic.metal
+    static constexpr int kTiles = 4;
+    static constexpr int kTileGroups = 4;
+    static constexpr int kGroupSize = 16;
+    static constexpr int kHistogramSize = 128;
+    static constexpr int kPartials = 4;
+    static constexpr int kWhitePartials = 4 * kHistogramSize + 1;
+    static constexpr int kGroups = kTiles * kTileGroups * kTiles * kTileGroups;
+
+    // Mirrors WhiteBalanceParameters in demosaic.metal
+    struct Parameters {
+        Matrix3x3 rgb_ycbcr;
+        simd::float4 scaleMul;
+        float white;
+        float black;
+        float highlightsFraction;
+        int bayerPattern;
+        int stage;
+        simd::int2 tileSize;
+    };
 
-    void statistics(MetalContext* context, const gls::size& imageDimensions) const {
-        histogramStatistics(context, /*gridSize=*/ MTL::Size(1, 1, 1),
-                            histogramBuffer.buffer(),
-                            simd::uint2 { (unsigned) imageDimensions.width, (unsigned) imageDimensions.height });
+    Kernel<MTL::Texture*,   // rawImage
+           Parameters,      // parameters
+           MTL::Buffer*,    // meanSums
+           MTL::Buffer*,    // deviationSums
+           MTL::Buffer*     // whiteSums
+    > statistics;
+
+    Kernel<MTL::Buffer*,    // meanSums
+           MTL::Buffer*,    // whiteSums
+           Parameters,      // parameters
+           MTL::Buffer*     // tileGains
+    > gains;
+
+    gls::Buffer<float> meanSums;
+    gls::Buffer<float> deviationSums;
+    gls::Buffer<float> whiteSums;
+    gls::Buffer<simd::float4> tileGains;
+
+    whiteBalanceKernel(MetalContext* context) :
+        statistics(context, "whiteBalanceStatistics"),
+        gains(context, "whiteBalanceGains"),
+        meanSums(context->device(), kGroups * kPartials),
+        deviationSums(context->device(), kGroups * kPartials),
+        whiteSums(context->device(), kGroups * kWhitePartials),
+        tileGains(context->device(), kTiles * kTiles)
+        { }
+
+    // Same interface and results as autoWhiteBalance in demosaic_utils.cpp, waits for the GPU
+    gls::Vector<3> operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                               const gls::Matrix<3, 3>& rgb_ycbcr, const gls::Vector<4>& scale_mul4,
+                               float white, float black, BayerPattern bayerPattern, float* highlights) {
+        // The tile dimensions are a multiple of two
+        const simd::int2 tileSize = { 2 * ((rawImage.width / kTiles) / 2), 2 * ((rawImage.height / kTiles) / 2) };
+
+        Parameters parameters = {
+            .rgb_ycbcr = rgb_ycbcr,
+            .scaleMul = { scale_mul4[0] / scale_mul4[1], 1, scale_mul4[2] / scale_mul4[1], 1 },
+            .white = white / (float) 0xffff,
+            .black = black / (float) 0xffff,
+            .highlightsFraction = 0.01,
+            .bayerPattern = bayerPattern,
+            .stage = mean,
+            .tileSize = tileSize
+        };
+
+        {
+            MetalContext::ConcurrentScope concurrent(context);
+
+            // A fixed grid of kTileGroups x kTileGroups threadgroups per tile
+            const int threads = kTiles * kTileGroups * kGroupSize;
+            for (int stage = mean; stage <= white; stage++) {
+                parameters.stage = stage;
+                statistics(context, /*gridSize=*/ MTL::Size(threads, threads, 1),
+                           /*threadGroupSize=*/ MTL::Size(kGroupSize, kGroupSize, 1),
+                           rawImage.texture(), parameters, meanSums.buffer(), deviationSums.buffer(), whiteSums.buffer());
+                context->barrier();
+            }
+            gains(context, /*gridSize=*/ MTL::Size(kHistogramSize * kTiles * kTiles, 1, 1),
+                  /*threadGroupSize=*/ MTL::Size(kHistogramSize, 1, 1),
+                  meanSums.buffer(), whiteSums.buffer(), parameters, tileGains.buffer());
+        }
+        context->submit().get();
+
+        gls::Vector<3> wbGain = {0, 0, 0};
+        float highlightPixels = 0;
+        const simd::float4* results = tileGains.data();
+        for (int t = 0; t < kTiles * kTiles; t++) {
+            wbGain += gls::Vector<3> { results[t].x, results[t].y, results[t].z };
+            highlightPixels += results[t].w;
+        }
+        wbGain /= (float) (kTiles * kTiles);
+        wbGain /= (float) wbGain[1];
+        if (highlights) {
+            *highlights = highlightPixels / (rawImage.width * rawImage.height / 4);
+        }
+        return wbGain;
     }
 };
 
+// Multi-scale guided filter and local tone mapping mask. The guided filter's box means are running sums with a
+// radius-independent cost, see boxFilterSegment in demosaic.metal.
 struct localToneMappingMaskKernel {
-    Kernel<MTL::Texture*,  // guideImage
-           MTL::Texture*,  // abImage
-           float           // eps
-    > GuidedFilterABImage;
+    Kernel<MTL::Texture*,  // inputImage
+           MTL::Texture*,  // outputImage
+           int,            // radius
+           int             // moments
+    > boxFilterRows;
 
     Kernel<MTL::Texture*,  // inputImage
-           MTL::Texture*   // outputImage
-    > BoxFilterGFImage;
+           MTL::Texture*,  // outputImage
+           int,            // radius
+           int,            // guidedAB
+           float           // eps
+    > boxFilterColumns;
 
     Kernel<MTL::Texture*,  // inputImage
            MTL::Texture*,  // gradientImage
@@ -555,30 +2110,94 @@ struct localToneMappingMaskKernel {
            MTL::Buffer*    // histogramBuffer
     > localToneMappingMaskImage;
 
+    Kernel<MTL::Texture*,  // inputImage
+           MTL::Texture*,  // historyImage
+           MTL::Texture*,  // outputImage
+           float           // weight
+    > temporalBlendImage;
+
+    // kBoxFilterSegment in demosaic.metal
+    static constexpr int kSegment = 32;
+
     localToneMappingMaskKernel(MetalContext* context) :
-        GuidedFilterABImage(context, "GuidedFilterABImage"),
-        BoxFilterGFImage(context, "BoxFilterGFImage"),
-        localToneMappingMaskImage(context, "localToneMappingMaskImage")
+        boxFilterRows(context, "boxFilterRows"),
+        boxFilterColumns(context, "boxFilterColumns"),
+        localToneMappingMaskImage(context, "localToneMappingMaskImage"),
+        temporalBlendImage(context, "temporalBlendImage")
         { }
 
+    // Passes of the separable box filter, with guided the rows input is the guide image and the columns
+    // output the guided filter's coefficients
+    template <typename inputType>
+    void rows(MetalContext* context, const gls::mtl_image_2d<inputType>& inputImage, int radius, bool guided,
+              gls::mtl_image_2d<gls::pixel_float2>* outputImage) const {
+        boxFilterRows(context, /*gridSize=*/ MTL::Size((outputImage->width + kSegment - 1) / kSegment, outputImage->height, 1),
+                      inputImage.texture(), outputImage->texture(), radius, guided);
+    }
+
+    void columns(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float2>& inputImage, int radius, bool guided,
+                 float eps, gls::mtl_image_2d<gls::pixel_float2>* outputImage) const {
+        boxFilterColumns(context, /*gridSize=*/ MTL::Size(outputImage->width, (outputImage->height + kSegment - 1) / kSegment, 1),
+                         inputImage.texture(), outputImage->texture(), radius, guided, eps);
+    }
+
+    // Only the bands with update set are recomputed, the others keep their abMeanImage from a previous run. The
+    // bands with a historyImage blend the new means with it, with historyWeight the weight of the new frame.
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
                      const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
                      const std::array<const gls::mtl_image_2d<gls::pixel_float4>*, 3>& guideImage,
-                     const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, 3>& abImage,
-                     const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, 3>& abMeanImage,
+                     const std::array<gls::mtl_image_2d<gls::pixel_float2>*, 3>& abImage,
+                     const std::array<gls::mtl_image_2d<gls::pixel_float2>*, 3>& abMeanImage,
+                     const std::array<gls::mtl_image_2d<gls::pixel_float2>*, 3>& tmpImage,
                      const LTMParameters& ltmParameters, const gls::Vector<2>& nlf, MTL::Buffer* histogramBuffer,
-                     gls::mtl_image_2d<gls::pixel_float>* outputImage) const {
+                     gls::mtl_image_2d<gls::pixel_float>* outputImage,
+                     const std::array<bool, 3>& update = {true, true, true},
+                     const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, 3>& historyImage = {},
+                     float historyWeight = 1) const {
         for (int i = 0; i < 3; i++) {
             assert(guideImage[i]->width == abImage[i]->width && guideImage[i]->height == abImage[i]->height);
             assert(guideImage[i]->width == abMeanImage[i]->width && guideImage[i]->height == abMeanImage[i]->height);
+            assert(guideImage[i]->width == tmpImage[i]->width && guideImage[i]->height == tmpImage[i]->height);
+            assert(!historyImage[i] || historyImage[i]->size() == abMeanImage[i]->size());
         }
 
-        for (int i = 0; i < 3; i++) {
-            GuidedFilterABImage(context, /*gridSize=*/ MTL::Size(guideImage[i]->width, guideImage[i]->height, 1),
-                     guideImage[i]->texture(), abImage[i]->texture(), ltmParameters.eps);
-
-            BoxFilterGFImage(context, /*gridSize=*/ MTL::Size(abImage[i]->width, abImage[i]->height, 1),
-                         abImage[i]->texture(), abMeanImage[i]->texture());
+        {
+            // The three frequency bands are independent, each pass runs concurrently on all of them
+            MetalContext::ConcurrentScope concurrent(context);
+
+            for (int i = 0; i < 3; i++) {
+                if (update[i]) {
+                    rows(context, *guideImage[i], ltmParameters.radius[i], /*guided=*/ true, tmpImage[i]);
+                }
+            }
+            context->barrier();
+            for (int i = 0; i < 3; i++) {
+                if (update[i]) {
+                    columns(context, *tmpImage[i], ltmParameters.radius[i], /*guided=*/ true, ltmParameters.eps, abImage[i]);
+                }
+            }
+            context->barrier();
+            for (int i = 0; i < 3; i++) {
+                if (update[i]) {
+                    rows(context, *abImage[i], ltmParameters.radius[i], /*guided=*/ false, tmpImage[i]);
+                }
+            }
+            context->barrier();
+            // With a history the a/b image, free after the rows pass, receives the new means
+            for (int i = 0; i < 3; i++) {
+                if (update[i]) {
+                    columns(context, *tmpImage[i], ltmParameters.radius[i], /*guided=*/ false, /*eps=*/ 0,
+                            historyImage[i] ? abImage[i] : abMeanImage[i]);
+                }
+            }
+            context->barrier();
+            for (int i = 0; i < 3; i++) {
+                if (update[i] && historyImage[i]) {
+                    temporalBlendImage(context, /*gridSize=*/ MTL::Size(abMeanImage[i]->width, abMeanImage[i]->height, 1),
+                                       abImage[i]->texture(), historyImage[i]->texture(), abMeanImage[i]->texture(),
+                                       historyWeight);
+                }
+            }
         }
 
         localToneMappingMaskImage(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
@@ -588,85 +2207,390 @@ struct localToneMappingMaskKernel {
     }
 };
 
+// Tileable film grain texture, see generateGrainImage in demosaic.metal. The texture is generated on the GPU the
+// first time a seed is used and kept until the seed changes, the images pick their tile offset from their own seed.
+class filmGrain {
+    Kernel<MTL::Texture*,   // grainImage
+           MTL::Buffer*,    // permutation
+           MTL::Buffer*     // gradient
+    > generateGrainImage;
+
+    MTL::Device* _device;
+    std::optional<unsigned> _seed;
+    gls::mtl_image_2d<gls::pixel_float>::unique_ptr _grainImage;
+
+public:
+    static constexpr int kGrainTileSize = 512;
+
+    filmGrain(MetalContext* context) :
+        generateGrainImage(context, "generateGrainImage"),
+        _device(context->device()) { }
+
+    const gls::mtl_image_2d<gls::pixel_float>& grainImage(MetalContext* context, unsigned seed = 0) {
+        if (_seed != seed) {
+            // Fresh buffers and texture, the command buffers in flight retain the previous ones
+            gls::Buffer<std::array<int, Noise2D::arraySize>> permBuffer(_device, 1);
+            gls::Buffer<std::array<std::array<float, 2>, Noise2D::arraySize>> gradBuffer(_device, 1);
+            Noise2D::randomSeed(seed);
+            Noise2D::initGradients(permBuffer.data(), gradBuffer.data());
+
+            _grainImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float>>(_device, kGrainTileSize, kGrainTileSize,
+                                                                                        gls::texture_precision::fp16);
+            generateGrainImage(context, /*gridSize=*/ MTL::Size(kGrainTileSize, kGrainTileSize, 1),
+                               _grainImage->texture(), permBuffer.buffer(), gradBuffer.buffer());
+            _seed = seed;
+        }
+        return *_grainImage;
+    }
+
+    // Deterministic tile offset of an image
+    static simd::int2 offset(unsigned imageSeed) {
+        uint32_t h = imageSeed * 0x9E3779B1u;
+        h ^= h >> 15;
+        h *= 0x85EBCA77u;
+        h ^= h >> 13;
+        return { (int) (h & (kGrainTileSize - 1)), (int) ((h >> 16) & (kGrainTileSize - 1)) };
+    }
+};
+
 struct simplexNoiseKernel {
     Kernel<MTL::Texture*,   // inputImage
-           MTL::Buffer*,    // permutation
-           MTL::Buffer*,    // gradient
+           MTL::Texture*,   // grainImage
+           simd::int2,      // grainOffset
            simd::float2,    // lumaVariance
            MTL::Texture*    // outputImage
     > kernel;
 
-    gls::Buffer<std::array<int, Noise2D::arraySize>> permBuffer;
-    gls::Buffer<std::array<std::array<float, 2>, Noise2D::arraySize>> gradBuffer;
-
-    void randomSeed(unsigned seed) {
-        Noise2D::randomSeed(seed);
-    }
-
-    void initGradients() {
-        auto& perm = *permBuffer.data();
-        auto& grad = *gradBuffer.data();
-
-        Noise2D::initGradients(&perm, &grad);
-    }
-
     simplexNoiseKernel(MetalContext* context) :
-        kernel(context, "simplex_noise"),
-        permBuffer(context->device(), 1),
-        gradBuffer(context->device(), 1)
-    {
-        initGradients();
-    }
+        kernel(context, "simplex_noise") { }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                     const gls::mtl_image_2d<gls::pixel_float>& grainImage, simd::int2 grainOffset,
                      const gls::Vector<2>& luma_nlf, gls::mtl_image_2d<gls::pixel_float4>* outputImage) const {
         kernel(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
-               inputImage.texture(), permBuffer.buffer(), gradBuffer.buffer(), simd::float2 { luma_nlf[0], luma_nlf[1] },
+               inputImage.texture(), grainImage.texture(), grainOffset, simd::float2 { luma_nlf[0], luma_nlf[1] },
                outputImage->texture());
     }
 };
 
 struct convertTosRGBKernel {
-    Kernel<MTL::Texture*,           // linearImage
-           MTL::Texture*,           // ltmMaskImage
+    // ConvertTosRGBResources in demosaic.metal
+    struct Resources {
+        MTL::ResourceID linearImage;
+        MTL::ResourceID ltmMaskImage;
+        MTL::ResourceID grainImage;
+        MTL::ResourceID colorLut;
+        MTL::ResourceID toneCurveLut;
+        uint64_t histogram;
+    };
+
+    SpecializedKernel<ArgumentBinding,         // resources
            MTL::Texture*,           // rgbImage
            Matrix3x3,               // transform
            RGBConversionParameters, // demosaicParameters
-           MTL::Buffer*,            // histogramBuffer
            simd::float2,            // lumaVariance
-           MTL::Buffer*,            // noisePermutation
-           MTL::Buffer*             // noiseGradient
+           simd::int2,              // grainOffset
+           Matrix3x3                // inputTransform
     > kernel;
 
-    gls::Buffer<std::array<int, Noise2D::arraySize>> permBuffer;
-    gls::Buffer<std::array<std::array<float, 2>, Noise2D::arraySize>> gradBuffer;
+    SpecializedKernel<ArgumentBinding,         // resources
+           MTL::Texture*,           // lumaImage
+           MTL::Texture*,           // chromaImage
+           Matrix3x3,               // transform
+           RGBConversionParameters, // demosaicParameters
+           simd::float2,            // lumaVariance
+           simd::int2,              // grainOffset
+           int,                     // bitDepth
+           Matrix3x3                // inputTransform
+    > ycbcr420Kernel;
+
+    SpecializedKernel<ArgumentBinding,         // resources
+           MTL::Texture*,           // rgbImage
+           MTL::Texture*,           // lumaImage
+           MTL::Texture*,           // displayImage
+           MTL::Texture*,           // thumbnailImage
+           Matrix3x3,               // transform
+           RGBConversionParameters, // demosaicParameters
+           simd::float2,            // lumaVariance
+           simd::int2,              // grainOffset
+           simd::float3,            // lumaWeights
+           int,                     // blockSize
+           Matrix3x3                // inputTransform
+    > multiOutputKernel;
 
-    void randomSeed(unsigned seed) {
-        Noise2D::randomSeed(seed);
-    }
+    Kernel<MTL::Texture*,           // colorLut
+           Matrix3x3,               // transform
+           RGBConversionParameters, // demosaicParameters
+           MTL::Buffer*             // histogramBuffer
+    > bakeColorLut;
+
+    Kernel<MTL::Texture*,           // toneCurveLut
+           RGBConversionParameters  // demosaicParameters
+    > bakeToneCurveLut;
 
-    void initGradients() {
-        auto& perm = *permBuffer.data();
-        auto& grad = *gradBuffer.data();
+    // Optional images written by the same pass as the sRGB output, a write each instead of another read of the image
+    struct ExtraOutputs {
+        // Registration luma, the output's size: convertToGrayscale of the sRGB pixels with lumaWeights
+        gls::mtl_image_2d<float>* luma = nullptr;
+        std::array<float, 3> lumaWeights = { 0.2126, 0.7152, 0.0722 };
 
-        Noise2D::initGradients(&perm, &grad);
+        // 8 bit copy of the output for display
+        gls::mtl_image_2d<gls::pixel<uint8_t, 4>>* display = nullptr;
+
+        // Box filtered thumbnail, the output's size divided by thumbnailScale and rounded up
+        gls::mtl_image_2d<gls::pixel_float4>* thumbnail = nullptr;
+        int thumbnailScale = 8;
+
+        bool empty() const {
+            return !luma && !display && !thumbnail;
+        }
+
+        static gls::size thumbnailSize(const gls::size& imageSize, int thumbnailScale) {
+            return { (imageSize.width + thumbnailScale - 1) / thumbnailScale, (imageSize.height + thumbnailScale - 1) / thumbnailScale };
+        }
+    };
+
+    // kColorLutSize and kToneCurveLutSize in demosaic.metal
+    static constexpr int kColorLutSize = 33;
+    static constexpr int kToneCurveLutSize = 1024;
+
+    NS::SharedPtr<MTL::Texture> colorLut;
+    NS::SharedPtr<MTL::Texture> toneCurveLut;
+
+    // The inputs are the graph's intermediates, the grain and the lookup tables: one argument buffer per graph
+    mutable ArgumentTable<Resources> resourceTable;
+
+    static NS::SharedPtr<MTL::Texture> lutTexture(MTL::Device* device, MTL::TextureType textureType,
+                                                  MTL::PixelFormat pixelFormat, int size) {
+        auto textureDesc = NS::TransferPtr(MTL::TextureDescriptor::alloc()->init());
+        textureDesc->setTextureType(textureType);
+        textureDesc->setPixelFormat(pixelFormat);
+        textureDesc->setWidth(size);
+        textureDesc->setHeight(textureType == MTL::TextureType3D ? size : 1);
+        textureDesc->setDepth(textureType == MTL::TextureType3D ? size : 1);
+        textureDesc->setStorageMode(MTL::StorageModePrivate);
+        textureDesc->setUsage(MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite);
+        return NS::TransferPtr(device->newTexture(textureDesc.get()));
     }
 
     convertTosRGBKernel(MetalContext* context) : kernel(context, "convertTosRGB"),
-        permBuffer(context->device(), 1),
-        gradBuffer(context->device(), 1)
+        ycbcr420Kernel(context, "convertToYCbCr420"),
+        multiOutputKernel(context, "convertTosRGBMultiOutput"),
+        bakeColorLut(context, "bakeColorLut"),
+        bakeToneCurveLut(context, "bakeToneCurveLut"),
+        colorLut(lutTexture(context->device(), MTL::TextureType3D, MTL::PixelFormatRGBA16Float, kColorLutSize)),
+        toneCurveLut(lutTexture(context->device(), MTL::TextureType1D, MTL::PixelFormatR16Float, kToneCurveLutSize)),
+        resourceTable(context->device())
         { }
 
+    ArgumentBinding bindResources(const gls::mtl_image_2d<gls::pixel_float4>& linearImage,
+                                  const gls::mtl_image_2d<gls::pixel_float>& ltmMaskImage,
+                                  const gls::mtl_image_2d<gls::pixel_float>& grainImage, MTL::Buffer* histogramBuffer) const {
+        using table = ArgumentTable<Resources>;
+        const Resources arguments = {
+            table::resourceID(linearImage.texture()),
+            table::resourceID(ltmMaskImage.texture()),
+            table::resourceID(grainImage.texture()),
+            table::resourceID(colorLut.get()),
+            table::resourceID(toneCurveLut.get()),
+            table::gpuAddress(histogramBuffer)
+        };
+        return resourceTable.bind(arguments, { linearImage.texture(), ltmMaskImage.texture(), grainImage.texture(),
+                                               colorLut.get(), toneCurveLut.get(), histogramBuffer });
+    }
+
+    // The linear image is camera RGB, or with ycbcrToCam the denoiser's YCbCr, converted as it is read in place of a
+    // transformImageKernel pass
+    static Matrix3x3 inputTransform(const gls::Matrix<3, 3>* ycbcrToCam) {
+        return Matrix3x3(ycbcrToCam ? *ycbcrToCam : gls::Matrix<3, 3>::identity());
+    }
+
+    // With colorLut the frame's color conversion and tone curve are evaluated once in the lookup tables, the
+    // per-pixel kernels only add the local tone mapping and the grain
+    FunctionConstants bakeLuts(MetalContext* context, const DemosaicParameters& demosaicParameters,
+                               MTL::Buffer* histogramBuffer, bool useColorLut) const {
+        if (useColorLut) {
+            bakeColorLut(context, /*gridSize=*/ MTL::Size(kColorLutSize, kColorLutSize, kColorLutSize), colorLut.get(),
+                         demosaicParameters.rgb_cam, demosaicParameters.rgbConversionParameters, histogramBuffer);
+            bakeToneCurveLut(context, /*gridSize=*/ MTL::Size(kToneCurveLutSize, 1, 1), toneCurveLut.get(),
+                             demosaicParameters.rgbConversionParameters);
+        }
+        return FunctionConstants().set(kColorLutConstant, useColorLut);
+    }
+
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& linearImage,
                      const gls::mtl_image_2d<gls::pixel_float>& ltmMaskImage,
                      const DemosaicParameters& demosaicParameters, MTL::Buffer* histogramBuffer,
-                     const gls::Vector<2>& luma_nlf,
-                     gls::mtl_image_2d<gls::pixel_float4>* rgbImage) const {
+                     const gls::Vector<2>& luma_nlf, const gls::mtl_image_2d<gls::pixel_float>& grainImage,
+                     simd::int2 grainOffset, gls::mtl_image_2d<gls::pixel_float4>* rgbImage, bool useColorLut = false,
+                     const gls::Matrix<3, 3>* ycbcrToCam = nullptr) const {
         const auto& transform = demosaicParameters.rgb_cam;
+        const auto functionConstants = bakeLuts(context, demosaicParameters, histogramBuffer, useColorLut)
+            .set(kYCbCrInputConstant, ycbcrToCam != nullptr);
 
-        kernel(context, /*gridSize=*/ MTL::Size(rgbImage->width, rgbImage->height, 1), linearImage.texture(),
-               ltmMaskImage.texture(), rgbImage->texture(), transform, demosaicParameters.rgbConversionParameters,
-               histogramBuffer, simd::float2 { luma_nlf[0], luma_nlf[1] },permBuffer.buffer(), gradBuffer.buffer());
+        kernel[functionConstants](context, /*gridSize=*/ MTL::Size(rgbImage->width, rgbImage->height, 1),
+               bindResources(linearImage, ltmMaskImage, grainImage, histogramBuffer), rgbImage->texture(), transform,
+               demosaicParameters.rgbConversionParameters, simd::float2 { luma_nlf[0], luma_nlf[1] }, grainOffset,
+               inputTransform(ycbcrToCam));
+    }
+
+    // With extra outputs each thread converts a thumbnailScale x thumbnailScale block, or a single pixel without
+    // a thumbnail. Throws if an extra output doesn't match the size of rgbImage.
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& linearImage,
+                     const gls::mtl_image_2d<gls::pixel_float>& ltmMaskImage,
+                     const DemosaicParameters& demosaicParameters, MTL::Buffer* histogramBuffer,
+                     const gls::Vector<2>& luma_nlf, const gls::mtl_image_2d<gls::pixel_float>& grainImage,
+                     simd::int2 grainOffset, gls::mtl_image_2d<gls::pixel_float4>* rgbImage,
+                     const ExtraOutputs& extraOutputs, bool useColorLut = false,
+                     const gls::Matrix<3, 3>* ycbcrToCam = nullptr) const {
+        if (extraOutputs.empty()) {
+            operator()(context, linearImage, ltmMaskImage, demosaicParameters, histogramBuffer, luma_nlf, grainImage,
+                       grainOffset, rgbImage, useColorLut, ycbcrToCam);
+            return;
+        }
+        const int blockSize = extraOutputs.thumbnail ? std::max(extraOutputs.thumbnailScale, 1) : 1;
+        if ((extraOutputs.luma && extraOutputs.luma->size() != rgbImage->size()) ||
+            (extraOutputs.display && extraOutputs.display->size() != rgbImage->size()) ||
+            (extraOutputs.thumbnail && extraOutputs.thumbnail->size() != ExtraOutputs::thumbnailSize(rgbImage->size(), blockSize))) {
+            throw std::runtime_error("convertTosRGBKernel: extra output size mismatch");
+        }
+
+        const auto& transform = demosaicParameters.rgb_cam;
+        const auto functionConstants = bakeLuts(context, demosaicParameters, histogramBuffer, useColorLut)
+            .set(kLumaOutputConstant, extraOutputs.luma != nullptr)
+            .set(kDisplayOutputConstant, extraOutputs.display != nullptr)
+            .set(kThumbnailOutputConstant, extraOutputs.thumbnail != nullptr)
+            .set(kYCbCrInputConstant, ycbcrToCam != nullptr);
+
+        const auto& lumaWeights = extraOutputs.lumaWeights;
+        const auto gridSize = ExtraOutputs::thumbnailSize(rgbImage->size(), blockSize);
+        multiOutputKernel[functionConstants](context, /*gridSize=*/ MTL::Size(gridSize.width, gridSize.height, 1),
+                          bindResources(linearImage, ltmMaskImage, grainImage, histogramBuffer), rgbImage->texture(),
+                          extraOutputs.luma ? extraOutputs.luma->texture() : nullptr,
+                          extraOutputs.display ? extraOutputs.display->texture() : nullptr,
+                          extraOutputs.thumbnail ? extraOutputs.thumbnail->texture() : nullptr, transform,
+                          demosaicParameters.rgbConversionParameters, simd::float2 { luma_nlf[0], luma_nlf[1] },
+                          grainOffset, simd::float3 { lumaWeights[0], lumaWeights[1], lumaWeights[2] }, blockSize,
+                          inputTransform(ycbcrToCam));
+    }
+
+    // Bi-planar 4:2:0 output, one thread per 2x2 quad
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& linearImage,
+                     const gls::mtl_image_2d<gls::pixel_float>& ltmMaskImage,
+                     const DemosaicParameters& demosaicParameters, MTL::Buffer* histogramBuffer,
+                     const gls::Vector<2>& luma_nlf, const gls::mtl_image_2d<gls::pixel_float>& grainImage,
+                     simd::int2 grainOffset, gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage, bool useColorLut = false,
+                     const gls::Matrix<3, 3>* ycbcrToCam = nullptr) const {
+        const auto& transform = demosaicParameters.rgb_cam;
+        const auto functionConstants = bakeLuts(context, demosaicParameters, histogramBuffer, useColorLut)
+            .set(kYCbCrInputConstant, ycbcrToCam != nullptr);
+
+        ycbcr420Kernel[functionConstants](context, /*gridSize=*/ MTL::Size((ycbcrImage->width + 1) / 2, (ycbcrImage->height + 1) / 2, 1),
+                       bindResources(linearImage, ltmMaskImage, grainImage, histogramBuffer),
+                       ycbcrImage->lumaTexture(), ycbcrImage->chromaTexture(), transform,
+                       demosaicParameters.rgbConversionParameters, simd::float2 { luma_nlf[0], luma_nlf[1] },
+                       grainOffset, ycbcrImage->bitDepth, inputTransform(ycbcrToCam));
+    }
+};
+
+// Low latency preview: 2x2 binning of the raw data to half resolution YCbCr
+struct previewRawToYCbCrKernel {
+    SpecializedKernel<MTL::Texture*,     // rawImage
+           MTL::Texture*,     // ycbcrImage
+           int,               // bayerPattern
+           simd::half4,       // scaleMul
+           half,              // blackLevel
+           MTL::Texture*,     // lensShadingMap
+           Matrix3x3,         // transform
+           simd::float4       // lensShadingGeometry
+    > kernel;
+
+    previewRawToYCbCrKernel(MetalContext* context) : kernel(context, "previewRawToYCbCr") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                     gls::mtl_image_2d<gls::pixel_float4>* ycbcrImage, BayerPattern bayerPattern,
+                     gls::Vector<4> scaleMul, float blackLevel, const LensShading& lensShading,
+                     const gls::Matrix<3, 3>& cam_to_ycbcr) const {
+        assert(rawImage.width / 2 == ycbcrImage->width && rawImage.height / 2 == ycbcrImage->height);
+
+        const auto functionConstants = bayerPatternConstants(bayerPattern).set(kLensShadingConstant, lensShading.enabled);
+
+        kernel[functionConstants](context, /*gridSize=*/ MTL::Size(ycbcrImage->width, ycbcrImage->height, 1),
+               rawImage.texture(), ycbcrImage->texture(), bayerPattern,
+               simd::half4 { (half) scaleMul[0], (half) scaleMul[1], (half) scaleMul[2], (half) scaleMul[3] },
+               blackLevel, lensShading.gainMap->texture(), cam_to_ycbcr, lensShading.geometry);
+    }
+};
+
+// Low latency preview: color conversion fused with the tone curve
+struct previewTosRGBKernel {
+    Kernel<MTL::Texture*,           // ycbcrImage
+           MTL::Texture*,           // rgbImage
+           Matrix3x3,               // ycbcrToCam
+           Matrix3x3,               // transform
+           RGBConversionParameters, // parameters
+           simd::float2             // levels
+    > kernel;
+
+    previewTosRGBKernel(MetalContext* context) : kernel(context, "previewTosRGB") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& ycbcrImage,
+                     const gls::Matrix<3, 3>& ycbcr_to_cam, const DemosaicParameters& demosaicParameters,
+                     const RGBConversionParameters& rgbConversionParameters, float blackLevel, float mean,
+                     gls::mtl_image_2d<gls::pixel_float4>* rgbImage) const {
+        kernel(context, /*gridSize=*/ MTL::Size(rgbImage->width, rgbImage->height, 1),
+               ycbcrImage.texture(), rgbImage->texture(), ycbcr_to_cam, demosaicParameters.rgb_cam,
+               rgbConversionParameters, simd::float2 { blackLevel, mean });
+    }
+};
+
+// Gallery renditions of the final image from the pyramid levels, see renditionTosRGB in demosaic.metal
+struct renditionTosRGBKernel {
+    Kernel<MTL::Texture*,           // ycbcrImage
+           MTL::Texture*,           // ltmMaskImage
+           MTL::Texture*,           // rgbImage
+           Matrix3x3,               // ycbcrToCam
+           Matrix3x3,               // transform
+           RGBConversionParameters, // parameters
+           MTL::Buffer*             // histogramBuffer
+    > kernel;
+
+    renditionTosRGBKernel(MetalContext* context) : kernel(context, "renditionTosRGB") { }
+
+    // The size of a rendition with the given long side, at most the image's size
+    static gls::size renditionSize(const gls::size& imageSize, int longSide) {
+        const int imageLongSide = std::max(imageSize.width, imageSize.height);
+        if (longSide >= imageLongSide) {
+            return imageSize;
+        }
+        const float scale = longSide / (float) imageLongSide;
+        return { std::max((int) std::lround(imageSize.width * scale), 1),
+                 std::max((int) std::lround(imageSize.height * scale), 1) };
+    }
+
+    // The coarsest of the levels, finest first, at least as large as rgbImage
+    static const gls::mtl_image_2d<gls::pixel_float4>* sourceLevel(const std::vector<const gls::mtl_image_2d<gls::pixel_float4>*>& levels,
+                                                                   const gls::size& renditionSize) {
+        const gls::mtl_image_2d<gls::pixel_float4>* source = nullptr;
+        for (const auto level : levels) {
+            if (!source || (level->width >= renditionSize.width && level->height >= renditionSize.height)) {
+                source = level;
+            }
+        }
+        return source;
+    }
+
+    void operator() (MetalContext* context, const std::vector<const gls::mtl_image_2d<gls::pixel_float4>*>& levels,
+                     const gls::mtl_image_2d<gls::pixel_float>& ltmMaskImage, const gls::Matrix<3, 3>& ycbcr_to_cam,
+                     const DemosaicParameters& demosaicParameters, MTL::Buffer* histogramBuffer,
+                     gls::mtl_image_2d<gls::pixel_float4>* rgbImage) const {
+        const auto source = sourceLevel(levels, rgbImage->size());
+        if (!source) {
+            throw std::runtime_error("renditionTosRGBKernel: no source level");
+        }
+        kernel(context, /*gridSize=*/ MTL::Size(rgbImage->width, rgbImage->height, 1),
+               source->texture(), ltmMaskImage.texture(), rgbImage->texture(), ycbcr_to_cam,
+               demosaicParameters.rgb_cam, demosaicParameters.rgbConversionParameters, histogramBuffer);
     }
 };
 
@@ -687,6 +2611,111 @@ struct convertToGrayscale {
     }
 };
 
+struct rawGreenToGrayscaleKernel {
+    Kernel<
+        MTL::Texture*,  // rawRGBAImage
+        MTL::Texture*,  // grayscaleImage
+        simd::float2    // levels
+    > kernel;
+
+    rawGreenToGrayscaleKernel(MetalContext* context) : kernel(context, "rawGreenToGrayscale") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& rawRGBAImage,
+                     gls::mtl_image_2d<float>* grayscaleImage, float blackLevel, float greenScale) const {
+        kernel(context, /*gridSize=*/ MTL::Size(grayscaleImage->width, grayscaleImage->height, 1),
+               rawRGBAImage.texture(), grayscaleImage->texture(), simd::float2 { blackLevel, greenScale });
+    }
+};
+
+// Burst frame scores, see frameScoreLevel, frameSharpness and frameResidual in demosaic.metal and BurstFrameSelector
+struct burstFrameScoreKernel {
+    // kFrameScoreGroupSize and kFrameScoreSums in demosaic.metal
+    static constexpr int kThreadGroupSize = 16;
+    static constexpr int kSums = 3;
+
+    // Of a sharpness or residual measure: the gradient energy or the absolute difference, the luma and the pixels
+    struct Sums {
+        float value = 0;
+        float luma = 0;
+        float count = 0;
+    };
+
+    SpecializedKernel<MTL::Texture*,  // rawImage
+           MTL::Texture*,  // levelImage
+           int,            // bayerPattern
+           simd::float2    // levels
+    > levelKernel;
+
+    Kernel<MTL::Texture*,  // levelImage
+           MTL::Buffer*    // partialSums
+    > sharpnessKernel;
+
+    Kernel<MTL::Texture*,  // referenceImage
+           MTL::Texture*,  // frameImage
+           Matrix3x3,      // homography
+           MTL::Buffer*    // partialSums
+    > residualKernel;
+
+    std::unique_ptr<gls::Buffer<float>> _partialSums;
+    int _groups = 0;
+
+    burstFrameScoreKernel(MetalContext* context) :
+        levelKernel(context, "frameScoreLevel"),
+        sharpnessKernel(context, "frameSharpness"),
+        residualKernel(context, "frameResidual") { }
+
+    // The level is 1/8 of the raw image's size
+    static gls::size levelSize(const gls::size& rawImageSize) {
+        return { rawImageSize.width / 8, rawImageSize.height / 8 };
+    }
+
+    void level(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+               gls::mtl_image_2d<float>* levelImage, BayerPattern bayerPattern, float blackLevel, float greenScale) const {
+        assert(levelImage->size() == levelSize(rawImage.size()));
+
+        levelKernel[bayerPatternConstants(bayerPattern)](context, /*gridSize=*/ MTL::Size(levelImage->width, levelImage->height, 1),
+                    rawImage.texture(), levelImage->texture(), bayerPattern, simd::float2 { blackLevel, greenScale });
+    }
+
+    void sharpness(MetalContext* context, const gls::mtl_image_2d<float>& levelImage) {
+        const auto gridSize = groupGrid(context, levelImage.size());
+        sharpnessKernel(context, gridSize, /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+                        levelImage.texture(), _partialSums->buffer());
+    }
+
+    // The homography maps the reference level's coordinates to the frame level's
+    void residual(MetalContext* context, const gls::mtl_image_2d<float>& referenceImage,
+                  const gls::mtl_image_2d<float>& frameImage, const gls::Matrix<3, 3>& homography) {
+        const auto gridSize = groupGrid(context, referenceImage.size());
+        residualKernel(context, gridSize, /*threadGroupSize=*/ MTL::Size(kThreadGroupSize, kThreadGroupSize, 1),
+                       referenceImage.texture(), frameImage.texture(), homography, _partialSums->buffer());
+    }
+
+    // Of the last measure, valid once its command buffer has completed
+    Sums sums() const {
+        Sums sums;
+        const float* partialSums = _partialSums->data();
+        for (int group = 0; group < _groups; group++) {
+            sums.value += partialSums[group * kSums + 0];
+            sums.luma += partialSums[group * kSums + 1];
+            sums.count += partialSums[group * kSums + 2];
+        }
+        return sums;
+    }
+
+private:
+    // Whole threadgroups, with a partial sums slot each
+    MTL::Size groupGrid(MetalContext* context, const gls::size& imageSize) {
+        const int groupsX = (imageSize.width + kThreadGroupSize - 1) / kThreadGroupSize;
+        const int groupsY = (imageSize.height + kThreadGroupSize - 1) / kThreadGroupSize;
+        _groups = groupsX * groupsY;
+        if (!_partialSums || _partialSums->size() < _groups * kSums) {
+            _partialSums = std::make_unique<gls::Buffer<float>>(context->device(), _groups * kSums);
+        }
+        return MTL::Size(groupsX * kThreadGroupSize, groupsY * kThreadGroupSize, 1);
+    }
+};
+
 struct RegisterAndFuseKernel {
     Kernel<
         MTL::Texture*,      // inputImage0
@@ -709,20 +2738,133 @@ struct RegisterAndFuseKernel {
     }
 };
 
+// Burst merge of several frames in one pass: the frames are warped with their homographies and accumulated per output
+// pixel, the fused image is written once per kMaxFrames frames instead of once per frame. The frames are bound with
+// an argument buffer, see registerAndFuseFrames in SURF.metal.
+struct RegisterAndFuseFramesKernel {
+    // kMaxFusedFrames in SURF.metal
+    static constexpr int kMaxFrames = 8;
+
+    // FusedFrames and FusedFrameHomographies in SURF.metal
+    struct Frames {
+        MTL::ResourceID images[kMaxFrames];
+    };
+
+    struct Homographies {
+        simd::float3 m[kMaxFrames][3];
+    };
+
+    Kernel<
+        ArgumentBinding,    // frames
+        MTL::Texture*,      // fusedImage
+        MTL::Texture*,      // newFusedImage
+        Homographies,       // homographies
+        int,                // frameCount
+        int                 // priorCount
+    > registerAndFuseFrames;
+
+    mutable ArgumentTable<Frames> frameTable;
+
+    RegisterAndFuseFramesKernel(MetalContext* context) :
+        registerAndFuseFrames(context, "registerAndFuseFrames"),
+        frameTable(context->device()) { }
+
+    // Adds the frames to fusedImage, which holds the average of priorCount frames (none with priorCount == 0, e.g. when
+    // the reference is the first frame with an identity homography). The homographies map fusedImage's coordinates to
+    // the frames'. Longer bursts are fused kMaxFrames frames at a time, nothing waits for the GPU.
+    void operator() (MetalContext* context, const std::vector<const gls::mtl_image_2d<gls::pixel_float4>*>& frames,
+                     const std::vector<gls::Matrix<3, 3>>& homographies, int priorCount,
+                     gls::mtl_image_2d<gls::pixel_float4>* fusedImage) const {
+        if (frames.size() != homographies.size()) {
+            throw std::runtime_error("RegisterAndFuseFramesKernel: one homography per frame");
+        }
+        using table = ArgumentTable<Frames>;
+        for (int first = 0; first < (int) frames.size(); first += kMaxFrames) {
+            const int frameCount = std::min(kMaxFrames, (int) frames.size() - first);
+
+            Frames arguments = {};
+            Homographies frameHomographies = {};
+            std::vector<MTL::Resource*> resources;
+            for (int i = 0; i < frameCount; i++) {
+                const auto texture = frames[first + i]->texture();
+                arguments.images[i] = table::resourceID(texture);
+                resources.push_back(texture);
+
+                const auto& homography = homographies[first + i];
+                for (int j = 0; j < 3; j++) {
+                    frameHomographies.m[i][j] = { homography[j][0], homography[j][1], homography[j][2] };
+                }
+            }
+
+            registerAndFuseFrames(context, /*gridSize=*/ MTL::Size(fusedImage->width, fusedImage->height, 1),
+                                  frameTable.bind(arguments, std::move(resources)), fusedImage->texture(),
+                                  fusedImage->texture(), frameHomographies, frameCount, priorCount + first);
+        }
+    }
+};
+
 template <typename T>
 struct RegisterImageKernel {
     Kernel<
         MTL::Texture*,      // inputImage
         MTL::Texture*,      // outputImage
-        Matrix3x3           // homography
+        WarpTransform       // transform
     > registerImage;
 
-    RegisterImageKernel(MetalContext* context) : registerImage(context, "registerImage") { }
+    Kernel<
+        MTL::Texture*,      // inputImage
+        MTL::Texture*,      // outputImage
+        MTL::Texture*,      // motionField
+        int                 // tileSize
+    > registerImageMotionField;
+
+    Kernel<
+        MTL::Texture*,      // inputImage
+        MTL::Texture*,      // outputImage
+        MeshWarp            // mesh
+    > registerImageMesh;
+
+    RegisterImageKernel(MetalContext* context) :
+        registerImage(context, "registerImage"),
+        registerImageMotionField(context, "registerImageMotionField"),
+        registerImageMesh(context, "registerImageMesh") { }
+
+    // Warp with per cell homographies (see gls::FindMeshHomography) over the output image, interpolated per pixel.
+    // Doesn't wait for the GPU.
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
+                     gls::mtl_image_2d<T>* outputImage, const MeshWarp& mesh) {
+        registerImageMesh(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
+                          inputImage.texture(), outputImage->texture(), mesh);
+    }
+
+    // Warp with the per tile motion field of PyramidProcessor::alignFrame instead of a global homography
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
+                     gls::mtl_image_2d<T>* outputImage, const gls::mtl_image_2d<gls::pixel_float2>& motionField,
+                     int tileSize = alignTilesKernel::tileSize) {
+        registerImageMotionField(context, /*gridSize=*/ MTL::Size(outputImage->width, outputImage->height, 1),
+                                 inputImage.texture(), outputImage->texture(), motionField.texture(), tileSize);
+
+        // TODO: verify that this is a good idea
+        context->waitForCompletion();
+    }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
                      gls::mtl_image_2d<T>* outputImage, const gls::Matrix<3, 3>& homography) {
+        (*this)(context, inputImage, outputImage, WarpTransform(homography));
+    }
+
+    // Registers and corrects the lens distortion in one resampling, the output is in the undistorted geometry
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
+                     gls::mtl_image_2d<T>* outputImage, const gls::Matrix<3, 3>& homography,
+                     const std::optional<LensDistortion>& lensDistortion) {
+        (*this)(context, inputImage, outputImage,
+                WarpTransform(homography, lensDistortion, gls::size(outputImage->width, outputImage->height)));
+    }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& inputImage,
+                     gls::mtl_image_2d<T>* outputImage, const WarpTransform& transform) {
         registerImage(context, /*gridSize=*/ MTL::Size(inputImage.width, inputImage.height, 1),
-                      inputImage.texture(), outputImage->texture(), homography);
+                      inputImage.texture(), outputImage->texture(), transform);
 
         // TODO: verify that this is a good idea
         context->waitForCompletion();
@@ -733,19 +2875,125 @@ struct RegisterBayerImageKernel {
     Kernel<
         MTL::Texture*,      // inputImage
         MTL::Texture*,      // outputImage
-        Matrix3x3           // homography
+        WarpTransform       // transform
     > registerBayerImage;
 
     RegisterBayerImageKernel(MetalContext* context) : registerBayerImage(context, "registerBayerImage") { }
 
     void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& inputImage,
-                     gls::mtl_image_2d<gls::luma_pixel_16>* outputImage, const gls::Matrix<3, 3>& homography) {
+                     gls::mtl_image_2d<gls::luma_pixel_16>* outputImage, const gls::Matrix<3, 3>& homography,
+                     const std::optional<LensDistortion>& lensDistortion = std::nullopt) {
+        // The homography and the distortion model are in the coordinates of the half resolution color planes
+        const auto transform = WarpTransform(homography, lensDistortion,
+                                             gls::size(outputImage->width / 2, outputImage->height / 2));
         registerBayerImage(context, /*gridSize=*/ MTL::Size(inputImage.width, inputImage.height, 1),
-                           inputImage.texture(), outputImage->texture(), homography);
+                           inputImage.texture(), outputImage->texture(), transform);
 
         // TODO: verify that this is a good idea
         context->waitForCompletion();
     }
 };
 
+// Running average of a burst in the Bayer domain, the homography maps the reference frame's half resolution
+// coordinates to the frame's
+struct RegisterAndFuseBayerKernel {
+    Kernel<
+        MTL::Texture*,      // fusedImage
+        MTL::Texture*,      // inputImage
+        MTL::Texture*,      // newFusedImage
+        Matrix3x3,          // homography
+        int                 // count
+    > registerAndFuseBayer;
+
+    RegisterAndFuseBayerKernel(MetalContext* context) : registerAndFuseBayer(context, "registerAndFuseBayer") { }
+
+    void operator() (MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& fusedImage,
+                     const gls::mtl_image_2d<gls::luma_pixel_16>& inputImage,
+                     gls::mtl_image_2d<gls::luma_pixel_16>* newFusedImage, const gls::Matrix<3, 3>& homography, int count) const {
+        assert(newFusedImage != &fusedImage);
+
+        registerAndFuseBayer(context, /*gridSize=*/ MTL::Size(fusedImage.width, fusedImage.height, 1),
+                             fusedImage.texture(), inputImage.texture(), newFusedImage->texture(), homography, count);
+    }
+};
+
+// Mirrors TensorLayout in demosaic.metal: the mapping between the pixels of an image and the elements of a tensor of
+// the Core ML models. Grid index g maps to the tensor element t = tensorOffset + g, at t.y * rowStride + t.x *
+// columnStride + c * channelStride, and to the image pixel origin + t, or origin + t.yx when transposed. The tensor
+// values are scale * pixel + offset.
+struct TensorLayout {
+    simd::int2 origin = 0;
+    simd::int2 tensorOffset = 0;
+    int channels = 1;
+    int channelStride = 0;
+    int rowStride = 0;
+    int columnStride = 1;
+    int transpose = 0;
+    float scale = 1;
+    float offset = 0;
+
+    // Planar layout of an [N, C, H, W] tensor
+    static TensorLayout nchw(int channels, int height, int width) {
+        TensorLayout layout;
+        layout.channels = channels;
+        layout.channelStride = height * width;
+        layout.rowStride = width;
+        layout.columnStride = 1;
+        return layout;
+    }
+
+    // Interleaved layout of an [N, H, W, C] tensor
+    static TensorLayout nhwc(int channels, int height, int width) {
+        TensorLayout layout;
+        layout.channels = channels;
+        layout.channelStride = 1;
+        layout.rowStride = width * channels;
+        layout.columnStride = channels;
+        return layout;
+    }
+};
+
+// Image to tensor conversion of a width x height region of the tensor, Float32 or Float16 tensors. Reads outside
+// of the image are clamped to its edges, which pads the tensors of the border tiles.
+struct imageToTensorKernel {
+    Kernel<
+        MTL::Texture*,  // image
+        MTL::Buffer*,   // tensor
+        TensorLayout    // layout
+    > imageToTensorFloat, imageToTensorHalf;
+
+    imageToTensorKernel(MetalContext* context) :
+        imageToTensorFloat(context, "imageToTensorFloat"),
+        imageToTensorHalf(context, "imageToTensorHalf") { }
+
+    template <typename T, typename TensorType>
+    void operator() (MetalContext* context, const gls::mtl_image_2d<T>& image, const gls::Buffer<TensorType>& tensor,
+                     const TensorLayout& layout, int width, int height) const {
+        static_assert(std::is_same<TensorType, float>::value || std::is_same<TensorType, gls::float16_t>::value);
+        const auto& kernel = std::is_same<TensorType, float>::value ? imageToTensorFloat : imageToTensorHalf;
+        kernel(context, /*gridSize=*/ MTL::Size(width, height, 1), image.texture(), tensor.buffer(), layout);
+    }
+};
+
+// The inverse of imageToTensorKernel, the pixels of the region outside of the image are skipped
+struct tensorToImageKernel {
+    Kernel<
+        MTL::Buffer*,   // tensor
+        MTL::Texture*,  // image
+        TensorLayout    // layout
+    > tensorToImageFloat, tensorToImageHalf;
+
+    tensorToImageKernel(MetalContext* context) :
+        tensorToImageFloat(context, "tensorToImageFloat"),
+        tensorToImageHalf(context, "tensorToImageHalf") { }
+
+    template <typename TensorType, typename T>
+    void operator() (MetalContext* context, const gls::Buffer<TensorType>& tensor, gls::mtl_image_2d<T>* image,
+                     const TensorLayout& layout, int width, int height) const {
+        static_assert(std::is_same<TensorType, float>::value || std::is_same<TensorType, gls::float16_t>::value);
+        const auto& kernel = std::is_same<TensorType, float>::value ? tensorToImageFloat : tensorToImageHalf;
+        kernel(context, /*gridSize=*/ MTL::Size(width, height, 1), tensor.buffer(), image->texture(), layout);
+    }
+};
+
 #endif /* demosaic_kernels_h */
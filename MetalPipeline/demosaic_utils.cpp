@@ -13,11 +13,14 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <atomic>
+#include <cassert>
 #include <cstring>
 #include <iomanip>
 #include <numeric>
 
-#include "ThreadPool.hpp"
+#include "TaskScheduler.hpp"
+#include "gls_frame_arena.hpp"
 #include "tinyicc.hpp"
 
 #include "demosaic.hpp"
@@ -265,9 +268,42 @@ void white_balance(const gls::image<gls::luma_pixel_16>& rawImage, gls::Vector<3
     *wb_mul = *wb_mul / (*wb_mul)[1];
 }
 
-float unpackDNGMetadata(const gls::image<gls::luma_pixel_16>& rawImage, gls::tiff_metadata* dng_metadata,
-                        DemosaicParameters* demosaicParameters, const gls::Matrix<3, 3>& xyz_rgb,
-                        bool auto_white_balance, const gls::rectangle* gmb_position, bool rotate_180, float* highlights) {
+// A 4x4 CFA repeat of 2x2 blocks of the same color
+static bool isQuadBayerPattern(const std::vector<uint16_t>& cfaDimensions, const std::vector<uint8_t>& cfaPattern) {
+    if (cfaDimensions.size() != 2 || cfaDimensions[0] != 4 || cfaDimensions[1] != 4 || cfaPattern.size() != 16) {
+        return false;
+    }
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            if (cfaPattern[4 * y + x] != cfaPattern[4 * (y & ~1) + (x & ~1)]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Averages the 2x2 blocks of quad Bayer data, the result is a Bayer image with the blocks' pattern
+static gls::image<gls::luma_pixel_16> binQuadBayerImage(const gls::image<gls::luma_pixel_16>& rawImage) {
+    gls::image<gls::luma_pixel_16> bayerImage(2 * (rawImage.width / 4), 2 * (rawImage.height / 4));
+    for (int y = 0; y < bayerImage.height; y++) {
+        for (int x = 0; x < bayerImage.width; x++) {
+            const int sum = rawImage[2 * y][2 * x].luma + rawImage[2 * y][2 * x + 1].luma +
+                            rawImage[2 * y + 1][2 * x].luma + rawImage[2 * y + 1][2 * x + 1].luma;
+            bayerImage[y][x] = (uint16_t) ((sum + 2) / 4);
+        }
+    }
+    return bayerImage;
+}
+
+// rawImage is only read by the auto white balance and the color checker calibration
+static float unpackDNGMetadata(const gls::size& imageSize, const gls::image<gls::luma_pixel_16>* rawImage,
+                               gls::tiff_metadata* dng_metadata, DemosaicParameters* demosaicParameters,
+                               const gls::Matrix<3, 3>& xyz_rgb, bool auto_white_balance,
+                               const gls::rectangle* gmb_position, bool rotate_180, float* highlights,
+                               const AutoWhiteBalanceFunction& awbFunction) {
+    assert(rawImage || (!auto_white_balance && !gmb_position));
+
     const auto color_matrix1 = getVector<float>(*dng_metadata, TIFFTAG_COLORMATRIX1);
     const auto color_matrix2 = getVector<float>(*dng_metadata, TIFFTAG_COLORMATRIX2);
 
@@ -293,17 +329,47 @@ float unpackDNGMetadata(const gls::image<gls::luma_pixel_16>& rawImage, gls::tif
     demosaicParameters->raw_exposure_multiplier = exposure_multiplier;
     demosaicParameters->exposure_multiplier = std::min(exposure_multiplier, 1.0f);
 
-    demosaicParameters->bayerPattern = std::memcmp(cfa_pattern.data(), "\00\01\01\02", 4) == 0   ? BayerPattern::rggb
-                                       : std::memcmp(cfa_pattern.data(), "\02\01\01\00", 4) == 0 ? BayerPattern::bggr
-                                       : std::memcmp(cfa_pattern.data(), "\01\00\02\01", 4) == 0 ? BayerPattern::grbg
-                                                                                                 : BayerPattern::gbrg;
-    LOG_INFO(TAG) << "bayerPattern: " << BayerPatternName[demosaicParameters->bayerPattern] << std::endl;
+    // Quad Bayer: a 4x4 repeat of 2x2 blocks of the same color, the blocks are laid out as a Bayer pattern
+    const auto cfa_dimensions = getVector<uint16_t>(*dng_metadata, TIFFTAG_CFAREPEATPATTERNDIM);
+    demosaicParameters->quadBayer = isQuadBayerPattern(cfa_dimensions, cfa_pattern);
+    const auto bayer_pattern = demosaicParameters->quadBayer
+        ? std::vector<uint8_t> { cfa_pattern[0], cfa_pattern[2], cfa_pattern[8], cfa_pattern[10] }
+        : cfa_pattern;
+
+    demosaicParameters->bayerPattern = std::memcmp(bayer_pattern.data(), "\00\01\01\02", 4) == 0   ? BayerPattern::rggb
+                                       : std::memcmp(bayer_pattern.data(), "\02\01\01\00", 4) == 0 ? BayerPattern::bggr
+                                       : std::memcmp(bayer_pattern.data(), "\01\00\02\01", 4) == 0 ? BayerPattern::grbg
+                                                                                                   : BayerPattern::gbrg;
+    LOG_INFO(TAG) << "bayerPattern: " << BayerPatternName[demosaicParameters->bayerPattern]
+                  << (demosaicParameters->quadBayer ? " (quad Bayer)" : "") << std::endl;
+
+    // Lens shading gain maps, a malformed opcode list falls back to the calibration's radial correction
+    try {
+        demosaicParameters->lensShadingGainMap = LensShadingGainMap::fromDNGOpcodeList(
+            getVector<uint8_t>(*dng_metadata, TIFFTAG_OPCODELIST2), imageSize,
+            bayerOffsets[demosaicParameters->bayerPattern]);
+    } catch (const std::runtime_error& e) {
+        LOG_INFO(TAG) << "Ignoring the DNG gain maps: " << e.what() << std::endl;
+        demosaicParameters->lensShadingGainMap = nullptr;
+    }
+    if (demosaicParameters->lensShadingGainMap) {
+        LOG_INFO(TAG) << "Using the DNG lens shading gain maps" << std::endl;
+    }
+
+    // Lens distortion, corrected by the registration warps
+    try {
+        demosaicParameters->lensDistortion =
+            LensDistortion::fromDNGOpcodeList(getVector<uint8_t>(*dng_metadata, TIFFTAG_OPCODELIST3));
+    } catch (const std::runtime_error& e) {
+        LOG_INFO(TAG) << "Ignoring the DNG lens distortion: " << e.what() << std::endl;
+        demosaicParameters->lensDistortion = std::nullopt;
+    }
 
     gls::Vector<3> pre_mul;
     gls::Matrix<3, 3> cam_xyz;
     if (gmb_position) {
         demosaicParameters->noiseModel.rawNlf = estimateRawParameters(
-            rawImage, &cam_xyz, &pre_mul, demosaicParameters->black_level, demosaicParameters->white_level,
+            *rawImage, &cam_xyz, &pre_mul, demosaicParameters->black_level, demosaicParameters->white_level,
             demosaicParameters->bayerPattern, *gmb_position, rotate_180);
 
         // Obtain the rgb_cam matrix and pre_mul
@@ -332,9 +398,12 @@ float unpackDNGMetadata(const gls::image<gls::luma_pixel_16>& rawImage, gls::tif
         }
 
         auto cam_to_ycbcr = cam_ycbcr(demosaicParameters->rgb_cam, xyz_rgb);
+        const AutoWhiteBalanceFunction& whiteBalance = awbFunction ? awbFunction : autoWhiteBalance;
+        // The white balance statistics read Bayer quads
+        const auto bayerImage = demosaicParameters->quadBayer ? std::optional(binQuadBayerImage(*rawImage)) : std::nullopt;
         gls::Vector<3> cam_mul =
-            autoWhiteBalance(rawImage, cam_to_ycbcr, demosaicParameters->scale_mul, demosaicParameters->white_level,
-                             demosaicParameters->black_level, demosaicParameters->bayerPattern, highlights);
+            whiteBalance(bayerImage ? *bayerImage : *rawImage, cam_to_ycbcr, demosaicParameters->scale_mul, demosaicParameters->white_level,
+                         demosaicParameters->black_level, demosaicParameters->bayerPattern, highlights);
 
         LOG_INFO(TAG) << "Auto White Balance: " << cam_mul << std::endl;
 
@@ -365,6 +434,20 @@ float unpackDNGMetadata(const gls::image<gls::luma_pixel_16>& rawImage, gls::tif
     return exposure_multiplier;
 }
 
+float unpackDNGMetadata(const gls::image<gls::luma_pixel_16>& rawImage, gls::tiff_metadata* dng_metadata,
+                        DemosaicParameters* demosaicParameters, const gls::Matrix<3, 3>& xyz_rgb,
+                        bool auto_white_balance, const gls::rectangle* gmb_position, bool rotate_180, float* highlights,
+                        const AutoWhiteBalanceFunction& awbFunction) {
+    return unpackDNGMetadata(rawImage.size(), &rawImage, dng_metadata, demosaicParameters, xyz_rgb, auto_white_balance,
+                             gmb_position, rotate_180, highlights, awbFunction);
+}
+
+float unpackDNGMetadata(const gls::size& imageSize, gls::tiff_metadata* dng_metadata,
+                        DemosaicParameters* demosaicParameters, const gls::Matrix<3, 3>& xyz_rgb) {
+    return unpackDNGMetadata(imageSize, nullptr, dng_metadata, demosaicParameters, xyz_rgb, /*auto_white_balance=*/ false,
+                             /*gmb_position=*/ nullptr, /*rotate_180=*/ false, /*highlights=*/ nullptr, nullptr);
+}
+
 // clang-format off
 
 const char* GMBColorNames[24] {
@@ -427,9 +510,11 @@ void colorCheckerRawStats(const gls::image<gls::luma_pixel_16>& rawImage, float
     const gls::point b = offsets[blue];
     const gls::point g2 = offsets[green2];
 
-    int patchIdx = 0;
-    for (int row = 0; row < 4; row++) {
-        for (int col = 0; col < 6; col++, patchIdx++) {
+    // The patches are independent, the channel images are written at each patch's own pixels
+    gls::parallel_for(0, 24, /*grain=*/ 1, [&](int p0, int p1) {
+        for (int patchIdx = p0; patchIdx < p1; patchIdx++) {
+            const int row = patchIdx / 6;
+            const int col = patchIdx % 6;
             gls::rectangle patch = alignToQuad({gmb_position.x + col * patch_width + (int)(0.25 * patch_width),
                                                 gmb_position.y + row * patch_height + (int)(0.25 * patch_height),
                                                 (int)(0.5 * patch_width), (int)(0.5 * patch_height)});
@@ -497,17 +582,19 @@ void colorCheckerRawStats(const gls::image<gls::luma_pixel_16>& rawImage, float
 
             (*stats)[patchIdx] = {{avgR, avgG1, avgB, avgG2}, {varR, varG1, varB, varG2}};
         }
-    }
+    });
 
     if (rotate_180) {
         std::reverse(stats->begin(), stats->end());
     }
 
-    static int file_count = 0;
-    red_channel.write_png_file("/Users/fabio/red_channel" + std::to_string(file_count) + ".png", false);
-    green_channel.write_png_file("/Users/fabio/green_channel" + std::to_string(file_count) + ".png", false);
-    blue_channel.write_png_file("/Users/fabio/blue_channel" + std::to_string(file_count) + ".png", false);
-    green2_channel.write_png_file("/Users/fabio/green2_channel" + std::to_string(file_count++) + ".png", false);
+    // Calibration series are measured concurrently
+    static std::atomic<int> file_count = 0;
+    const int file_index = file_count++;
+    red_channel.write_png_file("/Users/fabio/red_channel" + std::to_string(file_index) + ".png", false);
+    green_channel.write_png_file("/Users/fabio/green_channel" + std::to_string(file_index) + ".png", false);
+    blue_channel.write_png_file("/Users/fabio/blue_channel" + std::to_string(file_index) + ".png", false);
+    green2_channel.write_png_file("/Users/fabio/green2_channel" + std::to_string(file_index) + ".png", false);
 }
 
 // Collect mean and variance of ColorChecker patches
@@ -519,9 +606,10 @@ void colorCheckerStats(gls::image<gls::pixel_float4>* image, const gls::rectangl
     int patch_width = gmb_position.width / 6;
     int patch_height = gmb_position.height / 4;
 
-    int patchIdx = 0;
-    for (int row = 0; row < 4; row++) {
-        for (int col = 0; col < 6; col++, patchIdx++) {
+    gls::parallel_for(0, 24, /*grain=*/ 1, [&](int p0, int p1) {
+        for (int patchIdx = p0; patchIdx < p1; patchIdx++) {
+            const int row = patchIdx / 6;
+            const int col = patchIdx % 6;
             gls::rectangle patch = {gmb_position.x + col * patch_width + (int)(0.25 * patch_width),
                                     gmb_position.y + row * patch_height + (int)(0.25 * patch_height),
                                     (int)(0.5 * patch_width), (int)(0.5 * patch_height)};
@@ -566,7 +654,7 @@ void colorCheckerStats(gls::image<gls::pixel_float4>* image, const gls::rectangl
 
             (*stats)[patchIdx] = {{avgY, avgCb, avgCr}, {varY, varCb, varCr}};
         }
-    }
+    });
 
     if (rotate_180) {
         std::reverse(stats->begin(), stats->end());
@@ -760,7 +848,10 @@ std::pair<gls::Vector<3>, int> autoWhiteBalanceKernel(const gls::image<gls::luma
     int highlightPixels = 0;
     // Compute the average ycbcr values
     gls::Vector<3> M = {0, 0, 0};
-    gls::image<gls::rgb_pixel_fp32> YUV(rawImage.width / 2, rawImage.height / 2);
+    // Half resolution ycbcr in the frame's arena, viewed as an image
+    const int yuvWidth = rawImage.width / 2, yuvHeight = rawImage.height / 2;
+    gls::frame_vector<gls::rgb_pixel_fp32> yuvData((size_t) yuvWidth * yuvHeight);
+    gls::image<gls::rgb_pixel_fp32> YUV(yuvWidth, yuvHeight, yuvWidth, std::span(yuvData.data(), yuvData.size()));
     for (int y = 0; y < rawImage.height; y += 2) {
         for (int x = 0; x < rawImage.width; x += 2) {
             // Compute the RGB value in the target color space clipping the highlights to white
@@ -885,32 +976,24 @@ gls::Vector<3> autoWhiteBalance(const gls::image<gls::luma_pixel_16>& rawImage,
     const int tileWidth = 2 * ((rawImage.width / hTiles) / 2);
     const int tileHeight = 2 * ((rawImage.height / vTiles) / 2);
 
-    ThreadPool threadPool(8);
-
     auto t_start = std::chrono::high_resolution_clock::now();
 
-    std::array<std::array<std::future<std::pair<gls::Vector<3>, int>>, hTiles>, vTiles> results;
-    for (int y = 0; y < vTiles; y++) {
-        for (int x = 0; x < hTiles; x++) {
-            results[y][x] = threadPool.enqueue([x, y, tileWidth, tileHeight, rgb_ycbcr, white, black, bayerPattern,
-                                                &rawImage, &scale_mul]() -> std::pair<gls::Vector<3>, int> {
-                int tile_x = x * tileWidth;
-                int tile_y = y * tileHeight;
-                const auto rawTile = gls::image<gls::luma_pixel_16>(rawImage, tile_x, tile_y, tileWidth, tileHeight);
-                return autoWhiteBalanceKernel(rawTile, rgb_ycbcr, scale_mul, white, black, bayerPattern,
-                                              /*highlightsFraction=*/0.01);
-            });
+    std::array<std::pair<gls::Vector<3>, int>, hTiles * vTiles> results;
+    gls::parallel_for(0, hTiles * vTiles, 1, [&](int t0, int t1) {
+        for (int t = t0; t < t1; t++) {
+            int tile_x = (t % hTiles) * tileWidth;
+            int tile_y = (t / hTiles) * tileHeight;
+            const auto rawTile = gls::image<gls::luma_pixel_16>(rawImage, tile_x, tile_y, tileWidth, tileHeight);
+            results[t] = autoWhiteBalanceKernel(rawTile, rgb_ycbcr, scale_mul, white, black, bayerPattern,
+                                                /*highlightsFraction=*/0.01);
         }
-    }
+    });
 
     gls::Vector<3> wbGain = {0, 0, 0};
     float highlightPixels = 0;
-    for (int y = 0; y < vTiles; y++) {
-        for (int x = 0; x < hTiles; x++) {
-            const auto& res = results[y][x].get();
-            wbGain += res.first;
-            highlightPixels += res.second;
-        }
+    for (const auto& res : results) {
+        wbGain += res.first;
+        highlightPixels += res.second;
     }
     wbGain /= (float)vTiles * hTiles;
     wbGain /= (float)wbGain[1];
@@ -1004,3 +1087,285 @@ std::vector<std::array<float, 3>> gaussianKernelBilinearWeights(float radius) {
 
     return weightsOut;
 }
+
+// --- CPU demosaicing, the fallback path when Metal isn't available ---
+
+// Runs process(y0, y1) on bands of rows [y0, y1) on all the CPU cores. The band height is even so that all bands
+// start on the same Bayer phase, the row loops are kept branch free to let the compiler vectorize them (NEON/SSE).
+template <typename F>
+static void processRowBands(int height, F process, int bandHeight = 64) {
+    gls::parallel_for(0, height, bandHeight, process);
+}
+
+// Mirror indexing around the image edges, preserves the Bayer phase
+static inline int mirrorIndex(int i, int size) { return i < 0 ? -i : i >= size ? 2 * (size - 1) - i : i; }
+
+static inline uint16_t clamp_uint16(int value) { return (uint16_t)std::clamp(value, 0, 0xffff); }
+
+// Gradient directed green interpolation (Hamilton-Adams): the green channel is estimated along the direction of
+// smallest gradient, the red and blue samples are copied to their channels for interpolateRedBlue
+void interpolateGreen(const gls::image<gls::luma_pixel_16>& rawImage, gls::image<gls::rgb_pixel_16>* rgbImage,
+                      BayerPattern bayerPattern) {
+    const int width = rawImage.width;
+    const int height = rawImage.height;
+    if (width < 4 || height < 4) {
+        throw std::runtime_error("interpolateGreen: image too small");
+    }
+
+    const auto& offsets = bayerOffsets[bayerPattern];
+    const auto r = offsets[0];
+    const auto b = offsets[2];
+
+    processRowBands(height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint16_t* rowM2 = &rawImage[mirrorIndex(y - 2, height)][0];
+            const uint16_t* rowM1 = &rawImage[mirrorIndex(y - 1, height)][0];
+            const uint16_t* row = &rawImage[y][0];
+            const uint16_t* rowP1 = &rawImage[mirrorIndex(y + 1, height)][0];
+            const uint16_t* rowP2 = &rawImage[mirrorIndex(y + 2, height)][0];
+            auto* out = &(*rgbImage)[y][0];
+
+            // Red or blue sites of this row
+            const bool redRow = (y & 1) == r.y;
+            const int cx = redRow ? r.x : b.x;
+            const int channel = redRow ? 0 : 2;
+
+            for (int x = 1 - cx; x < width; x += 2) {
+                out[x] = {0, row[x], 0};
+            }
+
+            const auto site = [&](int x, int xm2, int xm1, int xp1, int xp2) {
+                const int c = row[x];
+                const int gl = row[xm1], gr = row[xp1];
+                const int gu = rowM1[x], gd = rowP1[x];
+                const int lapH = 2 * c - row[xm2] - row[xp2];
+                const int lapV = 2 * c - rowM2[x] - rowP2[x];
+                const int dh = std::abs(gl - gr) + std::abs(lapH);
+                const int dv = std::abs(gu - gd) + std::abs(lapV);
+                const int gh = 2 * (gl + gr) + lapH;
+                const int gv = 2 * (gu + gd) + lapV;
+                const int g = dh < dv ? 2 * gh : dv < dh ? 2 * gv : gh + gv;
+
+                out[x] = {0, clamp_uint16(g / 8), 0};
+                out[x][channel] = c;
+            };
+
+            int x = cx;
+            for (; x < 2; x += 2) {
+                site(x, mirrorIndex(x - 2, width), mirrorIndex(x - 1, width), x + 1, x + 2);
+            }
+            for (; x < width - 2; x += 2) {
+                site(x, x - 2, x - 1, x + 1, x + 2);
+            }
+            for (; x < width; x += 2) {
+                site(x, x - 2, x - 1, mirrorIndex(x + 1, width), mirrorIndex(x + 2, width));
+            }
+        }
+    });
+}
+
+// Color difference interpolation of the red and blue channels over the green channel of interpolateGreen.
+// Only the missing samples are written, one channel at a time, so the bands can be processed in place.
+void interpolateRedBlue(gls::image<gls::rgb_pixel_16>* image, BayerPattern bayerPattern) {
+    const int width = image->width;
+    const int height = image->height;
+
+    const auto& offsets = bayerOffsets[bayerPattern];
+    const auto r = offsets[0];
+    const auto b = offsets[2];
+
+    processRowBands(height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const auto* rowM1 = &(*image)[mirrorIndex(y - 1, height)][0];
+            auto* row = &(*image)[y][0];
+            const auto* rowP1 = &(*image)[mirrorIndex(y + 1, height)][0];
+
+            // The color of the row's color sites and the other one
+            const bool redRow = (y & 1) == r.y;
+            const int cx = redRow ? r.x : b.x;
+            const int c = redRow ? 0 : 2;
+            const int o = 2 - c;
+
+            const auto diff = [](const gls::rgb_pixel_16& p, int channel) { return (int)p[channel] - (int)p[1]; };
+
+            // Green sites: the row's color from the horizontal neighbors, the other from the vertical ones
+            const auto greenSite = [&](int x, int xm1, int xp1) {
+                const int g = row[x][1];
+                row[x][c] = clamp_uint16(g + (diff(row[xm1], c) + diff(row[xp1], c)) / 2);
+                row[x][o] = clamp_uint16(g + (diff(rowM1[x], o) + diff(rowP1[x], o)) / 2);
+            };
+
+            // Color sites: the other color from the diagonal neighbors
+            const auto colorSite = [&](int x, int xm1, int xp1) {
+                const int g = row[x][1];
+                row[x][o] = clamp_uint16(g + (diff(rowM1[xm1], o) + diff(rowM1[xp1], o) + diff(rowP1[xm1], o) +
+                                              diff(rowP1[xp1], o)) / 4);
+            };
+
+            const auto processSites = [&](int x0, const auto& siteKernel) {
+                int x = x0;
+                if (x == 0) {
+                    siteKernel(0, 1, 1);
+                    x += 2;
+                }
+                for (; x < width - 1; x += 2) {
+                    siteKernel(x, x - 1, x + 1);
+                }
+                if (x == width - 1) {
+                    siteKernel(x, x - 1, x - 1);
+                }
+            };
+
+            processSites(1 - cx, greenSite);
+            processSites(cx, colorSite);
+        }
+    });
+}
+
+// Black level subtraction, white balance and normalization of the raw data, ahead of the color difference
+// interpolation which works best on white balanced data.
+static gls::image<gls::luma_pixel_16>::unique_ptr scaleRawImage(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                                const DemosaicParameters& demosaicParameters) {
+    auto scaledImage = std::make_unique<gls::image<gls::luma_pixel_16>>(rawImage.width, rawImage.height);
+
+    const auto& offsets = bayerOffsets[demosaicParameters.bayerPattern];
+    const int black = (int)demosaicParameters.black_level;
+    const float range = demosaicParameters.white_level - demosaicParameters.black_level;
+
+    // Per channel gains indexed by the Bayer phase of the pixel
+    float gain[2][2];
+    for (int c = 0; c < 4; c++) {
+        gain[offsets[c].y][offsets[c].x] = demosaicParameters.scale_mul[c] * 0xffff / range;
+    }
+
+    processRowBands(rawImage.height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const uint16_t* in = &rawImage[y][0];
+            uint16_t* out = &(*scaledImage)[y][0];
+            const float* g = gain[y & 1];
+            for (int x = 0; x < rawImage.width; x++) {
+                out[x] = (uint16_t)std::clamp((in[x] - black) * g[x & 1], 0.0f, (float)0xffff);
+            }
+        }
+    });
+    return scaledImage;
+}
+
+// Linear output color space RGB image of the raw data
+static gls::image<gls::rgb_pixel_16>::unique_ptr demosaicLinearRGB(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                                   const DemosaicParameters& demosaicParameters) {
+    const auto scaledImage = scaleRawImage(rawImage, demosaicParameters);
+
+    auto rgbImage = std::make_unique<gls::image<gls::rgb_pixel_16>>(rawImage.width, rawImage.height);
+    interpolateGreen(*scaledImage, rgbImage.get(), demosaicParameters.bayerPattern);
+    interpolateRedBlue(rgbImage.get(), demosaicParameters.bayerPattern);
+
+    float transform[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            transform[i][j] = demosaicParameters.exposure_multiplier * demosaicParameters.rgb_cam[i][j];
+        }
+    }
+
+    processRowBands(rgbImage->height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            auto* row = &(*rgbImage)[y][0];
+            for (int x = 0; x < rgbImage->width; x++) {
+                const float v[3] = {(float)row[x][0], (float)row[x][1], (float)row[x][2]};
+                for (int c = 0; c < 3; c++) {
+                    const float value = transform[c][0] * v[0] + transform[c][1] * v[1] + transform[c][2] * v[2];
+                    row[x][c] = (uint16_t)std::clamp(value, 0.0f, (float)0xffff);
+                }
+            }
+        }
+    });
+    return rgbImage;
+}
+
+gls::image<gls::rgb_pixel_16>::unique_ptr demosaicImageCPU(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                           gls::tiff_metadata* metadata, bool auto_white_balance) {
+    DemosaicParameters demosaicParameters;
+    unpackDNGMetadata(rawImage, metadata, &demosaicParameters, xyz_sRGB, auto_white_balance,
+                      /*gmb_position=*/nullptr, /*rotate_180=*/false);
+
+    auto t_start = std::chrono::high_resolution_clock::now();
+
+    auto rgbImage = demosaicLinearRGB(rawImage, demosaicParameters);
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+    double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+    LOG_INFO(TAG) << "demosaicImageCPU execution time: " << elapsed_time_ms << "ms." << std::endl;
+
+    return rgbImage;
+}
+
+// CPU preview pipeline: demosaicing, color conversion and sRGB gamma, no denoising or tone mapping
+gls::image<gls::rgb_pixel>::unique_ptr runFastPipeline(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                       const DemosaicParameters& demosaicParameters) {
+    auto t_start = std::chrono::high_resolution_clock::now();
+
+    const auto rgbImage = demosaicLinearRGB(rawImage, demosaicParameters);
+
+    static const auto sRGBGamma = []() {
+        std::vector<uint8_t> lut(0x10000);
+        for (int i = 0; i < (int)lut.size(); i++) {
+            const float v = i / (float)0xffff;
+            const float s = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+            lut[i] = (uint8_t)std::clamp(255 * s + 0.5f, 0.0f, 255.0f);
+        }
+        return lut;
+    }();
+
+    auto srgbImage = std::make_unique<gls::image<gls::rgb_pixel>>(rawImage.width, rawImage.height);
+    processRowBands(rawImage.height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const auto* in = &(*rgbImage)[y][0];
+            auto* out = &(*srgbImage)[y][0];
+            for (int x = 0; x < rawImage.width; x++) {
+                out[x] = {sRGBGamma[in[x][0]], sRGBGamma[in[x][1]], sRGBGamma[in[x][2]]};
+            }
+        }
+    });
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+    double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+    LOG_INFO(TAG) << "runFastPipeline execution time: " << elapsed_time_ms << "ms." << std::endl;
+
+    return srgbImage;
+}
+
+PackedRawImage packRawImage(const gls::image<gls::luma_pixel_16>& rawImage, int bitsPerSample, std::vector<uint8_t>* data) {
+    if (bitsPerSample < 8 || bitsPerSample > 16) {
+        throw std::runtime_error("packRawImage: unsupported bit depth " + std::to_string(bitsPerSample));
+    }
+    PackedRawImage packed = {
+        .width = rawImage.width,
+        .height = rawImage.height,
+        .bitsPerSample = bitsPerSample,
+        .rowBytes = PackedRawImage::packedRowBytes(rawImage.width, bitsPerSample)
+    };
+    data->assign(packed.payloadBytes(), 0);
+
+    const uint32_t mask = (1u << bitsPerSample) - 1;
+    gls::parallel_for(0, rawImage.height, /*grain=*/ 32, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            uint8_t* row = data->data() + packed.rowBytes * y;
+            // Samples are shifted into a 32 bit accumulator and flushed a byte at a time
+            uint32_t accumulator = 0;
+            int bits = 0;
+            for (int x = 0; x < rawImage.width; x++) {
+                accumulator = (accumulator << bitsPerSample) | ((uint32_t) rawImage[y][x] & mask);
+                bits += bitsPerSample;
+                while (bits >= 8) {
+                    bits -= 8;
+                    *row++ = (uint8_t) (accumulator >> bits);
+                }
+            }
+            if (bits > 0) {
+                *row = (uint8_t) (accumulator << (8 - bits));
+            }
+        }
+    });
+    packed.data = std::span<const uint8_t>(data->data(), data->size());
+    return packed;
+}
@@ -0,0 +1,448 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef dng_decoder_hpp
+#define dng_decoder_hpp
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dng_reader.hpp"
+#include "gls_mtl_image.hpp"
+#include "TaskScheduler.hpp"
+
+// Decoder of the lossless JPEG (ITU T.81 process 14) streams of the DNG tiles: one interleaved scan, Huffman coded,
+// with any of the 7 predictors and a point transform. The samples are in raster order of the frame, components
+// interleaved, and fill the rows of the tile in the same order, as the DNG spec lays them out.
+class LosslessJPEGDecoder {
+    struct HuffmanTable {
+        // The codes of up to kLookupBits bits are looked up in one step, the longer ones are decoded as in F.2.2.3
+        static constexpr int kLookupBits = 9;
+
+        std::array<int32_t, 17> maxCode;
+        std::array<int32_t, 17> valueOffset;
+        std::array<uint8_t, 256> values;
+        std::array<uint16_t, 1 << kLookupBits> lookup;  // length << 8 | value, 0 for the longer codes
+        bool defined = false;
+    };
+
+    // Entropy coded data with the stuffed zero bytes removed, zeros are read past a marker
+    class BitReader {
+        const uint8_t* _data;
+        size_t _size;
+        size_t _position;
+        uint64_t _bits = 0;  // Left aligned
+        int _count = 0;
+
+        void fill() {
+            while (_count <= 56) {
+                uint8_t byte = 0;
+                if (_position < _size) {
+                    byte = _data[_position];
+                    if (byte != 0xff) {
+                        _position++;
+                    } else if (_position + 1 < _size && _data[_position + 1] == 0x00) {
+                        _position += 2;
+                    } else {
+                        byte = 0;  // At a marker, stay there
+                    }
+                }
+                _bits |= (uint64_t) byte << (56 - _count);
+                _count += 8;
+            }
+        }
+
+    public:
+        BitReader(std::span<const uint8_t> data, size_t position) : _data(data.data()), _size(data.size()), _position(position) { }
+
+        uint32_t peek(int n) {
+            if (_count < n) {
+                fill();
+            }
+            return (uint32_t) (_bits >> (64 - n));
+        }
+
+        void skip(int n) {
+            _bits <<= n;
+            _count -= n;
+        }
+
+        uint32_t get(int n) {
+            const uint32_t value = peek(n);
+            skip(n);
+            return value;
+        }
+
+        // Skips the RSTn marker ending the current restart interval
+        void restart() {
+            _bits = 0;
+            _count = 0;
+            if (_position + 1 < _size && _data[_position] == 0xff && (_data[_position + 1] & 0xf8) == 0xd0) {
+                _position += 2;
+            } else {
+                throw std::runtime_error("LosslessJPEGDecoder: missing restart marker");
+            }
+        }
+    };
+
+    std::span<const uint8_t> _data;
+    std::array<HuffmanTable, 4> _tables;
+
+    int _precision = 0;
+    int _width = 0;   // Of the frame, in samples of each component
+    int _height = 0;
+    int _components = 0;
+    std::array<int, 4> _componentIds = {};
+    std::array<const HuffmanTable*, 4> _componentTables = {};
+    int _predictor = 1;
+    int _pointTransform = 0;
+    int _restartInterval = 0;
+    size_t _scanOffset = 0;
+
+    uint16_t u16(size_t offset) const {
+        if (offset + 2 > _data.size()) {
+            throw std::runtime_error("LosslessJPEGDecoder: truncated stream");
+        }
+        return (uint16_t) (_data[offset] << 8 | _data[offset + 1]);
+    }
+
+    uint8_t u8(size_t offset) const {
+        if (offset >= _data.size()) {
+            throw std::runtime_error("LosslessJPEGDecoder: truncated stream");
+        }
+        return _data[offset];
+    }
+
+    void readHuffmanTables(size_t offset, size_t end) {
+        while (offset < end) {
+            const int index = u8(offset) & 0x0f;
+            if (index >= (int) _tables.size()) {
+                throw std::runtime_error("LosslessJPEGDecoder: bad Huffman table index");
+            }
+            auto& table = _tables[index];
+            std::array<int, 17> counts = {};
+            size_t valueCount = 0;
+            for (int l = 1; l <= 16; l++) {
+                counts[l] = u8(offset + l);
+                valueCount += counts[l];
+            }
+            if (valueCount > table.values.size()) {
+                throw std::runtime_error("LosslessJPEGDecoder: bad Huffman table");
+            }
+            for (size_t i = 0; i < valueCount; i++) {
+                table.values[i] = u8(offset + 17 + i);
+            }
+            offset += 17 + valueCount;
+
+            table.lookup.fill(0);
+            int code = 0;
+            int k = 0;
+            for (int l = 1; l <= 16; l++) {
+                table.valueOffset[l] = k - code;
+                for (int i = 0; i < counts[l]; i++, code++, k++) {
+                    if (l <= HuffmanTable::kLookupBits) {
+                        const int shift = HuffmanTable::kLookupBits - l;
+                        for (int j = 0; j < (1 << shift); j++) {
+                            table.lookup[(code << shift) | j] = (uint16_t) (l << 8 | table.values[k]);
+                        }
+                    }
+                }
+                table.maxCode[l] = counts[l] ? code - 1 : -1;
+                code <<= 1;
+            }
+            table.defined = true;
+        }
+    }
+
+    static int decodeLength(BitReader* bits, const HuffmanTable& table) {
+        const uint16_t entry = table.lookup[bits->peek(HuffmanTable::kLookupBits)];
+        if (entry) {
+            bits->skip(entry >> 8);
+            return entry & 0xff;
+        }
+        const uint32_t code16 = bits->peek(16);
+        for (int l = HuffmanTable::kLookupBits + 1; l <= 16; l++) {
+            const int32_t code = code16 >> (16 - l);
+            if (code <= table.maxCode[l]) {
+                bits->skip(l);
+                return table.values[table.valueOffset[l] + code];
+            }
+        }
+        throw std::runtime_error("LosslessJPEGDecoder: bad Huffman code");
+    }
+
+    static int decodeDifference(BitReader* bits, const HuffmanTable& table) {
+        const int length = decodeLength(bits, table);
+        if (length == 0) {
+            return 0;
+        }
+        if (length == 16) {
+            return -32768;
+        }
+        const int value = bits->get(length);
+        return value < (1 << (length - 1)) ? value - (1 << length) + 1 : value;
+    }
+
+public:
+    // Parses the markers up to the scan, throws on anything but a lossless single scan stream
+    LosslessJPEGDecoder(std::span<const uint8_t> data) : _data(data) {
+        if (u16(0) != 0xffd8) {
+            throw std::runtime_error("LosslessJPEGDecoder: missing SOI marker");
+        }
+        size_t offset = 2;
+        while (_scanOffset == 0) {
+            const uint16_t marker = u16(offset);
+            const size_t length = u16(offset + 2);
+            const size_t segment = offset + 4;
+            const size_t end = offset + 2 + length;
+            if ((marker & 0xff00) != 0xff00 || length < 2) {
+                throw std::runtime_error("LosslessJPEGDecoder: bad marker");
+            }
+            switch (marker) {
+                case 0xffc3:
+                    _precision = u8(segment);
+                    _height = u16(segment + 1);
+                    _width = u16(segment + 3);
+                    _components = u8(segment + 5);
+                    if (_components < 1 || _components > 4 || _precision < 2 || _precision > 16) {
+                        throw std::runtime_error("LosslessJPEGDecoder: unsupported frame");
+                    }
+                    for (int c = 0; c < _components; c++) {
+                        _componentIds[c] = u8(segment + 6 + 3 * c);
+                    }
+                    break;
+                case 0xffc4:
+                    readHuffmanTables(segment, end);
+                    break;
+                case 0xffdd:
+                    _restartInterval = u16(segment);
+                    break;
+                case 0xffda: {
+                    if (_components == 0 || u8(segment) != _components) {
+                        throw std::runtime_error("LosslessJPEGDecoder: only interleaved scans are supported");
+                    }
+                    for (int c = 0; c < _components; c++) {
+                        if (u8(segment + 1 + 2 * c) != _componentIds[c]) {
+                            throw std::runtime_error("LosslessJPEGDecoder: scan components out of order");
+                        }
+                        const auto& table = _tables[u8(segment + 2 + 2 * c) >> 4 & 0x03];
+                        if (!table.defined) {
+                            throw std::runtime_error("LosslessJPEGDecoder: undefined Huffman table");
+                        }
+                        _componentTables[c] = &table;
+                    }
+                    _predictor = u8(segment + 1 + 2 * _components);
+                    _pointTransform = u8(segment + 3 + 2 * _components) & 0x0f;
+                    if (_predictor < 1 || _predictor > 7) {
+                        throw std::runtime_error("LosslessJPEGDecoder: bad predictor");
+                    }
+                    // The prediction resets at the start of a restart interval, at a row boundary for lossless
+                    if (_restartInterval % _width != 0) {
+                        throw std::runtime_error("LosslessJPEGDecoder: restart interval not a multiple of the rows");
+                    }
+                    _scanOffset = end;
+                    break;
+                }
+                case 0xffc0: case 0xffc1: case 0xffc2: case 0xffc5: case 0xffc6: case 0xffc7:
+                case 0xffc9: case 0xffca: case 0xffcb: case 0xffcd: case 0xffce: case 0xffcf:
+                    throw std::runtime_error("LosslessJPEGDecoder: not a lossless Huffman JPEG");
+                default:
+                    // APPn, COM and the other tables don't apply
+                    break;
+            }
+            offset = end;
+        }
+    }
+
+    // Samples per row of the frame, all the components
+    int rowSamples() const {
+        return _width * _components;
+    }
+
+    int rows() const {
+        return _height;
+    }
+
+    // Decodes the frame, output(row, samples) is called with the rowSamples() samples of each row in turn
+    template <typename Output>
+    void decode(Output output) const {
+        BitReader bits(_data, _scanOffset);
+        const int samples = rowSamples();
+        const int restartRows = _restartInterval / _width;
+        const int initial = 1 << (_precision - _pointTransform - 1);
+
+        std::vector<uint16_t> previous(samples), current(samples);
+        std::vector<uint16_t> shifted(_pointTransform ? samples : 0);
+        for (int y = 0; y < _height; y++) {
+            const bool restart = restartRows > 0 && y > 0 && y % restartRows == 0;
+            if (restart) {
+                bits.restart();
+            }
+            // The first row of the scan and of a restart interval only predicts from the left
+            const bool firstRow = y == 0 || restart;
+
+            for (int x = 0; x < _width; x++) {
+                for (int c = 0; c < _components; c++) {
+                    const int i = x * _components + c;
+                    int prediction;
+                    if (firstRow) {
+                        prediction = x == 0 ? initial : current[i - _components];
+                    } else if (x == 0) {
+                        prediction = previous[i];
+                    } else {
+                        const int ra = current[i - _components];
+                        const int rb = previous[i];
+                        const int rc = previous[i - _components];
+                        switch (_predictor) {
+                            case 1: prediction = ra; break;
+                            case 2: prediction = rb; break;
+                            case 3: prediction = rc; break;
+                            case 4: prediction = ra + rb - rc; break;
+                            case 5: prediction = ra + ((rb - rc) >> 1); break;
+                            case 6: prediction = rb + ((ra - rc) >> 1); break;
+                            default: prediction = (ra + rb) >> 1; break;
+                        }
+                    }
+                    current[i] = (uint16_t) (prediction + decodeDifference(&bits, *_componentTables[c]));
+                }
+            }
+            if (_pointTransform) {
+                for (int i = 0; i < samples; i++) {
+                    shifted[i] = current[i] << _pointTransform;
+                }
+                output(y, std::span<const uint16_t>(shifted));
+            } else {
+                output(y, std::span<const uint16_t>(current));
+            }
+            std::swap(previous, current);
+        }
+    }
+};
+
+// Multithreaded decoder of the raw data of a DNG: the tiles or the strips are independent, they are decoded in
+// parallel on the TaskScheduler, each straight into its rectangle of the destination image. Decoding into the
+// memory of a mtl_host_image_2d gives the GPU the raw data without any copy, see readHostImage().
+class DNGDecoder {
+    static void storeSamples(std::span<const uint16_t> samples, const gls::rectangle& tile, int* row, int* column,
+                             gls::image<gls::luma_pixel_16>* image) {
+        for (const uint16_t sample : samples) {
+            const int x = tile.x + *column;
+            const int y = tile.y + *row;
+            if (x < image->width && y < image->height) {
+                (*image)[y][x].luma = sample;
+            }
+            if (++*column == tile.width) {
+                *column = 0;
+                ++*row;
+            }
+        }
+    }
+
+    static void decodeUncompressed(std::span<const uint8_t> data, const DNGTileLayout& layout,
+                                   const gls::rectangle& tile, gls::image<gls::luma_pixel_16>* image) {
+        const int rows = std::min(tile.height, image->height - tile.y);
+        const int columns = std::min(tile.width, image->width - tile.x);
+        const size_t rowBytes = PackedRawImage::packedRowBytes(tile.width, layout.bitsPerSample);
+        if (data.size() < rowBytes * rows) {
+            throw std::runtime_error("DNGDecoder: truncated tile");
+        }
+        const uint32_t mask = (1u << layout.bitsPerSample) - 1;
+        for (int y = 0; y < rows; y++) {
+            const uint8_t* p = data.data() + rowBytes * y;
+            auto* out = &(*image)[tile.y + y][tile.x];
+            if (layout.bitsPerSample == 16) {
+                for (int x = 0; x < columns; x++) {
+                    out[x].luma = layout.bigEndian ? p[2 * x] << 8 | p[2 * x + 1] : p[2 * x + 1] << 8 | p[2 * x];
+                }
+            } else {
+                // Packed samples are a big-endian bitstream
+                uint32_t accumulator = 0;
+                int bits = 0;
+                for (int x = 0; x < columns; x++) {
+                    while (bits < layout.bitsPerSample) {
+                        accumulator = accumulator << 8 | *p++;
+                        bits += 8;
+                    }
+                    bits -= layout.bitsPerSample;
+                    out[x].luma = (accumulator >> bits) & mask;
+                }
+            }
+        }
+    }
+
+public:
+    // Decodes all the tiles of layout into image, as large as the raw image. Throws on malformed tiles.
+    static void decode(const DNGReader& reader, const DNGTileLayout& layout, gls::image<gls::luma_pixel_16>* image) {
+        if (image->width != layout.width || image->height != layout.height) {
+            throw std::runtime_error("DNGDecoder: the image size doesn't match the raw data");
+        }
+        gls::parallel_for(0, (int) layout.tiles.size(), /*grain=*/ 1, [&](int t0, int t1) {
+            for (int t = t0; t < t1; t++) {
+                const auto data = reader.fileData(layout.tiles[t].fileOffset, layout.tiles[t].bytes);
+                const auto tile = layout.tileRect(t);
+                if (layout.compression == DNGTileLayout::kLosslessJPEG) {
+                    int row = 0, column = 0;
+                    LosslessJPEGDecoder(data).decode([&](int, std::span<const uint16_t> samples) {
+                        storeSamples(samples, tile, &row, &column, image);
+                    });
+                } else {
+                    decodeUncompressed(data, layout, tile, image);
+                }
+            }
+        });
+    }
+
+    // The raw image and the metadata of a DNG: the tiled and strip layouts of DNGReader::tileLayout() are decoded
+    // in parallel, the others by the single threaded reader of gls::image. Only the metadata of readMetadata()
+    // is returned for the former.
+    static gls::image<gls::luma_pixel_16>::unique_ptr read(const DNGReader& reader, gls::tiff_metadata* dng_metadata,
+                                                           gls::tiff_metadata* exif_metadata) {
+        if (const auto layout = reader.tileLayout()) {
+            reader.readMetadata(dng_metadata, exif_metadata);
+            auto image = std::make_unique<gls::image<gls::luma_pixel_16>>(layout->width, layout->height);
+            decode(reader, *layout, image.get());
+            return image;
+        }
+        return gls::image<gls::luma_pixel_16>::read_dng_file(reader.path(), dng_metadata, exif_metadata);
+    }
+
+    static gls::image<gls::luma_pixel_16>::unique_ptr read(const std::string& path, gls::tiff_metadata* dng_metadata,
+                                                           gls::tiff_metadata* exif_metadata) {
+        return read(DNGReader(path), dng_metadata, exif_metadata);
+    }
+
+    // As read(), decoding into the memory of a Metal texture on device
+    static gls::mtl_host_image_2d<gls::luma_pixel_16>::unique_ptr readHostImage(MTL::Device* device, const std::string& path,
+                                                                               gls::tiff_metadata* dng_metadata,
+                                                                               gls::tiff_metadata* exif_metadata) {
+        const DNGReader reader(path);
+        if (const auto layout = reader.tileLayout()) {
+            reader.readMetadata(dng_metadata, exif_metadata);
+            auto image = std::make_unique<gls::mtl_host_image_2d<gls::luma_pixel_16>>(device, layout->width, layout->height);
+            decode(reader, *layout, image->mapImage().get());
+            return image;
+        }
+        const auto rawImage = gls::image<gls::luma_pixel_16>::read_dng_file(reader.path(), dng_metadata, exif_metadata);
+        auto image = std::make_unique<gls::mtl_host_image_2d<gls::luma_pixel_16>>(device, rawImage->width, rawImage->height);
+        image->copyPixelsFrom(*rawImage);
+        return image;
+    }
+};
+
+#endif /* dng_decoder_hpp */
@@ -0,0 +1,81 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef dng_opcode_list_hpp
+#define dng_opcode_list_hpp
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Reader of the big-endian parameters of a DNG opcode list (the OpcodeList1, 2 and 3 tags)
+struct DNGOpcodeReader {
+    const std::vector<uint8_t>& data;
+    size_t offset = 0;
+
+    DNGOpcodeReader(const std::vector<uint8_t>& _data) : data(_data) { }
+
+    uint32_t u32() {
+        if (offset + 4 > data.size()) {
+            throw std::runtime_error("DNG opcode list: truncated");
+        }
+        const uint8_t* p = &data[offset];
+        offset += 4;
+        return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+    }
+
+    float f32() {
+        const uint32_t bits = u32();
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    double f64() {
+        const uint64_t high = u32();
+        const uint64_t bits = high << 32 | u32();
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+// Calls opcode(opcodeID, reader) for the opcodes of the list, with the reader at the opcode's parameters. The reader
+// moves to the next opcode whatever the callback reads, throws on a malformed list.
+template <typename Opcode>
+void forEachDNGOpcode(const std::vector<uint8_t>& opcodeList, Opcode opcode) {
+    if (opcodeList.empty()) {
+        return;
+    }
+    DNGOpcodeReader reader(opcodeList);
+
+    const uint32_t opcodes = reader.u32();
+    for (uint32_t i = 0; i < opcodes; i++) {
+        const uint32_t opcodeID = reader.u32();
+        reader.u32();  // DNG version
+        reader.u32();  // Flags
+        const uint32_t parameterBytes = reader.u32();
+        const size_t next = reader.offset + parameterBytes;
+        if (next > opcodeList.size()) {
+            throw std::runtime_error("DNG opcode list: truncated opcode " + std::to_string(opcodeID));
+        }
+        opcode(opcodeID, &reader);
+        reader.offset = next;
+    }
+}
+
+#endif /* dng_opcode_list_hpp */
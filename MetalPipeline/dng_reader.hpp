@@ -0,0 +1,491 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef dng_reader_hpp
+#define dng_reader_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "demosaic.hpp"
+#include "gls_mapped_file.hpp"
+
+// Uncompressed raw strips of a DNG, as they are in the file: the strips hold consecutive rows of the packed
+// samples, strip i goes at payloadOffset in the packed image
+struct DNGRawLayout {
+    struct Strip {
+        uint64_t fileOffset;
+        uint64_t bytes;
+        uint64_t payloadOffset;
+    };
+
+    PackedRawImage image;  // Without data, see payloadBytes()
+    std::vector<Strip> strips;
+};
+
+// Raw data of a DNG as independent tiles, which can be decoded in parallel. Strips are tiles as wide as the image.
+// Tile i covers the tileWidth x tileHeight rectangle at column i % tilesAcross() and row i / tilesAcross() of the
+// tile grid, the tiles on the right and bottom edges overhang the image.
+struct DNGTileLayout {
+    static constexpr uint16_t kUncompressed = 1;
+    static constexpr uint16_t kLosslessJPEG = 7;
+
+    struct Tile {
+        uint64_t fileOffset;
+        uint64_t bytes;
+    };
+
+    int width = 0;
+    int height = 0;
+    int tileWidth = 0;
+    int tileHeight = 0;
+    int bitsPerSample = 16;
+    uint16_t compression = kUncompressed;
+    bool bigEndian = false;  // Of the uncompressed 16 bit samples
+    std::vector<Tile> tiles;
+
+    int tilesAcross() const {
+        return (width + tileWidth - 1) / tileWidth;
+    }
+
+    gls::rectangle tileRect(int i) const {
+        return { (i % tilesAcross()) * tileWidth, (i / tilesAcross()) * tileHeight, tileWidth, tileHeight };
+    }
+};
+
+// Direct reader of the IFDs of a DNG: the file is memory mapped and the IFDs are parsed when they are first used,
+// so e.g. grouping the files of a directory by camera model only reads the pages of IFD0, and the raw data is not
+// touched. Only the tags used by the pipeline are converted to gls::tiff_metadata, see readMetadata(), the others
+// can be read with values() and string(). Throws on files that are not classic TIFF. The lazy parsing makes the
+// accessors not thread safe, use a reader per thread.
+class DNGReader {
+public:
+    struct Entry {
+        uint16_t type;
+        uint32_t count;
+        uint64_t offset;  // Of the value in the file, inline values point into the IFD entry
+    };
+    typedef std::map<uint16_t, Entry> IFD;
+
+private:
+    enum : uint16_t {
+        kType_BYTE = 1, kType_ASCII = 2, kType_SHORT = 3, kType_LONG = 4, kType_RATIONAL = 5, kType_SBYTE = 6,
+        kType_UNDEFINED = 7, kType_SSHORT = 8, kType_SLONG = 9, kType_SRATIONAL = 10, kType_FLOAT = 11,
+        kType_DOUBLE = 12, kType_IFD = 13
+    };
+
+    enum : uint16_t {
+        kTag_NewSubFileType = 254, kTag_ImageWidth = 256, kTag_ImageLength = 257, kTag_BitsPerSample = 258,
+        kTag_Compression = 259, kTag_PhotometricInterpretation = 262, kTag_StripOffsets = 273,
+        kTag_SamplesPerPixel = 277, kTag_RowsPerStrip = 278, kTag_StripByteCounts = 279, kTag_PlanarConfiguration = 284,
+        kTag_TileWidth = 322, kTag_TileLength = 323, kTag_TileOffsets = 324, kTag_TileByteCounts = 325,
+        kTag_SubIFDs = 330, kTag_ExifIFD = 34665
+    };
+
+    static constexpr uint16_t kPhotometricCFA = 32803;
+
+    std::string _path;
+    gls::MappedFile _file;
+    uint64_t _fileSize = 0;
+    bool _bigEndian = false;
+
+    IFD _mainIFD;
+    mutable std::optional<IFD> _rawIFD;
+    mutable std::optional<IFD> _exifIFD;
+
+    static size_t typeSize(uint16_t type) {
+        switch (type) {
+            case kType_BYTE: case kType_ASCII: case kType_SBYTE: case kType_UNDEFINED:
+                return 1;
+            case kType_SHORT: case kType_SSHORT:
+                return 2;
+            case kType_LONG: case kType_SLONG: case kType_FLOAT: case kType_IFD:
+                return 4;
+            case kType_RATIONAL: case kType_SRATIONAL: case kType_DOUBLE:
+                return 8;
+        }
+        return 0;
+    }
+
+    void read(uint64_t offset, void* data, size_t size) const {
+        if (offset + size > _fileSize) {
+            throw std::runtime_error("DNGReader: truncated file " + _path);
+        }
+        std::memcpy(data, _file.data().data() + offset, size);
+    }
+
+    uint64_t unsignedValue(const uint8_t* p, size_t size) const {
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; i++) {
+            value |= (uint64_t) p[_bigEndian ? i : size - 1 - i] << (8 * (size - 1 - i));
+        }
+        return value;
+    }
+
+    uint16_t u16(uint64_t offset) const {
+        uint8_t p[2];
+        read(offset, p, sizeof(p));
+        return unsignedValue(p, sizeof(p));
+    }
+
+    uint32_t u32(uint64_t offset) const {
+        uint8_t p[4];
+        read(offset, p, sizeof(p));
+        return unsignedValue(p, sizeof(p));
+    }
+
+    IFD readIFD(uint64_t offset) const {
+        IFD ifd;
+        const uint16_t entries = u16(offset);
+        std::vector<uint8_t> data(12 * (size_t) entries);
+        read(offset + 2, data.data(), data.size());
+        for (int i = 0; i < entries; i++) {
+            const uint8_t* p = &data[12 * i];
+            const uint16_t tag = unsignedValue(p, 2);
+            Entry entry = { (uint16_t) unsignedValue(p + 2, 2), (uint32_t) unsignedValue(p + 4, 4), 0 };
+            const uint64_t bytes = (uint64_t) typeSize(entry.type) * entry.count;
+            entry.offset = bytes <= 4 ? offset + 2 + 12 * i + 8 : unsignedValue(p + 8, 4);
+            ifd[tag] = entry;
+        }
+        return ifd;
+    }
+
+    bool isRawIFD(const IFD& ifd) const {
+        const auto subFileType = values<uint32_t>(ifd, kTag_NewSubFileType);
+        const auto photometric = values<uint16_t>(ifd, kTag_PhotometricInterpretation);
+        return (subFileType.empty() || subFileType[0] == 0) && !photometric.empty() && photometric[0] == kPhotometricCFA;
+    }
+
+    // The full resolution CFA image is IFD0 or one of its SubIFDs
+    IFD findRawIFD() const {
+        if (isRawIFD(_mainIFD)) {
+            return _mainIFD;
+        }
+        for (const auto offset : values<uint32_t>(_mainIFD, kTag_SubIFDs)) {
+            auto ifd = readIFD(offset);
+            if (isRawIFD(ifd)) {
+                return ifd;
+            }
+        }
+        throw std::runtime_error("DNGReader: no raw image in " + _path);
+    }
+
+    template <typename T>
+    void insertVector(const IFD& ifd, uint16_t tag, gls::tiff_metadata* metadata) const {
+        auto v = values<T>(ifd, tag);
+        if (!v.empty()) {
+            metadata->insert({ tag, v });
+        }
+    }
+
+    template <typename T>
+    void insertValue(const IFD& ifd, uint16_t tag, gls::tiff_metadata* metadata) const {
+        const auto v = values<T>(ifd, tag);
+        if (!v.empty()) {
+            metadata->insert({ tag, v[0] });
+        }
+    }
+
+    void insertString(const IFD& ifd, uint16_t tag, gls::tiff_metadata* metadata) const {
+        if (ifd.contains(tag)) {
+            metadata->insert({ tag, string(ifd, tag) });
+        }
+    }
+
+public:
+    DNGReader(const std::string& path) : _path(path), _file(path), _fileSize(_file.size()) {
+
+        char byteOrder[2];
+        read(0, byteOrder, sizeof(byteOrder));
+        if (std::memcmp(byteOrder, "II", 2) != 0 && std::memcmp(byteOrder, "MM", 2) != 0) {
+            throw std::runtime_error("DNGReader: not a TIFF file " + path);
+        }
+        _bigEndian = byteOrder[0] == 'M';
+        if (u16(2) != 42) {
+            throw std::runtime_error("DNGReader: not a classic TIFF file " + path);
+        }
+
+        _mainIFD = readIFD(u32(4));
+    }
+
+    const std::string& path() const {
+        return _path;
+    }
+
+    bool bigEndian() const {
+        return _bigEndian;
+    }
+
+    const IFD& mainIFD() const {
+        return _mainIFD;
+    }
+
+    // Throws if the file has no full resolution CFA image
+    const IFD& rawIFD() const {
+        if (!_rawIFD) {
+            _rawIFD = findRawIFD();
+        }
+        return *_rawIFD;
+    }
+
+    // Empty if the file has no Exif IFD
+    const IFD& exifIFD() const {
+        if (!_exifIFD) {
+            const auto exifOffset = values<uint32_t>(_mainIFD, kTag_ExifIFD);
+            _exifIFD = exifOffset.empty() ? IFD() : readIFD(exifOffset[0]);
+        }
+        return *_exifIFD;
+    }
+
+    // The keys of the calibration registry, see CameraCalibrationRegistry::find()
+    std::string cameraModel() const {
+        return string(_mainIFD, TIFFTAG_MODEL);
+    }
+
+    std::string lensModel() const {
+        return string(exifIFD(), EXIFTAG_LENSMODEL);
+    }
+
+    // Numeric values of a tag converted to T, empty if the tag is missing or not numeric
+    template <typename T>
+    std::vector<T> values(const IFD& ifd, uint16_t tag) const {
+        const auto entry = ifd.find(tag);
+        if (entry == ifd.end()) {
+            return {};
+        }
+        const auto& e = entry->second;
+        const size_t size = typeSize(e.type);
+        if (size == 0 || e.type == kType_ASCII) {
+            return {};
+        }
+        std::vector<uint8_t> data(size * e.count);
+        read(e.offset, data.data(), data.size());
+
+        std::vector<T> result(e.count);
+        for (uint32_t i = 0; i < e.count; i++) {
+            const uint8_t* p = &data[size * i];
+            double value = 0;
+            switch (e.type) {
+                case kType_SBYTE:
+                    value = (int8_t) p[0];
+                    break;
+                case kType_SSHORT:
+                    value = (int16_t) unsignedValue(p, 2);
+                    break;
+                case kType_SLONG:
+                    value = (int32_t) unsignedValue(p, 4);
+                    break;
+                case kType_RATIONAL: {
+                    const uint32_t denominator = unsignedValue(p + 4, 4);
+                    value = denominator ? unsignedValue(p, 4) / (double) denominator : 0;
+                    break;
+                }
+                case kType_SRATIONAL: {
+                    const int32_t denominator = unsignedValue(p + 4, 4);
+                    value = denominator ? (int32_t) unsignedValue(p, 4) / (double) denominator : 0;
+                    break;
+                }
+                case kType_FLOAT: {
+                    const uint32_t bits = unsignedValue(p, 4);
+                    float f;
+                    std::memcpy(&f, &bits, sizeof(f));
+                    value = f;
+                    break;
+                }
+                case kType_DOUBLE: {
+                    const uint64_t bits = unsignedValue(p, 8);
+                    std::memcpy(&value, &bits, sizeof(value));
+                    break;
+                }
+                default:
+                    value = unsignedValue(p, size);
+            }
+            result[i] = (T) value;
+        }
+        return result;
+    }
+
+    // The bytes of a tag as they are in the file, e.g. an opcode list
+    std::vector<uint8_t> bytes(const IFD& ifd, uint16_t tag) const {
+        const auto entry = ifd.find(tag);
+        if (entry == ifd.end()) {
+            return {};
+        }
+        const auto& e = entry->second;
+        std::vector<uint8_t> data(typeSize(e.type) * e.count);
+        read(e.offset, data.data(), data.size());
+        return data;
+    }
+
+    // Bytes of the file, unlike the IFD accessors safe to call from several threads
+    std::span<const uint8_t> fileData(uint64_t offset, uint64_t bytes) const {
+        if (offset + bytes > _fileSize) {
+            throw std::runtime_error("DNGReader: truncated file " + _path);
+        }
+        return _file.data().subspan(offset, bytes);
+    }
+
+    std::string string(const IFD& ifd, uint16_t tag) const {
+        const auto data = bytes(ifd, tag);
+        std::string s(data.begin(), data.end());
+        s.erase(std::find(s.begin(), s.end(), '\0'), s.end());
+        return s;
+    }
+
+    // The tags used by the pipeline, with the value types of the TIFF reader: the color calibration is in IFD0, the
+    // black and white levels, the CFA layout and the opcodes in the raw IFD
+    void readMetadata(gls::tiff_metadata* dng_metadata, gls::tiff_metadata* exif_metadata) const {
+        if (dng_metadata) {
+            insertString(_mainIFD, TIFFTAG_MAKE, dng_metadata);
+            insertString(_mainIFD, TIFFTAG_MODEL, dng_metadata);
+            insertString(_mainIFD, TIFFTAG_UNIQUECAMERAMODEL, dng_metadata);
+            insertVector<float>(_mainIFD, TIFFTAG_COLORMATRIX1, dng_metadata);
+            insertVector<float>(_mainIFD, TIFFTAG_COLORMATRIX2, dng_metadata);
+            insertVector<float>(_mainIFD, TIFFTAG_ASSHOTNEUTRAL, dng_metadata);
+            insertValue<float>(_mainIFD, TIFFTAG_BASELINEEXPOSURE, dng_metadata);
+            insertVector<uint16_t>(_mainIFD, TIFFTAG_ISO, dng_metadata);
+
+            insertVector<float>(rawIFD(), TIFFTAG_BLACKLEVEL, dng_metadata);
+            insertVector<uint32_t>(rawIFD(), TIFFTAG_WHITELEVEL, dng_metadata);
+            insertVector<uint16_t>(rawIFD(), TIFFTAG_CFAREPEATPATTERNDIM, dng_metadata);
+            insertVector<uint8_t>(rawIFD(), TIFFTAG_CFAPATTERN, dng_metadata);
+            for (const auto tag : { TIFFTAG_OPCODELIST2, TIFFTAG_OPCODELIST3 }) {
+                const auto opcodeList = bytes(rawIFD(), tag);
+                if (!opcodeList.empty()) {
+                    dng_metadata->insert({ tag, opcodeList });
+                }
+            }
+        }
+        if (exif_metadata) {
+            insertVector<uint16_t>(exifIFD(), EXIFTAG_ISOSPEEDRATINGS, exif_metadata);
+            insertValue<uint32_t>(exifIFD(), EXIFTAG_RECOMMENDEDEXPOSUREINDEX, exif_metadata);
+            insertVector<float>(exifIFD(), EXIFTAG_EXPOSURETIME, exif_metadata);
+            insertString(exifIFD(), EXIFTAG_LENSMODEL, exif_metadata);
+        }
+    }
+
+    gls::size imageSize() const {
+        const auto width = values<uint32_t>(rawIFD(), kTag_ImageWidth);
+        const auto height = values<uint32_t>(rawIFD(), kTag_ImageLength);
+        if (width.empty() || height.empty()) {
+            throw std::runtime_error("DNGReader: no image size in " + _path);
+        }
+        return { (int) width[0], (int) height[0] };
+    }
+
+    // Layout of the raw data if it can be used as it is in the file: uncompressed, one sample per pixel, in strips.
+    // Compressed and tiled DNGs go through DNGDecoder, see tileLayout().
+    std::optional<DNGRawLayout> rawLayout() const {
+        const auto compression = values<uint16_t>(rawIFD(), kTag_Compression);
+        const auto samplesPerPixel = values<uint16_t>(rawIFD(), kTag_SamplesPerPixel);
+        const auto bitsPerSample = values<uint16_t>(rawIFD(), kTag_BitsPerSample);
+        const auto planarConfiguration = values<uint16_t>(rawIFD(), kTag_PlanarConfiguration);
+        if ((!compression.empty() && compression[0] != 1) ||
+            (!samplesPerPixel.empty() && samplesPerPixel[0] != 1) ||
+            (!planarConfiguration.empty() && planarConfiguration[0] != 1) ||
+            bitsPerSample.empty() || bitsPerSample[0] < 8 || bitsPerSample[0] > 16 ||
+            rawIFD().contains(kTag_TileWidth)) {
+            return std::nullopt;
+        }
+
+        DNGRawLayout layout;
+        const auto size = imageSize();
+        layout.image.width = size.width;
+        layout.image.height = size.height;
+        layout.image.bitsPerSample = bitsPerSample[0];
+        layout.image.rowBytes = PackedRawImage::packedRowBytes(size.width, bitsPerSample[0]);
+        // 16 bit samples are in the file's byte order, the packed ones are a big-endian bitstream
+        layout.image.littleEndian = bitsPerSample[0] == 16 && !_bigEndian;
+
+        const auto offsets = values<uint64_t>(rawIFD(), kTag_StripOffsets);
+        const auto byteCounts = values<uint64_t>(rawIFD(), kTag_StripByteCounts);
+        const auto rowsPerStripTag = values<uint32_t>(rawIFD(), kTag_RowsPerStrip);
+        const uint64_t rowsPerStrip = rowsPerStripTag.empty() ? size.height : std::min<uint64_t>(rowsPerStripTag[0], size.height);
+        const uint64_t strips = rowsPerStrip ? (size.height + rowsPerStrip - 1) / rowsPerStrip : 0;
+        if (offsets.size() != strips || byteCounts.size() != strips) {
+            return std::nullopt;
+        }
+        for (uint64_t i = 0; i < strips; i++) {
+            const uint64_t rows = std::min<uint64_t>(rowsPerStrip, size.height - i * rowsPerStrip);
+            const uint64_t bytes = std::min<uint64_t>(byteCounts[i], rows * layout.image.rowBytes);
+            if (bytes < rows * layout.image.rowBytes || offsets[i] + bytes > _fileSize) {
+                return std::nullopt;
+            }
+            layout.strips.push_back({ offsets[i], bytes, i * rowsPerStrip * layout.image.rowBytes });
+        }
+        return layout;
+    }
+
+    // Layout of the tiles or the strips of the raw data, uncompressed or lossless JPEG, see DNGDecoder. Empty for
+    // the other compressions and for more than one sample per pixel.
+    std::optional<DNGTileLayout> tileLayout() const {
+        const auto compression = values<uint16_t>(rawIFD(), kTag_Compression);
+        const auto samplesPerPixel = values<uint16_t>(rawIFD(), kTag_SamplesPerPixel);
+        const auto bitsPerSample = values<uint16_t>(rawIFD(), kTag_BitsPerSample);
+        DNGTileLayout layout;
+        layout.compression = compression.empty() ? DNGTileLayout::kUncompressed : compression[0];
+        if ((layout.compression != DNGTileLayout::kUncompressed && layout.compression != DNGTileLayout::kLosslessJPEG) ||
+            (!samplesPerPixel.empty() && samplesPerPixel[0] != 1) ||
+            bitsPerSample.empty() || bitsPerSample[0] < 8 || bitsPerSample[0] > 16) {
+            return std::nullopt;
+        }
+
+        const auto size = imageSize();
+        layout.width = size.width;
+        layout.height = size.height;
+        layout.bitsPerSample = bitsPerSample[0];
+        layout.bigEndian = _bigEndian;
+
+        std::vector<uint64_t> offsets, byteCounts;
+        if (rawIFD().contains(kTag_TileWidth)) {
+            const auto tileWidth = values<uint32_t>(rawIFD(), kTag_TileWidth);
+            const auto tileHeight = values<uint32_t>(rawIFD(), kTag_TileLength);
+            if (tileWidth.empty() || tileHeight.empty() || tileWidth[0] == 0 || tileHeight[0] == 0) {
+                return std::nullopt;
+            }
+            layout.tileWidth = tileWidth[0];
+            layout.tileHeight = tileHeight[0];
+            offsets = values<uint64_t>(rawIFD(), kTag_TileOffsets);
+            byteCounts = values<uint64_t>(rawIFD(), kTag_TileByteCounts);
+        } else {
+            const auto rowsPerStrip = values<uint32_t>(rawIFD(), kTag_RowsPerStrip);
+            layout.tileWidth = size.width;
+            layout.tileHeight = rowsPerStrip.empty() ? size.height : std::clamp<int>(rowsPerStrip[0], 1, size.height);
+            offsets = values<uint64_t>(rawIFD(), kTag_StripOffsets);
+            byteCounts = values<uint64_t>(rawIFD(), kTag_StripByteCounts);
+        }
+
+        const size_t tiles = (size_t) layout.tilesAcross() * ((size.height + layout.tileHeight - 1) / layout.tileHeight);
+        if (offsets.size() != tiles || byteCounts.size() != tiles) {
+            return std::nullopt;
+        }
+        for (size_t i = 0; i < tiles; i++) {
+            if (offsets[i] + byteCounts[i] > _fileSize) {
+                return std::nullopt;
+            }
+            layout.tiles.push_back({ offsets[i], byteCounts[i] });
+        }
+        return layout;
+    }
+};
+
+#endif /* dng_reader_hpp */
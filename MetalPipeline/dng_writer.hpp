@@ -0,0 +1,592 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef dng_writer_hpp
+#define dng_writer_hpp
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <tiffio.h>
+#include <zlib.h>
+
+#include "gls_image.hpp"
+#include "gls_tiff_metadata.hpp"
+#include "TaskScheduler.hpp"
+
+// Lossless JPEG encoder of the DNG tiles, the counterpart of LosslessJPEGDecoder: the rows of a tile are coded as
+// two interleaved components, so that the left prediction of the Bayer samples is from the same color, with a
+// Huffman table optimized for the tile.
+class LosslessJPEGEncoder {
+    static constexpr int kPrecision = 16;
+    static constexpr int kLengths = 17;  // Difference magnitude categories 0...16
+
+    struct HuffmanTable {
+        std::array<uint8_t, 17> counts = {};  // Of the codes of each length
+        std::vector<uint8_t> values;          // By increasing code length
+        std::array<uint16_t, kLengths> codes = {};
+        std::array<uint8_t, kLengths> lengths = {};
+    };
+
+    // Entropy coded data with the 0xff bytes stuffed, the last byte is padded with ones
+    class BitWriter {
+        std::vector<uint8_t>* _out;
+        uint32_t _bits = 0;
+        int _count = 0;
+
+    public:
+        BitWriter(std::vector<uint8_t>* out) : _out(out) { }
+
+        void put(uint32_t value, int n) {
+            _bits = (_bits << n) | (value & ((1u << n) - 1));
+            _count += n;
+            while (_count >= 8) {
+                _count -= 8;
+                const uint8_t byte = (uint8_t) (_bits >> _count);
+                _out->push_back(byte);
+                if (byte == 0xff) {
+                    _out->push_back(0x00);
+                }
+            }
+        }
+
+        void flush() {
+            if (_count > 0) {
+                put(0x7f, 8 - _count);
+            }
+        }
+    };
+
+    static int category(int difference) {
+        int magnitude = std::abs(difference);
+        int length = 0;
+        while (magnitude) {
+            length++;
+            magnitude >>= 1;
+        }
+        return length;
+    }
+
+    // The code lengths of Annex K.2, limited to 16 bits, with the all ones code reserved
+    static HuffmanTable optimalTable(const std::array<int64_t, kLengths>& histogram) {
+        constexpr int symbols = kLengths + 1;  // The last one reserves the all ones code
+        std::array<int64_t, symbols> frequency;
+        std::copy(histogram.begin(), histogram.end(), frequency.begin());
+        frequency[kLengths] = 1;
+        std::array<int, symbols> codeSize = {};
+        std::array<int, symbols> others;
+        others.fill(-1);
+
+        while (true) {
+            int c1 = -1, c2 = -1;
+            for (int i = 0; i < symbols; i++) {
+                if (frequency[i] && (c1 < 0 || frequency[i] <= frequency[c1])) {
+                    c1 = i;
+                }
+            }
+            for (int i = 0; i < symbols; i++) {
+                if (frequency[i] && i != c1 && (c2 < 0 || frequency[i] <= frequency[c2])) {
+                    c2 = i;
+                }
+            }
+            if (c2 < 0) {
+                break;
+            }
+            frequency[c1] += frequency[c2];
+            frequency[c2] = 0;
+            codeSize[c1]++;
+            while (others[c1] >= 0) {
+                c1 = others[c1];
+                codeSize[c1]++;
+            }
+            others[c1] = c2;
+            codeSize[c2]++;
+            while (others[c2] >= 0) {
+                c2 = others[c2];
+                codeSize[c2]++;
+            }
+        }
+
+        std::array<int, 2 * symbols> bits = {};
+        for (int i = 0; i < symbols; i++) {
+            if (codeSize[i]) {
+                bits[codeSize[i]]++;
+            }
+        }
+        for (int i = (int) bits.size() - 1; i > 16; i--) {
+            while (bits[i] > 0) {
+                int j = i - 2;
+                while (bits[j] == 0) {
+                    j--;
+                }
+                bits[i] -= 2;
+                bits[i - 1]++;
+                bits[j + 1] += 2;
+                bits[j]--;
+            }
+        }
+        int longest = 16;
+        while (bits[longest] == 0) {
+            longest--;
+        }
+        bits[longest]--;
+
+        HuffmanTable table;
+        for (int l = 1; l <= 16; l++) {
+            table.counts[l] = bits[l];
+        }
+        for (int size = 1; size < (int) bits.size(); size++) {
+            for (int i = 0; i < kLengths; i++) {
+                if (codeSize[i] == size) {
+                    table.values.push_back(i);
+                }
+            }
+        }
+
+        // Canonical codes, the symbols in the order of values
+        int code = 0, k = 0;
+        for (int l = 1; l <= 16; l++) {
+            for (int i = 0; i < table.counts[l]; i++, k++, code++) {
+                table.codes[table.values[k]] = code;
+                table.lengths[table.values[k]] = l;
+            }
+            code <<= 1;
+        }
+        return table;
+    }
+
+    static void marker(std::vector<uint8_t>* out, uint16_t marker, const std::vector<uint8_t>& segment) {
+        const size_t length = segment.size() + 2;
+        out->insert(out->end(), { (uint8_t) (marker >> 8), (uint8_t) marker, (uint8_t) (length >> 8), (uint8_t) length });
+        out->insert(out->end(), segment.begin(), segment.end());
+    }
+
+public:
+    // Encodes the width x height samples of rows, width even, rowStride samples apart
+    static std::vector<uint8_t> encode(const uint16_t* rows, int width, int height, int rowStride) {
+        if (width % 2 != 0 || width / 2 > 0xffff || height > 0xffff) {
+            throw std::runtime_error("LosslessJPEGEncoder: unsupported tile size");
+        }
+        constexpr int components = 2;
+        const int initial = 1 << (kPrecision - 1);
+        const auto forEachDifference = [&](auto process) {
+            for (int y = 0; y < height; y++) {
+                const uint16_t* row = rows + (size_t) rowStride * y;
+                const uint16_t* previous = y > 0 ? row - rowStride : nullptr;
+                for (int x = 0; x < width; x++) {
+                    const int prediction = x >= components ? row[x - components] : previous ? previous[x] : initial;
+                    process((int16_t) (uint16_t) (row[x] - prediction));
+                }
+            }
+        };
+
+        std::array<int64_t, kLengths> histogram = {};
+        forEachDifference([&](int difference) {
+            histogram[category(difference)]++;
+        });
+        const auto table = optimalTable(histogram);
+
+        std::vector<uint8_t> out = { 0xff, 0xd8 };
+        std::vector<uint8_t> dht = { 0x00 };
+        dht.insert(dht.end(), table.counts.begin() + 1, table.counts.end());
+        dht.insert(dht.end(), table.values.begin(), table.values.end());
+        marker(&out, 0xffc4, dht);
+        marker(&out, 0xffc3, { (uint8_t) kPrecision, (uint8_t) (height >> 8), (uint8_t) height,
+                               (uint8_t) ((width / 2) >> 8), (uint8_t) (width / 2), (uint8_t) components,
+                               0, 0x11, 0, 1, 0x11, 0 });
+        // Predictor 1, no point transform
+        marker(&out, 0xffda, { (uint8_t) components, 0, 0x00, 1, 0x00, 1, 0, 0 });
+
+        out.reserve(out.size() + (size_t) width * height * 3 / 2);
+        BitWriter bits(&out);
+        forEachDifference([&](int difference) {
+            const int length = category(difference);
+            bits.put(table.codes[length], table.lengths[length]);
+            if (length > 0 && length < 16) {
+                bits.put(difference < 0 ? difference - 1 : difference, length);
+            }
+        });
+        bits.flush();
+        out.insert(out.end(), { 0xff, 0xd9 });
+        return out;
+    }
+};
+
+// Tiled DNG writer of raw images, e.g. a merged burst: the tiles are compressed in parallel on the TaskScheduler and
+// streamed to the file as they complete, the IFDs follow them. The tags read by the pipeline are carried over from
+// the metadata of the reference frame, see DNGReader::readMetadata(), so the file goes through the pipeline as the
+// original captures do.
+class DNGWriter {
+public:
+    enum class Compression {
+        losslessJPEG,   // The DNG baseline, readable by DNGDecoder
+        deflate         // With the DNG 1.4 horizontal difference X2 predictor
+    };
+
+    struct Options {
+        Compression compression = Compression::losslessJPEG;
+        int tileSize = 256;
+        int compressionLevel = Z_DEFAULT_COMPRESSION;
+    };
+
+private:
+    enum : uint16_t {
+        kType_BYTE = 1, kType_ASCII = 2, kType_SHORT = 3, kType_LONG = 4, kType_RATIONAL = 5, kType_UNDEFINED = 7,
+        kType_SRATIONAL = 10
+    };
+
+    static constexpr uint16_t kPhotometricCFA = 32803;
+    static constexpr uint16_t kPredictorHorizontalDifferenceX2 = 34892;
+
+    // A little-endian TIFF IFD, the values that don't fit in the entries follow it
+    class Directory {
+        struct Entry {
+            uint16_t tag;
+            uint16_t type;
+            uint32_t count;
+            std::vector<uint8_t> data;
+        };
+        std::vector<Entry> _entries;
+
+        static void append(std::vector<uint8_t>* out, uint64_t value, int bytes) {
+            for (int i = 0; i < bytes; i++) {
+                out->push_back((uint8_t) (value >> (8 * i)));
+            }
+        }
+
+        template <typename T>
+        static std::vector<uint8_t> pack(const std::vector<T>& values) {
+            std::vector<uint8_t> data;
+            for (const auto v : values) {
+                append(&data, (uint64_t) v, sizeof(T));
+            }
+            return data;
+        }
+
+        // With the largest power of 10 denominator that keeps the numerator in range
+        static void appendRational(std::vector<uint8_t>* out, double value, bool isSigned) {
+            const double limit = isSigned ? std::numeric_limits<int32_t>::max() : std::numeric_limits<uint32_t>::max();
+            uint32_t denominator = 1;
+            while (denominator < 1000000000 && std::abs(value) * denominator * 10 < limit) {
+                denominator *= 10;
+            }
+            const double numerator = std::round(value * denominator);
+            append(out, isSigned ? (uint32_t) (int32_t) numerator : (uint32_t) std::max(numerator, 0.0), 4);
+            append(out, denominator, 4);
+        }
+
+    public:
+        void add(uint16_t tag, uint16_t type, uint32_t count, std::vector<uint8_t> data) {
+            std::erase_if(_entries, [tag](const Entry& e) { return e.tag == tag; });
+            _entries.push_back({ tag, type, count, std::move(data) });
+        }
+
+        void bytes(uint16_t tag, const std::vector<uint8_t>& values, uint16_t type = kType_BYTE) {
+            add(tag, type, (uint32_t) values.size(), values);
+        }
+
+        void shorts(uint16_t tag, const std::vector<uint16_t>& values) {
+            add(tag, kType_SHORT, (uint32_t) values.size(), pack(values));
+        }
+
+        void longs(uint16_t tag, const std::vector<uint32_t>& values) {
+            add(tag, kType_LONG, (uint32_t) values.size(), pack(values));
+        }
+
+        void ascii(uint16_t tag, const std::string& value) {
+            std::vector<uint8_t> data(value.begin(), value.end());
+            data.push_back(0);
+            add(tag, kType_ASCII, (uint32_t) data.size(), data);
+        }
+
+        void rationals(uint16_t tag, const std::vector<float>& values, bool isSigned) {
+            std::vector<uint8_t> data;
+            for (const auto v : values) {
+                appendRational(&data, v, isSigned);
+            }
+            add(tag, isSigned ? kType_SRATIONAL : kType_RATIONAL, (uint32_t) values.size(), data);
+        }
+
+        size_t size() const {
+            size_t bytes = 2 + 12 * _entries.size() + 4;
+            for (const auto& e : _entries) {
+                if (e.data.size() > 4) {
+                    bytes += (e.data.size() + 1) & ~1;
+                }
+            }
+            return bytes;
+        }
+
+        // The directory at offset in the file, an even offset
+        std::vector<uint8_t> serialize(uint32_t offset) {
+            std::sort(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) { return a.tag < b.tag; });
+            std::vector<uint8_t> out, values;
+            uint32_t valuesOffset = offset + 2 + 12 * (uint32_t) _entries.size() + 4;
+            append(&out, _entries.size(), 2);
+            for (const auto& e : _entries) {
+                append(&out, e.tag, 2);
+                append(&out, e.type, 2);
+                append(&out, e.count, 4);
+                if (e.data.size() <= 4) {
+                    auto inlineValue = e.data;
+                    inlineValue.resize(4, 0);
+                    out.insert(out.end(), inlineValue.begin(), inlineValue.end());
+                } else {
+                    append(&out, valuesOffset + values.size(), 4);
+                    values.insert(values.end(), e.data.begin(), e.data.end());
+                    if (values.size() % 2) {
+                        values.push_back(0);
+                    }
+                }
+            }
+            append(&out, 0, 4);  // No next IFD
+            out.insert(out.end(), values.begin(), values.end());
+            return out;
+        }
+    };
+
+    // Writes at the end of the file, tiles and IFDs alike
+    class File {
+        std::unique_ptr<FILE, int (*)(FILE*)> _file;
+        const std::string _path;
+        uint64_t _size = 0;
+
+    public:
+        File(const std::string& path) : _file(std::fopen(path.c_str(), "wb"), std::fclose), _path(path) {
+            if (!_file) {
+                throw std::runtime_error("DNGWriter: couldn't open " + path);
+            }
+        }
+
+        uint32_t append(const std::vector<uint8_t>& data) {
+            if (_size + data.size() > std::numeric_limits<uint32_t>::max()) {
+                throw std::runtime_error("DNGWriter: " + _path + " is over the 4GB of classic TIFF");
+            }
+            if (std::fwrite(data.data(), 1, data.size(), _file.get()) != data.size()) {
+                throw std::runtime_error("DNGWriter: couldn't write " + _path);
+            }
+            const uint32_t offset = (uint32_t) _size;
+            _size += data.size();
+            return offset;
+        }
+
+        // Pads to an even offset, as the IFDs need
+        uint32_t align() {
+            if (_size % 2) {
+                append({ 0 });
+            }
+            return (uint32_t) _size;
+        }
+
+        void write(uint64_t offset, const std::vector<uint8_t>& data) {
+            if (std::fseek(_file.get(), (long) offset, SEEK_SET) != 0 ||
+                std::fwrite(data.data(), 1, data.size(), _file.get()) != data.size()) {
+                throw std::runtime_error("DNGWriter: couldn't write " + _path);
+            }
+            std::fseek(_file.get(), 0, SEEK_END);
+        }
+
+        void close() {
+            if (std::fclose(_file.release()) != 0) {
+                throw std::runtime_error("DNGWriter: couldn't close " + _path);
+            }
+        }
+    };
+
+    // The samples of a tile, the edge tiles are padded with the last row and column of the image
+    static std::vector<uint16_t> tileSamples(const gls::image<gls::luma_pixel_16>& image, int x0, int y0, int tileSize) {
+        std::vector<uint16_t> samples((size_t) tileSize * tileSize);
+        for (int y = 0; y < tileSize; y++) {
+            const auto* row = &image[std::min(y0 + y, image.height - 1)][0];
+            for (int x = 0; x < tileSize; x++) {
+                samples[(size_t) tileSize * y + x] = row[std::min(x0 + x, image.width - 1)].luma;
+            }
+        }
+        return samples;
+    }
+
+    static std::vector<uint8_t> deflateTile(std::vector<uint16_t> samples, int tileSize, int compressionLevel) {
+        // Predicted from the sample of the same color on the left, right to left not to overwrite the predictors
+        for (int y = 0; y < tileSize; y++) {
+            uint16_t* row = &samples[(size_t) tileSize * y];
+            for (int x = tileSize - 1; x >= 2; x--) {
+                row[x] -= row[x - 2];
+            }
+        }
+        std::vector<uint8_t> bytes(2 * samples.size());
+        for (size_t i = 0; i < samples.size(); i++) {
+            bytes[2 * i] = (uint8_t) samples[i];
+            bytes[2 * i + 1] = (uint8_t) (samples[i] >> 8);
+        }
+        uLongf compressedSize = compressBound(bytes.size());
+        std::vector<uint8_t> compressed(compressedSize);
+        if (compress2(compressed.data(), &compressedSize, bytes.data(), bytes.size(), compressionLevel) != Z_OK) {
+            throw std::runtime_error("DNGWriter: couldn't compress a tile");
+        }
+        compressed.resize(compressedSize);
+        return compressed;
+    }
+
+    static void copyMetadata(const gls::tiff_metadata& dng_metadata, Directory* ifd) {
+        std::string value;
+        if (getValue(dng_metadata, TIFFTAG_MAKE, &value)) {
+            ifd->ascii(TIFFTAG_MAKE, value);
+        }
+        if (getValue(dng_metadata, TIFFTAG_MODEL, &value)) {
+            ifd->ascii(TIFFTAG_MODEL, value);
+        }
+        if (getValue(dng_metadata, TIFFTAG_UNIQUECAMERAMODEL, &value)) {
+            ifd->ascii(TIFFTAG_UNIQUECAMERAMODEL, value);
+        }
+        for (const auto tag : { TIFFTAG_COLORMATRIX1, TIFFTAG_COLORMATRIX2 }) {
+            if (const auto matrix = getVector<float>(dng_metadata, tag); !matrix.empty()) {
+                ifd->rationals(tag, matrix, /*isSigned=*/ true);
+            }
+        }
+        if (const auto neutral = getVector<float>(dng_metadata, TIFFTAG_ASSHOTNEUTRAL); !neutral.empty()) {
+            ifd->rationals(TIFFTAG_ASSHOTNEUTRAL, neutral, /*isSigned=*/ false);
+        }
+        float baselineExposure;
+        if (getValue(dng_metadata, TIFFTAG_BASELINEEXPOSURE, &baselineExposure)) {
+            ifd->rationals(TIFFTAG_BASELINEEXPOSURE, { baselineExposure }, /*isSigned=*/ true);
+        }
+        if (const auto iso = getVector<uint16_t>(dng_metadata, TIFFTAG_ISO); !iso.empty()) {
+            ifd->shorts(TIFFTAG_ISO, iso);
+        }
+        if (const auto black = getVector<float>(dng_metadata, TIFFTAG_BLACKLEVEL); !black.empty()) {
+            ifd->rationals(TIFFTAG_BLACKLEVEL, black, /*isSigned=*/ false);
+            if (black.size() == 4) {
+                ifd->shorts(TIFFTAG_BLACKLEVELREPEATDIM, { 2, 2 });
+            }
+        }
+        if (const auto white = getVector<uint32_t>(dng_metadata, TIFFTAG_WHITELEVEL); !white.empty()) {
+            ifd->longs(TIFFTAG_WHITELEVEL, white);
+        }
+        if (const auto dimensions = getVector<uint16_t>(dng_metadata, TIFFTAG_CFAREPEATPATTERNDIM); !dimensions.empty()) {
+            ifd->shorts(TIFFTAG_CFAREPEATPATTERNDIM, dimensions);
+        }
+        if (const auto pattern = getVector<uint8_t>(dng_metadata, TIFFTAG_CFAPATTERN); !pattern.empty()) {
+            ifd->bytes(TIFFTAG_CFAPATTERN, pattern);
+        }
+        if (const auto opcodes = getVector<uint8_t>(dng_metadata, TIFFTAG_OPCODELIST2); !opcodes.empty()) {
+            ifd->bytes(TIFFTAG_OPCODELIST2, opcodes, kType_UNDEFINED);
+        }
+        if (const auto opcodes = getVector<uint8_t>(dng_metadata, TIFFTAG_OPCODELIST3); !opcodes.empty()) {
+            ifd->bytes(TIFFTAG_OPCODELIST3, opcodes, kType_UNDEFINED);
+        }
+    }
+
+    static void copyExifMetadata(const gls::tiff_metadata& exif_metadata, Directory* ifd) {
+        if (const auto exposureTime = getVector<float>(exif_metadata, EXIFTAG_EXPOSURETIME); !exposureTime.empty()) {
+            ifd->rationals(EXIFTAG_EXPOSURETIME, exposureTime, /*isSigned=*/ false);
+        }
+        if (const auto iso = getVector<uint16_t>(exif_metadata, EXIFTAG_ISOSPEEDRATINGS); !iso.empty()) {
+            ifd->shorts(EXIFTAG_ISOSPEEDRATINGS, iso);
+        }
+        uint32_t exposureIndex;
+        if (getValue(exif_metadata, EXIFTAG_RECOMMENDEDEXPOSUREINDEX, &exposureIndex)) {
+            ifd->longs(EXIFTAG_RECOMMENDEDEXPOSUREINDEX, { exposureIndex });
+        }
+        std::string lensModel;
+        if (getValue(exif_metadata, EXIFTAG_LENSMODEL, &lensModel)) {
+            ifd->ascii(EXIFTAG_LENSMODEL, lensModel);
+        }
+    }
+
+public:
+    // Throws if the file can't be written, a partial file is left behind
+    static void write(const gls::image<gls::luma_pixel_16>& image, const std::string& path,
+                      const gls::tiff_metadata& dng_metadata, const gls::tiff_metadata* exif_metadata = nullptr,
+                      const Options& options = {}) {
+        const int tileSize = options.tileSize;
+        if (tileSize <= 0 || tileSize % 16 != 0) {
+            throw std::runtime_error("DNGWriter: the tile size must be a multiple of 16");
+        }
+        const int tilesAcross = (image.width + tileSize - 1) / tileSize;
+        const int tilesDown = (image.height + tileSize - 1) / tileSize;
+        const int tiles = tilesAcross * tilesDown;
+
+        File file(path);
+        // Little-endian classic TIFF, the offset of IFD0 is patched once it is known
+        file.append({ 'I', 'I', 42, 0, 0, 0, 0, 0 });
+
+        std::vector<uint32_t> tileOffsets(tiles), tileByteCounts(tiles);
+        std::mutex fileMutex;
+        gls::parallel_for(0, tiles, /*grain=*/ 1, [&](int t0, int t1) {
+            for (int t = t0; t < t1; t++) {
+                const auto samples = tileSamples(image, (t % tilesAcross) * tileSize, (t / tilesAcross) * tileSize, tileSize);
+                const auto compressed = options.compression == Compression::losslessJPEG
+                    ? LosslessJPEGEncoder::encode(samples.data(), tileSize, tileSize, tileSize)
+                    : deflateTile(samples, tileSize, options.compressionLevel);
+
+                std::lock_guard<std::mutex> guard(fileMutex);
+                tileOffsets[t] = file.append(compressed);
+                tileByteCounts[t] = (uint32_t) compressed.size();
+            }
+        });
+
+        Directory ifd0;
+        ifd0.longs(TIFFTAG_SUBFILETYPE, { 0 });
+        ifd0.longs(TIFFTAG_IMAGEWIDTH, { (uint32_t) image.width });
+        ifd0.longs(TIFFTAG_IMAGELENGTH, { (uint32_t) image.height });
+        ifd0.shorts(TIFFTAG_BITSPERSAMPLE, { 16 });
+        ifd0.shorts(TIFFTAG_COMPRESSION, { (uint16_t) (options.compression == Compression::losslessJPEG
+                                                       ? COMPRESSION_JPEG : COMPRESSION_ADOBE_DEFLATE) });
+        if (options.compression == Compression::deflate) {
+            ifd0.shorts(TIFFTAG_PREDICTOR, { kPredictorHorizontalDifferenceX2 });
+        }
+        ifd0.shorts(TIFFTAG_PHOTOMETRIC, { kPhotometricCFA });
+        ifd0.shorts(TIFFTAG_ORIENTATION, { ORIENTATION_TOPLEFT });
+        ifd0.shorts(TIFFTAG_SAMPLESPERPIXEL, { 1 });
+        ifd0.shorts(TIFFTAG_PLANARCONFIG, { PLANARCONFIG_CONTIG });
+        ifd0.longs(TIFFTAG_TILEWIDTH, { (uint32_t) tileSize });
+        ifd0.longs(TIFFTAG_TILELENGTH, { (uint32_t) tileSize });
+        ifd0.longs(TIFFTAG_TILEOFFSETS, tileOffsets);
+        ifd0.longs(TIFFTAG_TILEBYTECOUNTS, tileByteCounts);
+        ifd0.bytes(TIFFTAG_DNGVERSION, { 1, 4, 0, 0 });
+        ifd0.bytes(TIFFTAG_DNGBACKWARDVERSION, { 1, (uint8_t) (options.compression == Compression::deflate ? 4 : 1), 0, 0 });
+        copyMetadata(dng_metadata, &ifd0);
+
+        Directory exifIFD;
+        if (exif_metadata) {
+            copyExifMetadata(*exif_metadata, &exifIFD);
+            ifd0.longs(TIFFTAG_EXIFIFD, { 0 });  // Sized now, set below
+        }
+
+        const uint32_t ifd0Offset = file.align();
+        if (exif_metadata) {
+            ifd0.longs(TIFFTAG_EXIFIFD, { ifd0Offset + (uint32_t) ifd0.size() });
+        }
+        file.append(ifd0.serialize(ifd0Offset));
+        if (exif_metadata) {
+            const uint32_t exifOffset = file.align();
+            file.append(exifIFD.serialize(exifOffset));
+        }
+        file.write(4, { (uint8_t) ifd0Offset, (uint8_t) (ifd0Offset >> 8), (uint8_t) (ifd0Offset >> 16), (uint8_t) (ifd0Offset >> 24) });
+        file.close();
+    }
+};
+
+#endif /* dng_writer_hpp */
@@ -16,8 +16,19 @@
 #ifndef float16_h
 #define float16_h
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
 #include <simd/simd.h>
 
+#if __aarch64__
+#include <arm_neon.h>
+#endif
+
 //#define half float
 //#define half2 float2
 //#define half3 float3
@@ -38,4 +49,121 @@ typedef ::simd_half4 half4;
 
 }
 
+namespace gls {
+
+// Bulk conversions between float, half and uint16 spans, out[i] = in[i] * scale + offset computed in float. These
+// are the host side pixel format conversions, e.g. of the CPU copies of the fp16 textures: NEON on ARM, clang vector
+// extensions elsewhere, eight values at a time. Stores to uint16 are rounded to nearest and clamped to [0, 0xffff].
+
+namespace float16_detail {
+
+typedef __attribute__((__ext_vector_type__(8))) float float8;
+typedef __attribute__((__ext_vector_type__(8))) half half8;
+typedef __attribute__((__ext_vector_type__(8))) uint16_t ushort8;
+
+template <typename V, typename T>
+inline V load(const T* data) {
+    V v;
+    std::memcpy(&v, data, sizeof(V));
+    return v;
+}
+
+template <typename V, typename T>
+inline void store(T* data, const V& v) {
+    std::memcpy(data, &v, sizeof(V));
+}
+
+}  // namespace float16_detail
+
+inline void convertToHalf(std::span<const float> in, std::span<float16_t> out, float scale = 1, float offset = 0) {
+    using namespace float16_detail;
+    assert(out.size() >= in.size());
+    const size_t n = in.size();
+    size_t i = 0;
+#if __aarch64__
+    const float32x4_t vscale = vdupq_n_f32(scale), voffset = vdupq_n_f32(offset);
+    for (; i + 8 <= n; i += 8) {
+        const float32x4_t lo = vfmaq_f32(voffset, vld1q_f32(&in[i]), vscale);
+        const float32x4_t hi = vfmaq_f32(voffset, vld1q_f32(&in[i + 4]), vscale);
+        vst1q_f16(&out[i], vcombine_f16(vcvt_f16_f32(lo), vcvt_f16_f32(hi)));
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        store(&out[i], __builtin_convertvector(load<float8>(&in[i]) * scale + offset, half8));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = (float16_t) (in[i] * scale + offset);
+    }
+}
+
+inline void convertToFloat(std::span<const float16_t> in, std::span<float> out, float scale = 1, float offset = 0) {
+    using namespace float16_detail;
+    assert(out.size() >= in.size());
+    const size_t n = in.size();
+    size_t i = 0;
+#if __aarch64__
+    const float32x4_t vscale = vdupq_n_f32(scale), voffset = vdupq_n_f32(offset);
+    for (; i + 8 <= n; i += 8) {
+        const float16x8_t h = vld1q_f16(&in[i]);
+        vst1q_f32(&out[i], vfmaq_f32(voffset, vcvt_f32_f16(vget_low_f16(h)), vscale));
+        vst1q_f32(&out[i + 4], vfmaq_f32(voffset, vcvt_high_f32_f16(h), vscale));
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        store(&out[i], __builtin_convertvector(load<half8>(&in[i]), float8) * scale + offset);
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = (float) in[i] * scale + offset;
+    }
+}
+
+// E.g. raw data to normalized half: scale = 1 / (white - black), offset = -black * scale
+inline void convertToHalf(std::span<const uint16_t> in, std::span<float16_t> out, float scale = 1, float offset = 0) {
+    using namespace float16_detail;
+    assert(out.size() >= in.size());
+    const size_t n = in.size();
+    size_t i = 0;
+#if __aarch64__
+    const float32x4_t vscale = vdupq_n_f32(scale), voffset = vdupq_n_f32(offset);
+    for (; i + 8 <= n; i += 8) {
+        const uint16x8_t u = vld1q_u16(&in[i]);
+        const float32x4_t lo = vfmaq_f32(voffset, vcvtq_f32_u32(vmovl_u16(vget_low_u16(u))), vscale);
+        const float32x4_t hi = vfmaq_f32(voffset, vcvtq_f32_u32(vmovl_high_u16(u)), vscale);
+        vst1q_f16(&out[i], vcombine_f16(vcvt_f16_f32(lo), vcvt_f16_f32(hi)));
+    }
+#else
+    for (; i + 8 <= n; i += 8) {
+        store(&out[i], __builtin_convertvector(__builtin_convertvector(load<ushort8>(&in[i]), float8) * scale + offset, half8));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = (float16_t) (in[i] * scale + offset);
+    }
+}
+
+// E.g. normalized half to 16 bit output: scale = 0xffff
+inline void convertToUInt16(std::span<const float16_t> in, std::span<uint16_t> out, float scale = 1, float offset = 0) {
+    assert(out.size() >= in.size());
+    const size_t n = in.size();
+    size_t i = 0;
+#if __aarch64__
+    const float32x4_t vscale = vdupq_n_f32(scale), voffset = vdupq_n_f32(offset);
+    for (; i + 8 <= n; i += 8) {
+        const float16x8_t h = vld1q_f16(&in[i]);
+        // vcvtnq rounds to nearest and saturates the negatives to zero, vqmovn saturates to 16 bits
+        const uint32x4_t lo = vcvtnq_u32_f32(vfmaq_f32(voffset, vcvt_f32_f16(vget_low_f16(h)), vscale));
+        const uint32x4_t hi = vcvtnq_u32_f32(vfmaq_f32(voffset, vcvt_high_f32_f16(h), vscale));
+        vst1q_u16(&out[i], vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi)));
+    }
+#endif
+    // The clamped loop vectorizes as it is
+    for (; i < n; i++) {
+        out[i] = (uint16_t) std::clamp(std::nearbyint((float) in[i] * scale + offset), 0.0f, (float) 0xffff);
+    }
+}
+
+}  // namespace gls
+
 #endif /* float16_h */
@@ -0,0 +1,71 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef gls_content_hash_hpp
+#define gls_content_hash_hpp
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "gls_image.hpp"
+
+namespace gls {
+
+// FNV-1a style hash of image content and of the parameters keying cached intermediates, e.g. the re-rendering cache
+// of RawConverter and the cached levels of PyramidProcessor. Bulk data is hashed a word at a time, struct members one
+// by one: the padding of a struct has no defined value.
+struct ContentHash {
+    uint64_t value = 0xcbf29ce484222325ull;
+
+    void addBytes(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*) data;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, sizeof(word));
+            value = (value ^ word) * 0x100000001b3ull;
+        }
+        for (; i < size; i++) {
+            value = (value ^ bytes[i]) * 0x100000001b3ull;
+        }
+    }
+
+    // Scalars, and vectors and matrices of them
+    template <typename T>
+    void add(const T& v) {
+        if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>) {
+            addBytes(&v, sizeof(v));
+        } else {
+            for (const auto& element : v) {
+                add(element);
+            }
+        }
+    }
+
+    template <typename T>
+    void addImage(const gls::image<T>& image) {
+        add(image.width);
+        add(image.height);
+        for (int y = 0; y < image.height; y++) {
+            addBytes(&image[y][0], sizeof(T) * image.width);
+        }
+    }
+};
+
+}  // namespace gls
+
+#endif /* gls_content_hash_hpp */
@@ -0,0 +1,229 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_debug_dump_hpp
+#define gls_debug_dump_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+#include "gls_mtl.hpp"
+#include "gls_mtl_image.hpp"
+#include "ThreadPool.hpp"
+
+namespace gls {
+
+// Non-blocking dumps of intermediate images, e.g. the pyramid levels or the noise statistics. Dumping a texture is
+// a blit to a pooled staging buffer at the current position of the command stream: nothing waits for the GPU, the
+// encoder runs on a background thread once the command buffer has completed and the staging buffer goes back to the
+// pool. Place the dump after the barrier completing the image, like any other reader of it.
+//
+// Files go to the dump directory as <sequence>_<name>, the sequence numbers follow the order of the dump calls.
+// Encoders get the full path and add the extension if <name> doesn't have it, the ones writing several files can
+// use it as a prefix. Disabled by default, dump() is a flag check: enable() it with a directory (GLS_DUMP_DIR in
+// PipelineTest), and wait() for the pending dumps before exiting.
+class DebugDumpService {
+public:
+    template <typename T>
+    using Encoder = std::function<void(const gls::image<T>& image, const std::string& path)>;
+
+private:
+    struct Staging {
+        NS::SharedPtr<MTL::Buffer> buffer;
+        GPUMemoryTracker::Allocation allocation;
+    };
+
+    std::mutex _mutex;
+    std::condition_variable _idle;
+    std::atomic<bool> _enabled = false;
+    std::filesystem::path _directory;
+    std::unique_ptr<ThreadPool> _encoders;
+    int _sequence = 0;
+    int _pending = 0;
+
+    // Free staging buffers by length
+    std::multimap<size_t, Staging> _stagingPool;
+
+    DebugDumpService() = default;
+
+    std::string nextPath(const std::string& name) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        std::ostringstream fileName;
+        fileName << std::setw(4) << std::setfill('0') << _sequence++ << "_" << name;
+        return (_directory / fileName.str()).string();
+    }
+
+    // Throws gpu_budget_exceeded if a new staging buffer doesn't fit the budget
+    Staging acquireStaging(MTL::Device* device, size_t length) {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            auto entry = _stagingPool.lower_bound(length);
+            if (entry != _stagingPool.end()) {
+                auto staging = std::move(entry->second);
+                _stagingPool.erase(entry);
+                return staging;
+            }
+        }
+        GPUMemoryTracker::Scope scope("DebugDump");
+        Staging staging;
+        staging.buffer = NS::TransferPtr(device->newBuffer(length, MTL::ResourceStorageModeShared));
+        staging.allocation = GPUMemoryTracker::shared().track(staging.buffer->allocatedSize());
+        return staging;
+    }
+
+    void releaseStaging(Staging&& staging) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        const auto length = staging.buffer->length();
+        _stagingPool.insert({ length, std::move(staging) });
+    }
+
+    void beginJob() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _pending++;
+    }
+
+    void endJob() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (--_pending == 0) {
+            _idle.notify_all();
+        }
+    }
+
+    template <typename T>
+    void encode(const gls::image<T>& image, const std::string& path, const Encoder<T>& encoder) {
+        try {
+            encoder(image, path);
+        } catch (const std::exception& e) {
+            std::cout << "DebugDumpService: couldn't write " << path << ": " << e.what() << std::endl;
+        }
+    }
+
+public:
+    DebugDumpService(const DebugDumpService&) = delete;
+    DebugDumpService& operator=(const DebugDumpService&) = delete;
+
+    static DebugDumpService& shared() {
+        static DebugDumpService service;
+        return service;
+    }
+
+    void enable(const std::filesystem::path& directory, int encoderThreads = 1) {
+        wait();
+        std::filesystem::create_directories(directory);
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        _directory = directory;
+        _encoders = std::make_unique<ThreadPool>(std::max(encoderThreads, 1), gls::QoS::background);
+        _enabled = true;
+    }
+
+    // Waits for the pending dumps and releases the staging pool
+    void disable() {
+        _enabled = false;
+        wait();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        _encoders.reset();
+        _stagingPool.clear();
+    }
+
+    bool enabled() const {
+        return _enabled;
+    }
+
+    // Waits for the dumps enqueued so far to be written, their command buffers have to be committed
+    void wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [this]() { return _pending == 0; });
+    }
+
+    // Dumps a texture as of the work enqueued on context so far
+    template <typename T>
+    void dump(MetalContext* context, const gls::mtl_image_2d<T>& image, const std::string& name,
+              std::type_identity_t<Encoder<T>> encoder) {
+        if (!_enabled) {
+            return;
+        }
+        const int width = image.width;
+        const int height = image.height;
+        const size_t bytesPerRow = sizeof(T) * width;
+
+        Staging staging;
+        try {
+            staging = acquireStaging(context->device(), bytesPerRow * height);
+        } catch (const gpu_budget_exceeded& e) {
+            std::cout << "DebugDumpService: skipping " << name << ", " << e.what() << std::endl;
+            return;
+        }
+        const auto path = nextPath(name);
+        beginJob();
+
+        // The texture is retained by the blit, the image itself can go before the command buffer completes
+        auto texture = NS::RetainPtr(image.texture());
+        context->enqueue([context, texture, buffer = staging.buffer, bytesPerRow, width, height](MTL::CommandBuffer* commandBuffer) {
+            auto encoder = commandBuffer->blitCommandEncoder();
+            if (encoder) {
+                // The image can be an untracked intermediate
+                context->waitForHazards(encoder);
+                encoder->copyFromTexture(texture.get(), /*sourceSlice=*/ 0, /*sourceLevel=*/ 0, MTL::Origin(0, 0, 0),
+                                         MTL::Size(width, height, 1), buffer.get(), /*destinationOffset=*/ 0,
+                                         bytesPerRow, /*destinationBytesPerImage=*/ bytesPerRow * height);
+                context->signalHazards(encoder);
+                encoder->endEncoding();
+            }
+        }, [this, staging, width, height, path, encoder](MTL::CommandBuffer*) {
+            _encoders->enqueue([this, staging, width, height, path, encoder]() mutable {
+                const auto& buffer = staging.buffer;
+                gls::image<T> view(width, height, width, std::span<T>((T*) buffer->contents(), buffer->length() / sizeof(T)));
+                encode(view, path, encoder);
+                releaseStaging(std::move(staging));
+                endJob();
+            });
+        });
+    }
+
+    // Dumps a CPU image, the copy is taken now and encoded in the background
+    template <typename T>
+    void dump(const gls::image<T>& image, const std::string& name, std::type_identity_t<Encoder<T>> encoder) {
+        if (!_enabled) {
+            return;
+        }
+        auto copy = std::make_shared<gls::image<T>>(image.width, image.height);
+        for (int y = 0; y < image.height; y++) {
+            std::memcpy(&(*copy)[y][0], &image[y][0], sizeof(T) * image.width);
+        }
+        const auto path = nextPath(name);
+        beginJob();
+        _encoders->enqueue([this, copy, path, encoder]() {
+            encode(*copy, path, encoder);
+            endJob();
+        });
+    }
+};
+
+}  // namespace gls
+
+#endif /* gls_debug_dump_hpp */
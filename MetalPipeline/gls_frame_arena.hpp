@@ -0,0 +1,183 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_frame_arena_hpp
+#define gls_frame_arena_hpp
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace gls {
+
+// Monotonic arena for the short lived CPU containers of a frame: the keypoints and the matches of the registration,
+// the RANSAC points, the AWB and PCA scratch. Allocations bump an offset in a single block, the memory is released
+// all at once when the frame's outermost Scope ends. Allocations that don't fit go to the heap and the block grows
+// to the high water mark when the frame ends, after the first frames the temporaries don't touch the heap. The
+// allocation is lock free and thread safe: the scheduler's helpers allocate from the arena of the thread running
+// parallel_for, see TaskScheduler. Nothing allocated in a Scope may outlive it.
+//
+// The containers use frame_allocator rather than std::pmr: the std::pmr runtime requires iOS 17 and macOS 14.
+class FrameArena {
+    std::unique_ptr<std::byte[]> _block;
+    size_t _capacity = 0;
+    std::atomic<size_t> _used = 0;
+
+    // The heap allocations of the blocks that didn't fit, freed when the frame ends
+    struct Overflow {
+        void* pointer;
+        size_t alignment;
+    };
+    std::mutex _overflowMutex;
+    std::vector<Overflow> _overflow;
+    size_t _overflowBytes = 0;
+
+    // Open scopes, they are opened by the thread running the frame
+    int _depth = 0;
+
+    // Growth granularity of the block
+    static constexpr size_t kBlockGranularity = 64 * 1024;
+
+    static std::align_val_t alignment(size_t alignment) {
+        return std::align_val_t(std::max(alignment, (size_t) __STDCPP_DEFAULT_NEW_ALIGNMENT__));
+    }
+
+    void reset() {
+        const size_t highWater = _used + _overflowBytes;
+        for (const auto& overflow : _overflow) {
+            ::operator delete(overflow.pointer, alignment(overflow.alignment));
+        }
+        _overflow.clear();
+        if (_overflowBytes > 0) {
+            _capacity = (highWater + kBlockGranularity - 1) / kBlockGranularity * kBlockGranularity;
+            _block.reset(new std::byte[_capacity]);
+        }
+        _overflowBytes = 0;
+        _used = 0;
+    }
+
+public:
+    FrameArena(size_t capacity = 0) : _block(capacity > 0 ? new std::byte[capacity] : nullptr), _capacity(capacity) { }
+
+    ~FrameArena() {
+        assert(_depth == 0);
+        reset();
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    void* allocate(size_t bytes, size_t alignment) {
+        const auto base = (uintptr_t) _block.get();
+        size_t offset = _used.load(std::memory_order_relaxed);
+        while (_block) {
+            const size_t aligned = ((base + offset + alignment - 1) & ~(uintptr_t) (alignment - 1)) - base;
+            if (aligned + bytes > _capacity) {
+                break;
+            }
+            if (_used.compare_exchange_weak(offset, aligned + bytes, std::memory_order_relaxed)) {
+                return _block.get() + aligned;
+            }
+        }
+
+        void* pointer = ::operator new(bytes, FrameArena::alignment(alignment));
+        std::lock_guard<std::mutex> guard(_overflowMutex);
+        _overflow.push_back({ pointer, alignment });
+        _overflowBytes += bytes + alignment;
+        return pointer;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    // The arena the containers of the calling thread allocate from, nullptr for the heap
+    static FrameArena*& current() {
+        static thread_local FrameArena* arena = nullptr;
+        return arena;
+    }
+
+    // Makes the arena the calling thread's current one till the end of the scope, e.g. for the CPU work of a frame.
+    // The arena is reset when its outermost scope ends.
+    class Scope {
+        FrameArena* _arena;
+        FrameArena* _previous;
+
+    public:
+        Scope(FrameArena* arena) : _arena(arena), _previous(current()) {
+            _arena->_depth++;
+            current() = _arena;
+        }
+
+        ~Scope() {
+            current() = _previous;
+            if (--_arena->_depth == 0) {
+                _arena->reset();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+// Allocator of the current FrameArena of the thread constructing the container, or of the heap outside of a
+// FrameArena::Scope. The deallocations in the arena are no-ops, the frame releases the memory.
+template <typename T>
+class frame_allocator {
+    template <typename U> friend class frame_allocator;
+
+    FrameArena* _arena;
+
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    frame_allocator() : _arena(FrameArena::current()) { }
+
+    template <typename U>
+    frame_allocator(const frame_allocator<U>& other) : _arena(other._arena) { }
+
+    T* allocate(size_t n) {
+        if (_arena) {
+            return (T*) _arena->allocate(n * sizeof(T), alignof(T));
+        }
+        return (T*) ::operator new(n * sizeof(T), std::align_val_t(alignof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (!_arena) {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+        }
+    }
+
+    template <typename U>
+    bool operator==(const frame_allocator<U>& other) const {
+        return _arena == other._arena;
+    }
+};
+
+template <typename T>
+using frame_vector = std::vector<T, frame_allocator<T>>;
+
+}  // namespace gls
+
+#endif /* gls_frame_arena_hpp */
@@ -0,0 +1,272 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_image_writer_hpp
+#define gls_image_writer_hpp
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <tiffio.h>
+#include <zlib.h>
+
+#include "gls_image.hpp"
+#include "gls_tiff_metadata.hpp"
+
+#include "TaskScheduler.hpp"
+#include "ThreadPool.hpp"
+#include "dng_writer.hpp"
+
+namespace gls {
+
+// Conversion of a linear [0, 1] image to an integer output format, the rows are converted in parallel and the
+// channel arithmetic of a row vectorizes. The values are truncated like the processing's previous output loops.
+template <typename output_pixel_type, typename input_pixel_type>
+void convertToOutput(const gls::image<input_pixel_type>& image, gls::image<output_pixel_type>* output,
+                     float exposure_multiplier = 1) {
+    using value_type = typename output_pixel_type::value_type;
+    assert(output->width == image.width && output->height == image.height);
+
+    const float scale = std::numeric_limits<value_type>::max();
+    const float gain = scale * exposure_multiplier;
+    gls::parallel_for(0, image.height, /*grain=*/ 16, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            const input_pixel_type* in = &image[y][0];
+            output_pixel_type* out = &(*output)[y][0];
+            for (int x = 0; x < image.width; x++) {
+                out[x] = {
+                    (value_type) std::clamp(gain * (float) in[x].red, 0.0f, scale),
+                    (value_type) std::clamp(gain * (float) in[x].green, 0.0f, scale),
+                    (value_type) std::clamp(gain * (float) in[x].blue, 0.0f, scale)
+                };
+            }
+        }
+    });
+}
+
+// Deflate compressed TIFF, the strips are compressed in parallel and written with TIFFWriteRawStrip. Only the
+// basic tags, Make, Model and the ICC profile are written: outputs needing the full DNG/EXIF metadata go through
+// gls::image::write_tiff_file.
+template <typename pixel_type>
+void writeDeflateTiff(const gls::image<pixel_type>& image, const std::string& path,
+                      const gls::tiff_metadata* metadata, const std::vector<uint8_t>* icc_profile_data,
+                      int rowsPerStrip = 64, int compressionLevel = Z_DEFAULT_COMPRESSION) {
+    using value_type = typename pixel_type::value_type;
+    constexpr int channels = sizeof(pixel_type) / sizeof(value_type);
+    static_assert(channels == 1 || channels == 3, "writeDeflateTiff: luma or RGB pixels");
+
+    const size_t rowBytes = sizeof(pixel_type) * image.width;
+    const int strips = (image.height + rowsPerStrip - 1) / rowsPerStrip;
+    std::vector<std::vector<uint8_t>> compressedStrips(strips);
+
+    gls::parallel_for(0, strips, /*grain=*/ 1, [&](int s0, int s1) {
+        std::vector<uint8_t> stripData;
+        for (int s = s0; s < s1; s++) {
+            const int y0 = s * rowsPerStrip;
+            const int y1 = std::min(y0 + rowsPerStrip, image.height);
+            stripData.resize(rowBytes * (y1 - y0));
+            for (int y = y0; y < y1; y++) {
+                std::memcpy(&stripData[rowBytes * (y - y0)], &image[y][0], rowBytes);
+            }
+
+            auto& compressed = compressedStrips[s];
+            uLongf compressedSize = compressBound(stripData.size());
+            compressed.resize(compressedSize);
+            if (compress2(compressed.data(), &compressedSize, stripData.data(), stripData.size(), compressionLevel) != Z_OK) {
+                throw std::runtime_error("writeDeflateTiff: couldn't compress strip " + std::to_string(s));
+            }
+            compressed.resize(compressedSize);
+        }
+    });
+
+    // libtiff writes the host byte order, the samples go as they are
+    auto tiff = std::unique_ptr<TIFF, void (*)(TIFF*)>(TIFFOpen(path.c_str(), "w"), TIFFClose);
+    if (!tiff) {
+        throw std::runtime_error("writeDeflateTiff: couldn't open " + path);
+    }
+    TIFFSetField(tiff.get(), TIFFTAG_IMAGEWIDTH, image.width);
+    TIFFSetField(tiff.get(), TIFFTAG_IMAGELENGTH, image.height);
+    TIFFSetField(tiff.get(), TIFFTAG_BITSPERSAMPLE, (int) (8 * sizeof(value_type)));
+    TIFFSetField(tiff.get(), TIFFTAG_SAMPLESPERPIXEL, channels);
+    TIFFSetField(tiff.get(), TIFFTAG_PHOTOMETRIC, channels == 3 ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff.get(), TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff.get(), TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    TIFFSetField(tiff.get(), TIFFTAG_ROWSPERSTRIP, rowsPerStrip);
+    TIFFSetField(tiff.get(), TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+    if (metadata) {
+        std::string make, model;
+        if (getValue(*metadata, TIFFTAG_MAKE, &make)) {
+            TIFFSetField(tiff.get(), TIFFTAG_MAKE, make.c_str());
+        }
+        if (getValue(*metadata, TIFFTAG_MODEL, &model)) {
+            TIFFSetField(tiff.get(), TIFFTAG_MODEL, model.c_str());
+        }
+    }
+    if (icc_profile_data && !icc_profile_data->empty()) {
+        TIFFSetField(tiff.get(), TIFFTAG_ICCPROFILE, (uint32_t) icc_profile_data->size(), icc_profile_data->data());
+    }
+    for (int s = 0; s < strips; s++) {
+        auto& compressed = compressedStrips[s];
+        if (TIFFWriteRawStrip(tiff.get(), s, compressed.data(), compressed.size()) < 0) {
+            throw std::runtime_error("writeDeflateTiff: couldn't write strip " + std::to_string(s) + " of " + path);
+        }
+    }
+}
+
+// Asynchronous output writer: write() converts the linear image to the output format right away, in parallel, so
+// the caller can reuse the source (e.g. a mapped GPU texture), and the encoding happens on the writer's threads.
+// At most maxPending images wait to be encoded, write() blocks beyond that to bound the memory in flight.
+class ImageWriter {
+public:
+    enum class Format {
+        tiff,           // Uncompressed, with the full metadata
+        tiffDeflate,    // Strip parallel deflate, see writeDeflateTiff
+        png,
+        jpeg            // 8 bit only
+    };
+
+    struct Options {
+        Format format = Format::tiff;
+        float exposureMultiplier = 1;
+        int jpegQuality = 95;
+    };
+
+private:
+    ThreadPool _threads;
+    const int _maxPending;
+
+    std::mutex _mutex;
+    std::condition_variable _done;
+    int _pending = 0;
+    std::exception_ptr _error;
+
+    template <typename pixel_type>
+    static void encode(const gls::image<pixel_type>& image, const std::string& path, const Options& options,
+                       const gls::tiff_metadata* metadata, const std::vector<uint8_t>* icc_profile_data) {
+        switch (options.format) {
+            case Format::tiff:
+                image.write_tiff_file(path, gls::tiff_compression::NONE, const_cast<gls::tiff_metadata*>(metadata),
+                                      icc_profile_data);
+                break;
+            case Format::tiffDeflate:
+                writeDeflateTiff(image, path, metadata, icc_profile_data);
+                break;
+            case Format::png:
+                image.write_png_file(path, /*skip_alpha=*/ true, icc_profile_data);
+                break;
+            case Format::jpeg:
+                if constexpr (sizeof(typename pixel_type::value_type) == 1) {
+                    image.write_jpeg_file(path, options.jpegQuality);
+                } else {
+                    throw std::runtime_error("ImageWriter: JPEG output needs 8 bit pixels, " + path);
+                }
+                break;
+        }
+    }
+
+    // Runs task on the writer's threads, blocks while maxPending writes wait
+    template <typename F>
+    void enqueue(F task) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done.wait(lock, [this]() { return _pending < _maxPending; });
+            _pending++;
+        }
+        _threads.enqueue([this, task]() {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(_mutex);
+                if (!_error) {
+                    _error = std::current_exception();
+                }
+            }
+            std::lock_guard<std::mutex> guard(_mutex);
+            _pending--;
+            _done.notify_all();
+        });
+    }
+
+public:
+    // Encoding is throughput work, the writer's threads run at utility QoS
+    ImageWriter(int threads = 2, int maxPending = 4) :
+        _threads(std::max(threads, 1), gls::QoS::utility), _maxPending(std::max(maxPending, 1)) { }
+
+    ~ImageWriter() {
+        try {
+            wait();
+        } catch (const std::exception& e) {
+            std::cout << "ImageWriter: " << e.what() << std::endl;
+        }
+    }
+
+    // The metadata and the ICC profile are copied, they can go once write() returns
+    template <typename pixel_type, typename input_pixel_type>
+    void write(const gls::image<input_pixel_type>& image, const std::string& path, const Options& options = {},
+               const gls::tiff_metadata* metadata = nullptr, const std::vector<uint8_t>* icc_profile_data = nullptr) {
+        auto output = std::make_shared<gls::image<pixel_type>>(image.width, image.height);
+        convertToOutput(image, output.get(), options.exposureMultiplier);
+
+        auto metadataCopy = metadata ? std::make_shared<gls::tiff_metadata>(*metadata) : nullptr;
+        auto iccCopy = icc_profile_data ? std::make_shared<std::vector<uint8_t>>(*icc_profile_data) : nullptr;
+        enqueue([output, path, options, metadataCopy, iccCopy]() {
+            encode(*output, path, options, metadataCopy.get(), iccCopy.get());
+        });
+    }
+
+    // Tiled DNG of a raw image, see DNGWriter. The image is copied right away, as for write(), the metadata of the
+    // reference frame goes to the DNG's tags.
+    void writeDNG(const gls::image<gls::luma_pixel_16>& rawImage, const std::string& path,
+                  const gls::tiff_metadata& dng_metadata, const gls::tiff_metadata* exif_metadata = nullptr,
+                  const DNGWriter::Options& options = {}) {
+        auto raw = std::make_shared<gls::image<gls::luma_pixel_16>>(rawImage.width, rawImage.height);
+        gls::parallel_for(0, rawImage.height, /*grain=*/ 64, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                std::memcpy(&(*raw)[y][0], &rawImage[y][0], sizeof(gls::luma_pixel_16) * rawImage.width);
+            }
+        });
+        auto metadataCopy = std::make_shared<gls::tiff_metadata>(dng_metadata);
+        auto exifCopy = exif_metadata ? std::make_shared<gls::tiff_metadata>(*exif_metadata) : nullptr;
+        enqueue([raw, path, metadataCopy, exifCopy, options]() {
+            DNGWriter::write(*raw, path, *metadataCopy, exifCopy.get(), options);
+        });
+    }
+
+    // Waits for all the writes, rethrows the first error
+    void wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this]() { return _pending == 0; });
+        if (_error) {
+            auto error = _error;
+            _error = nullptr;
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+}  // namespace gls
+
+#endif /* gls_image_writer_hpp */
@@ -0,0 +1,89 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_mapped_file_hpp
+#define gls_mapped_file_hpp
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace gls {
+
+// Read only memory mapping of a whole file: the pages are read from disk when they are first touched, so parsing
+// the headers of a large file only reads the pages holding them. Throws if the file can't be opened or mapped.
+class MappedFile {
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+
+public:
+    MappedFile(const std::string& path, bool sequential = false) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("MappedFile: couldn't open " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("MappedFile: couldn't stat " + path);
+        }
+        _size = info.st_size;
+        if (_size > 0) {
+            void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("MappedFile: couldn't map " + path);
+            }
+            _data = (const uint8_t*) data;
+            // The mapping outlives the descriptor
+            ::madvise(data, _size, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (_data) {
+            ::munmap((void*) _data, _size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::span<const uint8_t> data() const {
+        return { _data, _size };
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    // The whole file, e.g. an ICC profile
+    static std::vector<uint8_t> read(const std::string& path) {
+        MappedFile file(path, /*sequential=*/ true);
+        return { file.data().begin(), file.data().end() };
+    }
+};
+
+}  // namespace gls
+
+#endif /* gls_mapped_file_hpp */
@@ -0,0 +1,113 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef gls_memory_pressure_hpp
+#define gls_memory_pressure_hpp
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gls {
+
+enum class MemoryPressure {
+    normal,
+    warning,    // Drop what can be recomputed cheaply: idle caches and pools
+    critical    // Drop everything not in use, e.g. the textures of idle converters
+};
+
+// Dispatches the system's memory warnings to the clients holding caches, e.g. an idle RawConverter's textures and
+// the converter pools. Clients are trimmed in ascending priority order, the cheapest to rebuild first, each returns
+// the bytes it released. The platform layer feeds respond(), e.g. from a dispatch memory pressure source or the
+// application's memory warning notification.
+//
+// Clients stay registered for the lifetime of their Registration token. The trim callbacks run on the thread calling
+// respond(), concurrently with the clients' own work: a client which can't trim safely from another thread should
+// defer the trim to its next use.
+class MemoryPressureResponder {
+public:
+    typedef std::shared_ptr<const void> Registration;
+    typedef std::function<size_t(MemoryPressure level)> TrimFunction;
+
+private:
+    struct Client {
+        std::string name;
+        int priority;
+        TrimFunction trim;
+    };
+
+    // Guards the list of clients, respond() holds it while trimming: a client can't be unregistered mid trim
+    std::recursive_mutex _mutex;
+    std::vector<std::shared_ptr<Client>> _clients;
+
+    MemoryPressureResponder() = default;
+
+public:
+    MemoryPressureResponder(const MemoryPressureResponder&) = delete;
+    MemoryPressureResponder& operator=(const MemoryPressureResponder&) = delete;
+
+    static MemoryPressureResponder& shared() {
+        static MemoryPressureResponder responder;
+        return responder;
+    }
+
+    // Lower priorities are trimmed first
+    [[nodiscard]] Registration add(const std::string& name, int priority, TrimFunction trim) {
+        auto client = std::make_shared<Client>(Client { name, priority, std::move(trim) });
+
+        std::lock_guard<std::recursive_mutex> guard(_mutex);
+        const auto position = std::find_if(_clients.begin(), _clients.end(), [&](const auto& c) {
+            return c->priority > priority;
+        });
+        _clients.insert(position, client);
+
+        return Registration(client.get(), [this](const void* client) {
+            std::lock_guard<std::recursive_mutex> guard(_mutex);
+            std::erase_if(_clients, [client](const auto& c) { return c.get() == client; });
+        });
+    }
+
+    // Trims all the clients for the given level, returns the bytes released
+    size_t respond(MemoryPressure level) {
+        if (level == MemoryPressure::normal) {
+            return 0;
+        }
+
+        std::lock_guard<std::recursive_mutex> guard(_mutex);
+        // A trim may release the registration of another client
+        const auto clients = _clients;
+        size_t released = 0;
+        for (const auto& client : clients) {
+            const size_t bytes = client->trim(level);
+            if (bytes > 0) {
+                std::cout << "Memory " << (level == MemoryPressure::critical ? "critical" : "warning") << ", "
+                          << client->name << " released " << std::fixed << std::setprecision(1)
+                          << bytes / (1024.0 * 1024.0) << "MB" << std::endl;
+            }
+            released += bytes;
+        }
+        return released;
+    }
+};
+
+}  // namespace gls
+
+#endif /* gls_memory_pressure_hpp */
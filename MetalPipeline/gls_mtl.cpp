@@ -19,5 +19,4 @@
 
 #include "gls_mtl.hpp"
 
-std::unique_ptr<std::map<const std::string,
-                         NS::SharedPtr<MTL::ComputePipelineState>>> kernelStateMap = nullptr;
+PipelineStateCache pipelineStateCache;
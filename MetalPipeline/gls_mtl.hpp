@@ -16,35 +16,1499 @@
 #ifndef gls_mtl_hpp
 #define gls_mtl_hpp
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
 #include <exception>
 #include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
 #include <map>
 #include <vector>
 #include <string>
 #include <mutex>
+#include <shared_mutex>
+#include <future>
+#include <thread>
+#include <filesystem>
+#include <fstream>
+#include <optional>
 
 #include <Metal/Metal.hpp>
 
+#include "gpu_memory_tracker.hpp"
+#include "gls_qos.hpp"
+#include "gls_signpost.hpp"
+
+// Function constant values for kernel specialization, also part of the pipeline cache key
+class FunctionConstants {
+    struct Value {
+        NS::UInteger index;
+        MTL::DataType type;
+        std::array<uint8_t, 8> bytes;
+        size_t size;
+    };
+    std::vector<Value> _values;
+
+    template <typename T>
+    static constexpr MTL::DataType dataType() {
+        if constexpr (std::is_same<T, bool>::value) {
+            return MTL::DataTypeBool;
+        } else if constexpr (std::is_same<T, int>::value) {
+            return MTL::DataTypeInt;
+        } else if constexpr (std::is_same<T, unsigned>::value) {
+            return MTL::DataTypeUInt;
+        } else if constexpr (std::is_same<T, short>::value) {
+            return MTL::DataTypeShort;
+        } else if constexpr (std::is_same<T, unsigned short>::value) {
+            return MTL::DataTypeUShort;
+        } else {
+            static_assert(std::is_same<T, float>::value, "Unsupported function constant type");
+            return MTL::DataTypeFloat;
+        }
+    }
+
+public:
+    template <typename T>
+    FunctionConstants& set(NS::UInteger index, const T& value) {
+        Value v = { index, dataType<T>(), {}, sizeof(T) };
+        std::memcpy(v.bytes.data(), &value, sizeof(T));
+        _values.erase(std::remove_if(_values.begin(), _values.end(), [index](const Value& e) { return e.index == index; }), _values.end());
+        _values.push_back(v);
+        std::sort(_values.begin(), _values.end(), [](const Value& a, const Value& b) { return a.index < b.index; });
+        return *this;
+    }
+
+    bool empty() const {
+        return _values.empty();
+    }
+
+    // Canonical string representation of the constant values
+    std::string key() const {
+        std::string result;
+        for (const auto& v : _values) {
+            result += std::to_string(v.index) + ":" + std::to_string((int) v.type) + "=";
+            for (size_t i = 0; i < v.size; i++) {
+                static const char* hex = "0123456789abcdef";
+                result += hex[v.bytes[i] >> 4];
+                result += hex[v.bytes[i] & 0xf];
+            }
+            result += ";";
+        }
+        return result;
+    }
+
+    NS::SharedPtr<MTL::FunctionConstantValues> constantValues() const {
+        auto constantValues = NS::TransferPtr(MTL::FunctionConstantValues::alloc()->init());
+        for (const auto& v : _values) {
+            constantValues->setConstantValue(v.bytes.data(), v.type, v.index);
+        }
+        return constantValues;
+    }
+};
+
+// Process-wide pipeline state cache keyed by (device, library, kernel name, function constants).
+// Lookups only take a shared lock, pipelines are created outside of the lock so that different
+// kernels can be compiled in parallel, concurrent requests for the same pipeline wait on its future.
+class PipelineStateCache {
+public:
+    typedef std::tuple<const MTL::Device*, const MTL::Library*, std::string, std::string> Key;
+    typedef NS::SharedPtr<MTL::ComputePipelineState> Value;
+
+private:
+    std::shared_mutex _mutex;
+    std::map<Key, std::shared_future<Value>> _entries;
+
+public:
+    Value get(const Key& key, std::function<MTL::ComputePipelineState*()> create) {
+        {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            auto entry = _entries.find(key);
+            if (entry != _entries.end()) {
+                auto future = entry->second;
+                lock.unlock();
+                return future.get();
+            }
+        }
+
+        std::promise<Value> promise;
+        {
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            auto entry = _entries.find(key);
+            if (entry != _entries.end()) {
+                auto future = entry->second;
+                lock.unlock();
+                return future.get();
+            }
+            _entries[key] = promise.get_future().share();
+        }
+
+        try {
+            auto value = NS::TransferPtr(create());
+            promise.set_value(value);
+            return value;
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            // Let later requests retry
+            std::unique_lock<std::shared_mutex> lock(_mutex);
+            _entries.erase(key);
+            throw;
+        }
+    }
+
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _entries.clear();
+    }
+
+    // Visits the pipelines built so far, the ones still compiling are skipped
+    void forEach(const std::function<void(const Key&, const Value&)>& visitor) {
+        std::vector<std::pair<Key, std::shared_future<Value>>> entries;
+        {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            entries.assign(_entries.begin(), _entries.end());
+        }
+        for (const auto& [key, future] : entries) {
+            if (future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+                visitor(key, future.get());
+            }
+        }
+    }
+};
+
+extern PipelineStateCache pipelineStateCache;
+
+// Debug check of CPU access to textures written by in-flight GPU work: the kernels record the textures
+// they write until their command buffer completes, mtl_image_2d::mapImage() asserts they are not pending.
+// Enabled in debug builds, define GLS_TRACK_GPU_WRITES to 0 or 1 to override.
+#ifndef GLS_TRACK_GPU_WRITES
+#ifdef NDEBUG
+#define GLS_TRACK_GPU_WRITES 0
+#else
+#define GLS_TRACK_GPU_WRITES 1
+#endif
+#endif
+
+class GPUWriteTracker {
+    std::mutex _mutex;
+    std::map<const MTL::Texture*, int> _pending;
+
+public:
+    static GPUWriteTracker& instance() {
+        static GPUWriteTracker tracker;
+        return tracker;
+    }
+
+    void begin(const MTL::Texture* texture) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _pending[texture]++;
+    }
+
+    void end(const MTL::Texture* texture) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto entry = _pending.find(texture);
+        if (entry != _pending.end() && --entry->second <= 0) {
+            _pending.erase(entry);
+        }
+    }
+
+    bool pending(const MTL::Texture* texture) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _pending.find(texture) != _pending.end();
+    }
+};
+
+// Default threadgroup shape: 2D tiles one SIMD-group wide for image kernels, 1D strips otherwise
+inline MTL::Size defaultThreadGroupSize(const MTL::ComputePipelineState* pipelineState, const MTL::Size& gridSize) {
+    const auto maxThreads = pipelineState->maxTotalThreadsPerThreadgroup();
+    if (gridSize.height <= 1 && gridSize.depth <= 1) {
+        return MTL::Size(maxThreads, 1, 1);
+    }
+    const auto width = pipelineState->threadExecutionWidth();
+    return MTL::Size(width, std::max<NS::UInteger>(maxThreads / width, 1), 1);
+}
+
+// Threadgroup shape autotuning: candidate shapes are tried on successive dispatches of each kernel,
+// timed with the GPU timestamp counters, and the fastest one is kept and persisted per device
+class ThreadgroupTuner {
+    static constexpr int kSamplesPerCandidate = 3;
+
+    struct Entry {
+        std::vector<MTL::Size> candidates;
+        std::vector<std::vector<double>> times;
+        size_t next = 0;
+        std::optional<MTL::Size> best;
+    };
+
+    std::map<std::string, Entry> _entries;
+    std::string _path;
+    std::string _deviceName;
+
+    static std::vector<MTL::Size> candidateSizes(const MTL::ComputePipelineState* pipelineState, const MTL::Size& gridSize) {
+        const NS::UInteger maxThreads = pipelineState->maxTotalThreadsPerThreadgroup();
+        std::vector<MTL::Size> candidates;
+        if (gridSize.height <= 1 && gridSize.depth <= 1) {
+            for (NS::UInteger threads = maxThreads; threads >= 32; threads /= 2) {
+                candidates.push_back(MTL::Size(threads, 1, 1));
+            }
+        } else {
+            for (NS::UInteger threads : { maxThreads, maxThreads / 4 }) {
+                for (NS::UInteger width = 8; width <= threads; width *= 2) {
+                    candidates.push_back(MTL::Size(width, threads / width, 1));
+                }
+            }
+        }
+        return candidates;
+    }
+
+public:
+    ThreadgroupTuner() = default;
+
+    void load(const std::string& path, const std::string& deviceName) {
+        _path = path;
+        _deviceName = deviceName;
+
+        // Format: one "device<TAB>kernel<TAB>width<TAB>height" line per tuned kernel
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string device, kernel;
+            NS::UInteger width = 0, height = 0;
+            if (std::getline(fields, device, '\t') && std::getline(fields, kernel, '\t') && (fields >> width >> height)) {
+                if (device == _deviceName && width > 0 && height > 0) {
+                    _entries[kernel].best = MTL::Size(width, height, 1);
+                }
+            }
+        }
+    }
+
+    void save() const {
+        if (_path.empty()) {
+            return;
+        }
+        // Keep the entries of the other devices
+        std::vector<std::string> lines;
+        {
+            std::ifstream file(_path);
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.rfind(_deviceName + "\t", 0) != 0) {
+                    lines.push_back(line);
+                }
+            }
+        }
+        std::ofstream file(_path);
+        for (const auto& line : lines) {
+            file << line << std::endl;
+        }
+        for (const auto& [kernel, entry] : _entries) {
+            if (entry.best) {
+                file << _deviceName << "\t" << kernel << "\t" << entry.best->width << "\t" << entry.best->height << std::endl;
+            }
+        }
+    }
+
+    std::optional<MTL::Size> tunedSize(const std::string& kernel) const {
+        auto entry = _entries.find(kernel);
+        return entry != _entries.end() ? entry->second.best : std::nullopt;
+    }
+
+    // Next shape to try for a kernel being tuned, round robin over the candidates
+    MTL::Size nextCandidate(const std::string& kernel, const MTL::ComputePipelineState* pipelineState, const MTL::Size& gridSize) {
+        auto& entry = _entries[kernel];
+        if (entry.best) {
+            return *entry.best;
+        }
+        if (entry.candidates.empty()) {
+            entry.candidates = candidateSizes(pipelineState, gridSize);
+            entry.times.resize(entry.candidates.size());
+        }
+        const auto candidate = entry.candidates[entry.next];
+        entry.next = (entry.next + 1) % entry.candidates.size();
+        return candidate;
+    }
+
+    void addSample(const std::string& kernel, const MTL::Size& threadGroupSize, double timeMs) {
+        auto e = _entries.find(kernel);
+        if (e == _entries.end() || e->second.best) {
+            return;
+        }
+        auto& entry = e->second;
+        for (size_t i = 0; i < entry.candidates.size(); i++) {
+            const auto& c = entry.candidates[i];
+            if (c.width == threadGroupSize.width && c.height == threadGroupSize.height && c.depth == threadGroupSize.depth) {
+                entry.times[i].push_back(timeMs);
+            }
+        }
+
+        if (std::all_of(entry.times.begin(), entry.times.end(), [](const auto& t) { return t.size() >= kSamplesPerCandidate; })) {
+            // Pick the candidate with the lowest median time
+            double bestTime = std::numeric_limits<double>::max();
+            for (size_t i = 0; i < entry.candidates.size(); i++) {
+                auto times = entry.times[i];
+                std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+                if (times[times.size() / 2] < bestTime) {
+                    bestTime = times[times.size() / 2];
+                    entry.best = entry.candidates[i];
+                }
+            }
+            entry.candidates.clear();
+            entry.times.clear();
+            save();
+        }
+    }
+};
+
+// Slice of a shared buffer holding kernel parameters
+struct BufferSlice {
+    MTL::Buffer* buffer;
+    NS::UInteger offset;
+    void* contents;
+};
+
+// Ring of shared buffer blocks sub-allocated for small per-dispatch parameter blocks. The slices allocated
+// since the last retire() belong to the next committed command buffer, a block is recycled once all the
+// command buffers using it have completed, so updating parameters never has to wait for the GPU.
+class ParameterArena {
+    static constexpr size_t kBlockSize = 256 * 1024;
+
+    struct Block {
+        NS::SharedPtr<MTL::Buffer> buffer;
+        gls::GPUMemoryTracker::Allocation allocation;
+        size_t head = 0;
+        int users = 0;  // In-flight command buffers plus the pending one
+        bool pending = false;
+    };
+
+    MTL::Device* _device;
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<Block>> _blocks;
+    Block* _current = nullptr;
+    std::vector<Block*> _pending;
+
+    Block* availableBlock(size_t length) {
+        for (auto& block : _blocks) {
+            if (block.get() != _current && block->users == 0 && block->buffer->length() >= length) {
+                block->head = 0;
+                return block.get();
+            }
+        }
+        auto block = std::make_unique<Block>();
+        block->buffer = NS::TransferPtr(_device->newBuffer(std::max(length, kBlockSize), MTL::ResourceStorageModeShared));
+        if (!block->buffer) {
+            throw std::runtime_error("Couldn't allocate parameter arena block");
+        }
+        {
+            gls::GPUMemoryTracker::Scope scope("ParameterArena");
+            block->allocation = gls::GPUMemoryTracker::shared().track(block->buffer->allocatedSize());
+        }
+        _blocks.push_back(std::move(block));
+        return _blocks.back().get();
+    }
+
+public:
+    // Satisfies the constant buffer offset alignment of all Metal GPU families
+    static constexpr size_t kAlignment = 256;
+
+    ParameterArena(MTL::Device* device) : _device(device) { }
+
+    BufferSlice allocate(size_t length, size_t alignment = kAlignment) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        if (_current && _current->users == 0) {
+            // Nothing in flight uses this block anymore
+            _current->head = 0;
+        }
+        size_t offset = _current ? (_current->head + alignment - 1) / alignment * alignment : 0;
+        if (!_current || offset + length > _current->buffer->length()) {
+            _current = availableBlock(length);
+            offset = 0;
+        }
+        _current->head = offset + length;
+
+        if (!_current->pending) {
+            _current->pending = true;
+            _current->users++;
+            _pending.push_back(_current);
+        }
+        return { _current->buffer.get(), offset, (uint8_t*) _current->buffer->contents() + offset };
+    }
+
+    // Hands the pending slices to a command buffer being committed, call the returned function on completion
+    std::function<void()> retire() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_pending.empty()) {
+            return [] {};
+        }
+        for (auto block : _pending) {
+            block->pending = false;
+        }
+        return [this, blocks = std::move(_pending)] {
+            std::lock_guard<std::mutex> guard(_mutex);
+            for (auto block : blocks) {
+                block->users--;
+            }
+        };
+    }
+};
+
+// Argument buffer bound to a kernel parameter: the buffer is set at the parameter's index and the resources it
+// references are made resident for the dispatch, read only.
+struct ArgumentBinding {
+    MTL::Buffer* buffer;
+    NS::UInteger offset;
+    std::vector<MTL::Resource*> resources;
+};
+
+// Tier 2 argument buffers of a kernel's resources that stay the same from one dispatch to the next, e.g. the
+// intermediate images of the demosaic graph and the lookup tables: Arguments is the C layout of the kernel's argument
+// struct, with an MTL::ResourceID per texture and the gpuAddress() of the buffers. Each distinct set of arguments is
+// written once to its own buffer, later dispatches with the same resources only bind it. The buffers only depend on
+// the bytes of Arguments, a recycled resource ID hits an entry that is still valid for the new resource, so the table
+// doesn't retain anything but the buffers. The least recently used entry goes beyond kMaxEntries.
+template <typename Arguments>
+class ArgumentTable {
+    static_assert(std::is_trivially_copyable_v<Arguments>, "ArgumentTable: Arguments is copied to the GPU as is");
+
+    static constexpr int kMaxEntries = 4;
+
+    struct Entry {
+        Arguments arguments;
+        NS::SharedPtr<MTL::Buffer> buffer;
+        gls::GPUMemoryTracker::Allocation allocation;
+    };
+
+    MTL::Device* _device;
+    std::mutex _mutex;
+    std::vector<Entry> _entries;  // Most recently used last
+
+public:
+    ArgumentTable(MTL::Device* device) : _device(device) {
+        if (device->argumentBuffersSupport() < MTL::ArgumentBuffersTier2) {
+            throw std::runtime_error("ArgumentTable: " + std::string(device->name()->utf8String()) +
+                                     " doesn't support Tier 2 argument buffers");
+        }
+    }
+
+    static MTL::ResourceID resourceID(const MTL::Texture* texture) {
+        return texture ? texture->gpuResourceID() : MTL::ResourceID { 0 };
+    }
+
+    static uint64_t gpuAddress(const MTL::Buffer* buffer) {
+        return buffer ? buffer->gpuAddress() : 0;
+    }
+
+    // resources are the textures and buffers referenced by arguments
+    ArgumentBinding bind(const Arguments& arguments, std::vector<MTL::Resource*> resources) {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto entry = std::find_if(_entries.begin(), _entries.end(), [&arguments](const Entry& e) {
+            return std::memcmp(&e.arguments, &arguments, sizeof(Arguments)) == 0;
+        });
+        if (entry != _entries.end()) {
+            std::rotate(entry, entry + 1, _entries.end());
+        } else {
+            if (_entries.size() >= kMaxEntries) {
+                // The command buffers using the buffer retain it
+                _entries.erase(_entries.begin());
+            }
+            Entry newEntry { arguments };
+            newEntry.buffer = NS::TransferPtr(_device->newBuffer(&arguments, sizeof(Arguments), MTL::ResourceStorageModeShared));
+            if (!newEntry.buffer) {
+                throw std::runtime_error("Couldn't allocate argument buffer");
+            }
+            {
+                gls::GPUMemoryTracker::Scope scope("ArgumentTable");
+                newEntry.allocation = gls::GPUMemoryTracker::shared().track(newEntry.buffer->allocatedSize());
+            }
+            _entries.push_back(std::move(newEntry));
+        }
+        std::erase(resources, nullptr);
+        return { _entries.back().buffer.get(), /*offset=*/ 0, std::move(resources) };
+    }
+};
+
+// Cancellation of a pipeline job, e.g. the processing of a shot superseded by the next one. cancel() can be called
+// from any thread: the work enqueued in the token's MetalContext::CancellationScope from then on is not encoded, the
+// command buffers already committed run to completion. Copies share the state.
+class CancellationToken {
+    std::shared_ptr<std::atomic<bool>> _cancelled = std::make_shared<std::atomic<bool>>(false);
+
+public:
+    void cancel() const {
+        *_cancelled = true;
+    }
+
+    bool cancelled() const {
+        return *_cancelled;
+    }
+};
+
 // Metal execution context implementing a simple sequential pipeline
 
-class MetalContext {
-    NS::SharedPtr<MTL::Device> _device;
-    NS::SharedPtr<MTL::Library> _computeLibrary;
-    NS::SharedPtr<MTL::CommandQueue> _commandQueue;
-    std::vector<MTL::CommandBuffer*> work_in_progress;
-    std::mutex work_in_progress_mutex;
+class MetalContext {
+public:
+    // Priority lanes, each with its own command queue: the GPU interleaves the command buffers of the two queues, so
+    // interactive work (e.g. the viewfinder preview) doesn't wait behind a long background job (e.g. burst fusion).
+    // The lanes are not ordered with respect to each other: work on one lane can only use the results of the other
+    // once they are complete, lanes writing the same textures have to waitForCompletion() when switching.
+    enum class Lane {
+        standard,       // Default, the pipeline's own work
+        interactive
+    };
+    static constexpr int kLanes = 2;
+
+    struct KernelProfile {
+        std::string name;
+        MTL::Size gridSize;
+        MTL::Size threadGroupSize;
+        double gpuTimeMs;
+    };
+
+private:
+    NS::SharedPtr<MTL::Device> _device;
+    NS::SharedPtr<MTL::Library> _computeLibrary;
+    std::array<NS::SharedPtr<MTL::CommandQueue>, kLanes> _commandQueues;
+    Lane _lane = Lane::standard;
+    ParameterArena _parameterArena;
+    std::vector<MTL::CommandBuffer*> work_in_progress;
+    std::mutex work_in_progress_mutex;
+
+    // Completion of the last committed command buffer of each lane, a queue executes command buffers in commit order
+    std::array<std::shared_future<void>, kLanes> _lastSubmission;
+
+    // GPU execution time of the completed command buffers, nanoseconds
+    std::atomic<uint64_t> _gpuTime = 0;
+
+    // Cancellation of the current job, see CancellationScope
+    CancellationToken _cancellationToken;
+
+    // Explicit hazard tracking for untracked resources, see ExplicitHazardsScope: a fence per lane chains the encoders
+    int _explicitHazardsDepth = 0;
+    std::array<NS::SharedPtr<MTL::Fence>, kLanes> _hazardFences;
+
+    // Frame batching: while a batch is open all enqueued work is recorded into a single command buffer
+    int _batchDepth = 0;
+    MTL::CommandBuffer* _batchCommandBuffer = nullptr;
+    MTL::ComputeCommandEncoder* _batchEncoder = nullptr;
+    std::vector<std::function<void(MTL::CommandBuffer*)>> _batchCompletionHandlers;
+    std::shared_ptr<std::promise<void>> _batchPromise;
+    std::shared_future<void> _batchFuture;
+
+    // Concurrent dispatch: inside a concurrent scope the batch encoder doesn't order dispatches, see barrier()
+    int _concurrentDepth = 0;
+
+    // Textures written by the work recorded since the last commit, see GPUWriteTracker
+    std::vector<NS::SharedPtr<MTL::Texture>> _trackedWrites;
+
+    // Kernel profiling: each profiled dispatch uses a pair of timestamp samples in _counterSampleBuffer
+    static constexpr NS::UInteger kMaxProfileSamples = 4096;
+    static constexpr uint64_t kCounterErrorValue = ~0ULL;  // MTLCounterErrorValue
+    bool _profiling = false;
+    bool _stageBoundarySampling = false;
+    NS::SharedPtr<MTL::CounterSampleBuffer> _counterSampleBuffer;
+    NS::UInteger _nextSampleIndex = 0;
+    std::vector<std::pair<KernelProfile, NS::UInteger>> _pendingProfiles;
+    std::vector<KernelProfile> _kernelProfiles;
+    MTL::Timestamp _cpuStartTimestamp = 0;
+    MTL::Timestamp _gpuStartTimestamp = 0;
+
+    // Instruments tracing: the open trace stages, with the batch command buffer holding their debug group if any
+    bool _tracing = false;
+    std::vector<std::pair<std::string, MTL::CommandBuffer*>> _traceStages;
+
+    // GPU trace capture, see captureCommandBuffers: armed with the number of command buffers to capture, the capture
+    // starts with the next command buffer created and stops when the last captured one completes. The latency
+    // trigger arms a capture of the frame following a slow one, see reportFrameLatency.
+    std::mutex _gpuCaptureMutex;
+    int _gpuCaptureArmed = 0;
+    int _gpuCaptureRemaining = 0;
+    std::string _gpuCapturePath;
+    double _gpuCaptureLatencyThreshold = 0;
+    int _gpuCaptureLatencyCount = 0;
+    std::string _gpuCaptureLatencyDirectory;
+
+    // Threadgroup shapes tuned per kernel
+    ThreadgroupTuner _threadgroupTuner;
+    bool _autotuning = false;
+
+    // Dispatch shapes per kernel name for printPipelineStateReport, recorded when enabled
+    struct DispatchShape {
+        int count = 0;
+        MTL::Size gridSize;
+        MTL::Size threadGroupSize;
+    };
+    bool _recordingDispatches = false;
+    std::mutex _dispatchShapesMutex;
+    std::map<std::string, DispatchShape> _dispatchShapes;
+
+    // Pipeline state binary archive, populated on first run and reused on later launches
+    NS::SharedPtr<MTL::BinaryArchive> _binaryArchive;
+    std::string _binaryArchivePath;
+    bool _binaryArchiveDirty = false;
+    std::mutex _binaryArchiveMutex;
+    std::thread _prewarmThread;
+
+    // Called with _gpuCaptureMutex held
+    void startGPUCapture() {
+        auto captureManager = MTL::CaptureManager::sharedCaptureManager();
+        if (!captureManager->supportsDestination(MTL::CaptureDestinationGPUTraceDocument)) {
+            // Outside of Xcode the app needs MetalCaptureEnabled in its Info.plist, or MTL_CAPTURE_ENABLED=1
+            std::cout << "MetalContext: GPU trace capture not enabled" << std::endl;
+            return;
+        }
+        auto descriptor = NS::TransferPtr(MTL::CaptureDescriptor::alloc()->init());
+        descriptor->setCaptureObject(_device.get());
+        descriptor->setDestination(MTL::CaptureDestinationGPUTraceDocument);
+        descriptor->setOutputURL(NS::URL::fileURLWithPath(NS::String::string(_gpuCapturePath.c_str(), NS::UTF8StringEncoding)));
+
+        NS::Error* error = nullptr;
+        if (!captureManager->startCapture(descriptor.get(), &error)) {
+            std::cout << "MetalContext: can't start the GPU trace capture - "
+                      << (error ? error->localizedDescription()->utf8String() : "unknown error") << std::endl;
+            return;
+        }
+        std::cout << "MetalContext: capturing " << _gpuCaptureArmed << " command buffers to " << _gpuCapturePath << std::endl;
+        _gpuCaptureRemaining = _gpuCaptureArmed;
+    }
+
+    // Counts a command buffer being committed, true if it is the last one of the capture
+    bool captureCommandBuffer() {
+        std::lock_guard<std::mutex> guard(_gpuCaptureMutex);
+        return _gpuCaptureRemaining > 0 && --_gpuCaptureRemaining == 0;
+    }
+
+    MTL::CommandBuffer* newCommandBuffer() {
+        // The capture records the commands as they are encoded, it starts before the command buffer is created
+        {
+            std::lock_guard<std::mutex> guard(_gpuCaptureMutex);
+            if (_gpuCaptureArmed > 0 && _gpuCaptureRemaining == 0) {
+                startGPUCapture();
+                _gpuCaptureArmed = 0;
+            }
+        }
+        auto commandBuffer = _commandQueues[(int) _lane]->commandBuffer();
+        if (_tracing && !_traceStages.empty()) {
+            commandBuffer->setLabel(NS::String::string(traceStagePath().c_str(), NS::UTF8StringEncoding));
+        }
+
+        // Add commandBuffer from work_in_progress
+        {
+            std::lock_guard<std::mutex> guard(work_in_progress_mutex);
+            work_in_progress.push_back(commandBuffer);
+        }
+        return commandBuffer;
+    }
+
+    void commit(MTL::CommandBuffer* commandBuffer, std::function<void(MTL::CommandBuffer*)> completionHandler,
+                std::shared_ptr<std::promise<void>> promise = nullptr) {
+        if (!promise) {
+            promise = std::make_shared<std::promise<void>>();
+            std::lock_guard<std::mutex> guard(work_in_progress_mutex);
+            _lastSubmission[(int) _lane] = promise->get_future().share();
+        } else {
+            std::lock_guard<std::mutex> guard(work_in_progress_mutex);
+            _lastSubmission[(int) _lane] = _batchFuture;
+        }
+
+        auto releaseParameters = _parameterArena.retire();
+        auto releaseWrites = retireTrackedWrites();
+        const bool endsGPUCapture = captureCommandBuffer();
+
+        commandBuffer->addCompletedHandler((MTL::HandlerFunction) [this, completionHandler, promise, releaseParameters, releaseWrites,
+                                                                   endsGPUCapture](MTL::CommandBuffer* commandBuffer) {
+            // Accounted before the completion is signaled, the GPU time of a result is in once it is done
+            const double gpuTime = commandBuffer->GPUEndTime() - commandBuffer->GPUStartTime();
+            if (gpuTime > 0) {
+                _gpuTime += (uint64_t) (gpuTime * 1.0e9);
+            }
+            if (endsGPUCapture) {
+                MTL::CaptureManager::sharedCaptureManager()->stopCapture();
+                std::cout << "MetalContext: GPU trace capture complete" << std::endl;
+            }
+            completionHandler(commandBuffer);
+            releaseParameters();
+            releaseWrites();
+
+            if (commandBuffer->status() == MTL::CommandBufferStatusError) {
+                const auto error = commandBuffer->error();
+                promise->set_exception(std::make_exception_ptr(std::runtime_error(std::string("Command buffer execution failed: ") +
+                    (error ? error->localizedDescription()->utf8String() : "unknown error"))));
+            } else {
+                promise->set_value();
+            }
+
+            // Remove completed commandBuffer from work_in_progress
+            {
+                std::lock_guard<std::mutex> guard(work_in_progress_mutex);
+                work_in_progress.erase(std::remove(work_in_progress.begin(), work_in_progress.end(), commandBuffer), work_in_progress.end());
+            }
+        });
+
+        commandBuffer->commit();
+    }
+
+    // The tracked writes of the command buffer being committed end with its completion
+    std::function<void()> retireTrackedWrites() {
+        if (_trackedWrites.empty()) {
+            return [] { };
+        }
+        auto writes = std::make_shared<std::vector<NS::SharedPtr<MTL::Texture>>>(std::move(_trackedWrites));
+        _trackedWrites.clear();
+        return [writes] {
+            for (const auto& texture : *writes) {
+                GPUWriteTracker::instance().end(texture.get());
+            }
+        };
+    }
+
+    MTL::CommandBuffer* batchCommandBuffer() {
+        if (!_batchCommandBuffer) {
+            _batchCommandBuffer = newCommandBuffer();
+        }
+        return _batchCommandBuffer;
+    }
+
+    void newBatchPromise() {
+        _batchPromise = std::make_shared<std::promise<void>>();
+        _batchFuture = _batchPromise->get_future().share();
+    }
+
+    MTL::ComputeCommandEncoder* batchEncoder() {
+        if (!_batchEncoder) {
+            _batchEncoder = _concurrentDepth > 0 ? batchCommandBuffer()->computeCommandEncoder(MTL::DispatchTypeConcurrent)
+                                                 : batchCommandBuffer()->computeCommandEncoder();
+            if (_batchEncoder) {
+                waitForHazards(_batchEncoder);
+            }
+        }
+        return _batchEncoder;
+    }
+
+    void endBatchEncoder() {
+        if (_batchEncoder) {
+            signalHazards(_batchEncoder);
+            _batchEncoder->endEncoding();
+            _batchEncoder = nullptr;
+        }
+    }
+
+    void loadBinaryArchive() {
+        auto descriptor = NS::TransferPtr(MTL::BinaryArchiveDescriptor::alloc()->init());
+        if (std::filesystem::exists(_binaryArchivePath)) {
+            descriptor->setUrl(NS::URL::fileURLWithPath(NS::String::string(_binaryArchivePath.c_str(), NS::UTF8StringEncoding)));
+        }
+        NS::Error* error = nullptr;
+        _binaryArchive = NS::TransferPtr(_device->newBinaryArchive(descriptor.get(), &error));
+        if (!_binaryArchive && descriptor->url()) {
+            // Stale or corrupted archive (e.g. after an OS update), start from scratch
+            std::cout << "Discarding pipeline archive " << _binaryArchivePath << ": " << error->localizedDescription()->utf8String() << std::endl;
+            descriptor->setUrl(nullptr);
+            _binaryArchive = NS::TransferPtr(_device->newBinaryArchive(descriptor.get(), &error));
+        }
+        if (!_binaryArchive) {
+            std::cout << "Couldn't create pipeline archive: " << error->localizedDescription()->utf8String() << std::endl;
+        }
+    }
+
+public:
+    MetalContext(NS::SharedPtr<MTL::Device> device, const std::string& binaryArchivePath = "") :
+        _device(device), _parameterArena(device.get()), _binaryArchivePath(binaryArchivePath) {
+        _computeLibrary = NS::TransferPtr(_device->newDefaultLibrary());
+        for (auto& commandQueue : _commandQueues) {
+            commandQueue = NS::TransferPtr(_device->newCommandQueue());
+        }
+        for (auto& fence : _hazardFences) {
+            fence = NS::TransferPtr(_device->newFence());
+        }
+
+        if (!_binaryArchivePath.empty()) {
+            loadBinaryArchive();
+        }
+    }
+
+    ~MetalContext() {
+        if (_prewarmThread.joinable()) {
+            _prewarmThread.join();
+        }
+        waitForCompletion();
+        saveBinaryArchive();
+    }
+
+    // Write back the binary archive if new pipelines have been added to it
+    void saveBinaryArchive() {
+        std::lock_guard<std::mutex> guard(_binaryArchiveMutex);
+        if (_binaryArchive && _binaryArchiveDirty) {
+            NS::Error* error = nullptr;
+            auto url = NS::URL::fileURLWithPath(NS::String::string(_binaryArchivePath.c_str(), NS::UTF8StringEncoding));
+            if (_binaryArchive->serializeToURL(url, &error)) {
+                _binaryArchiveDirty = false;
+            } else {
+                std::cout << "Couldn't save pipeline archive " << _binaryArchivePath << ": " << error->localizedDescription()->utf8String() << std::endl;
+            }
+        }
+    }
+
+    // Build the pipeline states of all the kernels in the default library on a background thread
+    void prewarmKernels() {
+        if (_prewarmThread.joinable()) {
+            return;
+        }
+        std::vector<std::string> kernelNames;
+        auto functionNames = _computeLibrary->functionNames();
+        for (NS::UInteger i = 0; i < functionNames->count(); i++) {
+            kernelNames.push_back(functionNames->object<NS::String>(i)->utf8String());
+        }
+
+        _prewarmThread = std::thread([this, kernelNames]() {
+            // Off the capture path's cores, a kernel still missing when needed is built by its first user
+            gls::setThreadQoS(gls::QoS::utility);
+
+            // metal-cpp objects created on this thread need their own autorelease pool
+            auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+            for (const auto& name : kernelNames) {
+                try {
+                    kernelPipelineState(name);
+                } catch (const std::exception& e) {
+                    std::cout << "prewarmKernels: " << e.what() << std::endl;
+                }
+            }
+            saveBinaryArchive();
+        });
+    }
+
+    // Open a batch scope: every kernel enqueued until the matching endBatch() is encoded
+    // on one shared compute encoder and submitted as a single command buffer. Batches nest.
+    void beginBatch() {
+        if (_batchDepth++ == 0) {
+            newBatchPromise();
+        }
+    }
+
+    // Returns a future fulfilled when the batch's work has completed on the GPU
+    std::shared_future<void> endBatch() {
+        assert(_batchDepth > 0);
+        auto future = _batchFuture;
+        if (--_batchDepth == 0) {
+            flushBatch();
+        }
+        return future;
+    }
+
+    // Future for the work recorded so far in the open batch
+    std::shared_future<void> batchFuture() {
+        assert(_batchDepth > 0);
+        return _batchFuture;
+    }
+
+    bool isBatching() const {
+        return _batchDepth > 0;
+    }
+
+    // Commit the work recorded so far in the current batch, the batch itself stays open
+    void flushBatch() {
+        if (_batchCommandBuffer) {
+            endBatchEncoder();
+            closeTraceDebugGroups();
+
+            auto completionHandlers = std::move(_batchCompletionHandlers);
+            _batchCompletionHandlers.clear();
+
+            commit(_batchCommandBuffer, [completionHandlers](MTL::CommandBuffer* commandBuffer) {
+                for (const auto& handler : completionHandlers) {
+                    handler(commandBuffer);
+                }
+            }, _batchPromise);
+            _batchCommandBuffer = nullptr;
+
+            // Work recorded after a flush goes in a new command buffer with its own future
+            if (_batchDepth > 0) {
+                newBatchPromise();
+            }
+        }
+    }
+
+    // Commit all pending work, the returned future is fulfilled when everything submitted so far on the current lane
+    // has completed
+    std::shared_future<void> submit() {
+        flushBatch();
+
+        std::lock_guard<std::mutex> guard(work_in_progress_mutex);
+        auto& lastSubmission = _lastSubmission[(int) _lane];
+        if (!lastSubmission.valid()) {
+            std::promise<void> done;
+            done.set_value();
+            lastSubmission = done.get_future().share();
+        }
+        return lastSubmission;
+    }
+
+    Lane lane() const {
+        return _lane;
+    }
+
+    // The work recorded so far in an open batch is committed on the previous lane
+    void setLane(Lane lane) {
+        if (lane != _lane) {
+            flushBatch();
+            _lane = lane;
+        }
+    }
+
+    // RAII helper running the work enqueued in the scope on a lane
+    class LaneScope {
+        MetalContext* _context;
+        const Lane _previous;
+
+    public:
+        LaneScope(MetalContext* context, Lane lane) : _context(context), _previous(context->lane()) {
+            _context->setLane(lane);
+        }
+
+        ~LaneScope() {
+            _context->setLane(_previous);
+        }
+
+        LaneScope(const LaneScope&) = delete;
+        LaneScope& operator=(const LaneScope&) = delete;
+    };
+
+    // Explicit hazard tracking: resources created with MTL::HazardTrackingModeUntracked, e.g. the transient textures
+    // of a StageGraph compiled with untrackedHazards, are not tracked by the driver. In the scope every encoder of the
+    // context waits for its lane's fence when it starts and updates it when it ends, which orders the encoders of a
+    // lane across command buffers as the driver would. The dispatches of a serial encoder are ordered, those of a
+    // concurrent one rely on its barrier() calls. Tasks creating their own encoders (e.g. blits) that touch untracked
+    // resources bracket them with waitForHazards and signalHazards.
+    void beginExplicitHazards() {
+        if (_explicitHazardsDepth++ == 0) {
+            // The encoder in use didn't wait for the fence
+            endBatchEncoder();
+        }
+    }
+
+    void endExplicitHazards() {
+        assert(_explicitHazardsDepth > 0);
+        if (_explicitHazardsDepth == 1) {
+            // The encoder in use signals the fence
+            endBatchEncoder();
+        }
+        _explicitHazardsDepth--;
+    }
+
+    bool explicitHazards() const {
+        return _explicitHazardsDepth > 0;
+    }
+
+    template <typename Encoder>
+    void waitForHazards(Encoder* encoder) const {
+        if (_explicitHazardsDepth > 0) {
+            encoder->waitForFence(_hazardFences[(int) _lane].get());
+        }
+    }
+
+    template <typename Encoder>
+    void signalHazards(Encoder* encoder) const {
+        if (_explicitHazardsDepth > 0) {
+            encoder->updateFence(_hazardFences[(int) _lane].get());
+        }
+    }
+
+    // Render encoders fence their stages, the context only encodes tile dispatches, see enqueueTilePass
+    void waitForHazards(MTL::RenderCommandEncoder* encoder) const {
+        if (_explicitHazardsDepth > 0) {
+            encoder->waitForFence(_hazardFences[(int) _lane].get(), MTL::RenderStageTile);
+        }
+    }
+
+    void signalHazards(MTL::RenderCommandEncoder* encoder) const {
+        if (_explicitHazardsDepth > 0) {
+            encoder->updateFence(_hazardFences[(int) _lane].get(), MTL::RenderStageTile);
+        }
+    }
+
+    class ExplicitHazardsScope {
+        MetalContext* _context;
+
+    public:
+        ExplicitHazardsScope(MetalContext* context) : _context(context) {
+            _context->beginExplicitHazards();
+        }
+
+        ~ExplicitHazardsScope() {
+            _context->endExplicitHazards();
+        }
+
+        ExplicitHazardsScope(const ExplicitHazardsScope&) = delete;
+        ExplicitHazardsScope& operator=(const ExplicitHazardsScope&) = delete;
+    };
+
+    // True if the current job has been cancelled: enqueue() skips its work, the pipeline can also skip its CPU work
+    bool cancelled() const {
+        return _cancellationToken.cancelled();
+    }
+
+    // RAII helper binding the work enqueued in the scope to a cancellation token
+    class CancellationScope {
+        MetalContext* _context;
+        const CancellationToken _previous;
+
+    public:
+        CancellationScope(MetalContext* context, const CancellationToken& token) :
+            _context(context), _previous(context->_cancellationToken) {
+            _context->_cancellationToken = token;
+        }
+
+        ~CancellationScope() {
+            _context->_cancellationToken = _previous;
+        }
+
+        CancellationScope(const CancellationScope&) = delete;
+        CancellationScope& operator=(const CancellationScope&) = delete;
+    };
+
+    // Open a concurrent dispatch scope: kernels enqueued in the scope may run in any order and overlap,
+    // dependent stages must be separated with barrier(). The scope implies a batch. When a nested scope
+    // ends a barrier is inserted, when the outermost one ends its encoder is closed, so work enqueued after
+    // the scope is always ordered with respect to the work in it.
+    void beginConcurrent() {
+        beginBatch();
+        if (_concurrentDepth++ == 0) {
+            // Serial work recorded so far stays in its own encoder
+            endBatchEncoder();
+        }
+    }
+
+    void endConcurrent() {
+        assert(_concurrentDepth > 0);
+        if (--_concurrentDepth == 0) {
+            endBatchEncoder();
+        } else {
+            barrier();
+        }
+        endBatch();
+    }
+
+    bool isConcurrent() const {
+        return _concurrentDepth > 0;
+    }
+
+    // Make the results of all the dispatches encoded so far in the concurrent scope visible to the following ones
+    void barrier() {
+        if (_concurrentDepth > 0 && _batchEncoder) {
+            _batchEncoder->memoryBarrier(MTL::BarrierScopeTextures | MTL::BarrierScopeBuffers);
+        }
+    }
+
+    // Barrier limited to the given resources
+    void barrier(std::initializer_list<const MTL::Resource*> resources) {
+        if (_concurrentDepth > 0 && _batchEncoder) {
+            std::vector<const MTL::Resource*> list(resources);
+            _batchEncoder->memoryBarrier(list.data(), list.size());
+        }
+    }
+
+    // RAII helper for concurrent dispatch scopes
+    class ConcurrentScope {
+        MetalContext* _context;
+
+    public:
+        ConcurrentScope(MetalContext* context) : _context(context) {
+            _context->beginConcurrent();
+        }
+
+        ~ConcurrentScope() {
+            _context->endConcurrent();
+        }
+
+        ConcurrentScope(const ConcurrentScope&) = delete;
+        ConcurrentScope& operator=(const ConcurrentScope&) = delete;
+    };
+
+    // Invoke callback when all the work enqueued so far has completed, or with the open batch
+    void notify(std::function<void()> callback) {
+        if (_batchDepth > 0) {
+            _batchCompletionHandlers.push_back([callback](MTL::CommandBuffer*) { callback(); });
+        } else {
+            // An empty command buffer completes after all the ones committed before it
+            auto commandBuffer = newCommandBuffer();
+            commit(commandBuffer, [callback](MTL::CommandBuffer*) { callback(); });
+        }
+    }
+
+    // Opt-in Instruments tracing: command buffers are labeled with the open trace stages, in batches every stage is
+    // a debug group of the command buffer, and every kernel dispatch a debug group of its encoder. Closing the shared
+    // encoder at the stage boundaries serializes the batches, so this is off by default.
+    void enableTracing(bool enable = true) {
+        _tracing = enable;
+    }
+
+    bool isTracing() const {
+        return _tracing;
+    }
+
+    std::string traceStagePath() const {
+        std::string path;
+        for (const auto& [name, commandBuffer] : _traceStages) {
+            path += path.empty() ? name : "/" + name;
+        }
+        return path;
+    }
+
+    void pushTraceStage(const std::string& name) {
+        MTL::CommandBuffer* commandBuffer = nullptr;
+        // The dispatches of a concurrent scope share an encoder, its stages only get their signposts
+        if (_batchDepth > 0 && _concurrentDepth == 0) {
+            endBatchEncoder();
+            commandBuffer = batchCommandBuffer();
+            commandBuffer->pushDebugGroup(NS::String::string(name.c_str(), NS::UTF8StringEncoding));
+        }
+        _traceStages.push_back({ name, commandBuffer });
+    }
+
+    void popTraceStage() {
+        assert(!_traceStages.empty());
+        const auto commandBuffer = _traceStages.back().second;
+        if (commandBuffer && commandBuffer == _batchCommandBuffer) {
+            endBatchEncoder();
+            commandBuffer->popDebugGroup();
+        }
+        _traceStages.pop_back();
+    }
+
+    // The debug groups open on a batch command buffer being committed end with it
+    void closeTraceDebugGroups() {
+        for (auto it = _traceStages.rbegin(); it != _traceStages.rend(); it++) {
+            if (it->second && it->second == _batchCommandBuffer) {
+                it->second->popDebugGroup();
+                it->second = nullptr;
+            }
+        }
+    }
+
+    // Pipeline stage for Instruments: an os_signpost interval on the CPU and, when tracing is enabled, the stage's
+    // debug group and command buffer labels on the GPU, so that both line up in Metal System Trace
+    class TraceScope {
+        MetalContext* _context;
+        gls::TraceInterval _interval;
+        bool _traced;
+
+    public:
+        TraceScope(MetalContext* context, const std::string& name) :
+            _context(context), _interval(name), _traced(context->isTracing()) {
+            if (_traced) {
+                _context->pushTraceStage(name);
+            }
+        }
+
+        ~TraceScope() {
+            if (_traced) {
+                _context->popTraceStage();
+            }
+        }
+
+        TraceScope(const TraceScope&) = delete;
+        TraceScope& operator=(const TraceScope&) = delete;
+    };
+
+    // RAII helper for frame-scoped batching
+    class BatchScope {
+        MetalContext* _context;
+
+    public:
+        BatchScope(MetalContext* context) : _context(context) {
+            _context->beginBatch();
+        }
+
+        ~BatchScope() {
+            _context->endBatch();
+        }
+
+        BatchScope(const BatchScope&) = delete;
+        BatchScope& operator=(const BatchScope&) = delete;
+    };
+
+private:
+    bool createCounterSampleBuffer() {
+        if (!_counterSampleBuffer) {
+            MTL::CounterSet* timestampCounterSet = nullptr;
+            auto counterSets = _device->counterSets();
+            for (NS::UInteger i = 0; counterSets && i < counterSets->count(); i++) {
+                auto counterSet = counterSets->object<MTL::CounterSet>(i);
+                if (counterSet->name()->isEqualToString(MTL::CommonCounterSetTimestamp)) {
+                    timestampCounterSet = counterSet;
+                    break;
+                }
+            }
+
+            _stageBoundarySampling = _device->supportsCounterSampling(MTL::CounterSamplingPointAtStageBoundary);
+            bool dispatchBoundarySampling = _device->supportsCounterSampling(MTL::CounterSamplingPointAtDispatchBoundary);
+            if (!timestampCounterSet || !(_stageBoundarySampling || dispatchBoundarySampling)) {
+                std::cout << "MetalContext: timestamp counters not supported on " << _device->name()->utf8String() << std::endl;
+                return false;
+            }
+
+            auto descriptor = NS::TransferPtr(MTL::CounterSampleBufferDescriptor::alloc()->init());
+            descriptor->setCounterSet(timestampCounterSet);
+            descriptor->setStorageMode(MTL::StorageModeShared);
+            descriptor->setSampleCount(kMaxProfileSamples);
+
+            NS::Error* error = nullptr;
+            _counterSampleBuffer = NS::TransferPtr(_device->newCounterSampleBuffer(descriptor.get(), &error));
+            if (!_counterSampleBuffer) {
+                throw std::runtime_error(std::string("Couldn't create counter sample buffer: ") + error->localizedDescription()->utf8String());
+            }
+            _device->sampleTimestamps(&_cpuStartTimestamp, &_gpuStartTimestamp);
+        }
+        return true;
+    }
+
+public:
+    // Opt-in per-kernel GPU timing, requires timestamp counters support
+    bool enableProfiling(bool enable = true) {
+        _profiling = enable && createCounterSampleBuffer();
+        return _profiling;
+    }
+
+    bool isProfiling() const {
+        return _profiling;
+    }
+
+    // Dispatches are bracketed by timestamp samples, either for profiling or for threadgroup autotuning
+    bool timestampSampling() const {
+        return _profiling || _autotuning;
+    }
+
+    // Captures the next count command buffers committed, on any lane, to the .gputrace document at path, e.g. the
+    // command buffers of the next pipeline run. A capture in progress is not interrupted. The capture manager has to
+    // be enabled: by Xcode, with MetalCaptureEnabled in the app's Info.plist or with MTL_CAPTURE_ENABLED=1.
+    void captureCommandBuffers(int count, const std::string& path) {
+        std::lock_guard<std::mutex> guard(_gpuCaptureMutex);
+        if (_gpuCaptureRemaining == 0) {
+            _gpuCaptureArmed = count;
+            _gpuCapturePath = path;
+        }
+    }
+
+    // Arms a capture of count command buffers once a frame reported with reportFrameLatency takes longer than
+    // threshold seconds, the frames following a slow one usually run in the same conditions. The trace is written to
+    // directory as slow-frame-<latency ms>-<time>.gputrace. The trigger fires once, a zero threshold disables it.
+    void setGPUCaptureLatencyTrigger(double threshold, int count, const std::string& directory) {
+        std::lock_guard<std::mutex> guard(_gpuCaptureMutex);
+        _gpuCaptureLatencyThreshold = threshold;
+        _gpuCaptureLatencyCount = count;
+        _gpuCaptureLatencyDirectory = directory;
+    }
 
-public:
-    MetalContext(NS::SharedPtr<MTL::Device> device) : _device(device) {
-        _computeLibrary = NS::TransferPtr(_device->newDefaultLibrary());
-        _commandQueue = NS::TransferPtr(_device->newCommandQueue());
+    void reportFrameLatency(double seconds) {
+        std::string path;
+        int count;
+        {
+            std::lock_guard<std::mutex> guard(_gpuCaptureMutex);
+            if (_gpuCaptureLatencyThreshold <= 0 || seconds <= _gpuCaptureLatencyThreshold) {
+                return;
+            }
+            _gpuCaptureLatencyThreshold = 0;
+            count = _gpuCaptureLatencyCount;
+            const auto now = std::chrono::system_clock::now().time_since_epoch();
+            path = _gpuCaptureLatencyDirectory + "/slow-frame-" + std::to_string((int) (1000 * seconds)) + "ms-" +
+                   std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now).count()) + ".gputrace";
+        }
+        captureCommandBuffers(count, path);
     }
 
-    ~MetalContext() {
-        waitForCompletion();
+    // Use the threadgroup shapes previously tuned for this device
+    void loadThreadgroupSizes(const std::string& path) {
+        _threadgroupTuner.load(path, _device->name()->utf8String());
+    }
+
+    // Benchmark candidate threadgroup shapes for every kernel on its first dispatches, winners are saved to path
+    bool enableAutotune(const std::string& path) {
+        loadThreadgroupSizes(path);
+        _autotuning = createCounterSampleBuffer();
+        return _autotuning;
+    }
+
+    MTL::Size threadGroupSize(const std::string& kernelName, const MTL::ComputePipelineState* pipelineState, const MTL::Size& gridSize) {
+        if (_autotuning) {
+            return _threadgroupTuner.nextCandidate(kernelName, pipelineState, gridSize);
+        }
+        if (auto tuned = _threadgroupTuner.tunedSize(kernelName)) {
+            return *tuned;
+        }
+        return defaultThreadGroupSize(pipelineState, gridSize);
+    }
+
+    // Record the grid and threadgroup shape of the kernel dispatches, see printPipelineStateReport
+    void recordDispatches(bool enable = true) {
+        _recordingDispatches = enable;
+    }
+
+    bool isRecordingDispatches() const {
+        return _recordingDispatches;
+    }
+
+    void recordDispatch(const std::string& kernelName, const MTL::Size& gridSize, const MTL::Size& threadGroupSize) {
+        std::lock_guard<std::mutex> guard(_dispatchShapesMutex);
+        auto& shape = _dispatchShapes[kernelName];
+        shape.count++;
+        shape.gridSize = gridSize;
+        shape.threadGroupSize = threadGroupSize;
+    }
+
+    // Resource usage of the pipelines built for this context's device and library: the threadgroup size limit,
+    // the SIMD width and the static threadgroup memory of each, with the last dispatch shape if recorded.
+    // Pipelines whose threadgroup limit is below the device's have been constrained by their register usage.
+    void printPipelineStateReport(std::ostream& os = std::cout) {
+        const NS::UInteger deviceMaxThreads = _device->maxThreadsPerThreadgroup().width;
+
+        struct Entry {
+            std::string name;
+            NS::UInteger maxThreads;
+            NS::UInteger executionWidth;
+            NS::UInteger threadgroupMemory;
+        };
+        std::vector<Entry> entries;
+        pipelineStateCache.forEach([&](const PipelineStateCache::Key& key, const PipelineStateCache::Value& pipelineState) {
+            const auto& [device, library, name, constants] = key;
+            if (device != _device.get() || library != _computeLibrary.get() || !pipelineState) {
+                return;
+            }
+            entries.push_back({ constants.empty() ? name : name + " [" + constants + "]",
+                                pipelineState->maxTotalThreadsPerThreadgroup(),
+                                pipelineState->threadExecutionWidth(),
+                                pipelineState->staticThreadgroupMemoryLength() });
+        });
+        // Most constrained first
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.maxThreads != b.maxThreads ? a.maxThreads < b.maxThreads : a.name < b.name;
+        });
+
+        std::lock_guard<std::mutex> guard(_dispatchShapesMutex);
+        int constrained = 0;
+        os << "Pipeline state report, device threadgroup limit: " << deviceMaxThreads << std::endl;
+        for (const auto& entry : entries) {
+            const bool registerLimited = entry.maxThreads < deviceMaxThreads;
+            constrained += registerLimited;
+            os << std::setw(44) << std::left << entry.name << std::right
+               << " max threads: " << std::setw(4) << entry.maxThreads
+               << " simd width: " << std::setw(2) << entry.executionWidth
+               << " threadgroup memory: " << std::setw(5) << entry.threadgroupMemory;
+            const auto name = entry.name.substr(0, entry.name.find(' '));
+            const auto shape = _dispatchShapes.find(name);
+            if (shape != _dispatchShapes.end()) {
+                const auto& [count, gridSize, threadGroupSize] = shape->second;
+                const auto threads = threadGroupSize.width * threadGroupSize.height * threadGroupSize.depth;
+                os << " dispatches: " << std::setw(3) << count
+                   << " grid: " << gridSize.width << "x" << gridSize.height << "x" << gridSize.depth
+                   << " threadgroup: " << threadGroupSize.width << "x" << threadGroupSize.height << "x" << threadGroupSize.depth
+                   << " (" << (threads + entry.executionWidth - 1) / entry.executionWidth << " simdgroups)";
+            }
+            if (registerLimited) {
+                os << " <- register limited";
+            }
+            os << std::endl;
+        }
+        os << constrained << " of " << entries.size() << " pipelines below the device threadgroup limit" << std::endl;
+    }
+
+    // Encode a single kernel dispatch bracketed by GPU timestamp samples
+    void enqueueProfiled(const std::string& name, const MTL::Size& gridSize, const MTL::Size& threadGroupSize,
+                         std::function<void(MTL::ComputeCommandEncoder*)> task) {
+        if (cancelled() || _nextSampleIndex + 2 > kMaxProfileSamples) {
+            // Sample buffer full, resolved at the next waitForCompletion(), or nothing to time
+            enqueue(task);
+            return;
+        }
+
+        const auto sampleIndex = _nextSampleIndex;
+        _nextSampleIndex += 2;
+        _pendingProfiles.push_back({ { name, gridSize, threadGroupSize, 0 }, sampleIndex });
+
+        enqueue([&, sampleIndex] (MTL::CommandBuffer* commandBuffer) {
+            MTL::ComputeCommandEncoder* encoder = nullptr;
+            if (_stageBoundarySampling) {
+                auto passDescriptor = MTL::ComputePassDescriptor::computePassDescriptor();
+                auto attachment = passDescriptor->sampleBufferAttachments()->object(0);
+                attachment->setSampleBuffer(_counterSampleBuffer.get());
+                attachment->setStartOfEncoderSampleIndex(sampleIndex);
+                attachment->setEndOfEncoderSampleIndex(sampleIndex + 1);
+                encoder = commandBuffer->computeCommandEncoder(passDescriptor);
+            } else {
+                encoder = commandBuffer->computeCommandEncoder();
+            }
+            if (encoder) {
+                waitForHazards(encoder);
+                if (_tracing) {
+                    encoder->setLabel(NS::String::string(name.c_str(), NS::UTF8StringEncoding));
+                }
+                if (!_stageBoundarySampling) {
+                    encoder->sampleCountersInBuffer(_counterSampleBuffer.get(), sampleIndex, /*barrier=*/ true);
+                }
+                task(encoder);
+                if (!_stageBoundarySampling) {
+                    encoder->sampleCountersInBuffer(_counterSampleBuffer.get(), sampleIndex + 1, /*barrier=*/ true);
+                }
+                signalHazards(encoder);
+                encoder->endEncoding();
+            }
+        });
+    }
+
+    const std::vector<KernelProfile>& kernelProfiles() const {
+        return _kernelProfiles;
+    }
+
+    void clearKernelProfiles() {
+        _kernelProfiles.clear();
+    }
+
+    // Per-kernel-name breakdown of the GPU time collected so far
+    void printKernelProfiles(std::ostream& os = std::cout) const {
+        struct Entry {
+            int count = 0;
+            double gpuTimeMs = 0;
+            MTL::Size gridSize;
+            MTL::Size threadGroupSize;
+        };
+        std::map<std::string, Entry> entries;
+        double totalTimeMs = 0;
+        for (const auto& profile : _kernelProfiles) {
+            auto& entry = entries[profile.name];
+            entry.count++;
+            entry.gpuTimeMs += profile.gpuTimeMs;
+            entry.gridSize = profile.gridSize;
+            entry.threadGroupSize = profile.threadGroupSize;
+            totalTimeMs += profile.gpuTimeMs;
+        }
+
+        std::vector<std::pair<std::string, Entry>> sorted(entries.begin(), entries.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+            return a.second.gpuTimeMs > b.second.gpuTimeMs;
+        });
+
+        os << "Kernel GPU time breakdown, total: " << std::fixed << std::setprecision(3) << totalTimeMs << "ms" << std::endl;
+        for (const auto& [name, entry] : sorted) {
+            os << std::setw(36) << std::left << name << std::right
+               << " calls: " << std::setw(3) << entry.count
+               << " time: " << std::setw(8) << entry.gpuTimeMs << "ms"
+               << " (" << std::setprecision(1) << std::setw(5) << 100 * entry.gpuTimeMs / totalTimeMs << "%)" << std::setprecision(3)
+               << " grid: " << entry.gridSize.width << "x" << entry.gridSize.height << "x" << entry.gridSize.depth
+               << " threadgroup: " << entry.threadGroupSize.width << "x" << entry.threadGroupSize.height << "x" << entry.threadGroupSize.depth
+               << std::endl;
+        }
     }
 
+    // Waits for all submitted work, a pending batch is committed first
     void waitForCompletion() {
+        flushBatch();
+
         while (true) {
             MTL::CommandBuffer* commandBuffer = nullptr;
             {
@@ -60,15 +1524,140 @@ public:
                 commandBuffer->waitUntilCompleted();
             }
         };
+
+        if (!_pendingProfiles.empty()) {
+            resolveProfiles();
+        }
+    }
+
+    // Waits only for the work of a lane, e.g. for a preview frame while a background job is in flight
+    void waitForCompletion(Lane lane) {
+        if (lane == _lane) {
+            flushBatch();
+        }
+        const auto commandQueue = _commandQueues[(int) lane].get();
+
+        while (true) {
+            MTL::CommandBuffer* commandBuffer = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(work_in_progress_mutex);
+
+                // Command buffers complete in commit order within a queue
+                auto last = std::find_if(work_in_progress.rbegin(), work_in_progress.rend(), [commandQueue](MTL::CommandBuffer* cb) {
+                    return cb->commandQueue() == commandQueue;
+                });
+                if (last != work_in_progress.rend()) {
+                    commandBuffer = *last;
+                } else {
+                    break;
+                }
+            }
+            commandBuffer->waitUntilCompleted();
+        };
+
+        if (!_pendingProfiles.empty()) {
+            resolveProfiles();
+        }
+    }
+
+    void resolveProfiles() {
+        // Calibrate GPU timestamps against the CPU clock (nanoseconds)
+        MTL::Timestamp cpuTimestamp = 0, gpuTimestamp = 0;
+        _device->sampleTimestamps(&cpuTimestamp, &gpuTimestamp);
+        const double gpuToNanoseconds = gpuTimestamp > _gpuStartTimestamp
+            ? (double) (cpuTimestamp - _cpuStartTimestamp) / (double) (gpuTimestamp - _gpuStartTimestamp) : 1.0;
+
+        auto data = _counterSampleBuffer->resolveCounterRange(NS::Range::Make(0, _nextSampleIndex));
+        if (data) {
+            const auto timestamps = (const MTL::CounterResultTimestamp*) data->mutableBytes();
+            const auto sampleCount = data->length() / sizeof(MTL::CounterResultTimestamp);
+
+            for (auto& [profile, sampleIndex] : _pendingProfiles) {
+                if (sampleIndex + 1 >= sampleCount) {
+                    continue;
+                }
+                const auto start = timestamps[sampleIndex].timestamp;
+                const auto end = timestamps[sampleIndex + 1].timestamp;
+                if (start == kCounterErrorValue || end == kCounterErrorValue || end < start) {
+                    continue;
+                }
+                profile.gpuTimeMs = (end - start) * gpuToNanoseconds / 1.0e6;
+                if (_autotuning) {
+                    _threadgroupTuner.addSample(profile.name, profile.threadGroupSize, profile.gpuTimeMs);
+                }
+                if (_profiling) {
+                    _kernelProfiles.push_back(profile);
+                }
+            }
+        }
+        _pendingProfiles.clear();
+        _nextSampleIndex = 0;
     }
 
     MTL::Device* device() const {
         return _device.get();
     }
 
-    MTL::ComputePipelineState* newKernelPipelineState(const std::string& kernelName) const {
+    // Total GPU execution time of the command buffers completed so far in seconds, e.g. the difference around a run
+    // with exclusive use of the context. Overlapping command buffers of the two lanes are both counted.
+    double gpuTime() const {
+        return _gpuTime.load() / 1.0e9;
+    }
+
+    // Live and peak device memory of the tracked allocations, with the per-owner breakdown and the optional budget
+    gls::GPUMemoryTracker& memoryTracker() const {
+        return gls::GPUMemoryTracker::shared();
+    }
+
+    // Parameter storage for the work enqueued next, recycled when its command buffer completes
+    BufferSlice allocateParameters(size_t length, size_t alignment = ParameterArena::kAlignment) {
+        return _parameterArena.allocate(length, alignment);
+    }
+
+    template <typename T>
+    BufferSlice parameters(const T& value) {
+        auto slice = allocateParameters(sizeof(T), std::max(alignof(T), ParameterArena::kAlignment));
+        std::memcpy(slice.contents, &value, sizeof(T));
+        return slice;
+    }
+
+    MTL::ComputePipelineState* newKernelPipelineState(const std::string& kernelName,
+                                                      const FunctionConstants& functionConstants = FunctionConstants()) {
         NS::Error* error = nullptr;
-        auto kernel = NS::TransferPtr(_computeLibrary->newFunction(NS::String::string(kernelName.c_str(), NS::UTF8StringEncoding)));
+        const auto functionName = NS::String::string(kernelName.c_str(), NS::UTF8StringEncoding);
+        auto kernel = functionConstants.empty()
+            ? NS::TransferPtr(_computeLibrary->newFunction(functionName))
+            : NS::TransferPtr(_computeLibrary->newFunction(functionName, functionConstants.constantValues().get(), &error));
+        if (!kernel) {
+            throw std::runtime_error("Couldn't find kernel " + kernelName +
+                                     (error ? std::string(" : ") + error->localizedDescription()->utf8String() : ""));
+        }
+
+        if (_binaryArchive) {
+            auto descriptor = NS::TransferPtr(MTL::ComputePipelineDescriptor::alloc()->init());
+            descriptor->setComputeFunction(kernel.get());
+            descriptor->setLabel(NS::String::string(kernelName.c_str(), NS::UTF8StringEncoding));
+            descriptor->setBinaryArchives(NS::Array::array(_binaryArchive.get()));
+
+            // Fast path: pick up the precompiled pipeline from the archive
+            auto pso = _device->newComputePipelineState(descriptor.get(), MTL::PipelineOptionFailOnBinaryArchiveMiss, nullptr, &error);
+            if (!pso) {
+                error = nullptr;
+                pso = _device->newComputePipelineState(descriptor.get(), MTL::PipelineOptionNone, nullptr, &error);
+                if (pso) {
+                    std::lock_guard<std::mutex> guard(_binaryArchiveMutex);
+                    NS::Error* archiveError = nullptr;
+                    if (_binaryArchive->addComputePipelineFunctions(descriptor.get(), &archiveError)) {
+                        _binaryArchiveDirty = true;
+                    }
+                }
+            }
+            if (!pso) {
+                throw std::runtime_error("Couldn't create pipeline state for kernel " + kernelName + " : " + error->localizedDescription()->utf8String());
+            }
+            return pso;
+        }
+
         auto pso = _device->newComputePipelineState(kernel.get(), &error);
         if (!pso) {
             throw std::runtime_error("Couldn't create pipeline state for kernel " + kernelName + " : " + error->localizedDescription()->utf8String());
@@ -76,29 +1665,219 @@ public:
         return pso;
     }
 
-    void enqueue(std::function<void(MTL::CommandBuffer*)> task, std::function<void(MTL::CommandBuffer*)> completionHandler) {
-        auto commandBuffer = _commandQueue->commandBuffer();
+    // Pipeline of kernelName with its [[visible]] function stitchedName linked from a chain of [[stitchable]]
+    // functions: each stage takes the previous stage's result and the chain's parameters, the first one the kernel's
+    // argument. The intermediate results of the chain stay in registers, see pointwiseChainKernel.
+    NS::SharedPtr<MTL::ComputePipelineState> newStitchedPipelineState(const std::string& kernelName,
+                                                                      const std::string& stitchedName,
+                                                                      const std::vector<std::string>& stages) {
+        if (stages.empty()) {
+            throw std::runtime_error("Stitched kernel " + kernelName + " without stages");
+        }
+        auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+        const auto string = [](const std::string& s) { return NS::String::string(s.c_str(), NS::UTF8StringEncoding); };
 
-        // Add commandBuffer from work_in_progress
-        {
-            std::lock_guard<std::mutex> guard(work_in_progress_mutex);
-            work_in_progress.push_back(commandBuffer);
+        std::vector<NS::SharedPtr<MTL::Function>> functions;
+        std::vector<NS::Object*> functionObjects;
+        for (const auto& stage : stages) {
+            auto function = NS::TransferPtr(_computeLibrary->newFunction(string(stage)));
+            if (!function) {
+                throw std::runtime_error("Couldn't find stitchable function " + stage);
+            }
+            functionObjects.push_back(function.get());
+            functions.push_back(std::move(function));
         }
 
-        // Schedule task on commandBuffer
-        task(commandBuffer);
+        // Inputs: 0 the pixel, 1 the parameters
+        auto pixel = NS::TransferPtr(MTL::FunctionStitchingInputNode::alloc()->init(0));
+        auto parameters = NS::TransferPtr(MTL::FunctionStitchingInputNode::alloc()->init(1));
 
-        commandBuffer->addCompletedHandler((MTL::HandlerFunction) [this, completionHandler](MTL::CommandBuffer* commandBuffer) {
-            completionHandler(commandBuffer);
+        std::vector<NS::SharedPtr<MTL::FunctionStitchingFunctionNode>> nodes;
+        std::vector<NS::Object*> nodeObjects;
+        NS::Object* previous = pixel.get();
+        for (const auto& stage : stages) {
+            NS::Object* arguments[] = { previous, parameters.get() };
+            auto node = NS::TransferPtr(MTL::FunctionStitchingFunctionNode::alloc()->init(
+                string(stage), NS::Array::array(arguments, 2), NS::Array::array()));
+            previous = node.get();
+            nodeObjects.push_back(node.get());
+            nodes.push_back(std::move(node));
+        }
+        // The output node is not part of the graph's nodes
+        nodeObjects.pop_back();
 
-            // Remove completed commandBuffer from work_in_progress
-            {
-                std::lock_guard<std::mutex> guard(work_in_progress_mutex);
-                work_in_progress.erase(std::remove(work_in_progress.begin(), work_in_progress.end(), commandBuffer), work_in_progress.end());
+        auto graph = NS::TransferPtr(MTL::FunctionStitchingGraph::alloc()->init(
+            string(stitchedName), NS::Array::array(nodeObjects.data(), nodeObjects.size()), nodes.back().get(),
+            NS::Array::array()));
+
+        auto libraryDescriptor = NS::TransferPtr(MTL::StitchedLibraryDescriptor::alloc()->init());
+        libraryDescriptor->setFunctions(NS::Array::array(functionObjects.data(), functionObjects.size()));
+        libraryDescriptor->setFunctionGraphs(NS::Array::array(graph.get()));
+
+        NS::Error* error = nullptr;
+        auto library = NS::TransferPtr(_device->newLibrary(libraryDescriptor.get(), &error));
+        auto stitched = library ? NS::TransferPtr(library->newFunction(string(stitchedName))) : NS::SharedPtr<MTL::Function>();
+        if (!stitched) {
+            throw std::runtime_error("Couldn't stitch " + stitchedName +
+                                     (error ? std::string(" : ") + error->localizedDescription()->utf8String() : ""));
+        }
+
+        auto kernel = NS::TransferPtr(_computeLibrary->newFunction(string(kernelName)));
+        if (!kernel) {
+            throw std::runtime_error("Couldn't find kernel " + kernelName);
+        }
+        auto linkedFunctions = NS::TransferPtr(MTL::LinkedFunctions::alloc()->init());
+        linkedFunctions->setPrivateFunctions(NS::Array::array(stitched.get()));
+
+        auto descriptor = NS::TransferPtr(MTL::ComputePipelineDescriptor::alloc()->init());
+        descriptor->setComputeFunction(kernel.get());
+        descriptor->setLinkedFunctions(linkedFunctions.get());
+        descriptor->setLabel(string(kernelName));
+
+        auto pso = NS::TransferPtr(_device->newComputePipelineState(descriptor.get(), MTL::PipelineOptionNone, nullptr, &error));
+        if (!pso) {
+            throw std::runtime_error("Couldn't create pipeline state for kernel " + kernelName + " : " +
+                                     error->localizedDescription()->utf8String());
+        }
+        return pso;
+    }
+
+    // simdgroup_matrix needs an Apple7 (A14, M1) or a Mac2 GPU
+    bool supportsSimdgroupMatrix() const {
+        return _device->supportsFamily(MTL::GPUFamilyApple7) || _device->supportsFamily(MTL::GPUFamilyMac2);
+    }
+
+    // Tile shaders and imageblocks need an Apple4 (A11) or later GPU
+    bool supportsTileShaders() const {
+        return _device->supportsFamily(MTL::GPUFamilyApple4);
+    }
+
+    // Pipeline of the tile function tileName, for the passes of enqueueTilePass over a target of pixelFormat: the
+    // threadgroups are the render pass' tiles and the function reads and writes their imageblock
+    NS::SharedPtr<MTL::RenderPipelineState> newTilePipelineState(const std::string& tileName, MTL::PixelFormat pixelFormat) {
+        auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+        const auto name = NS::String::string(tileName.c_str(), NS::UTF8StringEncoding);
+
+        auto function = NS::TransferPtr(_computeLibrary->newFunction(name));
+        if (!function) {
+            throw std::runtime_error("Couldn't find tile function " + tileName);
+        }
+
+        auto descriptor = NS::TransferPtr(MTL::TileRenderPipelineDescriptor::alloc()->init());
+        descriptor->setTileFunction(function.get());
+        descriptor->colorAttachments()->object(0)->setPixelFormat(pixelFormat);
+        descriptor->setRasterSampleCount(1);
+        descriptor->setThreadgroupSizeMatchesTileSize(true);
+        descriptor->setLabel(name);
+
+        NS::Error* error = nullptr;
+        auto pso = NS::TransferPtr(_device->newRenderPipelineState(descriptor.get(), MTL::PipelineOptionNone, nullptr, &error));
+        if (!pso) {
+            throw std::runtime_error("Couldn't create pipeline state for tile function " + tileName + " : " +
+                                     error->localizedDescription()->utf8String());
+        }
+        return pso;
+    }
+
+    // A render pass without draws over target for the task's tile dispatches: the target is loaded into tile memory
+    // with loadTarget, otherwise the first dispatch fills the imageblocks, and it is stored once when the pass ends
+    void enqueueTilePass(MTL::Texture* target, bool loadTarget, std::function<void(MTL::RenderCommandEncoder*)> task) {
+        enqueue([&] (MTL::CommandBuffer* commandBuffer) {
+            auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+
+            auto pass = MTL::RenderPassDescriptor::renderPassDescriptor();
+            auto attachment = pass->colorAttachments()->object(0);
+            attachment->setTexture(target);
+            attachment->setLoadAction(loadTarget ? MTL::LoadActionLoad : MTL::LoadActionDontCare);
+            attachment->setStoreAction(MTL::StoreActionStore);
+
+            auto encoder = commandBuffer->renderCommandEncoder(pass);
+            if (encoder) {
+                waitForHazards(encoder);
+                task(encoder);
+                signalHazards(encoder);
+                encoder->endEncoding();
             }
         });
+    }
 
-        commandBuffer->commit();
+    // Indices of the textures a kernel writes, from the pipeline reflection
+    std::vector<NS::UInteger> kernelWrittenTextures(const std::string& kernelName,
+                                                    const FunctionConstants& functionConstants = FunctionConstants()) {
+        auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+        NS::Error* error = nullptr;
+        const auto functionName = NS::String::string(kernelName.c_str(), NS::UTF8StringEncoding);
+        auto kernel = functionConstants.empty()
+            ? NS::TransferPtr(_computeLibrary->newFunction(functionName))
+            : NS::TransferPtr(_computeLibrary->newFunction(functionName, functionConstants.constantValues().get(), &error));
+
+        std::vector<NS::UInteger> writtenTextures;
+        MTL::AutoreleasedComputePipelineReflection reflection = nullptr;
+        auto pso = kernel ? NS::TransferPtr(_device->newComputePipelineState(kernel.get(), MTL::PipelineOptionArgumentInfo,
+                                                                             &reflection, &error))
+                          : NS::SharedPtr<MTL::ComputePipelineState>();
+        if (pso && reflection) {
+            const auto arguments = reflection->arguments();
+            for (NS::UInteger i = 0; i < arguments->count(); i++) {
+                const auto argument = arguments->object<MTL::Argument>(i);
+                if (argument->type() == MTL::ArgumentTypeTexture && argument->access() != MTL::ArgumentAccessReadOnly) {
+                    writtenTextures.push_back(argument->index());
+                }
+            }
+        }
+        return writtenTextures;
+    }
+
+    // Record a texture written by the work enqueued next
+    void trackWrite(MTL::Texture* texture) {
+        GPUWriteTracker::instance().begin(texture);
+        _trackedWrites.push_back(NS::RetainPtr(texture));
+    }
+
+    // Shared pipeline state lookup, pipelines are created on first use
+    NS::SharedPtr<MTL::ComputePipelineState> kernelPipelineState(const std::string& kernelName,
+                                                                 const FunctionConstants& functionConstants = FunctionConstants()) {
+        const PipelineStateCache::Key key = { _device.get(), _computeLibrary.get(), kernelName, functionConstants.key() };
+        return pipelineStateCache.get(key, [&]() {
+            return newKernelPipelineState(kernelName, functionConstants);
+        });
+    }
+
+    // The work of a cancelled job isn't encoded, its completion handler still runs in order with the rest of the work
+    bool skipCancelled(const std::function<void(MTL::CommandBuffer*)>& completionHandler) {
+        if (!cancelled()) {
+            return false;
+        }
+        if (_batchDepth > 0) {
+            _batchCompletionHandlers.push_back(completionHandler);
+        } else {
+            commit(newCommandBuffer(), completionHandler);
+        }
+        return true;
+    }
+
+    void enqueue(std::function<void(MTL::CommandBuffer*)> task, std::function<void(MTL::CommandBuffer*)> completionHandler) {
+        if (skipCancelled(completionHandler)) {
+            return;
+        }
+        if (_batchDepth > 0) {
+            auto commandBuffer = batchCommandBuffer();
+
+            // The task creates its own encoders, close the shared one
+            endBatchEncoder();
+
+            task(commandBuffer);
+
+            _batchCompletionHandlers.push_back(completionHandler);
+            return;
+        }
+
+        auto commandBuffer = newCommandBuffer();
+
+        // Schedule task on commandBuffer
+        task(commandBuffer);
+
+        commit(commandBuffer, completionHandler);
     }
 
     void enqueue(std::function<void(MTL::CommandBuffer*)> task) {
@@ -106,11 +1885,25 @@ public:
     }
 
     void enqueue(std::function<void(MTL::ComputeCommandEncoder*)> task, std::function<void(MTL::CommandBuffer*)> completionHandler) {
+        if (skipCancelled(completionHandler)) {
+            return;
+        }
+        if (_batchDepth > 0) {
+            auto encoder = batchEncoder();
+            if (encoder) {
+                task(encoder);
+            }
+            _batchCompletionHandlers.push_back(completionHandler);
+            return;
+        }
+
         enqueue([&] (MTL::CommandBuffer *commandBuffer) {
             auto encoder = commandBuffer->computeCommandEncoder();
             if (encoder) {
+                waitForHazards(encoder);
                 task(encoder);
 
+                signalHazards(encoder);
                 encoder->endEncoding();
             }
         }, completionHandler);
@@ -124,6 +1917,8 @@ public:
 template <typename T>
 class BufferParameters {
     NS::SharedPtr<MTL::Buffer> _buffer;
+    NS::UInteger _offset = 0;
+    gls::GPUMemoryTracker::Allocation _allocation;
 
 public:
     BufferParameters() = default;
@@ -131,27 +1926,95 @@ public:
     BufferParameters(const BufferParameters &) = default;
 
     BufferParameters(MTL::Device* device, const T& value) :
-        _buffer(NS::TransferPtr(device->newBuffer(sizeof(T), MTL::ResourceStorageModeShared)))
+        _buffer(NS::TransferPtr(device->newBuffer(sizeof(T), MTL::ResourceStorageModeShared))),
+        _allocation(gls::GPUMemoryTracker::shared().track(_buffer->allocatedSize()))
     {
         T* contents = (T*) _buffer->contents();
         *contents = value;
     }
 
+    // Per-frame parameters sub-allocated from the context's parameter arena
+    BufferParameters(MetalContext* context, const T& value) {
+        const auto slice = context->parameters(value);
+        _buffer = NS::RetainPtr(slice.buffer);
+        _offset = slice.offset;
+    }
+
     const MTL::Buffer* buffer() const {
         return _buffer.get();
     }
 
+    NS::UInteger offset() const {
+        return _offset;
+    }
+
+    BufferSlice slice() const {
+        return { _buffer.get(), _offset, (uint8_t*) _buffer->contents() + _offset };
+    }
+
     T* data() {
-        return (T*) _buffer->contents();
+        return (T*) ((uint8_t*) _buffer->contents() + _offset);
     }
 };
 
-extern std::unique_ptr<std::map<const std::string,
-                                NS::SharedPtr<MTL::ComputePipelineState>>> kernelStateMap;
+// Consecutive scalar arguments of a kernel bound with a single setBytes instead of one call and one binding each, e.g.
+// Kernel<MTL::Texture*, PackedArguments<simd::float3, float, float>, MTL::Texture*>, called with the values in braces.
+// The layout is computed at compile time to be the one of a struct with members of the same types in the same order,
+// the kernel declares that struct for its buffer: the types must have the same size and alignment on both sides,
+// as the simd and the half types do.
+template <typename... Ts>
+class PackedArguments {
+    static_assert(sizeof...(Ts) > 0);
+    static_assert((std::is_trivially_copyable_v<Ts> && ...), "PackedArguments: the arguments are copied as bytes");
+
+    static constexpr size_t kCount = sizeof...(Ts);
+    static constexpr std::array<size_t, kCount> kSizes = { sizeof(Ts)... };
+    static constexpr std::array<size_t, kCount> kAlignments = { alignof(Ts)... };
+    static constexpr size_t kAlignment = std::max({ alignof(Ts)... });
+
+    static constexpr std::array<size_t, kCount> memberOffsets() {
+        std::array<size_t, kCount> offsets = {};
+        size_t offset = 0;
+        for (size_t i = 0; i < kCount; i++) {
+            offset = (offset + kAlignments[i] - 1) / kAlignments[i] * kAlignments[i];
+            offsets[i] = offset;
+            offset += kSizes[i];
+        }
+        return offsets;
+    }
+
+public:
+    // Offsets of the members and size of the struct, with its tail padding
+    static constexpr std::array<size_t, kCount> kOffsets = memberOffsets();
+    static constexpr size_t kSize = (kOffsets[kCount - 1] + kSizes[kCount - 1] + kAlignment - 1) / kAlignment * kAlignment;
+
+private:
+    // Zeroed padding, the bytes of two equal argument lists compare equal
+    alignas(kAlignment) std::array<uint8_t, kSize> _data = {};
+
+public:
+    PackedArguments(const Ts&... ts) {
+        size_t index = 0;
+        ((memcpy(_data.data() + kOffsets[index++], &ts, sizeof(Ts))), ...);
+    }
+};
 
 template <typename... Ts>
 class Kernel {
     NS::SharedPtr<MTL::ComputePipelineState> _pipelineState;
+    std::string _name;
+#if GLS_TRACK_GPU_WRITES
+    std::vector<NS::UInteger> _writtenTextures;
+
+    template <typename T>
+    void trackWrite(MetalContext* metalContext, const T& parameter, unsigned index) const { }
+
+    void trackWrite(MetalContext* metalContext, MTL::Texture* texture, unsigned index) const {
+        if (texture && std::find(_writtenTextures.begin(), _writtenTextures.end(), index) != _writtenTextures.end()) {
+            metalContext->trackWrite(texture);
+        }
+    }
+#endif
 
     template <int index, typename T0, typename... T1s>
     void setArgs(MTL::ComputeCommandEncoder* encoder, T0&& t0, T1s&&... t1s) const {
@@ -165,18 +2028,22 @@ class Kernel {
     }
 
 public:
-    Kernel(MetalContext* context, const std::string& name) {
-        if (kernelStateMap == nullptr) {
-            kernelStateMap = std::make_unique<std::map<const std::string,
-                                                       NS::SharedPtr<MTL::ComputePipelineState>>>();
-        }
+    Kernel(MetalContext* context, const std::string& name) : _name(name) {
+        _pipelineState = context->kernelPipelineState(name);
+#if GLS_TRACK_GPU_WRITES
+        _writtenTextures = context->kernelWrittenTextures(name);
+#endif
+    }
 
-        _pipelineState = (*kernelStateMap)[name];
+    // A pipeline built by the caller, e.g. MetalContext::newStitchedPipelineState. Its writes are not tracked.
+    Kernel(NS::SharedPtr<MTL::ComputePipelineState> pipelineState, const std::string& name) :
+        _pipelineState(std::move(pipelineState)), _name(name) { }
 
-        if (!_pipelineState) {
-            _pipelineState = NS::TransferPtr(context->newKernelPipelineState(name));
-            (*kernelStateMap)[name] = _pipelineState;
-        }
+    Kernel(MetalContext* context, const std::string& name, const FunctionConstants& functionConstants) : _name(name) {
+        _pipelineState = context->kernelPipelineState(name, functionConstants);
+#if GLS_TRACK_GPU_WRITES
+        _writtenTextures = context->kernelWrittenTextures(name, functionConstants);
+#endif
     }
 
     ~Kernel() { }
@@ -185,11 +2052,21 @@ public:
         return _pipelineState.get();
     }
 
+    const std::string& name() const {
+        return _name;
+    }
+
     template <typename parameter_type>
     void setParameter(MTL::ComputeCommandEncoder* encoder, const parameter_type& parameter, unsigned index) const {
         encoder->setBytes(&parameter, sizeof(parameter_type), index);
     }
 
+    template <typename... Ps>
+    void setParameter(MTL::ComputeCommandEncoder* encoder, const PackedArguments<Ps...>& arguments, unsigned index) const {
+        static_assert(sizeof(arguments) == PackedArguments<Ps...>::kSize);
+        encoder->setBytes(&arguments, PackedArguments<Ps...>::kSize, index);
+    }
+
     template <>
     void setParameter<MTL::Buffer*>(MTL::ComputeCommandEncoder* encoder, MTL::Buffer* const & buffer, unsigned index) const {
         encoder->setBuffer(buffer, /*offset=*/ 0, index);
@@ -200,9 +2077,21 @@ public:
         encoder->setTexture(texture, index);
     }
 
+    template <>
+    void setParameter<BufferSlice>(MTL::ComputeCommandEncoder* encoder, const BufferSlice& slice, unsigned index) const {
+        encoder->setBuffer(slice.buffer, slice.offset, index);
+    }
+
+    template <>
+    void setParameter<ArgumentBinding>(MTL::ComputeCommandEncoder* encoder, const ArgumentBinding& binding, unsigned index) const {
+        encoder->setBuffer(binding.buffer, binding.offset, index);
+        for (auto resource : binding.resources) {
+            encoder->useResource(resource, MTL::ResourceUsageRead);
+        }
+    }
+
     void dispatchThreads(const MTL::Size& gridSize, MTL::ComputeCommandEncoder* encoder) const {
-        auto threadGroupSize = _pipelineState->maxTotalThreadsPerThreadgroup();
-        encoder->dispatchThreads(/*threadsPerGrid=*/ gridSize, /*threadsPerThreadgroup*/ MTL::Size(threadGroupSize, 1, 1));
+        encoder->dispatchThreads(/*threadsPerGrid=*/ gridSize, /*threadsPerThreadgroup*/ defaultThreadGroupSize(_pipelineState.get(), gridSize));
     }
 
     void operator()(MTL::ComputeCommandEncoder* encoder, const MTL::Size& gridSize, Ts... ts) const {
@@ -221,9 +2110,8 @@ public:
     }
 
     void operator()(MetalContext* metalContext, const MTL::Size& gridSize, Ts... ts) const {
-        metalContext->enqueue([&, this](MTL::CommandBuffer* commandBuffer){
-            operator()(commandBuffer, gridSize, std::forward<Ts>(ts)...);
-        });
+        const auto threadGroupSize = metalContext->threadGroupSize(_name, _pipelineState.get(), gridSize);
+        operator()(metalContext, gridSize, threadGroupSize, std::forward<Ts>(ts)...);
     }
 
     void dispatchThreads(const MTL::Size& gridSize, const MTL::Size& threadGroupSize, MTL::ComputeCommandEncoder* encoder) const {
@@ -246,10 +2134,99 @@ public:
     }
 
     void operator()(MetalContext* metalContext, const MTL::Size& gridSize, const MTL::Size& threadGroupSize, Ts... ts) const {
-        metalContext->enqueue([&, this](MTL::CommandBuffer* commandBuffer){
-            operator()(commandBuffer, gridSize, threadGroupSize, std::forward<Ts>(ts)...);
+#if GLS_TRACK_GPU_WRITES
+        unsigned index = 0;
+        (trackWrite(metalContext, ts, index++), ...);
+#endif
+        if (metalContext->isRecordingDispatches()) {
+            metalContext->recordDispatch(_name, gridSize, threadGroupSize);
+        }
+        if (metalContext->timestampSampling()) {
+            metalContext->enqueueProfiled(_name, gridSize, threadGroupSize, [&, this](MTL::ComputeCommandEncoder* encoder){
+                operator()(encoder, gridSize, threadGroupSize, std::forward<Ts>(ts)...);
+            });
+            return;
+        }
+        if (metalContext->isTracing()) {
+            metalContext->enqueue([&, this](MTL::ComputeCommandEncoder* encoder){
+                encoder->pushDebugGroup(NS::String::string(_name.c_str(), NS::UTF8StringEncoding));
+                operator()(encoder, gridSize, threadGroupSize, std::forward<Ts>(ts)...);
+                encoder->popDebugGroup();
+            });
+            return;
+        }
+        metalContext->enqueue([&, this](MTL::ComputeCommandEncoder* encoder){
+            operator()(encoder, gridSize, threadGroupSize, std::forward<Ts>(ts)...);
+        });
+    }
+};
+
+// Kernel specializations, built on first use for each combination of function constant values
+template <typename... Ts>
+class SpecializedKernel {
+    MetalContext* _context;
+    const std::string _name;
+    mutable std::mutex _mutex;
+    mutable std::map<std::string, std::unique_ptr<Kernel<Ts...>>> _variants;
+
+public:
+    SpecializedKernel(MetalContext* context, const std::string& name) : _context(context), _name(name) { }
+
+    const Kernel<Ts...>& operator[](const FunctionConstants& functionConstants) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto& variant = _variants[functionConstants.key()];
+        if (!variant) {
+            variant = std::make_unique<Kernel<Ts...>>(_context, _name, functionConstants);
+        }
+        return *variant;
+    }
+};
+
+// A kernel struct built on first use, for the stages of the less common configurations: they cost no startup time and
+// hold no pipeline states until needed. Calls go through to the kernel, prefetch() builds it on a background thread
+// ahead of its first use. The constructor arguments following the context are kept for the build.
+template <typename K, typename... Args>
+class LazyKernel {
+    MetalContext* _context;
+    const std::tuple<Args...> _args;
+    mutable std::once_flag _built;
+    mutable std::unique_ptr<K> _kernel;
+    mutable std::future<void> _prefetch;
+
+public:
+    LazyKernel(MetalContext* context, Args... args) : _context(context), _args(std::move(args)...) { }
+
+    ~LazyKernel() {
+        if (_prefetch.valid()) {
+            _prefetch.wait();
+        }
+    }
+
+    // A failed build throws here, and is retried by the next use
+    K& get() const {
+        std::call_once(_built, [this]() {
+            _kernel = std::apply([this](const Args&... args) { return std::make_unique<K>(_context, args...); }, _args);
+        });
+        return *_kernel;
+    }
+
+    void prefetch() const {
+        if (_prefetch.valid()) {
+            return;
+        }
+        _prefetch = std::async(std::launch::async, [this]() {
+            gls::setThreadQoS(gls::QoS::utility);
+
+            // metal-cpp objects created on this thread need their own autorelease pool
+            auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+            get();
         });
     }
+
+    template <typename... Ts>
+    decltype(auto) operator()(Ts&&... ts) const {
+        return get()(std::forward<Ts>(ts)...);
+    }
 };
 
 #endif /* gls_mtl_hpp */
@@ -0,0 +1,386 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_mtl_graph_hpp
+#define gls_mtl_graph_hpp
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gls_mtl.hpp"
+#include "gls_mtl_image.hpp"
+
+// Declarative description of a GPU pipeline: stages declare the textures they read and write,
+// the graph derives from that the live stages, the lifetimes and placement of the transient
+// textures, the grouping of independent stages in concurrent dispatch scopes, and records the
+// whole execution in a single command buffer.
+//
+// Textures are either imported, owned by the client and bound to the graph (possibly rebound for
+// every execution), or transient, allocated by the graph on a placement heap where textures with
+// disjoint lifetimes share memory.
+//
+// The execution is re-encoded every time, it is not replayed from an MTL::IndirectCommandBuffer:
+// indirect compute commands only bind buffers, while the pipeline's kernels take their images as
+// [[texture(n)]] arguments, and the stages compute their uniforms (noise model, exposure, levels)
+// per frame on the CPU anyway. Replay would need the kernels to read their textures from argument
+// buffers, see Kernel.
+class StageGraph {
+public:
+    struct Resource {
+        int id = -1;
+
+        bool valid() const {
+            return id >= 0;
+        }
+    };
+
+    template <typename T>
+    struct Texture : public Resource { };
+
+    struct StageOptions {
+        // The stage can be encoded concurrently with neighbouring independent stages, i.e. all of its
+        // dispatches are independent of each other or the stage places its own barriers
+        bool concurrent = false;
+        // The stage has effects beyond the textures it writes (CPU readbacks, statistics buffers)
+        // and it is never pruned
+        bool sideEffects = false;
+    };
+
+private:
+    struct ResourceEntry {
+        const std::string name;
+        const bool transient;
+        bool output = false;
+        int firstStage = -1;
+        int lastStage = -1;
+
+        ResourceEntry(const std::string& _name, bool _transient) : name(_name), transient(_transient) { }
+        virtual ~ResourceEntry() { }
+
+        virtual const void* image() const = 0;
+        virtual void allocate(gls::transient_heap* heap) = 0;
+    };
+
+    template <typename T>
+    struct TextureEntry : public ResourceEntry {
+        const gls::size size;
+        const gls::texture_precision precision;
+        typename gls::mtl_image_2d<T>::unique_ptr owned;
+        gls::mtl_image_2d<T>* bound;
+
+        TextureEntry(const std::string& name, gls::mtl_image_2d<T>* image) :
+            ResourceEntry(name, /*transient=*/ false), size({0, 0}), precision(gls::texture_precision::native), bound(image) { }
+
+        TextureEntry(const std::string& name, const gls::size& _size, gls::texture_precision _precision) :
+            ResourceEntry(name, /*transient=*/ true), size(_size), precision(_precision), bound(nullptr) { }
+
+        const void* image() const override {
+            return transient ? owned.get() : bound;
+        }
+
+        void allocate(gls::transient_heap* heap) override {
+            heap->add(&owned, size, firstStage, lastStage, precision);
+        }
+    };
+
+    struct Stage {
+        std::string name;
+        std::vector<int> reads;
+        std::vector<int> writes;
+        std::function<void(MetalContext*, const StageGraph&)> encode;
+        bool enabled;
+        StageOptions options;
+        bool live = false;
+    };
+
+    std::vector<std::unique_ptr<ResourceEntry>> _resources;
+    std::vector<Stage> _stages;
+    // Live stages, grouped in runs of stages that can be encoded concurrently
+    std::vector<std::vector<int>> _waves;
+    size_t _transientBytes = 0;
+    bool _untrackedHazards = false;
+    bool _compiled = false;
+
+    template <typename T>
+    TextureEntry<T>* entry(const Texture<T>& texture) const {
+        assert(texture.valid() && texture.id < _resources.size());
+        return static_cast<TextureEntry<T>*>(_resources[texture.id].get());
+    }
+
+    static bool intersects(const std::vector<int>& a, const std::vector<int>& b) {
+        for (int r : a) {
+            if (std::find(b.begin(), b.end(), r) != b.end()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool dependent(const Stage& a, const Stage& b) {
+        return intersects(a.writes, b.reads) || intersects(a.writes, b.writes) || intersects(a.reads, b.writes);
+    }
+
+public:
+    StageGraph() = default;
+
+    StageGraph(const StageGraph&) = delete;
+    StageGraph& operator=(const StageGraph&) = delete;
+
+    // Client owned texture, image can be null and bound later
+    template <typename T>
+    Texture<T> importTexture(const std::string& name, gls::mtl_image_2d<T>* image = nullptr) {
+        _resources.push_back(std::make_unique<TextureEntry<T>>(name, image));
+        Texture<T> texture;
+        texture.id = (int) _resources.size() - 1;
+        return texture;
+    }
+
+    // Graph owned texture, only allocated if a live stage uses it
+    template <typename T>
+    Texture<T> transientTexture(const std::string& name, const gls::size& size,
+                                gls::texture_precision precision = gls::texture_precision::native) {
+        assert(!_compiled);
+        _resources.push_back(std::make_unique<TextureEntry<T>>(name, size, precision));
+        Texture<T> texture;
+        texture.id = (int) _resources.size() - 1;
+        return texture;
+    }
+
+    // Rebind an imported texture, e.g. the input and output images of the current execution
+    template <typename T>
+    void bind(const Texture<T>& texture, gls::mtl_image_2d<T>* image) {
+        auto e = entry(texture);
+        if (e->transient) {
+            throw std::runtime_error("StageGraph: can't bind transient texture " + e->name);
+        }
+        e->bound = image;
+    }
+
+    // The image backing a texture, the stages' encode functions receive the graph to resolve their textures
+    template <typename T>
+    gls::mtl_image_2d<T>* operator[](const Texture<T>& texture) const {
+        auto e = entry(texture);
+        auto image = e->transient ? e->owned.get() : e->bound;
+        if (!image) {
+            throw std::runtime_error("StageGraph: texture " + e->name + (e->transient ? " is not allocated" : " is not bound"));
+        }
+        return image;
+    }
+
+    // The results of the graph, the stages producing them and their dependencies are live
+    void markOutput(const Resource& resource) {
+        assert(resource.valid() && resource.id < _resources.size());
+        _resources[resource.id]->output = true;
+    }
+
+    void addStage(const std::string& name, std::initializer_list<Resource> reads, std::initializer_list<Resource> writes,
+                  std::function<void(MetalContext*, const StageGraph&)> encode, bool enabled = true, StageOptions options = {}) {
+        assert(!_compiled);
+        Stage stage = { name, {}, {}, encode, enabled, options };
+        for (const auto& r : reads) {
+            assert(r.valid() && r.id < _resources.size());
+            stage.reads.push_back(r.id);
+        }
+        for (const auto& r : writes) {
+            assert(r.valid() && r.id < _resources.size());
+            stage.writes.push_back(r.id);
+        }
+        _stages.push_back(stage);
+    }
+
+    // Prunes the disabled and unused stages, validates the data flow and allocates the transient textures.
+    // With untrackedHazards the transient textures are not hazard tracked by the driver, the stage order is known:
+    // execute() chains the encoders with fences, see MetalContext::beginExplicitHazards, and the textures sharing
+    // memory have lifetimes in disjoint waves, the stages of a concurrent wave run unordered.
+    void compile(MTL::Device* device, bool untrackedHazards = false) {
+        assert(!_compiled);
+        _untrackedHazards = untrackedHazards;
+
+        // Backwards liveness: a stage is live if it has side effects or if it writes a texture
+        // which is a graph output or is read by a later live stage
+        std::vector<bool> needed(_resources.size(), false);
+        for (int i = 0; i < _resources.size(); i++) {
+            needed[i] = _resources[i]->output;
+        }
+        for (int s = (int) _stages.size() - 1; s >= 0; s--) {
+            auto& stage = _stages[s];
+            if (!stage.enabled) {
+                continue;
+            }
+            stage.live = stage.options.sideEffects ||
+                         std::any_of(stage.writes.begin(), stage.writes.end(), [&](int r) { return needed[r]; });
+            if (stage.live) {
+                for (int r : stage.reads) {
+                    needed[r] = true;
+                }
+            }
+        }
+
+        // Group consecutive independent concurrent stages, dependent stages start a new wave
+        _waves.clear();
+        for (int s = 0; s < _stages.size(); s++) {
+            const auto& stage = _stages[s];
+            if (!stage.live) {
+                continue;
+            }
+            bool join = !_waves.empty() && stage.options.concurrent;
+            if (join) {
+                for (int w : _waves.back()) {
+                    if (!_stages[w].options.concurrent || dependent(_stages[w], stage)) {
+                        join = false;
+                        break;
+                    }
+                }
+            }
+            if (join) {
+                _waves.back().push_back(s);
+            } else {
+                _waves.push_back({ s });
+            }
+        }
+
+        std::vector<int> stageWave(_stages.size(), -1);
+        for (int w = 0; w < _waves.size(); w++) {
+            for (int s : _waves[w]) {
+                stageWave[s] = w;
+            }
+        }
+
+        // Transient textures must be written before they are read, lifetimes are in live stage indices,
+        // in wave indices for untracked textures
+        std::vector<bool> written(_resources.size(), false);
+        int liveIndex = 0;
+        for (int s = 0; s < _stages.size(); s++) {
+            const auto& stage = _stages[s];
+            if (!stage.live) {
+                continue;
+            }
+            const int lifetimeIndex = untrackedHazards ? stageWave[s] : liveIndex;
+            for (int r : stage.reads) {
+                auto& resource = _resources[r];
+                if (resource->transient && !written[r]) {
+                    throw std::runtime_error("StageGraph: stage " + stage.name + " reads " + resource->name + " before it is written");
+                }
+            }
+            for (int r : stage.writes) {
+                written[r] = true;
+            }
+            for (const auto& list : { stage.reads, stage.writes }) {
+                for (int r : list) {
+                    auto& resource = _resources[r];
+                    if (resource->firstStage < 0) {
+                        resource->firstStage = lifetimeIndex;
+                    }
+                    resource->lastStage = lifetimeIndex;
+                }
+            }
+            liveIndex++;
+        }
+
+        gls::transient_heap heap(device, MTL::StorageModePrivate, untrackedHazards);
+        for (auto& resource : _resources) {
+            if (resource->transient && resource->firstStage >= 0) {
+                resource->allocate(&heap);
+            }
+        }
+        _transientBytes = heap.allocate();
+
+        _compiled = true;
+    }
+
+    bool compiled() const {
+        return _compiled;
+    }
+
+    // Bytes used by the transient textures' heap, zero for standalone allocations
+    size_t transientBytes() const {
+        return _transientBytes;
+    }
+
+    // Record all the live stages in a single command buffer, the caller submits the work
+    void execute(MetalContext* context) const {
+        if (!_compiled) {
+            throw std::runtime_error("StageGraph: execute() before compile()");
+        }
+        for (const auto& resource : _resources) {
+            if (!resource->transient && resource->firstStage >= 0 && !resource->image()) {
+                throw std::runtime_error("StageGraph: texture " + resource->name + " is not bound");
+            }
+        }
+
+        MetalContext::BatchScope batch(context);
+        std::optional<MetalContext::ExplicitHazardsScope> explicitHazards;
+        if (_untrackedHazards) {
+            explicitHazards.emplace(context);
+        }
+
+        // Metal orders the dispatches of a serial encoder, a concurrent scope is only needed for
+        // waves of several independent stages
+        for (const auto& wave : _waves) {
+            // A cancelled job skips the remaining stages, CPU work included
+            if (context->cancelled()) {
+                break;
+            }
+            if (wave.size() > 1) {
+                // The stages of a concurrent wave share a debug group
+                std::string waveName;
+                for (int s : wave) {
+                    waveName += waveName.empty() ? _stages[s].name : "+" + _stages[s].name;
+                }
+                MetalContext::TraceScope trace(context, waveName);
+                MetalContext::ConcurrentScope concurrent(context);
+                for (int s : wave) {
+                    gls::TraceInterval interval(_stages[s].name);
+                    _stages[s].encode(context, *this);
+                }
+            } else {
+                MetalContext::TraceScope trace(context, _stages[wave[0]].name);
+                _stages[wave[0]].encode(context, *this);
+            }
+        }
+    }
+
+    // Human readable description of the compiled graph
+    void print(std::ostream& os) const {
+        int waveIndex = 0;
+        for (const auto& wave : _waves) {
+            for (int s : wave) {
+                const auto& stage = _stages[s];
+                os << "[" << waveIndex << "] " << stage.name << ":";
+                for (int r : stage.reads) {
+                    os << " " << _resources[r]->name;
+                }
+                os << " ->";
+                for (int r : stage.writes) {
+                    os << " " << _resources[r]->name;
+                }
+                os << std::endl;
+            }
+            waveIndex++;
+        }
+        for (const auto& resource : _resources) {
+            if (resource->transient && resource->firstStage >= 0) {
+                os << "transient " << resource->name << ": stages " << resource->firstStage << "-" << resource->lastStage << std::endl;
+            }
+        }
+    }
+};
+
+#endif /* gls_mtl_graph_hpp */
@@ -16,12 +16,28 @@
 #ifndef gls_mtl_image_h
 #define gls_mtl_image_h
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <functional>
 #include <map>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <Metal/Metal.hpp>
+#include <CoreVideo/CoreVideo.h>
 
 #include "gls_image.hpp"
+#include "gls_mtl.hpp"
+#include "TaskScheduler.hpp"
 
 namespace gls {
 
@@ -113,11 +129,111 @@ DECLARE_TYPE_FORMATS(int8_t, MTL::PixelFormatR8Snorm)
 DECLARE_TYPE_FORMATS(int16_t, MTL::PixelFormatR16Snorm)
 DECLARE_TYPE_FORMATS(int32_t, MTL::PixelFormatRG32Sint)
 
+// Runs process(y0, y1) on bands of rows [y0, y1) of an image of the given height on all the CPU cores
+template <typename F>
+void parallel_bands(int height, F process, int bandHeight = 64) {
+    parallel_for(0, height, bandHeight, process);
+}
+
+// Page aligned host memory, rounded up to whole pages, that Metal can use in place with newBufferWithBytesNoCopy:
+// on unified memory what the CPU writes in it, e.g. a decoded raw image or a CPU stage's output, becomes a GPU
+// resource without a copy. The Metal resources wrapping the allocation keep a reference to it.
+template <typename T>
+class host_allocation {
+    T* _data = nullptr;
+    const size_t _size;
+    const size_t _bytes;
+
+public:
+    typedef std::shared_ptr<host_allocation<T>> shared_ptr;
+
+    static size_t pageSize() {
+        static const size_t size = (size_t) ::getpagesize();
+        return size;
+    }
+
+    static size_t roundToPages(size_t bytes) {
+        return pageSize() * ((bytes + pageSize() - 1) / pageSize());
+    }
+
+    // The requirements of newBufferWithBytesNoCopy
+    static bool canWrap(const void* pointer, size_t bytes) {
+        return (uintptr_t) pointer % pageSize() == 0 && bytes > 0 && bytes % pageSize() == 0;
+    }
+
+    host_allocation(size_t size) : _size(size), _bytes(roundToPages(std::max(sizeof(T) * size, (size_t) 1))) {
+        void* data = nullptr;
+        if (::posix_memalign(&data, pageSize(), _bytes) != 0) {
+            throw std::runtime_error("host_allocation: couldn't allocate " + std::to_string(_bytes) + " bytes");
+        }
+        _data = (T*) data;
+    }
+
+    ~host_allocation() {
+        ::free(_data);
+    }
+
+    host_allocation(const host_allocation&) = delete;
+    host_allocation& operator=(const host_allocation&) = delete;
+
+    static shared_ptr make(size_t size) {
+        return std::make_shared<host_allocation<T>>(size);
+    }
+
+    T* data() const {
+        return _data;
+    }
+
+    size_t size() const {
+        return _size;
+    }
+
+    // Including the padding to the page boundary
+    size_t bytes() const {
+        return _bytes;
+    }
+
+    std::span<T> span() const {
+        return { _data, _size };
+    }
+
+    // Image view of the allocation, valid as long as the allocation is
+    typename gls::image<T>::unique_ptr image(int width, int height, int stride) const {
+        if ((size_t) stride * height > _size) {
+            throw std::runtime_error("host_allocation: " + std::to_string(width) + "x" + std::to_string(height) +
+                                     " image larger than the allocation");
+        }
+        return std::make_unique<gls::image<T>>(width, height, stride, std::span<T>(_data, (size_t) stride * height));
+    }
+
+    // A shared no-copy Metal buffer over memory that outlives it, throws if the memory is not page aligned
+    static NS::SharedPtr<MTL::Buffer> wrap(MTL::Device* device, const void* pointer, size_t bytes) {
+        if (!canWrap(pointer, bytes)) {
+            throw std::runtime_error("host_allocation: no-copy buffers need page aligned memory, " +
+                                     std::to_string(bytes) + " bytes");
+        }
+        auto buffer = NS::TransferPtr(device->newBuffer(pointer, bytes, MTL::ResourceStorageModeShared,
+                                                        /*deallocator=*/ nullptr));
+        if (!buffer) {
+            throw std::runtime_error("host_allocation: couldn't wrap " + std::to_string(bytes) + " bytes");
+        }
+        return buffer;
+    }
+};
+
 template <typename T>
 class mtl_image_2d : public mtl_image<T> {
 protected:
+    NS::SharedPtr<MTL::Heap> _heap;
     NS::SharedPtr<MTL::Buffer> _buffer;
     NS::SharedPtr<MTL::Texture> _texture;
+    // Heap placed images share the heap's allocation
+    GPUMemoryTracker::Allocation _allocation;
+    // False for storage the image doesn't own, e.g. host memory or a pixel buffer, which is never made purgeable
+    bool _purgeable = true;
+
+    // Texture storage is provided by the derived class
+    mtl_image_2d(int _width, int _height, int _stride) : mtl_image<T>(_width, _height), stride(_stride) { }
 
 public:
     const int stride;
@@ -135,6 +251,55 @@ public:
         return _texture->gpuResourceID();
     }
 
+    // Image metadata, no CPU view needed: width, height and size() come from basic_image
+
+    MTL::PixelFormat pixelFormat() const {
+        return _texture->pixelFormat();
+    }
+
+    size_t bytesPerRow() const {
+        return sizeof(T) * stride;
+    }
+
+    // Memory used by the texture, including the alignment padding
+    size_t allocatedSize() const {
+        return _texture->allocatedSize();
+    }
+
+    // Keeps the tracked allocation holding the image's storage, e.g. its heap, alive with the image
+    void shareAllocation(const GPUMemoryTracker::Allocation& allocation) {
+        _allocation = allocation;
+    }
+
+    // Idle images can be made volatile, the system may then discard their contents under memory pressure. Heap
+    // placed images set the state of their heap, which they share with the other images placed in it. Returns the
+    // previous state: MTL::PurgeableStateEmpty when making an image nonvolatile means its contents were discarded
+    // and have to be recomputed, the storage itself is still valid.
+    MTL::PurgeableState setPurgeableState(MTL::PurgeableState state) const {
+        if (!_purgeable) {
+            return MTL::PurgeableStateNonVolatile;
+        }
+        if (_heap) {
+            return _heap->setPurgeableState(state);
+        }
+        if (_buffer) {
+            return _buffer->setPurgeableState(state);
+        }
+        return _texture->setPurgeableState(state);
+    }
+
+    // False for GPU-only images, mapImage() throws for those
+    bool cpuAccessible() const {
+        return _texture->storageMode() != MTL::StorageModePrivate;
+    }
+
+    // With GLS_TRACK_GPU_WRITES a CPU view of a texture written by in-flight GPU work is flagged
+    void assertNoPendingGPUWrites() const {
+#if GLS_TRACK_GPU_WRITES
+        assert(!GPUWriteTracker::instance().pending(_texture.get()) && "CPU access to a texture with in-flight GPU writes");
+#endif
+    }
+
     static uint32_t computeStride(MTL::Device* device, MTL::PixelFormat pixelFormat, int _width) {
         assert(device != nullptr);
         const uint32_t mlta = (uint32_t)device->minimumLinearTextureAlignmentForPixelFormat(pixelFormat);
@@ -154,11 +319,35 @@ public:
         textureDesc->setUsage(MTL::ResourceUsageSample | MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
 
         _texture = NS::TransferPtr(_buffer->newTexture(textureDesc, 0, bytesPerRow));
+        _allocation = GPUMemoryTracker::shared().track(_buffer->allocatedSize());
     }
 
     mtl_image_2d(MTL::Device* device, const gls::size& imageSize)
         : mtl_image_2d(device, imageSize.width, imageSize.height) { }
 
+    // Placement allocation at the given offset of a heap, textures placed at overlapping offsets alias each other
+    mtl_image_2d(MTL::Heap* heap, size_t offset, int _width, int _height)
+        : mtl_image<T>(_width, _height), stride(computeStride(heap->device(), mtl_image<T>::ImageFormat(), _width)) {
+        assert(heap != nullptr && heap->type() == MTL::HeapTypePlacement);
+        uint32_t bytesPerRow = sizeof(T) * stride;
+
+        _heap = NS::RetainPtr(heap);
+        _buffer = NS::TransferPtr(heap->newBuffer(bytesPerRow * _height, heap->resourceOptions(), offset));
+        if (!_buffer) {
+            throw std::runtime_error("Couldn't allocate heap buffer at offset " + std::to_string(offset));
+        }
+
+        auto textureDesc = MTL::TextureDescriptor::texture2DDescriptor(mtl_image<T>::ImageFormat(), _width, _height, /*mipmapped=*/ false);
+        textureDesc->setStorageMode(MTL::StorageModeShared);
+        textureDesc->setUsage(MTL::ResourceUsageSample | MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+
+        _texture = NS::TransferPtr(_buffer->newTexture(textureDesc, 0, bytesPerRow));
+    }
+
+    static size_t byteSize(MTL::Device* device, int _width, int _height) {
+        return sizeof(T) * computeStride(device, mtl_image<T>::ImageFormat(), _width) * _height;
+    }
+
     mtl_image_2d(MTL::Device* device, const gls::image<T>& other)
         : mtl_image_2d(device, other.width, other.height) {
         assert(device != nullptr);
@@ -168,6 +357,7 @@ public:
     virtual ~mtl_image_2d() {}
 
     virtual typename gls::image<T>::unique_ptr mapImage() const {
+        assertNoPendingGPUWrites();
         void* bufferData = _buffer->contents();
         size_t bufferLength = _buffer->length();
 
@@ -188,16 +378,53 @@ public:
     void copyPixelsFrom(const image<T>& other) const {
         assert(other.width == image<T>::width && other.height == image<T>::height);
         auto cpuImage = mapImage();
-        copyPixels(cpuImage.get(), other);
+        parallel_bands(basic_image<T>::height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                std::memcpy(&(*cpuImage)[y][0], &other[y][0], sizeof(T) * basic_image<T>::width);
+            }
+        });
     }
 
     void copyPixelsTo(image<T>* other) const {
         assert(other->width == image<T>::width && other->height == image<T>::height);
         auto cpuImage = mapImage();
-        copyPixels(other, *cpuImage);
+        parallel_bands(basic_image<T>::height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                std::memcpy(&(*other)[y][0], &(*cpuImage)[y][0], sizeof(T) * basic_image<T>::width);
+            }
+        });
+    }
+
+    // GPU copy from another image of the same size and format, e.g.:
+    //   context->enqueue([&](MTL::CommandBuffer* commandBuffer) { image.copyPixelsFrom(commandBuffer, other); });
+    void copyPixelsFrom(MTL::CommandBuffer* commandBuffer, const mtl_image_2d<T>& other) const {
+        assert(other.width == basic_image<T>::width && other.height == basic_image<T>::height);
+        assert(other.texture()->pixelFormat() == _texture->pixelFormat());
+        auto encoder = commandBuffer->blitCommandEncoder();
+        if (encoder) {
+            encoder->copyFromTexture(other.texture(), /*sourceSlice=*/ 0, /*sourceLevel=*/ 0, MTL::Origin(0, 0, 0),
+                                     MTL::Size(basic_image<T>::width, basic_image<T>::height, 1),
+                                     _texture.get(), /*destinationSlice=*/ 0, /*destinationLevel=*/ 0, MTL::Origin(0, 0, 0));
+            encoder->endEncoding();
+        }
+    }
+
+    // GPU copy of a region of another image of the same format to position (x, y) of this one
+    void copyPixelsFrom(MTL::CommandBuffer* commandBuffer, const mtl_image_2d<T>& other, const gls::rectangle& region, int x, int y) const {
+        assert(region.x >= 0 && region.y >= 0 && region.x + region.width <= other.width && region.y + region.height <= other.height);
+        assert(x >= 0 && y >= 0 && x + region.width <= basic_image<T>::width && y + region.height <= basic_image<T>::height);
+        assert(other.texture()->pixelFormat() == _texture->pixelFormat());
+        auto encoder = commandBuffer->blitCommandEncoder();
+        if (encoder) {
+            encoder->copyFromTexture(other.texture(), /*sourceSlice=*/ 0, /*sourceLevel=*/ 0, MTL::Origin(region.x, region.y, 0),
+                                     MTL::Size(region.width, region.height, 1),
+                                     _texture.get(), /*destinationSlice=*/ 0, /*destinationLevel=*/ 0, MTL::Origin(x, y, 0));
+            encoder->endEncoding();
+        }
     }
 
-    void apply(std::function<void(T* pixel, int x, int y)> process) {
+    template <typename F>
+    void apply(F process) {
         auto cpu_image = mapImage();
         for (int y = 0; y < basic_image<T>::height; y++) {
             for (int x = 0; x < basic_image<T>::width; x++) {
@@ -205,11 +432,639 @@ public:
             }
         }
     }
+
+    // Multi-threaded apply, process is called concurrently on different rows
+    template <typename F>
+    void parallel_apply(F process) {
+        auto cpu_image = mapImage();
+        parallel_bands(basic_image<T>::height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                for (int x = 0; x < basic_image<T>::width; x++) {
+                    process(&(*cpu_image)[y][x], x, y);
+                }
+            }
+        });
+    }
+};
+
+// Storage precision of GPU-only float textures, independent of the pixel type: kernels read and write
+// half and float textures interchangeably, only the bandwidth and the accuracy change
+enum class texture_precision {
+    native,     // The pixel type format
+    fp16,
+    fp32
+};
+
+// GPU-only image using private, optimally tiled storage, losslessly compressed where the hardware supports it.
+// It has no CPU-visible buffer: use it for pipeline intermediates and keep mtl_image_2d for inputs and outputs.
+template <typename T>
+class mtl_private_image_2d : public mtl_image_2d<T> {
+public:
+    static MTL::PixelFormat storageFormat(texture_precision precision) {
+        if (precision == texture_precision::native) {
+            return mtl_image<T>::ImageFormat();
+        }
+        assert(!std::is_integral<typename T::value_type>::value);
+        const bool fp16 = precision == texture_precision::fp16;
+        return T::channels == 1 ? (fp16 ? MTL::PixelFormatR16Float : MTL::PixelFormatR32Float) :
+               T::channels == 2 ? (fp16 ? MTL::PixelFormatRG16Float : MTL::PixelFormatRG32Float) :
+               (fp16 ? MTL::PixelFormatRGBA16Float : MTL::PixelFormatRGBA32Float);
+    }
+
+    static MTL::TextureDescriptor* textureDescriptor(int _width, int _height, texture_precision precision = texture_precision::native) {
+        auto textureDesc = MTL::TextureDescriptor::texture2DDescriptor(storageFormat(precision), _width, _height, /*mipmapped=*/ false);
+        textureDesc->setStorageMode(MTL::StorageModePrivate);
+        textureDesc->setUsage(MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite);
+        textureDesc->setAllowGPUOptimizedContents(true);
+        return textureDesc;
+    }
+
+    mtl_private_image_2d(MTL::Device* device, int _width, int _height, texture_precision precision = texture_precision::native)
+        : mtl_image_2d<T>(_width, _height, _width) {
+        assert(device != nullptr);
+        this->_texture = NS::TransferPtr(device->newTexture(textureDescriptor(_width, _height, precision)));
+        this->_allocation = GPUMemoryTracker::shared().track(this->_texture->allocatedSize());
+    }
+
+    mtl_private_image_2d(MTL::Device* device, const gls::size& imageSize, texture_precision precision = texture_precision::native)
+        : mtl_private_image_2d(device, imageSize.width, imageSize.height, precision) { }
+
+    // Placement allocation at the given offset of a private heap
+    mtl_private_image_2d(MTL::Heap* heap, size_t offset, int _width, int _height, texture_precision precision = texture_precision::native)
+        : mtl_image_2d<T>(_width, _height, _width) {
+        assert(heap != nullptr && heap->type() == MTL::HeapTypePlacement);
+        this->_heap = NS::RetainPtr(heap);
+        this->_texture = NS::TransferPtr(heap->newTexture(textureDescriptor(_width, _height, precision), offset));
+        if (!this->_texture) {
+            throw std::runtime_error("Couldn't allocate heap texture at offset " + std::to_string(offset));
+        }
+    }
+
+    static MTL::SizeAndAlign heapSizeAndAlign(MTL::Device* device, int _width, int _height,
+                                              texture_precision precision = texture_precision::native) {
+        return device->heapTextureSizeAndAlign(textureDescriptor(_width, _height, precision));
+    }
+
+    typename gls::image<T>::unique_ptr mapImage() const override {
+        throw std::runtime_error("mtl_private_image_2d is not CPU accessible");
+    }
+};
+
+// A view of one mipmap level of a texture, as an image of that level's size for the kernels reading or writing it.
+// The view keeps its texture alive.
+template <typename T>
+class mtl_texture_level_2d : public mtl_image_2d<T> {
+public:
+    mtl_texture_level_2d(MTL::Texture* texture, int level)
+        : mtl_image_2d<T>(std::max((int) texture->width() >> level, 1), std::max((int) texture->height() >> level, 1),
+                          std::max((int) texture->width() >> level, 1)) {
+        assert(level < (int) texture->mipmapLevelCount());
+        this->_texture = NS::TransferPtr(texture->newTextureView(texture->pixelFormat(), MTL::TextureType2D,
+                                                                 NS::Range(level, 1), NS::Range(0, 1)));
+        // The storage is the texture's
+        this->_purgeable = false;
+    }
+
+    typename gls::image<T>::unique_ptr mapImage() const override {
+        throw std::runtime_error("mtl_texture_level_2d is not CPU accessible");
+    }
+};
+
+// GPU-only image with a chain of mipmap levels in a single allocation, e.g. for the pyramids whose kernels don't need
+// an exact resampling filter: the image is level 0, generateMipmaps() fills the lower levels with the hardware's box
+// filter in one blit pass and level() gives the views of the levels. The pixel format must be filterable, see
+// supportsMipmaps().
+template <typename T>
+class mtl_mipmapped_image_2d : public mtl_image_2d<T> {
+public:
+    mtl_mipmapped_image_2d(MTL::Device* device, int _width, int _height, int levels,
+                           texture_precision precision = texture_precision::native)
+        : mtl_image_2d<T>(_width, _height, _width) {
+        assert(device != nullptr);
+        auto textureDesc = mtl_private_image_2d<T>::textureDescriptor(_width, _height, precision);
+        textureDesc->setMipmapLevelCount(levels);
+        this->_texture = NS::TransferPtr(device->newTexture(textureDesc));
+        this->_allocation = GPUMemoryTracker::shared().track(this->_texture->allocatedSize());
+    }
+
+    // 32 bit float textures are not filterable on every GPU
+    static bool supportsMipmaps(MTL::Device* device, texture_precision precision = texture_precision::native) {
+        const auto format = mtl_private_image_2d<T>::storageFormat(precision);
+        const bool fp32 = format == MTL::PixelFormatR32Float || format == MTL::PixelFormatRG32Float ||
+                          format == MTL::PixelFormatRGBA32Float;
+        return !fp32 || device->supports32BitFloatFiltering();
+    }
+
+    int levels() const {
+        return (int) this->_texture->mipmapLevelCount();
+    }
+
+    typename mtl_image_2d<T>::unique_ptr level(int level) const {
+        return std::make_unique<mtl_texture_level_2d<T>>(this->_texture.get(), level);
+    }
+
+    // Downsamples level 0 into the lower levels
+    void generateMipmaps(MTL::CommandBuffer* commandBuffer) const {
+        auto encoder = commandBuffer->blitCommandEncoder();
+        if (encoder) {
+            encoder->generateMipmaps(this->_texture.get());
+            encoder->endEncoding();
+        }
+    }
+
+    typename gls::image<T>::unique_ptr mapImage() const override {
+        throw std::runtime_error("mtl_mipmapped_image_2d is not CPU accessible");
+    }
+};
+
+// GPU-only image on a sparse heap for very large, sparsely touched outputs and accumulators, e.g. the fusion of a
+// cropped region of a 60MP burst or the output of a tiled run: only the tiles mapped with map() are backed by
+// physical memory. Reads of unmapped tiles return zero and writes to them are discarded. The heap holds the largest
+// working set, the tiled processing maps the region it is about to write and unmaps the ones it's done with. The
+// mapping is encoded in the command buffer, ordered with the kernels reading and writing the image.
+template <typename T>
+class mtl_sparse_image_2d : public mtl_image_2d<T> {
+    MTL::Size _tileSize;
+    size_t _tileBytes;
+    int _tilesX;
+    int _tilesY;
+    std::vector<bool> _mappedTiles;
+    size_t _mappedTileCount = 0;
+
+    // The tiles of a pixel region, rounded outward
+    gls::rectangle tileRegion(const gls::rectangle& region) const {
+        const int x0 = region.x / (int) _tileSize.width;
+        const int y0 = region.y / (int) _tileSize.height;
+        const int x1 = std::min((region.x + region.width + (int) _tileSize.width - 1) / (int) _tileSize.width, _tilesX);
+        const int y1 = std::min((region.y + region.height + (int) _tileSize.height - 1) / (int) _tileSize.height, _tilesY);
+        return gls::rectangle({x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0)});
+    }
+
+    // Encodes the runs of tiles of each row of the region whose state changes
+    void updateMapping(MTL::CommandBuffer* commandBuffer, const gls::rectangle& region, bool map) {
+        const auto tiles = tileRegion(region);
+        if (map) {
+            size_t newTiles = 0;
+            for (int y = tiles.y; y < tiles.y + tiles.height; y++) {
+                for (int x = tiles.x; x < tiles.x + tiles.width; x++) {
+                    newTiles += !_mappedTiles[y * _tilesX + x];
+                }
+            }
+            if (_mappedTileCount + newTiles > maxMappedTiles()) {
+                throw std::runtime_error("mtl_sparse_image_2d: the mapped tiles exceed the sparse heap");
+            }
+        }
+
+        MTL::ResourceStateCommandEncoder* encoder = nullptr;
+        for (int y = tiles.y; y < tiles.y + tiles.height; y++) {
+            for (int x = tiles.x; x < tiles.x + tiles.width;) {
+                if (_mappedTiles[y * _tilesX + x] == map) {
+                    x++;
+                    continue;
+                }
+                int run = x;
+                while (run < tiles.x + tiles.width && _mappedTiles[y * _tilesX + run] != map) {
+                    _mappedTiles[y * _tilesX + run] = map;
+                    run++;
+                }
+                if (!encoder) {
+                    encoder = commandBuffer->resourceStateCommandEncoder();
+                }
+                encoder->updateTextureMapping(this->_texture.get(),
+                                              map ? MTL::SparseTextureMappingModeMap : MTL::SparseTextureMappingModeUnmap,
+                                              MTL::Region(x, y, run - x, 1), /*mipLevel=*/ 0, /*slice=*/ 0);
+                _mappedTileCount = map ? _mappedTileCount + (run - x) : _mappedTileCount - (run - x);
+                x = run;
+            }
+        }
+        if (encoder) {
+            encoder->endEncoding();
+        }
+    }
+
+public:
+    typedef std::unique_ptr<mtl_sparse_image_2d<T>> unique_ptr;
+
+    // Sparse textures need an Apple6 (A13) or later GPU
+    static bool isSupported(MTL::Device* device) {
+        return device->supportsFamily(MTL::GPUFamilyApple6);
+    }
+
+    // A heap of heapBytes, rounded up to whole tiles, backs the mapped tiles of the image
+    mtl_sparse_image_2d(MTL::Device* device, int _width, int _height, size_t heapBytes,
+                        texture_precision precision = texture_precision::native)
+        : mtl_image_2d<T>(_width, _height, _width) {
+        assert(device != nullptr);
+        if (!isSupported(device)) {
+            throw std::runtime_error("mtl_sparse_image_2d: sparse textures are not supported by " +
+                                     std::string(device->name()->utf8String()));
+        }
+        const auto pixelFormat = mtl_private_image_2d<T>::storageFormat(precision);
+        _tileSize = device->sparseTileSize(MTL::TextureType2D, pixelFormat, /*sampleCount=*/ 1);
+        _tileBytes = device->sparseTileSizeInBytes();
+        _tilesX = (int) ((_width + _tileSize.width - 1) / _tileSize.width);
+        _tilesY = (int) ((_height + _tileSize.height - 1) / _tileSize.height);
+        _mappedTiles.assign((size_t) _tilesX * _tilesY, false);
+
+        auto heapDescriptor = NS::TransferPtr(MTL::HeapDescriptor::alloc()->init());
+        heapDescriptor->setType(MTL::HeapTypeSparse);
+        heapDescriptor->setStorageMode(MTL::StorageModePrivate);
+        heapDescriptor->setSize(_tileBytes * std::max((heapBytes + _tileBytes - 1) / _tileBytes, (size_t) 1));
+        this->_heap = NS::TransferPtr(device->newHeap(heapDescriptor.get()));
+        if (!this->_heap) {
+            throw std::runtime_error("mtl_sparse_image_2d: couldn't allocate a sparse heap of " + std::to_string(heapBytes) + " bytes");
+        }
+
+        auto textureDesc = mtl_private_image_2d<T>::textureDescriptor(_width, _height, precision);
+        textureDesc->setAllowGPUOptimizedContents(false);
+        this->_texture = NS::TransferPtr(this->_heap->newTexture(textureDesc));
+        if (!this->_texture) {
+            throw std::runtime_error("mtl_sparse_image_2d: couldn't allocate a sparse texture");
+        }
+        // The heap is the physical memory, the texture only reserves address space
+        this->_allocation = GPUMemoryTracker::shared().track(this->_heap->size());
+    }
+
+    mtl_sparse_image_2d(MTL::Device* device, const gls::size& imageSize, size_t heapBytes,
+                        texture_precision precision = texture_precision::native)
+        : mtl_sparse_image_2d(device, imageSize.width, imageSize.height, heapBytes, precision) { }
+
+    // Size of a sparse tile in pixels
+    gls::size tileSize() const {
+        return { (int) _tileSize.width, (int) _tileSize.height };
+    }
+
+    size_t maxMappedTiles() const {
+        return this->_heap->size() / _tileBytes;
+    }
+
+    size_t mappedBytes() const {
+        return _mappedTileCount * _tileBytes;
+    }
+
+    // Whether all the tiles of the pixel region are mapped
+    bool isMapped(const gls::rectangle& region) const {
+        const auto tiles = tileRegion(region);
+        for (int y = tiles.y; y < tiles.y + tiles.height; y++) {
+            for (int x = tiles.x; x < tiles.x + tiles.width; x++) {
+                if (!_mappedTiles[y * _tilesX + x]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Backs the tiles covering the pixel region with memory of the heap, the ones already mapped keep their
+    // contents. The new tiles' contents are undefined. Throws if the heap doesn't have enough free tiles.
+    void map(MTL::CommandBuffer* commandBuffer, const gls::rectangle& region) {
+        updateMapping(commandBuffer, region, /*map=*/ true);
+    }
+
+    // Returns the tiles covering the pixel region to the heap, the work encoded before in the command buffer still
+    // sees their contents
+    void unmap(MTL::CommandBuffer* commandBuffer, const gls::rectangle& region) {
+        updateMapping(commandBuffer, region, /*map=*/ false);
+    }
+
+    void unmapAll(MTL::CommandBuffer* commandBuffer) {
+        unmap(commandBuffer, gls::rectangle({0, 0, basic_image<T>::width, basic_image<T>::height}));
+    }
+
+    typename gls::image<T>::unique_ptr mapImage() const override {
+        throw std::runtime_error("mtl_sparse_image_2d is not CPU accessible");
+    }
+};
+
+// Zero-copy image over a host allocation, the texture aliases the allocation, which is retained for the lifetime of
+// the image. The allocation is laid out with the texture's stride, see allocate(): fill it through
+// host_allocation::image(), or mapImage(), and bind it to the GPU as any other mtl_image_2d.
+template <typename T>
+class mtl_host_image_2d : public mtl_image_2d<T> {
+    const typename host_allocation<T>::shared_ptr _memory;
+
+public:
+    typedef std::unique_ptr<mtl_host_image_2d<T>> unique_ptr;
+
+    static int textureStride(MTL::Device* device, int _width) {
+        return mtl_image_2d<T>::computeStride(device, mtl_image<T>::ImageFormat(), _width);
+    }
+
+    // Host memory for an image of the given size, rows padded to the linear texture alignment
+    static typename host_allocation<T>::shared_ptr allocate(MTL::Device* device, int _width, int _height) {
+        return host_allocation<T>::make((size_t) textureStride(device, _width) * _height);
+    }
+
+    mtl_host_image_2d(MTL::Device* device, const typename host_allocation<T>::shared_ptr& memory, int _width, int _height)
+        : mtl_image_2d<T>(_width, _height, textureStride(device, _width)), _memory(memory) {
+        assert(device != nullptr);
+        const uint32_t bytesPerRow = sizeof(T) * this->stride;
+        if (memory->size() < (size_t) this->stride * _height) {
+            throw std::runtime_error("mtl_host_image_2d: the allocation is smaller than the image");
+        }
+
+        this->_buffer = host_allocation<T>::wrap(device, memory->data(), memory->bytes());
+        this->_purgeable = false;
+
+        auto textureDesc = MTL::TextureDescriptor::texture2DDescriptor(mtl_image<T>::ImageFormat(), _width, _height, /*mipmapped=*/ false);
+        textureDesc->setStorageMode(MTL::StorageModeShared);
+        textureDesc->setUsage(MTL::ResourceUsageSample | MTL::ResourceUsageRead | MTL::ResourceUsageWrite);
+
+        this->_texture = NS::TransferPtr(this->_buffer->newTexture(textureDesc, 0, bytesPerRow));
+        this->_allocation = GPUMemoryTracker::shared().track(this->_buffer->allocatedSize());
+    }
+
+    mtl_host_image_2d(MTL::Device* device, int _width, int _height)
+        : mtl_host_image_2d(device, allocate(device, _width, _height), _width, _height) { }
+
+    const typename host_allocation<T>::shared_ptr& memory() const {
+        return _memory;
+    }
+};
+
+// Zero-copy wrapper of an IOSurface-backed CVPixelBuffer (e.g. a camera capture), the texture aliases the
+// pixel buffer memory. The pixel buffer is retained for the lifetime of the image, mapImage() is only
+// valid while the pixel buffer base address is locked.
+template <typename T>
+class mtl_pixel_buffer_image_2d : public mtl_image_2d<T> {
+    CVPixelBufferRef _pixelBuffer;
+
+    static int pixelBufferStride(CVPixelBufferRef pixelBuffer) {
+        return (int) (CVPixelBufferGetBytesPerRow(pixelBuffer) / sizeof(T));
+    }
+
+public:
+    typedef std::unique_ptr<mtl_pixel_buffer_image_2d<T>> unique_ptr;
+
+    mtl_pixel_buffer_image_2d(MTL::Device* device, CVPixelBufferRef pixelBuffer)
+        : mtl_image_2d<T>((int) CVPixelBufferGetWidth(pixelBuffer), (int) CVPixelBufferGetHeight(pixelBuffer),
+                          pixelBufferStride(pixelBuffer)),
+          _pixelBuffer(CVPixelBufferRetain(pixelBuffer)) {
+        assert(device != nullptr);
+        this->_purgeable = false;
+        IOSurfaceRef ioSurface = CVPixelBufferGetIOSurface(pixelBuffer);
+        if (!ioSurface) {
+            CVPixelBufferRelease(_pixelBuffer);
+            throw std::runtime_error("CVPixelBuffer is not IOSurface-backed");
+        }
+
+        auto textureDesc = MTL::TextureDescriptor::texture2DDescriptor(mtl_image<T>::ImageFormat(), this->width, this->height, /*mipmapped=*/ false);
+        textureDesc->setStorageMode(MTL::StorageModeShared);
+        textureDesc->setUsage(MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite);
+
+        this->_texture = NS::TransferPtr(device->newTexture(textureDesc, ioSurface, /*plane=*/ 0));
+        if (!this->_texture) {
+            CVPixelBufferRelease(_pixelBuffer);
+            throw std::runtime_error("Couldn't create a texture from the CVPixelBuffer IOSurface");
+        }
+    }
+
+    ~mtl_pixel_buffer_image_2d() {
+        // Release the texture before the pixel buffer backing it
+        this->_texture = nullptr;
+        CVPixelBufferRelease(_pixelBuffer);
+    }
+
+    static bool isSupported(CVPixelBufferRef pixelBuffer) {
+        return CVPixelBufferGetIOSurface(pixelBuffer) != nullptr && !CVPixelBufferIsPlanar(pixelBuffer);
+    }
+
+    CVPixelBufferRef pixelBuffer() const {
+        return _pixelBuffer;
+    }
+
+    typename gls::image<T>::unique_ptr mapImage() const override {
+        this->assertNoPendingGPUWrites();
+        T* baseAddress = (T*) CVPixelBufferGetBaseAddress(_pixelBuffer);
+        assert(baseAddress != nullptr);
+        return std::make_unique<gls::image<T>>(this->width, this->height, this->stride,
+                                               std::span<T>(baseAddress, this->stride * this->height));
+    }
+};
+
+// Zero-copy wrapper of an IOSurface-backed full range bi-planar 4:2:0 CVPixelBuffer, 8 bit or 10 bit, the
+// native input format of the HEVC encoders. The luma plane texture is R8/R16Unorm at full resolution, the
+// chroma plane texture RG8/RG16Unorm at half resolution, rounded up. The 10 bit samples are MSB aligned in
+// 16 bit words. Same lifetime rules as mtl_pixel_buffer_image_2d.
+class mtl_pixel_buffer_ycbcr_420_image {
+    CVPixelBufferRef _pixelBuffer;
+    NS::SharedPtr<MTL::Texture> _lumaTexture;
+    NS::SharedPtr<MTL::Texture> _chromaTexture;
+
+    static NS::SharedPtr<MTL::Texture> planeTexture(MTL::Device* device, CVPixelBufferRef pixelBuffer, int plane,
+                                                    MTL::PixelFormat pixelFormat) {
+        auto textureDesc = MTL::TextureDescriptor::texture2DDescriptor(pixelFormat,
+                                                                       CVPixelBufferGetWidthOfPlane(pixelBuffer, plane),
+                                                                       CVPixelBufferGetHeightOfPlane(pixelBuffer, plane),
+                                                                       /*mipmapped=*/ false);
+        textureDesc->setStorageMode(MTL::StorageModeShared);
+        textureDesc->setUsage(MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite);
+
+        return NS::TransferPtr(device->newTexture(textureDesc, CVPixelBufferGetIOSurface(pixelBuffer), plane));
+    }
+
+public:
+    typedef std::unique_ptr<mtl_pixel_buffer_ycbcr_420_image> unique_ptr;
+
+    const int width;
+    const int height;
+    const int bitDepth;
+
+    mtl_pixel_buffer_ycbcr_420_image(MTL::Device* device, CVPixelBufferRef pixelBuffer)
+        : _pixelBuffer(CVPixelBufferRetain(pixelBuffer)),
+          width((int) CVPixelBufferGetWidth(pixelBuffer)),
+          height((int) CVPixelBufferGetHeight(pixelBuffer)),
+          bitDepth(bitDepthOf(CVPixelBufferGetPixelFormatType(pixelBuffer))) {
+        assert(device != nullptr);
+        if (!isSupported(pixelBuffer)) {
+            CVPixelBufferRelease(_pixelBuffer);
+            throw std::runtime_error("CVPixelBuffer is not an IOSurface-backed full range 420 bi-planar buffer");
+        }
+
+        const bool tenBit = bitDepth > 8;
+        _lumaTexture = planeTexture(device, pixelBuffer, 0, tenBit ? MTL::PixelFormatR16Unorm : MTL::PixelFormatR8Unorm);
+        _chromaTexture = planeTexture(device, pixelBuffer, 1, tenBit ? MTL::PixelFormatRG16Unorm : MTL::PixelFormatRG8Unorm);
+        if (!_lumaTexture || !_chromaTexture) {
+            _lumaTexture = nullptr;
+            _chromaTexture = nullptr;
+            CVPixelBufferRelease(_pixelBuffer);
+            throw std::runtime_error("Couldn't create the plane textures from the CVPixelBuffer IOSurface");
+        }
+    }
+
+    ~mtl_pixel_buffer_ycbcr_420_image() {
+        // Release the textures before the pixel buffer backing them
+        _lumaTexture = nullptr;
+        _chromaTexture = nullptr;
+        CVPixelBufferRelease(_pixelBuffer);
+    }
+
+    mtl_pixel_buffer_ycbcr_420_image(const mtl_pixel_buffer_ycbcr_420_image&) = delete;
+    mtl_pixel_buffer_ycbcr_420_image& operator=(const mtl_pixel_buffer_ycbcr_420_image&) = delete;
+
+    // Zero for the unsupported pixel formats
+    static int bitDepthOf(OSType pixelFormat) {
+        return pixelFormat == kCVPixelFormatType_420YpCbCr8BiPlanarFullRange ? 8 :
+               pixelFormat == kCVPixelFormatType_420YpCbCr10BiPlanarFullRange ? 10 : 0;
+    }
+
+    static bool isSupported(CVPixelBufferRef pixelBuffer) {
+        return CVPixelBufferGetIOSurface(pixelBuffer) != nullptr && CVPixelBufferGetPlaneCount(pixelBuffer) == 2 &&
+               bitDepthOf(CVPixelBufferGetPixelFormatType(pixelBuffer)) != 0;
+    }
+
+    gls::size size() const {
+        return { width, height };
+    }
+
+    MTL::Texture* lumaTexture() const {
+        return _lumaTexture.get();
+    }
+
+    MTL::Texture* chromaTexture() const {
+        return _chromaTexture.get();
+    }
+
+    CVPixelBufferRef pixelBuffer() const {
+        return _pixelBuffer;
+    }
+};
+
+// Allocator for textures which are only live during part of the pipeline. Each texture declares the
+// range of pipeline stages it is used in, textures with disjoint lifetimes are placed at overlapping
+// offsets of a single placement heap. With StorageModePrivate the textures are mtl_private_image_2d,
+// with StorageModeShared they are CPU-visible buffer-backed mtl_image_2d. Falls back to standalone
+// allocations if the device can't create the heap. An untracked heap and its textures are not hazard
+// tracked by the driver, the client orders their uses, see MetalContext::beginExplicitHazards.
+class transient_heap {
+    struct request {
+        size_t size;
+        size_t align;
+        int firstStage;
+        int lastStage;
+        size_t offset;
+        std::function<void(MTL::Heap* heap, size_t offset, const GPUMemoryTracker::Allocation& allocation)> create;
+    };
+
+    MTL::Device* _device;
+    const MTL::StorageMode _storageMode;
+    const bool _untracked;
+    std::vector<request> _requests;
+    size_t _heapSize = 0;
+
+    MTL::ResourceOptions resourceOptions() const {
+        return (_storageMode == MTL::StorageModePrivate ? MTL::ResourceStorageModePrivate : MTL::ResourceStorageModeShared) |
+               (_untracked ? MTL::ResourceHazardTrackingModeUntracked : MTL::ResourceHazardTrackingModeTracked);
+    }
+
+    // Greedy offset assignment, largest allocations first: each allocation goes in the lowest
+    // aligned gap between the allocations already placed whose lifetimes overlap its own
+    void plan() {
+        std::vector<request*> order;
+        for (auto& r : _requests) {
+            order.push_back(&r);
+        }
+        std::stable_sort(order.begin(), order.end(), [](const request* a, const request* b) {
+            return a->size > b->size;
+        });
+
+        std::vector<request*> placed;
+        _heapSize = 0;
+        for (auto r : order) {
+            std::vector<request*> live;
+            for (auto p : placed) {
+                if (p->firstStage <= r->lastStage && r->firstStage <= p->lastStage) {
+                    live.push_back(p);
+                }
+            }
+            std::sort(live.begin(), live.end(), [](const request* a, const request* b) {
+                return a->offset < b->offset;
+            });
+
+            size_t offset = 0;
+            for (auto p : live) {
+                if (offset + r->size <= p->offset) {
+                    break;
+                }
+                offset = std::max(offset, (p->offset + p->size + r->align - 1) / r->align * r->align);
+            }
+            r->offset = offset;
+            _heapSize = std::max(_heapSize, offset + r->size);
+            placed.push_back(r);
+        }
+    }
+
+public:
+    transient_heap(MTL::Device* device, MTL::StorageMode storageMode = MTL::StorageModePrivate, bool untracked = false) :
+        _device(device), _storageMode(storageMode), _untracked(untracked) {
+        assert(storageMode == MTL::StorageModePrivate || storageMode == MTL::StorageModeShared);
+    }
+
+    // The precision only applies to private storage, shared images have the pixel type format
+    template <typename T>
+    void add(std::unique_ptr<mtl_image_2d<T>>* image, int width, int height, int firstStage, int lastStage,
+             texture_precision precision = texture_precision::native) {
+        assert(firstStage <= lastStage);
+        const bool gpuPrivate = _storageMode == MTL::StorageModePrivate;
+        const auto sizeAndAlign = gpuPrivate
+            ? mtl_private_image_2d<T>::heapSizeAndAlign(_device, width, height, precision)
+            : _device->heapBufferSizeAndAlign(mtl_image_2d<T>::byteSize(_device, width, height), resourceOptions());
+        _requests.push_back({
+            sizeAndAlign.size, sizeAndAlign.align, firstStage, lastStage, 0,
+            [=, device = _device](MTL::Heap* heap, size_t offset, const GPUMemoryTracker::Allocation& allocation) {
+                if (gpuPrivate) {
+                    *image = heap ? std::make_unique<mtl_private_image_2d<T>>(heap, offset, width, height, precision)
+                                  : std::make_unique<mtl_private_image_2d<T>>(device, width, height, precision);
+                } else {
+                    *image = heap ? std::make_unique<mtl_image_2d<T>>(heap, offset, width, height)
+                                  : std::make_unique<mtl_image_2d<T>>(device, width, height);
+                }
+                if (heap) {
+                    (*image)->shareAllocation(allocation);
+                }
+            }
+        });
+    }
+
+    template <typename T>
+    void add(std::unique_ptr<mtl_image_2d<T>>* image, const gls::size& imageSize, int firstStage, int lastStage,
+             texture_precision precision = texture_precision::native) {
+        add(image, imageSize.width, imageSize.height, firstStage, lastStage, precision);
+    }
+
+    // Creates the heap and instantiates all the requested textures, returns the heap size
+    size_t allocate() {
+        if (_requests.empty()) {
+            return 0;
+        }
+
+        plan();
+
+        auto heapDescriptor = NS::TransferPtr(MTL::HeapDescriptor::alloc()->init());
+        heapDescriptor->setType(MTL::HeapTypePlacement);
+        heapDescriptor->setResourceOptions(resourceOptions());
+        heapDescriptor->setSize(_heapSize);
+        auto heap = NS::TransferPtr(_device->newHeap(heapDescriptor.get()));
+        GPUMemoryTracker::Allocation allocation;
+        if (heap) {
+            allocation = GPUMemoryTracker::shared().track(heap->size());
+        }
+
+        for (auto& r : _requests) {
+            r.create(heap.get(), r.offset, allocation);
+        }
+        _requests.clear();
+
+        return heap ? _heapSize : 0;
+    }
 };
 
 template <typename T>
 class Buffer {
     const NS::SharedPtr<MTL::Buffer> _buffer;
+    const GPUMemoryTracker::Allocation _allocation = GPUMemoryTracker::shared().track(_buffer->allocatedSize());
+    // The owner of the host memory of no-copy buffers
+    const std::shared_ptr<const void> _hostMemory;
 
 public:
     Buffer(MTL::Device* device, size_t lenght) :
@@ -227,6 +1082,17 @@ public:
         std::copy(span.begin(), span.end(), this->data());
     }
 
+    // No-copy buffer over a host allocation, size() includes the padding to the page boundary
+    Buffer(MTL::Device* device, const typename host_allocation<T>::shared_ptr& memory) :
+    _buffer(host_allocation<T>::wrap(device, memory->data(), memory->bytes())),
+    _hostMemory(memory) { }
+
+    // No-copy buffer over page aligned memory of whole pages, e.g. a CoreML output, kept alive by owner. Throws if the
+    // memory can't be wrapped, see host_allocation::canWrap().
+    Buffer(MTL::Device* device, const std::span<T> memory, std::shared_ptr<const void> owner) :
+    _buffer(host_allocation<T>::wrap(device, memory.data(), memory.size_bytes())),
+    _hostMemory(std::move(owner)) { }
+
     template< typename IteratorType >
     Buffer(MTL::Device* device, IteratorType startIterator, IteratorType endIterator) :
     _buffer(NS::TransferPtr(device->newBuffer(sizeof(T) * (endIterator - startIterator),
@@ -247,6 +1113,14 @@ public:
         return _buffer.get();
     }
 
+    // See mtl_image_2d::setPurgeableState(), no-copy buffers are left alone
+    MTL::PurgeableState setPurgeableState(MTL::PurgeableState state) const {
+        if (_hostMemory) {
+            return MTL::PurgeableStateNonVolatile;
+        }
+        return _buffer->setPurgeableState(state);
+    }
+
     void copy_from(const std::span<T> span) {
         std::copy(span.begin(), span.end(), this->data());
     }
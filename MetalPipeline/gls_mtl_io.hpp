@@ -0,0 +1,108 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_mtl_io_hpp
+#define gls_mtl_io_hpp
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "gls_mtl.hpp"
+#include "gls_mtl_image.hpp"
+#include "dng_reader.hpp"
+
+// Packed raw data of a DNG on its way to a GPU buffer, see DNGIOLoader. The payload can still be loading: the GPU
+// work reading it waits for the loaded event, see RawConverter::demosaicAsync.
+struct StreamedRawImage {
+    static constexpr uint64_t kLoadedValue = 1;
+
+    PackedRawImage layout;  // Without data, the samples are in payload
+    std::shared_ptr<gls::Buffer<uint8_t>> payload;
+    NS::SharedPtr<MTL::SharedEvent> loaded;  // Signaled with kLoadedValue, also when the load fails
+    std::shared_ptr<std::atomic<bool>> error = std::make_shared<std::atomic<bool>>(false);
+
+    // Valid once the GPU work reading the payload has completed
+    bool failed() const {
+        return *error;
+    }
+};
+
+// Loader of the raw strips of uncompressed DNGs straight from the file to GPU buffers with Metal fast resource
+// loading: no copy in a gls::image, no staging through the page cache. The IFDs are parsed on the CPU with
+// DNGReader, the loads run on the IO queue while the GPU processes the previous images. Compressed and tiled DNGs
+// have no rawLayout(), they go through DNGDecoder.
+class DNGIOLoader {
+    NS::SharedPtr<MTL::Device> _device;
+    NS::SharedPtr<MTL::IOCommandQueue> _queue;
+
+public:
+    DNGIOLoader(MTL::Device* device) : _device(NS::RetainPtr(device)) {
+        auto descriptor = NS::TransferPtr(MTL::IOCommandQueueDescriptor::alloc()->init());
+        descriptor->setType(MTL::IOCommandQueueTypeConcurrent);
+        descriptor->setPriority(MTL::IOPriorityNormal);
+
+        NS::Error* error = nullptr;
+        _queue = NS::TransferPtr(device->newIOCommandQueue(descriptor.get(), &error));
+        if (!_queue) {
+            throw std::runtime_error(std::string("DNGIOLoader: couldn't create the IO queue") +
+                                     (error ? std::string(" : ") + error->localizedDescription()->utf8String() : ""));
+        }
+    }
+
+    MTL::Device* device() const {
+        return _device.get();
+    }
+
+    // Enqueues the loads of the strips and returns right away, throws if the file can't be opened
+    StreamedRawImage load(const std::string& path, const DNGRawLayout& layout) const {
+        auto pool = NS::TransferPtr(NS::AutoreleasePool::alloc()->init());
+
+        NS::Error* error = nullptr;
+        auto url = NS::URL::fileURLWithPath(NS::String::string(path.c_str(), NS::UTF8StringEncoding));
+        auto handle = NS::TransferPtr(_device->newIOHandle(url, &error));
+        if (!handle) {
+            throw std::runtime_error("DNGIOLoader: couldn't open " + path +
+                                     (error ? std::string(" : ") + error->localizedDescription()->utf8String() : ""));
+        }
+
+        StreamedRawImage image;
+        image.layout = layout.image;
+        {
+            gls::GPUMemoryTracker::Scope scope("DNGIOLoader");
+            image.payload = std::make_shared<gls::Buffer<uint8_t>>(_device.get(), layout.image.payloadBytes());
+        }
+        image.loaded = NS::TransferPtr(_device->newSharedEvent());
+
+        auto commandBuffer = NS::RetainPtr(_queue->commandBuffer());
+        for (const auto& strip : layout.strips) {
+            commandBuffer->loadBuffer(image.payload->buffer(), strip.payloadOffset, strip.bytes, handle.get(), strip.fileOffset);
+        }
+        commandBuffer->signalEvent(image.loaded.get(), StreamedRawImage::kLoadedValue);
+
+        // A failed command buffer skips its signal, release the GPU work waiting for it anyway
+        commandBuffer->addCompletedHandler([handle, loaded = image.loaded, failed = image.error](MTL::IOCommandBuffer* commandBuffer) {
+            if (commandBuffer->status() != MTL::IOStatusComplete) {
+                *failed = true;
+                loaded->setSignaledValue(StreamedRawImage::kLoadedValue);
+            }
+        });
+        commandBuffer->commit();
+        return image;
+    }
+};
+
+#endif /* gls_mtl_io_hpp */
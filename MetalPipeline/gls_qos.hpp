@@ -0,0 +1,99 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_qos_hpp
+#define gls_qos_hpp
+
+#if __APPLE__
+#include <pthread/qos.h>
+#endif
+
+namespace gls {
+
+// Quality of service class of the CPU work, mapped to the Darwin QoS classes. On Apple silicon the kernel prefers the
+// performance cores for the interactive and initiated classes and keeps utility and background work mostly on the
+// efficiency cores, it is the only control of the thread placement there is. A no-op on the other platforms.
+enum class QoS {
+    userInteractive,    // The capture path: AWB, noise estimation, PCA, registration of the frame being shot
+    userInitiated,      // Work the user waits for, the default of the pipeline's threads
+    utility,            // Batch conversion, burst fusion, output encoding
+    background          // Debug dumps, kernel prewarming
+};
+
+#if __APPLE__
+inline qos_class_t qosClass(QoS qos) {
+    switch (qos) {
+        case QoS::userInteractive:
+            return QOS_CLASS_USER_INTERACTIVE;
+        case QoS::userInitiated:
+            return QOS_CLASS_USER_INITIATED;
+        case QoS::utility:
+            return QOS_CLASS_UTILITY;
+        case QoS::background:
+            return QOS_CLASS_BACKGROUND;
+    }
+    return QOS_CLASS_USER_INITIATED;
+}
+#endif
+
+// Threads without an explicit class (e.g. the main thread) count as user initiated
+inline QoS threadQoS() {
+#if __APPLE__
+    switch (qos_class_self()) {
+        case QOS_CLASS_USER_INTERACTIVE:
+            return QoS::userInteractive;
+        case QOS_CLASS_UTILITY:
+            return QoS::utility;
+        case QOS_CLASS_BACKGROUND:
+            return QoS::background;
+        default:
+            return QoS::userInitiated;
+    }
+#else
+    return QoS::userInitiated;
+#endif
+}
+
+inline void setThreadQoS(QoS qos) {
+#if __APPLE__
+    pthread_set_qos_class_self_np(qosClass(qos), 0);
+#endif
+}
+
+// Runs the calling thread at the given class till the end of the scope, e.g. for a pipeline stage. The scheduler's
+// parallel_for inherits the class of its caller, see TaskScheduler.
+class QoSScope {
+    const QoS _previous;
+
+public:
+    QoSScope(QoS qos) : _previous(threadQoS()) {
+        if (qos != _previous) {
+            setThreadQoS(qos);
+        }
+    }
+
+    ~QoSScope() {
+        if (threadQoS() != _previous) {
+            setThreadQoS(_previous);
+        }
+    }
+
+    QoSScope(const QoSScope&) = delete;
+    QoSScope& operator=(const QoSScope&) = delete;
+};
+
+}  // namespace gls
+
+#endif /* gls_qos_hpp */
@@ -0,0 +1,66 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gls_signpost_hpp
+#define gls_signpost_hpp
+
+#include <string>
+
+#if __APPLE__
+#include <os/signpost.h>
+#endif
+
+namespace gls {
+
+// os_signpost interval for Instruments' Points of Interest track, from construction to destruction. The interval
+// name is the "Stage" signpost with the stage's name as its message, e.g. "rawFrontEnd" or "pyramid level 2".
+// Signposts cost a flag check when no trace is being recorded.
+class TraceInterval {
+#if __APPLE__
+    os_signpost_id_t _id = OS_SIGNPOST_ID_NULL;
+
+    static os_log_t log() {
+        static os_log_t log = os_log_create("com.glass-imaging.pipeline", OS_LOG_CATEGORY_POINTS_OF_INTEREST);
+        return log;
+    }
+#endif
+
+public:
+    TraceInterval(const char* name) {
+#if __APPLE__
+        if (os_signpost_enabled(log())) {
+            _id = os_signpost_id_generate(log());
+            os_signpost_interval_begin(log(), _id, "Stage", "%{public}s", name);
+        }
+#endif
+    }
+
+    TraceInterval(const std::string& name) : TraceInterval(name.c_str()) { }
+
+    ~TraceInterval() {
+#if __APPLE__
+        if (_id != OS_SIGNPOST_ID_NULL) {
+            os_signpost_interval_end(log(), _id, "Stage");
+        }
+#endif
+    }
+
+    TraceInterval(const TraceInterval&) = delete;
+    TraceInterval& operator=(const TraceInterval&) = delete;
+};
+
+}  // namespace gls
+
+#endif /* gls_signpost_hpp */
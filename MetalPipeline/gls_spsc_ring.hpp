@@ -0,0 +1,85 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef gls_spsc_ring_hpp
+#define gls_spsc_ring_hpp
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+namespace gls {
+
+// Lock-free single producer, single consumer ring of capacity - 1 elements, e.g. per frame statistics published
+// from the GPU completion handlers to the UI. Neither side ever blocks: when the ring is full the producer's
+// element is dropped, the consumer sees the oldest elements first.
+template <typename T, size_t capacity>
+class spsc_ring {
+    static_assert(capacity >= 2, "spsc_ring needs room for at least one element");
+
+    std::array<T, capacity> _elements;
+    // Written by the producer only
+    alignas(64) std::atomic<size_t> _head = 0;
+    // Written by the consumer only
+    alignas(64) std::atomic<size_t> _tail = 0;
+
+    static size_t next(size_t index) {
+        return index + 1 == capacity ? 0 : index + 1;
+    }
+
+public:
+    // Producer side, false if the ring is full
+    bool push(const T& element) {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        const size_t nextHead = next(head);
+        if (nextHead == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        _elements[head] = element;
+        _head.store(nextHead, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, the oldest element
+    std::optional<T> pop() {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        T element = _elements[tail];
+        _tail.store(next(tail), std::memory_order_release);
+        return element;
+    }
+
+    // Consumer side, drops all but the newest element, e.g. for a control loop running slower than the producer
+    std::optional<T> latest() {
+        std::optional<T> element;
+        while (auto e = pop()) {
+            element = std::move(e);
+        }
+        return element;
+    }
+
+    // Approximate from either side
+    bool empty() const {
+        return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire);
+    }
+};
+
+}  // namespace gls
+
+#endif /* gls_spsc_ring_hpp */
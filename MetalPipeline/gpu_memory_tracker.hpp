@@ -0,0 +1,196 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef gpu_memory_tracker_hpp
+#define gpu_memory_tracker_hpp
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace gls {
+
+// Thrown by GPUMemoryTracker::track() when an allocation exceeds the budget, e.g. to fall back to tiled processing
+class gpu_budget_exceeded : public std::runtime_error {
+public:
+    const size_t requestedBytes;
+    const size_t liveBytes;
+    const size_t budget;
+
+    gpu_budget_exceeded(const std::string& owner, size_t requestedBytes, size_t liveBytes, size_t budget) :
+        std::runtime_error("GPU memory budget exceeded by " + owner + ": " + std::to_string(requestedBytes) +
+                           " bytes requested, " + std::to_string(liveBytes) + " live, budget " + std::to_string(budget)),
+        requestedBytes(requestedBytes), liveBytes(liveBytes), budget(budget) { }
+};
+
+// Accounting of the device memory allocated by the pipeline: mtl_image_2d and transient heap storage, Buffer,
+// BufferParameters, the parameter arena blocks and the SURF buffers. Allocations are tagged with the owner of the
+// innermost Scope of the allocating thread, nested scopes are joined with '/' (e.g. "RawConverter/PyramidProcessor"),
+// and released when the last copy of their Allocation token is gone, i.e. with the resource holding it.
+//
+// Memory owned by CoreVideo (the pixel buffer backed images) is not tracked. The tracker is shared by all the
+// contexts of the process, see MetalContext::memoryTracker().
+class GPUMemoryTracker {
+public:
+    struct OwnerStats {
+        size_t liveBytes = 0;
+        size_t peakBytes = 0;
+        size_t allocations = 0;  // Live allocations
+    };
+
+    typedef std::shared_ptr<const void> Allocation;
+
+    // Tags the allocations of the calling thread for its lifetime
+    class Scope {
+    public:
+        Scope(const std::string& owner) {
+            auto& stack = scopeStack();
+            stack.push_back(stack.empty() ? owner : stack.back() + "/" + owner);
+        }
+
+        ~Scope() {
+            scopeStack().pop_back();
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+private:
+    mutable std::mutex _mutex;
+    std::map<std::string, OwnerStats> _owners;
+    size_t _liveBytes = 0;
+    size_t _peakBytes = 0;
+    size_t _budget = 0;
+
+    static std::vector<std::string>& scopeStack() {
+        static thread_local std::vector<std::string> stack;
+        return stack;
+    }
+
+    void release(OwnerStats* owner, size_t bytes) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        owner->liveBytes -= bytes;
+        owner->allocations--;
+        _liveBytes -= bytes;
+    }
+
+    GPUMemoryTracker() = default;
+
+public:
+    GPUMemoryTracker(const GPUMemoryTracker&) = delete;
+    GPUMemoryTracker& operator=(const GPUMemoryTracker&) = delete;
+
+    static GPUMemoryTracker& shared() {
+        static GPUMemoryTracker tracker;
+        return tracker;
+    }
+
+    static std::string currentOwner() {
+        const auto& stack = scopeStack();
+        return stack.empty() ? "untagged" : stack.back();
+    }
+
+    // Records an allocation of bytes for the current owner, keep the token with the resource. With a budget set an
+    // allocation that doesn't fit throws gpu_budget_exceeded: the resource should be released, nothing is recorded.
+    Allocation track(size_t bytes) {
+        const auto owner = currentOwner();
+
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_budget > 0 && _liveBytes + bytes > _budget) {
+            throw gpu_budget_exceeded(owner, bytes, _liveBytes, _budget);
+        }
+        // std::map nodes are stable, the token can keep a pointer to its owner
+        auto& stats = _owners[owner];
+        stats.liveBytes += bytes;
+        stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+        stats.allocations++;
+        _liveBytes += bytes;
+        _peakBytes = std::max(_peakBytes, _liveBytes);
+
+        return Allocation(&stats, [this, bytes](const void* owner) {
+            release((OwnerStats*) owner, bytes);
+        });
+    }
+
+    // Budget for the live bytes of the tracked allocations, zero for none
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _budget = bytes;
+    }
+
+    size_t budget() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _budget;
+    }
+
+    // True if an allocation of bytes fits the budget now
+    bool fits(size_t bytes) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _budget == 0 || _liveBytes + bytes <= _budget;
+    }
+
+    size_t liveBytes() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _liveBytes;
+    }
+
+    size_t peakBytes() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _peakBytes;
+    }
+
+    // The high-water marks start over from the current live bytes, e.g. between the stages of a benchmark
+    void resetPeaks() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _peakBytes = _liveBytes;
+        for (auto& [name, stats] : _owners) {
+            stats.peakBytes = stats.liveBytes;
+        }
+    }
+
+    std::map<std::string, OwnerStats> breakdown() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _owners;
+    }
+
+    void print(std::ostream& os = std::cout) const {
+        const auto owners = breakdown();
+        const auto MB = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+
+        os << std::fixed << std::setprecision(1) << "GPU memory, live: " << MB(liveBytes()) << "MB, peak: "
+           << MB(peakBytes()) << "MB";
+        if (const auto b = budget()) {
+            os << ", budget: " << MB(b) << "MB";
+        }
+        os << std::endl;
+        for (const auto& [name, stats] : owners) {
+            os << std::setw(48) << std::left << name << std::right
+               << " live: " << std::setw(8) << MB(stats.liveBytes) << "MB"
+               << " peak: " << std::setw(8) << MB(stats.peakBytes) << "MB"
+               << " allocations: " << stats.allocations << std::endl;
+        }
+    }
+};
+
+}  // namespace gls
+
+#endif /* gpu_memory_tracker_hpp */
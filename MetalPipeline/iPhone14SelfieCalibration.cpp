@@ -31,32 +31,8 @@ class iPhone14SelfieCalibration : public CameraCalibration<levels> {
 
 public:
     NoiseModel<levels> nlfFromIso(int iso) const override {
-        iso = std::clamp(iso, 20, 2000);
-
-        if (iso >= 20 && iso < 40) {
-            float a = (iso - 20) / 20;
-            return lerp<levels>(NLFData[0], NLFData[1], a);
-        } else if (iso >= 40 && iso < 80) {
-            float a = (iso - 40) / 40;
-            return lerp<levels>(NLFData[1], NLFData[2], a);
-        } else if (iso >= 80 && iso < 160) {
-            float a = (iso - 80) / 80;
-            return lerp<levels>(NLFData[2], NLFData[3], a);
-        } else if (iso >= 160 && iso < 320) {
-            float a = (iso - 160) / 160;
-            return lerp<levels>(NLFData[3], NLFData[4], a);
-        } else if (iso >= 320 && iso < 640) {
-            float a = (iso - 320) / 320;
-            return lerp<levels>(NLFData[4], NLFData[5], a);
-        } else if (iso >= 640 && iso < 1250) {
-            float a = (iso - 640) / 640;
-            return lerp<levels>(NLFData[5], NLFData[6], a);
-        } else if (iso >= 1250 && iso <= 2000) {
-            float a = (iso - 1250) / 750;
-            return lerp<levels>(NLFData[6], NLFData[7], a);
-        } else {
-            throw std::range_error("Unexpected ISO value: " + std::to_string(iso));
-        }
+        static const NoiseModelTable<levels, 8> nlfTable({ 20, 40, 80, 160, 320, 640, 1250, 2000 }, NLFData);
+        return nlfTable(iso);
     }
 
     std::pair<RAWDenoiseParameters, std::array<DenoiseParameters, levels>> getDenoiseParameters(int iso) const override {
@@ -142,6 +118,9 @@ std::unique_ptr<DemosaicParameters> unpackiPhone14SelfieRawImage(const gls::imag
     return calibration.getDemosaicParameters(inputImage, xyz_rgb, dng_metadata, exif_metadata);
 }
 
+std::unique_ptr<CameraCalibration<5>> getiPhone14SelfieCalibration() {
+    return std::make_unique<iPhone14SelfieCalibration<5>>();
+}
 
 // --- NLFData ---
 
@@ -31,35 +31,8 @@ class iPhone14TeleCalibration : public CameraCalibration<levels> {
 
 public:
     NoiseModel<levels> nlfFromIso(int iso) const override {
-        iso = std::clamp(iso, 20, 2500);
-
-        if (iso >= 20 && iso < 32) {
-            float a = (iso - 12) / 12;
-            return lerp<levels>(NLFData[0], NLFData[1], a);
-        } else if (iso >= 32 && iso < 50) {
-            float a = (iso - 14) / 14;
-            return lerp<levels>(NLFData[0], NLFData[1], a);
-        } else if (iso >= 50 && iso < 100) {
-            float a = (iso - 50) / 50;
-            return lerp<levels>(NLFData[1], NLFData[2], a);
-        } else if (iso >= 100 && iso < 200) {
-            float a = (iso - 100) / 100;
-            return lerp<levels>(NLFData[2], NLFData[3], a);
-        } else if (iso >= 200 && iso < 400) {
-            float a = (iso - 200) / 200;
-            return lerp<levels>(NLFData[3], NLFData[4], a);
-        } else if (iso >= 400 && iso < 800) {
-            float a = (iso - 400) / 400;
-            return lerp<levels>(NLFData[4], NLFData[5], a);
-        } else if (iso >= 800 && iso < 1600) {
-            float a = (iso - 800) / 800;
-            return lerp<levels>(NLFData[5], NLFData[6], a);
-        } else if (iso >= 1600 && iso <= 2500) {
-            float a = (iso - 900) / 900;
-            return lerp<levels>(NLFData[6], NLFData[7], a);
-        } else {
-            throw std::range_error("Unexpected ISO value: " + std::to_string(iso));
-        }
+        static const NoiseModelTable<levels, 9> nlfTable({ 20, 32, 50, 100, 200, 400, 800, 1600, 2500 }, NLFData);
+        return nlfTable(iso);
     }
 
     std::pair<RAWDenoiseParameters, std::array<DenoiseParameters, levels>> getDenoiseParameters(int iso) const override {
@@ -31,35 +31,8 @@ class iPhone14WideCalibration : public CameraCalibration<levels> {
 
 public:
     NoiseModel<levels> nlfFromIso(int iso) const override {
-        iso = std::clamp(iso, 50, 12500);
-
-        if (iso >= 50 && iso < 100) {
-            float a = (iso - 50) / 50;
-            return lerp<levels>(NLFData[0], NLFData[1], a);
-        } else if (iso >= 100 && iso < 200) {
-            float a = (iso - 100) / 100;
-            return lerp<levels>(NLFData[1], NLFData[2], a);
-        } else if (iso >= 200 && iso < 400) {
-            float a = (iso - 200) / 200;
-            return lerp<levels>(NLFData[2], NLFData[3], a);
-        } else if (iso >= 400 && iso < 800) {
-            float a = (iso - 400) / 400;
-            return lerp<levels>(NLFData[3], NLFData[4], a);
-        } else if (iso >= 800 && iso < 1600) {
-            float a = (iso - 800) / 800;
-            return lerp<levels>(NLFData[4], NLFData[5], a);
-        } else if (iso >= 1600 && iso < 3200) {
-            float a = (iso - 1600) / 1600;
-            return lerp<levels>(NLFData[5], NLFData[6], a);
-        } else if (iso >= 3200 && iso < 6400) {
-            float a = (iso - 3200) / 3200;
-            return lerp<levels>(NLFData[6], NLFData[7], a);
-        } else if (iso >= 6400 && iso <= 12500) {
-            float a = (iso - 6100) / 6100;
-            return lerp<levels>(NLFData[7], NLFData[8], a);
-        } else {
-            throw std::range_error("Unexpected ISO value: " + std::to_string(iso));
-        }
+        static const NoiseModelTable<levels, 9> nlfTable({ 50, 100, 200, 400, 800, 1600, 3200, 6400, 12500 }, NLFData);
+        return nlfTable(iso);
     }
 
     std::pair<RAWDenoiseParameters, std::array<DenoiseParameters, levels>> getDenoiseParameters(int iso) const override {
@@ -145,6 +118,9 @@ std::unique_ptr<DemosaicParameters> unpackiPhone14WideRawImage(const gls::image<
     return calibration.getDemosaicParameters(inputImage, xyz_rgb, dng_metadata, exif_metadata);
 }
 
+std::unique_ptr<CameraCalibration<5>> getiPhone14WideCalibration() {
+    return std::make_unique<iPhone14WideCalibration<5>>();
+}
 
 // --- NLFData ---
 
@@ -0,0 +1,81 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef lens_distortion_hpp
+#define lens_distortion_hpp
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <optional>
+#include <vector>
+
+#include "dng_opcode_list.hpp"
+#include "gls_image.hpp"
+
+// Radial and tangential lens model of the DNG WarpRectilinear opcode (opcode ID 1, in OpcodeList3): the pixel of the
+// corrected image at p samples the captured image at
+//
+//   c + m * (f(r^2) * d + t(d))
+//
+// with d = (p - c) / m, r = |d|, c the optical center and m the largest distance from the center to the image corners;
+// f(r^2) = kr0 + kr1 * r^2 + kr2 * r^4 + kr3 * r^6 and t(d) = (kt0 * 2 dx dy + kt1 * (r^2 + 2 dx^2),
+// kt1 * 2 dx dy + kt0 * (r^2 + 2 dy^2)). The model is independent of the image scale, the warps evaluate it in the
+// coordinates of the image they resample, see WarpTransform in demosaic_kernels.hpp.
+struct LensDistortion {
+    std::array<float, 4> radial = { 1, 0, 0, 0 };
+    std::array<float, 2> tangential = { 0, 0 };
+    // Optical center, relative to the image size
+    std::array<float, 2> center = { 0.5, 0.5 };
+
+    bool isIdentity() const {
+        return radial == std::array<float, 4> { 1, 0, 0, 0 } && tangential == std::array<float, 2> { 0, 0 };
+    }
+
+    // The model of the first WarpRectilinear of a DNG OpcodeList3, the coefficients of its first plane: the planes
+    // only differ for the lateral chromatic aberration, which isn't corrected. Returns nothing if the list has no
+    // WarpRectilinear, throws on a malformed list.
+    static std::optional<LensDistortion> fromDNGOpcodeList(const std::vector<uint8_t>& opcodeList) {
+        std::optional<LensDistortion> distortion;
+        forEachDNGOpcode(opcodeList, [&](uint32_t opcodeID, DNGOpcodeReader* reader) {
+            if (opcodeID != kWarpRectilinearOpcode || distortion) {
+                return;
+            }
+            const uint32_t planes = reader->u32();
+            if (planes == 0) {
+                throw std::runtime_error("LensDistortion: invalid WarpRectilinear opcode");
+            }
+            LensDistortion model;
+            for (uint32_t p = 0; p < planes; p++) {
+                std::array<float, 6> coefficients;
+                for (auto& coefficient : coefficients) {
+                    coefficient = (float) reader->f64();
+                }
+                if (p == 0) {
+                    model.radial = { coefficients[0], coefficients[1], coefficients[2], coefficients[3] };
+                    model.tangential = { coefficients[4], coefficients[5] };
+                }
+            }
+            model.center = { (float) reader->f64(), (float) reader->f64() };
+            distortion = model;
+        });
+        return distortion;
+    }
+
+private:
+    static constexpr uint32_t kWarpRectilinearOpcode = 1;
+};
+
+#endif /* lens_distortion_hpp */
@@ -0,0 +1,184 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef lens_shading_hpp
+#define lens_shading_hpp
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dng_opcode_list.hpp"
+#include "gls_image.hpp"
+
+// Lens shading gains of the raw channels on a regular grid spanning the frame, texel (x, y) is centered at
+// ((x + 0.5) / width, (y + 0.5) / height) in normalized frame coordinates. The channels are in raw order: red, green,
+// blue, green2, see bayerOffsets. The GPU pipeline samples it bilinearly, see LensShadingMap in demosaic_kernels.hpp.
+struct LensShadingGainMap {
+    // Texels on the long side of the frame, the falloff of phone lenses is smooth at this scale
+    static constexpr int kMaxSize = 64;
+
+    int width = 0;
+    int height = 0;
+    std::vector<std::array<float, 4>> gains;
+
+    LensShadingGainMap(int _width, int _height) : width(_width), height(_height), gains(_width * _height, { 1, 1, 1, 1 }) { }
+
+    std::array<float, 4>& operator() (int x, int y) {
+        return gains[y * width + x];
+    }
+
+    const std::array<float, 4>& operator() (int x, int y) const {
+        return gains[y * width + x];
+    }
+
+    // Grid with the aspect ratio of the frame
+    static gls::size gridSize(const gls::size& frameSize) {
+        const float aspect = frameSize.height / (float) std::max(frameSize.width, 1);
+        return aspect <= 1 ? gls::size { kMaxSize, std::max((int) std::round(kMaxSize * aspect), 2) }
+                           : gls::size { std::max((int) std::round(kMaxSize / aspect), 2), kMaxSize };
+    }
+
+    // The calibration's radial falloff 1 + lensShadingCorrection * r^2, r is the distance from the frame center
+    // normalized to the half diagonal, the same gain for all the channels
+    static LensShadingGainMap radial(const gls::size& frameSize, float lensShadingCorrection) {
+        const auto size = gridSize(frameSize);
+        LensShadingGainMap map(size.width, size.height);
+
+        // Integer center, as in lensShadingGeometry
+        const float cx = frameSize.width / 2;
+        const float cy = frameSize.height / 2;
+        const float inverseHalfDiagonal = 1 / std::sqrt(cx * cx + cy * cy);
+        for (int y = 0; y < map.height; y++) {
+            for (int x = 0; x < map.width; x++) {
+                const float px = (x + 0.5f) / map.width * frameSize.width;
+                const float py = (y + 0.5f) / map.height * frameSize.height;
+                const float r = std::hypot(px - cx, py - cy) * inverseHalfDiagonal;
+                const float gain = 1 + lensShadingCorrection * r * r;
+                map(x, y) = { gain, gain, gain, gain };
+            }
+        }
+        return map;
+    }
+
+    // The GainMap opcodes (opcode ID 9) of a DNG OpcodeList (OpcodeList2 applies to the raw data), resampled on the
+    // grid. channelOffsets are the pixel offsets of the raw channels in their Bayer quad, e.g. bayerOffsets[pattern]:
+    // maps with a pitch of two pixels apply to the channel of their area's origin, the others to all the channels.
+    // The maps of a channel multiply, as the opcodes are applied in sequence. Returns nullptr if the list has no gain
+    // maps, throws on a malformed list.
+    static std::shared_ptr<const LensShadingGainMap> fromDNGOpcodeList(const std::vector<uint8_t>& opcodeList,
+                                                                       const gls::size& imageSize,
+                                                                       const gls::point channelOffsets[4]) {
+        if (opcodeList.empty()) {
+            return nullptr;
+        }
+
+        const auto size = gridSize(imageSize);
+        auto map = std::make_shared<LensShadingGainMap>(size.width, size.height);
+        bool hasGainMap = false;
+        forEachDNGOpcode(opcodeList, [&](uint32_t opcodeID, DNGOpcodeReader* reader) {
+            if (opcodeID == kGainMapOpcode) {
+                applyGainMap(reader, imageSize, channelOffsets, map.get());
+                hasGainMap = true;
+            }
+        });
+        return hasGainMap ? map : nullptr;
+    }
+
+private:
+    static constexpr uint32_t kGainMapOpcode = 9;
+
+    static void applyGainMap(DNGOpcodeReader* reader, const gls::size& imageSize, const gls::point channelOffsets[4],
+                             LensShadingGainMap* map) {
+        const int top = reader->u32();
+        const int left = reader->u32();
+        const int bottom = reader->u32();
+        const int right = reader->u32();
+        reader->u32();  // Plane
+        reader->u32();  // Planes
+        const int rowPitch = reader->u32();
+        const int colPitch = reader->u32();
+        const int pointsV = reader->u32();
+        const int pointsH = reader->u32();
+        const double spacingV = reader->f64();
+        const double spacingH = reader->f64();
+        const double originV = reader->f64();
+        const double originH = reader->f64();
+        const int mapPlanes = reader->u32();
+        if (pointsV <= 0 || pointsH <= 0 || mapPlanes <= 0 || rowPitch <= 0 || colPitch <= 0) {
+            throw std::runtime_error("LensShadingGainMap: invalid GainMap opcode");
+        }
+        // Only the first plane of the map, the planes of a CFA image are its channels
+        std::vector<float> gains(pointsV * pointsH);
+        for (int v = 0; v < pointsV; v++) {
+            for (int h = 0; h < pointsH; h++) {
+                gains[v * pointsH + h] = reader->f32();
+                for (int p = 1; p < mapPlanes; p++) {
+                    reader->f32();
+                }
+            }
+        }
+
+        // Channels of the area's origin, all of them for a map applying to every pixel
+        std::array<bool, 4> channels = { true, true, true, true };
+        if (rowPitch == 2 && colPitch == 2) {
+            for (int c = 0; c < 4; c++) {
+                channels[c] = channelOffsets[c].x == (left & 1) && channelOffsets[c].y == (top & 1);
+            }
+        }
+
+        // Bilinear interpolation of the map, clamped to its edges, in coordinates relative to the image
+        const auto sample = [&](double v, double h) {
+            const double mv = std::clamp((v - originV) / (spacingV > 0 ? spacingV : 1), 0.0, (double) pointsV - 1);
+            const double mh = std::clamp((h - originH) / (spacingH > 0 ? spacingH : 1), 0.0, (double) pointsH - 1);
+            const int v0 = std::min((int) mv, pointsV - 1);
+            const int h0 = std::min((int) mh, pointsH - 1);
+            const int v1 = std::min(v0 + 1, pointsV - 1);
+            const int h1 = std::min(h0 + 1, pointsH - 1);
+            const double fv = mv - v0;
+            const double fh = mh - h0;
+            const double g0 = std::lerp(gains[v0 * pointsH + h0], gains[v0 * pointsH + h1], fh);
+            const double g1 = std::lerp(gains[v1 * pointsH + h0], gains[v1 * pointsH + h1], fh);
+            return (float) std::lerp(g0, g1, fv);
+        };
+
+        for (int y = 0; y < map->height; y++) {
+            for (int x = 0; x < map->width; x++) {
+                const double v = (y + 0.5) / map->height;
+                const double h = (x + 0.5) / map->width;
+                // Pixels outside of the opcode's area are not corrected
+                const int py = (int) (v * imageSize.height);
+                const int px = (int) (h * imageSize.width);
+                if (py < top || py >= bottom || px < left || px >= right) {
+                    continue;
+                }
+                const float gain = sample(v, h);
+                for (int c = 0; c < 4; c++) {
+                    if (channels[c]) {
+                        (*map)(x, y)[c] *= gain;
+                    }
+                }
+            }
+        }
+    }
+};
+
+#endif /* lens_shading_hpp */
@@ -0,0 +1,244 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef noise_model_cache_hpp
+#define noise_model_cache_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "demosaic.hpp"
+
+// Persistent store of the noise models measured with calibrateFromImage, keyed by camera model,
+// ISO and exposure time. The measurements of a unit refine the camera's static nlfFromIso tables:
+// lookups blend the cached model with the static one, with a weight growing with the number of
+// measurements, so that regular captures get per-unit accuracy without measuring the image.
+//
+// File layout, native endian: "GLNM", version, entry count, then for every entry the camera model
+// (length + bytes), iso, exposure time, measurement count and the NoiseModel coefficients.
+class NoiseModelCache {
+public:
+    static constexpr size_t levels = 5;
+    typedef NoiseModel<levels> noiseModel;
+
+    struct Key {
+        std::string cameraModel;
+        int iso = 0;
+        float exposureTime = 0;
+    };
+
+    // Exposure times within a third of a stop share an entry
+    static constexpr float kExposureTolerance = 1.0 / 3.0;
+    // Measurements after which the cached model fully replaces the static one
+    static constexpr int kConvergedSamples = 8;
+
+private:
+    static constexpr uint32_t kMagic = 'G' | 'L' << 8 | 'N' << 16 | 'M' << 24;
+    static constexpr uint32_t kVersion = 1;
+
+    struct Entry {
+        Key key;
+        int samples = 0;
+        noiseModel model;
+    };
+
+    const std::filesystem::path _path;
+    std::vector<Entry> _entries;
+    mutable std::mutex _mutex;
+    bool _dirty = false;
+
+    static float exposureDistance(float a, float b) {
+        if (a <= 0 || b <= 0) {
+            return a == b ? 0 : INFINITY;
+        }
+        return std::abs(std::log2(a / b));
+    }
+
+    const Entry* find(const Key& key) const {
+        const Entry* best = nullptr;
+        float bestDistance = kExposureTolerance;
+        for (const auto& entry : _entries) {
+            if (entry.key.iso != key.iso || entry.key.cameraModel != key.cameraModel) {
+                continue;
+            }
+            const float distance = exposureDistance(entry.key.exposureTime, key.exposureTime);
+            if (distance <= bestDistance) {
+                bestDistance = distance;
+                best = &entry;
+            }
+        }
+        return best;
+    }
+
+    Entry* find(const Key& key) {
+        return const_cast<Entry*>(static_cast<const NoiseModelCache*>(this)->find(key));
+    }
+
+    // All the model's coefficients in a fixed order, for the running average and the serialization
+    template <typename F>
+    static void forEachCoefficient(noiseModel& model, F f) {
+        for (int c = 0; c < 4; c++) {
+            f(model.rawNlf.first[c]);
+            f(model.rawNlf.second[c]);
+        }
+        for (auto& nlf : model.pyramidNlf) {
+            for (int c = 0; c < 3; c++) {
+                f(nlf.first[c]);
+                f(nlf.second[c]);
+            }
+        }
+    }
+
+    template <typename T>
+    static bool read(std::istream& is, T* value) {
+        return (bool) is.read(reinterpret_cast<char*>(value), sizeof(T));
+    }
+
+    template <typename T>
+    static void write(std::ostream& os, const T& value) {
+        os.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    bool load() {
+        std::ifstream is(_path, std::ios::binary);
+        if (!is) {
+            return false;
+        }
+        uint32_t magic, version, count;
+        if (!read(is, &magic) || magic != kMagic || !read(is, &version) || version != kVersion || !read(is, &count)) {
+            return false;
+        }
+        std::vector<Entry> entries(count);
+        for (auto& entry : entries) {
+            uint32_t length;
+            if (!read(is, &length) || length > 1024) {
+                return false;
+            }
+            entry.key.cameraModel.resize(length);
+            if (!is.read(entry.key.cameraModel.data(), length) || !read(is, &entry.key.iso) ||
+                !read(is, &entry.key.exposureTime) || !read(is, &entry.samples)) {
+                return false;
+            }
+            bool valid = true;
+            forEachCoefficient(entry.model, [&](float& v) { valid = valid && read(is, &v); });
+            if (!valid) {
+                return false;
+            }
+        }
+        _entries = std::move(entries);
+        return true;
+    }
+
+public:
+    // Loads the cache file if present, an unreadable file starts an empty cache
+    NoiseModelCache(const std::filesystem::path& path) : _path(path) {
+        if (std::filesystem::exists(_path) && !load()) {
+            std::cout << "NoiseModelCache: ignoring invalid cache file " << _path << std::endl;
+            _entries.clear();
+        }
+    }
+
+    NoiseModelCache(const NoiseModelCache&) = delete;
+    NoiseModelCache& operator=(const NoiseModelCache&) = delete;
+
+    std::optional<noiseModel> lookup(const Key& key, int* samples = nullptr) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        const auto entry = find(key);
+        if (samples) {
+            *samples = entry ? entry->samples : 0;
+        }
+        return entry ? std::optional<noiseModel>(entry->model) : std::nullopt;
+    }
+
+    // The static table's model refined by the cached measurements, if any
+    noiseModel blend(const noiseModel& staticModel, const Key& key) const {
+        int samples;
+        const auto cached = lookup(key, &samples);
+        if (!cached) {
+            return staticModel;
+        }
+        const float weight = std::min(samples / (float) kConvergedSamples, 1.0f);
+        return lerp<levels>(staticModel, *cached, weight);
+    }
+
+    // Folds a new measurement in the running average of its entry
+    void insert(const Key& key, const noiseModel& measured) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto entry = find(key);
+        if (!entry) {
+            _entries.push_back({ key, 0, measured });
+            entry = &_entries.back();
+        }
+        entry->samples++;
+        if (entry->samples > 1) {
+            std::vector<float> values;
+            auto m = measured;
+            forEachCoefficient(m, [&](float& v) { values.push_back(v); });
+            const float a = 1.0f / entry->samples;
+            int i = 0;
+            forEachCoefficient(entry->model, [&](float& v) { v = std::lerp(v, values[i++], a); });
+        }
+        _dirty = true;
+    }
+
+    // Writes the cache to a temporary file replacing the previous one, so an interrupted save never
+    // corrupts the store
+    void save() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_dirty) {
+            return;
+        }
+        auto tmpPath = _path;
+        tmpPath += ".tmp";
+        {
+            std::ofstream os(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!os) {
+                throw std::runtime_error("NoiseModelCache: can't write " + tmpPath.string());
+            }
+            write(os, kMagic);
+            write(os, kVersion);
+            write(os, (uint32_t) _entries.size());
+            for (auto& entry : _entries) {
+                write(os, (uint32_t) entry.key.cameraModel.size());
+                os.write(entry.key.cameraModel.data(), entry.key.cameraModel.size());
+                write(os, entry.key.iso);
+                write(os, entry.key.exposureTime);
+                write(os, entry.samples);
+                forEachCoefficient(entry.model, [&](float& v) { write(os, v); });
+            }
+            if (!os) {
+                throw std::runtime_error("NoiseModelCache: failed writing " + tmpPath.string());
+            }
+        }
+        std::filesystem::rename(tmpPath, _path);
+        _dirty = false;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _entries.size();
+    }
+};
+
+#endif /* noise_model_cache_hpp */
@@ -13,40 +13,80 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
 #include <iomanip>
+#include <utility>
 
+#include "cpu_pyramid_levels.hpp"
+#include "gls_content_hash.hpp"
+#include "gls_debug_dump.hpp"
 #include "gls_logging.h"
 #include "pyramid_processor.hpp"
-#include "PCA.hpp"
 
 static const char* TAG = "DEMOSAIC";
 
 template <size_t levels>
-PyramidProcessor<levels>::PyramidProcessor(MetalContext* context, int _width, int _height)
-    : width(_width), height(_height), fusedFrames(0),
+PyramidProcessor<levels>::PyramidProcessor(MetalContext* context, int _width, int _height,
+                                           gls::transient_heap* transientHeap, int denoiseStage,
+                                           gls::texture_precision _precision, bool _halfResolutionGradients)
+    : width(_width), height(_height), precision(_precision), halfResolutionGradients(_halfResolutionGradients),
+    fusedFrames(0),
     _denoiseImage(context),
-    _collectPatches(context),
+    _copyImage(context),
+    _pcaSpace(context),
     _pcaProjection(context),
     _blockMatchingDenoiseImage(context),
     _subtractNoiseImage(context),
+    _subtractNoiseImage420(context),
+    _blockMatchingDenoiseImage420(context),
+    _mergeYCbCr420(context),
     _resampleImage(context, "downsampleImageXYZ"),
     _resampleGradientImage(context, "downsampleImageXY"),
+    _buildPyramids(context),
     _basicNoiseStatistics(context),
-    _hfNoiseTransferImage(context, 0.4)
+    _hfNoiseTransferImage(context, 0.4),
+    _fusePyramidLevel(context),
+    _alignTiles(context),
+    _noiseStatisticsReduction(context)
 {
+    gls::GPUMemoryTracker::Scope scope("PyramidProcessor");
     auto mtlDevice = context->device();
+    const int gradientScale = halfResolutionGradients ? 2 : 1;
     for (int i = 0, scale = 2; i < levels - 1; i++, scale *= 2) {
-        imagePyramid[i] = std::make_unique<imageType>(mtlDevice, width / scale, height / scale);
-        gradientPyramid[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(
-            mtlDevice, width / scale, height / scale);
+        imagePyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, width / scale, height / scale, precision);
+        gradientPyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(
+            mtlDevice, width / (gradientScale * scale), height / (gradientScale * scale), precision);
     }
     for (int i = 0, scale = 1; i < levels; i++, scale *= 2) {
         denoisedImagePyramid[i] = std::make_unique<imageType>(mtlDevice, width / scale, height / scale);
-        subtractedImagePyramid[i] = std::make_unique<imageType>(mtlDevice, width / scale, height / scale);
-        pcaImagePyramid[i] = std::make_unique<gls::mtl_image_2d<gls::pixel<uint32_t, 4>>>(mtlDevice, width / scale, height / scale);
+        if (transientHeap) {
+            transientHeap->add(&subtractedImagePyramid[i], width / scale, height / scale, denoiseStage, denoiseStage, precision);
+        } else {
+            subtractedImagePyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, width / scale, height / scale, precision);
+        }
+        pcaImagePyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel<uint32_t, 4>>>(mtlDevice, width / scale, height / scale);
+    }
+
+    allocatePcaPartialSums(mtlDevice);
+    for (int i = 0; i < levels; i++) {
+        pcaSpace[i] = std::make_unique<gls::Buffer<std::array<float16_t, pcaSpaceSize>>>(mtlDevice, pcaPatchSize);
+        pcaBasisState[i] = std::make_unique<gls::Buffer<pcaSpaceKernel::pca_basis_state>>(mtlDevice, 1);
+        *pcaBasisState[i]->data() = { .capturedVariance = 0, .refreshes = 0 };
     }
+    levelPlan.fill(LevelDenoise::blockMatching);
+}
 
-    pcaPatches = std::make_unique<gls::Buffer<std::array<float, pcaPatchSize>>>(context->device(), width * height / 64);
+template <size_t levels>
+void PyramidProcessor<levels>::allocatePcaPartialSums(MTL::Device* mtlDevice) {
+    // The stride changes with the level size, the smaller levels can have more partial groups
+    size_t size = 0;
+    for (int i = 0, scale = 1; i < levels; i++, scale *= 2) {
+        size = std::max(size, pcaSpaceKernel::partialSumsSize(gls::size {width / scale, height / scale}, pcaSampleBudget));
+    }
+    if (!pcaPartialSums || pcaPartialSums->size() < size) {
+        gls::GPUMemoryTracker::Scope scope("PyramidProcessor");
+        pcaPartialSums = std::make_unique<gls::Buffer<float>>(mtlDevice, size);
+    }
 }
 
 gls::Vector<3> nflMultiplier(const DenoiseParameters& denoiseParameters) {
@@ -58,119 +98,603 @@ gls::Vector<3> nflMultiplier(const DenoiseParameters& denoiseParameters) {
 #if DEBUG_PYRAMID
 extern const gls::Matrix<3, 3> ycbcr_srgb;
 
-void dumpYCbCrImage(const gls::mtl_image_2d<gls::pixel_float4>& image) {
-    gls::image<gls::rgb_pixel> out(image.width, image.height);
-    const auto downsampledCPU = image.mapImage();
-    out.apply([&downsampledCPU](gls::rgb_pixel* p, int x, int y) {
-        const auto& ip = downsampledCPU[y][x];
-        const auto& v = ycbcr_srgb * gls::Vector<3>{ip.x, ip.y, ip.z};
-        *p = gls::rgb_pixel{(uint8_t)(255 * std::sqrt(std::clamp(v[0], 0.0f, 1.0f))),
-                            (uint8_t)(255 * std::sqrt(std::clamp(v[1], 0.0f, 1.0f))),
-                            (uint8_t)(255 * std::sqrt(std::clamp(v[2], 0.0f, 1.0f)))};
+void dumpYCbCrImage(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& image) {
+    gls::DebugDumpService::shared().dump(context, image, "pyramid_7x7.png",
+                                         [](const gls::image<gls::pixel_float4>& image, const std::string& path) {
+        gls::image<gls::rgb_pixel> out(image.width, image.height);
+        out.apply([&image](gls::rgb_pixel* p, int x, int y) {
+            const auto& ip = image[y][x];
+            const auto& v = ycbcr_srgb * gls::Vector<3>{ip.x, ip.y, ip.z};
+            *p = gls::rgb_pixel{(uint8_t)(255 * std::sqrt(std::clamp(v[0], 0.0f, 1.0f))),
+                                (uint8_t)(255 * std::sqrt(std::clamp(v[1], 0.0f, 1.0f))),
+                                (uint8_t)(255 * std::sqrt(std::clamp(v[2], 0.0f, 1.0f)))};
+        });
+        out.write_png_file(path);
     });
-    image.unmapImage(downsampledCPU);
-    static int count = 1;
-    out.write_png_file("/Users/fabio/pyramid_7x7" + std::to_string(count++) + ".png");
 }
 
-void dumpGradientImage(const gls::mtl_image_2d<gls::pixel_float2>& image);
-
 #endif  // DEBUG_PYRAMID
 
-void savePatchMap(const gls::mtl_image_2d<gls::pixel_float4>& denoisedImage) {
-    gls::image<gls::luma_pixel> out(denoisedImage.width, denoisedImage.height);
-    const auto denoisedImageCPU = denoisedImage.mapImage();
-    out.apply([&denoisedImageCPU](gls::luma_pixel* p, int x, int y) {
-        const auto& ip = (*denoisedImageCPU)[y][x];
-        *p = gls::luma_pixel{(uint8_t)(ip.w)};
+void savePatchMap(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& denoisedImage) {
+    gls::DebugDumpService::shared().dump(context, denoisedImage, "patch_map.png",
+                                         [](const gls::image<gls::pixel_float4>& image, const std::string& path) {
+        gls::image<gls::luma_pixel> out(image.width, image.height);
+        out.apply([&image](gls::luma_pixel* p, int x, int y) {
+            *p = gls::luma_pixel{(uint8_t)(image[y][x].w)};
+        });
+        out.write_png_file(path);
     });
-    // denoisedImage.unmapImage(denoisedImageCPU);
-    static int count = 1;
-    out.write_png_file("/Users/fabio/patch_map" + std::to_string(count++) + ".png");
 }
 
 // TODO: Make this a tunable
 static const constexpr float lumaDenoiseWeight[4] = {1, 1, 1, 1};
 
 template <size_t levels>
-typename PyramidProcessor<levels>::imageType* PyramidProcessor<levels>::denoise(
-    MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters, const imageType& image,
-    const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, std::array<YCbCrNLF, levels>* nlfParameters,
-    float exposure_multiplier, float lensShadingCorrection, bool calibrateFromImage) {
-    std::array<gls::Vector<3>, levels> thresholdMultipliers;
+bool PyramidProcessor<levels>::setPurgeable(bool purgeable) {
+    const auto state = purgeable ? MTL::PurgeableStateVolatile : MTL::PurgeableStateNonVolatile;
+    bool retained = true;
+    const auto mark = [&](const auto& resources) {
+        for (const auto& resource : resources) {
+            if (resource && resource->setPurgeableState(state) == MTL::PurgeableStateEmpty) {
+                retained = false;
+            }
+        }
+    };
+    mark(imagePyramid);
+    mark(gradientPyramid);
+    mark(subtractedImagePyramid);
+    mark(subtractedLumaPyramid);
+    mark(subtractedChromaPyramid);
+    mark(denoisedImagePyramid);
+    mark(pcaImagePyramid);
+    mark(pcaCompactImagePyramid);
+    mark(pcaSpace);
+    mark(cpuInputPyramid);
+    mark(cpuGradientPyramid);
+    mark(fusionImagePyramidA);
+    mark(fusionImagePyramidB);
+    mark(fusionReferenceGradientPyramid);
+    mark(motionFieldPyramid);
+
+    if (!purgeable && !retained) {
+        denoiseInputKey.reset();
+        pyramidKey.reset();
+        levelKeys = {};
+        pcaBasisScene = {};
+        fusedFrames = 0;
+    }
+    return retained;
+}
 
-    // Create gaussian image pyramid an setup noise model
+template <size_t levels>
+float PyramidProcessor<levels>::levelNoise(const YCbCrNLF& nlf, const gls::Vector<3>& thresholdMultipliers) {
+    float variance = 0;
+    for (int c = 0; c < 3; c++) {
+        variance = std::max(variance, (nlf.first[c] + 0.5f * nlf.second[c]) * thresholdMultipliers[c]);
+    }
+    return std::sqrt(variance);
+}
+
+template <size_t levels>
+std::array<typename PyramidProcessor<levels>::LevelDenoise, levels> PyramidProcessor<levels>::planLevels(
+    const std::array<YCbCrNLF, levels>& nlfParameters, const std::array<gls::Vector<3>, levels>& thresholdMultipliers) const {
+    std::array<LevelDenoise, levels> plan;
     for (int i = 0; i < levels; i++) {
-        const auto currentLayer = i > 0 ? imagePyramid[i - 1].get() : &image;
-        const auto currentGradientLayer = i > 0 ? gradientPyramid[i - 1].get() : &gradientImage;
+        const float noise = levelNoise(nlfParameters[i], thresholdMultipliers[i]);
+        if (i > 0 && noise < copyNoise) {
+            plan[i] = LevelDenoise::copy;
+        } else if (!usePatchSimiliarity || noise < blockMatchingNoise) {
+            plan[i] = LevelDenoise::denoise;
+        } else {
+            plan[i] = LevelDenoise::blockMatching;
+        }
+    }
+    return plan;
+}
+
+template <size_t levels>
+void PyramidProcessor<levels>::buildPyramids(MetalContext* context, const imageType& image,
+                                             const gls::mtl_image_2d<gls::pixel_float2>& gradientImage) {
+    // Set by denoise for its input
+    pyramidKey.reset();
+
+    // The image and gradient pyramids are built concurrently, each level depends on the previous one
+    MetalContext::ConcurrentScope concurrent(context);
+
+    if constexpr (levels == 5) {
+        // All the lower levels of both pyramids in a single pass, the fused kernel's tiles are laid out on the
+        // image levels: half resolution gradients go through their own resampling chain
+        _buildPyramids(context, image, gradientImage, imagePyramid, gradientPyramid, !halfResolutionGradients);
+        if (halfResolutionGradients) {
+            for (int i = 0; i < levels - 1; i++) {
+                _resampleGradientImage(context, i > 0 ? *gradientPyramid[i - 1] : gradientImage, gradientPyramid[i].get());
+                context->barrier();
+            }
+        } else {
+            context->barrier();
+        }
+    } else {
+        for (int i = 0; i < levels - 1; i++) {
+            const auto currentLayer = i > 0 ? imagePyramid[i - 1].get() : &image;
+            const auto currentGradientLayer = i > 0 ? gradientPyramid[i - 1].get() : &gradientImage;
 
-        if (i < levels - 1) {
             // Generate next layer in the pyramid
             _resampleImage(context, *currentLayer, imagePyramid[i].get());
             _resampleGradientImage(context, *currentGradientLayer, gradientPyramid[i].get());
+            context->barrier();
         }
+    }
+}
 
-        if (calibrateFromImage) {
-            // Use the denoisedImagePyramid to collect the noise statistics
-            (*nlfParameters)[i] =
-                MeasureYCbCrNLF(context, *currentLayer, denoisedImagePyramid[i].get(), exposure_multiplier);
-        }
+template <size_t levels>
+typename PyramidProcessor<levels>::imageType* PyramidProcessor<levels>::denoise(
+    MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters, const imageType& image,
+    const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, std::array<YCbCrNLF, levels>* nlfParameters,
+    float exposure_multiplier, const LensShading& lensShading, bool calibrateFromImage) {
+    // The noise statistics are collected in the denoised levels, nothing can be reused
+    auto inputKey = std::exchange(denoiseInputKey, std::nullopt);
+    if (calibrateFromImage) {
+        inputKey.reset();
+    }
 
-        thresholdMultipliers[i] = nflMultiplier((*denoiseParameters)[i]);
+    // Create gaussian image pyramid an setup noise model
+    if (!inputKey || inputKey != pyramidKey) {
+        buildPyramids(context, image, gradientImage);
+        pyramidKey = inputKey;
     }
 
-    // Denoise pyramid layers from the bottom to the top, subtracting the noise of the previous layer from the next
-    for (int i = levels - 1; i >= 0; i--) {
-        const auto denoiseInput = i > 0 ? imagePyramid[i - 1].get() : &image;
-        const auto gradientInput = i > 0 ? gradientPyramid[i - 1].get() : &gradientImage;
-
-        if (i < levels - 1) {
-            const auto np = YCbCrNLF{(*nlfParameters)[i].first * thresholdMultipliers[i],
-                                     (*nlfParameters)[i].second * thresholdMultipliers[i]};
-            _subtractNoiseImage(context, *denoiseInput, *(imagePyramid[i]), *(denoisedImagePyramid[i + 1]),
-                                *gradientInput, lumaDenoiseWeight[i], (*denoiseParameters)[i].sharpening,
-                                {np.first[0], np.second[0]}, subtractedImagePyramid[i].get());
-        }
+    std::array<const imageType*, levels> inputs;
+    std::array<const gls::mtl_image_2d<gls::pixel_float2>*, levels> gradients;
+    for (int i = 0; i < levels; i++) {
+        inputs[i] = i > 0 ? imagePyramid[i - 1].get() : &image;
+        gradients[i] = i > 0 ? gradientPyramid[i - 1].get() : &gradientImage;
 
-        const auto layerImage = i < levels - 1 ? subtractedImagePyramid[i].get() : denoiseInput;
+        if (calibrateFromImage && i < activeLevels()) {
+            // Use the denoisedImagePyramid to collect the noise statistics
+            (*nlfParameters)[i] = MeasureYCbCrNLF(context, *inputs[i], denoisedImagePyramid[i].get(), exposure_multiplier);
+        }
+    }
 
-        if (usePatchSimiliarity) {
-            assert(layerImage->size() == pcaImagePyramid[i]->size());
+    return denoisePyramid(context, denoiseParameters, inputs, gradients, *nlfParameters, lensShading, inputKey);
+}
 
-            const auto imageCPU = layerImage->mapImage();
+template <size_t levels>
+typename PyramidProcessor<levels>::imageType* PyramidProcessor<levels>::denoisePyramid(
+    MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters,
+    const std::array<const imageType*, levels>& inputs,
+    const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, levels>& gradients,
+    const std::array<YCbCrNLF, levels>& nlfParameters, const LensShading& lensShading, std::optional<uint64_t> inputKey) {
+    std::array<gls::Vector<3>, levels> thresholdMultipliers;
+    for (int i = 0; i < levels; i++) {
+        thresholdMultipliers[i] = nflMultiplier((*denoiseParameters)[i]);
+    }
+    const int active = activeLevels();
+    const int components = std::clamp(pcaComponents, 1, pcaSpaceSize);
+    denoiseInputs = inputs;
+    levelPlan = planLevels(nlfParameters, thresholdMultipliers);
+    allocatePcaPartialSums(context->device());
+
+    if (std::any_of(levelPlan.begin(), levelPlan.begin() + active, [](LevelDenoise d) { return d != LevelDenoise::blockMatching; })) {
+        static const char* planNames[] = { "block matching", "denoise", "copy" };
+        std::string plan;
+        for (int i = 0; i < active; i++) {
+            plan += (i > 0 ? ", " : "") + std::to_string(i) + ": " + planNames[(int) levelPlan[i]];
+        }
+        LOG_INFO(TAG) << "Pyramid level plan - " << plan << std::endl;
+    }
 
-            const int sample_size = imageCPU->width * imageCPU->height / 64;
+    // Each level depends on its own inputs and on the coarser levels: the key of a level chains the ones above it
+    std::array<std::optional<uint64_t>, levels> keys = {};
+    if (inputKey) {
+        gls::ContentHash hash;
+        hash.add(*inputKey);
+        hash.add(active);
+        hash.add(components);
+        hash.add(pcaBasisLevel);
+        hash.add(pcaSampleBudget);
+        hash.add(chroma420);
+        for (int i = 0; i < levels; i++) {
+            hash.add(compactPcaFeatures[i]);
+        }
+        hash.add(lensShading.gainMap);
+        hash.add(lensShading.enabled);
+        for (int c = 0; c < 4; c++) {
+            hash.add(lensShading.geometry[c]);
+        }
+        for (int i = active - 1; i >= 0; i--) {
+            const auto& dp = (*denoiseParameters)[i];
+            hash.add(levelPlan[i]);
+            hash.add(nlfParameters[i].first);
+            hash.add(nlfParameters[i].second);
+            hash.add(thresholdMultipliers[i]);
+            hash.add(dp.chromaBoost);
+            hash.add(dp.gradientBoost);
+            hash.add(dp.gradientThreshold);
+            hash.add(dp.sharpening);
+            keys[i] = hash.value;
+        }
+    }
+    recomputedLevels = 0;
+
+    // The CPU levels and the GPU work waiting for them are in one batch
+    const int cpuFirst = active - std::clamp(cpuLevels, 0, active - 1);
+    std::optional<MetalContext::BatchScope> cpuBatch;
+    if (cpuFirst < active) {
+        cpuBatch.emplace(context);
+
+        // The keys chain from the coarse levels, the levels to recompute are the finer ones
+        int top = cpuFirst - 1;
+        for (int i = active - 1; i >= cpuFirst; i--) {
+            if (!keys[i] || keys[i] != levelKeys[i]) {
+                top = i;
+                break;
+            }
+        }
+        if (top >= cpuFirst) {
+            encodeCpuLevels(context, cpuFirst, top, *denoiseParameters, inputs, gradients, nlfParameters,
+                            thresholdMultipliers, lensShading);
+            recomputedLevels += top - cpuFirst + 1;
+        }
+    }
 
-            assert(pcaPatches->size() >= sample_size);
+    // Denoise pyramid layers from the bottom to the top, subtracting the noise of the previous layer from the next
+    for (int i = active - 1; i >= 0; i--) {
+        if (i >= cpuFirst || (keys[i] && keys[i] == levelKeys[i])) {
+            if (levelDenoised) {
+                levelDenoised(context, i);
+            }
+            continue;
+        }
+        recomputedLevels++;
+
+        MetalContext::TraceScope trace(context, "pyramid level " + std::to_string(i));
+        const auto denoiseInput = inputs[i];
+        const auto gradientInput = gradients[i];
+
+        const bool subtracted420 = chroma420 && i < active - 1;
+        if (subtracted420 && !subtractedLumaPyramid[i]) {
+            gls::GPUMemoryTracker::Scope scope("PyramidProcessor");
+            subtractedLumaPyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float>>(
+                context->device(), denoiseInput->width, denoiseInput->height, precision);
+            subtractedChromaPyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(
+                context->device(), (denoiseInput->width + 1) / 2, (denoiseInput->height + 1) / 2, precision);
+        }
 
-            _collectPatches(context, *layerImage, pcaPatches->buffer());
+        // The noise subtraction is evaluated by the block matching kernels as they read the level
+        const bool subtractInline = fusedSubtraction && i < active - 1 && !subtracted420 &&
+                                    levelPlan[i] == LevelDenoise::blockMatching && i < fusedProjectionLevel;
+        SubtractNoiseSource subtraction;
+
+        if (i < active - 1) {
+            const auto np = YCbCrNLF{nlfParameters[i].first * thresholdMultipliers[i],
+                                     nlfParameters[i].second * thresholdMultipliers[i]};
+            if (subtractInline) {
+                subtraction = {
+                    .inputImage1 = inputs[i + 1],
+                    .inputImageDenoised1 = denoisedImagePyramid[i + 1].get(),
+                    .gradientImage = gradientInput,
+                    .parameters = { lumaDenoiseWeight[i], (*denoiseParameters)[i].sharpening, { np.first[0], np.second[0] } }
+                };
+            } else if (subtracted420) {
+                _subtractNoiseImage420.get()(context, *denoiseInput, *inputs[i + 1], *(denoisedImagePyramid[i + 1]),
+                                             *gradientInput, lumaDenoiseWeight[i], (*denoiseParameters)[i].sharpening,
+                                             {np.first[0], np.second[0]}, subtractedLumaPyramid[i].get(),
+                                             subtractedChromaPyramid[i].get());
+                if (levelPlan[i] != LevelDenoise::blockMatching) {
+                    context->barrier();
+                    _mergeYCbCr420(context, *subtractedLumaPyramid[i], *subtractedChromaPyramid[i],
+                                   subtractedImagePyramid[i].get());
+                }
+            } else {
+                _subtractNoiseImage(context, *denoiseInput, *inputs[i + 1], *(denoisedImagePyramid[i + 1]),
+                                    *gradientInput, lumaDenoiseWeight[i], (*denoiseParameters)[i].sharpening,
+                                    {np.first[0], np.second[0]}, subtractedImagePyramid[i].get());
+            }
+        }
 
-            context->waitForCompletion();
-            build_pca_space(std::span(pcaPatches->data(), sample_size), &pcaSpace);
+        const auto layerImage = i < active - 1 && !subtractInline ? subtractedImagePyramid[i].get() : denoiseInput;
+
+        if (levelPlan[i] == LevelDenoise::copy) {
+            // The noise subtracted from the finer level is zero
+            _copyImage(context, *layerImage, denoisedImagePyramid[i].get(), gls::Matrix<3, 3>::identity());
+        } else if (levelPlan[i] == LevelDenoise::blockMatching) {
+            // The coarser basis level was denoised before this one
+            const int basisLevel = pcaBasisLevel > i && pcaBasisLevel < active &&
+                                   levelPlan[pcaBasisLevel] == LevelDenoise::blockMatching ? pcaBasisLevel : i;
+
+            const int levelComponents = compactPcaFeatures[i] ? std::min(components, compactPcaComponents) : components;
+            const bool fused = i >= fusedProjectionLevel;
+            const bool compact = !fused && levelComponents <= compactPcaComponents;
+            if (compact && !pcaCompactImagePyramid[i]) {
+                gls::GPUMemoryTracker::Scope scope("PyramidProcessor");
+                pcaCompactImagePyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel<uint32_t, 2>>>(
+                    context->device(), denoiseInput->width, denoiseInput->height);
+            }
 
-            _pcaProjection(context, *layerImage, pcaSpace, pcaImagePyramid[i].get());
+            // The patches of 4:2:0 levels are the luma plane's
+            const auto blockMatch = [&](const auto& patchSource) {
+                assert(patchSource.size() == pcaImagePyramid[i]->size());
+
+                const bool newScene = pcaBasisScene[i] != pcaScene;
+                if (basisLevel == i && (newScene || pcaRuns % std::max(pcaRefreshInterval, 1) == 0)) {
+                    // The patch covariance and its eigenvectors are computed on the GPU, in stream with the denoising,
+                    // the GPU decides from the drift of the cached basis whether to rebuild it
+                    _pcaSpace(context, patchSource, pcaPartialSums.get(), pcaSpace[i]->buffer(), pcaBasisState[i]->buffer(),
+                              pcaDriftThreshold, /*forceRefresh=*/ newScene || pcaDriftThreshold <= 0, pcaSampleBudget,
+                              subtraction);
+                    context->barrier();
+                    pcaBasisScene[i] = pcaScene;
+                }
+
+                // Denoise current layer, patches is the projected image or the basis of the fused projection
+                const auto denoiseLayer = [&](const auto& patches) {
+                    const auto& dp = (*denoiseParameters)[i];
+                    if (subtracted420) {
+                        _blockMatchingDenoiseImage420(context, *subtractedLumaPyramid[i], *subtractedChromaPyramid[i],
+                                                      *gradientInput, patches, nlfParameters[i].first, nlfParameters[i].second,
+                                                      thresholdMultipliers[i], dp.chromaBoost, dp.gradientBoost,
+                                                      dp.gradientThreshold, lensShading.downsampled(1 << i), levelComponents,
+                                                      denoisedImagePyramid[i].get());
+                    } else {
+                        _blockMatchingDenoiseImage(context, *layerImage, *gradientInput, patches,
+                                                   nlfParameters[i].first, nlfParameters[i].second, thresholdMultipliers[i],
+                                                   dp.chromaBoost, dp.gradientBoost, dp.gradientThreshold,
+                                                   lensShading.downsampled(1 << i), levelComponents, denoisedImagePyramid[i].get(),
+                                                   subtraction);
+                    }
+                };
+
+                if (fused) {
+                    denoiseLayer(pcaSpace[basisLevel]->buffer());
+                } else if (compact) {
+                    _pcaProjection(context, patchSource, pcaSpace[basisLevel]->buffer(), levelComponents, pcaCompactImagePyramid[i].get(),
+                                   subtraction);
+                    denoiseLayer(*pcaCompactImagePyramid[i]);
+                } else {
+                    _pcaProjection(context, patchSource, pcaSpace[basisLevel]->buffer(), levelComponents, pcaImagePyramid[i].get(),
+                                   subtraction);
+                    denoiseLayer(*pcaImagePyramid[i]);
+                }
+            };
+            if (subtracted420) {
+                blockMatch(*subtractedLumaPyramid[i]);
+            } else {
+                blockMatch(*layerImage);
+            }
 
-            // Denoise current layer
-            _blockMatchingDenoiseImage(context, *layerImage, *gradientInput, *pcaImagePyramid[i],
-                                       (*nlfParameters)[i].first, (*nlfParameters)[i].second, thresholdMultipliers[i],
-                                       (*denoiseParameters)[i].chromaBoost, (*denoiseParameters)[i].gradientBoost,
-                                       (*denoiseParameters)[i].gradientThreshold, lensShadingCorrection,
-                                       denoisedImagePyramid[i].get());
-
-//            context->waitForCompletion();
-//            savePatchMap(*(denoisedImagePyramid[i]));
+//            context->barrier();
+//            savePatchMap(context, *(denoisedImagePyramid[i]));
         } else {
             // Denoise current layer
             _denoiseImage(context, *layerImage, *gradientInput,
-                          (*nlfParameters)[i].first, (*nlfParameters)[i].second, thresholdMultipliers[i],
+                          nlfParameters[i].first, nlfParameters[i].second, thresholdMultipliers[i],
                           (*denoiseParameters)[i].chromaBoost, (*denoiseParameters)[i].gradientBoost,
                           (*denoiseParameters)[i].gradientThreshold, denoisedImagePyramid[i].get());
         }
+
+        if (levelDenoised) {
+            levelDenoised(context, i);
+        }
     }
+    levelKeys = keys;
+    pcaRuns++;
 
     return denoisedImagePyramid[0].get();
 }
 
+template <size_t levels>
+void PyramidProcessor<levels>::encodeCpuLevels(MetalContext* context, int first, int top,
+                                               const std::array<DenoiseParameters, levels>& denoiseParameters,
+                                               const std::array<const imageType*, levels>& inputs,
+                                               const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, levels>& gradients,
+                                               const std::array<YCbCrNLF, levels>& nlfParameters,
+                                               const std::array<gls::Vector<3>, levels>& thresholdMultipliers,
+                                               const LensShading& lensShading) {
+    auto mtlDevice = context->device();
+    if (!cpuLevelsDone) {
+        cpuLevelsDone = NS::TransferPtr(mtlDevice->newSharedEvent());
+        cpuLevelsWorker = std::make_unique<ThreadPool>(1);
+    }
+    const int active = activeLevels();
+    // The noise of the coarser level is subtracted from top, its input is read too
+    const int last = std::min(top + 1, active - 1);
+
+    {
+        // Shared copies of the GPU-only levels, at full float precision
+        gls::GPUMemoryTracker::Scope scope("PyramidProcessor");
+        MetalContext::ConcurrentScope concurrent(context);
+        for (int i = first; i <= last; i++) {
+            if (!cpuInputPyramid[i] || cpuInputPyramid[i]->size() != inputs[i]->size()) {
+                cpuInputPyramid[i] = std::make_unique<imageType>(mtlDevice, inputs[i]->width, inputs[i]->height);
+                cpuGradientPyramid[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, gradients[i]->width,
+                                                                                                gradients[i]->height);
+            }
+            _copyImage(context, *inputs[i], cpuInputPyramid[i].get(), gls::Matrix<3, 3>::identity());
+            _copyImage(context, *gradients[i], cpuGradientPyramid[i].get(), gls::Matrix<3, 3>::identity());
+        }
+    }
+
+    // The gain map is small, the CPU samples its own copy
+    std::shared_ptr<gls::image<gls::pixel_float4>> gainMap;
+    if (lensShading.enabled && lensShading.gainMap) {
+        gainMap = lensShading.gainMap->toImage();
+    }
+
+    const auto plan = levelPlan;
+    const int components = std::clamp(pcaComponents, 1, pcaSpaceSize);
+    const auto compactFeatures = compactPcaFeatures;
+    const int sampleBudget = pcaSampleBudget;
+    for (int i = first; i <= top; i++) {
+        pcaBasisScene[i] = pcaScene;
+    }
+
+    const uint64_t signal = ++cpuLevelsSignal;
+    context->notify([=, this, event = cpuLevelsDone]() {
+        cpuLevelsWorker->enqueue([=, this]() {
+            try {
+                for (int i = top; i >= first; i--) {
+                    auto input = cpu_pyramid::toPlanar(*cpuInputPyramid[i]->mapImage());
+                    const auto levelGradients = cpu_pyramid::levelGradients(cpu_pyramid::toPlanar(*cpuGradientPyramid[i]->mapImage()),
+                                                                            input.width, input.height);
+                    const auto& dp = denoiseParameters[i];
+                    const auto& nlf = nlfParameters[i];
+                    const auto& tm = thresholdMultipliers[i];
+
+                    if (i < active - 1) {
+                        const auto input1 = cpu_pyramid::toPlanar(*cpuInputPyramid[i + 1]->mapImage());
+                        const auto denoised1 = cpu_pyramid::toPlanar(*denoisedImagePyramid[i + 1]->mapImage());
+                        input = cpu_pyramid::subtractNoise(input, input1, denoised1, levelGradients, lumaDenoiseWeight[i],
+                                                           dp.sharpening, { nlf.first[0] * tm[0], nlf.second[0] * tm[0] });
+                    }
+
+                    const std::array<float, 3> var_a = { nlf.first[0], nlf.first[1], nlf.first[2] };
+                    const std::array<float, 3> var_b = { nlf.second[0], nlf.second[1], nlf.second[2] };
+                    const std::array<float, 3> multipliers = { tm[0], tm[1], tm[2] };
+
+                    cpu_pyramid::PlanarImage denoised;
+                    if (plan[i] == LevelDenoise::copy) {
+                        denoised = std::move(input);
+                    } else if (plan[i] == LevelDenoise::blockMatching) {
+                        const auto basis = cpu_pyramid::pcaBasis(input, sampleBudget);
+                        std::copy(basis.begin(), basis.end(), pcaSpace[i]->data());
+
+                        const auto geometry = lensShading.downsampled(1 << i).geometry;
+                        const auto lensShadingGains = cpu_pyramid::lensShadingGains(gainMap.get(), { geometry.x, geometry.y, geometry.z, geometry.w },
+                                                                                    (bool) gainMap, input.width, input.height);
+                        const int levelComponents = compactFeatures[i] ? std::min(components, compactPcaComponents) : components;
+                        denoised = cpu_pyramid::blockMatchingDenoise(input, levelGradients, cpu_pyramid::pcaProjection(input, basis),
+                                                                     levelComponents, var_a, var_b, multipliers, dp.chromaBoost,
+                                                                     dp.gradientBoost, dp.gradientThreshold, lensShadingGains);
+                    } else {
+                        denoised = cpu_pyramid::denoise(input, levelGradients, var_a, var_b, multipliers, dp.chromaBoost,
+                                                        dp.gradientBoost, dp.gradientThreshold);
+                    }
+                    cpu_pyramid::fromPlanar(denoised, denoisedImagePyramid[i]->mapImage().get());
+                }
+            } catch (const std::exception& e) {
+                LOG_ERROR(TAG) << "PyramidProcessor: CPU levels failed - " << e.what() << std::endl;
+            }
+            // Always release the GPU
+            event->setSignaledValue(signal);
+        });
+    });
+
+    // The work encoded so far runs before the CPU levels, the finer levels wait for them on the GPU
+    context->flushBatch();
+    context->enqueue([event = cpuLevelsDone, signal](MTL::CommandBuffer* commandBuffer) {
+        commandBuffer->encodeWait(event.get(), signal);
+    });
+}
+
+template <size_t levels>
+void PyramidProcessor<levels>::fuseFrame(MetalContext* context, const imageType& image,
+                                         const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                                         const gls::Matrix<3, 3>& homography) {
+    if (!fusionBuffer[0]) {
+        auto mtlDevice = context->device();
+        for (int i = 0, scale = 1; i < levels; i++, scale *= 2) {
+            fusionImagePyramidA[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, width / scale, height / scale, precision);
+            fusionImagePyramidB[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, width / scale, height / scale, precision);
+            // The reference gradients have the size of the gradient levels
+            const auto& gradientLevel = i > 0 ? *gradientPyramid[i - 1] : gradientImage;
+            fusionReferenceGradientPyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(
+                mtlDevice, gradientLevel.width, gradientLevel.height, precision);
+        }
+        fusionBuffer[0] = &fusionImagePyramidA;
+        fusionBuffer[1] = &fusionImagePyramidB;
+    }
+    assert(image.width == width && image.height == height);
+
+    const bool referenceFrame = fusedFrames == 0;
+    const int count = fusedFrames + 1;
+
+    buildPyramids(context, image, gradientImage);
+
+    {
+        // The levels are independent
+        MetalContext::ConcurrentScope concurrent(context);
+
+        for (int i = 0, scale = 1; i < levels; i++, scale *= 2) {
+            const auto& frameLevel = i > 0 ? *imagePyramid[i - 1] : image;
+
+            // Reference pixel coordinates of the level to frame pixel coordinates of the level
+            const auto levelHomography = gls::Matrix<3, 3> {
+                { 1.0f / scale, 0, 0 },
+                { 0, 1.0f / scale, 0 },
+                { 0, 0, 1 }
+            } * homography * gls::Matrix<3, 3> {
+                { (float) scale, 0, 0 },
+                { 0, (float) scale, 0 },
+                { 0, 0, 1 }
+            };
+
+            _fusePyramidLevel(context, *(*fusionBuffer[0])[i], frameLevel, levelHomography, count, (*fusionBuffer[1])[i].get());
+
+            if (referenceFrame) {
+                const auto& gradientLevel = i > 0 ? *gradientPyramid[i - 1] : gradientImage;
+                _fusePyramidLevel(context, gradientLevel, gradientLevel, gls::Matrix<3, 3>::identity(), /*count=*/ 1,
+                                  fusionReferenceGradientPyramid[i].get());
+            }
+        }
+    }
+    std::swap(fusionBuffer[0], fusionBuffer[1]);
+    fusedFrames = count;
+}
+
+template <size_t levels>
+const gls::mtl_image_2d<gls::pixel_float2>* PyramidProcessor<levels>::alignFrame(
+    MetalContext* context, const imageType& image, const gls::mtl_image_2d<gls::pixel_float2>& gradientImage) {
+    if (fusedFrames == 0) {
+        throw std::runtime_error("PyramidProcessor::alignFrame: no reference frame");
+    }
+    assert(image.width == width && image.height == height);
+
+    if (!motionFieldPyramid[0]) {
+        auto mtlDevice = context->device();
+        for (int i = 0, scale = 1; i < levels; i++, scale *= 2) {
+            const auto size = alignTilesKernel::motionFieldSize(width / scale, height / scale);
+            motionFieldPyramid[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, size.width, size.height);
+        }
+    }
+
+    buildPyramids(context, image, gradientImage);
+
+    // Every level starts from the offsets of the coarser one, the dispatches are serial
+    for (int i = levels - 1; i >= 0; i--) {
+        MetalContext::TraceScope trace(context, "align level " + std::to_string(i));
+        const auto& frameLevel = i > 0 ? *imagePyramid[i - 1] : image;
+        const auto& referenceLevel = *(*fusionBuffer[0])[i];
+
+        // A wide search at the coarsest level, L1 at full resolution is more robust to outliers (HDR+)
+        const int searchRadius = i == levels - 1 ? 4 : i > 0 ? 2 : 1;
+        _alignTiles(context, referenceLevel, frameLevel, i < levels - 1 ? motionFieldPyramid[i + 1].get() : nullptr,
+                    searchRadius, /*l1Norm=*/ i == 0, motionFieldPyramid[i].get());
+    }
+    return motionFieldPyramid[0].get();
+}
+
+template <size_t levels>
+typename PyramidProcessor<levels>::imageType* PyramidProcessor<levels>::denoiseFused(
+    MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters,
+    const std::array<YCbCrNLF, levels>& nlfParameters, const LensShading& lensShading) {
+    if (fusedFrames == 0) {
+        throw std::runtime_error("PyramidProcessor::denoiseFused: no fused frames");
+    }
+
+    std::array<const imageType*, levels> inputs;
+    std::array<const gls::mtl_image_2d<gls::pixel_float2>*, levels> gradients;
+    std::array<YCbCrNLF, levels> fusedNlfParameters;
+    for (int i = 0; i < levels; i++) {
+        inputs[i] = (*fusionBuffer[0])[i].get();
+        gradients[i] = fusionReferenceGradientPyramid[i].get();
+
+        // The noise variance of the average of N registered frames is 1/N of the one of a single frame
+        fusedNlfParameters[i] = { nlfParameters[i].first / (float) fusedFrames, nlfParameters[i].second / (float) fusedFrames };
+    }
+
+    return denoisePyramid(context, denoiseParameters, inputs, gradients, fusedNlfParameters, lensShading);
+}
+
 template <size_t levels>
 YCbCrNLF PyramidProcessor<levels>::MeasureYCbCrNLF(MetalContext* context,
                                                    const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
@@ -179,26 +703,15 @@ YCbCrNLF PyramidProcessor<levels>::MeasureYCbCrNLF(MetalContext* context,
     assert(inputImage.size() == noiseStats->size());
 
     _basicNoiseStatistics(context, inputImage, noiseStats);
-    context->waitForCompletion();
-
-    // applyKernel(glsContext, "noiseStatistics_old", inputImage, &noiseStats);
-    const auto noiseStatsCpu = noiseStats->mapImage();
+    context->barrier();
 
     using double3 = gls::DVector<3>;
+    using reduction = noiseStatisticsReductionKernel;
 
-    gls::DVector<6> varianceHistogram = {0, 0, 0, 0, 0, 0};   // 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1
-    noiseStatsCpu->apply([&](const gls::pixel_float4& ns, int x, int y) {
-        double3 v = {ns[1], ns[2], ns[3]};
-
-        bool validStats = !any(isnan(v)) && all(v > double3(0.0));
-
-        if (validStats) {
-            const auto scale = gls::apply(std::log10, v);
-
-            int entry = 6 + (int) std::clamp(max_element(scale), -6.0, -1.0);
-            varianceHistogram[entry]++;
-        }
-    });
+    // The statistics image is reduced on the GPU, the mean is in x and the variances in yzw
+    reduction::Parameters parameters = { .stage = reduction::histogram, .packedStatistics = 1 };
+    const auto histogramSums = _noiseStatisticsReduction(context, *noiseStats, *noiseStats, parameters);
+    const auto varianceHistogram = reduction::vector<6>(histogramSums, 0);   // 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1
 
     // Only consider pixels with variance lower than the expected noise value
     double3 varianceMax = varianceHistogram[0] > 1e3 ? 1.0e-5 :
@@ -210,86 +723,49 @@ YCbCrNLF PyramidProcessor<levels>::MeasureYCbCrNLF(MetalContext* context,
     // std::cout << "MeasureYCbCrNLF - varianceHistogram: " << varianceHistogram << ", varianceMax: " << varianceMax << std::endl;
 
     // Limit to pixels the more linear intensity zone of the sensor
-    const double maxValue = 0.9;
-    const double minValue = 0.001;
+    parameters.maxValue = 0.9;
+    parameters.minValue = 0.001;
+
+    // The fourth channel of the packed statistics repeats the luma variance
+    const auto toFloat4 = [](const double3& v) -> simd::float4 {
+        return { (float) v[0], (float) v[1], (float) v[2], (float) v[0] };
+    };
 
     // Collect pixel statistics
-    double s_x = 0;
-    double s_xx = 0;
-    double3 s_y = 0;
-    double3 s_xy = 0;
-
-    double N = 0;
-    noiseStatsCpu->apply([&](const gls::pixel_float4& ns, int x, int y) {
-        double m = ns[0];
-        double3 v = {ns[1], ns[2], ns[3]};
-
-        bool validStats = !(std::isnan(m) || any(isnan(v)));
-
-        if (validStats && m >= minValue && m <= maxValue && all(v <= varianceMax)) {
-            s_x += m;
-            s_y += v;
-            s_xx += m * m;
-            s_xy += m * v;
-            N++;
-        }
-    });
+    parameters.stage = reduction::regression;
+    parameters.varianceMax = toFloat4(varianceMax);
+    auto sums = _noiseStatisticsReduction(context, *noiseStats, *noiseStats, parameters);
+    double s_x = sums[reduction::kSumX];
+    double s_xx = sums[reduction::kSumXX];
+    double3 s_y = reduction::vector<3>(sums, reduction::kSumY);
+    double3 s_xy = reduction::vector<3>(sums, reduction::kSumXY);
+    double N = sums[reduction::kCount];
 
     // Linear regression on pixel statistics to extract a linear noise model: nlf = A + B * Y
     auto nlfB = max((N * s_xy - s_x * s_y) / (N * s_xx - s_x * s_x), 1e-8);
     auto nlfA = max((s_y - nlfB * s_x) / N, 1e-8);
 
     // Estimate regression mean square error
-    double3 err2 = 0;
-    noiseStatsCpu->apply([&](const gls::pixel_float4& ns, int x, int y) {
-        double m = ns[0];
-        double3 v = {ns[1], ns[2], ns[3]};
-
-        bool validStats = !(std::isnan(m) || any(isnan(v)));
-
-        if (validStats && m >= minValue && m <= maxValue && all(v <= varianceMax)) {
-            auto nlfP = nlfA + nlfB * m;
-            auto diff = nlfP - v;
-            err2 += diff * diff;
-        }
-    });
-    err2 /= N;
+    parameters.stage = reduction::error;
+    parameters.nlfA = toFloat4(nlfA);
+    parameters.nlfB = toFloat4(nlfB);
+    sums = _noiseStatisticsReduction(context, *noiseStats, *noiseStats, parameters);
+    double3 err2 = reduction::vector<3>(sums, reduction::kSumError) / N;
 
     // Update the maximum variance with the model
     varianceMax = nlfB;
 
     // Redo the statistics collection limiting the sample to pixels that fit well the linear model
-    s_x = 0;
-    s_xx = 0;
-    s_y = 0;
-    s_xy = 0;
-    N = 0;
-    double3 newErr2 = 0;
-    int discarded = 0;
-    noiseStatsCpu->apply([&](const gls::pixel_float4& ns, int x, int y) {
-        double m = ns[0];
-        double3 v = {ns[1], ns[2], ns[3]};
-
-        bool validStats = !(std::isnan(m) || any(isnan(v)));
-
-        if (validStats && m >= minValue && m <= maxValue && all(v <= varianceMax)) {
-            auto nlfP = nlfA + nlfB * m;
-            auto diff = abs(nlfP - v);
-            auto diffSquare = diff * diff;
-
-            if (all(diffSquare <= err2)) {
-                s_x += m;
-                s_y += v;
-                s_xx += m * m;
-                s_xy += m * v;
-                N++;
-                newErr2 += diffSquare;
-            } else {
-                discarded++;
-            }
-        }
-    });
-    newErr2 /= N;
+    parameters.stage = reduction::refit;
+    parameters.varianceMax = toFloat4(varianceMax);
+    parameters.errorThreshold = toFloat4(err2);
+    sums = _noiseStatisticsReduction(context, *noiseStats, *noiseStats, parameters);
+    s_x = sums[reduction::kSumX];
+    s_xx = sums[reduction::kSumXX];
+    s_y = reduction::vector<3>(sums, reduction::kSumY);
+    s_xy = reduction::vector<3>(sums, reduction::kSumXY);
+    N = sums[reduction::kCount];
+    double3 newErr2 = reduction::vector<3>(sums, reduction::kSumError) / N;
 
     if (all(newErr2 <= err2) && N / (inputImage.width * inputImage.height) > 0.01) {
         // Estimate the new regression parameters
@@ -311,8 +787,6 @@ YCbCrNLF PyramidProcessor<levels>::MeasureYCbCrNLF(MetalContext* context,
 
     // assert(all(newErr2 < err2));
 
-    // noiseStats->unmapImage(noiseStatsCpu);
-
     double varianceExposureAdjustment = exposure_multiplier * exposure_multiplier;
 
     nlfA *= varianceExposureAdjustment;
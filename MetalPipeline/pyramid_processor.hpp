@@ -16,63 +16,247 @@
 #ifndef pyramid_processor_hpp
 #define pyramid_processor_hpp
 
+#include <functional>
+#include <memory>
+#include <optional>
+
 #include "demosaic.hpp"
 #include "demosaic_kernels.hpp"
+#include "ThreadPool.hpp"
 
 template <size_t levels>
 struct PyramidProcessor {
     const int width, height;
+    const gls::texture_precision precision;
+    // The gradient levels are at half the resolution of their image levels, like the raw gradients they are built from
+    const bool halfResolutionGradients;
     int fusedFrames;
 
     static constexpr bool usePatchSimiliarity = true;
     static constexpr int pcaPatchSize = 25;
     static constexpr int pcaSpaceSize = 8;
 
-    denoiseImageKernel _denoiseImage;
-    collectPatchesKernel _collectPatches;
-    pcaProjectionKernel _pcaProjection;
-    blockMatchingDenoiseImageKernel _blockMatchingDenoiseImage;
+    // The kernels of the denoise modes and of the fusion are built on first use, see LazyKernel
+    LazyKernel<denoiseImageKernel> _denoiseImage;
+    // Identity transform: the pass-through of the levels that are not denoised, converting the level's precision
+    transformImageKernel _copyImage;
+    LazyKernel<pcaSpaceKernel> _pcaSpace;
+    LazyKernel<pcaProjectionKernel> _pcaProjection;
+    LazyKernel<blockMatchingDenoiseImageKernel> _blockMatchingDenoiseImage;
     subtractNoiseImageKernel _subtractNoiseImage;
+    LazyKernel<subtractNoiseImage420Kernel> _subtractNoiseImage420;
+    LazyKernel<blockMatchingDenoiseImage420Kernel> _blockMatchingDenoiseImage420;
+    LazyKernel<mergeYCbCr420Kernel> _mergeYCbCr420;
     resampleImageKernel _resampleImage;
     resampleImageKernel _resampleGradientImage;
-    basicNoiseStatisticsKernel _basicNoiseStatistics;
-    hfNoiseTransferImageKernel _hfNoiseTransferImage;
+    buildPyramidsKernel _buildPyramids;
+    LazyKernel<basicNoiseStatisticsKernel> _basicNoiseStatistics;
+    LazyKernel<hfNoiseTransferImageKernel, float> _hfNoiseTransferImage;
+    LazyKernel<fusePyramidLevelKernel> _fusePyramidLevel;
+    LazyKernel<alignTilesKernel> _alignTiles;
+    LazyKernel<noiseStatisticsReductionKernel> _noiseStatisticsReduction;
 
     typedef gls::mtl_image_2d<gls::pixel_float4> imageType;
     std::array<imageType::unique_ptr, levels - 1> imagePyramid;
     std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, levels - 1> gradientPyramid;
     std::array<imageType::unique_ptr, levels> subtractedImagePyramid;
+    // With chroma420 the levels below the coarsest are subtracted to full resolution luma and half resolution chroma,
+    // allocated by the first denoise using them. Block matching filters the chroma at half resolution, the other
+    // plans merge the level back to subtractedImagePyramid. Half the texels of the subtracted levels and of the block
+    // matching tiles, at the cost of some chroma resolution.
+    bool chroma420 = false;
+    std::array<gls::mtl_image_2d<gls::pixel_float>::unique_ptr, levels> subtractedLumaPyramid;
+    std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, levels> subtractedChromaPyramid;
     std::array<imageType::unique_ptr, levels> denoisedImagePyramid;
     std::array<gls::mtl_image_2d<gls::pixel<uint32_t, 4>>::unique_ptr, levels> pcaImagePyramid;
-    std::unique_ptr<gls::Buffer<std::array<float, pcaPatchSize>>> pcaPatches;
-    std::array<std::array<float16_t, pcaSpaceSize>, pcaPatchSize> pcaSpace;
+    // The levels block matched with at most compactPcaComponents store them in half the space, 4 fp16 components
+    // packed in a pixel<uint32_t, 2>: half the reads of the patch tiles. compactPcaFeatures caps a level's components
+    // to get there, e.g. for the full resolution level, at some loss of patch discrimination. Allocated on first use.
+    static constexpr int compactPcaComponents = 4;
+    std::array<bool, levels> compactPcaFeatures = {};
+    std::array<gls::mtl_image_2d<gls::pixel<uint32_t, 2>>::unique_ptr, levels> pcaCompactImagePyramid;
+    // Per threadgroup patch covariance sums, shared by all levels and sized for pcaSampleBudget
+    std::unique_ptr<gls::Buffer<float>> pcaPartialSums;
+    // The PCA basis of each level is computed and consumed on the GPU, pcaPatchSize rows of pcaSpaceSize components
+    std::array<std::unique_ptr<gls::Buffer<std::array<float16_t, pcaSpaceSize>>>, levels> pcaSpace;
+    std::array<std::unique_ptr<gls::Buffer<pcaSpaceKernel::pca_basis_state>>, levels> pcaBasisState;
+    // Scene of each level's cached basis, unset until the first basis is built
+    std::array<std::optional<uint64_t>, levels> pcaBasisScene;
+    // The PCA basis of each level is checked every pcaRefreshInterval runs, in between the previous one is reused.
+    // A check rebuilds the basis if the scene changed or if the fraction of the patch variance captured by the
+    // cached basis dropped by more than pcaDriftThreshold, with a zero threshold every check rebuilds the basis.
+    // Across bursts and video frames the patch statistics vary slowly.
+    int pcaRefreshInterval = 1;
+    float pcaDriftThreshold = 0;
+    uint64_t pcaScene = 0;
+    int pcaRuns = 0;
+    // Patches sampled per level for the PCA basis, stratified over the level, see pcaSpaceKernel
+    int pcaSampleBudget = pcaSpaceKernel::kDefaultSampleBudget;
+    // The levels finer than pcaBasisLevel project on its basis instead of computing their own, if it is block
+    // matched. Negative computes a basis per level.
+    int pcaBasisLevel = -1;
+    // The block matched levels from fusedProjectionLevel down to the coarsest project their patches in the block
+    // matching dispatch, without pcaProjection and pcaImagePyramid: the small levels are dominated by the dispatches
+    // and the barriers between them. Same results, levels can't exceed the pyramid to disable it.
+    int fusedProjectionLevel = 2;
+    // The block matched levels projected by pcaProjection subtract the noise of the coarser level as the PCA, the
+    // projection and the block matching load their tiles, subtractedImagePyramid isn't written and read back: a full
+    // level write and read less per level, for a few redundant subtractions in the aprons of the tiles. The 4:2:0 and
+    // the fused projection levels still subtract to their levels.
+    bool fusedSubtraction = true;
+    // Levels denoised, the ones above are only downsampled, and PCA components used for block matching
+    int denoiseLevels = levels;
+    int pcaComponents = pcaSpaceSize;
+    // Noise thresholds of the level plan, see DenoisePyramidConfig
+    float blockMatchingNoise = 0;
+    float copyNoise = 0;
+
+    enum class LevelDenoise {
+        blockMatching,  // PCA and block matching
+        denoise,        // denoiseImage
+        copy            // Passed through
+    };
+    // How each level of the last denoise ran, the levels above activeLevels() are only downsampled
+    std::array<LevelDenoise, levels> levelPlan;
+
+    // Identifies the image and gradients of the next denoise, e.g. a hash of the raw data and of the parameters of
+    // the stages producing them, consumed by the denoise. With the key of the previous denoise the image pyramid is
+    // kept, and so are the denoised levels whose inputs (noise model, DenoiseParameters, plan and the coarser levels)
+    // didn't change: a tuner editing the parameters of level 0 only redoes level 0. Unset recomputes everything.
+    std::optional<uint64_t> denoiseInputKey;
+    // Input of imagePyramid and gradientPyramid, and inputs of each level of denoisedImagePyramid
+    std::optional<uint64_t> pyramidKey;
+    std::array<std::optional<uint64_t>, levels> levelKeys;
+    // Levels denoised by the last denoise, the coarser active levels were reused
+    int recomputedLevels = 0;
+
+    // The cpuLevels coarsest active levels are denoised on the CPU, level 0 always runs on the GPU. Their inputs are
+    // copied to shared textures when the GPU has built them, the CPU denoises them once the work encoded so far has
+    // completed and writes denoisedImagePyramid, while the GPU waits on cpuLevelsDone before the finer levels. The
+    // small levels don't fill the GPU and their dispatches are mostly launch overhead. The CPU levels compute their
+    // own PCA basis at every run, into pcaSpace for the finer levels using them. The denoise runs in a batch.
+    int cpuLevels = 0;
+    std::array<imageType::unique_ptr, levels> cpuInputPyramid;
+    std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, levels> cpuGradientPyramid;
+    NS::SharedPtr<MTL::SharedEvent> cpuLevelsDone;
+    uint64_t cpuLevelsSignal = 0;
+    std::unique_ptr<ThreadPool> cpuLevelsWorker;
+
+    // Called once the denoising of each level is encoded, from the coarsest active level down to level 0, e.g. for a
+    // progressive preview from the coarse levels: denoisedLevel(level) can be read after a barrier. Also called for
+    // the reused levels.
+    std::function<void(MetalContext* context, int level)> levelDenoised;
+
+    // Allocates the PCA partial sums for the current pcaSampleBudget if needed
+    void allocatePcaPartialSums(MTL::Device* mtlDevice);
     gls::mtl_image_2d<gls::pixel_float>::unique_ptr filteredLuma;
+    // Input of each level of the last denoise, the image itself or a level of a pyramid
+    std::array<const imageType*, levels> denoiseInputs = {};
 
-//    std::array<imageType::unique_ptr, levels> fusionImagePyramidA;
-//    std::array<imageType::unique_ptr, levels> fusionImagePyramidB;
-//    std::array<imageType::unique_ptr, levels> fusionReferenceImagePyramid;
-//    std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, levels> fusionReferenceGradientPyramid;
-//    std::array<imageType::unique_ptr, levels>* fusionBuffer[2];
+    // Multi-frame fusion, allocated by the first fuseFrame: fusionBuffer[0] holds the running average of the burst
+    // at every pyramid level, the next frame is accumulated into fusionBuffer[1] and the buffers are swapped.
+    // The gradients are the reference frame's.
+    std::array<imageType::unique_ptr, levels> fusionImagePyramidA;
+    std::array<imageType::unique_ptr, levels> fusionImagePyramidB;
+    std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, levels> fusionReferenceGradientPyramid;
+    std::array<imageType::unique_ptr, levels>* fusionBuffer[2] = { nullptr, nullptr };
 
-    PyramidProcessor(MetalContext* context, int width, int height);
+    // Per tile motion of the last aligned frame at every pyramid level, allocated by the first alignFrame
+    std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, levels> motionFieldPyramid;
+
+    // If transientHeap is given the textures only used while denoising are allocated from it at denoiseStage,
+    // precision applies to the GPU-only pyramid levels
+    PyramidProcessor(MetalContext* context, int width, int height,
+                     gls::transient_heap* transientHeap = nullptr, int denoiseStage = 0,
+                     gls::texture_precision precision = gls::texture_precision::native,
+                     bool halfResolutionGradients = false);
 
     imageType* denoise(MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters,
                        const imageType& image, const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
-                       std::array<YCbCrNLF, levels>* nlfParameters, float exposure_multiplier, float lensShadingCorrection,
-                       bool calibrateFromImage = false);
-
-//    void fuseFrame(MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters,
-//                   const imageType& image, const gls::Matrix<3, 3>& homography,
-//                   const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
-//                   std::array<YCbCrNLF, levels>* nlfParameters, float exposure_multiplier,
-//                   bool calibrateFromImage = false);
-//
-//    imageType* getFusedImage(MetalContext* context);
+                       std::array<YCbCrNLF, levels>* nlfParameters, float exposure_multiplier,
+                       const LensShading& lensShading, bool calibrateFromImage = false);
+
+    // Accumulates a frame of a burst into the fusion pyramids, the first frame after resetFusion is the reference.
+    // The homography maps the reference frame's pixel coordinates to the frame's, at full resolution.
+    void fuseFrame(MetalContext* context, const imageType& image,
+                   const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, const gls::Matrix<3, 3>& homography);
+
+    // Coarse-to-fine tile alignment of a burst frame to the running average of the burst, which is in the reference
+    // frame's coordinates: fuseFrame must have been called with the reference frame. The search starts with a wide
+    // radius at the coarsest level and is refined at every level down to full resolution. Returns the motion field of
+    // level 0: for every alignTilesKernel::tileSize tile, the offset from the reference's pixel coordinates to the
+    // frame's, see RegisterImageKernel. Unlike a global homography this follows parallax and moving subjects.
+    const gls::mtl_image_2d<gls::pixel_float2>* alignFrame(MetalContext* context, const imageType& image,
+                                                           const gls::mtl_image_2d<gls::pixel_float2>& gradientImage);
+
+    // Level 0 of the running average, not denoised
+    imageType* getFusedImage() const {
+        return fusedFrames > 0 ? (*fusionBuffer[0])[0].get() : nullptr;
+    }
+
+    // A single denoise pass over the fused pyramids, the noise model is the one of the individual frames and it is
+    // scaled by the number of fused frames
+    imageType* denoiseFused(MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters,
+                            const std::array<YCbCrNLF, levels>& nlfParameters, const LensShading& lensShading);
+
+    void resetFusion() {
+        fusedFrames = 0;
+    }
+
+    // Result of the last denoise at a pyramid level, levels above denoiseLevels are returned as they are
+    const imageType* denoisedLevel(int level) const {
+        if (level < activeLevels()) {
+            return denoisedImagePyramid[level].get();
+        }
+        return denoiseInputs[level];
+    }
+
+    int activeLevels() const {
+        return std::clamp(denoiseLevels, 1, (int) levels);
+    }
+
+    // Standard deviation of a level's noise at mid grey, the largest of the three channels
+    static float levelNoise(const YCbCrNLF& nlf, const gls::Vector<3>& thresholdMultipliers);
+
+    // Denoising of each level from its noise model and the noise thresholds
+    std::array<LevelDenoise, levels> planLevels(const std::array<YCbCrNLF, levels>& nlfParameters,
+                                                const std::array<gls::Vector<3>, levels>& thresholdMultipliers) const;
+
+    // Number of PCA basis rebuilds over all levels, valid once the GPU work is completed
+    uint32_t pcaBasisRefreshes() const {
+        uint32_t refreshes = 0;
+        for (const auto& state : pcaBasisState) {
+            refreshes += state->data()->refreshes;
+        }
+        return refreshes;
+    }
 
     YCbCrNLF MeasureYCbCrNLF(MetalContext* context,
                              const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
                              gls::mtl_image_2d<gls::pixel_float4> *noiseStats,
                              float exposure_multiplier);
+
+    // Marks the pyramids and the PCA state volatile while the processor is idle, e.g. in a texture cache, or
+    // nonvolatile again before its next use. Returns false if the system discarded any of their contents: the
+    // cached state is then invalidated, the next denoise recomputes everything and fusion restarts.
+    bool setPurgeable(bool purgeable);
+
+    // Encodes the denoising of the levels [first, top] on the CPU, see cpuLevels
+    void encodeCpuLevels(MetalContext* context, int first, int top, const std::array<DenoiseParameters, levels>& denoiseParameters,
+                         const std::array<const imageType*, levels>& inputs,
+                         const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, levels>& gradients,
+                         const std::array<YCbCrNLF, levels>& nlfParameters,
+                         const std::array<gls::Vector<3>, levels>& thresholdMultipliers, const LensShading& lensShading);
+
+    // Downsamples image and gradientImage into imagePyramid and gradientPyramid
+    void buildPyramids(MetalContext* context, const imageType& image, const gls::mtl_image_2d<gls::pixel_float2>& gradientImage);
+
+    // With an inputKey the levels denoised from the same inputs by the previous call are reused, see denoiseInputKey
+    imageType* denoisePyramid(MetalContext* context, std::array<DenoiseParameters, levels>* denoiseParameters,
+                              const std::array<const imageType*, levels>& inputs,
+                              const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, levels>& gradients,
+                              const std::array<YCbCrNLF, levels>& nlfParameters, const LensShading& lensShading,
+                              std::optional<uint64_t> inputKey = std::nullopt);
 };
 
 #endif /* pyramid_processor_hpp */
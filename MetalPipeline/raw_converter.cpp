@@ -16,248 +16,1733 @@
 #include "raw_converter.hpp"
 
 #include "SimplexNoise.hpp"
+#include "gls_content_hash.hpp"
+#include "gls_debug_dump.hpp"
+
+#include <utility>
+
+template <typename ImageType>
+PixelBufferImagePool<ImageType>::PixelBufferImagePool(MTL::Device* device, OSType pixelFormat, int capacity) :
+    _device(device), _capacity(capacity), _pixelFormat(pixelFormat), _imageSize({0, 0}), _pixelBufferPool(nullptr) { }
+
+template <typename ImageType>
+PixelBufferImagePool<ImageType>::~PixelBufferImagePool() {
+    _available.clear();
+    _checkedOut.clear();
+    if (_pixelBufferPool) {
+        CVPixelBufferPoolRelease(_pixelBufferPool);
+    }
+}
+
+template <typename ImageType>
+void PixelBufferImagePool<ImageType>::createPixelBufferPool(const gls::size& imageSize) {
+    if (_pixelBufferPool) {
+        CVPixelBufferPoolRelease(_pixelBufferPool);
+        _pixelBufferPool = nullptr;
+    }
+
+    const int32_t width = imageSize.width;
+    const int32_t height = imageSize.height;
+    const OSType pixelFormat = _pixelFormat;
+
+    CFNumberRef widthNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &width);
+    CFNumberRef heightNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &height);
+    CFNumberRef pixelFormatNumber = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &pixelFormat);
+    CFDictionaryRef ioSurfaceProperties = CFDictionaryCreate(kCFAllocatorDefault, nullptr, nullptr, 0,
+                                                             &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    const void* keys[] = { kCVPixelBufferWidthKey, kCVPixelBufferHeightKey, kCVPixelBufferPixelFormatTypeKey,
+                           kCVPixelBufferIOSurfacePropertiesKey, kCVPixelBufferMetalCompatibilityKey };
+    const void* values[] = { widthNumber, heightNumber, pixelFormatNumber, ioSurfaceProperties, kCFBooleanTrue };
+    CFDictionaryRef attributes = CFDictionaryCreate(kCFAllocatorDefault, keys, values, sizeof(keys) / sizeof(keys[0]),
+                                                    &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+    CVReturn ret = CVPixelBufferPoolCreate(kCFAllocatorDefault, nullptr, attributes, &_pixelBufferPool);
+
+    CFRelease(attributes);
+    CFRelease(ioSurfaceProperties);
+    CFRelease(pixelFormatNumber);
+    CFRelease(heightNumber);
+    CFRelease(widthNumber);
+
+    if (ret != kCVReturnSuccess) {
+        throw std::runtime_error("CVPixelBufferPoolCreate failed: " + std::to_string(ret));
+    }
+}
+
+template <typename ImageType>
+void PixelBufferImagePool<ImageType>::setPixelFormat(OSType pixelFormat) {
+    std::lock_guard<std::mutex> guard(_mutex);
+
+    if (_pixelFormat != pixelFormat) {
+        // The pool is recreated by the next checkout, the images still checked out are dropped when returned
+        _available.clear();
+        _pixelFormat = pixelFormat;
+        _imageSize = {0, 0};
+    }
+}
+
+template <typename ImageType>
+typename PixelBufferImagePool<ImageType>::image_type* PixelBufferImagePool<ImageType>::checkout(const gls::size& imageSize) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_imageSize != imageSize) {
+        // Images of the previous size are dropped, the ones still checked out when they are returned
+        _available.clear();
+        createPixelBufferPool(imageSize);
+        _imageSize = imageSize;
+    }
+
+    _returned.wait(lock, [this] { return !_available.empty() || (int) _checkedOut.size() < _capacity; });
+
+    std::unique_ptr<image_type> image;
+    if (!_available.empty()) {
+        image = std::move(_available.back());
+        _available.pop_back();
+    } else {
+        CVPixelBufferRef pixelBuffer = nullptr;
+        CVReturn ret = CVPixelBufferPoolCreatePixelBuffer(kCFAllocatorDefault, _pixelBufferPool, &pixelBuffer);
+        if (ret != kCVReturnSuccess) {
+            throw std::runtime_error("CVPixelBufferPoolCreatePixelBuffer failed: " + std::to_string(ret));
+        }
+        image = std::make_unique<image_type>(_device, pixelBuffer);
+        // The image holds its own reference
+        CVPixelBufferRelease(pixelBuffer);
+    }
+
+    _checkedOut.push_back(std::move(image));
+    return _checkedOut.back().get();
+}
+
+template <typename ImageType>
+void PixelBufferImagePool<ImageType>::checkin(CVPixelBufferRef pixelBuffer) {
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        auto entry = std::find_if(_checkedOut.begin(), _checkedOut.end(), [pixelBuffer](const auto& image) {
+            return image->pixelBuffer() == pixelBuffer;
+        });
+        if (entry == _checkedOut.end()) {
+            return;
+        }
+        if ((*entry)->size() == _imageSize && CVPixelBufferGetPixelFormatType(pixelBuffer) == _pixelFormat) {
+            _available.push_back(std::move(*entry));
+        }
+        _checkedOut.erase(entry);
+    }
+    _returned.notify_one();
+}
+
+template <typename ImageType>
+size_t PixelBufferImagePool<ImageType>::trim() {
+    std::lock_guard<std::mutex> guard(_mutex);
+
+    size_t bytes = 0;
+    for (const auto& image : _available) {
+        bytes += CVPixelBufferGetDataSize(image->pixelBuffer());
+    }
+    _available.clear();
+    if (_pixelBufferPool) {
+        CVPixelBufferPoolFlush(_pixelBufferPool, kCVPixelBufferPoolFlushExcessBuffers);
+    }
+    return bytes;
+}
+
+template class PixelBufferImagePool<gls::mtl_pixel_buffer_image_2d<gls::pixel_float4>>;
+template class PixelBufferImagePool<gls::mtl_pixel_buffer_ycbcr_420_image>;
 
 void RawConverter::allocateTextures(const gls::size& imageSize) {
     assert(imageSize.width > 0 && imageSize.height > 0);
 
-    if (_rawImageSize != imageSize) {
-        std::cout << "Reallocating RawConverter textures" << std::endl;
+    applyDeferredTrim();
+
+    if (_rawImageSize != imageSize) {
+        stashTextures();
+        trimTextureCache();
+
+        if (restoreTextures(imageSize)) {
+            std::cout << "Reusing RawConverter textures for " << imageSize.width << " x " << imageSize.height << std::endl;
+            return;
+        }
+
+        std::cout << "Reallocating RawConverter textures" << std::endl;
+
+        gls::GPUMemoryTracker::Scope scope("RawConverter");
+        try {
+            createTextures(imageSize);
+        } catch (const gls::gpu_budget_exceeded&) {
+            dropTextures();
+            if (_textureCache.empty()) {
+                throw;
+            }
+            // Make room evicting the intermediates of the cached sizes
+            _textureCache.clear();
+            try {
+                createTextures(imageSize);
+            } catch (const gls::gpu_budget_exceeded&) {
+                dropTextures();
+                throw;
+            }
+        }
+    }
+}
+
+void RawConverter::createTextures(const gls::size& imageSize) {
+    auto mtlDevice = _mtlContext.device();
+    const size_t deviceAllocatedSize = mtlDevice->currentAllocatedSize();
+
+    // Textures only used in a single stage of the pipeline share memory, GPU-only textures use private storage
+    gls::transient_heap transientHeap(mtlDevice, MTL::StorageModePrivate);
+
+    const auto& precision = _precisionPolicy;
+
+    _scaledRawImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float>>(mtlDevice, imageSize, precision.rawData);
+    const int gradientScale = _halfResolutionGradients ? 2 : 1;
+    _rawGradientImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(
+        mtlDevice, imageSize.width / gradientScale, imageSize.height / gradientScale, precision.gradients);
+    transientHeap.add(&_greenImage, imageSize, kDemosaicStage, kDemosaicStage, precision.demosaic);
+    // CPU-visible output image
+    _linearRGBImageA = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize);
+    _linearRGBImageB = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, imageSize, precision.demosaic);
+
+    if (_calibrateFromImage) {
+        _meanImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / 2, imageSize.height / 2);
+        _varImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / 2, imageSize.height / 2);
+    }
+
+    _pyramidProcessor = std::make_unique<PyramidProcessor<5>>(&_mtlContext, imageSize.width, imageSize.height,
+                                                              &transientHeap, kDenoiseStage, precision.pyramid,
+                                                              _halfResolutionGradients);
+
+    const auto heapSize = transientHeap.allocate();
+    if (heapSize > 0) {
+        std::cout << "Transient texture heap: " << heapSize / (1024 * 1024) << "MB" << std::endl;
+    }
+
+    // Only set once everything is in place, a failed allocation leaves no size allocated
+    _rawImageSize = imageSize;
+    _rerenderKey.reset();
+
+    const size_t currentAllocatedSize = mtlDevice->currentAllocatedSize();
+    _allocatedBytes = currentAllocatedSize > deviceAllocatedSize ? currentAllocatedSize - deviceAllocatedSize : 0;
+}
+
+// Releases a partial allocation of the size-dependent intermediates
+void RawConverter::dropTextures() {
+    _scaledRawImage = nullptr;
+    _rawGradientImage = nullptr;
+    _greenImage = nullptr;
+    _linearRGBImageA = nullptr;
+    _linearRGBImageB = nullptr;
+    _meanImage = nullptr;
+    _varImage = nullptr;
+    _pyramidProcessor = nullptr;
+    _rawImageSize = {0, 0};
+    _allocatedBytes = 0;
+}
+
+void RawConverter::releaseTextures() {
+    _mtlContext.waitForCompletion();
+
+    stashTextures();
+    _textureCache.clear();
+    _rawImage = nullptr;
+    _packedRawData = nullptr;
+    _demosaicGraph = nullptr;
+}
+
+void RawConverter::stashTextures() {
+    if (_rawImageSize.width == 0 || _rawImageSize.height == 0) {
+        return;
+    }
+
+    _textureCache.push_front({
+        _rawImageSize, _allocatedBytes,
+        std::move(_scaledRawImage), std::move(_rawGradientImage), std::move(_greenImage),
+        std::move(_linearRGBImageA), std::move(_linearRGBImageB), std::move(_meanImage), std::move(_varImage),
+        std::move(_pyramidProcessor)
+    });
+    // Idle until restored, the system may reclaim them. Not while the GPU may still use them for the last run.
+    _mtlContext.waitForCompletion();
+    _textureCache.front().setPurgeable(true);
+    _rawImageSize = {0, 0};
+    _allocatedBytes = 0;
+}
+
+bool RawConverter::restoreTextures(const gls::size& imageSize) {
+    auto entry = std::find_if(_textureCache.begin(), _textureCache.end(), [&imageSize](const SizedTextures& textures) {
+        return textures.imageSize == imageSize;
+    });
+    // The statistics images are only allocated when calibrating
+    if (entry == _textureCache.end() || (_calibrateFromImage && !entry->meanImage)) {
+        return false;
+    }
+
+    _scaledRawImage = std::move(entry->scaledRawImage);
+    _rawGradientImage = std::move(entry->rawGradientImage);
+    _greenImage = std::move(entry->greenImage);
+    _linearRGBImageA = std::move(entry->linearRGBImageA);
+    _linearRGBImageB = std::move(entry->linearRGBImageB);
+    _meanImage = std::move(entry->meanImage);
+    _varImage = std::move(entry->varImage);
+    _pyramidProcessor = std::move(entry->pyramidProcessor);
+    _rawImageSize = entry->imageSize;
+    _allocatedBytes = entry->allocatedBytes;
+
+    if (!entry->setPurgeable(false)) {
+        // The storage is still there, the cached results are recomputed
+        std::cout << "RawConverter textures for " << imageSize.width << " x " << imageSize.height
+                  << " were purged" << std::endl;
+        _rerenderKey.reset();
+    }
+
+    _textureCache.erase(entry);
+    return true;
+}
+
+bool RawConverter::SizedTextures::setPurgeable(bool purgeable) {
+    const auto state = purgeable ? MTL::PurgeableStateVolatile : MTL::PurgeableStateNonVolatile;
+    bool retained = true;
+    for (const gls::mtl_image_2d<gls::pixel_float>* image : { scaledRawImage.get(), greenImage.get() }) {
+        retained &= !image || image->setPurgeableState(state) != MTL::PurgeableStateEmpty;
+    }
+    retained &= !rawGradientImage || rawGradientImage->setPurgeableState(state) != MTL::PurgeableStateEmpty;
+    for (const gls::mtl_image_2d<gls::pixel_float4>* image : { linearRGBImageA.get(), linearRGBImageB.get(),
+                                                                meanImage.get(), varImage.get() }) {
+        retained &= !image || image->setPurgeableState(state) != MTL::PurgeableStateEmpty;
+    }
+    // Always reached, the pyramid processor must be made nonvolatile too
+    return (!pyramidProcessor || pyramidProcessor->setPurgeable(purgeable)) && retained;
+}
+
+void RawConverter::trimTextureCache() {
+    size_t cachedBytes = 0;
+    for (const auto& textures : _textureCache) {
+        cachedBytes += textures.allocatedBytes;
+    }
+
+    // Evict the least recently used sizes first
+    while (!_textureCache.empty() && cachedBytes > _textureCacheBudget) {
+        cachedBytes -= _textureCache.back().allocatedBytes;
+        _textureCache.pop_back();
+    }
+}
+
+size_t RawConverter::trimMemory(gls::MemoryPressure level) {
+    if (level == gls::MemoryPressure::normal) {
+        return 0;
+    }
+
+    _mtlContext.waitForCompletion();
+
+    size_t released = _outputImagePool.trim() + _ycbcrOutputImagePool.trim();
+    const auto drop = [&released](auto* image) {
+        if (*image) {
+            released += (*image)->allocatedSize();
+            *image = nullptr;
+        }
+    };
+
+    released += allocatedBytes() - _allocatedBytes;
+    _textureCache.clear();
+
+    _rerenderKey.reset();
+
+    drop(&_previewRawImage);
+    drop(&_previewYCbCrImage);
+    drop(&_previewDenoisedImage);
+    drop(&_previewImage);
+    drop(&_progressivePreviewImage);
+
+    if (level == gls::MemoryPressure::critical) {
+        released += _allocatedBytes;
+        drop(&_rawImage);
+        releaseTextures();
+        if (_temporalDenoiser) {
+            _temporalDenoiser->releaseTextures();
+        }
+    }
+    return released;
+}
+
+size_t RawConverter::requestTrim(gls::MemoryPressure level) {
+    // Keep the strongest pending level
+    int pending = _deferredTrim.load();
+    while (pending < (int) level && !_deferredTrim.compare_exchange_weak(pending, (int) level)) { }
+
+    return _outputImagePool.trim() + _ycbcrOutputImagePool.trim();
+}
+
+void RawConverter::setPrecisionPolicy(const PrecisionPolicy& precisionPolicy) {
+    _mtlContext.waitForCompletion();
+
+    _precisionPolicy = precisionPolicy;
+
+    // Force the reallocation of all the intermediates
+    _textureCache.clear();
+    _rawImageSize = {0, 0};
+    _demosaicGraph = nullptr;
+    _ltmImagePyramid[0] = nullptr;
+    _localToneMapping = std::make_unique<LocalToneMapping>(&_mtlContext);
+}
+
+void RawConverter::setTemporalDenoise(float strength, uint64_t scene) {
+    if (strength <= 0) {
+        if (_temporalDenoiser) {
+            _mtlContext.waitForCompletion();
+            _temporalDenoiser = nullptr;
+        }
+        return;
+    }
+    if (!_temporalDenoiser) {
+        _temporalDenoiser = std::make_unique<TemporalDenoiser>(&_mtlContext);
+    }
+    _temporalDenoiser->strength = std::min(strength, 0.95f);
+    _temporalDenoiser->scene = scene;
+}
+
+void RawConverter::setHalfResolutionGradients(bool halfResolutionGradients) {
+    if (halfResolutionGradients == _halfResolutionGradients) {
+        return;
+    }
+    _mtlContext.waitForCompletion();
+
+    _halfResolutionGradients = halfResolutionGradients;
+
+    // The cached textures have the previous gradient size
+    _textureCache.clear();
+    _rawImageSize = {0, 0};
+    _demosaicGraph = nullptr;
+}
+
+void RawConverter::setPreset(const PipelinePreset& preset) {
+    const auto& p = _precisionPolicy;
+    const auto& q = preset.precision;
+    if (p.rawData != q.rawData || p.gradients != q.gradients || p.demosaic != q.demosaic || p.pyramid != q.pyramid ||
+        p.ltm != q.ltm) {
+        setPrecisionPolicy(preset.precision);
+    }
+    if (preset.gradientBlurRadius != _preset.gradientBlurRadius) {
+        _rawFrontEnd.setBlurRadii(&_mtlContext, preset.gradientBlurRadius[0], preset.gradientBlurRadius[1]);
+    }
+    setHalfResolutionGradients(preset.halfResolutionGradients);
+    _tiledDemosaic = preset.tiledDemosaic;
+    _bakedColorLut = preset.bakedColorLut;
+    _mipmappedLtmPyramid = preset.mipmappedLtmPyramid;
+    _pcaRefreshInterval = std::max(preset.pcaRefreshInterval, 1);
+    _preset = preset;
+}
+
+double RawConverter::validatePrecision(const gls::image<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters) {
+    const auto precisionPolicy = _precisionPolicy;
+    const bool halfResolutionGradients = _halfResolutionGradients;
+
+    // The pipeline updates some of the parameters, give each run its own copy
+    auto baselineParameters = demosaicParameters;
+    setPrecisionPolicy(PrecisionPolicy::fullPrecision());
+    setHalfResolutionGradients(false);
+    const auto baselineImage = demosaic(rawImage, &baselineParameters)->toImage();
+
+    auto testParameters = demosaicParameters;
+    setPrecisionPolicy(precisionPolicy);
+    setHalfResolutionGradients(halfResolutionGradients);
+    const auto testImage = demosaic(rawImage, &testParameters)->mapImage();
+
+    double squaredError = 0;
+    testImage->apply([&](const gls::pixel_float4& p, int x, int y) {
+        const auto& b = (*baselineImage)[y][x];
+        for (int c = 0; c < 3; c++) {
+            const double diff = std::clamp((double) p[c], 0.0, 1.0) - std::clamp((double) b[c], 0.0, 1.0);
+            squaredError += diff * diff;
+        }
+    });
+    const double mse = squaredError / (3.0 * testImage->width * testImage->height);
+    const double psnr = mse > 0 ? 10 * std::log10(1 / mse) : std::numeric_limits<double>::infinity();
+
+    std::cout << "Precision policy PSNR vs fp32 baseline: " << std::setprecision(2) << std::fixed << psnr << "dB" << std::endl;
+
+    return psnr;
+}
+
+void RawConverter::allocateLtmImagePyramid(const gls::size& imageSize) {
+    auto mtlDevice = _mtlContext.device();
+    const bool mipmapped = _mipmappedLtmPyramid &&
+        gls::mtl_mipmapped_image_2d<gls::pixel_float4>::supportsMipmaps(mtlDevice, _precisionPolicy.ltm);
+
+    if (_ltmImagePyramid[0] == nullptr || _ltmImagePyramid[0]->width != imageSize.width / 2 || _ltmImagePyramid[0]->height != imageSize.height / 2 ||
+        _ltmPyramidMipmapped != mipmapped) {
+        if (mipmapped) {
+            // Mipmap level i of the first level is 1 / 2^i its size, rounded down as imageSize / scale
+            auto pyramid = std::make_unique<gls::mtl_mipmapped_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / 2, imageSize.height / 2,
+                                                                                            (int) _ltmImagePyramid.size(), _precisionPolicy.ltm);
+            for (int i = 1; i < (int) _ltmImagePyramid.size(); i++) {
+                _ltmImagePyramid[i] = pyramid->level(i);
+            }
+            _ltmImagePyramid[0] = std::move(pyramid);
+        } else {
+            int levels = (int) _ltmImagePyramid.size() + 1;
+            for (int i = 0, scale = 2; i < levels - 1; i++, scale *= 2) {
+                _ltmImagePyramid[i] = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / scale, imageSize.height / scale,
+                                                                                                      _precisionPolicy.ltm);
+            }
+        }
+        _ltmPyramidMipmapped = mipmapped;
+    }
+}
+
+void RawConverter::configurePyramidProcessor(const DemosaicParameters& demosaicParameters) {
+    _pyramidProcessor->pcaRefreshInterval = _pcaRefreshInterval;
+    _pyramidProcessor->pcaDriftThreshold = _pcaDriftThreshold;
+    _pyramidProcessor->pcaScene = _pcaScene;
+    _pyramidProcessor->denoiseLevels = demosaicParameters.denoisePyramidConfig.levels;
+    _pyramidProcessor->pcaComponents = demosaicParameters.denoisePyramidConfig.pcaComponents;
+    _pyramidProcessor->blockMatchingNoise = demosaicParameters.denoisePyramidConfig.blockMatchingNoise;
+    _pyramidProcessor->copyNoise = demosaicParameters.denoisePyramidConfig.copyNoise;
+    _pyramidProcessor->pcaSampleBudget = demosaicParameters.denoisePyramidConfig.pcaSampleBudget;
+    _pyramidProcessor->pcaBasisLevel = demosaicParameters.denoisePyramidConfig.pcaBasisLevel;
+    _pyramidProcessor->chroma420 = demosaicParameters.denoisePyramidConfig.chroma420;
+    _pyramidProcessor->cpuLevels = _cpuPyramidLevels;
+}
+
+gls::mtl_image_2d<gls::pixel_float4>* RawConverter::denoise(const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
+                                                                DemosaicParameters* demosaicParameters) {
+    NoiseModel<5>* noiseModel = &demosaicParameters->noiseModel;
+
+    // Luma and Chroma Despeckling
+    const auto& np = noiseModel->pyramidNlf[0];
+    _despeckleImage(&_mtlContext, inputImage,
+                    /*var_a=*/np.first,
+                    /*var_b=*/np.second, _linearRGBImageB.get());
+
+    // The temporal denoise leaves less noise to the pyramid, the frame's noise model is kept
+    const gls::mtl_image_2d<gls::pixel_float4>* pyramidInput = _linearRGBImageB.get();
+    std::array<YCbCrNLF, 5> temporalNlf;
+    std::array<YCbCrNLF, 5>* pyramidNlf = &noiseModel->pyramidNlf;
+    if (_temporalDenoiser) {
+        temporalNlf = noiseModel->pyramidNlf;
+        pyramidInput = &_temporalDenoiser->denoise(&_mtlContext, *_linearRGBImageB, &temporalNlf);
+        pyramidNlf = &temporalNlf;
+        // The input depends on the history, not only on the raw data
+        _pyramidProcessor->denoiseInputKey.reset();
+    }
+
+    configurePyramidProcessor(*demosaicParameters);
+    gls::mtl_image_2d<gls::pixel_float4>* denoisedImage = _pyramidProcessor->denoise(&_mtlContext, &(demosaicParameters->denoiseParameters),
+                                                                                         *pyramidInput, *_rawGradientImage,
+                                                                                         pyramidNlf,
+                                                                                         demosaicParameters->exposure_multiplier,
+                                                                                         lensShading(*demosaicParameters, inputImage.size()),
+                                                                                         _calibrateFromImage);
+
+    denoisedImageStatistics(*denoisedImage, *_rawGradientImage, demosaicParameters);
+
+    return denoisedImage;
+}
+
+void RawConverter::denoisedImageStatistics(const gls::mtl_image_2d<gls::pixel_float4>& denoisedImage,
+                                           const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                                           DemosaicParameters* demosaicParameters) {
+    // The histogram statistics run concurrently with the first LTM passes
+    MetalContext::ConcurrentScope concurrent(&_mtlContext);
+
+    // Use a lower level of the pyramid to compute the histogram, the privatized histogram kernel
+    // makes the finer level affordable
+    if (!_frozenHistogram) {
+        const auto histogramImage = _pyramidProcessor->denoisedLevel(2);
+        _histogramImage(&_mtlContext, *histogramImage);
+    }
+
+//    _mtlContext.waitForCompletion();
+//    auto histogramData = this->histogramData();
+//
+//    auto histogramImageCPU = histogramImage->mapImage();
+//    gls::image<gls::luma_pixel_16> lumaImage(histogramImageCPU->width, histogramImageCPU->height);
+//    lumaImage.apply([&](gls::luma_pixel_16* p, int x, int y) {
+//        float luma = std::clamp(((*histogramImageCPU)[y][x].x - histogramData->black_level) / (histogramData->white_level - histogramData->black_level), 0.0f, 1.0f);
+//
+//        p->luma = (uint16_t) (0xffff * std::sqrt(luma));
+//    });
+//    lumaImage.write_png_file("/Users/fabio/luma.png");
+
+
+    if (demosaicParameters->rgbConversionParameters.localToneMapping) {
+        // Tiles and crops are different images, they never share the cached bands
+        createLtmMask(denoisedImage, gradientImage, demosaicParameters, /*temporal=*/ !_frozenHistogram);
+    }
+}
+
+void RawConverter::createLtmMask(const gls::mtl_image_2d<gls::pixel_float4>& denoisedImage,
+                                 const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
+                                 DemosaicParameters* demosaicParameters, bool temporal) {
+    const std::array<const gls::mtl_image_2d<gls::pixel_float4>*, 3>& guideImage = {
+        _pyramidProcessor->denoisedLevel(4),
+        _pyramidProcessor->denoisedLevel(2),
+        _pyramidProcessor->denoisedLevel(1)
+    };
+    _localToneMapping->refreshInterval = _ltmRefreshInterval;
+    _localToneMapping->temporalWeight = _ltmTemporalWeight;
+    _localToneMapping->scene = _ltmScene;
+    MetalContext::TraceScope trace(&_mtlContext, "LTM");
+    _localToneMapping->createMask(&_mtlContext, denoisedImage, gradientImage, guideImage, demosaicParameters->noiseModel,
+                                  demosaicParameters->ltmParameters, _histogramImage.buffer(), temporal);
+}
+
+uint64_t RawConverter::denoiseInputKey(uint64_t rawContentHash, const DemosaicGraphConfig& config,
+                                       const DemosaicParameters& p) const {
+    gls::ContentHash hash;
+    hash.add(rawContentHash);
+    hash.add(config.imageSize.width);
+    hash.add(config.imageSize.height);
+    hash.add(config.rawDenoise);
+    hash.add(config.tiledDemosaic);
+    hash.add(config.pointwiseFusion);
+    hash.add(config.inlineHighlights);
+
+    // The parameters of the stages ahead of the denoising pyramid
+    hash.add(p.bayerPattern);
+    hash.add(p.black_level);
+    hash.add(p.white_level);
+    hash.add(p.exposure_multiplier);
+    hash.add(p.raw_exposure_multiplier);
+    hash.add(p.lensShadingCorrection);
+    hash.add(p.lensShadingGainMap.get());
+    hash.add(p.scale_mul);
+    hash.add(p.rgb_cam);
+    hash.add(p.rawDenoiseParameters.highNoiseImage);
+    hash.add(p.rawDenoiseParameters.strength);
+    hash.add(p.noiseModel.rawNlf.first);
+    hash.add(p.noiseModel.rawNlf.second);
+    // The despeckling of the pyramid input
+    hash.add(p.noiseModel.pyramidNlf[0].first);
+    hash.add(p.noiseModel.pyramidNlf[0].second);
+    return hash.value;
+}
+
+uint64_t RawConverter::rerenderKey(uint64_t denoiseInputKey, const DemosaicParameters& p) const {
+    gls::ContentHash hash;
+    hash.add(denoiseInputKey);
+
+    // With the denoise input, everything but rgbConversionParameters and ltmParameters
+    for (const auto& nlf : p.noiseModel.pyramidNlf) {
+        hash.add(nlf.first);
+        hash.add(nlf.second);
+    }
+    for (const auto& dp : p.denoiseParameters) {
+        hash.add(dp.luma);
+        hash.add(dp.chroma);
+        hash.add(dp.chromaBoost);
+        hash.add(dp.gradientBoost);
+        hash.add(dp.gradientThreshold);
+        hash.add(dp.sharpening);
+    }
+    const auto& pc = p.denoisePyramidConfig;
+    hash.add(pc.levels);
+    hash.add(pc.pcaComponents);
+    hash.add(pc.blockMatchingNoise);
+    hash.add(pc.copyNoise);
+    hash.add(pc.pcaSampleBudget);
+    hash.add(pc.pcaBasisLevel);
+    hash.add(pc.chroma420);
+    return hash.value;
+}
+
+template <typename OutputImageType>
+void RawConverter::convertTosRGB(const gls::mtl_image_2d<gls::pixel_float4>& linearImage, DemosaicParameters* demosaicParameters,
+                                 OutputImageType* outputImage, const gls::Matrix<3, 3>* ycbcrToCam) {
+    // FIXME: This is horrible!
+    demosaicParameters->rgbConversionParameters.exposureBias += log2(demosaicParameters->exposure_multiplier);
+
+    // The grain tile is shared by all images, the image's noise seed picks its offset
+    const auto& grainImage = _filmGrain.grainImage(&_mtlContext);
+
+    if constexpr (std::is_same<OutputImageType, gls::mtl_image_2d<gls::pixel_float4>>::value) {
+        _convertTosRGB(&_mtlContext, linearImage, _localToneMapping->getMask(), *demosaicParameters,
+                       _histogramImage.buffer(), /*luma_nlf=*/ 2.0f * _demosaicFrame.rawVariance[1], grainImage,
+                       filmGrain::offset(_demosaicFrame.noiseSeed), outputImage, _extraOutputs, _bakedColorLut, ycbcrToCam);
+    } else {
+        _convertTosRGB(&_mtlContext, linearImage, _localToneMapping->getMask(), *demosaicParameters,
+                       _histogramImage.buffer(), /*luma_nlf=*/ 2.0f * _demosaicFrame.rawVariance[1], grainImage,
+                       filmGrain::offset(_demosaicFrame.noiseSeed), outputImage, _bakedColorLut, ycbcrToCam);
+    }
+}
+
+// The denoised pyramid of the last run, finest first
+static std::vector<const gls::mtl_image_2d<gls::pixel_float4>*> denoisedLevels(const PyramidProcessor<5>& pyramidProcessor) {
+    std::vector<const gls::mtl_image_2d<gls::pixel_float4>*> levels;
+    for (int level = 0; level < 5; level++) {
+        levels.push_back(pyramidProcessor.denoisedLevel(level));
+    }
+    return levels;
+}
+
+// Debug dumps, see gls::DebugDumpService
+void saveLumaImage(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float>& denoisedImage) {
+    gls::DebugDumpService::shared().dump(context, denoisedImage, "green.png",
+                                         [](const gls::image<gls::pixel_float>& image, const std::string& path) {
+        gls::image<gls::luma_pixel_16> out(image.width, image.height);
+        out.apply([&image](gls::luma_pixel_16* p, int x, int y) {
+            *p = {
+                (uint16_t) std::clamp((int)(0xffff * image[y][x]), 0, 0xffff)
+            };
+        });
+        out.write_png_file(path);
+    });
+}
+
+void saveRawChannels(const gls::image<gls::pixel_float4>& rgbaRawImage, const std::string& postfix) {
+    gls::DebugDumpService::shared().dump(rgbaRawImage, "raw_" + postfix,
+                                         [](const gls::image<gls::pixel_float4>& image, const std::string& path) {
+        std::array<gls::image<gls::luma_pixel_16>::unique_ptr, 4> saveImages;
+        for (auto& img : saveImages) {
+            img = std::make_unique<gls::image<gls::luma_pixel_16>>(image.size());
+        }
+        image.apply([&] (const gls::pixel_float4& p, int x, int y){
+            for (int c = 0; c < 4; c++) {
+                (*saveImages[c])[y][x] = std::clamp(0xffff * p[c], 0.0f, (float) 0xffff);
+            }
+        });
+        saveImages[0]->write_png_file(path + "_red.png");
+        saveImages[1]->write_png_file(path + "_green1.png");
+        saveImages[2]->write_png_file(path + "_blue.png");
+        saveImages[3]->write_png_file(path + "_green2.png");
+    });
+}
+
+RawConverter::AsyncResult RawConverter::demosaicAsync(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                     DemosaicParameters* demosaicParameters,
+                                                     bool noiseReduction, bool postProcess,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    if (!_rawImage || _rawImage->size() != rawImage.size()) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
+    }
+    _rawImage->copyPixelsFrom(rawImage);
+
+    return demosaicAsync(*_rawImage, demosaicParameters, noiseReduction, postProcess, outputImage);
+}
+
+static bool validPackedLayout(const PackedRawImage& rawImage) {
+    return rawImage.bitsPerSample >= 8 && rawImage.bitsPerSample <= 16 &&
+           rawImage.rowBytes >= PackedRawImage::packedRowBytes(rawImage.width, rawImage.bitsPerSample) &&
+           (!rawImage.littleEndian || rawImage.bitsPerSample == 16);
+}
+
+RawConverter::AsyncResult RawConverter::demosaicAsync(const PackedRawImage& rawImage, DemosaicParameters* demosaicParameters,
+                                                     bool noiseReduction, bool postProcess,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    if (!validPackedLayout(rawImage) || rawImage.data.size() < rawImage.payloadBytes()) {
+        throw std::runtime_error("RawConverter: invalid packed raw image");
+    }
+    const gls::size imageSize = { rawImage.width, rawImage.height };
+    if (!_rawImage || _rawImage->size() != imageSize) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), imageSize);
+    }
+    if (!_packedRawData || _packedRawData->size() < rawImage.payloadBytes()) {
+        gls::GPUMemoryTracker::Scope scope("RawConverter");
+        _packedRawData = std::make_unique<gls::Buffer<uint8_t>>(_mtlContext.device(), rawImage.payloadBytes());
+    }
+    std::memcpy(_packedRawData->data(), rawImage.data.data(), rawImage.payloadBytes());
+
+    // In stream ahead of the pipeline, every stage sees the unpacked data
+    _unpackRawData(&_mtlContext, *_packedRawData, rawImage, _rawImage.get());
+
+    // The raw texture is only written by the GPU, the packed data identifies it
+    if (_rerenderCache) {
+        gls::ContentHash hash;
+        hash.add(rawImage.width);
+        hash.add(rawImage.height);
+        hash.add(rawImage.bitsPerSample);
+        hash.add(rawImage.rowBytes);
+        hash.add(rawImage.littleEndian);
+        hash.addBytes(rawImage.data.data(), rawImage.data.size());
+        _rawContentHash = hash.value;
+    }
+    return demosaicAsync(*_rawImage, demosaicParameters, noiseReduction, postProcess, outputImage, nullptr);
+}
+
+RawConverter::AsyncResult RawConverter::demosaicAsync(const StreamedRawImage& rawImage, DemosaicParameters* demosaicParameters,
+                                                     bool noiseReduction, bool postProcess,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    const auto& layout = rawImage.layout;
+    if (!validPackedLayout(layout) || !rawImage.payload || rawImage.payload->size() < layout.payloadBytes() ||
+        !rawImage.loaded || rawImage.payload->buffer()->device() != _mtlContext.device()) {
+        throw std::runtime_error("RawConverter: invalid streamed raw image");
+    }
+    const gls::size imageSize = { layout.width, layout.height };
+    if (!_rawImage || _rawImage->size() != imageSize) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), imageSize);
+    }
+
+    // The load, the unpacking and the pipeline in the same command buffer
+    MetalContext::BatchScope batch(&_mtlContext);
+
+    _mtlContext.enqueue([loaded = rawImage.loaded](MTL::CommandBuffer* commandBuffer) {
+        commandBuffer->encodeWait(loaded.get(), StreamedRawImage::kLoadedValue);
+    });
+    _unpackRawData(&_mtlContext, *rawImage.payload, layout, _rawImage.get());
+
+    // Not loaded yet, the run can't be keyed for re-rendering
+    return demosaicAsync(*_rawImage, demosaicParameters, noiseReduction, postProcess, outputImage, nullptr);
+}
+
+RawConverter::AsyncResult RawConverter::demosaicToYCbCrAsync(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                             DemosaicParameters* demosaicParameters, bool noiseReduction,
+                                                             gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage) {
+    if (!_rawImage || _rawImage->size() != rawImage.size()) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
+    }
+    _rawImage->copyPixelsFrom(rawImage);
+
+    return demosaicToYCbCrAsync(*_rawImage, demosaicParameters, noiseReduction, ycbcrImage);
+}
+
+static uint64_t rawContentHash(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage) {
+    gls::ContentHash hash;
+    hash.addImage(*rawImage.mapImage());
+    return hash.value;
+}
+
+RawConverter::AsyncResult RawConverter::demosaicToYCbCrAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                             DemosaicParameters* demosaicParameters, bool noiseReduction,
+                                                             gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage) {
+    // GPU-only raw images can't be hashed, their runs are never re-rendered
+    if (_rerenderCache && rawImage.cpuAccessible()) {
+        _rawContentHash = rawContentHash(rawImage);
+    }
+    return demosaicAsync(rawImage, demosaicParameters, noiseReduction, /*postProcess=*/ true, nullptr, ycbcrImage);
+}
+
+RawConverter::AsyncResult RawConverter::demosaicAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                     DemosaicParameters* demosaicParameters,
+                                                     bool noiseReduction, bool postProcess,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    // GPU-only raw images can't be hashed, their runs are never re-rendered
+    if (_rerenderCache && rawImage.cpuAccessible()) {
+        _rawContentHash = rawContentHash(rawImage);
+    }
+    return demosaicAsync(rawImage, demosaicParameters, noiseReduction, postProcess, outputImage, nullptr);
+}
+
+RawConverter::AsyncResult RawConverter::demosaicAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                     DemosaicParameters* demosaicParameters,
+                                                     bool noiseReduction, bool postProcess,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage,
+                                                     gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage,
+                                                     const preview_callback_type& previewReady) {
+    if (demosaicParameters->quadBayer) {
+        return demosaicQuadBayerAsync(rawImage, demosaicParameters, noiseReduction, postProcess, outputImage, ycbcrImage,
+                                      previewReady);
+    }
+
+    assert(!ycbcrImage || (postProcess && ycbcrImage->size() == rawImage.size()));
+
+    // Set by the public entry points for this call only
+    const auto rawContentHash = std::exchange(_rawContentHash, std::nullopt);
+    const auto noiseSeed = std::exchange(_noiseSeed, std::nullopt);
+    const auto downscaledOutputImage = std::exchange(_downscaledOutputImage, nullptr);
+    assert(!downscaledOutputImage || (postProcess && noiseReduction && !ycbcrImage));
+
+    allocateTextures(rawImage.size());
+
+    _renditionsWritten = false;
+    if (postProcess && noiseReduction) {
+        allocateRenditions(rawImage.size());
+    }
+
+    bool high_noise_image = _calibrateFromImage ? false : demosaicParameters->rawDenoiseParameters.highNoiseImage;
+
+    const DemosaicGraphConfig config = {
+        rawImage.size(), noiseReduction, noiseReduction && high_noise_image, postProcess, _tiledDemosaic,
+        _measureImageStatistics, _untrackedHazards, _pointwiseFusion, _tileMemoryFusion, _inlineHighlights
+    };
+
+    // Runs updating the noise model are always rendered in full, as are the ones reading state left by other images
+    // (frozen histogram, progressive previews, crops) for the re-rendering
+    std::optional<uint64_t> inputKey;
+    if (_rerenderCache && rawContentHash && noiseReduction && !_calibrateFromImage) {
+        inputKey = denoiseInputKey(*rawContentHash, config, *demosaicParameters);
+    }
+    std::optional<uint64_t> key;
+    if (inputKey && postProcess && !previewReady && !_frozenHistogram && _regionFrameSize.width == 0) {
+        key = rerenderKey(*inputKey, *demosaicParameters);
+    }
+    const bool rerender = key && key == _rerenderKey && _demosaicGraph && _demosaicGraphConfig == config;
+    _rerenderKey = key;
+
+    // Zero histogram data, a re-render keeps the statistics of its image
+    if (!_frozenHistogram && !rerender) {
+        _histogramImage.reset();
+    }
+    if (_measureImageStatistics && !rerender) {
+        _imageStatistics.reset();
+    }
+
+    if (demosaicParameters->rgbConversionParameters.localToneMapping) {
+        _localToneMapping->allocateTextures(&_mtlContext, rawImage.width, rawImage.height, _precisionPolicy.ltm);
+    }
+
+    if (!_demosaicGraph || !(_demosaicGraphConfig == config)) {
+        _mtlContext.waitForCompletion();
+        buildDemosaicGraph(config);
+    }
+
+    auto& frame = _demosaicFrame;
+    frame.demosaicParameters = demosaicParameters;
+    frame.ycbcrOutputImage = ycbcrImage;
+    frame.previewReady = previewReady;
+    frame.denoiseInputKey = inputKey;
+    frame.downscaledOutputImage = downscaledOutputImage;
+    frame.rawVariance = getRawVariance(demosaicParameters->noiseModel.rawNlf);
+
+    // Convert linear image to YCbCr for denoising
+    const auto ycbcrTransforms = ColorProfileCache::shared().ycbcrTransforms(demosaicParameters->rgb_cam, xyz_rgb());
+    frame.cam_to_ycbcr = ycbcrTransforms.cam_to_ycbcr;
+
+    // Convert result back to camera RGB
+    frame.ycbcr_to_cam = ycbcrTransforms.ycbcr_to_cam;
+
+    // Use the first pixel value of the image as a seed for the noise to have a stable noise pattern for every given image
+    frame.noiseSeed = noiseSeed ? *noiseSeed : (*rawImage.mapImage())[0][0];
+
+    gls::mtl_image_2d<gls::pixel_float4>* resultImage = _linearRGBImageA.get();
+    if (postProcess && outputImage) {
+        assert(outputImage->size() == _linearRGBImageA->size());
+        resultImage = outputImage;
+    }
+
+    auto context = &_mtlContext;
+
+    if (rerender) {
+        // The cached intermediates include heap textures, the previous frame must be done with them
+        context->waitForCompletion();
+
+        MetalContext::BatchScope batch(context);
+
+        if (demosaicParameters->rgbConversionParameters.localToneMapping) {
+            createLtmMask(*_pyramidProcessor->denoisedLevel(0), *_rawGradientImage, demosaicParameters, /*temporal=*/ false);
+        }
+        const auto& denoisedImage = *_pyramidProcessor->denoisedLevel(0);
+        if (downscaledOutputImage) {
+            encodeDownscaledOutput(context, demosaicParameters, frame.ycbcr_to_cam, downscaledOutputImage);
+        } else if (ycbcrImage) {
+            convertTosRGB(denoisedImage, demosaicParameters, ycbcrImage, &frame.ycbcr_to_cam);
+        } else {
+            convertTosRGB(denoisedImage, demosaicParameters, resultImage, &frame.ycbcr_to_cam);
+        }
+        encodeRenditions(context, denoisedLevels(*_pyramidProcessor), frame.ycbcr_to_cam, *demosaicParameters);
+        return { resultImage, context->submit(), renditionImages() };
+    }
+
+    // The imported textures change with the texture cache and with the caller's images, bind them for every frame
+    const auto& t = _demosaicGraphTextures;
+    auto& graph = *_demosaicGraph;
+    graph.bind(t.rawImage, const_cast<gls::mtl_image_2d<gls::luma_pixel_16>*>(&rawImage));
+    graph.bind(t.scaledRawImage, _scaledRawImage.get());
+    graph.bind(t.rawGradientImage, _rawGradientImage.get());
+    graph.bind(t.greenImage, _greenImage.get());
+    graph.bind(t.linearRGBImageA, _linearRGBImageA.get());
+    graph.bind(t.linearRGBImageB, _linearRGBImageB.get());
+    graph.bind(t.outputImage, resultImage);
+
+    // Record the whole frame into a single command buffer, CPU sync points flush the batch
+    MetalContext::BatchScope batch(context);
+
+    graph.execute(context);
+
+    return { resultImage, context->submit(), renditionImages() };
+}
+
+void RawConverter::buildDemosaicGraph(const DemosaicGraphConfig& config) {
+    _demosaicGraph = std::make_unique<StageGraph>();
+    _demosaicGraphConfig = config;
+
+    auto& graph = *_demosaicGraph;
+    auto& t = _demosaicGraphTextures;
+    auto& frame = _demosaicFrame;
+
+    t.rawImage = graph.importTexture<gls::luma_pixel_16>("rawImage");
+    t.scaledRawImage = graph.importTexture<gls::pixel_float>("scaledRawImage");
+    t.rawGradientImage = graph.importTexture<gls::pixel_float2>("rawGradientImage");
+    t.greenImage = graph.importTexture<gls::pixel_float>("greenImage");
+    t.linearRGBImageA = graph.importTexture<gls::pixel_float4>("linearRGBImageA");
+    t.linearRGBImageB = graph.importTexture<gls::pixel_float4>("linearRGBImageB");
+    t.outputImage = graph.importTexture<gls::pixel_float4>("outputImage");
+
+    // Denoised raw mosaic, only allocated when raw denoising is enabled
+    const auto denoisedRawImage = graph.transientTexture<gls::pixel_float>("denoisedRawImage", config.imageSize,
+                                                                          _precisionPolicy.rawData);
+
+    // --- Image Statistics ---
+
+    // Sampling every other Bayer quad, a quarter of the raw data is read
+    graph.addStage("imageStatistics", { t.rawImage }, {}, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto p = frame.demosaicParameters;
+        const gls::Vector<3> lumaWeights = { frame.cam_to_ycbcr[0][0], frame.cam_to_ycbcr[0][1], frame.cam_to_ycbcr[0][2] };
+        _imageStatistics(context, *graph[t.rawImage], p->bayerPattern, p->scale_mul, p->black_level / 0xffff,
+                         lumaWeights, /*sampleStride=*/ 2);
+    }, config.imageStatistics, { .concurrent = true, .sideEffects = true });
+
+    // --- Image Demosaicing ---
+
+    // The noise measurement needs the scaled raw data ahead of the front-end, which then rewrites it
+    graph.addStage("scaleRawData", { t.rawImage }, { t.scaledRawImage }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto p = frame.demosaicParameters;
+        const auto rawImage = graph[t.rawImage];
+        _scaleRawData(context, *rawImage, graph[t.scaledRawImage], p->bayerPattern, p->scale_mul,
+                      p->black_level / 0xffff, lensShading(*p, rawImage->size()));
+    }, _calibrateFromImage);
+
+    graph.addStage("measureRawNLF", { t.scaledRawImage }, {}, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto p = frame.demosaicParameters;
+        p->noiseModel.rawNlf = MeasureRawNLF(p->exposure_multiplier, p->bayerPattern);
+        frame.rawVariance = getRawVariance(p->noiseModel.rawNlf);
+    }, _calibrateFromImage, { .sideEffects = true });
+
+    graph.addStage("rawFrontEnd", { t.rawImage }, { t.scaledRawImage, t.rawGradientImage }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto p = frame.demosaicParameters;
+        const auto rawImage = graph[t.rawImage];
+        _rawFrontEnd(context, *rawImage, graph[t.scaledRawImage], p->bayerPattern, p->scale_mul,
+                     p->black_level / 0xffff, lensShading(*p, rawImage->size()),
+                     frame.rawVariance[1], graph[t.rawGradientImage]);
+    });
+
+    graph.addStage("rawDenoise", { t.scaledRawImage, t.rawGradientImage }, { denoisedRawImage }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto p = frame.demosaicParameters;
+        _highNoiseRawDenoise(context, *graph[t.scaledRawImage], *graph[t.rawGradientImage], p->bayerPattern,
+                             p->noiseModel.rawNlf.second, p->rawDenoiseParameters.strength, graph[denoisedRawImage]);
+    }, config.rawDenoise);
+
+    // The demosaic reads the denoised mosaic in place of the scaled raw data
+    const auto demosaicInput = config.rawDenoise ? denoisedRawImage : t.scaledRawImage;
+
+    // With inline highlights the demosaic blends the highlights as it writes linearRGBImageA
+    const auto inlineHighlights = [this, enabled = config.inlineHighlights]() -> std::optional<demosaicImageKernel::InlineHighlights> {
+        if (!enabled) {
+            return std::nullopt;
+        }
+        // The previous frame is done with the count, see clippedPixels
+        _clippedPixels.data()[0] = 0;
+        return demosaicImageKernel::InlineHighlights { /*clip=*/ 1.0, _clippedPixels.buffer() };
+    };
+
+    // With inline highlights and noise reduction nothing reads the demosaic's camera RGB, it writes the denoiser's
+    // YCbCr input directly
+    const bool ycbcrDemosaic = config.noiseReduction && config.inlineHighlights;
+
+    graph.addStage("demosaicSinglePass", { demosaicInput, t.rawGradientImage }, { t.linearRGBImageA }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto highlights = inlineHighlights();
+        _demosaicImage(context, *graph[demosaicInput], *graph[t.rawGradientImage], graph[t.linearRGBImageA],
+                       frame.demosaicParameters->bayerPattern, frame.rawVariance, highlights ? &*highlights : nullptr,
+                       ycbcrDemosaic ? &frame.cam_to_ycbcr : nullptr);
+    }, config.tiledDemosaic);
+
+    graph.addStage("demosaic", { demosaicInput, t.rawGradientImage },
+                   { t.greenImage, t.linearRGBImageB, t.linearRGBImageA }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto highlights = inlineHighlights();
+        _demosaicImage(context, *graph[demosaicInput], *graph[t.rawGradientImage],
+                       graph[t.greenImage], /*rgbImageTmp=*/ graph[t.linearRGBImageB], graph[t.linearRGBImageA],
+                       frame.demosaicParameters->bayerPattern, frame.rawVariance, highlights ? &*highlights : nullptr,
+                       ycbcrDemosaic ? &frame.cam_to_ycbcr : nullptr);
+    }, !config.tiledDemosaic);
+
+    // With noise reduction the highlights blending and the conversion to YCbCr are the chain of pointwise stages
+    // ahead of the denoiser: fused, linearRGBImageA holds the denoiser's YCbCr input after this stage
+    const bool fuseHighlightsToYCbCr = config.pointwiseFusion && config.noiseReduction && !config.inlineHighlights;
+    const bool tileMemoryFusion = fuseHighlightsToYCbCr && config.tileMemoryFusion && _mtlContext.supportsTileShaders();
+    if (fuseHighlightsToYCbCr) {
+        using Stage = pointwiseChainKernel::Stage;
+        const std::vector<Stage> stages = { Stage::blendHighlights, Stage::transform };
+        if (tileMemoryFusion && !_highlightsToYCbCrTile) {
+            _highlightsToYCbCrTile = std::make_unique<pointwiseTileChainKernel>(&_mtlContext, stages);
+        } else if (!tileMemoryFusion && !_highlightsToYCbCr) {
+            _highlightsToYCbCr = std::make_unique<pointwiseChainKernel>(&_mtlContext, stages);
+        }
+    }
+
+    graph.addStage("blendHighlights", { t.linearRGBImageA }, { t.linearRGBImageA }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        if (tileMemoryFusion) {
+            (*_highlightsToYCbCrTile)(context, *graph[t.linearRGBImageA], graph[t.linearRGBImageA],
+                                      { frame.cam_to_ycbcr, /*clip=*/ 1.0 });
+        } else if (fuseHighlightsToYCbCr) {
+            (*_highlightsToYCbCr)(context, *graph[t.linearRGBImageA], graph[t.linearRGBImageA],
+                                  { frame.cam_to_ycbcr, /*clip=*/ 1.0 });
+        } else {
+            _blendHighlightsImage(context, *graph[t.linearRGBImageA], /*clip=*/1.0, graph[t.linearRGBImageA]);
+        }
+    }, !config.inlineHighlights);
+
+    // --- Image Denoising ---
+
+    graph.addStage("denoise", { t.linearRGBImageA, t.rawGradientImage }, { t.linearRGBImageA, t.linearRGBImageB },
+                   [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        const auto p = frame.demosaicParameters;
+
+        // Convert to YCbCr, unless fused with blendHighlights or with the demosaic
+        if (!fuseHighlightsToYCbCr && !ycbcrDemosaic) {
+            _transformImage(context, *graph[t.linearRGBImageA], graph[t.linearRGBImageA], frame.cam_to_ycbcr);
+        }
+
+        if (frame.previewReady) {
+            _pyramidProcessor->levelDenoised = [this](MetalContext* context, int level) {
+                if (level == std::min(kProgressivePreviewLevel, _pyramidProcessor->activeLevels() - 1)) {
+                    encodeProgressivePreview(context, level);
+                }
+            };
+        }
+        // Same raw data and upstream parameters: only the pyramid levels with new inputs are denoised again
+        _pyramidProcessor->denoiseInputKey = frame.denoiseInputKey;
+        const auto denoisedImage = denoise(*graph[t.linearRGBImageA], p);
+        _pyramidProcessor->levelDenoised = nullptr;
+
+        // Convert to RGB for the output, convertTosRGB reads the denoised YCbCr itself
+        if (!config.postProcess) {
+            _transformImage(context, *denoisedImage, graph[t.linearRGBImageA], frame.ycbcr_to_cam);
+        }
+
+        if (_calibrateFromImage) {
+            dumpNoiseModel<5>(p->iso, p->noiseModel);
+            if (_noiseModelCache) {
+                _noiseModelCache->insert({ p->cameraModel, p->iso, p->exposureTime }, p->noiseModel);
+            }
+        }
+    }, config.noiseReduction);
+
+    graph.addStage("defaultHistogram", {}, {}, [this](MetalContext* context, const StageGraph& graph) {
+        auto histogramData = this->histogramData();
+        histogramData->black_level = 0.1;
+        histogramData->white_level = 1.0;
+        histogramData->mean = 0.22;
+        histogramData->median = 0.22;
+    }, !config.noiseReduction, { .sideEffects = true });
+
+    // --- Image Post Processing ---
+
+    graph.addStage("convertTosRGB", { t.linearRGBImageA }, { t.outputImage }, [=, this, &frame](MetalContext* context, const StageGraph& graph) {
+        // With noise reduction the input is the denoised YCbCr, the stage follows the denoise through linearRGBImageA
+        const auto& linearImage = config.noiseReduction ? *_pyramidProcessor->denoisedLevel(0) : *graph[t.linearRGBImageA];
+        const auto ycbcrToCam = config.noiseReduction ? &frame.ycbcr_to_cam : nullptr;
+        if (frame.downscaledOutputImage) {
+            encodeDownscaledOutput(context, frame.demosaicParameters, frame.ycbcr_to_cam, frame.downscaledOutputImage);
+        } else if (frame.ycbcrOutputImage) {
+            convertTosRGB(linearImage, frame.demosaicParameters, frame.ycbcrOutputImage, ycbcrToCam);
+        } else {
+            convertTosRGB(linearImage, frame.demosaicParameters, graph[t.outputImage], ycbcrToCam);
+        }
+        // The renditions come from the denoised pyramid, without noise reduction there is none
+        if (config.noiseReduction) {
+            encodeRenditions(context, denoisedLevels(*_pyramidProcessor), frame.ycbcr_to_cam, *frame.demosaicParameters);
+        }
+    }, config.postProcess);
+
+    graph.markOutput(config.postProcess ? t.outputImage : t.linearRGBImageA);
+
+    graph.compile(_mtlContext.device(), config.untrackedHazards);
+}
+
+gls::mtl_image_2d<gls::pixel_float4>* RawConverter::demosaic(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                             DemosaicParameters* demosaicParameters,
+                                                             bool noiseReduction, bool postProcess) {
+    auto result = demosaicAsync(rawImage, demosaicParameters, noiseReduction, postProcess);
+    result.done.get();
+
+    // Also resolves the profiling samples, if enabled
+    _mtlContext.waitForCompletion();
+
+    return result.image;
+}
+
+gls::mtl_image_2d<gls::pixel_float4>* RawConverter::demosaic(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                             DemosaicParameters* demosaicParameters,
+                                                             bool noiseReduction, bool postProcess) {
+    auto result = demosaicAsync(rawImage, demosaicParameters, noiseReduction, postProcess);
+    result.done.get();
+
+    _mtlContext.waitForCompletion();
+
+    return result.image;
+}
+
+void RawConverter::fuseFrame(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                             const gls::Matrix<3, 3>& homography) {
+    const int slot = _fusionFrame++ % 2;
+
+    // The upload texture was last used two frames ago
+    if (_fusionDone[slot].valid()) {
+        _fusionDone[slot].get();
+    }
+    auto& uploadImage = _fusionRawImages[slot];
+    if (!uploadImage || uploadImage->size() != rawImage.size()) {
+        uploadImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
+    }
+    uploadImage->copyPixelsFrom(rawImage);
+
+    fuseFrame(*uploadImage, demosaicParameters, homography);
+    _fusionDone[slot] = _mtlContext.submit();
+}
+
+void RawConverter::fuseFrame(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                             const gls::Matrix<3, 3>& homography) {
+    demosaicAsync(rawImage, demosaicParameters, /*noiseReduction=*/ false, /*postProcess=*/ false);
+
+    auto context = &_mtlContext;
+    MetalContext::BatchScope batch(context);
+
+    // The frames are fused as they would be denoised: despeckled YCbCr
+    _transformImage(context, *_linearRGBImageA, _linearRGBImageA.get(), _demosaicFrame.cam_to_ycbcr);
+
+    const auto& np = demosaicParameters->noiseModel.pyramidNlf[0];
+    _despeckleImage(context, *_linearRGBImageA, /*var_a=*/np.first, /*var_b=*/np.second, _linearRGBImageB.get());
+
+    _pyramidProcessor->fuseFrame(context, *_linearRGBImageB, *_rawGradientImage, homography);
+
+    context->submit();
+}
+
+gls::mtl_image_2d<gls::pixel_float4>* RawConverter::demosaicFused(DemosaicParameters* demosaicParameters, bool postProcess) {
+    if (!_pyramidProcessor || _pyramidProcessor->fusedFrames == 0) {
+        throw std::runtime_error("RawConverter::demosaicFused: no fused frames");
+    }
+
+    // Overwrites the cached pyramid and linear image
+    _rerenderKey.reset();
+
+    if (!_frozenHistogram) {
+        _histogramImage.reset();
+    }
+
+    if (demosaicParameters->rgbConversionParameters.localToneMapping) {
+        _localToneMapping->allocateTextures(&_mtlContext, _rawImageSize.width, _rawImageSize.height, _precisionPolicy.ltm);
+    }
+
+    auto context = &_mtlContext;
+    {
+        MetalContext::BatchScope batch(context);
+
+        configurePyramidProcessor(*demosaicParameters);
+        const auto denoisedImage = _pyramidProcessor->denoiseFused(context, &(demosaicParameters->denoiseParameters),
+                                                                   demosaicParameters->noiseModel.pyramidNlf,
+                                                                   lensShading(*demosaicParameters, _rawImageSize));
+
+        denoisedImageStatistics(*denoisedImage, *_pyramidProcessor->fusionReferenceGradientPyramid[0], demosaicParameters);
+
+        // Convert to RGB, folded in the sRGB conversion when post-processing
+        if (postProcess) {
+            convertTosRGB(*denoisedImage, demosaicParameters, _linearRGBImageA.get(), &_demosaicFrame.ycbcr_to_cam);
+        } else {
+            _transformImage(context, *denoisedImage, _linearRGBImageA.get(), _demosaicFrame.ycbcr_to_cam);
+        }
+
+        context->submit();
+    }
+    context->waitForCompletion();
+
+    _pyramidProcessor->resetFusion();
+    _fusionDone = {};
+
+    return _linearRGBImageA.get();
+}
+
+// Averages each color over binning x binning quads, the result is a Bayer image with the same pattern
+static gls::image<gls::luma_pixel_16> binRawImage(const gls::image<gls::luma_pixel_16>& rawImage, int binning) {
+    const int quadSize = 2 * binning;
+    gls::image<gls::luma_pixel_16> binnedImage(2 * (rawImage.width / quadSize), 2 * (rawImage.height / quadSize));
+
+    gls::parallel_bands(binnedImage.height, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            // Rows of the same color in the source quads
+            const int sy = quadSize * (y / 2) + (y & 1);
+            for (int x = 0; x < binnedImage.width; x++) {
+                const int sx = quadSize * (x / 2) + (x & 1);
+                int sum = 0;
+                for (int j = 0; j < binning; j++) {
+                    for (int i = 0; i < binning; i++) {
+                        sum += rawImage[sy + 2 * j][sx + 2 * i].luma;
+                    }
+                }
+                const int count = binning * binning;
+                binnedImage[y][x] = (uint16_t) ((sum + count / 2) / count);
+            }
+        }
+    });
+    return binnedImage;
+}
+
+// View of a rectangle of image, valid as long as image is
+static gls::image<gls::pixel_float4> imageRegion(const gls::image<gls::pixel_float4>& image, const gls::rectangle& region) {
+    return gls::image<gls::pixel_float4>(region.width, region.height, image.stride,
+                                         std::span(const_cast<gls::pixel_float4*>(&image[region.y][region.x]),
+                                                   image.stride * (region.height - 1) + region.width));
+}
+
+LensShading RawConverter::lensShading(const DemosaicParameters& demosaicParameters, const gls::size& imageSize) {
+    // The processed image is either the whole frame or the current region of it, the map spans the frame
+    const bool region = _regionFrameSize.width > 0;
+    const auto frameSize = region ? _regionFrameSize : imageSize;
+    _lensShadingMap.update(frameSize, demosaicParameters.lensShadingCorrection, demosaicParameters.lensShadingGainMap);
+    return _lensShadingMap.lensShading(region ? ::lensShadingGeometry(_regionFrameSize, _regionOrigin)
+                                              : ::lensShadingGeometry(imageSize));
+}
+
+void RawConverter::measureGlobalStatistics(const gls::image<gls::luma_pixel_16>& rawImage,
+                                           DemosaicParameters* demosaicParameters, int binning) {
+    const auto binnedImage = binRawImage(rawImage, binning);
+    demosaic(binnedImage, demosaicParameters, /*denoise=*/ true, /*postProcess=*/ false);
+}
+
+RawConverter::AsyncResult RawConverter::demosaicRegionAsync(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                           DemosaicParameters* demosaicParameters,
+                                                           const gls::rectangle& region, bool noiseReduction) {
+    assert(region.x % 2 == 0 && region.y % 2 == 0 && region.width % 2 == 0 && region.height % 2 == 0);
+
+    if (!_rawTileImage || _rawTileImage->width != region.width || _rawTileImage->height != region.height) {
+        _rawTileImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), region.width, region.height);
+    }
+    {
+        auto rawTile = _rawTileImage->mapImage();
+        gls::parallel_bands(region.height, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                std::memcpy(&(*rawTile)[y][0], &rawImage[region.y + y][region.x], region.width * sizeof(gls::luma_pixel_16));
+            }
+        });
+    }
+
+    // The kernels are encoded by demosaicAsync, the region geometry is only needed until it returns
+    _regionFrameSize = rawImage.size();
+    _regionOrigin = { region.x, region.y };
+    try {
+        auto result = demosaicAsync(*_rawTileImage, demosaicParameters, noiseReduction);
+        _regionFrameSize = { 0, 0 };
+        return result;
+    } catch (...) {
+        _regionFrameSize = { 0, 0 };
+        throw;
+    }
+}
+
+void RawConverter::demosaicTiled(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                 int tileSize, const tile_output_type& tileOutput) {
+    const int halo = tileHalo();
 
-        auto mtlDevice = _mtlContext.device();
+    // Tiles and their origins stay on the coarsest pyramid level grid, which also preserves the Bayer phase
+    tileSize = std::max(32 * (tileSize / 32), 32);
 
-        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(mtlDevice, imageSize);
-        _scaledRawImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float>>(mtlDevice, imageSize);
-        _rawSobelImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize);
-        _rawGradientImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, imageSize);
-        _greenImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float>>(mtlDevice, imageSize);
-        _linearRGBImageA = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize);
-        _linearRGBImageB = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize);
+    // All tiles have the same padded size, so that they share the same intermediates
+    const int paddedWidth = std::min(rawImage.width, tileSize + 2 * halo) & ~1;
+    const int paddedHeight = std::min(rawImage.height, tileSize + 2 * halo) & ~1;
 
-        if (_calibrateFromImage) {
-            _meanImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / 2, imageSize.height / 2);
-            _varImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / 2, imageSize.height / 2);
+    const auto rgbConversionParameters = demosaicParameters->rgbConversionParameters;
+
+    // Global statistics from a binned version of the image
+    measureGlobalStatistics(rawImage, demosaicParameters, /*binning=*/ 2);
+
+    // Free the pre-pass working set before allocating the tile-sized one
+    releaseTextures();
+
+    _frozenHistogram = true;
+    try {
+        for (int y0 = 0; y0 < rawImage.height; y0 += tileSize) {
+            const int interiorHeight = std::min(tileSize, rawImage.height - y0);
+            const int py = std::clamp(y0 - halo, 0, rawImage.height - paddedHeight) & ~1;
+
+            for (int x0 = 0; x0 < rawImage.width; x0 += tileSize) {
+                const int interiorWidth = std::min(tileSize, rawImage.width - x0);
+                const int px = std::clamp(x0 - halo, 0, rawImage.width - paddedWidth) & ~1;
+
+                // Every tile starts from the same color parameters, the pipeline adjusts them in place
+                demosaicParameters->rgbConversionParameters = rgbConversionParameters;
+
+                auto result = demosaicRegionAsync(rawImage, demosaicParameters, { px, py, paddedWidth, paddedHeight });
+                result.done.get();
+
+                const auto resultCpu = result.image->mapImage();
+                tileOutput(imageRegion(*resultCpu, { x0 - px, y0 - py, interiorWidth, interiorHeight }), x0, y0);
+            }
         }
+    } catch (...) {
+        _frozenHistogram = false;
+        throw;
+    }
+    _frozenHistogram = false;
+}
+
+void RawConverter::demosaicRegion(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                  const gls::rectangle& roi, const tile_output_type& regionOutput, bool noiseReduction) {
+    if (roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0 ||
+        roi.x + roi.width > rawImage.width || roi.y + roi.height > rawImage.height) {
+        throw std::runtime_error("demosaicRegion: the region of interest is outside of the image");
+    }
 
-        _rawImageSize = imageSize;
+    // The roi and its halo, clamped to the image, on even coordinates to preserve the Bayer phase
+    const int halo = tileHalo();
+    const int x0 = std::max(roi.x - halo, 0) & ~1;
+    const int y0 = std::max(roi.y - halo, 0) & ~1;
+    const int x1 = std::min(roi.x + roi.width + halo, rawImage.width & ~1);
+    const int y1 = std::min(roi.y + roi.height + halo, rawImage.height & ~1);
+    const gls::rectangle region = { x0, y0, (x1 - x0 + 1) & ~1, (y1 - y0 + 1) & ~1 };
 
-        _pyramidProcessor = std::make_unique<PyramidProcessor<5>>(&_mtlContext, _rawImageSize.width, _rawImageSize.height);
+    // Histogram and levels of the whole frame from a 4x4 binned pre-pass, the exposure of the crop matches the full image
+    if (noiseReduction) {
+        measureGlobalStatistics(rawImage, demosaicParameters, /*binning=*/ 4);
+    }
+
+    _frozenHistogram = noiseReduction;
+    try {
+        auto result = demosaicRegionAsync(rawImage, demosaicParameters, region, noiseReduction);
+        result.done.get();
+
+        const auto resultCpu = result.image->mapImage();
+        regionOutput(imageRegion(*resultCpu, { roi.x - region.x, roi.y - region.y, roi.width, roi.height }), roi.x, roi.y);
+    } catch (...) {
+        _frozenHistogram = false;
+        throw;
     }
+    _frozenHistogram = false;
 }
 
-void RawConverter::allocateHighNoiseTextures(const gls::size& imageSize) {
-    int width = imageSize.width;
-    int height = imageSize.height;
+void RawConverter::allocatePreviewTextures(const gls::size& imageSize) {
+    const int width = imageSize.width / 2;
+    const int height = imageSize.height / 2;
 
-    if (!_rgbaRawImage || _rgbaRawImage->width != width / 2 || _rgbaRawImage->height != height / 2) {
+    if (!_previewImage || _previewImage->width != width || _previewImage->height != height) {
         auto mtlDevice = _mtlContext.device();
 
-        _rgbaRawImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, width / 2, height / 2);
-        _denoisedRgbaRawImage =
-            std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, width / 2, height / 2);
+        _previewYCbCrImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, width, height,
+                                                                                             gls::texture_precision::fp16);
+        _previewDenoisedImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float4>>(mtlDevice, width, height,
+                                                                                                gls::texture_precision::fp16);
+        // CPU-visible output image
+        _previewImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, width, height);
     }
 }
 
-void RawConverter::allocateLtmImagePyramid(const gls::size& imageSize) {
-    if (_ltmImagePyramid[0] == nullptr || _ltmImagePyramid[0]->width != imageSize.width / 2 || _ltmImagePyramid[0]->height != imageSize.height / 2) {
-        auto mtlDevice = _mtlContext.device();
-        int levels = (int) _ltmImagePyramid.size() + 1;
-        for (int i = 0, scale = 2; i < levels - 1; i++, scale *= 2) {
-            _ltmImagePyramid[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize.width / scale, imageSize.height / scale);
-        }
+RawConverter::AsyncResult RawConverter::previewAsync(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                     const DemosaicParameters& demosaicParameters,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    if (!_previewRawImage || _previewRawImage->size() != rawImage.size()) {
+        _previewRawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
     }
+    _previewRawImage->copyPixelsFrom(rawImage);
+
+    return previewAsync(*_previewRawImage, demosaicParameters, outputImage);
 }
 
-gls::mtl_image_2d<gls::pixel_float4>* RawConverter::denoise(const gls::mtl_image_2d<gls::pixel_float4>& inputImage,
-                                                                DemosaicParameters* demosaicParameters) {
-    NoiseModel<5>* noiseModel = &demosaicParameters->noiseModel;
+RawConverter::AsyncResult RawConverter::previewAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                     const DemosaicParameters& demosaicParameters,
+                                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    allocatePreviewTextures(rawImage.size());
 
-    // Luma and Chroma Despeckling
-    const auto& np = noiseModel->pyramidNlf[0];
-    _despeckleImage(&_mtlContext, inputImage,
-                    /*var_a=*/np.first,
-                    /*var_b=*/np.second, _linearRGBImageB.get());
+    gls::mtl_image_2d<gls::pixel_float4>* resultImage = outputImage ? outputImage : _previewImage.get();
+    assert(resultImage->size() == _previewImage->size());
 
-    gls::mtl_image_2d<gls::pixel_float4>* denoisedImage = _pyramidProcessor->denoise(&_mtlContext, &(demosaicParameters->denoiseParameters),
-                                                                                         *_linearRGBImageB, *_rawGradientImage,
-                                                                                         &noiseModel->pyramidNlf,
-                                                                                         demosaicParameters->exposure_multiplier,
-                                                                                         demosaicParameters->lensShadingCorrection,
-                                                                                         _calibrateFromImage);
+    const auto ycbcrTransforms = ColorProfileCache::shared().ycbcrTransforms(demosaicParameters.rgb_cam, xyz_rgb());
+    const auto& cam_to_ycbcr = ycbcrTransforms.cam_to_ycbcr;
+    const auto& ycbcr_to_cam = ycbcrTransforms.ycbcr_to_cam;
 
-    // Use a lower level of the pyramid to compute the histogram
-    const auto histogramImage = _pyramidProcessor->denoisedImagePyramid[3].get();
-    _histogramImage(&_mtlContext, *histogramImage);
-    _histogramImage.statistics(&_mtlContext, histogramImage->size());
+    auto context = &_mtlContext;
 
-//    _mtlContext.waitForCompletion();
-//    auto histogramData = this->histogramData();
-//
-//    auto histogramImageCPU = histogramImage->mapImage();
-//    gls::image<gls::luma_pixel_16> lumaImage(histogramImageCPU->width, histogramImageCPU->height);
-//    lumaImage.apply([&](gls::luma_pixel_16* p, int x, int y) {
-//        float luma = std::clamp(((*histogramImageCPU)[y][x].x - histogramData->black_level) / (histogramData->white_level - histogramData->black_level), 0.0f, 1.0f);
-//
-//        p->luma = (uint16_t) (0xffff * std::sqrt(luma));
-//    });
-//    lumaImage.write_png_file("/Users/fabio/luma.png");
+    // The preview textures are its own, it doesn't need to be ordered with the rest of the converter's work
+    MetalContext::LaneScope lane(context, MetalContext::Lane::interactive);
+    MetalContext::BatchScope batch(context);
 
+    _previewRawToYCbCr(context, rawImage, _previewYCbCrImage.get(),
+                       demosaicParameters.bayerPattern,
+                       demosaicParameters.scale_mul,
+                       demosaicParameters.black_level / 0xffff,
+                       lensShading(demosaicParameters, rawImage.size()),
+                       cam_to_ycbcr);
 
-    if (demosaicParameters->rgbConversionParameters.localToneMapping) {
-        const std::array<const gls::mtl_image_2d<gls::pixel_float4>*, 3>& guideImage = {
-            _pyramidProcessor->denoisedImagePyramid[4].get(),
-            _pyramidProcessor->denoisedImagePyramid[2].get(),
-            _pyramidProcessor->denoisedImagePyramid[0].get()
-        };
-        _localToneMapping->createMask(&_mtlContext, *denoisedImage, *_rawGradientImage, guideImage, *noiseModel,
-                                      demosaicParameters->ltmParameters, _histogramImage.buffer());
+    if (_previewStatistics) {
+        encodePreviewStatistics(context, rawImage, demosaicParameters, cam_to_ycbcr);
     }
 
-    return denoisedImage;
-}
+    // Binning averages four samples, the first pyramid level noise model is a good match for the half resolution data
+    const auto& np = demosaicParameters.noiseModel.pyramidNlf[0];
+    _despeckleImage(context, *_previewYCbCrImage, /*var_a=*/ np.first, /*var_b=*/ np.second, _previewDenoisedImage.get());
 
-void saveLumaImage(const gls::mtl_image_2d<gls::pixel_float>& denoisedImage) {
-    gls::image<gls::luma_pixel_16> out(denoisedImage.width, denoisedImage.height);
-    const auto denoisedImageCPU = denoisedImage.mapImage();
-    out.apply([&denoisedImageCPU](gls::luma_pixel_16* p, int x, int y) {
-        const auto& ip = (*denoisedImageCPU)[y][x];
-        *p = {
-            (uint16_t) std::clamp((int)(0xffff * ip), 0, 0xffff)
-        };
-    });
-    // denoisedImage.unmapImage(denoisedImageCPU);
-    static int count = 1;
-    out.write_png_file("/Users/fabio/green" + std::to_string(count++) + ".png");
+    // Same exposure adjustment as the full pipeline, without touching demosaicParameters
+    auto rgbConversionParameters = demosaicParameters.rgbConversionParameters;
+    rgbConversionParameters.exposureBias += log2(demosaicParameters.exposure_multiplier);
+
+    // Fixed levels, as the full pipeline uses without noise reduction statistics
+    _previewTosRGB(context, *_previewDenoisedImage, ycbcr_to_cam, demosaicParameters, rgbConversionParameters,
+                   /*blackLevel=*/ 0.1, /*mean=*/ 0.22, resultImage);
+
+    return { resultImage, context->submit() };
 }
 
-void saveRawChannels(gls::image<gls::pixel_float4>& rgbaRawImage, const std::string& postfix) {
-    std::array<gls::image<gls::luma_pixel_16>::unique_ptr, 4> saveImages;
-    for (auto& img : saveImages) {
-        img = std::make_unique<gls::image<gls::luma_pixel_16>>(rgbaRawImage.size());
+void RawConverter::encodePreviewStatistics(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                           const DemosaicParameters& demosaicParameters,
+                                           const gls::Matrix<3, 3>& cam_to_ycbcr) {
+    const uint64_t frame = _previewFrame++;
+    auto slot = &_previewStatisticsSlots[frame % kPreviewStatisticsSlots];
+    if (slot->busy.exchange(true)) {
+        return;
+    }
+    if (!slot->kernel) {
+        slot->kernel = std::make_unique<imageStatisticsKernel>(context);
     }
-    rgbaRawImage.apply([&] (const gls::pixel_float4& p, int x, int y){
+
+    // Sampling one Bayer quad in four in each direction is plenty for the exposure
+    const gls::Vector<3> lumaWeights = { cam_to_ycbcr[0][0], cam_to_ycbcr[0][1], cam_to_ycbcr[0][2] };
+    slot->kernel->reset();
+    (*slot->kernel)(context, rawImage, demosaicParameters.bayerPattern, demosaicParameters.scale_mul,
+                    demosaicParameters.black_level / 0xffff, lumaWeights, /*sampleStride=*/ 4);
+
+    // The completion handlers of the preview lane run in order, they are the ring's single producer
+    context->notify([this, slot, frame]() {
+        const auto s = slot->kernel->statistics();
+        const float samples = std::max(s->samples, 1u);
+
+        PreviewStatistics statistics = {
+            .frame = frame,
+            .samples = s->samples,
+            .highlights = s->highlights / samples,
+            .lumaHistogram = s->histogram,
+            .grayWorld = s->grayWorld,
+        };
         for (int c = 0; c < 4; c++) {
-            (*saveImages[c])[y][x] = std::clamp(0xffff * p[c], 0.0f, (float) 0xffff);
+            statistics.clipped[c] = s->clipped[c] / samples;
         }
+        for (int c = 0; c < 3; c++) {
+            statistics.grayWorldGains[c] = s->grayWorld[c] > 0 ? s->grayWorld[1] / s->grayWorld[c] : 1;
+        }
+        slot->busy = false;
+
+        _previewStatisticsRing.push(statistics);
     });
-    saveImages[0]->write_png_file("/Users/fabio/red_" + postfix + ".png");
-    saveImages[1]->write_png_file("/Users/fabio/green1_" + postfix + ".png");
-    saveImages[2]->write_png_file("/Users/fabio/blue_" + postfix + ".png");
-    saveImages[3]->write_png_file("/Users/fabio/green2_" + postfix + ".png");
 }
 
-gls::mtl_image_2d<gls::pixel_float4>* RawConverter::demosaic(const gls::image<gls::luma_pixel_16>& rawImage,
-                                                             DemosaicParameters* demosaicParameters,
-                                                             bool noiseReduction, bool postProcess) {
-    allocateTextures(rawImage.size());
+RawConverter::AsyncResult RawConverter::demosaicProgressiveAsync(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                                DemosaicParameters* demosaicParameters,
+                                                                const preview_callback_type& previewReady,
+                                                                gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    if (!_rawImage || _rawImage->size() != rawImage.size()) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
+    }
+    _rawImage->copyPixelsFrom(rawImage);
 
-    // Zero histogram data
-    _histogramImage.reset();
+    return demosaicProgressiveAsync(*_rawImage, demosaicParameters, previewReady, outputImage);
+}
 
-    if (demosaicParameters->rgbConversionParameters.localToneMapping) {
-        _localToneMapping->allocateTextures(&_mtlContext, rawImage.width, rawImage.height);
-    }
+RawConverter::AsyncResult RawConverter::demosaicProgressiveAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                                DemosaicParameters* demosaicParameters,
+                                                                const preview_callback_type& previewReady,
+                                                                gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    auto result = demosaicAsync(rawImage, demosaicParameters, /*noiseReduction=*/ true, /*postProcess=*/ true,
+                                outputImage, nullptr, previewReady);
+    _demosaicFrame.previewReady = nullptr;
+    return result;
+}
 
-    bool high_noise_image = _calibrateFromImage ? false : demosaicParameters->rawDenoiseParameters.highNoiseImage;
-    if (high_noise_image) {
-        allocateHighNoiseTextures(rawImage.size());
+void RawConverter::encodeProgressivePreview(MetalContext* context, int level) {
+    const auto& frame = _demosaicFrame;
+    const auto p = frame.demosaicParameters;
+    const auto& denoisedLevel = *_pyramidProcessor->denoisedLevel(level);
+
+    if (!_progressivePreviewImage || _progressivePreviewImage->size() != denoisedLevel.size()) {
+        // Waits for the previous preview to be consumed
+        _mtlContext.waitForCompletion();
+        _progressivePreviewImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_mtlContext.device(),
+                                                                                           denoisedLevel.size());
     }
 
-    // Convert linear image to YCbCr for denoising
-    const auto cam_to_ycbcr = cam_ycbcr(demosaicParameters->rgb_cam, xyz_rgb());
+    // Same exposure adjustment as convertTosRGB, without touching demosaicParameters
+    auto rgbConversionParameters = p->rgbConversionParameters;
+    rgbConversionParameters.exposureBias += log2(p->exposure_multiplier);
 
-    // Convert result back to camera RGB
-    const auto ycbcr_to_cam = inverse(cam_to_ycbcr);
+    context->barrier();
+    _previewTosRGB(context, denoisedLevel, frame.ycbcr_to_cam, *p, rgbConversionParameters,
+                   /*blackLevel=*/ 0.1, /*mean=*/ 0.22, _progressivePreviewImage.get());
 
-    _rawImage->copyPixelsFrom(rawImage);
+    // The preview goes with the work recorded so far, the finer levels are encoded in a new command buffer
+    const auto previewReady = frame.previewReady;
+    const auto previewImage = _progressivePreviewImage.get();
+    context->notify([previewReady, previewImage]() {
+        previewReady(*previewImage);
+    });
+    context->flushBatch();
+}
 
-    gls::mtl_image_2d<gls::pixel_float4>* denoisedImage = nullptr;
+void RawConverter::allocateRenditions(const gls::size& imageSize) {
+    if (_renditions.size() != _renditionSizes.size()) {
+        // The previous renditions may still be written
+        _mtlContext.waitForCompletion();
+        _renditions.resize(_renditionSizes.size());
+    }
+    for (size_t i = 0; i < _renditionSizes.size(); i++) {
+        const auto size = renditionTosRGBKernel::renditionSize(imageSize, _renditionSizes[i]);
+        if (!_renditions[i] || _renditions[i]->size() != size) {
+            _mtlContext.waitForCompletion();
+            gls::GPUMemoryTracker::Scope scope("RawConverter");
+            _renditions[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_mtlContext.device(), size);
+        }
+    }
+}
 
-    auto context = &_mtlContext;
+std::vector<gls::mtl_image_2d<gls::pixel_float4>*> RawConverter::renditionImages() const {
+    std::vector<gls::mtl_image_2d<gls::pixel_float4>*> images;
+    if (_renditionsWritten) {
+        for (const auto& rendition : _renditions) {
+            images.push_back(rendition.get());
+        }
+    }
+    return images;
+}
 
-    // --- Image Demosaicing ---
+void RawConverter::encodeRenditions(MetalContext* context, const std::vector<const gls::mtl_image_2d<gls::pixel_float4>*>& levels,
+                                    const gls::Matrix<3, 3>& ycbcr_to_cam, const DemosaicParameters& demosaicParameters) {
+    // Set with a run in flight, the next run allocates them
+    if (_renditionSizes.empty() || _renditions.size() != _renditionSizes.size()) {
+        return;
+    }
+    // Same tone curve, histogram levels and LTM mask as the output
+    for (const auto& rendition : _renditions) {
+        _renditionTosRGB(context, levels, _localToneMapping->getMask(), ycbcr_to_cam, demosaicParameters,
+                         _histogramImage.buffer(), rendition.get());
+    }
+    _renditionsWritten = true;
+}
 
-    _scaleRawData(context, *_rawImage, _scaledRawImage.get(),
-                  demosaicParameters->bayerPattern,
-                  demosaicParameters->scale_mul,
-                  demosaicParameters->black_level / 0xffff,
-                  demosaicParameters->lensShadingCorrection);
+void RawConverter::encodeDownscaledOutput(MetalContext* context, DemosaicParameters* demosaicParameters,
+                                          const gls::Matrix<3, 3>& ycbcr_to_cam, gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    // Same exposure adjustment as convertTosRGB, the renditions of the run follow
+    demosaicParameters->rgbConversionParameters.exposureBias += log2(demosaicParameters->exposure_multiplier);
 
-    _rawImageSobel(context, *_scaledRawImage, _rawSobelImage.get());
+    _renditionTosRGB(context, denoisedLevels(*_pyramidProcessor), _localToneMapping->getMask(), ycbcr_to_cam,
+                     *demosaicParameters, _histogramImage.buffer(), outputImage);
+}
 
-    NoiseModel<5>* noiseModel = &demosaicParameters->noiseModel;
-    if (_calibrateFromImage) {
-        noiseModel->rawNlf = MeasureRawNLF(demosaicParameters->exposure_multiplier, demosaicParameters->bayerPattern);
+// The noise model of the 2x2 binned raw data: the average of four samples has a quarter of the raw variance, and
+// each pyramid level of the half resolution image has the noise of the next coarser level of the full one
+static NoiseModel<5> binnedNoiseModel(const NoiseModel<5>& noiseModel) {
+    NoiseModel<5> binnedModel = noiseModel;
+    binnedModel.rawNlf = { noiseModel.rawNlf.first / 4.0f, noiseModel.rawNlf.second / 4.0f };
+    // The coarsest level keeps its own
+    for (int level = 0; level < 4; level++) {
+        binnedModel.pyramidNlf[level] = noiseModel.pyramidNlf[level + 1];
     }
-    const auto rawVariance = getRawVariance(noiseModel->rawNlf);
-
-    _gaussianBlurSobelImage(context, *_scaledRawImage, *_rawSobelImage, rawVariance[1], _rawGradientImage.get());
+    return binnedModel;
+}
 
-    if (noiseReduction && high_noise_image) {
-        _bayerToRawRGBA(context, *_scaledRawImage, _rgbaRawImage.get(), demosaicParameters->bayerPattern);
+RawConverter::AsyncResult RawConverter::demosaicToSizeAsync(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                           DemosaicParameters* demosaicParameters, int outputLongSide) {
+    if (!_rawImage || _rawImage->size() != rawImage.size()) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
+    }
+    _rawImage->copyPixelsFrom(rawImage);
 
-        _despeckleRawRGBAImage(context, *_rgbaRawImage, *_rawGradientImage, noiseModel->rawNlf.second, _denoisedRgbaRawImage.get());
-        _crossDenoiseRawRGBAImage(context, *_denoisedRgbaRawImage, noiseModel->rawNlf.second, demosaicParameters->rawDenoiseParameters.strength, _rgbaRawImage.get());
+    return demosaicToSizeAsync(*_rawImage, demosaicParameters, outputLongSide);
+}
 
-        _rawRGBAToBayer(context, *_rgbaRawImage, _scaledRawImage.get(), demosaicParameters->bayerPattern);
+RawConverter::AsyncResult RawConverter::demosaicToSizeAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                           DemosaicParameters* demosaicParameters, int outputLongSide) {
+    const auto strategy = outputStrategy(rawImage.size(), outputLongSide, _calibrateFromImage);
+    if (strategy == OutputStrategy::fullResolution) {
+        return demosaicAsync(rawImage, demosaicParameters);
     }
 
-    _demosaicImage(context, *_scaledRawImage, *_rawGradientImage,
-                   _greenImage.get(), /*rgbImageTmp=*/ _linearRGBImageB.get(), _linearRGBImageA.get(),
-                   demosaicParameters->bayerPattern, rawVariance);
+    const auto outputSize = renditionTosRGBKernel::renditionSize(rawImage.size(), outputLongSide);
+    if (!_sizedOutputImage || _sizedOutputImage->size() != outputSize) {
+        // The previous output may still be written
+        _mtlContext.waitForCompletion();
+        gls::GPUMemoryTracker::Scope scope("RawConverter");
+        _sizedOutputImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_mtlContext.device(), outputSize);
+    }
 
-    _blendHighlightsImage(context, *_linearRGBImageA, /*clip=*/1.0, _linearRGBImageA.get());
+    // Quad Bayer data has its own binning, see setQuadBayerMode
+    if (strategy == OutputStrategy::fusedDownscale || demosaicParameters->quadBayer) {
+        _downscaledOutputImage = _sizedOutputImage.get();
+        auto result = demosaicAsync(rawImage, demosaicParameters);
+        result.image = _sizedOutputImage.get();
+        return result;
+    }
 
-    // --- Image Denoising ---
+    const gls::size binnedSize = { 2 * (rawImage.width / 4), 2 * (rawImage.height / 4) };
+    if (!_binnedRawImage || _binnedRawImage->size() != binnedSize) {
+        _mtlContext.waitForCompletion();
+        gls::GPUMemoryTracker::Scope scope("RawConverter");
+        _binnedRawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), binnedSize);
+    }
 
-    if (noiseReduction) {
-        // Convert to YCbCr
-        _transformImage(context, *_linearRGBImageA, _linearRGBImageA.get(), cam_to_ycbcr);
+    // The pipeline runs one pyramid level lower, the caller's noise model is for the sensor's resolution
+    DemosaicParameters binnedParameters = *demosaicParameters;
+    binnedParameters.noiseModel = binnedNoiseModel(demosaicParameters->noiseModel);
 
-        denoisedImage = denoise(*_linearRGBImageA, demosaicParameters);
+    // The binning and the pipeline in the same command buffer. Without film grain the noise seed read from the binned
+    // image before the GPU writes it doesn't matter.
+    MetalContext::BatchScope batch(&_mtlContext);
+    _binBayerImage(&_mtlContext, rawImage, _binnedRawImage.get());
 
-        // Convert to RGB
-        _transformImage(context, *denoisedImage, _linearRGBImageA.get(), ycbcr_to_cam);
+    _downscaledOutputImage = _sizedOutputImage.get();
+    auto result = demosaicAsync(*_binnedRawImage, &binnedParameters, /*noiseReduction=*/ true, /*postProcess=*/ true,
+                                /*outputImage=*/ nullptr, /*ycbcrImage=*/ nullptr);
+    result.image = _sizedOutputImage.get();
+    return result;
+}
 
-        if (_calibrateFromImage) {
-            dumpNoiseModel<5>(demosaicParameters->iso, *noiseModel);
-        }
-    } else {
-        auto histogramData = this->histogramData();
-        histogramData->black_level = 0.1;
-        histogramData->white_level = 1.0;
-        histogramData->mean = 0.22;
-        histogramData->median = 0.22;
+bool RawConverter::quadBayerBinning(const DemosaicParameters& demosaicParameters) const {
+    if (_calibrateFromImage || _regionFrameSize.width > 0) {
+        return false;
     }
+    switch (_quadBayerMode) {
+        case QuadBayerMode::binning:
+            return true;
+        case QuadBayerMode::remosaic:
+            return false;
+        case QuadBayerMode::automatic:
+            return _preset.quadBayerBinning || demosaicParameters.rawDenoiseParameters.highNoiseImage;
+    }
+    return false;
+}
 
-    // --- Image Post Processing ---
-    if (postProcess) {
-        // FIXME: This is horrible!
-        demosaicParameters->rgbConversionParameters.exposureBias += log2(demosaicParameters->exposure_multiplier);
-
-        // Use the first pixel value of the image as a seed for the noise to have a stable noise pattern for every given image
-        _convertTosRGB.randomSeed(rawImage[0][0]);
-        _convertTosRGB.initGradients();
+RawConverter::AsyncResult RawConverter::demosaicQuadBayerAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                              DemosaicParameters* demosaicParameters,
+                                                              bool noiseReduction, bool postProcess,
+                                                              gls::mtl_image_2d<gls::pixel_float4>* outputImage,
+                                                              gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage,
+                                                              const preview_callback_type& previewReady) {
+    const bool binning = quadBayerBinning(*demosaicParameters);
+    const auto bayerSize = processedSize(rawImage.size(), *demosaicParameters);
+    if (!_quadBayerRawImage || _quadBayerRawImage->size() != bayerSize) {
+        // The previous run may still read it
+        _mtlContext.waitForCompletion();
+        gls::GPUMemoryTracker::Scope scope("RawConverter");
+        _quadBayerRawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), bayerSize);
+    }
 
-        _convertTosRGB(context, *_linearRGBImageA, _localToneMapping->getMask(), *demosaicParameters,
-                       _histogramImage.buffer(), /*luma_nlf=*/ 2.0f * rawVariance[1], _linearRGBImageA.get());
+    // The binned data is processed one pyramid level lower, the caller's noise model is for the sensor's resolution
+    DemosaicParameters bayerParameters = *demosaicParameters;
+    bayerParameters.quadBayer = false;
+    if (binning) {
+        bayerParameters.noiseModel = binnedNoiseModel(demosaicParameters->noiseModel);
     }
 
-    _mtlContext.waitForCompletion();
+    // The conversion and the pipeline in the same command buffer, the Bayer image is only written by the GPU
+    MetalContext::BatchScope batch(&_mtlContext);
+    if (binning) {
+        _binQuadBayer(&_mtlContext, rawImage, _quadBayerRawImage.get());
+    } else {
+        _remosaicQuadBayer(&_mtlContext, rawImage, _quadBayerRawImage.get(), demosaicParameters->bayerPattern);
+    }
 
-    return _linearRGBImageA.get();
+    _noiseSeed = (*rawImage.mapImage())[0][0];
+    return demosaicAsync(*_quadBayerRawImage, &bayerParameters, noiseReduction, postProcess, outputImage, ycbcrImage,
+                         previewReady);
 }
 
-gls::mtl_image_2d<gls::pixel_float4>* RawConverter::postprocess(gls::image<gls::pixel_float4>& rgbImage, DemosaicParameters* demosaicParameters) {
-    allocateTextures(rgbImage.size());
+void RawConverter::encodePostprocess(const gls::size& imageSize, DemosaicParameters* demosaicParameters) {
+    allocateTextures(imageSize);
+    _rerenderKey.reset();
 
     // Zero histogram data
-    _histogramImage.reset();
+    if (!_frozenHistogram) {
+        _histogramImage.reset();
+    }
 
     if (demosaicParameters->rgbConversionParameters.localToneMapping) {
-        _localToneMapping->allocateTextures(&_mtlContext, rgbImage.width, rgbImage.height);
+        _localToneMapping->allocateTextures(&_mtlContext, imageSize.width, imageSize.height, _precisionPolicy.ltm);
     }
 
-    allocateLtmImagePyramid(rgbImage.size());
+    allocateLtmImagePyramid(imageSize);
 
     gls::Vector<3> normalized_scale_mul = { demosaicParameters->scale_mul[0], demosaicParameters->scale_mul[1], demosaicParameters->scale_mul[2] };
     normalized_scale_mul /= *std::max_element(std::begin(normalized_scale_mul), std::end(normalized_scale_mul));
@@ -266,103 +1751,205 @@ gls::mtl_image_2d<gls::pixel_float4>* RawConverter::postprocess(gls::image<gls::
 
     const auto scaled_black_level = demosaicParameters->black_level / demosaicParameters->white_level;
 
-    rgbImage.apply([&] (gls::pixel_float4* p, int x, int y) {
-        gls::Vector<3> v = { (*p)[0], (*p)[1], (*p)[2] };
-
-        v = clamp((2 * exposure_multiplier * max(v - scaled_black_level, 0.0f) * normalized_scale_mul) * 0.9f + 0.1f, 0.0f, 1.0f);
-
-        *p = {
-            (float16_t) v[0],
-            (float16_t) v[1],
-            (float16_t) v[2],
-            1
-        };
-    });
-
-    _linearRGBImageA->copyPixelsFrom(rgbImage);
-
     // Convert linear image to YCbCr for denoising
-    const auto cam_to_ycbcr = cam_ycbcr(demosaicParameters->rgb_cam, xyz_rgb());
+    const auto ycbcrTransforms = ColorProfileCache::shared().ycbcrTransforms(demosaicParameters->rgb_cam, xyz_rgb());
+    const auto& cam_to_ycbcr = ycbcrTransforms.cam_to_ycbcr;
 
     // Convert result back to camera RGB
-    const auto ycbcr_to_cam = inverse(cam_to_ycbcr);
+    const auto& ycbcr_to_cam = ycbcrTransforms.ycbcr_to_cam;
 
     NoiseModel<5>* noiseModel = &demosaicParameters->noiseModel;
 
     auto context = &_mtlContext;
 
+    MetalContext::BatchScope batch(context);
+
     // histogram_data* hd = histogramData();
 
-    // Convert to YCbCr
-    _transformImage(context, *_linearRGBImageA, _linearRGBImageB.get(), cam_to_ycbcr);
+    // Normalize and convert to YCbCr, the input is in _linearRGBImageA
+    _normalizeRGBToYCbCr(context, *_linearRGBImageA, 2 * exposure_multiplier * normalized_scale_mul, scaled_black_level,
+                         cam_to_ycbcr, _linearRGBImageB.get());
 
-    for (int i = 0; i < 4; i++) {
-        const auto currentLayer = i > 0 ? _ltmImagePyramid[i - 1].get() : _linearRGBImageB.get();
-        _pyramidProcessor->_resampleImage(context, *currentLayer, _ltmImagePyramid[i].get());
+    if (_ltmPyramidMipmapped) {
+        // The first level with the exact filter, the box filtered mipmaps below it
+        _pyramidProcessor->_resampleImage(context, *_linearRGBImageB, _ltmImagePyramid[0].get());
+        const auto pyramid = static_cast<const gls::mtl_mipmapped_image_2d<gls::pixel_float4>*>(_ltmImagePyramid[0].get());
+        context->enqueue([pyramid](MTL::CommandBuffer* commandBuffer) { pyramid->generateMipmaps(commandBuffer); });
+    } else {
+        for (int i = 0; i < 4; i++) {
+            const auto currentLayer = i > 0 ? _ltmImagePyramid[i - 1].get() : _linearRGBImageB.get();
+            _pyramidProcessor->_resampleImage(context, *currentLayer, _ltmImagePyramid[i].get());
+        }
     }
 
     // Use a lower level of the pyramid to compute the histogram
-    const auto histogramImage = _ltmImagePyramid[2].get();
-    _histogramImage(&_mtlContext, *histogramImage);
-    _histogramImage.statistics(&_mtlContext, histogramImage->size());
+    if (!_frozenHistogram) {
+        const auto histogramImage = _ltmImagePyramid[2].get();
+        _histogramImage(&_mtlContext, *histogramImage);
+    }
 
     if (demosaicParameters->rgbConversionParameters.localToneMapping) {
         const std::array<const gls::mtl_image_2d<gls::pixel_float4>*, 3>& guideImage = {
             _ltmImagePyramid[3].get(),
             _ltmImagePyramid[1].get(),
-            _linearRGBImageB.get()
+            _ltmImagePyramid[0].get()
         };
+        _localToneMapping->refreshInterval = _ltmRefreshInterval;
+        _localToneMapping->temporalWeight = _ltmTemporalWeight;
+        _localToneMapping->scene = _ltmScene;
+        // The bands of a streaming run are different images, they never share the cached bands
         _localToneMapping->createMask(&_mtlContext, *_linearRGBImageB, *_rawGradientImage, guideImage, *noiseModel,
-                                      demosaicParameters->ltmParameters, _histogramImage.buffer());
+                                      demosaicParameters->ltmParameters, _histogramImage.buffer(),
+                                      /*temporal=*/ !_frozenHistogram);
     }
 
-    // Convert to RGB
-    _transformImage(context, *_linearRGBImageB, _linearRGBImageA.get(), ycbcr_to_cam);
+    // Back to RGB as the normalized YCbCr is read
+    _convertTosRGB(context, *_linearRGBImageB, _localToneMapping->getMask(), *demosaicParameters,
+                   _histogramImage.buffer(), /*lumaVariance=*/{0, 0}, _filmGrain.grainImage(context), /*grainOffset=*/ {0, 0},
+                   _linearRGBImageA.get(), _bakedColorLut, &ycbcr_to_cam);
+}
 
-    _convertTosRGB(context, *_linearRGBImageA, _localToneMapping->getMask(), *demosaicParameters,
-                   _histogramImage.buffer(), /*lumaVariance=*/{0, 0}, _linearRGBImageA.get());
+RawConverter::AsyncResult RawConverter::postprocessAsync(const gls::image<gls::pixel_float4>& rgbImage, DemosaicParameters* demosaicParameters) {
+    allocateTextures(rgbImage.size());
 
-    _mtlContext.waitForCompletion();
+    // The input normalization runs on the GPU, see normalizeRGBToYCbCr
+    _linearRGBImageA->copyPixelsFrom(rgbImage);
 
-    return _linearRGBImageA.get();
+    _renditionsWritten = false;
+    allocateRenditions(rgbImage.size());
+
+    encodePostprocess(rgbImage.size(), demosaicParameters);
+
+    // From the normalized YCbCr image and its LTM pyramid, the bands of a streaming run don't have the whole image
+    const auto ycbcrTransforms = ColorProfileCache::shared().ycbcrTransforms(demosaicParameters->rgb_cam, xyz_rgb());
+    encodeRenditions(&_mtlContext, { _linearRGBImageB.get(), _ltmImagePyramid[0].get(), _ltmImagePyramid[1].get(),
+                                     _ltmImagePyramid[2].get(), _ltmImagePyramid[3].get() },
+                     ycbcrTransforms.ycbcr_to_cam, *demosaicParameters);
+
+    return { _linearRGBImageA.get(), _mtlContext.submit(), renditionImages() };
 }
 
-void dumpNoiseImage(const gls::image<gls::pixel_float4>& image, float a, float b, const std::string& name) {
-    gls::image<gls::luma_pixel_16> luma(image.size());
+gls::mtl_image_2d<gls::pixel_float4>* RawConverter::beginStreamingPostprocess(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                                             DemosaicParameters* demosaicParameters, int bandHeight) {
+    const auto imageSize = rawImage.size();
+    if (!_streamingInputImage || _streamingInputImage->size() != imageSize) {
+        auto mtlDevice = _mtlContext.device();
+        _streamingInputImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize);
+        _streamingOutputImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(mtlDevice, imageSize);
+    }
 
-    luma.apply([&image, a, b](gls::luma_pixel_16* p, int x, int y) {
-        *p = std::clamp((int)(0xffff * a * (image[y][x].green + b)), 0, 0xffff);
-    });
-    luma.write_png_file("/Users/fabio/Statistics/" + name + ".png");
+    _streamingParameters = demosaicParameters;
+    _streamingRgbConversionParameters = demosaicParameters->rgbConversionParameters;
+    // Bands start on even rows, the bands and their halos share the same intermediates
+    _streamingBandHeight = std::max(bandHeight & ~1, 2);
+    _streamingNextBand = 0;
+
+    // Histogram and levels of the whole frame from a 4x4 binned pre-pass, the GPU runs it while the first bands
+    // are being produced. The binned image is only needed until demosaicAsync returns.
+    _frozenHistogram = false;
+    demosaicAsync(binRawImage(rawImage, /*binning=*/ 4), demosaicParameters, /*denoise=*/ true, /*postProcess=*/ false);
+    _frozenHistogram = true;
+
+    return _streamingInputImage.get();
 }
 
-RawNLF RawConverter::MeasureRawNLF(float exposure_multiplier, BayerPattern bayerPattern) {
-    _rawNoiseStatistics(&_mtlContext, *_scaledRawImage, bayerPattern, _meanImage.get(), _varImage.get());
-    _mtlContext.waitForCompletion();
+void RawConverter::streamingRowsAvailable(int rows) {
+    assert(_streamingParameters != nullptr);
 
-    const auto meanImageCpu = _meanImage->mapImage();
-    const auto varImageCpu = _varImage->mapImage();
+    const int width = _streamingInputImage->width;
+    const int height = _streamingInputImage->height;
+    const int halo = tileHalo();
+    const int paddedHeight = std::min(height, _streamingBandHeight + 2 * halo) & ~1;
 
-//    static int count = 0;
-//    dumpNoiseImage(*meanImageCpu, 1, 0, "mean9x9-" + std::to_string(count));
-//    dumpNoiseImage(*varImageCpu, 100, 0, "variance9x9-" + std::to_string(count));
-//    count++;
+    while (_streamingNextBand < height) {
+        const int y0 = _streamingNextBand;
+        const int interiorHeight = std::min(_streamingBandHeight, height - y0);
+        const int py = std::clamp(y0 - halo, 0, height - paddedHeight) & ~1;
+        if (rows < std::min(py + paddedHeight, height)) {
+            return;
+        }
 
-    using double4 = gls::DVector<4>;
+        // Every band starts from the same color parameters, the pipeline adjusts them in place
+        _streamingParameters->rgbConversionParameters = _streamingRgbConversionParameters;
 
-    gls::DVector<6> varianceHistogram = {0, 0, 0, 0, 0, 0};   // 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1
-    varImageCpu->apply([&](const gls::pixel_float4& vv, int x, int y) {
-        double4 v = vv.v;
+        MetalContext::BatchScope batch(&_mtlContext);
 
-        bool validStats = !any(isnan(v));
+        allocateTextures({ width, paddedHeight });
+        _mtlContext.enqueue([&](MTL::CommandBuffer* commandBuffer) {
+            _linearRGBImageA->copyPixelsFrom(commandBuffer, *_streamingInputImage, { 0, py, width, paddedHeight }, 0, 0);
+        });
 
-        if (validStats) {
-            const auto scale = gls::apply(std::log10, v);
+        encodePostprocess({ width, paddedHeight }, _streamingParameters);
 
-            int entry = 6 + (int) std::clamp(max_element(scale), -6.0, -1.0);
-            varianceHistogram[entry]++;
-        }
+        _mtlContext.enqueue([&](MTL::CommandBuffer* commandBuffer) {
+            _streamingOutputImage->copyPixelsFrom(commandBuffer, *_linearRGBImageA, { 0, y0 - py, width, interiorHeight }, 0, y0);
+        });
+
+        _streamingNextBand += _streamingBandHeight;
+    }
+}
+
+RawConverter::AsyncResult RawConverter::endStreamingPostprocess() {
+    try {
+        streamingRowsAvailable(_streamingInputImage->height);
+    } catch (...) {
+        _frozenHistogram = false;
+        _streamingParameters = nullptr;
+        throw;
+    }
+    _frozenHistogram = false;
+    _streamingParameters = nullptr;
+
+    return { _streamingOutputImage.get(), _mtlContext.submit() };
+}
+
+gls::mtl_image_2d<gls::pixel_float4>* RawConverter::postprocess(const gls::image<gls::pixel_float4>& rgbImage, DemosaicParameters* demosaicParameters) {
+    auto result = postprocessAsync(rgbImage, demosaicParameters);
+    result.done.get();
+
+    _mtlContext.waitForCompletion();
+
+    return result.image;
+}
+
+void dumpNoiseImage(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& image, float a, float b,
+                    const std::string& name) {
+    gls::DebugDumpService::shared().dump(context, image, name + ".png",
+                                         [a, b](const gls::image<gls::pixel_float4>& image, const std::string& path) {
+        gls::image<gls::luma_pixel_16> luma(image.size());
+        luma.apply([&image, a, b](gls::luma_pixel_16* p, int x, int y) {
+            *p = std::clamp((int)(0xffff * a * (image[y][x].green + b)), 0, 0xffff);
+        });
+        luma.write_png_file(path);
     });
+}
+
+gls::Vector<3> RawConverter::autoWhiteBalance(const gls::image<gls::luma_pixel_16>& rawImage, const gls::Matrix<3, 3>& rgb_ycbcr,
+                                              const gls::Vector<4>& scale_mul, float white, float black, BayerPattern bayerPattern,
+                                              float* highlights) {
+    // The upload texture may still be in use by a previous frame
+    _mtlContext.waitForCompletion();
+    if (!_rawImage || _rawImage->size() != rawImage.size()) {
+        _rawImage = std::make_unique<gls::mtl_image_2d<gls::luma_pixel_16>>(_mtlContext.device(), rawImage.size());
+    }
+    _rawImage->copyPixelsFrom(rawImage);
+
+    return _whiteBalance(&_mtlContext, *_rawImage, rgb_ycbcr, scale_mul, white, black, bayerPattern, highlights);
+}
+
+RawNLF RawConverter::MeasureRawNLF(float exposure_multiplier, BayerPattern bayerPattern) {
+    _rawNoiseStatistics(&_mtlContext, *_scaledRawImage, bayerPattern, _meanImage.get(), _varImage.get());
+
+//    dumpNoiseImage(&_mtlContext, *_meanImage, 1, 0, "mean9x9");
+//    dumpNoiseImage(&_mtlContext, *_varImage, 100, 0, "variance9x9");
+
+    using double4 = gls::DVector<4>;
+    using reduction = noiseStatisticsReductionKernel;
+
+    // The statistics are reduced on the GPU, only the sums are read back
+    reduction::Parameters parameters = { .stage = reduction::histogram };
+    const auto histogramSums = _noiseStatisticsReduction(&_mtlContext, *_meanImage, *_varImage, parameters);
+    const auto varianceHistogram = reduction::vector<6>(histogramSums, 0);   // 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1
 
     // Only consider pixels with variance lower than the expected noise value
     double4 varianceMax = varianceHistogram[0] > 1e3 ? 1.0e-5 :
@@ -374,30 +1961,22 @@ RawNLF RawConverter::MeasureRawNLF(float exposure_multiplier, BayerPattern bayer
     std::cout << "MeasureRawNLF - varianceHistogram: " << varianceHistogram << ", varianceMax: " << varianceMax << std::endl;
 
     // Limit to pixels the more linear intensity zone of the sensor
-    const double maxValue = 0.9;
-    const double minValue = 0.001;
-
-    // Collect pixel statistics
-    double4 s_x = 0;
-    double4 s_y = 0;
-    double4 s_xx = 0;
-    double4 s_xy = 0;
+    parameters.maxValue = 0.9;
+    parameters.minValue = 0.001;
 
-    double N1 = 0;
-    meanImageCpu->apply([&](const gls::pixel_float4& mm, int x, int y) {
-        double4 m = mm.v;
-        double4 v = (*varImageCpu)[y][x].v;
+    const auto toFloat4 = [](const double4& v) -> simd::float4 {
+        return { (float) v[0], (float) v[1], (float) v[2], (float) v[3] };
+    };
 
-        bool validStats = !(any(isnan(m)) || any(isnan(v)));
-
-        if (validStats && all(m >= double4(minValue)) && all(m <= double4(maxValue)) && all(v <= varianceMax)) {
-            s_x += m;
-            s_y += v;
-            s_xx += m * m;
-            s_xy += m * v;
-            N1++;
-        }
-    });
+    // Collect pixel statistics
+    parameters.stage = reduction::regression;
+    parameters.varianceMax = toFloat4(varianceMax);
+    auto sums = _noiseStatisticsReduction(&_mtlContext, *_meanImage, *_varImage, parameters);
+    double4 s_x = reduction::vector<4>(sums, reduction::kSumX);
+    double4 s_y = reduction::vector<4>(sums, reduction::kSumY);
+    double4 s_xx = reduction::vector<4>(sums, reduction::kSumXX);
+    double4 s_xy = reduction::vector<4>(sums, reduction::kSumXY);
+    double N1 = sums[reduction::kCount];
 
     // Linear regression on pixel statistics to extract a linear noise model: nlf = A + B * Y
     auto nlfB = max((N1 * s_xy - s_x * s_y) / (N1 * s_xx - s_x * s_x), 1e-8);
@@ -405,62 +1984,35 @@ RawNLF RawConverter::MeasureRawNLF(float exposure_multiplier, BayerPattern bayer
 
 //    std::cout << "RAW NLF A: " << std::setprecision(4) << std::scientific << nlfA << ", B: " << nlfB
 //                  << " on " << std::setprecision(1) << std::fixed
-//                  << 100 * N1 / (_rawImage->width * _rawImage->height) << "% pixels" << std::endl;
+//                  << 100 * N1 / (_rawImageSize.width * _rawImageSize.height) << "% pixels" << std::endl;
 
     // Estimate regression mean square error
-    double4 err2 = 0;
-    meanImageCpu->apply([&](const gls::pixel_float4& mm, int x, int y) {
-        double4 m = mm.v;
-        double4 v = (*varImageCpu)[y][x].v;
-
-        bool validStats = !(any(isnan(m)) || any(isnan(v)));
-
-        if (validStats && all(m >= double4(minValue)) && all(m <= double4(maxValue)) && all(v <= varianceMax)) {
-            auto nlfP = nlfA + nlfB * m;
-            auto diff = nlfP - v;
-            err2 += diff * diff;
-        }
-    });
-    err2 /= N1;
+    parameters.stage = reduction::error;
+    parameters.nlfA = toFloat4(nlfA);
+    parameters.nlfB = toFloat4(nlfB);
+    sums = _noiseStatisticsReduction(&_mtlContext, *_meanImage, *_varImage, parameters);
+    double4 err2 = reduction::vector<4>(sums, reduction::kSumError) / N1;
 
 //    std::cout << "RAW NLF A: " << std::setprecision(4) << std::scientific << nlfA << ", B: " << nlfB
 //                  << ", MSE: " << sqrt(err2) << " on " << std::setprecision(1) << std::fixed
-//                  << 100 * N1 / (_rawImage->width * _rawImage->height) << "% pixels" << std::endl;
+//                  << 100 * N1 / (_rawImageSize.width * _rawImageSize.height) << "% pixels" << std::endl;
 
     // Update the maximum variance with the model
     varianceMax = nlfB;
 
     // Redo the statistics collection limiting the sample to pixels that fit well the linear model
-    s_x = 0;
-    s_y = 0;
-    s_xx = 0;
-    s_xy = 0;
-    double N2 = 0;
-    double4 newErr2 = 0;
-    meanImageCpu->apply([&](const gls::pixel_float4& mm, int x, int y) {
-        double4 m = mm.v;
-        double4 v = (*varImageCpu)[y][x].v;
-
-        bool validStats = !(any(isnan(m)) || any(isnan(v)));
-
-        if (validStats && all(m >= double4(minValue)) && all(m <= double4(maxValue)) && all(v <= varianceMax)) {
-            const auto nlfP = nlfA + nlfB * m;
-            const auto diff = abs(nlfP - v);
-            const auto diffSquare = diff * diff;
-
-            if (all(diffSquare <= 0.5 * err2)) {
-                s_x += m;
-                s_y += v;
-                s_xx += m * m;
-                s_xy += m * v;
-                N2++;
-                newErr2 += diffSquare;
-            }
-        }
-    });
-    newErr2 /= N2;
-
-    if (N2 > 0.001 * (_rawImage->width * _rawImage->height) && !any(isnan(newErr2)) && newErr2 < err2) {
+    parameters.stage = reduction::refit;
+    parameters.varianceMax = toFloat4(varianceMax);
+    parameters.errorThreshold = toFloat4(0.5 * err2);
+    sums = _noiseStatisticsReduction(&_mtlContext, *_meanImage, *_varImage, parameters);
+    s_x = reduction::vector<4>(sums, reduction::kSumX);
+    s_y = reduction::vector<4>(sums, reduction::kSumY);
+    s_xx = reduction::vector<4>(sums, reduction::kSumXX);
+    s_xy = reduction::vector<4>(sums, reduction::kSumXY);
+    double N2 = sums[reduction::kCount];
+    double4 newErr2 = reduction::vector<4>(sums, reduction::kSumError) / N2;
+
+    if (N2 > 0.001 * (_rawImageSize.width * _rawImageSize.height) && !any(isnan(newErr2)) && newErr2 < err2) {
         err2 = newErr2;
         N1 = N2;
 
@@ -474,10 +2026,7 @@ RawNLF RawConverter::MeasureRawNLF(float exposure_multiplier, BayerPattern bayer
 
     std::cout << "RAW NLF A: " << std::setprecision(4) << std::scientific << nlfA << ", B: " << nlfB
               << ", MSE: " << sqrt(err2) << " on " << std::setprecision(1) << std::fixed
-              << 100 * N1 / (_rawImage->width * _rawImage->height) << "% pixels" << std::endl;
-
-//    meanImage.unmapImage(meanImageCpu);
-//    varImage.unmapImage(varImageCpu);
+              << 100 * N1 / (_rawImageSize.width * _rawImageSize.height) << "% pixels" << std::endl;
 
     double varianceExposureAdjustment = exposure_multiplier * exposure_multiplier;
 
@@ -488,3 +2037,199 @@ RawNLF RawConverter::MeasureRawNLF(float exposure_multiplier, BayerPattern bayer
                      nlfB   // B values
     );
 }
+
+PipelinedRawConverter::PipelinedRawConverter(NS::SharedPtr<MTL::Device> mtlDevice, int slotCount,
+                                             const std::vector<uint8_t>* icc_profile_data, bool calibrateFromImage,
+                                             const std::string& binaryArchivePath) : _inFlight(std::max(slotCount, 1)) {
+    for (int i = 0; i < std::max(slotCount, 1); i++) {
+        _slots.push_back(std::make_unique<RawConverter>(mtlDevice, icc_profile_data, calibrateFromImage, binaryArchivePath));
+    }
+}
+
+RawConverter* PipelinedRawConverter::acquireSlot() {
+    if (_inFlight[_nextSlot].valid()) {
+        _inFlight[_nextSlot].wait();
+    }
+    return _slots[_nextSlot].get();
+}
+
+RawConverter::AsyncResult PipelinedRawConverter::submit(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                        DemosaicParameters* demosaicParameters,
+                                                        bool denoise, bool postProcess,
+                                                        gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    auto result = acquireSlot()->demosaicAsync(rawImage, demosaicParameters, denoise, postProcess, outputImage);
+    _inFlight[_nextSlot] = result.done;
+    _nextSlot = (_nextSlot + 1) % _slots.size();
+    return result;
+}
+
+RawConverter::AsyncResult PipelinedRawConverter::submit(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                        DemosaicParameters* demosaicParameters,
+                                                        bool denoise, bool postProcess,
+                                                        gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    auto result = acquireSlot()->demosaicAsync(rawImage, demosaicParameters, denoise, postProcess, outputImage);
+    _inFlight[_nextSlot] = result.done;
+    _nextSlot = (_nextSlot + 1) % _slots.size();
+    return result;
+}
+
+void PipelinedRawConverter::waitForCompletion() {
+    for (auto& done : _inFlight) {
+        if (done.valid()) {
+            done.wait();
+        }
+    }
+}
+
+StreamingRawConverter::StreamingRawConverter(NS::SharedPtr<MTL::Device> mtlDevice, const DemosaicParameters& demosaicParameters,
+                                             bool noiseReduction, int slotCount, int statisticsInterval,
+                                             const std::vector<uint8_t>* icc_profile_data, const std::string& binaryArchivePath) :
+    _pipeline(mtlDevice, slotCount, icc_profile_data, /*calibrateFromImage=*/ false, binaryArchivePath),
+    _parameters(demosaicParameters),
+    _frameParameters(_pipeline.slotCount()),
+    _noiseReduction(noiseReduction),
+    _statisticsInterval(std::max(statisticsInterval, 1)) {
+    for (int i = 0; i < _pipeline.slotCount(); i++) {
+        _pipeline.converter(i)->context()->prewarmKernels();
+        _pipeline.converter(i)->setPcaRefreshInterval(_statisticsInterval);
+        _pipeline.converter(i)->setPcaDriftThreshold(kPcaDriftThreshold);
+    }
+}
+
+StreamingRawConverter::~StreamingRawConverter() {
+    waitForCompletion();
+}
+
+void StreamingRawConverter::setParameters(const DemosaicParameters& demosaicParameters) {
+    _parameters = demosaicParameters;
+    _statistics.reset();
+    _scene++;
+    for (int i = 0; i < _pipeline.slotCount(); i++) {
+        _pipeline.converter(i)->setPcaScene(_scene);
+        _pipeline.converter(i)->setTemporalDenoise(_temporalDenoise, _scene);
+    }
+    _statisticsSlot = -1;
+}
+
+void StreamingRawConverter::setTemporalDenoise(float strength) {
+    _temporalDenoise = strength;
+    for (int i = 0; i < _pipeline.slotCount(); i++) {
+        _pipeline.converter(i)->setTemporalDenoise(_temporalDenoise, _scene);
+    }
+}
+
+void StreamingRawConverter::harvestStatistics(int slot) {
+    if (_statisticsSlot < 0) {
+        return;
+    }
+    // The slot about to be reused has completed, the others are only checked
+    if (_statisticsSlot != slot && _statisticsDone.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+
+    const auto& measured = *_pipeline.converter(_statisticsSlot)->histogramData();
+    if (_statistics) {
+        // Exponential smoothing of the levels avoids exposure flicker between measurements
+        const float a = 0.5;
+        auto& statistics = *_statistics;
+        statistics.histogram = measured.histogram;
+        statistics.bands = measured.bands;
+        statistics.black_level = std::lerp(statistics.black_level, measured.black_level, a);
+        statistics.white_level = std::lerp(statistics.white_level, measured.white_level, a);
+        statistics.shadows = std::lerp(statistics.shadows, measured.shadows, a);
+        statistics.highlights = std::lerp(statistics.highlights, measured.highlights, a);
+        statistics.mean = std::lerp(statistics.mean, measured.mean, a);
+        statistics.median = std::lerp(statistics.median, measured.median, a);
+    } else {
+        _statistics = measured;
+    }
+    _statisticsSlot = -1;
+}
+
+void StreamingRawConverter::prepareSlot(int slot, RawConverter* converter) {
+    harvestStatistics(slot);
+
+    // Until the first measurement is in every frame measures its own statistics
+    const bool measure = !_statistics || (_frameIndex % _statisticsInterval == 0 && _statisticsSlot < 0);
+    if (!measure) {
+        *converter->histogramData() = *_statistics;
+    }
+    converter->setFrozenHistogram(!measure);
+
+    _frameParameters[slot] = _parameters;
+}
+
+void StreamingRawConverter::frameSubmitted(int slot, RawConverter* converter, const RawConverter::AsyncResult& result,
+                                           bool measuresStatistics) {
+    if (measuresStatistics && _statisticsSlot < 0) {
+        _statisticsSlot = slot;
+        _statisticsDone = result.done;
+    }
+    _frameIndex++;
+
+    // Completes after the frame's command buffers
+    converter->context()->notify([this]() {
+        std::lock_guard<std::mutex> guard(_timingMutex);
+        _completionTimes.push_back(clock::now());
+        if (_completionTimes.size() > kTimingWindow + 1) {
+            _completionTimes.pop_front();
+        }
+        _completedFrames++;
+    });
+}
+
+RawConverter::AsyncResult StreamingRawConverter::submit(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                        gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    const int slot = _pipeline.nextSlot();
+    auto converter = _pipeline.acquireSlot();
+    prepareSlot(slot, converter);
+
+    const auto result = _pipeline.submit(rawImage, &_frameParameters[slot], _noiseReduction, /*postProcess=*/ true, outputImage);
+    frameSubmitted(slot, converter, result, !converter->frozenHistogram());
+    return result;
+}
+
+RawConverter::AsyncResult StreamingRawConverter::submit(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                        gls::mtl_image_2d<gls::pixel_float4>* outputImage) {
+    const int slot = _pipeline.nextSlot();
+    auto converter = _pipeline.acquireSlot();
+    prepareSlot(slot, converter);
+
+    const auto result = _pipeline.submit(rawImage, &_frameParameters[slot], _noiseReduction, /*postProcess=*/ true, outputImage);
+    frameSubmitted(slot, converter, result, !converter->frozenHistogram());
+    return result;
+}
+
+StreamingRawConverter::Statistics StreamingRawConverter::statistics() const {
+    std::lock_guard<std::mutex> guard(_timingMutex);
+
+    Statistics statistics = { _completedFrames, 0, 0, 0, 0 };
+    const int intervals = (int) _completionTimes.size() - 1;
+    if (intervals < 1) {
+        return statistics;
+    }
+
+    std::vector<double> frameTimes;
+    for (int i = 0; i < intervals; i++) {
+        frameTimes.push_back(std::chrono::duration<double, std::milli>(_completionTimes[i + 1] - _completionTimes[i]).count());
+    }
+    double sum = 0, sumSquares = 0;
+    for (double t : frameTimes) {
+        sum += t;
+        sumSquares += t * t;
+        statistics.maxFrameTime = std::max(statistics.maxFrameTime, t);
+    }
+    statistics.meanFrameTime = sum / intervals;
+    statistics.frameTimeJitter = std::sqrt(std::max(sumSquares / intervals - statistics.meanFrameTime * statistics.meanFrameTime, 0.0));
+    statistics.fps = statistics.meanFrameTime > 0 ? 1000 / statistics.meanFrameTime : 0;
+    return statistics;
+}
+
+void StreamingRawConverter::waitForCompletion() {
+    _pipeline.waitForCompletion();
+
+    // Also waits for the frame timing notifications
+    for (int i = 0; i < _pipeline.slotCount(); i++) {
+        _pipeline.converter(i)->context()->waitForCompletion();
+    }
+}
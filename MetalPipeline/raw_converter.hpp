@@ -16,75 +16,461 @@
 #ifndef raw_converter_hpp
 #define raw_converter_hpp
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <optional>
+
+#include "gls_frame_arena.hpp"
 #include "gls_mtl_image.hpp"
+#include "gls_memory_pressure.hpp"
+#include "gls_spsc_ring.hpp"
 #include "gls_mtl.hpp"
+#include "gls_mtl_graph.hpp"
+#include "gls_mtl_io.hpp"
 
 #include "pyramid_processor.hpp"
 #include "demosaic_kernels.hpp"
+#include "noise_model_cache.hpp"
+#include "color_profile_cache.hpp"
+
+// Storage precision of the GPU-only intermediates of each stage of the pipeline. The images read back on the
+// CPU (noise statistics, output) keep the pixel type format.
+struct PrecisionPolicy {
+    gls::texture_precision rawData = gls::texture_precision::fp32;      // Scaled raw data and raw denoising
+    gls::texture_precision gradients = gls::texture_precision::fp16;    // Raw gradient image
+    gls::texture_precision demosaic = gls::texture_precision::native;   // Green channel and linear RGB intermediates
+    gls::texture_precision pyramid = gls::texture_precision::fp16;      // Denoising pyramid
+    gls::texture_precision ltm = gls::texture_precision::fp16;          // Local tone mapping guides and mask
+
+    static PrecisionPolicy fullPrecision() {
+        const auto fp32 = gls::texture_precision::fp32;
+        return { fp32, fp32, fp32, fp32, fp32 };
+    }
+};
+
+// Quality and performance trade-offs of the whole pipeline, e.g. chosen by thermal state or shutter mode. The
+// converter settings go through RawConverter::setPreset, the denoising and tone mapping ones through apply() on the
+// calibration's DemosaicParameters of every frame. Balanced is the default configuration of the pipeline.
+struct PipelinePreset {
+    enum Name {
+        preview,    // Viewfinder and video: no block matching, no LTM, reused PCA basis
+        fast,       // Burst and thermal throttling
+        balanced,
+        max         // fp32 intermediates and the full pyramid regardless of the noise
+    };
+
+    Name name = balanced;
+
+    // RawConverter settings
+    PrecisionPolicy precision;
+    bool tiledDemosaic = false;
+    bool bakedColorLut = false;
+    bool halfResolutionGradients = false;
+    // Quad Bayer data is binned to half resolution instead of remosaiced, see RawConverter::setQuadBayerMode
+    bool quadBayerBinning = false;
+    int pcaRefreshInterval = 1;
+    std::array<float, 2> gradientBlurRadius = { 1.5, 4.5 };  // Raw gradient blur, see rawFrontEndKernel
+
+    // DemosaicParameters limits: the calibration's pyramid depth and PCA components are capped, the level plan
+    // thresholds are raised, see DenoisePyramidConfig
+    int pyramidLevels = 5;
+    int pcaComponents = 8;
+    float blockMatchingNoise = 0;
+    float copyNoise = 0;
+    int pcaSampleBudget = 64 * 1024;
+    bool localToneMapping = true;
+    // The LTM and histogram pyramid is a mipmapped texture, see RawConverter::setMipmappedLtmPyramid
+    bool mipmappedLtmPyramid = false;
+    // Max ignores the ISO driven pyramid configuration
+    bool fullPyramid = false;
+
+    static PipelinePreset named(Name name) {
+        const auto fp16 = gls::texture_precision::fp16;
+        PipelinePreset preset;
+        preset.name = name;
+        switch (name) {
+            case preview:
+                preset.precision = { fp16, fp16, fp16, fp16, fp16 };
+                preset.tiledDemosaic = true;
+                preset.bakedColorLut = true;
+                preset.halfResolutionGradients = true;
+                preset.quadBayerBinning = true;
+                preset.mipmappedLtmPyramid = true;
+                preset.pcaRefreshInterval = 8;
+                preset.gradientBlurRadius = { 1.0, 3.0 };
+                preset.pyramidLevels = 3;
+                preset.pcaComponents = 2;
+                preset.blockMatchingNoise = std::numeric_limits<float>::infinity();
+                preset.copyNoise = 1e-3;
+                preset.pcaSampleBudget = 16 * 1024;
+                preset.localToneMapping = false;
+                break;
+            case fast:
+                preset.precision.demosaic = fp16;
+                preset.tiledDemosaic = true;
+                preset.bakedColorLut = true;
+                preset.quadBayerBinning = true;
+                preset.mipmappedLtmPyramid = true;
+                preset.pcaRefreshInterval = 4;
+                preset.pyramidLevels = 4;
+                preset.pcaComponents = 4;
+                preset.blockMatchingNoise = 1e-3;
+                preset.copyNoise = 2.5e-4;
+                preset.pcaSampleBudget = 32 * 1024;
+                break;
+            case balanced:
+                break;
+            case max:
+                preset.precision = PrecisionPolicy::fullPrecision();
+                preset.fullPyramid = true;
+                break;
+        }
+        return preset;
+    }
+
+    static const char* nameString(Name name) {
+        static const char* names[] = { "preview", "fast", "balanced", "max" };
+        return names[name];
+    }
+
+    static Name nameFromString(const std::string& string) {
+        for (const auto name : { preview, fast, balanced, max }) {
+            if (string == nameString(name)) {
+                return name;
+            }
+        }
+        throw std::runtime_error("Unknown pipeline preset: " + string);
+    }
+
+    void apply(DemosaicParameters* demosaicParameters) const {
+        auto& config = demosaicParameters->denoisePyramidConfig;
+        if (fullPyramid) {
+            config = DenoisePyramidConfig();
+        }
+        config.levels = std::min(config.levels, pyramidLevels);
+        config.pcaComponents = std::min(config.pcaComponents, pcaComponents);
+        config.blockMatchingNoise = std::max(config.blockMatchingNoise, blockMatchingNoise);
+        config.copyNoise = std::max(config.copyNoise, copyNoise);
+        config.pcaSampleBudget = std::min(config.pcaSampleBudget, pcaSampleBudget);
+        demosaicParameters->rgbConversionParameters.localToneMapping &= localToneMapping;
+    }
+};
 
 class LocalToneMapping {
     gls::mtl_image_2d<gls::pixel_float>::unique_ptr ltmMaskImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr lfAbGfImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr lfAbGfMeanImage;
+    gls::mtl_image_2d<gls::pixel_float2>::unique_ptr lfAbGfTmpImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr mfAbGfImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr mfAbGfMeanImage;
+    gls::mtl_image_2d<gls::pixel_float2>::unique_ptr mfAbGfTmpImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr hfAbGfImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr hfAbGfMeanImage;
+    gls::mtl_image_2d<gls::pixel_float2>::unique_ptr hfAbGfTmpImage;
+    // Means of the previous run, blended with the new ones in temporal mode
+    gls::mtl_image_2d<gls::pixel_float2>::unique_ptr lfAbGfHistoryImage;
+    gls::mtl_image_2d<gls::pixel_float2>::unique_ptr mfAbGfHistoryImage;
+
+    // Only built when LTM is enabled, the placeholder mask needs no kernel
+    LazyKernel<localToneMappingMaskKernel> _localToneMappingMask;
 
-    localToneMappingMaskKernel _localToneMappingMask;
+    // Scene of the cached low and medium frequency means, unset until the first mask is built
+    std::optional<uint64_t> _historyScene;
+    int _runs = 0;
 
    public:
+    // Temporal mode, for bursts and video: the low and medium frequency bands are recomputed every refreshInterval
+    // runs and reused in between, with a temporalWeight < 1 the recomputed means are blended with the previous ones.
+    // The high frequency band follows every frame. Frames of different scenes never share the cached bands.
+    int refreshInterval = 1;
+    float temporalWeight = 1;
+    uint64_t scene = 0;
+
     LocalToneMapping(MetalContext* context) :
         _localToneMappingMask(context) {
+        gls::GPUMemoryTracker::Scope scope("LocalToneMapping");
         // Placeholder, only allocated if LTM is used
-        ltmMaskImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float>>(context->device(), 1, 1);
+        ltmMaskImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float>>(context->device(), 1, 1);
     }
 
-    void allocateTextures(MetalContext* context, int width, int height) {
+    // The guide images are at 1/16, 1/4 and 1/2 of the image resolution. The row filtered means of the guide's
+    // squares lose too much precision in half floats, the temporary images are always fp32.
+    void allocateTextures(MetalContext* context, int width, int height,
+                          gls::texture_precision precision = gls::texture_precision::native) {
+        gls::GPUMemoryTracker::Scope scope("LocalToneMapping");
         auto mtlDevice = context->device();
 
         if (ltmMaskImage->width != width || ltmMaskImage->height != height) {
-            ltmMaskImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float>>(mtlDevice, width, height);
+            const auto fp32 = gls::texture_precision::fp32;
+            ltmMaskImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float>>(mtlDevice, width, height, precision);
             lfAbGfImage =
-                std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, width / 16, height / 16);
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 16, height / 16, precision);
             lfAbGfMeanImage =
-                std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, width / 16, height / 16);
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 16, height / 16, precision);
+            lfAbGfTmpImage =
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 16, height / 16, fp32);
             mfAbGfImage =
-                std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, width / 4, height / 4);
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 4, height / 4, precision);
             mfAbGfMeanImage =
-                std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, width / 4, height / 4);
-            hfAbGfImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, width, height);
-            hfAbGfMeanImage = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(mtlDevice, width, height);
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 4, height / 4, precision);
+            mfAbGfTmpImage =
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 4, height / 4, fp32);
+            hfAbGfImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 2, height / 2, precision);
+            hfAbGfMeanImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 2, height / 2, precision);
+            hfAbGfTmpImage = std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 2, height / 2, fp32);
+            lfAbGfHistoryImage =
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 16, height / 16, precision);
+            mfAbGfHistoryImage =
+                std::make_unique<gls::mtl_private_image_2d<gls::pixel_float2>>(mtlDevice, width / 4, height / 4, precision);
+            _historyScene.reset();
         }
     }
 
-    void createMask(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& image,
+    void createMask(MetalContext* context, const gls::mtl_private_image_2d<gls::pixel_float4>& image,
                     const gls::mtl_image_2d<gls::pixel_float2>& gradientImage,
                     const std::array<const gls::mtl_image_2d<gls::pixel_float4>*, 3>& guideImage,
                     const NoiseModel<5>& noiseModel, const LTMParameters& ltmParameters,
-                    MTL::Buffer* histogramBuffer) {
-        const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, 3>& abImage = {
+                    MTL::Buffer* histogramBuffer, bool temporal = true) {
+        const bool valid = temporal && _historyScene == scene;
+        const bool refresh = !valid || _runs % std::max(refreshInterval, 1) == 0;
+        const bool blend = valid && refresh && temporalWeight < 1;
+        if (blend) {
+            // The previous means become the history, the new ones overwrite the older history
+            std::swap(lfAbGfMeanImage, lfAbGfHistoryImage);
+            std::swap(mfAbGfMeanImage, mfAbGfHistoryImage);
+        }
+        _runs = valid ? _runs + 1 : 1;
+        _historyScene = temporal ? std::optional<uint64_t>(scene) : std::nullopt;
+
+        const std::array<gls::mtl_image_2d<gls::pixel_float2>*, 3>& abImage = {
             lfAbGfImage.get(), mfAbGfImage.get(), hfAbGfImage.get()};
-        const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, 3>& abMeanImage = {
+        const std::array<gls::mtl_image_2d<gls::pixel_float2>*, 3>& abMeanImage = {
             lfAbGfMeanImage.get(), mfAbGfMeanImage.get(), hfAbGfMeanImage.get()};
+        const std::array<gls::mtl_image_2d<gls::pixel_float2>*, 3>& tmpImage = {
+            lfAbGfTmpImage.get(), mfAbGfTmpImage.get(), hfAbGfTmpImage.get()};
 
         gls::Vector<2> nlf = {noiseModel.pyramidNlf[0].first[0], noiseModel.pyramidNlf[0].second[0]};
 
-        _localToneMappingMask(context, image, gradientImage, guideImage, abImage, abMeanImage, ltmParameters,
-                              nlf, histogramBuffer, ltmMaskImage.get());
+        const std::array<const gls::mtl_image_2d<gls::pixel_float2>*, 3> historyImage = {
+            blend ? lfAbGfHistoryImage.get() : nullptr, blend ? mfAbGfHistoryImage.get() : nullptr, nullptr};
+
+        _localToneMappingMask.get()(context, image, gradientImage, guideImage, abImage, abMeanImage, tmpImage, ltmParameters,
+                                    nlf, histogramBuffer, ltmMaskImage.get(), {refresh, refresh, true}, historyImage,
+                                    std::clamp(temporalWeight, 0.0f, 1.0f));
     }
 
     const gls::mtl_image_2d<gls::pixel_float>& getMask() { return *ltmMaskImage; }
 };
 
+// Motion compensated recursive temporal denoise for video, see temporalDenoiseImageKernel: the YCbCr input of the
+// denoising pyramid is blended with the previous frame's output, warped by a cheap motion estimate, the tile
+// alignment of the frame's 1/8 and 1/4 resolution levels to the previous frame's. The noise variance left in a static
+// scene is tracked across the recursion, the spatial denoise runs with the matching noise model and can use fewer
+// levels. Frames of a different scene or size restart the recursion.
+class TemporalDenoiser {
+    // Levels at 1/2, 1/4 and 1/8 resolution, the two coarsest are aligned
+    static constexpr int kLevels = 3;
+    static constexpr int kMotionScale = 4;
+
+    LazyKernel<temporalDenoiseImageKernel> _temporalDenoise;
+    LazyKernel<alignTilesKernel> _alignTiles;
+    LazyKernel<resampleImageKernel, std::string> _downsampleImage;
+
+    // The previous output is _history[0], the new one goes to _history[1], the same for the input's levels
+    std::array<gls::mtl_image_2d<gls::pixel_float4>::unique_ptr, 2> _history;
+    std::array<std::array<gls::mtl_image_2d<gls::pixel_float4>::unique_ptr, kLevels>, 2> _levels;
+    std::array<gls::mtl_image_2d<gls::pixel_float2>::unique_ptr, 2> _motionField;
+
+    std::optional<uint64_t> _historyScene;
+    int _frames = 0;
+    // Noise variance of the history relative to a single frame's
+    float _variance = 1;
+
+    void allocate(MTL::Device* device, const gls::size& imageSize) {
+        if (_history[0] && _history[0]->size() == imageSize) {
+            return;
+        }
+        gls::GPUMemoryTracker::Scope scope("TemporalDenoiser");
+        for (int i = 0; i < 2; i++) {
+            _history[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(device, imageSize);
+            for (int l = 0, scale = 2; l < kLevels; l++, scale *= 2) {
+                _levels[i][l] = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(device, imageSize.width / scale, imageSize.height / scale);
+            }
+        }
+        for (int i = 0, scale = 2 * kMotionScale; i < 2; i++, scale /= 2) {
+            const auto size = alignTilesKernel::motionFieldSize(imageSize.width / scale, imageSize.height / scale);
+            _motionField[i] = std::make_unique<gls::mtl_image_2d<gls::pixel_float2>>(device, size.width, size.height);
+        }
+        _historyScene.reset();
+    }
+
+public:
+    // Largest weight of the history, the steady state noise variance of a static scene is (1 - s) / (1 + s) of a
+    // single frame's. A higher rejectionStrength tolerates larger differences before falling back to the frame.
+    float strength = 0.75;
+    float rejectionStrength = 4;
+    uint64_t scene = 0;
+
+    TemporalDenoiser(MetalContext* context) :
+        _temporalDenoise(context),
+        _alignTiles(context),
+        _downsampleImage(context, "downsampleImageXYZ") { }
+
+    void reset() {
+        _historyScene.reset();
+    }
+
+    void releaseTextures() {
+        _history = {};
+        _levels = {};
+        _motionField = {};
+        _historyScene.reset();
+    }
+
+    // Returns the filtered frame, valid until the next call, and scales the noise model to its residual noise
+    const gls::mtl_image_2d<gls::pixel_float4>& denoise(MetalContext* context, const gls::mtl_image_2d<gls::pixel_float4>& image,
+                                                        std::array<YCbCrNLF, 5>* nlfParameters) {
+        allocate(context->device(), image.size());
+
+        auto& levels = _levels[1];
+        for (int l = 0; l < kLevels; l++) {
+            _downsampleImage(context, l > 0 ? *levels[l - 1] : image, levels[l].get());
+        }
+
+        const bool valid = _historyScene == scene && strength > 0;
+        _historyScene = scene;
+        if (!valid) {
+            // The first frame of the recursion
+            context->enqueue([&, output = _history[1].get()](MTL::CommandBuffer* commandBuffer) {
+                output->copyPixelsFrom(commandBuffer, image);
+            });
+            _frames = 1;
+            _variance = 1;
+        } else {
+            MetalContext::TraceScope trace(context, "temporal denoise");
+
+            // The motion field maps the frame's coordinates to the history's, the 1/4 level refines the 1/8 one
+            _alignTiles(context, *levels[2], *_levels[0][2], nullptr, /*searchRadius=*/ 4, /*l1Norm=*/ false, _motionField[0].get());
+            _alignTiles(context, *levels[1], *_levels[0][1], _motionField[0].get(), /*searchRadius=*/ 2, /*l1Norm=*/ false,
+                        _motionField[1].get());
+
+            // The running average of the first frames, then the recursive filter
+            const float historyWeight = std::min(strength, 1 - 1.0f / (_frames + 1));
+            _temporalDenoise(context, image, *_history[0], *_motionField[1], (*nlfParameters)[0], historyWeight,
+                             rejectionStrength, kMotionScale, _history[1].get());
+
+            _frames++;
+            _variance = (1 - historyWeight) * (1 - historyWeight) + historyWeight * historyWeight * _variance;
+        }
+
+        // Moving areas keep more noise than the static scene's model, the spatial denoise can't tell them apart
+        for (auto& nlf : *nlfParameters) {
+            for (int c = 0; c < 3; c++) {
+                nlf.first[c] *= _variance;
+                nlf.second[c] *= _variance;
+            }
+        }
+
+        std::swap(_history[0], _history[1]);
+        std::swap(_levels[0], _levels[1]);
+        return *_history[0];
+    }
+
+    // Noise variance of the last output relative to a single frame's in a static scene
+    float variance() const {
+        return _variance;
+    }
+};
+
+// Pool of IOSurface-backed output images. An image is checked out for a pipeline run and returned explicitly
+// once the client is done with its CVPixelBuffer (e.g. after HEIC encoding), so several results can be in flight.
+// ImageType wraps a pixel buffer of the pool's pixelFormat, see OutputImagePool and YCbCrOutputImagePool.
+template <typename ImageType>
+class PixelBufferImagePool {
+public:
+    typedef ImageType image_type;
+
+private:
+    MTL::Device* _device;
+    const int _capacity;
+    OSType _pixelFormat;
+    gls::size _imageSize;
+    CVPixelBufferPoolRef _pixelBufferPool;
+    std::vector<std::unique_ptr<image_type>> _available;
+    std::vector<std::unique_ptr<image_type>> _checkedOut;
+    std::mutex _mutex;
+    std::condition_variable _returned;
+
+    void createPixelBufferPool(const gls::size& imageSize);
+
+public:
+    PixelBufferImagePool(MTL::Device* device, OSType pixelFormat, int capacity = 3);
+
+    ~PixelBufferImagePool();
+
+    OSType pixelFormat() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _pixelFormat;
+    }
+
+    // Like a size change, the images of the previous format are dropped
+    void setPixelFormat(OSType pixelFormat);
+
+    // Blocks while all the images are checked out
+    image_type* checkout(const gls::size& imageSize);
+
+    // Pixel buffers not coming from the pool are ignored
+    void checkin(CVPixelBufferRef pixelBuffer);
+
+    // Releases the idle images and the free buffers of the CoreVideo pool, returns the bytes of the images released.
+    // Thread-safe, the images checked out are not affected.
+    size_t trim();
+};
+
+// RGBA output of the pipeline's float4 images
+typedef PixelBufferImagePool<gls::mtl_pixel_buffer_image_2d<gls::pixel_float4>> OutputImagePool;
+
+// Full range 4:2:0 YCbCr output, 8 or 10 bit, for the HEVC encoders
+typedef PixelBufferImagePool<gls::mtl_pixel_buffer_ycbcr_420_image> YCbCrOutputImagePool;
+
+// Raw exposure and white balance statistics of a preview frame, see RawConverter::setPreviewStatistics
+struct PreviewStatistics {
+    // Index of the preview frame, in submission order: frames whose statistics slot was busy are missing
+    uint64_t frame;
+    // Bayer quads sampled
+    uint32_t samples;
+    // Fraction of the samples clipped in each raw channel, red, green, blue and second green
+    std::array<float, 4> clipped;
+    // Fraction of the samples in the highlights
+    float highlights;
+    // Luma histogram of the white balanced raw data, the bins follow histogramImage
+    std::array<uint32_t, 256> lumaHistogram;
+    // Average camera RGB of the unclipped samples and the gray world gains normalized to green
+    std::array<float, 3> grayWorld;
+    std::array<float, 3> grayWorldGains;
+};
+
 class RawConverter {
+    // Pipeline stages delimiting the lifetime of the transient textures
+    enum TransientStage {
+        kRawGradientStage = 0,
+        kDemosaicStage,
+        kDenoiseStage
+    };
+
     const bool _calibrateFromImage;
     MetalContext _mtlContext;
     gls::size _rawImageSize;
 
     gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _rawImage;
+    // Staging of the packed raw uploads, unpacked into _rawImage on the GPU
+    std::unique_ptr<gls::Buffer<uint8_t>> _packedRawData;
     gls::mtl_image_2d<gls::pixel_float>::unique_ptr _scaledRawImage;
-    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _rawSobelImage;
     gls::mtl_image_2d<gls::pixel_float2>::unique_ptr _rawGradientImage;
     gls::mtl_image_2d<gls::pixel_float>::unique_ptr _greenImage;
     gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _linearRGBImageA;
@@ -94,73 +480,672 @@ class RawConverter {
     gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _meanImage;
     gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _varImage;
 
-    // RawConverter HighNoise textures
-    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _rgbaRawImage;
-    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _denoisedRgbaRawImage;
-
+    // With _mipmappedLtmPyramid the first level is a gls::mtl_mipmapped_image_2d and the others are views of its levels
     std::array<gls::mtl_image_2d<gls::pixel_float4>::unique_ptr, 4> _ltmImagePyramid;
+    bool _mipmappedLtmPyramid = false;
+    bool _ltmPyramidMipmapped = false;
 
     std::unique_ptr<PyramidProcessor<5>> _pyramidProcessor;
 
     std::unique_ptr<LocalToneMapping> _localToneMapping;
 
-    std::unique_ptr<std::vector<uint8_t>> _icc_profile_data;
+    OutputImagePool _outputImagePool;
+    YCbCrOutputImagePool _ycbcrOutputImagePool;
+
+    PrecisionPolicy _precisionPolicy;
+
+    PipelinePreset _preset;
+
+    // Single pass demosaic instead of the three interpolation passes
+    bool _tiledDemosaic = false;
+    // Demosaic graph intermediates without driver hazard tracking, see setUntrackedHazards
+    bool _untrackedHazards = false;
+    // Stitched pointwise stages, see setPointwiseFusion
+    bool _pointwiseFusion = false;
+    // The fused pointwise stages in tile memory, see setTileMemoryFusion
+    bool _tileMemoryFusion = false;
+    // Highlights blending in the demosaic kernels, see setInlineHighlights
+    bool _inlineHighlights = false;
+    // Of the last demosaic with inline highlights, see clippedPixels
+    gls::Buffer<uint32_t> _clippedPixels;
+
+    // Raw gradient image at half of the raw resolution, see setHalfResolutionGradients
+    bool _halfResolutionGradients = false;
+
+    // Set while processing tiles: the histogram statistics come from the whole image and are not recomputed per tile
+    bool _frozenHistogram = false;
+
+    // Incremental re-rendering, see setRerenderCache
+    bool _rerenderCache = false;
+    // Of the raw data of the next run, set by the entry points which can read it on the CPU
+    std::optional<uint64_t> _rawContentHash;
+    QuadBayerMode _quadBayerMode = QuadBayerMode::automatic;
+    // Of the next run when its raw image is written by the GPU, see demosaicQuadBayerAsync
+    std::optional<gls::luma_pixel_16> _noiseSeed;
+    // Final image of the next run when smaller than the raw image, see demosaicToSizeAsync
+    gls::mtl_image_2d<gls::pixel_float4>* _downscaledOutputImage = nullptr;
+    // Raw content and upstream parameters of the intermediates left by the last run, unset if they can't be reused.
+    // The re-render converts the finest level of the denoised pyramid again.
+    std::optional<uint64_t> _rerenderKey;
+
+    // Streaming post-processing state, see beginStreamingPostprocess
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _streamingInputImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _streamingOutputImage;
+    DemosaicParameters* _streamingParameters = nullptr;
+    RGBConversionParameters _streamingRgbConversionParameters;
+    int _streamingBandHeight = 0;
+    int _streamingNextBand = 0;
+
+    // Runs between checks of the denoiser's PCA basis
+    int _pcaRefreshInterval = 1;
+    // Relative drop of the variance captured by the cached PCA basis triggering its rebuild, zero always rebuilds
+    float _pcaDriftThreshold = 0;
+    // Frames of different scenes never share a PCA basis
+    uint64_t _pcaScene = 0;
+    // Coarsest pyramid levels denoised on the CPU, see PyramidProcessor::cpuLevels
+    int _cpuPyramidLevels = 0;
+
+    // The final color conversion and tone curve go through per-frame lookup tables, see bakeColorLut in demosaic.metal
+    bool _bakedColorLut = false;
+
+    // Written by convertTosRGB along with the RGBA output, see setExtraOutputs
+    convertTosRGBKernel::ExtraOutputs _extraOutputs;
+
+    // Recursive temporal denoise of video frames, created by setTemporalDenoise
+    std::unique_ptr<TemporalDenoiser> _temporalDenoiser;
+
+    // Long sides of the gallery renditions and their images, see setRenditions
+    std::vector<int> _renditionSizes;
+    std::vector<gls::mtl_image_2d<gls::pixel_float4>::unique_ptr> _renditions;
+    // By the current run, not all of them render the renditions
+    bool _renditionsWritten = false;
+
+    // Temporal reuse of the LTM low and medium frequency bands, see LocalToneMapping
+    int _ltmRefreshInterval = 1;
+    float _ltmTemporalWeight = 1;
+    uint64_t _ltmScene = 0;
+
+    // Receives the noise models measured with calibrateFromImage, not owned
+    NoiseModelCache* _noiseModelCache = nullptr;
+
+    // Measure the combined raw image statistics with every frame
+    bool _measureImageStatistics = false;
+
+    // Set while processing a region of a larger frame (tiles, crops): the lens shading falloff follows the frame
+    gls::size _regionFrameSize = { 0, 0 };
+    gls::point _regionOrigin = { 0, 0 };
+
+    // Upload textures of the CPU raw images of a burst being fused, each is reused two frames later
+    std::array<gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr, 2> _fusionRawImages;
+    std::array<std::shared_future<void>, 2> _fusionDone;
+    int _fusionFrame = 0;
+
+    // Bayer data of a quad Bayer raw image, see setQuadBayerMode
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _quadBayerRawImage;
+
+    // 2x2 binned raw data and the output of demosaicToSizeAsync
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _binnedRawImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _sizedOutputImage;
+
+    // Raw data of the current tile in tiled mode
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _rawTileImage;
+
+    // Half resolution preview textures
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _previewRawImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _previewYCbCrImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _previewDenoisedImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _previewImage;
+
+    // CPU-visible output of the progressive preview, at the size of its pyramid level
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _progressivePreviewImage;
+
+    // Size-dependent intermediates of recently used raw image sizes, most recently used first. Switching
+    // cameras back and forth reuses them instead of reallocating (and page faulting) the whole pipeline.
+    struct SizedTextures {
+        gls::size imageSize;
+        size_t allocatedBytes;
+        gls::mtl_image_2d<gls::pixel_float>::unique_ptr scaledRawImage;
+        gls::mtl_image_2d<gls::pixel_float2>::unique_ptr rawGradientImage;
+        gls::mtl_image_2d<gls::pixel_float>::unique_ptr greenImage;
+        gls::mtl_image_2d<gls::pixel_float4>::unique_ptr linearRGBImageA;
+        gls::mtl_image_2d<gls::pixel_float4>::unique_ptr linearRGBImageB;
+        gls::mtl_image_2d<gls::pixel_float4>::unique_ptr meanImage;
+        gls::mtl_image_2d<gls::pixel_float4>::unique_ptr varImage;
+        std::unique_ptr<PyramidProcessor<5>> pyramidProcessor;
+
+        // Cached sizes are volatile, see gls::mtl_image_2d::setPurgeableState. Returns false if any of their
+        // contents were discarded.
+        bool setPurgeable(bool purgeable);
+    };
+    std::list<SizedTextures> _textureCache;
+    size_t _textureCacheBudget = 1024 * 1024 * 1024;
+    size_t _allocatedBytes = 0;
+
+    // Drops the size-dependent intermediates, including those of the cached sizes
+    void releaseTextures();
+
+    void stashTextures();
+    bool restoreTextures(const gls::size& imageSize);
+    void trimTextureCache();
+    void createTextures(const gls::size& imageSize);
+    void dropTextures();
+
+    // Level of the trim requested by requestTrim, applied by the next run
+    std::atomic<int> _deferredTrim = (int) gls::MemoryPressure::normal;
+
+    // The demosaic pipeline as a stage graph, rebuilt when the configuration changes. The raw denoising
+    // intermediates are transient textures of the graph, the other intermediates are imported.
+    struct DemosaicGraphConfig {
+        gls::size imageSize;
+        bool noiseReduction;
+        bool rawDenoise;
+        bool postProcess;
+        bool tiledDemosaic;
+        bool imageStatistics;
+        bool untrackedHazards;
+        bool pointwiseFusion;
+        bool tileMemoryFusion;
+        bool inlineHighlights;
+
+        bool operator==(const DemosaicGraphConfig& other) const {
+            return imageSize == other.imageSize && noiseReduction == other.noiseReduction && rawDenoise == other.rawDenoise &&
+                   postProcess == other.postProcess && tiledDemosaic == other.tiledDemosaic &&
+                   imageStatistics == other.imageStatistics && untrackedHazards == other.untrackedHazards &&
+                   pointwiseFusion == other.pointwiseFusion && tileMemoryFusion == other.tileMemoryFusion &&
+                   inlineHighlights == other.inlineHighlights;
+        }
+    };
+
+    struct DemosaicGraphTextures {
+        StageGraph::Texture<gls::luma_pixel_16> rawImage;
+        StageGraph::Texture<gls::pixel_float> scaledRawImage;
+        StageGraph::Texture<gls::pixel_float2> rawGradientImage;
+        StageGraph::Texture<gls::pixel_float> greenImage;
+        StageGraph::Texture<gls::pixel_float4> linearRGBImageA;
+        StageGraph::Texture<gls::pixel_float4> linearRGBImageB;
+        StageGraph::Texture<gls::pixel_float4> outputImage;
+    };
+
+    // Per-frame state read by the graph stages while they are encoded
+    struct DemosaicFrame {
+        DemosaicParameters* demosaicParameters = nullptr;
+        // When set the final image is written to it instead of the outputImage texture
+        gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrOutputImage = nullptr;
+        std::array<gls::Vector<2>, 3> rawVariance;
+        gls::Matrix<3, 3> cam_to_ycbcr;
+        gls::Matrix<3, 3> ycbcr_to_cam;
+        gls::luma_pixel_16 noiseSeed;
+        // Progressive preview callback of demosaicProgressiveAsync
+        std::function<void(const gls::mtl_image_2d<gls::pixel_float4>& preview)> previewReady;
+        // Of the denoise input, see PyramidProcessor::denoiseInputKey
+        std::optional<uint64_t> denoiseInputKey;
+        // When set the final image is rendered from the denoised pyramid at its size instead of the outputImage
+        gls::mtl_image_2d<gls::pixel_float4>* downscaledOutputImage = nullptr;
+    };
+
+    std::unique_ptr<StageGraph> _demosaicGraph;
+    DemosaicGraphConfig _demosaicGraphConfig;
+    DemosaicGraphTextures _demosaicGraphTextures;
+    DemosaicFrame _demosaicFrame;
+
+    void buildDemosaicGraph(const DemosaicGraphConfig& config);
+
+    // Denoiser settings shared by denoise() and demosaicFused()
+    void configurePyramidProcessor(const DemosaicParameters& demosaicParameters);
+
+    // Histogram and local tone mapping statistics of the denoised image
+    void denoisedImageStatistics(const gls::mtl_image_2d<gls::pixel_float4>& denoisedImage,
+                                 const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, DemosaicParameters* demosaicParameters);
+
+    // LTM mask of the denoised image, guided by the denoised pyramid levels
+    void createLtmMask(const gls::mtl_image_2d<gls::pixel_float4>& denoisedImage,
+                       const gls::mtl_image_2d<gls::pixel_float2>& gradientImage, DemosaicParameters* demosaicParameters,
+                       bool temporal);
+
+    // Keys of the input of the denoising pyramid and of the intermediates of a run, see setRerenderCache
+    uint64_t denoiseInputKey(uint64_t rawContentHash, const DemosaicGraphConfig& config,
+                             const DemosaicParameters& demosaicParameters) const;
+    uint64_t rerenderKey(uint64_t denoiseInputKey, const DemosaicParameters& demosaicParameters) const;
+
+    // outputImage is a float4 image or a gls::mtl_pixel_buffer_ycbcr_420_image. With ycbcrToCam the linear image is
+    // the denoiser's YCbCr, converted back to camera RGB as it is read.
+    template <typename OutputImageType>
+    void convertTosRGB(const gls::mtl_image_2d<gls::pixel_float4>& linearImage, DemosaicParameters* demosaicParameters,
+                       OutputImageType* outputImage, const gls::Matrix<3, 3>* ycbcrToCam = nullptr);
+
+    AsyncResult demosaicAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                              bool denoise, bool postProcess, gls::mtl_image_2d<gls::pixel_float4>* outputImage,
+                              gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage,
+                              const std::function<void(const gls::mtl_image_2d<gls::pixel_float4>&)>& previewReady = nullptr);
+
+    bool quadBayerBinning(const DemosaicParameters& demosaicParameters) const;
+
+    // Converts the quad Bayer data to Bayer data and runs demosaicAsync on it
+    AsyncResult demosaicQuadBayerAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                       bool denoise, bool postProcess, gls::mtl_image_2d<gls::pixel_float4>* outputImage,
+                                       gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage,
+                                       const std::function<void(const gls::mtl_image_2d<gls::pixel_float4>&)>& previewReady);
+
+    // Tone maps the denoised pyramid level to the progressive preview and commits the work so far,
+    // the frame's previewReady is called when the preview is complete
+    void encodeProgressivePreview(MetalContext* context, int level);
+
+    // The images of setRenditions for an output of imageSize, returned by renditionImages
+    void allocateRenditions(const gls::size& imageSize);
+    std::vector<gls::mtl_image_2d<gls::pixel_float4>*> renditionImages() const;
+
+    // The final image of a run with a downscaled output, in place of the conversion to sRGB at the raw image's size
+    void encodeDownscaledOutput(MetalContext* context, DemosaicParameters* demosaicParameters,
+                                const gls::Matrix<3, 3>& ycbcr_to_cam, gls::mtl_image_2d<gls::pixel_float4>* outputImage);
+
+    // Renders the renditions from the YCbCr pyramid levels, finest first, after the output's conversion to sRGB
+    void encodeRenditions(MetalContext* context, const std::vector<const gls::mtl_image_2d<gls::pixel_float4>*>& levels,
+                          const gls::Matrix<3, 3>& ycbcr_to_cam, const DemosaicParameters& demosaicParameters);
+
+    // Lens shading of an image processed by the pipeline, the gain map is rebuilt when the camera or the frame change
+    LensShading lensShading(const DemosaicParameters& demosaicParameters, const gls::size& imageSize);
+
+    // Shared by all the converters with the same profile
+    std::shared_ptr<const ColorProfileCache::Profile> _iccProfile;
     gls::Matrix<3, 3> _xyz_rgb;
 
-    // Kernels
+    // Kernels, the ones of the less common configurations are built on first use: packed raw input, high noise images,
+    // auto white balance, noise calibration and the preview
     scaleRawDataKernel _scaleRawData;
-    rawImageSobelKernel _rawImageSobel;
-    gaussianBlurSobelImageKernel _gaussianBlurSobelImage;
+    LazyKernel<unpackRawDataKernel> _unpackRawData;
+    rawFrontEndKernel _rawFrontEnd;
     demosaicImageKernel _demosaicImage;
-    bayerToRawRGBAKernel _bayerToRawRGBA;
-    rawRGBAToBayerKernel _rawRGBAToBayer;
-    despeckleRawRGBAImageKernel _despeckleRawRGBAImage;
-    crossDenoiseRawRGBAImageKernel _crossDenoiseRawRGBAImage;
+    LazyKernel<highNoiseRawDenoiseKernel> _highNoiseRawDenoise;
     blendHighlightsImageKernel _blendHighlightsImage;
     transformImageKernel _transformImage;
+    normalizeRGBToYCbCrKernel _normalizeRGBToYCbCr;
     convertTosRGBKernel _convertTosRGB;
+    // blendHighlights and the conversion to YCbCr of the denoiser's input, built with the first fused graph
+    std::unique_ptr<pointwiseChainKernel> _highlightsToYCbCr;
+    // The same chain in tile memory, see setTileMemoryFusion
+    std::unique_ptr<pointwiseTileChainKernel> _highlightsToYCbCrTile;
+    filmGrain _filmGrain;
     despeckleImageKernel _despeckleImage;
     histogramImageKernel _histogramImage;
-    basicRawNoiseStatisticsKernel _rawNoiseStatistics;
+    imageStatisticsKernel _imageStatistics;
+    LazyKernel<whiteBalanceKernel> _whiteBalance;
+    LazyKernel<basicRawNoiseStatisticsKernel> _rawNoiseStatistics;
+    LazyKernel<noiseStatisticsReductionKernel> _noiseStatisticsReduction;
+    LazyKernel<previewRawToYCbCrKernel> _previewRawToYCbCr;
+    LazyKernel<previewTosRGBKernel> _previewTosRGB;
+    LazyKernel<renditionTosRGBKernel> _renditionTosRGB;
+    LazyKernel<binBayerImageKernel> _binBayerImage;
+    LazyKernel<binQuadBayerKernel> _binQuadBayer;
+    LazyKernel<remosaicQuadBayerKernel> _remosaicQuadBayer;
+
+    // Per preview frame statistics, see setPreviewStatistics. A slot is busy from its frame's submission to the
+    // publication of its statistics, the frames finding their slot busy have no statistics.
+    static constexpr int kPreviewStatisticsSlots = 3;
+    struct PreviewStatisticsSlot {
+        std::unique_ptr<imageStatisticsKernel> kernel;
+        std::atomic<bool> busy = false;
+    };
+    bool _previewStatistics = false;
+    uint64_t _previewFrame = 0;
+    std::array<PreviewStatisticsSlot, kPreviewStatisticsSlots> _previewStatisticsSlots;
+    gls::spsc_ring<PreviewStatistics, 16> _previewStatisticsRing;
+
+    void encodePreviewStatistics(MetalContext* context, const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                 const DemosaicParameters& demosaicParameters, const gls::Matrix<3, 3>& cam_to_ycbcr);
+
+    LensShadingMap _lensShadingMap;
+
+    // CPU temporaries of the image being converted, see frameArena()
+    gls::FrameArena _frameArena;
 
 public:
+    // Output image of an asynchronous run, valid once done is fulfilled
+    struct AsyncResult {
+        gls::mtl_image_2d<gls::pixel_float4>* image;
+        std::shared_future<void> done;
+        // The gallery renditions written with the image, see setRenditions
+        std::vector<gls::mtl_image_2d<gls::pixel_float4>*> renditions = {};
+    };
 
-    RawConverter(NS::SharedPtr<MTL::Device> mtlDevice, const std::vector<uint8_t>* icc_profile_data = nullptr, bool calibrateFromImage = false) :
+    RawConverter(NS::SharedPtr<MTL::Device> mtlDevice, const std::vector<uint8_t>* icc_profile_data = nullptr, bool calibrateFromImage = false,
+                 const std::string& binaryArchivePath = "") :
         _calibrateFromImage(calibrateFromImage),
-        _mtlContext(mtlDevice),
+        _mtlContext(mtlDevice, binaryArchivePath),
         _rawImageSize(gls::size {0, 0}),
+        _outputImagePool(mtlDevice.get(), std::is_same<gls::pixel_float4::value_type, float>::value
+                                              ? kCVPixelFormatType_128RGBAFloat : kCVPixelFormatType_64RGBAHalf),
+        _ycbcrOutputImagePool(mtlDevice.get(), kCVPixelFormatType_420YpCbCr10BiPlanarFullRange),
+        _clippedPixels(_mtlContext.device(), 1),
         _scaleRawData(&_mtlContext),
-        _rawImageSobel(&_mtlContext),
-        _gaussianBlurSobelImage(&_mtlContext, 1.5f, 4.5f),
+        _unpackRawData(&_mtlContext),
+        _rawFrontEnd(&_mtlContext, 1.5f, 4.5f),
         _demosaicImage(&_mtlContext),
-        _bayerToRawRGBA(&_mtlContext),
-        _rawRGBAToBayer(&_mtlContext),
-        _despeckleRawRGBAImage(&_mtlContext),
-        _crossDenoiseRawRGBAImage(&_mtlContext),
+        _highNoiseRawDenoise(&_mtlContext),
         _blendHighlightsImage(&_mtlContext),
         _transformImage(&_mtlContext),
+        _normalizeRGBToYCbCr(&_mtlContext),
         _convertTosRGB(&_mtlContext),
+        _filmGrain(&_mtlContext),
         _despeckleImage(&_mtlContext),
         _histogramImage(&_mtlContext),
-        _rawNoiseStatistics(&_mtlContext)
+        _imageStatistics(&_mtlContext),
+        _whiteBalance(&_mtlContext),
+        _rawNoiseStatistics(&_mtlContext),
+        _noiseStatisticsReduction(&_mtlContext),
+        _previewRawToYCbCr(&_mtlContext),
+        _previewTosRGB(&_mtlContext),
+        _renditionTosRGB(&_mtlContext),
+        _binBayerImage(&_mtlContext),
+        _binQuadBayer(&_mtlContext),
+        _remosaicQuadBayer(&_mtlContext),
+        _lensShadingMap(_mtlContext.device())
     {
         _localToneMapping = std::make_unique<LocalToneMapping>(&_mtlContext);
 
+        // The calibration runs the noise statistics on every image
+        if (_calibrateFromImage) {
+            _rawNoiseStatistics.prefetch();
+            _noiseStatisticsReduction.prefetch();
+        }
+
         if (icc_profile_data) {
-            _icc_profile_data = std::make_unique<std::vector<uint8_t>>(*icc_profile_data);
+            _iccProfile = ColorProfileCache::shared().profile(*icc_profile_data);
 
-            _xyz_rgb = icc_profile_xyz_matrix(*_icc_profile_data);
+            _xyz_rgb = _iccProfile->xyz_rgb;
         } else {
             _xyz_rgb = xyz_sRGB;
         }
     }
 
+    // A run can be cancelled with a MetalContext::CancellationScope around it: the stages not yet encoded when the
+    // token is cancelled are skipped, the result's done future is still fulfilled
     MetalContext* context() {
         return &_mtlContext;
     }
 
+    // The CPU work of an image, calibration, white balance and registration, runs in a FrameArena::Scope of it:
+    // its containers are released together when the image is done, without reaching the heap after the first ones
+    gls::FrameArena* frameArena() {
+        return &_frameArena;
+    }
+
+    OutputImagePool* outputImagePool() {
+        return &_outputImagePool;
+    }
+
+    // 10 bit by default, setPixelFormat() selects kCVPixelFormatType_420YpCbCr8BiPlanarFullRange
+    YCbCrOutputImagePool* ycbcrOutputImagePool() {
+        return &_ycbcrOutputImagePool;
+    }
+
+    const PrecisionPolicy& precisionPolicy() const {
+        return _precisionPolicy;
+    }
+
+    // The textures are reallocated on the next run
+    void setPrecisionPolicy(const PrecisionPolicy& precisionPolicy);
+
+    const PipelinePreset& preset() const {
+        return _preset;
+    }
+
+    // Sets all the converter settings of the preset, a precision change reallocates the textures on the next run.
+    // The frames' DemosaicParameters go through preset().apply().
+    void setPreset(const PipelinePreset& preset);
+
+    bool tiledDemosaic() const {
+        return _tiledDemosaic;
+    }
+
+    void setTiledDemosaic(bool tiledDemosaic) {
+        _tiledDemosaic = tiledDemosaic;
+    }
+
+    bool untrackedHazards() const {
+        return _untrackedHazards;
+    }
+
+    // The transient textures of the demosaic graph are created untracked, the graph orders their uses with fences
+    // instead of the driver tracking them at every dispatch. Opt-in, the graph is rebuilt on the next run.
+    void setUntrackedHazards(bool untrackedHazards) {
+        _untrackedHazards = untrackedHazards;
+    }
+
+    bool pointwiseFusion() const {
+        return _pointwiseFusion;
+    }
+
+    // Consecutive pointwise stages of the demosaic graph run as one stitched kernel, their intermediate images
+    // are not written. Opt-in, the graph is rebuilt on the next run.
+    void setPointwiseFusion(bool pointwiseFusion) {
+        _pointwiseFusion = pointwiseFusion;
+    }
+
+    bool tileMemoryFusion() const {
+        return _tileMemoryFusion;
+    }
+
+    // With pointwise fusion, the fused stages run as tile dispatches in a render pass instead of a stitched kernel,
+    // on GPUs with tile shaders, see pointwiseTileChainKernel. Opt-in, the graph is rebuilt on the next run.
+    void setTileMemoryFusion(bool tileMemoryFusion) {
+        _tileMemoryFusion = tileMemoryFusion;
+    }
+
+    bool inlineHighlights() const {
+        return _inlineHighlights;
+    }
+
+    // The highlights are blended by the demosaic as it writes the linear RGB image instead of a separate pass over
+    // it, and the clipped pixels are counted on the GPU. Opt-in, the graph is rebuilt on the next run.
+    void setInlineHighlights(bool inlineHighlights) {
+        _inlineHighlights = inlineHighlights;
+    }
+
+    // Quad Bayer data (DemosaicParameters::quadBayer) goes through the standard Bayer front-end, converted on the GPU
+    enum class QuadBayerMode {
+        automatic,  // Binning with the preset's quadBayerBinning and for high noise images, remosaic otherwise
+        binning,    // The 2x2 blocks are averaged, the image is processed at half resolution, e.g. 12MP from 48MP
+        remosaic    // Full resolution Bayer data, for good light
+    };
+
+    QuadBayerMode quadBayerMode() const {
+        return _quadBayerMode;
+    }
+
+    // Regions and tiles of quad Bayer data, and the runs calibrating the noise model, are always remosaiced
+    void setQuadBayerMode(QuadBayerMode quadBayerMode) {
+        _quadBayerMode = quadBayerMode;
+    }
+
+    // The size of the images of a run on rawImageSize data, half of it for binned quad Bayer data: the output and
+    // YCbCr images given to the demosaic calls must have this size
+    gls::size processedSize(const gls::size& rawImageSize, const DemosaicParameters& demosaicParameters) const {
+        if (demosaicParameters.quadBayer && quadBayerBinning(demosaicParameters)) {
+            return { 2 * (rawImageSize.width / 4), 2 * (rawImageSize.height / 4) };
+        }
+        return rawImageSize;
+    }
+
+    // Once the GPU is done: the pixels above the clip level at the output of the last demosaic with inline
+    // highlights, zero for a frame without clipped highlights
+    uint32_t clippedPixels() const {
+        return _clippedPixels.data()[0];
+    }
+
+    bool halfResolutionGradients() const {
+        return _halfResolutionGradients;
+    }
+
+    // The raw gradients drive the demosaic and the denoising edge weights, they are smooth enough to be kept at half
+    // resolution: a quarter of the gradient writes and reads, the consumers upsample them bilinearly. The textures
+    // are reallocated on the next run.
+    void setHalfResolutionGradients(bool halfResolutionGradients);
+
+    // With an interval > 1 the denoiser reuses its PCA basis from previous runs, e.g. for video
+    void setPcaRefreshInterval(int pcaRefreshInterval) {
+        _pcaRefreshInterval = std::max(pcaRefreshInterval, 1);
+    }
+
+    // With a threshold > 0 the PCA basis is kept while it fits the image, e.g. across a burst or a video stream
+    void setPcaDriftThreshold(float pcaDriftThreshold) {
+        _pcaDriftThreshold = std::max(pcaDriftThreshold, 0.0f);
+    }
+
+    // A new scene invalidates the cached PCA basis, e.g. at the start of a burst or after a camera settings change
+    void setPcaScene(uint64_t pcaScene) {
+        _pcaScene = pcaScene;
+    }
+
+    // The smallest pyramid levels are denoised on the CPU while the GPU is busy with the rest of the frame, e.g. on
+    // devices with idle performance cores. Zero runs every level on the GPU.
+    void setCpuPyramidLevels(int cpuPyramidLevels) {
+        _cpuPyramidLevels = std::max(cpuPyramidLevels, 0);
+    }
+
+    // Evaluates the per-frame color conversion and tone curve once in lookup tables instead of per pixel, the local
+    // tone mapping and the grain stay per pixel. Off by default, the tables add a small interpolation error.
+    void setBakedColorLut(bool bakedColorLut) {
+        _bakedColorLut = bakedColorLut;
+    }
+
+    typedef convertTosRGBKernel::ExtraOutputs ExtraOutputs;
+
+    const ExtraOutputs& extraOutputs() const {
+        return _extraOutputs;
+    }
+
+    // Images written by the final color conversion in the same pass as the RGBA output of the following runs, e.g.
+    // the registration luma of a burst frame, a display copy or a thumbnail, instead of separate passes reading the
+    // output. They must match the output's size, the thumbnail ExtraOutputs::thumbnailSize(). Not written by the
+    // YCbCr output. The images are the caller's, set an empty ExtraOutputs() before releasing them.
+    void setExtraOutputs(const ExtraOutputs& extraOutputs) {
+        _extraOutputs = extraOutputs;
+    }
+
+    // Tone mapped renditions of the output of the following runs for the gallery, e.g. { 256, 1024 }: the long side
+    // of each, rendered from the denoised pyramid level of about its size with the output's tone curve and LTM mask,
+    // instead of a decode and resize of the full image. Written by the post-processed runs with noise reduction and
+    // by postprocessAsync, returned in AsyncResult::renditions in the same order. The images are the converter's,
+    // reused by the next run. Empty sizes disable them.
+    void setRenditions(const std::vector<int>& longSides) {
+        _renditionSizes = longSides;
+    }
+
+    // Motion compensated recursive temporal denoise of the following runs, e.g. for video: the history's largest
+    // weight, zero disables it. Frames of a different scene restart the recursion, see TemporalDenoiser.
+    void setTemporalDenoise(float strength, uint64_t scene = 0);
+
+    // With an interval > 1 the LTM mask reuses its low and medium frequency bands from previous runs, e.g. for video
+    void setLtmRefreshInterval(int ltmRefreshInterval) {
+        _ltmRefreshInterval = std::max(ltmRefreshInterval, 1);
+    }
+
+    // With a weight < 1 the recomputed LTM low and medium frequency bands are an exponential moving average across
+    // frames, the weight is the one of the new frame
+    void setLtmTemporalWeight(float ltmTemporalWeight) {
+        _ltmTemporalWeight = std::clamp(ltmTemporalWeight, 0.0f, 1.0f);
+    }
+
+    // A new scene invalidates the cached LTM bands, e.g. at the start of a burst or after a camera settings change
+    void setLtmScene(uint64_t ltmScene) {
+        _ltmScene = ltmScene;
+    }
+
+    // In calibrateFromImage mode the measured noise models are added to the cache, the client saves it
+    void setNoiseModelCache(NoiseModelCache* noiseModelCache) {
+        _noiseModelCache = noiseModelCache;
+    }
+
+    // Enables the combined statistics of the raw image: luma histogram, clipping, gray world and noise moments
+    void setMeasureImageStatistics(bool measureImageStatistics) {
+        _measureImageStatistics = measureImageStatistics;
+    }
+
+    // Statistics of the last frame with setMeasureImageStatistics, valid once the frame is done. The same
+    // buffer is available to the GPU consumers through imageStatisticsBuffer().
+    const imageStatisticsKernel::image_statistics* imageStatistics() const {
+        return _imageStatistics.statistics();
+    }
+
+    MTL::Buffer* imageStatisticsBuffer() const {
+        return _imageStatistics.buffer();
+    }
+
+    bool frozenHistogram() const {
+        return _frozenHistogram;
+    }
+
+    bool mipmappedLtmPyramid() const {
+        return _mipmappedLtmPyramid;
+    }
+
+    // The four levels of the LTM guide and histogram pyramid are one mipmapped texture, filled by a single resampling
+    // of the image to the first level and the hardware's mipmap generation, instead of four downsampleImageXYZ
+    // dispatches into separate textures. Falls back to the exact pyramid where the LTM precision isn't filterable.
+    void setMipmappedLtmPyramid(bool mipmappedLtmPyramid) {
+        _mipmappedLtmPyramid = mipmappedLtmPyramid;
+    }
+
+    // When frozen the histogram statistics in histogramData() are used as they are instead of being measured
+    void setFrozenHistogram(bool frozenHistogram) {
+        _frozenHistogram = frozenHistogram;
+    }
+
+    bool rerenderCache() const {
+        return _rerenderCache;
+    }
+
+    // Incremental re-rendering for tuning and re-edits: the intermediates of the last run (its denoised image,
+    // histogram and LTM guide pyramid) are kept, keyed by the raw content and by the parameters upstream of the tone
+    // mapping. A run with the same raw data and upstream parameters only redoes the LTM mask and convertTosRGB, e.g.
+    // after a change of rgbConversionParameters or ltmParameters. Only for the full pipeline with noise reduction
+    // and post-processing on the whole frame, with raw data the CPU can read: the raw content is hashed with every
+    // run. Without an outputImage the result goes to an internal texture, overwritten by the next run. A change of
+    // denoiseParameters or of the pyramid noise model reruns the graph, but the denoising pyramid only redoes the
+    // levels from the coarsest one affected, see PyramidProcessor::denoiseInputKey. Converter settings other than
+    // those of the demosaic graph are not part of the key, setting the cache again drops it.
+    void setRerenderCache(bool rerenderCache) {
+        _rerenderCache = rerenderCache;
+        _rerenderKey.reset();
+    }
+
+    // Memory budget for the intermediates kept for image sizes other than the current one
+    void setTextureCacheBudget(size_t bytes) {
+        _textureCacheBudget = bytes;
+        trimTextureCache();
+    }
+
+    // Releases memory in response to a memory warning, returns the bytes released. With MemoryPressure::warning
+    // the caches which are rebuilt on demand go: the intermediates of the cached sizes, the re-render cache, the
+    // preview textures and the idle output pixel buffers. With MemoryPressure::critical the intermediates of the
+    // current size go too, the next run reallocates them. Only while the converter is idle, see requestTrim.
+    size_t trimMemory(gls::MemoryPressure level);
+
+    // Thread-safe, the trim is applied at the start of the next run or by applyDeferredTrim, e.g. by the
+    // RawConverterPool when the converter is returned. The output pools are trimmed right away.
+    size_t requestTrim(gls::MemoryPressure level);
+
+    // Applies the pending trim, if any, only while the converter is idle
+    size_t applyDeferredTrim() {
+        const auto level = (gls::MemoryPressure) _deferredTrim.exchange((int) gls::MemoryPressure::normal);
+        return level != gls::MemoryPressure::normal ? trimMemory(level) : 0;
+    }
+
+    // Device memory held by the intermediates of the current and of the cached image sizes
+    size_t allocatedBytes() const {
+        size_t bytes = _allocatedBytes;
+        for (const auto& textures : _textureCache) {
+            bytes += textures.allocatedBytes;
+        }
+        return bytes;
+    }
+
+    // Runs the pipeline with full precision intermediates and full resolution gradients and with the current policy,
+    // returns the PSNR of the latter
+    double validatePrecision(const gls::image<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters);
+
     const std::vector<uint8_t>* icc_profile_data() const {
-        return _icc_profile_data.get();
+        return _iccProfile ? &_iccProfile->data : nullptr;
     }
 
     const gls::Matrix<3, 3>& xyz_rgb() const {
@@ -171,10 +1156,10 @@ public:
         return _histogramImage.histogramData();
     }
 
+    // With a GPUMemoryTracker budget set, intermediates exceeding it throw gls::gpu_budget_exceeded once the cached
+    // sizes have been evicted, nothing is left allocated for imageSize. Callers can then use demosaicTiled().
     void allocateTextures(const gls::size& imageSize);
 
-    void allocateHighNoiseTextures(const gls::size& imageSize);
-
     void allocateLtmImagePyramid(const gls::size& imageSize);
 
     gls::mtl_image_2d<gls::pixel_float4>* denoise(const gls::mtl_image_2d<gls::pixel_float4>& inputImage, DemosaicParameters* demosaicParameters);
@@ -182,9 +1167,662 @@ public:
     gls::mtl_image_2d<gls::pixel_float4>* demosaic(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
                                                    bool denoise = true, bool postProcess = true);
 
-    gls::mtl_image_2d<gls::pixel_float4>* postprocess(gls::image<gls::pixel_float4>& rgbImage, DemosaicParameters* demosaicParameters);
+    gls::mtl_image_2d<gls::pixel_float4>* postprocess(const gls::image<gls::pixel_float4>& rgbImage, DemosaicParameters* demosaicParameters);
+
+    // Submit the pipeline without waiting for the GPU, rawImage/rgbImage can be released as soon as these return.
+    // With postProcess the final image is written to outputImage if given (e.g. from the outputImagePool()),
+    // otherwise to an internal texture which is overwritten by the next run.
+    AsyncResult demosaicAsync(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                              bool denoise = true, bool postProcess = true,
+                              gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    // Raw data at its sensor bit depth, e.g. 12 or 14 bit DNG strips: only the packed bytes are copied, the samples
+    // are unpacked on the GPU. rawImage.data can be released as soon as this returns.
+    AsyncResult demosaicAsync(const PackedRawImage& rawImage, DemosaicParameters* demosaicParameters,
+                              bool denoise = true, bool postProcess = true,
+                              gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    // Raw data loaded straight into a GPU buffer by DNGIOLoader: the GPU work waits for the load and unpacks the
+    // payload in place, nothing is copied. rawImage must stay alive until the result is done, check
+    // rawImage.failed() then.
+    AsyncResult demosaicAsync(const StreamedRawImage& rawImage, DemosaicParameters* demosaicParameters,
+                              bool denoise = true, bool postProcess = true,
+                              gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    // Zero-copy variants taking the raw data already in a Metal texture, e.g. a gls::mtl_pixel_buffer_image_2d
+    // wrapping the camera CVPixelBuffer. rawImage must be CPU mappable and stay alive until the result is done.
+    AsyncResult demosaicAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                              bool denoise = true, bool postProcess = true,
+                              gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    gls::mtl_image_2d<gls::pixel_float4>* demosaic(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                                   bool denoise = true, bool postProcess = true);
+
+    // Post processed output written directly to a full range 4:2:0 YCbCr pixel buffer (e.g. from the
+    // ycbcrOutputImagePool()) for the HEVC encoders, a quarter of the RGBA output bandwidth. The result's image
+    // is an internal texture, the output is in ycbcrImage once done.
+    AsyncResult demosaicToYCbCrAsync(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                     bool denoise, gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage);
+
+    AsyncResult demosaicToYCbCrAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                     bool denoise, gls::mtl_pixel_buffer_ycbcr_420_image* ycbcrImage);
+
+    AsyncResult postprocessAsync(const gls::image<gls::pixel_float4>& rgbImage, DemosaicParameters* demosaicParameters);
+
+    // How demosaicToSizeAsync renders an output smaller than the raw image
+    enum class OutputStrategy {
+        fullResolution,     // Output of the raw image's size, the regular pipeline
+        fusedDownscale,     // Denoised at full resolution, the final color conversion samples the pyramid level of
+                            // about the output's size, the full resolution image is never converted
+        binnedDownscale     // As fusedDownscale from the 2x2 binned raw data, every stage runs at a quarter of the pixels
+    };
+
+    // Demosaicing resolves about three quarters of the image's pixel pitch: the half resolution binned data still has
+    // all the detail of outputs up to 3/8 of the raw image's long side. The noise calibration needs the full data.
+    static OutputStrategy outputStrategy(const gls::size& rawImageSize, int outputLongSide, bool calibrateFromImage = false) {
+        const int rawLongSide = std::max(rawImageSize.width, rawImageSize.height);
+        if (outputLongSide >= rawLongSide) {
+            return OutputStrategy::fullResolution;
+        }
+        if (!calibrateFromImage && 8 * outputLongSide <= 3 * rawLongSide) {
+            return OutputStrategy::binnedDownscale;
+        }
+        return OutputStrategy::fusedDownscale;
+    }
+
+    // Exports at a reduced size, e.g. 2048 or 3840 pixels on the long side: the post-processed and denoised image with
+    // the given long side (at most the raw image's, see setRenditions for the rounding), rendered with the cheapest
+    // OutputStrategy instead of a full resolution run and a resize. The downscaled output has the tone curve and LTM of
+    // the full one, without the film grain, the color LUT and the extra outputs. The renditions of setRenditions are
+    // of the processed size. The result's image is the converter's, reused by the next run.
+    AsyncResult demosaicToSizeAsync(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                    int outputLongSide);
+
+    // rawImage must be CPU mappable and stay alive until the result is done
+    AsyncResult demosaicToSizeAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                    int outputLongSide);
+
+    // Pyramid level of the progressive preview, 1/8 of the image size, coarser if fewer levels are denoised
+    static constexpr int kProgressivePreviewLevel = 3;
+
+    typedef std::function<void(const gls::mtl_image_2d<gls::pixel_float4>& preview)> preview_callback_type;
+
+    // Progressive capture: the full pipeline as demosaicAsync, with an early preview from the coarse pyramid levels.
+    // The command buffer is committed as soon as the kProgressivePreviewLevel level is denoised and tone mapped, and
+    // previewReady is called from its completion handler with the CPU-visible sRGB preview, long before the finer
+    // levels, LTM and post-processing are done. The preview uses the fixed levels of previewAsync and no LTM. It is an
+    // internal texture reused by the next run, previewReady has to copy it before returning. Without noise reduction
+    // there is no pyramid and no preview.
+    AsyncResult demosaicProgressiveAsync(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                         const preview_callback_type& previewReady,
+                                         gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    AsyncResult demosaicProgressiveAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                         const preview_callback_type& previewReady,
+                                         gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    // Post-processing overlapped with the production of the image in bands of rows, e.g. by a neural network running
+    // on the Neural Engine. The producer writes the linear RGB image to the texture returned by
+    // beginStreamingPostprocess and reports its progress with streamingRowsAvailable, which queues the post-processing
+    // of every band of bandHeight rows as soon as the band and its tileHalo() rows are in. The histogram and levels come
+    // from a 4x4 binned pre-pass over rawImage, as for demosaicRegion. The producer's GPU work must be complete or on
+    // this converter's context() when it reports its rows. endStreamingPostprocess processes the remaining bands.
+    gls::mtl_image_2d<gls::pixel_float4>* beginStreamingPostprocess(const gls::image<gls::luma_pixel_16>& rawImage,
+                                                                   DemosaicParameters* demosaicParameters, int bandHeight);
+
+    void streamingRowsAvailable(int rows);
+
+    AsyncResult endStreamingPostprocess();
+
+    // Multi-frame fusion in the denoising pyramid: each frame of a burst is demosaiced, registered to the first frame
+    // of the burst and accumulated into the pyramid's fusion buffers without waiting for the GPU. The homography maps
+    // the first frame's pixel coordinates to the frame's. demosaicFused denoises and post-processes the fused frames
+    // once and starts a new burst.
+    void fuseFrame(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                   const gls::Matrix<3, 3>& homography);
+
+    // rawImage must stay alive until the GPU is done with the frame
+    void fuseFrame(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                   const gls::Matrix<3, 3>& homography);
+
+    gls::mtl_image_2d<gls::pixel_float4>* demosaicFused(DemosaicParameters* demosaicParameters, bool postProcess = true);
+
+    void allocatePreviewTextures(const gls::size& imageSize);
+
+    // Low latency viewfinder pipeline producing a half resolution image: 2x2 binning of the raw data, a single
+    // despeckling level instead of the pyramid denoiser and a color conversion fused with the tone curve.
+    // The result is written to outputImage if given, otherwise to an internal texture reused by the next frame.
+    // It runs on the interactive lane of the context, it doesn't wait behind the converter's other work in flight.
+    AsyncResult previewAsync(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters,
+                             gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    AsyncResult previewAsync(const gls::image<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters,
+                             gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    // With preview statistics every preview frame also measures the raw clipping, the luma histogram and the gray
+    // world white balance of its raw data on the GPU, in the same batch. They are published once the frame is done
+    // to a lock-free ring, e.g. for a manual exposure mode to drive the exposure from the viewfinder frames without
+    // a CPU analysis of the video frames. The ring has a single consumer, when it is full new statistics are dropped.
+    void setPreviewStatistics(bool previewStatistics) {
+        _previewStatistics = previewStatistics;
+    }
+
+    bool previewStatistics() const {
+        return _previewStatistics;
+    }
+
+    // Oldest unread statistics, never blocks
+    std::optional<PreviewStatistics> nextPreviewStatistics() {
+        return _previewStatisticsRing.pop();
+    }
+
+    // Newest statistics, the older unread ones are dropped
+    std::optional<PreviewStatistics> latestPreviewStatistics() {
+        return _previewStatisticsRing.latest();
+    }
+
+    // Halo around each tile in tiled mode, covering the support of the pyramid denoiser (block matching radius at the
+    // coarsest level), of the LTM guided filter at 1/16 resolution and of the raw front-end and demosaic stages
+    static constexpr int kBlockMatchingRadius = 10;     // blockMatchingDenoiseImage
+    static constexpr int kGuidedFilterRadius = 4;       // Guided filter + a/b box filter, default LTMParameters::radius
+    static constexpr int kRawStagesHalo = 16;           // rawFrontEnd + demosaic
+    static constexpr int tileHalo() {
+        constexpr int coarsestScale = 1 << 4;
+        constexpr int halo = kRawStagesHalo + coarsestScale * std::max(kBlockMatchingRadius + 2, kGuidedFilterRadius);
+        // Align to the coarsest pyramid level
+        return 2 * coarsestScale * ((halo + 2 * coarsestScale - 1) / (2 * coarsestScale));
+    }
+
+    typedef std::function<void(const gls::image<gls::pixel_float4>& tile, int x, int y)> tile_output_type;
+
+    // Out-of-core processing of images too large for a full resolution working set: the image is processed as
+    // overlapping tiles of tileSize pixels plus a tileHalo() margin through a single tile-sized set of intermediates.
+    // The global statistics (histogram, black and white levels) come from a 2x2 binned pre-pass. Every tile's
+    // interior is handed to tileOutput with its position, the tile image is only valid during the call.
+    void demosaicTiled(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                       int tileSize, const tile_output_type& tileOutput);
+
+    // Region of interest processing, e.g. for crops and digital zoom: the pipeline only runs on roi plus a tileHalo()
+    // margin. The global statistics come from a 4x4 binned pre-pass over the whole frame, so the exposure of the
+    // crop matches that of the full image. The roi image is handed to regionOutput, it is only valid during the call.
+    void demosaicRegion(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                        const gls::rectangle& roi, const tile_output_type& regionOutput, bool denoise = true);
 
     RawNLF MeasureRawNLF(float exposure_multiplier, BayerPattern bayerPattern);
+
+    // GPU implementation of autoWhiteBalance, waits for the result
+    gls::Vector<3> autoWhiteBalance(const gls::image<gls::luma_pixel_16>& rawImage, const gls::Matrix<3, 3>& rgb_ycbcr,
+                                    const gls::Vector<4>& scale_mul, float white, float black, BayerPattern bayerPattern,
+                                    float* highlights = nullptr);
+
+    // autoWhiteBalance as an unpackDNGMetadata argument
+    AutoWhiteBalanceFunction autoWhiteBalanceFunction() {
+        return [this](const gls::image<gls::luma_pixel_16>& rawImage, const gls::Matrix<3, 3>& rgb_ycbcr,
+                      const gls::Vector<4>& scale_mul, float white, float black, BayerPattern bayerPattern, float* highlights) {
+            return autoWhiteBalance(rawImage, rgb_ycbcr, scale_mul, white, black, bayerPattern, highlights);
+        };
+    }
+
+private:
+    // Post-processing of the image in _linearRGBImageA, the result overwrites it
+    void encodePostprocess(const gls::size& imageSize, DemosaicParameters* demosaicParameters);
+
+    // Histogram statistics from a binned version of the image, for the runs on its regions with a frozen histogram
+    void measureGlobalStatistics(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                 int binning);
+
+    // Runs the pipeline on a region of rawImage, which must start and end at even coordinates
+    AsyncResult demosaicRegionAsync(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                    const gls::rectangle& region, bool denoise = true);
+};
+
+// Pipelined conversion of frame sequences (bursts, batch processing): each frame slot is a RawConverter with its
+// own intermediates and command queue, so the CPU side of frame N+1 (parameter setup, upload, encoding) overlaps
+// the GPU work of frame N. A frame's result stays valid until as many frames as there are slots have been submitted.
+class PipelinedRawConverter {
+    std::vector<std::unique_ptr<RawConverter>> _slots;
+    std::vector<std::shared_future<void>> _inFlight;
+    int _nextSlot = 0;
+
+public:
+    PipelinedRawConverter(NS::SharedPtr<MTL::Device> mtlDevice, int slotCount = 2,
+                          const std::vector<uint8_t>* icc_profile_data = nullptr, bool calibrateFromImage = false,
+                          const std::string& binaryArchivePath = "");
+
+    int slotCount() const {
+        return (int) _slots.size();
+    }
+
+    // All slots share the same configuration, e.g. for xyz_rgb() and icc_profile_data()
+    RawConverter* converter(int slot = 0) {
+        return _slots[slot].get();
+    }
+
+    // The slot used by the next submit(), e.g. to access its histogramData() once the result is done
+    int nextSlot() const {
+        return _nextSlot;
+    }
+
+    // Waits for the previous frame of the next slot, its intermediates and output are about to be reused by the
+    // next submit(). The converter can be configured before submitting.
+    RawConverter* acquireSlot();
+
+    RawConverter::AsyncResult submit(const gls::image<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                     bool denoise = true, bool postProcess = true,
+                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    RawConverter::AsyncResult submit(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage, DemosaicParameters* demosaicParameters,
+                                     bool denoise = true, bool postProcess = true,
+                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    void waitForCompletion();
+};
+
+// Continuous processing of a stream of raw frames with the same capture settings, e.g. video. The frames overlap
+// on the GPU across the slots of a PipelinedRawConverter and the intermediates of each slot stay resident. The
+// demosaic parameters (noise model, color conversion) are unpacked once for the stream, the histogram
+// statistics driving the tone curve and the local tone mapping are measured every statisticsInterval frames and
+// smoothed over time, the frames in between use them as they are. The denoiser's PCA basis is rebuilt at the
+// same interval.
+class StreamingRawConverter {
+public:
+    struct Statistics {
+        int frames;                 // Frames completed
+        double fps;                 // Sustained frame rate over the last kTimingWindow frames
+        double meanFrameTime;       // ms
+        double frameTimeJitter;     // Standard deviation of the frame time, ms
+        double maxFrameTime;        // ms
+    };
+
+    static constexpr int kTimingWindow = 120;
+    // The denoiser's PCA basis is rebuilt when it loses 2% of the variance it captured
+    static constexpr float kPcaDriftThreshold = 0.02;
+
+private:
+    typedef histogramImageKernel::histogram_data histogram_data;
+    typedef std::chrono::steady_clock clock;
+
+    PipelinedRawConverter _pipeline;
+    DemosaicParameters _parameters;
+    // The pipeline updates the parameters, each in-flight frame has its own copy
+    std::vector<DemosaicParameters> _frameParameters;
+    bool _noiseReduction;
+    const int _statisticsInterval;
+    int _frameIndex = 0;
+    uint64_t _scene = 0;
+    float _temporalDenoise = 0;
+
+    std::optional<histogram_data> _statistics;
+    // Frame measuring the statistics, harvested once it's done
+    int _statisticsSlot = -1;
+    std::shared_future<void> _statisticsDone;
+
+    mutable std::mutex _timingMutex;
+    std::deque<clock::time_point> _completionTimes;
+    int _completedFrames = 0;
+
+    void harvestStatistics(int slot);
+    void prepareSlot(int slot, RawConverter* converter);
+    void frameSubmitted(int slot, RawConverter* converter, const RawConverter::AsyncResult& result, bool measuresStatistics);
+
+public:
+    StreamingRawConverter(NS::SharedPtr<MTL::Device> mtlDevice, const DemosaicParameters& demosaicParameters,
+                          bool noiseReduction = true, int slotCount = 3, int statisticsInterval = 8,
+                          const std::vector<uint8_t>* icc_profile_data = nullptr, const std::string& binaryArchivePath = "");
+
+    ~StreamingRawConverter();
+
+    RawConverter* converter(int slot = 0) {
+        return _pipeline.converter(slot);
+    }
+
+    // New capture settings, e.g. an ISO change: frames submitted from now on use them and remeasure the statistics
+    void setParameters(const DemosaicParameters& demosaicParameters);
+
+    // Recursive temporal denoise of the frames, see RawConverter::setTemporalDenoise. Each slot filters against its
+    // own previous frame, slotCount frames earlier: the motion estimate covers the gap, at the price of more rejected
+    // history on fast motion than with a single slot. New capture settings restart the recursion.
+    void setTemporalDenoise(float strength);
+
+    // The result image is valid until slotCount frames later, unless outputImage is given
+    RawConverter::AsyncResult submit(const gls::image<gls::luma_pixel_16>& rawImage,
+                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    RawConverter::AsyncResult submit(const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                     gls::mtl_image_2d<gls::pixel_float4>* outputImage = nullptr);
+
+    Statistics statistics() const;
+
+    void waitForCompletion();
+};
+
+// Pool of RawConverter instances shared by concurrent clients (e.g. captures processed from separate tasks).
+// Each client leases a converter for the duration of a run: up to maxInstances converters are created while their
+// combined intermediates fit in memoryBudget, beyond that clients queue and are served in arrival order.
+class RawConverterPool {
+public:
+    typedef std::function<std::unique_ptr<RawConverter>()> factory_type;
+
+    // Exclusive use of a converter, returned to the pool when the lease goes out of scope
+    class Lease {
+        RawConverterPool* _pool;
+        RawConverter* _converter;
+
+    public:
+        Lease(RawConverterPool* pool, RawConverter* converter) : _pool(pool), _converter(converter) { }
+
+        Lease(Lease&& other) : _pool(other._pool), _converter(other._converter) {
+            other._converter = nullptr;
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease() {
+            if (_converter) {
+                _pool->checkin(_converter);
+            }
+        }
+
+        RawConverter* operator->() const {
+            return _converter;
+        }
+
+        RawConverter* get() const {
+            return _converter;
+        }
+    };
+
+private:
+    const factory_type _factory;
+    int _maxInstances;
+    size_t _memoryBudget;
+
+    std::vector<std::unique_ptr<RawConverter>> _converters;
+    std::vector<RawConverter*> _available;
+
+    // FIFO ticketing of the waiting clients
+    uint64_t _nextTicket = 0;
+    uint64_t _servingTicket = 0;
+    int _creating = 0;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _returned;
+
+    // Last member: unregistered before the rest of the pool goes
+    gls::MemoryPressureResponder::Registration _memoryPressure;
+
+    // The idle converters are trimmed right away, the leased ones when they are returned
+    size_t trimMemory(gls::MemoryPressure level) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        size_t released = 0;
+        for (const auto& converter : _converters) {
+            released += converter->requestTrim(level);
+        }
+        for (auto converter : _available) {
+            released += converter->applyDeferredTrim();
+        }
+        return released;
+    }
+
+    bool canGrow() const {
+        if (_converters.empty() && _creating == 0) {
+            return true;
+        }
+        if ((int) _converters.size() + _creating >= _maxInstances) {
+            return false;
+        }
+        // Assume a new instance will need as much memory as the largest existing one
+        size_t allocatedBytes = 0, largestBytes = 0;
+        for (const auto& converter : _converters) {
+            allocatedBytes += converter->allocatedBytes();
+            largestBytes = std::max(largestBytes, converter->allocatedBytes());
+        }
+        return allocatedBytes + largestBytes <= _memoryBudget;
+    }
+
+    void checkin(RawConverter* converter) {
+        converter->applyDeferredTrim();
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _available.push_back(converter);
+        }
+        _returned.notify_all();
+    }
+
+public:
+    RawConverterPool(factory_type factory, int maxInstances = 2, size_t memoryBudget = 2048ull * 1024 * 1024) :
+        _factory(factory), _maxInstances(std::max(maxInstances, 1)), _memoryBudget(memoryBudget),
+        _memoryPressure(gls::MemoryPressureResponder::shared().add("RawConverterPool", /*priority=*/ 0,
+                                                                   [this](gls::MemoryPressure level) {
+            return trimMemory(level);
+        })) { }
+
+    // Takes effect for the following checkouts, existing instances are kept
+    void setLimits(int maxInstances, size_t memoryBudget) {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _maxInstances = std::max(maxInstances, 1);
+            _memoryBudget = memoryBudget;
+        }
+        _returned.notify_all();
+    }
+
+    // Blocks until a converter is available
+    Lease checkout() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const uint64_t ticket = _nextTicket++;
+        _returned.wait(lock, [&]() {
+            return ticket == _servingTicket && (!_available.empty() || canGrow());
+        });
+        _servingTicket++;
+
+        if (!_available.empty()) {
+            RawConverter* converter = _available.back();
+            _available.pop_back();
+            lock.unlock();
+
+            // Let the next client in line check its turn
+            _returned.notify_all();
+            return Lease(this, converter);
+        }
+
+        // Build the new instance (compiling its kernels) without holding up the other clients
+        _creating++;
+        lock.unlock();
+        _returned.notify_all();
+
+        auto newConverter = _factory();
+        RawConverter* converter = newConverter.get();
+
+        lock.lock();
+        _converters.push_back(std::move(newConverter));
+        _creating--;
+        return Lease(this, converter);
+    }
+
+    // Visits every instance, e.g. to return an output buffer to the pool of the converter that produced it.
+    // The visitor must not use converters leased by other clients for anything but thread-safe calls.
+    void forEach(const std::function<void(RawConverter*)>& visitor) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& converter : _converters) {
+            visitor(converter.get());
+        }
+    }
+};
+
+// Batch processing across all the GPUs of a host, e.g. a Mac Pro: a RawConverterPool per Metal device, each checkout
+// goes to the least loaded device, the one with the lowest expected completion time of its jobs in flight given its
+// measured throughput. The pipeline states are in the process-wide pipelineStateCache, keyed by device, the tone and
+// color profiles in ColorProfileCache. If a NoiseModelCache is given all the converters share it, so a noise model
+// calibrated on one device serves the others. Binary archives are device-specific: the factory should give each
+// device its own path, see deviceName().
+class MultiDeviceRawConverterPool {
+public:
+    typedef std::function<std::unique_ptr<RawConverter>(NS::SharedPtr<MTL::Device> device)> factory_type;
+
+    struct DeviceStatistics {
+        std::string name;
+        int jobs;                   // Completed
+        int inFlight;
+        double busyTime;            // Total lease time of the completed jobs, s
+        double imagesPerMinute;     // Completed jobs over the time since the first checkout
+    };
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Device {
+        NS::SharedPtr<MTL::Device> device;
+        std::unique_ptr<RawConverterPool> pool;
+        int inFlight = 0;
+        int jobs = 0;
+        double busyTime = 0;
+    };
+
+    std::vector<std::unique_ptr<Device>> _devices;
+    std::optional<clock::time_point> _start;
+    mutable std::mutex _mutex;
+
+    // Without measurements all devices are assumed to be equally fast
+    double meanJobTime(const Device& device) const {
+        return device.jobs > 0 ? device.busyTime / device.jobs : 1;
+    }
+
+    int leastLoadedDevice() const {
+        int best = 0;
+        double bestTime = std::numeric_limits<double>::max();
+        for (int i = 0; i < (int) _devices.size(); i++) {
+            const auto& device = *_devices[i];
+            const double expectedTime = (device.inFlight + 1) * meanJobTime(device);
+            if (expectedTime < bestTime) {
+                best = i;
+                bestTime = expectedTime;
+            }
+        }
+        return best;
+    }
+
+    void jobDone(int device, double elapsedTime) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        auto& d = *_devices[device];
+        d.inFlight--;
+        d.jobs++;
+        d.busyTime += elapsedTime;
+    }
+
+public:
+    // A converter of one of the devices, returned to its pool and accounted when the lease goes out of scope
+    class Lease {
+        MultiDeviceRawConverterPool* _pool;
+        int _device;
+        RawConverterPool::Lease _lease;
+        clock::time_point _start;
+
+    public:
+        Lease(MultiDeviceRawConverterPool* pool, int device, RawConverterPool::Lease&& lease) :
+            _pool(pool), _device(device), _lease(std::move(lease)), _start(clock::now()) { }
+
+        Lease(Lease&& other) : _pool(other._pool), _device(other._device), _lease(std::move(other._lease)), _start(other._start) {
+            other._pool = nullptr;
+        }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        ~Lease() {
+            if (_pool) {
+                _pool->jobDone(_device, std::chrono::duration<double>(clock::now() - _start).count());
+            }
+        }
+
+        RawConverter* operator->() const {
+            return _lease.get();
+        }
+
+        RawConverter* get() const {
+            return _lease.get();
+        }
+
+        int device() const {
+            return _device;
+        }
+    };
+
+    // Up to maxInstancesPerDevice converters per device, each device's pool within memoryBudgetPerDevice
+    MultiDeviceRawConverterPool(const std::vector<NS::SharedPtr<MTL::Device>>& devices, factory_type factory,
+                                NoiseModelCache* noiseModelCache = nullptr, int maxInstancesPerDevice = 2,
+                                size_t memoryBudgetPerDevice = 2048ull * 1024 * 1024) {
+        if (devices.empty()) {
+            throw std::runtime_error("MultiDeviceRawConverterPool: no Metal devices");
+        }
+        for (const auto& mtlDevice : devices) {
+            auto device = std::make_unique<Device>();
+            device->device = mtlDevice;
+            device->pool = std::make_unique<RawConverterPool>([factory, mtlDevice, noiseModelCache]() {
+                auto converter = factory(mtlDevice);
+                if (noiseModelCache) {
+                    converter->setNoiseModelCache(noiseModelCache);
+                }
+                return converter;
+            }, maxInstancesPerDevice, memoryBudgetPerDevice);
+            _devices.push_back(std::move(device));
+        }
+    }
+
+    // All the Metal devices of the host
+    static std::vector<NS::SharedPtr<MTL::Device>> allDevices() {
+        std::vector<NS::SharedPtr<MTL::Device>> devices;
+        auto allMetalDevices = NS::TransferPtr(MTL::CopyAllDevices());
+        for (NS::UInteger i = 0; i < allMetalDevices->count(); i++) {
+            devices.push_back(NS::RetainPtr(allMetalDevices->object<MTL::Device>(i)));
+        }
+        return devices;
+    }
+
+    static std::string deviceName(MTL::Device* device) {
+        return device->name()->utf8String();
+    }
+
+    int deviceCount() const {
+        return (int) _devices.size();
+    }
+
+    // Blocks while all the converters of the chosen device are in flight
+    Lease checkout() {
+        int device;
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            if (!_start) {
+                _start = clock::now();
+            }
+            device = leastLoadedDevice();
+            _devices[device]->inFlight++;
+        }
+        return Lease(this, device, _devices[device]->pool->checkout());
+    }
+
+    std::vector<DeviceStatistics> statistics() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        const double elapsedTime = _start ? std::chrono::duration<double>(clock::now() - *_start).count() : 0;
+
+        std::vector<DeviceStatistics> statistics;
+        for (const auto& device : _devices) {
+            statistics.push_back({
+                deviceName(device->device.get()), device->jobs, device->inFlight, device->busyTime,
+                elapsedTime > 0 ? 60 * device->jobs / elapsedTime : 0
+            });
+        }
+        return statistics;
+    }
+
+    void printStatistics(std::ostream& os = std::cout) const {
+        for (const auto& device : statistics()) {
+            os << device.name << ": " << device.jobs << " images, " << std::setprecision(1) << std::fixed
+               << device.imagesPerMinute << " images/minute, "
+               << (device.jobs > 0 ? device.busyTime / device.jobs : 0) << "s per image" << std::endl;
+        }
+    }
 };
 
 #endif /* raw_converter_hpp */
@@ -0,0 +1,168 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef thermal_scheduler_hpp
+#define thermal_scheduler_hpp
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <optional>
+
+#include <Foundation/NSProcessInfo.hpp>
+#include "raw_converter.hpp"
+
+namespace gls {
+
+// Degradation strategy of the capture pipeline under thermal throttling. On sustained burst shooting the device
+// throttles and full quality runs take several times longer: each conversion gets a quality step from the thermal
+// state, raised further while the measured capture latency exceeds its target, and lowered again once the latency
+// has stayed well below it for a few runs. The steps trade the precision, the demosaic and the pyramid depth:
+//
+//   0: balanced preset
+//   1: balanced, 4 pyramid levels
+//   2: fast preset (fp16 and single pass tiled demosaic, capped PCA)
+//   3: fast, 3 pyramid levels
+//
+// The background burst fusion is deferred from the serious thermal state on, or while the captures are behind their
+// latency target. Every decision is logged, for the field analysis of throttled sessions. Thread-safe.
+class ThermalScheduler {
+public:
+    static constexpr int kMaxStep = 3;
+
+    struct Decision {
+        NS::ProcessInfoThermalState thermalState;
+        int thermalStep;    // From the thermal state alone
+        int step;           // With the latency correction
+        PipelinePreset::Name presetName;
+        int pyramidLevels;
+        bool deferBackgroundFusion;
+
+        bool operator==(const Decision& other) const = default;
+    };
+
+private:
+    const double _latencyTarget;
+    // Consecutive runs below the lowering threshold
+    static constexpr int kRecoveryRuns = 5;
+    static constexpr double kRecoveryFraction = 0.6;
+
+    mutable std::mutex _mutex;
+    int _latencySteps = 0;
+    int _fastRuns = 0;
+    bool _behind = false;
+    std::optional<Decision> _lastDecision;
+
+    static int thermalStep(NS::ProcessInfoThermalState thermalState) {
+        switch (thermalState) {
+            case NS::ProcessInfoThermalStateNominal: return 0;
+            case NS::ProcessInfoThermalStateFair: return 1;
+            case NS::ProcessInfoThermalStateSerious: return 2;
+            case NS::ProcessInfoThermalStateCritical: return 3;
+        }
+        return 0;
+    }
+
+    static const char* thermalStateString(NS::ProcessInfoThermalState thermalState) {
+        static const char* names[] = { "nominal", "fair", "serious", "critical" };
+        return names[std::clamp((int) thermalState, 0, 3)];
+    }
+
+    // Called with _mutex held
+    Decision decision(NS::ProcessInfoThermalState thermalState) const {
+        const int base = thermalStep(thermalState);
+        const int step = std::min(base + _latencySteps, kMaxStep);
+        return {
+            thermalState, base, step,
+            step >= 2 ? PipelinePreset::fast : PipelinePreset::balanced,
+            step == 0 ? 5 : step == 3 ? 3 : 4,
+            thermalState >= NS::ProcessInfoThermalStateSerious || _behind
+        };
+    }
+
+    // Called with _mutex held
+    void log(const Decision& d, const char* reason) {
+        std::cout << "ThermalScheduler: " << reason << ", thermal state " << thermalStateString(d.thermalState)
+                  << ", step " << d.step << " (thermal " << d.thermalStep << ", latency " << _latencySteps << "), "
+                  << PipelinePreset::nameString(d.presetName) << " preset, " << d.pyramidLevels << " pyramid levels"
+                  << (d.deferBackgroundFusion ? ", background fusion deferred" : "") << std::endl;
+    }
+
+public:
+    // Capture to result latency target in seconds
+    ThermalScheduler(double latencyTarget = 1.5) : _latencyTarget(latencyTarget) { }
+
+    static NS::ProcessInfoThermalState currentThermalState() {
+        return NS::ProcessInfo::processInfo()->thermalState();
+    }
+
+    // The configuration of the next conversion
+    Decision decide(NS::ProcessInfoThermalState thermalState = currentThermalState()) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        const auto d = decision(thermalState);
+        log(d, _lastDecision && *_lastDecision == d ? "decision" : "new decision");
+        _lastDecision = d;
+        return d;
+    }
+
+    // The preset of the decision, the converter is only reconfigured when it changes: a precision change reallocates
+    // its textures. The preset's limits apply to the frame's parameters.
+    static void apply(const Decision& d, RawConverter* rawConverter, DemosaicParameters* demosaicParameters) {
+        auto preset = PipelinePreset::named(d.presetName);
+        preset.pyramidLevels = std::min(preset.pyramidLevels, d.pyramidLevels);
+
+        const auto& current = rawConverter->preset();
+        if (current.name != preset.name || current.pyramidLevels != preset.pyramidLevels) {
+            rawConverter->setPreset(preset);
+        }
+        if (demosaicParameters) {
+            preset.apply(demosaicParameters);
+        }
+    }
+
+    // Latency of a completed conversion in seconds, drives the latency correction of the following decisions
+    void reportLatency(double seconds) {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _behind = seconds > _latencyTarget;
+        if (_behind) {
+            _fastRuns = 0;
+            if (_latencySteps < kMaxStep) {
+                _latencySteps++;
+                std::cout << "ThermalScheduler: latency " << seconds << "s over the " << _latencyTarget
+                          << "s target, stepping down" << std::endl;
+            }
+        } else if (seconds < kRecoveryFraction * _latencyTarget && _latencySteps > 0 && ++_fastRuns >= kRecoveryRuns) {
+            _fastRuns = 0;
+            _latencySteps--;
+            std::cout << "ThermalScheduler: latency " << seconds << "s, stepping up" << std::endl;
+        }
+    }
+
+    // E.g. for the scheduling of the background work, from the current thermal state
+    bool deferBackgroundFusion(NS::ProcessInfoThermalState thermalState = currentThermalState()) const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return decision(thermalState).deferBackgroundFusion;
+    }
+
+    std::optional<Decision> lastDecision() const {
+        std::lock_guard<std::mutex> guard(_mutex);
+        return _lastDecision;
+    }
+};
+
+}  // namespace gls
+
+#endif /* thermal_scheduler_hpp */
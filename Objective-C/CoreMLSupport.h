@@ -16,6 +16,15 @@
 #ifndef CoreMLSupport_h
 #define CoreMLSupport_h
 
+// Output rows and columns of a model tile, without its padding
+constexpr int fmenTileCoreSize = 1072 - 2 * 32;
+
 void fmenApplyToImage(const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel, gls::image<gls::pixel_fp16_4>* processedImage);
 
+// Streaming variant for RawConverter::beginStreamingPostprocess: the tiles are inferred a row of tiles at a time and
+// unpacked into outputImage on context, rowsDone is called with the output rows completed so far. Returns false when
+// the model is not available.
+bool fmenApplyToImage(MetalContext* context, const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel,
+                      gls::mtl_image_2d<gls::pixel_float4>* outputImage, const std::function<void(int rows)>& rowsDone);
+
 #endif /* CoreMLSupport_h */
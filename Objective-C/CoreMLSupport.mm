@@ -16,73 +16,247 @@
 #import <Foundation/Foundation.h>
 #import <CoreImage/CoreImage.h>
 
+#include <functional>
+
 #include "float16.hpp"
 #include "gls_image.hpp"
+#include "gls_mtl.hpp"
+#include "gls_mtl_image.hpp"
+#include "demosaic_kernels.hpp"
+
+#include "CoreMLSupport.h"
 
 //#define USE_FEMN_MODEL true
 
 #ifdef USE_FEMN_MODEL
+#import <CoreML/CoreML.h>
 #import "FMEN.h"
+
+#include <mutex>
 #endif
 
-void fmenApplyToImageFullRes(const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel, gls::image<gls::pixel_fp16_4>* processedImage) {
 #ifdef USE_FEMN_MODEL
-    assert(rawImage.width == 4032 && rawImage.height == 3024);
+// FMEN state kept across calls: the model, the Metal context and the layout conversion kernels, the Metal buffers
+// backing the model's input arrays and the staging buffers of its outputs. The image is tiled in cores of kTileCore
+// pixels, every tile padded by kTilePadding pixels on each side.
+class FMENTiler {
+public:
+    static constexpr int kTileSize = 1072;
+    static constexpr int kTilePadding = 32;
+    static constexpr int kTileCore = kTileSize - 2 * kTilePadding;
+    static_assert(kTileCore == fmenTileCoreSize);
 
-    const int fmen_tile_pixels = rawImage.width * rawImage.height;
+private:
+    FMEN* _fmen;
+    MetalContext _context;
+    imageToTensorKernel _imageToTensor;
+    tensorToImageKernel _tensorToImage;
 
-    @autoreleasepool {
-        // Allocate FMEN model
-        FMEN* fmen = [[FMEN alloc] init];
+    std::vector<std::unique_ptr<gls::Buffer<float>>> _inputTiles;
+    NSMutableArray<MLMultiArray*>* _inputArrays;
+    std::vector<std::unique_ptr<gls::Buffer<float>>> _outputTiles;
 
-        // Counting out time
-        auto t_fmen_start = std::chrono::high_resolution_clock::now();
+    // Float32 NCHW array aliasing the tensor's memory, which must outlive it
+    static MLMultiArray* tensorArray(const gls::Buffer<float>& tensor, int channels, int height, int width) {
+        NSError* error = nil;
+        MLMultiArray* array = [[MLMultiArray alloc] initWithDataPointer:tensor.data()
+                                                                  shape:@[@1, @(channels), @(height), @(width)]
+                                                               dataType:MLMultiArrayDataTypeFloat32
+                                                                strides:@[@(channels * height * width), @(height * width), @(width), @1]
+                                                            deallocator:nil
+                                                                  error:&error];
+        if (!array) {
+            throw std::runtime_error(std::string("Couldn't create the FMEN input array: ") + [[error localizedDescription] UTF8String]);
+        }
+        return array;
+    }
+
+    // The tiles only grow, an image of the same size reuses all of them
+    void allocateTiles(int tiles) {
+        while ((int) _inputTiles.size() < tiles) {
+            _inputTiles.push_back(std::make_unique<gls::Buffer<float>>(_context.device(), (size_t) kTileSize * kTileSize));
+            [_inputArrays addObject:tensorArray(*_inputTiles.back(), 1, kTileSize, kTileSize)];
+        }
+        _outputTiles.resize(std::max((int) _outputTiles.size(), tiles));
+    }
+
+    // Copies a [1, 3, H, W] Float32 model output to the tile's staging buffer, returns its layout
+    TensorLayout stageOutput(MLMultiArray* result, int tile, int height, int width) {
+        // Minimal sanity check
+        NSArray<NSNumber *> *resultShape = [result shape];
+        if (result.dataType != MLMultiArrayDataTypeFloat32 ||
+            [resultShape[0] longValue] != 1 || [resultShape[1] longValue] != 3 ||
+            [resultShape[2] longValue] != height || [resultShape[3] longValue] != width) {
+            throw std::runtime_error("Unexpected FMEN output");
+        }
+
+        // The output arrays are allocated by Core ML, batch predictions don't take output backings
+        TensorLayout layout = TensorLayout::nchw(3, height, width);
+        layout.channelStride = [result.strides[1] intValue];
+        layout.rowStride = [result.strides[2] intValue];
+        layout.columnStride = [result.strides[3] intValue];
+
+        const size_t tensorSize = 3 * (size_t) layout.channelStride;
+        if (!_outputTiles[tile] || _outputTiles[tile]->size() < tensorSize) {
+            _outputTiles[tile] = std::make_unique<gls::Buffer<float>>(_context.device(), tensorSize);
+        }
+        float* tensor = _outputTiles[tile]->data();
+        [result getBytesWithHandler:^(const void* bytes, NSInteger size) {
+            std::memcpy(tensor, bytes, std::min((size_t) size, tensorSize * sizeof(float)));
+        }];
+        return layout;
+    }
+
+public:
+    FMENTiler(NS::SharedPtr<MTL::Device> device) :
+        _fmen([[FMEN alloc] init]),
+        _context(device),
+        _imageToTensor(&_context),
+        _tensorToImage(&_context),
+        _inputArrays([NSMutableArray array]) {
+        if (!_fmen) {
+            throw std::runtime_error("Couldn't load the FMEN model");
+        }
+    }
+
+    // The tiler is created on the device of the first call
+    static FMENTiler* instance(MTL::Device* device) {
+        static std::unique_ptr<FMENTiler> tiler;
+        static std::once_flag once;
+        std::call_once(once, [device] {
+            tiler = std::make_unique<FMENTiler>(NS::RetainPtr(device));
+        });
+        if (tiler->_context.device() != device) {
+            throw std::runtime_error("FMENTiler: all calls must use the same Metal device");
+        }
+        return tiler.get();
+    }
+
+    MetalContext* context() {
+        return &_context;
+    }
+
+    // Calls share the model and the tile buffers
+    static std::mutex& mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
 
-        NSError *error = nil;
-        NSArray<NSNumber *> *tile_shape = @[@1, @1, @4032, @3024];
-        MLMultiArray *multiarray_tile = [[MLMultiArray alloc] initWithShape:tile_shape
-                                                                   dataType:MLMultiArrayDataTypeFloat error: &error];
-        assert(error == nil);
-        FMENInput *femn_input = [[FMENInput alloc] initWithX_3:multiarray_tile];
+    // The whole image in a single inference, the model sees it transposed
+    template <typename T>
+    void applyFullRes(const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel, gls::mtl_image_2d<T>* outputImage) {
+        const int tensorWidth = rawImage.height;
+        const int tensorHeight = rawImage.width;
 
-        gls::image<float> tile(rawImage.height, rawImage.width, rawImage.height,
-                               std::span((float *) multiarray_tile.dataPointer, fmen_tile_pixels));
+        gls::Buffer<float> inputTensor(_context.device(), (size_t) tensorWidth * tensorHeight);
+        MLMultiArray* inputArray = tensorArray(inputTensor, 1, tensorHeight, tensorWidth);
+        {
+            gls::mtl_image_2d<gls::luma_pixel_16> raw(_context.device(), rawImage);
+
+            TensorLayout layout = TensorLayout::nchw(1, tensorHeight, tensorWidth);
+            layout.transpose = true;
+            // R16Unorm reads are normalized to 0xffff
+            layout.scale = 0xffff / (float) whiteLevel;
+            _imageToTensor(&_context, raw, inputTensor, layout, tensorWidth, tensorHeight);
+            _context.waitForCompletion();
+        }
+
+        NSError* error = nil;
+        FMENOutput* output = [_fmen predictionFromFeatures:[[FMENInput alloc] initWithX_3:inputArray] error:&error];
+        if (!output) {
+            throw std::runtime_error(std::string("FMEN prediction failed: ") + [[error localizedDescription] UTF8String]);
+        }
+
+        allocateTiles(1);
+        TensorLayout layout = stageOutput([output var_540], /*tile=*/ 0, tensorHeight, tensorWidth);
+        layout.transpose = true;
+        _tensorToImage(&_context, *_outputTiles[0], outputImage, layout, tensorWidth, tensorHeight);
+        _context.waitForCompletion();
+    }
 
-        for (int y = 0; y < rawImage.height; y++) {
-            for (int x = 0; x < rawImage.width; x++) {
-                tile[x][y] = rawImage[y][x] / (float) whiteLevel;
+    // The tiles are unpacked into outputImage on the given context, as soon as inferred. With rowsDone the tiles
+    // are inferred a row of tiles at a time and rowsDone is called with the output rows completed so far, the
+    // unpacking of the rows being queued on the context. Otherwise all the tiles run in a single batch.
+    template <typename T>
+    void apply(MetalContext* context, const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel, gls::mtl_image_2d<T>* outputImage,
+               const std::function<void(int rows)>& rowsDone = nullptr) {
+        const int tilesX = (rawImage.width + kTileCore - 1) / kTileCore;
+        const int tilesY = (rawImage.height + kTileCore - 1) / kTileCore;
+        const int tiles = tilesX * tilesY;
+        allocateTiles(tiles);
+
+        // Image position of the tile's padded origin
+        auto tileOrigin = [&](int tile) -> simd::int2 {
+            return { (tile % tilesX) * kTileCore - kTilePadding, (tile / tilesX) * kTileCore - kTilePadding };
+        };
+
+        {
+            gls::mtl_image_2d<gls::luma_pixel_16> raw(_context.device(), rawImage);
+
+            TensorLayout layout = TensorLayout::nchw(1, kTileSize, kTileSize);
+            // R16Unorm reads are normalized to 0xffff
+            layout.scale = 0xffff / (float) whiteLevel;
+            for (int tile = 0; tile < tiles; tile++) {
+                layout.origin = tileOrigin(tile);
+                _imageToTensor(&_context, raw, *_inputTiles[tile], layout, kTileSize, kTileSize);
             }
+            // Only the packing, the work on the caller's context keeps going
+            _context.waitForCompletion();
         }
 
-        FMENOutput* femn_output = [fmen predictionFromFeatures: femn_input error: &error];
-        assert(error == nil);
+        const int tilesPerBatch = rowsDone ? tilesX : tiles;
+        for (int firstTile = 0; firstTile < tiles; firstTile += tilesPerBatch) {
+            gls::TraceInterval interval("FMEN tiles " + std::to_string(firstTile) + "-" +
+                                        std::to_string(firstTile + tilesPerBatch - 1));
+            NSMutableArray<id<MLFeatureProvider>>* inputs = [NSMutableArray arrayWithCapacity:tilesPerBatch];
+            for (int tile = firstTile; tile < firstTile + tilesPerBatch; tile++) {
+                [inputs addObject:[[FMENInput alloc] initWithX_3:_inputArrays[tile]]];
+            }
 
-        MLMultiArray *result_multiarray = [femn_output var_540];
+            // The tiles of a batch are pipelined by Core ML on the Neural Engine
+            NSError* error = nil;
+            id<MLBatchProvider> results = [_fmen.model predictionsFromBatch:[[MLArrayBatchProvider alloc] initWithFeatureProviderArray:inputs]
+                                                                    options:[[MLPredictionOptions alloc] init]
+                                                                      error:&error];
+            if (!results) {
+                throw std::runtime_error(std::string("FMEN prediction failed: ") + [[error localizedDescription] UTF8String]);
+            }
 
-        // Minimal sanity check
-        NSArray<NSNumber *> *resultShape = [result_multiarray shape];
-        assert([resultShape[0] longValue] == 1 &&
-               [resultShape[1] longValue] == 3 &&
-               [resultShape[2] longValue] == rawImage.width &&
-               [resultShape[3] longValue] == rawImage.height);
-
-        gls::image<float> resultTileRed(rawImage.height, rawImage.width, rawImage.height,
-                                        std::span((float *) result_multiarray.dataPointer, fmen_tile_pixels));
-        gls::image<float> resultTileGreen(rawImage.height, rawImage.width, rawImage.height,
-                                          std::span((float *) result_multiarray.dataPointer + fmen_tile_pixels, fmen_tile_pixels));
-        gls::image<float> resultTileBlue(rawImage.height, rawImage.width, rawImage.height,
-                                         std::span((float *) result_multiarray.dataPointer + 2 * fmen_tile_pixels, fmen_tile_pixels));
-
-        for (int y = 0; y < rawImage.height; y++) {
-            for (int x = 0; x < rawImage.width; x++) {
-                (*processedImage)[y][x] = {
-                    (float16_t) resultTileRed[y][x],
-                    (float16_t) resultTileGreen[y][x],
-                    (float16_t) resultTileBlue[y][x],
-                    (float16_t) 1
-                };
+            for (int tile = firstTile; tile < firstTile + tilesPerBatch; tile++) {
+                MLMultiArray* result = [[results featuresAtIndex:tile - firstTile] featureValueForName:@"var_540"].multiArrayValue;
+
+                // Only the tile's core goes to the output
+                TensorLayout layout = stageOutput(result, tile, kTileSize, kTileSize);
+                layout.origin = tileOrigin(tile);
+                layout.tensorOffset = kTilePadding;
+                _tensorToImage(context, *_outputTiles[tile], outputImage, layout, kTileCore, kTileCore);
+            }
+
+            if (rowsDone) {
+                rowsDone(std::min((firstTile / tilesX + 1) * kTileCore, rawImage.height));
             }
         }
+    }
+};
+#endif
+
+void fmenApplyToImageFullRes(const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel, gls::image<gls::pixel_fp16_4>* processedImage) {
+#ifdef USE_FEMN_MODEL
+    assert(rawImage.width == 4032 && rawImage.height == 3024);
+
+    std::lock_guard<std::mutex> guard(FMENTiler::mutex());
+
+    @autoreleasepool {
+        // Counting out time
+        auto t_fmen_start = std::chrono::high_resolution_clock::now();
+
+        auto device = NS::TransferPtr(MTL::CreateSystemDefaultDevice());
+        auto tiler = FMENTiler::instance(device.get());
+
+        gls::mtl_image_2d<gls::pixel_fp16_4> outputImage(device.get(), rawImage.width, rawImage.height);
+        tiler->applyFullRes(rawImage, whiteLevel, &outputImage);
+
+        outputImage.copyPixelsTo(processedImage);
 
         // Measure execution time
         auto t_fmen_end = std::chrono::high_resolution_clock::now();
@@ -94,69 +268,20 @@ void fmenApplyToImageFullRes(const gls::image<gls::luma_pixel_16>& rawImage, int
 
 void fmenApplyToImage(const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel, gls::image<gls::pixel_fp16_4>* processedImage) {
 #ifdef USE_FEMN_MODEL
-    const int fmen_tile_size = 1072;
-    const int fmen_tile_pixels = fmen_tile_size * fmen_tile_size;
-    const int image_tile_padding = 32;
-    const int image_tile_size = fmen_tile_size - 2 * image_tile_padding;
+    std::lock_guard<std::mutex> guard(FMENTiler::mutex());
 
     @autoreleasepool {
-        // Allocate FMEN model
-        FMEN* fmen = [[FMEN alloc] init];
-
         // Counting out time
         auto t_fmen_start = std::chrono::high_resolution_clock::now();
 
-        NSError *error = nil;
-        NSArray<NSNumber *> *tile_shape = @[@1, @1, @1072, @1072];
-        MLMultiArray *multiarray_tile = [[MLMultiArray alloc] initWithShape:tile_shape
-                                                                   dataType:MLMultiArrayDataTypeFloat error: &error];
-        assert(error == nil);
-        FMENInput *femn_input = [[FMENInput alloc] initWithX_3:multiarray_tile];
-
-        gls::image<float> tile(fmen_tile_size, fmen_tile_size, fmen_tile_size,
-                               std::span((float *) multiarray_tile.dataPointer, fmen_tile_pixels));
-
-        for (int y = 0; y < rawImage.height; y += image_tile_size) {
-            for (int x = 0; x < rawImage.width; x += image_tile_size) {
-                for (int j = 0, sj = -image_tile_padding; j < fmen_tile_size; j++, sj++) {
-                    for (int i = 0, si = -image_tile_padding; i < fmen_tile_size; i++, si++) {
-                        tile[j][i] = rawImage.getPixel(x + si, y + sj) / (float) whiteLevel;
-                    }
-                }
-
-                FMENOutput* femn_output = [fmen predictionFromFeatures: femn_input error: &error];
-                assert(error == nil);
-
-                MLMultiArray *result_multiarray = [femn_output var_540];
-
-                // Minimal sanity check
-                NSArray<NSNumber *> *resultShape = [result_multiarray shape];
-                assert([resultShape[0] longValue] == 1 &&
-                       [resultShape[1] longValue] == 3 &&
-                       [resultShape[2] longValue] == fmen_tile_size &&
-                       [resultShape[3] longValue] == fmen_tile_size);
-
-                gls::image<float> resultTileRed(fmen_tile_size, fmen_tile_size, fmen_tile_size,
-                                                std::span((float *) result_multiarray.dataPointer, fmen_tile_pixels));
-                gls::image<float> resultTileGreen(fmen_tile_size, fmen_tile_size, fmen_tile_size,
-                                                  std::span((float *) result_multiarray.dataPointer + fmen_tile_pixels, fmen_tile_pixels));
-                gls::image<float> resultTileBlue(fmen_tile_size, fmen_tile_size, fmen_tile_size,
-                                                 std::span((float *) result_multiarray.dataPointer + 2 * fmen_tile_pixels, fmen_tile_pixels));
-
-                for (int j = 0, rj = image_tile_padding; j < image_tile_size; j++, rj++) {
-                    for (int i = 0, ri = image_tile_padding; i < image_tile_size; i++, ri++) {
-                        if (y + j < rawImage.height && x + i < rawImage.width) {
-                            (*processedImage)[y + j][x + i] = {
-                                (float16_t) resultTileRed[rj][ri],
-                                (float16_t) resultTileGreen[rj][ri],
-                                (float16_t) resultTileBlue[rj][ri],
-                                (float16_t) 1
-                            };
-                        }
-                    }
-                }
-            }
-        }
+        auto device = NS::TransferPtr(MTL::CreateSystemDefaultDevice());
+        auto tiler = FMENTiler::instance(device.get());
+
+        gls::mtl_image_2d<gls::pixel_fp16_4> outputImage(device.get(), rawImage.width, rawImage.height);
+        tiler->apply(tiler->context(), rawImage, whiteLevel, &outputImage);
+        tiler->context()->waitForCompletion();
+
+        outputImage.copyPixelsTo(processedImage);
 
         // Measure execution time
         auto t_fmen_end = std::chrono::high_resolution_clock::now();
@@ -165,3 +290,17 @@ void fmenApplyToImage(const gls::image<gls::luma_pixel_16>& rawImage, int whiteL
     }
 #endif
 }
+
+bool fmenApplyToImage(MetalContext* context, const gls::image<gls::luma_pixel_16>& rawImage, int whiteLevel,
+                      gls::mtl_image_2d<gls::pixel_float4>* outputImage, const std::function<void(int rows)>& rowsDone) {
+#ifdef USE_FEMN_MODEL
+    std::lock_guard<std::mutex> guard(FMENTiler::mutex());
+
+    @autoreleasepool {
+        FMENTiler::instance(context->device())->apply(context, rawImage, whiteLevel, outputImage, rowsDone);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
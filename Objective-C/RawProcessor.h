@@ -37,14 +37,109 @@ NS_ASSUME_NONNULL_BEGIN
 @property NSArray<NSNumber*>* asShotNeutral;
 @property NSArray<NSNumber*>* noiseProfile;
 
+// TIFF Model and EXIF LensModel, they select the camera calibration
+@property (nullable) NSString* cameraModel;
+@property (nullable) NSString* lensModel;
+
 @end
 
+extern NSErrorDomain const RawProcessorErrorDomain;
+
+typedef NS_ERROR_ENUM(RawProcessorErrorDomain, RawProcessorError) {
+    RawProcessorErrorCancelled = 1,
+    RawProcessorErrorFailed = 2
+};
+
+// Called with a pooled pixel buffer, to be returned with returnOutputPixelBuffer:, or with the error. The pixel buffer
+// is only retained for the duration of the call.
+typedef void (^RawProcessorCompletionHandler)(CVPixelBufferRef _Nullable pixelBuffer, NSError* _Nullable error);
+
 @interface RawProcessor : NSObject
 
+// Concurrent conversions use up to maxConverters pipeline instances within memoryBudget bytes, further ones queue
++ (void) setMaxConverters: (NSInteger) maxConverters memoryBudget: (NSUInteger) memoryBudget;
+
+// Performance records of the captures completed since the last call, oldest first, e.g. for a periodic upload: the
+// stage durations in ms (leaseWaitMs, calibrationMs, encodeMs, gpuMs, totalMs), the tracked GPU memory (gpuLiveBytes,
+// gpuPeakBytes), the image size, the preset, its pyramid depth and the thermal state. The most recent 256 are kept.
++ (NSArray<NSDictionary<NSString*, id>*>*) drainTelemetry NS_SWIFT_NAME(drainTelemetry());
+
+// The result is a pooled buffer, return it with returnOutputPixelBuffer: once done with it
 - (CVPixelBufferRef) convertRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata;
 
+// Full range bi-planar 420 YCbCr result (BT.709 matrix, Display P3 primaries) for the HEIC encoder, 8 or 10 bit.
+// Also a pooled buffer, returned with returnOutputPixelBuffer:
+- (CVPixelBufferRef) convertRawPixelBufferToYCbCr: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                                             tenBit: (BOOL) tenBit
+    NS_SWIFT_NAME(convertRawPixelBufferToYCbCr(_:with:tenBit:));
+
+// Asynchronous variants, the conversions of each camera (cameraModel and lensModel) are submitted to the GPU in
+// order from a background queue and complete on a background thread, the captures of different cameras run
+// concurrently. The returned progress can cancel a conversion until it is submitted.
+- (NSProgress*) convertRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                           completion: (RawProcessorCompletionHandler) completion
+    NS_SWIFT_NAME(convertRawPixelBuffer(_:with:completion:));
+
+- (NSProgress*) convertRawPixelBufferToYCbCr: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                                      tenBit: (BOOL) tenBit completion: (RawProcessorCompletionHandler) completion
+    NS_SWIFT_NAME(convertRawPixelBufferToYCbCr(_:with:tenBit:completion:));
+
+- (void) returnOutputPixelBuffer: (CVPixelBufferRef) pixelBuffer;
+
 - (CVPixelBufferRef) nnProcessRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata;
 
 @end
 
+// Called on a background thread with the fused image file of the burst or the error, a capture of a single frame
+// isn't a burst and completes with neither
+typedef void (^BurstSessionCompletionHandler)(NSURL* _Nullable fusedImageURL, NSError* _Nullable error);
+
+// Merges the RAW frames of a burst while it is being captured: each frame is demosaiced, registered to the first one
+// and accumulated on a background queue as soon as it is added, finish only waits for the last frame's merge and the
+// rendering of the result. The session leases a converter of the RawProcessor pool till it completes.
+@interface BurstSession : NSObject
+
+// The fused image is written to outputURL as HEIC
+- (instancetype) initWithOutputURL: (NSURL*) outputURL completion: (BurstSessionCompletionHandler) completion
+    NS_SWIFT_NAME(init(outputURL:completion:));
+
+- (instancetype) init NS_UNAVAILABLE;
+
+// In capture order, the first frame is the reference, the buffer is retained till it is merged
+- (void) addRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+    NS_SWIFT_NAME(addRawPixelBuffer(_:with:));
+
+// After the last frame, completes once the frames added so far are merged
+- (void) finish;
+
+// Drops the frames not merged yet and completes with RawProcessorErrorCancelled
+- (void) cancel;
+
+@end
+
+// Called on a background thread with the fused image file of the burst, or the error
+typedef void (^BurstFusionCompletionHandler)(NSString* jobIdentifier, NSURL* _Nullable fusedImageURL, NSError* _Nullable error);
+
+// Merges the RAW bursts saved as DNG files in the background, one frame at a time, while the device is charging or
+// idle (not suspended by the app and with enough battery), with a nominal or fair thermal state, captures keeping up
+// with their latency target and Low Power Mode off. The pending bursts are kept in Application Support and picked up again on the next launch, a burst
+// interrupted by the app's suspension is merged again with the features of its frames already detected in the cache.
+@interface BurstFusionQueue : NSObject
+
+@property (class, readonly) BurstFusionQueue* sharedQueue NS_SWIFT_NAME(shared);
+
+@property (nullable, copy) BurstFusionCompletionHandler completionHandler;
+
+// Holds the work off, e.g. while capturing, the current frame completes first
+@property (getter=isSuspended) BOOL suspended;
+
+@property (readonly) NSInteger pendingBurstCount;
+
+// The frames are copied into the queue's storage, the first one is the reference. The fused image is written to
+// outputURL as HEIC. Returns the job's identifier.
+- (NSString*) enqueueBurst: (NSArray<NSURL*>*) dngFiles outputURL: (NSURL*) outputURL
+    NS_SWIFT_NAME(enqueueBurst(_:outputURL:));
+
+@end
+
 NS_ASSUME_NONNULL_END
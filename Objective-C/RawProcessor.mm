@@ -17,16 +17,29 @@
 
 #import <CoreGraphics/CGColorSpace.h>
 #import <CoreImage/CoreImage.h>
+#import <UIKit/UIKit.h>
 
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <simd/simd.h>
 
 #include "gls_tiff_metadata.hpp"
 #include "raw_converter.hpp"
+#include "thermal_scheduler.hpp"
+#include "capture_telemetry.hpp"
+#include "float16.hpp"
+#include "TaskScheduler.hpp"
 
 #include "CameraCalibration.hpp"
 
 #include "CoreMLSupport.h"
 
+#include "KeypointCache.hpp"
+#include "BurstMerger.hpp"
+
 std::vector<uint8_t> ICCProfileData(const CFStringRef colorSpaceName) {
     CGColorSpaceRef colorSpace = CGColorSpaceCreateWithName(colorSpaceName);
     if (colorSpace) {
@@ -46,13 +59,330 @@ std::vector<uint8_t> ICCProfileData(const CFStringRef colorSpaceName) {
     throw std::runtime_error("Cannot get CGColorSpaceCopyICCProfile()");
 }
 
+// A conversion submitted to the GPU, the result is in outputPixelBuffer once done. The converter stays leased
+// until then.
+struct RawConversion {
+    RawConverterPool::Lease rawConverter;
+    CVPixelBufferRef outputPixelBuffer;
+    RawConverter::AsyncResult result;
+    std::chrono::high_resolution_clock::time_point startTime;
+    // Completed by logExecutionTime
+    gls::CaptureTelemetry telemetry;
+    double gpuTimeStart;
+};
+
+// The performance records of the recent captures, see drainTelemetry
+static gls::telemetry_ring<gls::CaptureTelemetry, 256>& captureTelemetry() {
+    static gls::telemetry_ring<gls::CaptureTelemetry, 256> telemetry;
+    return telemetry;
+}
+
+static double millisecondsSince(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Captures and background fusion adapt to the device's thermal state
+static gls::ThermalScheduler& thermalScheduler() {
+    static gls::ThermalScheduler scheduler;
+    return scheduler;
+}
+
+static void logExecutionTime(const RawConversion& conversion) {
+    auto t_metal_end = std::chrono::high_resolution_clock::now();
+    auto elapsed_time_ms = std::chrono::duration<double, std::milli>(t_metal_end - conversion.startTime).count();
+
+    std::cout << "Metal Pipeline Execution Time: " << (int)elapsed_time_ms << std::endl;
+
+    thermalScheduler().reportLatency(elapsed_time_ms / 1000);
+    conversion.rawConverter->context()->reportFrameLatency(elapsed_time_ms / 1000);
+
+    auto telemetry = conversion.telemetry;
+    telemetry.timestamp = [NSDate date].timeIntervalSince1970;
+    telemetry.gpuMs = 1000 * (conversion.rawConverter->context()->gpuTime() - conversion.gpuTimeStart);
+    const auto& memoryTracker = gls::GPUMemoryTracker::shared();
+    telemetry.gpuLiveBytes = memoryTracker.liveBytes();
+    telemetry.gpuPeakBytes = memoryTracker.peakBytes();
+    telemetry.totalMs = elapsed_time_ms + telemetry.leaseWaitMs + telemetry.calibrationMs;
+    captureTelemetry().record(telemetry);
+}
+
+// The DNG and EXIF tags of the capture for the calibration, the CFA layout is the pixel buffer's
+static void rawImageMetadata(CVPixelBufferRef rawPixelBuffer, RawMetadata* metadata, gls::tiff_metadata* dng_metadata,
+                             gls::tiff_metadata* exif_metadata) {
+    auto pixelFormatType = CVPixelBufferGetPixelFormatType(rawPixelBuffer);
+    std::vector<uint8_t> cfaPattern = { 0, 1, 1, 2 };
+    switch (pixelFormatType) {
+        case kCVPixelFormatType_14Bayer_GRBG:
+            cfaPattern = { 1, 0, 2, 1 };
+            break;
+        case kCVPixelFormatType_14Bayer_RGGB:
+            cfaPattern = { 0, 1, 1, 2 };
+            break;
+        case kCVPixelFormatType_14Bayer_BGGR:
+            cfaPattern = { 2, 1, 1, 0 };
+            break;
+        case kCVPixelFormatType_14Bayer_GBRG:
+            cfaPattern = { 1, 2, 0, 1 };
+            break;
+        default:
+            std::cerr << "Unrecognized Pixel Format Type: " << pixelFormatType << ", defaulting to RGGB." << std::endl;
+            cfaPattern = { 0, 1, 1, 2 };
+            break;
+    }
+
+    // float exposureBiasValue = [metadata exposureBiasValue];
+    float baselineExposure = [metadata baselineExposure];
+    float exposureTime = [metadata exposureTime];
+    int isoSpeedRating = [metadata isoSpeedRating];
+    int blackLevel = [metadata blackLevel];
+    int whiteLevel = [metadata whiteLevel];
+    // int calibrationIlluminant1 = [metadata calibrationIlluminant1];
+    // int calibrationIlluminant2 = [metadata calibrationIlluminant2];
+    // NSArray<NSNumber*>* colorMatrix1 = [metadata colorMatrix1];
+    NSArray<NSNumber*>* colorMatrix2 = [metadata colorMatrix2];
+    NSArray<NSNumber*>* asShotNeutral = [metadata asShotNeutral];
+    // NSArray<NSNumber*>* noiseProfile = [metadata noiseProfile];
+
+    std::vector<float> as_shot_neutral(3);
+    for (int i = 0; i < 3; i++) {
+        as_shot_neutral[i] = [asShotNeutral[i] floatValue];
+    }
+
+    std::vector<float> color_matrix(9);
+    for (int i = 0; i < 9; i++) {
+        color_matrix[i] = [colorMatrix2[i] floatValue];
+    }
+
+    // Basic DNG image interpretation metadata
+    dng_metadata->insert({ TIFFTAG_COLORMATRIX1, color_matrix });
+    dng_metadata->insert({ TIFFTAG_ASSHOTNEUTRAL, as_shot_neutral });
+
+    dng_metadata->insert({ TIFFTAG_BASELINEEXPOSURE, baselineExposure });
+    dng_metadata->insert({ TIFFTAG_CFAREPEATPATTERNDIM, std::vector<uint16_t>{ 2, 2 } });
+    dng_metadata->insert({ TIFFTAG_CFAPATTERN, cfaPattern });
+    dng_metadata->insert({ TIFFTAG_BLACKLEVEL, std::vector<float>{ (float) blackLevel } });
+    dng_metadata->insert({ TIFFTAG_WHITELEVEL, std::vector<uint32_t>{ (uint32_t) whiteLevel } });
+
+    // Basic EXIF metadata
+    exif_metadata->insert({ EXIFTAG_ISOSPEEDRATINGS, std::vector<uint16_t>{ (uint16_t) isoSpeedRating } });
+    exif_metadata->insert({ EXIFTAG_EXPOSURETIME, std::vector<float>{ (float) exposureTime } });
+
+    // Camera and lens select the calibration
+    if (NSString* cameraModel = [metadata cameraModel]) {
+        dng_metadata->insert({ TIFFTAG_MODEL, std::string([cameraModel UTF8String]) });
+    }
+    if (NSString* lensModel = [metadata lensModel]) {
+        exif_metadata->insert({ EXIFTAG_LENSMODEL, std::string([lensModel UTF8String]) });
+    }
+}
+
+// Debug settings for the field reports of slow captures, the traces are written to Caches/GPUTraces: with
+// GPUCaptureNextCapture set the command buffers of the next capture are captured once, with
+// GPUCaptureLatencyThresholdMs those following the first capture slower than the threshold. GPUCaptureCommandBuffers
+// is the number of command buffers captured, 16 by default. The app needs MetalCaptureEnabled in its Info.plist.
+static NSString* const kGPUCaptureNextCapture = @"GPUCaptureNextCapture";
+static NSString* const kGPUCaptureLatencyThresholdMs = @"GPUCaptureLatencyThresholdMs";
+static NSString* const kGPUCaptureCommandBuffers = @"GPUCaptureCommandBuffers";
+
+static std::string gpuTraceDirectory() {
+    NSString* cachesDirectory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+    NSString* directory = [cachesDirectory stringByAppendingPathComponent:@"GPUTraces"];
+    [NSFileManager.defaultManager createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+    return [directory UTF8String];
+}
+
+static int gpuCaptureCommandBuffers() {
+    NSInteger count = [NSUserDefaults.standardUserDefaults integerForKey:kGPUCaptureCommandBuffers];
+    return count > 0 ? (int) count : 16;
+}
+
+// With a zero outputPixelFormat the result is the pipeline's RGBA pixel buffer, otherwise a 420 YCbCr one
+static RawConversion submitRawConversion(CVPixelBufferRef rawPixelBuffer, RawMetadata* metadata, OSType outputPixelFormat) {
+    // The capture path: the white balance and noise estimation of the calibration and their parallel_for helpers
+    // run on the performance cores
+    gls::QoSScope qos(gls::QoS::userInteractive);
+
+    CVPixelBufferLockBaseAddress(rawPixelBuffer, 0);
+    size_t width = CVPixelBufferGetWidth(rawPixelBuffer);
+    size_t height = CVPixelBufferGetHeight(rawPixelBuffer);
+    size_t bytesPerRow = CVPixelBufferGetBytesPerRow(rawPixelBuffer);
+    size_t stride = (int) bytesPerRow / sizeof(gls::luma_pixel_16);
+    gls::luma_pixel_16* pixelBufferData = (gls::luma_pixel_16*) CVPixelBufferGetBaseAddress(rawPixelBuffer);
+
+    auto rawImage = gls::image<gls::luma_pixel_16>((int) width, (int) height, (int) stride, std::span(pixelBufferData, stride * height));
+
+    gls::tiff_metadata dng_metadata, exif_metadata;
+    rawImageMetadata(rawPixelBuffer, metadata, &dng_metadata, &exif_metadata);
+
+    // Exclusive use of a converter till the GPU is done, concurrent captures get another one or wait their turn
+    auto t_lease_start = std::chrono::high_resolution_clock::now();
+    auto rawConverter = rawConverterPool()->checkout();
+    const double leaseWaitMs = millisecondsSince(t_lease_start);
+
+    // The CPU temporaries of the calibration and the white balance, released on return
+    gls::FrameArena::Scope frameArena(rawConverter->frameArena());
+
+    NSUserDefaults* defaults = NSUserDefaults.standardUserDefaults;
+    if ([defaults boolForKey:kGPUCaptureNextCapture]) {
+        [defaults removeObjectForKey:kGPUCaptureNextCapture];
+        const auto now = (long long) [NSDate date].timeIntervalSince1970;
+        rawConverter->context()->captureCommandBuffers(gpuCaptureCommandBuffers(),
+                                                       gpuTraceDirectory() + "/capture-" + std::to_string(now) + ".gputrace");
+    }
+
+    auto t_calibration_start = std::chrono::high_resolution_clock::now();
+    auto demosaicParameters = CameraCalibrationRegistry::shared().getDemosaicParameters(rawImage, rawConverter->xyz_rgb(),
+                                                                                        &dng_metadata, &exif_metadata);
+
+    // Quality preset and pyramid depth for the current thermal state and capture latency
+    const auto decision = thermalScheduler().decide();
+    gls::ThermalScheduler::apply(decision, rawConverter.get(), demosaicParameters.get());
+    const double calibrationMs = millisecondsSince(t_calibration_start);
+
+    gls::CaptureTelemetry telemetry = {
+        .width = (int) width,
+        .height = (int) height,
+        .preset = decision.presetName,
+        .pyramidLevels = demosaicParameters->denoisePyramidConfig.levels,
+        .thermalState = (int) decision.thermalState,
+        .leaseWaitMs = leaseWaitMs,
+        .calibrationMs = calibrationMs,
+    };
+    const double gpuTimeStart = rawConverter->context()->gpuTime();
+
+    auto t_metal_start = std::chrono::high_resolution_clock::now();
+
+    // Capture buffers are IOSurface-backed, the GPU can read them in place without copying
+    std::unique_ptr<gls::mtl_pixel_buffer_image_2d<gls::luma_pixel_16>> rawTexture;
+    if (gls::mtl_pixel_buffer_image_2d<gls::luma_pixel_16>::isSupported(rawPixelBuffer)) {
+        rawTexture = std::make_unique<gls::mtl_pixel_buffer_image_2d<gls::luma_pixel_16>>(rawConverter->context()->device(), rawPixelBuffer);
+    }
+
+    // Render into a pooled output buffer, the next capture can be processed while this one is being encoded
+    CVPixelBufferRef outputPixelBuffer = nullptr;
+    RawConverter::AsyncResult result;
+    if (outputPixelFormat) {
+        // The HEVC encoder's native format, written directly by the final pipeline stage
+        auto ycbcrOutputPool = rawConverter->ycbcrOutputImagePool();
+        ycbcrOutputPool->setPixelFormat(outputPixelFormat);
+        auto outputImage = ycbcrOutputPool->checkout(rawImage.size());
+        outputPixelBuffer = outputImage->pixelBuffer();
+
+        CVBufferSetAttachment(outputPixelBuffer, kCVImageBufferYCbCrMatrixKey, kCVImageBufferYCbCrMatrix_ITU_R_709_2,
+                              kCVAttachmentMode_ShouldPropagate);
+        CVBufferSetAttachment(outputPixelBuffer, kCVImageBufferColorPrimariesKey, kCVImageBufferColorPrimaries_P3_D65,
+                              kCVAttachmentMode_ShouldPropagate);
+        CVBufferSetAttachment(outputPixelBuffer, kCVImageBufferTransferFunctionKey, kCVImageBufferTransferFunction_IEC_sRGB,
+                              kCVAttachmentMode_ShouldPropagate);
+
+        result = rawTexture ? rawConverter->demosaicToYCbCrAsync(*rawTexture, demosaicParameters.get(), /*denoise=*/ true, outputImage)
+                            : rawConverter->demosaicToYCbCrAsync(rawImage, demosaicParameters.get(), /*denoise=*/ true, outputImage);
+    } else {
+        auto outputImage = rawConverter->outputImagePool()->checkout(rawImage.size());
+        outputPixelBuffer = outputImage->pixelBuffer();
+
+        result = rawTexture ? rawConverter->demosaicAsync(*rawTexture, demosaicParameters.get(), /*denoise=*/ true,
+                                                           /*postProcess=*/ true, outputImage)
+                            : rawConverter->demosaicAsync(rawImage, demosaicParameters.get(), /*denoise=*/ true,
+                                                           /*postProcess=*/ true, outputImage);
+    }
+
+    // All done with the CPU side of rawImage, the texture keeps the IOSurface alive for the GPU
+    CVPixelBufferUnlockBaseAddress(rawPixelBuffer, 0);
+
+    telemetry.encodeMs = millisecondsSince(t_metal_start);
+
+    return { std::move(rawConverter), outputPixelBuffer, result, t_metal_start, telemetry, gpuTimeStart };
+
+}
+
+// Asynchronous conversions are submitted in order from a serial queue per camera, waiting there for a converter
+// instead of in the caller. The captures of the wide and tele cameras are prepared (calibration, white balance,
+// noise estimation) concurrently on their own queues, each on its converter: the pool serves the waiting queues in
+// turn and the GPU interleaves the command queues of the converters. The converters share the pipeline states,
+// the ICC profile and the camera transforms, see PipelineStateCache and ColorProfileCache.
+static dispatch_queue_t rawSubmissionQueue(RawMetadata* metadata) {
+    static std::mutex mutex;
+    static std::map<std::string, dispatch_queue_t> queues;
+
+    std::string camera = metadata.cameraModel ? [metadata.cameraModel UTF8String] : "";
+    if (metadata.lensModel) {
+        camera += std::string("\n") + [metadata.lensModel UTF8String];
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+    auto& queue = queues[camera];
+    if (!queue) {
+        queue = dispatch_queue_create("com.glass-imaging.raw-submission",
+                                      dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0));
+    }
+    return queue;
+}
+
+static NSError* rawProcessorError(NSInteger code, NSString* description) {
+    return [NSError errorWithDomain:RawProcessorErrorDomain code:code userInfo:@{ NSLocalizedDescriptionKey: description }];
+}
+
+NSErrorDomain const RawProcessorErrorDomain = @"RawProcessorErrorDomain";
+
 @implementation RawMetadata : NSObject
 
 @end
 
 @implementation RawProcessor : NSObject
 
-static std::unique_ptr<RawConverter> _rawConverter = nullptr;
+// Converters shared by all RawProcessor instances, concurrent captures lease their own
+static RawConverterPool* rawConverterPool() {
+    static std::unique_ptr<RawConverterPool> pool = nullptr;
+    static std::once_flag once;
+
+    std::call_once(once, [] {
+        // Parsed once, the converters share the profile
+        auto iccProfile = ColorProfileCache::shared().profile([(__bridge NSString*) kCGColorSpaceDisplayP3 UTF8String],
+                                                              [] { return ICCProfileData(kCGColorSpaceDisplayP3); });
+
+        // Pipeline states are cached across launches in a binary archive
+        NSString* cachesDirectory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+        NSString* binaryArchivePath = [cachesDirectory stringByAppendingPathComponent:@"GlassKernels.binarchive"];
+        std::string binaryArchive = [binaryArchivePath UTF8String];
+
+        auto metalDevice = NS::RetainPtr(MTL::CreateSystemDefaultDevice());
+
+        pool = std::make_unique<RawConverterPool>([=]() {
+            std::cout << "Allocating new RawConvwerter instance." << std::endl;
+
+            auto rawConverter = std::make_unique<RawConverter>(metalDevice, &iccProfile->data, /*calibrateFromImage=*/ false,
+                                                               binaryArchive);
+
+            // Build the remaining kernels (pyramid, SURF) in the background
+            rawConverter->context()->prewarmKernels();
+
+            const double latencyThresholdMs = [NSUserDefaults.standardUserDefaults doubleForKey:kGPUCaptureLatencyThresholdMs];
+            if (latencyThresholdMs > 0) {
+                rawConverter->context()->setGPUCaptureLatencyTrigger(latencyThresholdMs / 1000, gpuCaptureCommandBuffers(),
+                                                                     gpuTraceDirectory());
+            }
+            return rawConverter;
+        });
+
+        // Have the first converter ready for the first capture
+        pool->checkout();
+
+        // The system's memory warnings trim the idle caches of the converters
+        static dispatch_source_t memoryPressureSource =
+            dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0,
+                                   DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL,
+                                   dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+        dispatch_source_set_event_handler(memoryPressureSource, ^{
+            const auto status = dispatch_source_get_data(memoryPressureSource);
+            gls::MemoryPressureResponder::shared().respond((status & DISPATCH_MEMORYPRESSURE_CRITICAL)
+                                                           ? gls::MemoryPressure::critical
+                                                           : gls::MemoryPressure::warning);
+        });
+        dispatch_resume(memoryPressureSource);
+    });
+    return pool.get();
+}
 
 - (instancetype) init
 {
@@ -60,16 +390,44 @@ static std::unique_ptr<RawConverter> _rawConverter = nullptr;
         // Initialize self
     }
 
-    if (_rawConverter == nullptr) {
-        std::cout << "Allocating new RawConvwerter instance." << std::endl;
+    rawConverterPool();
+    return self;
+}
+
++ (void) setMaxConverters: (NSInteger) maxConverters memoryBudget: (NSUInteger) memoryBudget {
+    rawConverterPool()->setLimits((int) maxConverters, memoryBudget);
+}
 
-        auto icc_profile_data = ICCProfileData(kCGColorSpaceDisplayP3);
++ (NSArray<NSDictionary<NSString*, id>*>*) drainTelemetry {
+    static std::mutex mutex;
+    static uint64_t cursor = 0;
 
-        // Create RawConverter object
-        auto metalDevice = NS::RetainPtr(MTL::CreateSystemDefaultDevice());
-        _rawConverter = std::make_unique<RawConverter>(metalDevice, &icc_profile_data);
+    std::vector<gls::CaptureTelemetry> records;
+    {
+        // A single reader of the ring at a time
+        std::lock_guard<std::mutex> guard(mutex);
+        captureTelemetry().read(&cursor, &records);
     }
-    return self;
+
+    NSMutableArray* result = [NSMutableArray arrayWithCapacity:records.size()];
+    for (const auto& r : records) {
+        [result addObject:@{
+            @"timestamp": @(r.timestamp),
+            @"width": @(r.width),
+            @"height": @(r.height),
+            @"preset": @(PipelinePreset::nameString((PipelinePreset::Name) r.preset)),
+            @"pyramidLevels": @(r.pyramidLevels),
+            @"thermalState": @(r.thermalState),
+            @"leaseWaitMs": @(r.leaseWaitMs),
+            @"calibrationMs": @(r.calibrationMs),
+            @"encodeMs": @(r.encodeMs),
+            @"totalMs": @(r.totalMs),
+            @"gpuMs": @(r.gpuMs),
+            @"gpuLiveBytes": @(r.gpuLiveBytes),
+            @"gpuPeakBytes": @(r.gpuPeakBytes),
+        }];
+    }
+    return result;
 }
 
 /*
@@ -116,7 +474,19 @@ CVPixelBufferRef buildCVPixelBuffer(const gls::image<gls::pixel_float4>& rgbImag
 
         auto pixelBufferImage = gls::image<pixel_type>((int) width, (int) height, (int) stride, std::span((pixel_type*) data, stride * height));
 
-        if (pixel_type::channels == 3) {
+        if constexpr (std::is_same<pixel_type, gls::pixel_fp16_4>::value) {
+            // Bulk conversion of the rows, opaque alpha
+            gls::parallel_for(0, (int) height, /*grain=*/ 16, [&](int y0, int y1) {
+                for (int y = y0; y < y1; y++) {
+                    auto row = &pixelBufferImage[y][0];
+                    gls::convertToHalf(std::span((const float*) &rgbImage[y][0], 4 * width),
+                                       std::span((gls::float16_t*) row, 4 * width));
+                    for (int x = 0; x < width; x++) {
+                        row[x][3] = 1;
+                    }
+                }
+            });
+        } else if (pixel_type::channels == 3) {
             pixelBufferImage.apply([&] (pixel_type* p, int x, int y) {
                 const auto ip = rgbImage[y][x];
                 *p = pixel_type {
@@ -144,94 +514,97 @@ CVPixelBufferRef buildCVPixelBuffer(const gls::image<gls::pixel_float4>& rgbImag
 
 - (CVPixelBufferRef) convertRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
 {
-    CVPixelBufferLockBaseAddress(rawPixelBuffer, 0);
-    size_t width = CVPixelBufferGetWidth(rawPixelBuffer);
-    size_t height = CVPixelBufferGetHeight(rawPixelBuffer);
-    size_t bytesPerRow = CVPixelBufferGetBytesPerRow(rawPixelBuffer);
-    size_t stride = (int) bytesPerRow / sizeof(gls::luma_pixel_16);
-    gls::luma_pixel_16* pixelBufferData = (gls::luma_pixel_16*) CVPixelBufferGetBaseAddress(rawPixelBuffer);
-
-    auto pixelFormatType = CVPixelBufferGetPixelFormatType(rawPixelBuffer);
-    std::vector<uint8_t> cfaPattern = { 0, 1, 1, 2 };
-    switch (pixelFormatType) {
-        case kCVPixelFormatType_14Bayer_GRBG:
-            cfaPattern = { 1, 0, 2, 1 };
-            break;
-        case kCVPixelFormatType_14Bayer_RGGB:
-            cfaPattern = { 0, 1, 1, 2 };
-            break;
-        case kCVPixelFormatType_14Bayer_BGGR:
-            cfaPattern = { 2, 1, 1, 0 };
-            break;
-        case kCVPixelFormatType_14Bayer_GBRG:
-            cfaPattern = { 1, 2, 0, 1 };
-            break;
-        default:
-            std::cerr << "Unrecognized Pixel Format Type: " << pixelFormatType << ", defaulting to RGGB." << std::endl;
-            cfaPattern = { 0, 1, 1, 2 };
-            break;
-    }
-
-    auto rawImage = gls::image<gls::luma_pixel_16>((int) width, (int) height, (int) stride, std::span(pixelBufferData, stride * height));
-
-    gls::tiff_metadata dng_metadata, exif_metadata;
-
-    // float exposureBiasValue = [metadata exposureBiasValue];
-    float baselineExposure = [metadata baselineExposure];
-    float exposureTime = [metadata exposureTime];
-    int isoSpeedRating = [metadata isoSpeedRating];
-    int blackLevel = [metadata blackLevel];
-    int whiteLevel = [metadata whiteLevel];
-    // int calibrationIlluminant1 = [metadata calibrationIlluminant1];
-    // int calibrationIlluminant2 = [metadata calibrationIlluminant2];
-    // NSArray<NSNumber*>* colorMatrix1 = [metadata colorMatrix1];
-    NSArray<NSNumber*>* colorMatrix2 = [metadata colorMatrix2];
-    NSArray<NSNumber*>* asShotNeutral = [metadata asShotNeutral];
-    // NSArray<NSNumber*>* noiseProfile = [metadata noiseProfile];
-
-    std::vector<float> as_shot_neutral(3);
-    for (int i = 0; i < 3; i++) {
-        as_shot_neutral[i] = [asShotNeutral[i] floatValue];
-    }
-
-    std::vector<float> color_matrix(9);
-    for (int i = 0; i < 9; i++) {
-        color_matrix[i] = [colorMatrix2[i] floatValue];
-    }
-
-    // Basic DNG image interpretation metadata
-    dng_metadata.insert({ TIFFTAG_COLORMATRIX1, color_matrix });
-    dng_metadata.insert({ TIFFTAG_ASSHOTNEUTRAL, as_shot_neutral });
-
-    dng_metadata.insert({ TIFFTAG_BASELINEEXPOSURE, baselineExposure });
-    dng_metadata.insert({ TIFFTAG_CFAREPEATPATTERNDIM, std::vector<uint16_t>{ 2, 2 } });
-    dng_metadata.insert({ TIFFTAG_CFAPATTERN, cfaPattern });
-    dng_metadata.insert({ TIFFTAG_BLACKLEVEL, std::vector<float>{ (float) blackLevel } });
-    dng_metadata.insert({ TIFFTAG_WHITELEVEL, std::vector<uint32_t>{ (uint32_t) whiteLevel } });
+    return [self convertRawPixelBuffer:rawPixelBuffer withMetadata:metadata outputPixelFormat:0];
+}
 
-    // Basic EXIF metadata
-    exif_metadata.insert({ EXIFTAG_ISOSPEEDRATINGS, std::vector<uint16_t>{ (uint16_t) isoSpeedRating } });
-    exif_metadata.insert({ EXIFTAG_EXPOSURETIME, std::vector<float>{ (float) exposureTime } });
+- (CVPixelBufferRef) convertRawPixelBufferToYCbCr: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                                             tenBit: (BOOL) tenBit
+{
+    return [self convertRawPixelBuffer:rawPixelBuffer withMetadata:metadata
+                     outputPixelFormat:tenBit ? kCVPixelFormatType_420YpCbCr10BiPlanarFullRange
+                                              : kCVPixelFormatType_420YpCbCr8BiPlanarFullRange];
+}
 
-    // FIXME: we need to select the right parameters for the right camera
-    auto demosaicParameters = unpackiPhoneRawImage(rawImage, _rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
+- (CVPixelBufferRef) convertRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                         outputPixelFormat: (OSType) outputPixelFormat
+{
+    auto conversion = submitRawConversion(rawPixelBuffer, metadata, outputPixelFormat);
 
-    auto t_metal_start = std::chrono::high_resolution_clock::now();
+    conversion.result.done.get();
 
-    auto rgbImage = _rawConverter->demosaic(rawImage, demosaicParameters.get());
+    logExecutionTime(conversion);
 
-    // All done with rawImage, release rawPixelBuffer
-    CVPixelBufferUnlockBaseAddress(rawPixelBuffer, 0);
+    // The pixel buffer stays checked out until it is handed back with returnOutputPixelBuffer:
+    return CVPixelBufferRetain(conversion.outputPixelBuffer);
+}
 
-    auto t_metal_end = std::chrono::high_resolution_clock::now();
-    auto elapsed_time_ms = std::chrono::duration<double, std::milli>(t_metal_end - t_metal_start).count();
+- (NSProgress*) convertRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                    outputPixelFormat: (OSType) outputPixelFormat
+                           completion: (RawProcessorCompletionHandler) completion
+{
+    // Queued, submitted, done
+    NSProgress* progress = [NSProgress discreteProgressWithTotalUnitCount:3];
+    progress.cancellable = YES;
+
+    // The capture buffer and the metadata are kept until the conversion is submitted
+    CVPixelBufferRetain(rawPixelBuffer);
+    dispatch_async(rawSubmissionQueue(metadata), ^{
+        if (progress.cancelled) {
+            CVPixelBufferRelease(rawPixelBuffer);
+            completion(nil, rawProcessorError(RawProcessorErrorCancelled, @"Conversion cancelled"));
+            return;
+        }
+        progress.completedUnitCount = 1;
+
+        std::shared_ptr<RawConversion> conversion;
+        try {
+            conversion = std::make_shared<RawConversion>(submitRawConversion(rawPixelBuffer, metadata, outputPixelFormat));
+        } catch (const std::exception& e) {
+            CVPixelBufferRelease(rawPixelBuffer);
+            completion(nil, rawProcessorError(RawProcessorErrorFailed, [NSString stringWithUTF8String:e.what()]));
+            return;
+        }
+        CVPixelBufferRelease(rawPixelBuffer);
+
+        // Once submitted the GPU work runs to completion
+        progress.cancellable = NO;
+        progress.completedUnitCount = 2;
+
+        // Called on a Metal completion thread, the converter goes back to the pool once the client has the result
+        conversion->rawConverter->context()->notify([conversion, progress, completion]() {
+            CVPixelBufferRef outputPixelBuffer = CVPixelBufferRetain(conversion->outputPixelBuffer);
+            dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+                logExecutionTime(*conversion);
+                progress.completedUnitCount = 3;
+                completion(outputPixelBuffer, nil);
+                CVPixelBufferRelease(outputPixelBuffer);
+            });
+        });
+    });
+    return progress;
+}
 
-    std::cout << "Metal Pipeline Execution Time: " << (int)elapsed_time_ms << std::endl;
+- (NSProgress*) convertRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                           completion: (RawProcessorCompletionHandler) completion
+{
+    return [self convertRawPixelBuffer:rawPixelBuffer withMetadata:metadata outputPixelFormat:0 completion:completion];
+}
 
-    const auto& rgbImageCPU = rgbImage->mapImage();
-    CVPixelBufferRef pixelBuffer = CVPixelBufferFromFP16ImageBytes(*rgbImageCPU);
+- (NSProgress*) convertRawPixelBufferToYCbCr: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+                                      tenBit: (BOOL) tenBit completion: (RawProcessorCompletionHandler) completion
+{
+    return [self convertRawPixelBuffer:rawPixelBuffer withMetadata:metadata
+                     outputPixelFormat:tenBit ? kCVPixelFormatType_420YpCbCr10BiPlanarFullRange
+                                              : kCVPixelFormatType_420YpCbCr8BiPlanarFullRange
+                            completion:completion];
+}
 
-    return pixelBuffer;
+- (void) returnOutputPixelBuffer: (CVPixelBufferRef) pixelBuffer {
+    // Only the pool of the converter that produced it takes it back
+    rawConverterPool()->forEach([&](RawConverter* rawConverter) {
+        rawConverter->outputImagePool()->checkin(pixelBuffer);
+        rawConverter->ycbcrOutputImagePool()->checkin(pixelBuffer);
+    });
 }
 
 - (CVPixelBufferRef) nnProcessRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata {
@@ -285,8 +658,10 @@ CVPixelBufferRef buildCVPixelBuffer(const gls::image<gls::pixel_float4>& rgbImag
     exif_metadata.insert({ EXIFTAG_ISOSPEEDRATINGS, std::vector<uint16_t>{ (uint16_t) isoSpeedRating } });
     exif_metadata.insert({ EXIFTAG_EXPOSURETIME, std::vector<float>{ (float) exposureTime } });
 
+    auto rawConverter = rawConverterPool()->checkout();
+
     // FIXME: we need to select the right parameters for the right camera
-    auto demosaicParameters = unpackiPhone14TeleFEMNRawImage(rawImage, _rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
+    auto demosaicParameters = unpackiPhone14TeleFEMNRawImage(rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
 
     float exposureMultiplier = pow(2.0, baselineExposure);
 
@@ -294,14 +669,21 @@ CVPixelBufferRef buildCVPixelBuffer(const gls::image<gls::pixel_float4>& rgbImag
               << ", baselineExposure: " << baselineExposure << "EV - " << exposureMultiplier
               << " scale, isoSpeedRating: " << isoSpeedRating << ", exposureTime: " << exposureTime << std::endl;
 
-    // Result Image
-    gls::image<gls::pixel_fp16_4> processedImage((int) width, (int) height);
+    // The model's output is post-processed a row of tiles at a time while the next rows are being inferred, the GPU
+    // work overlaps the Neural Engine's
+    auto processedImage = rawConverter->beginStreamingPostprocess(rawImage, demosaicParameters.get(), fmenTileCoreSize);
 
     // Apply model to image
-    fmenApplyToImage(rawImage, whiteLevel, &processedImage);
+    if (!fmenApplyToImage(rawConverter->context(), rawImage, whiteLevel, processedImage,
+                          [&](int rows) { rawConverter->streamingRowsAvailable(rows); })) {
+        std::cout << "FMEN model not available" << std::endl;
+    }
+
+    auto result = rawConverter->endStreamingPostprocess();
+    result.done.get();
+    rawConverter->context()->waitForCompletion();
 
-    auto srgbImage = _rawConverter->postprocess(processedImage, demosaicParameters.get());
-    const auto srgbImageCpu = srgbImage->mapImage();
+    const auto srgbImageCpu = result.image->mapImage();
 
     // All done with rawImage, release rawPixelBuffer
     CVPixelBufferUnlockBaseAddress(rawPixelBuffer, 0);
@@ -313,3 +695,504 @@ CVPixelBufferRef buildCVPixelBuffer(const gls::image<gls::pixel_float4>& rgbImag
 }
 
 @end
+
+// MARK: Background burst fusion
+
+// Without a charger the queue only runs above this battery level
+static const float kBurstFusionMinBatteryLevel = 0.5;
+
+// The container's path can change across app updates, the job files store the paths relative to the home directory
+static NSString* homeRelativePath(NSURL* url) {
+    NSString* home = [NSHomeDirectory() stringByAppendingString:@"/"];
+    return [url.path hasPrefix:home] ? [url.path substringFromIndex:home.length] : url.path;
+}
+
+static NSURL* homeRelativeURL(NSString* path) {
+    return path.isAbsolutePath ? [NSURL fileURLWithPath:path]
+                               : [[NSURL fileURLWithPath:NSHomeDirectory() isDirectory:YES] URLByAppendingPathComponent:path];
+}
+
+// Writes the merged burst to outputURL as HEIC, waiting for the merge to complete
+static BOOL writeFusedImage(const gls::mtl_image_2d<gls::pixel_float4>& fusedImage, CIContext* ciContext, NSURL* outputURL,
+                            NSError** error) {
+    const auto fusedImageCpu = fusedImage.mapImage();
+    CVPixelBufferRef pixelBuffer = buildCVPixelBuffer<gls::pixel_fp16_4>(*fusedImageCpu);
+    if (!pixelBuffer) {
+        *error = rawProcessorError(RawProcessorErrorFailed, @"Can't allocate the fused image");
+        return NO;
+    }
+
+    [NSFileManager.defaultManager createDirectoryAtURL:outputURL.URLByDeletingLastPathComponent withIntermediateDirectories:YES
+                                            attributes:nil error:nil];
+
+    CGColorSpaceRef colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceDisplayP3);
+    CIImage* image = [CIImage imageWithCVPixelBuffer:pixelBuffer options:@{ kCIImageColorSpace: (__bridge id) colorSpace }];
+    BOOL written = [ciContext writeHEIFRepresentationOfImage:image toURL:outputURL format:kCIFormatRGBA8
+                                                  colorSpace:colorSpace options:@{} error:error];
+    CGColorSpaceRelease(colorSpace);
+    CVPixelBufferRelease(pixelBuffer);
+    return written;
+}
+
+@implementation BurstFusionQueue {
+    // Guards the job list and the scheduling state
+    std::mutex _mutex;
+
+    // Pending bursts, in arrival order: { identifier, frames (file names in the job's directory), output }
+    NSMutableArray<NSDictionary*>* _jobs;
+    BOOL _suspended;
+    BOOL _running;
+    BOOL _inBackground;
+    BOOL _expiring;
+    UIBackgroundTaskIdentifier _backgroundTask;
+
+    NSURL* _directory;
+    dispatch_queue_t _workQueue;
+    std::unique_ptr<gls::KeypointCache> _keypointCache;
+    CIContext* _ciContext;
+}
+
++ (BurstFusionQueue*) sharedQueue {
+    static BurstFusionQueue* queue = nil;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        queue = [[BurstFusionQueue alloc] init];
+    });
+    return queue;
+}
+
+- (instancetype) init
+{
+    if (self = [super init]) {
+        NSFileManager* fileManager = NSFileManager.defaultManager;
+        NSURL* applicationSupport = [fileManager URLsForDirectory:NSApplicationSupportDirectory inDomains:NSUserDomainMask].firstObject;
+        _directory = [applicationSupport URLByAppendingPathComponent:@"BurstFusion" isDirectory:YES];
+        [fileManager createDirectoryAtURL:_directory withIntermediateDirectories:YES attributes:nil error:nil];
+
+        _jobs = [[NSArray arrayWithContentsOfURL:[self jobsURL]] mutableCopy] ?: [NSMutableArray array];
+        _backgroundTask = UIBackgroundTaskInvalid;
+
+        // The features of the frames merged before an interruption are on disk, the next attempt skips their detection
+        _keypointCache = std::make_unique<gls::KeypointCache>(/*capacity=*/ 16, [[self keypointsURL].path UTF8String]);
+        _ciContext = [CIContext context];
+
+        _workQueue = dispatch_queue_create("com.glass-imaging.burst-fusion",
+                                           dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+
+        NSNotificationCenter* center = NSNotificationCenter.defaultCenter;
+        for (NSNotificationName name in @[ NSProcessInfoThermalStateDidChangeNotification, NSProcessInfoPowerStateDidChangeNotification,
+                                           UIDeviceBatteryStateDidChangeNotification, UIDeviceBatteryLevelDidChangeNotification ]) {
+            [center addObserver:self selector:@selector(conditionsDidChange:) name:name object:nil];
+        }
+        [center addObserver:self selector:@selector(didEnterBackground:) name:UIApplicationDidEnterBackgroundNotification object:nil];
+        [center addObserver:self selector:@selector(willEnterForeground:) name:UIApplicationWillEnterForegroundNotification object:nil];
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            UIDevice.currentDevice.batteryMonitoringEnabled = YES;
+            [self schedule];
+        });
+    }
+    return self;
+}
+
+- (NSURL*) jobsURL {
+    return [_directory URLByAppendingPathComponent:@"Jobs.plist"];
+}
+
+- (NSURL*) keypointsURL {
+    return [_directory URLByAppendingPathComponent:@"Keypoints" isDirectory:YES];
+}
+
+- (NSURL*) jobDirectory: (NSString*) identifier {
+    return [_directory URLByAppendingPathComponent:identifier isDirectory:YES];
+}
+
+// Called with _mutex held
+- (void) saveJobs {
+    NSError* error = nil;
+    if (![_jobs writeToURL:[self jobsURL] error:&error]) {
+        std::cerr << "BurstFusionQueue: can't save the jobs - " << error.localizedDescription.UTF8String << std::endl;
+    }
+}
+
+// Called with _mutex held
+- (BOOL) shouldRun {
+    if (_jobs.count == 0 || _suspended || _expiring) {
+        return NO;
+    }
+    // The GPU isn't available to suspended apps, in the background only the time granted to finish the burst is used
+    if (_inBackground && _backgroundTask == UIBackgroundTaskInvalid) {
+        return NO;
+    }
+    if (thermalScheduler().deferBackgroundFusion() || NSProcessInfo.processInfo.lowPowerModeEnabled) {
+        return NO;
+    }
+    // Without battery monitoring (e.g. on the Mac) the state is unknown, that is a device on power
+    UIDevice* device = UIDevice.currentDevice;
+    return device.batteryState != UIDeviceBatteryStateUnplugged || device.batteryLevel >= kBurstFusionMinBatteryLevel;
+}
+
+// Called with _mutex held
+- (void) endBackgroundTask {
+    if (_backgroundTask != UIBackgroundTaskInvalid) {
+        [UIApplication.sharedApplication endBackgroundTask:_backgroundTask];
+        _backgroundTask = UIBackgroundTaskInvalid;
+    }
+}
+
+- (void) schedule {
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (!_running && [self shouldRun]) {
+        _running = YES;
+        dispatch_async(_workQueue, ^{
+            [self runJobs];
+        });
+    }
+}
+
+- (void) conditionsDidChange: (NSNotification*) notification {
+    [self schedule];
+}
+
+- (void) didEnterBackground: (NSNotification*) notification {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _inBackground = YES;
+    if (_running && _backgroundTask == UIBackgroundTaskInvalid) {
+        // Try to finish the burst in flight, when the time runs out the work stops at the next frame
+        _backgroundTask = [UIApplication.sharedApplication beginBackgroundTaskWithName:@"BurstFusion" expirationHandler:^{
+            std::lock_guard<std::mutex> guard(self->_mutex);
+            self->_expiring = YES;
+            [self endBackgroundTask];
+        }];
+    }
+}
+
+- (void) willEnterForeground: (NSNotification*) notification {
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _inBackground = NO;
+        _expiring = NO;
+    }
+    [self schedule];
+}
+
+- (BOOL) isSuspended {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _suspended;
+}
+
+- (void) setSuspended: (BOOL) suspended {
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _suspended = suspended;
+    }
+    if (!suspended) {
+        [self schedule];
+    }
+}
+
+- (NSInteger) pendingBurstCount {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _jobs.count;
+}
+
+- (NSString*) enqueueBurst: (NSArray<NSURL*>*) dngFiles outputURL: (NSURL*) outputURL
+{
+    NSString* identifier = NSUUID.UUID.UUIDString;
+    NSURL* jobDirectory = [self jobDirectory:identifier];
+
+    // The capture's files can be cleaned up, the queue keeps its own copy in the capture order
+    NSFileManager* fileManager = NSFileManager.defaultManager;
+    [fileManager createDirectoryAtURL:jobDirectory withIntermediateDirectories:YES attributes:nil error:nil];
+    NSMutableArray<NSString*>* frames = [NSMutableArray array];
+    for (NSURL* file in dngFiles) {
+        NSString* frame = [NSString stringWithFormat:@"%03lu.dng", (unsigned long) frames.count];
+        NSError* error = nil;
+        if ([fileManager copyItemAtURL:file toURL:[jobDirectory URLByAppendingPathComponent:frame] error:&error]) {
+            [frames addObject:frame];
+        } else {
+            std::cerr << "BurstFusionQueue: can't copy " << file.path.UTF8String << " - " << error.localizedDescription.UTF8String << std::endl;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        [_jobs addObject:@{ @"identifier": identifier, @"frames": frames, @"output": homeRelativePath(outputURL) }];
+        [self saveJobs];
+    }
+    [self schedule];
+    return identifier;
+}
+
+// Returns NO without an error when interrupted, the job stays in the queue
+- (BOOL) fuseBurst: (NSDictionary*) job fusedImageURL: (NSURL**) fusedImageURL error: (NSError**) error
+{
+    NSURL* jobDirectory = [self jobDirectory:job[@"identifier"]];
+    NSArray<NSString*>* frames = job[@"frames"];
+    if (frames.count == 0) {
+        *error = rawProcessorError(RawProcessorErrorFailed, @"Empty burst");
+        return NO;
+    }
+
+    try {
+        // Leased for the burst, captures in the meantime get another converter
+        auto rawConverter = rawConverterPool()->checkout();
+        BurstMerger burstMerger(rawConverter->context(), _keypointCache.get());
+
+        auto t_start = std::chrono::high_resolution_clock::now();
+
+        for (NSString* frame in frames) {
+            {
+                std::lock_guard<std::mutex> guard(_mutex);
+                if (![self shouldRun]) {
+                    return NO;
+                }
+            }
+
+            gls::FrameArena::Scope frameArena(rawConverter->frameArena());
+
+            NSString* path = [jobDirectory URLByAppendingPathComponent:frame].path;
+            gls::tiff_metadata dng_metadata, exif_metadata;
+            const auto rawImage = gls::image<gls::luma_pixel_16>::read_dng_file(path.UTF8String, &dng_metadata, &exif_metadata);
+
+            auto demosaicParameters = CameraCalibrationRegistry::shared().getDemosaicParameters(*rawImage, rawConverter->xyz_rgb(),
+                                                                                                &dng_metadata, &exif_metadata);
+
+            const auto rgbImage = rawConverter->demosaic(*rawImage, demosaicParameters.get(), /*noiseReduction=*/ true, /*postProcess=*/ true);
+            burstMerger.addFrame(*rgbImage, demosaicParameters->rgb_cam[0]);
+        }
+
+        NSURL* outputURL = homeRelativeURL(job[@"output"]);
+        BOOL written = writeFusedImage(burstMerger.fusedImage(), _ciContext, outputURL, error);
+
+        auto elapsed_time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t_start).count();
+        std::cout << "Burst Fusion of " << frames.count << " frames: " << (int) elapsed_time_ms << "ms" << std::endl;
+
+        if (written) {
+            *fusedImageURL = outputURL;
+        }
+        return written;
+    } catch (const std::exception& e) {
+        *error = rawProcessorError(RawProcessorErrorFailed, [NSString stringWithUTF8String:e.what()]);
+        return NO;
+    }
+}
+
+// Runs on the work queue till the queue is drained or the conditions change
+- (void) runJobs {
+    while (true) {
+        NSDictionary* job = nil;
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            if (![self shouldRun]) {
+                _running = NO;
+                [self endBackgroundTask];
+                return;
+            }
+            job = _jobs.firstObject;
+        }
+
+        NSURL* fusedImageURL = nil;
+        NSError* error = nil;
+        if (![self fuseBurst:job fusedImageURL:&fusedImageURL error:&error] && !error) {
+            // Interrupted, picked up again once the conditions allow
+            continue;
+        }
+
+        // Done or failed for good, a burst that can't be merged isn't retried
+        NSFileManager* fileManager = NSFileManager.defaultManager;
+        [fileManager removeItemAtURL:[self jobDirectory:job[@"identifier"]] error:nil];
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            [_jobs removeObject:job];
+            [self saveJobs];
+
+            // The cached features are only needed by the pending bursts
+            if (_jobs.count == 0) {
+                for (NSURL* entry in [fileManager contentsOfDirectoryAtURL:[self keypointsURL] includingPropertiesForKeys:nil
+                                                                   options:0 error:nil]) {
+                    [fileManager removeItemAtURL:entry error:nil];
+                }
+            }
+        }
+
+        if (BurstFusionCompletionHandler completionHandler = self.completionHandler) {
+            completionHandler(job[@"identifier"], fusedImageURL, error);
+        }
+    }
+}
+
+@end
+
+// MARK: Live burst merge
+
+// The merge state of a BurstSession, used on the session's queue: the converter writes each frame and its
+// registration luma straight to the merger's textures and the frames share the reference's calibration
+struct LiveBurstMerge {
+    RawConverterPool::Lease rawConverter;
+    BurstMerger burstMerger;
+    std::unique_ptr<BurstCalibration> burstCalibration;
+
+    LiveBurstMerge() : rawConverter(rawConverterPool()->checkout()), burstMerger(rawConverter->context()) { }
+
+    void addFrame(CVPixelBufferRef rawPixelBuffer, RawMetadata* metadata) {
+        // On the capture's critical path, as the conversions
+        gls::QoSScope qos(gls::QoS::userInteractive);
+        gls::FrameArena::Scope frameArena(rawConverter->frameArena());
+
+        gls::tiff_metadata dng_metadata, exif_metadata;
+        rawImageMetadata(rawPixelBuffer, metadata, &dng_metadata, &exif_metadata);
+
+        CVPixelBufferLockBaseAddress(rawPixelBuffer, 0);
+        size_t width = CVPixelBufferGetWidth(rawPixelBuffer);
+        size_t height = CVPixelBufferGetHeight(rawPixelBuffer);
+        size_t bytesPerRow = CVPixelBufferGetBytesPerRow(rawPixelBuffer);
+        size_t stride = (int) bytesPerRow / sizeof(gls::luma_pixel_16);
+        gls::luma_pixel_16* pixelBufferData = (gls::luma_pixel_16*) CVPixelBufferGetBaseAddress(rawPixelBuffer);
+
+        auto rawImage = gls::image<gls::luma_pixel_16>((int) width, (int) height, (int) stride, std::span(pixelBufferData, stride * height));
+
+        if (!burstCalibration) {
+            burstCalibration = std::make_unique<BurstCalibration>(rawImage.size(), rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
+        }
+        const auto demosaicParameters = burstCalibration->frameParameters(rawImage.size(), &dng_metadata, &exif_metadata);
+
+        std::unique_ptr<gls::mtl_pixel_buffer_image_2d<gls::luma_pixel_16>> rawTexture;
+        if (gls::mtl_pixel_buffer_image_2d<gls::luma_pixel_16>::isSupported(rawPixelBuffer)) {
+            rawTexture = std::make_unique<gls::mtl_pixel_buffer_image_2d<gls::luma_pixel_16>>(rawConverter->context()->device(), rawPixelBuffer);
+        }
+
+        const auto targets = burstMerger.nextFrameTargets(rawImage.size());
+        RawConverter::ExtraOutputs extraOutputs;
+        extraOutputs.luma = targets.lumaImage;
+        extraOutputs.lumaWeights = demosaicParameters->rgb_cam[0];
+        rawConverter->setExtraOutputs(extraOutputs);
+
+        const auto result = rawTexture ? rawConverter->demosaicAsync(*rawTexture, demosaicParameters.get(), /*denoise=*/ true,
+                                                                     /*postProcess=*/ true, targets.rgbImage)
+                                       : rawConverter->demosaicAsync(rawImage, demosaicParameters.get(), /*denoise=*/ true,
+                                                                     /*postProcess=*/ true, targets.rgbImage);
+        rawConverter->setExtraOutputs(RawConverter::ExtraOutputs());
+        result.done.get();
+
+        CVPixelBufferUnlockBaseAddress(rawPixelBuffer, 0);
+
+        burstMerger.addConvertedFrame();
+    }
+};
+
+@implementation BurstSession {
+    dispatch_queue_t _queue;
+    NSURL* _outputURL;
+    BurstSessionCompletionHandler _completion;
+    std::atomic<bool> _cancelled;
+
+    // Only used on _queue. The reference is held till the second frame arrives, single frame captures aren't merged.
+    std::unique_ptr<LiveBurstMerge> _merge;
+    CVPixelBufferRef _referencePixelBuffer;
+    RawMetadata* _referenceMetadata;
+    NSError* _error;
+    BOOL _completed;
+    std::chrono::high_resolution_clock::time_point _lastFrameTime;
+}
+
+- (instancetype) initWithOutputURL: (NSURL*) outputURL completion: (BurstSessionCompletionHandler) completion
+{
+    if (self = [super init]) {
+        _outputURL = outputURL;
+        _completion = completion;
+        _queue = dispatch_queue_create("com.glass-imaging.burst-session",
+                                       dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_USER_INITIATED, 0));
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    CVPixelBufferRelease(_referencePixelBuffer);
+}
+
+// Called on _queue
+- (void) releaseFrames {
+    _merge.reset();
+    CVPixelBufferRelease(_referencePixelBuffer);
+    _referencePixelBuffer = nullptr;
+    _referenceMetadata = nil;
+}
+
+// Called on _queue
+- (void) addFrame: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata {
+    if (!_merge && !_referencePixelBuffer) {
+        _referencePixelBuffer = CVPixelBufferRetain(rawPixelBuffer);
+        _referenceMetadata = metadata;
+        return;
+    }
+
+    try {
+        if (!_merge) {
+            _merge = std::make_unique<LiveBurstMerge>();
+            _merge->addFrame(_referencePixelBuffer, _referenceMetadata);
+            CVPixelBufferRelease(_referencePixelBuffer);
+            _referencePixelBuffer = nullptr;
+            _referenceMetadata = nil;
+        }
+        _merge->addFrame(rawPixelBuffer, metadata);
+    } catch (const std::exception& e) {
+        // The burst can't be merged, the following frames are dropped
+        _error = rawProcessorError(RawProcessorErrorFailed, [NSString stringWithUTF8String:e.what()]);
+        [self releaseFrames];
+    }
+    _lastFrameTime = std::chrono::high_resolution_clock::now();
+}
+
+- (void) addRawPixelBuffer: (CVPixelBufferRef) rawPixelBuffer withMetadata: (RawMetadata*) metadata
+{
+    CVPixelBufferRetain(rawPixelBuffer);
+    dispatch_async(_queue, ^{
+        if (!self->_cancelled && !self->_completed && !self->_error) {
+            [self addFrame:rawPixelBuffer withMetadata:metadata];
+        }
+        CVPixelBufferRelease(rawPixelBuffer);
+    });
+}
+
+- (void) finish
+{
+    dispatch_async(_queue, ^{
+        if (self->_cancelled || self->_completed) {
+            return;
+        }
+        self->_completed = YES;
+
+        NSURL* fusedImageURL = nil;
+        NSError* error = self->_error;
+        if (!error && self->_merge) {
+            try {
+                if (writeFusedImage(self->_merge->burstMerger.fusedImage(), [CIContext context], self->_outputURL, &error)) {
+                    fusedImageURL = self->_outputURL;
+                }
+                std::cout << "Live Burst Fusion of " << self->_merge->burstMerger.frameCount() << " frames: "
+                          << (int) millisecondsSince(self->_lastFrameTime) << "ms after the last frame" << std::endl;
+            } catch (const std::exception& e) {
+                error = rawProcessorError(RawProcessorErrorFailed, [NSString stringWithUTF8String:e.what()]);
+            }
+        }
+        [self releaseFrames];
+        self->_completion(fusedImageURL, error);
+    });
+}
+
+- (void) cancel
+{
+    _cancelled = true;
+    dispatch_async(_queue, ^{
+        if (self->_completed) {
+            return;
+        }
+        self->_completed = YES;
+        [self releaseFrames];
+        self->_completion(nil, rawProcessorError(RawProcessorErrorCancelled, @"Burst cancelled"));
+    });
+}
+
+@end
@@ -0,0 +1,254 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef energyMeter_hpp
+#define energyMeter_hpp
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <dlfcn.h>
+#include <mach/mach.h>
+#include <TargetConditionals.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+// Cumulative energy, in joules, of the system or of the process depending on the meter's scope. The components a
+// source doesn't break down are NaN.
+struct EnergyReading {
+    double cpu = NAN;
+    double gpu = NAN;
+    double dram = NAN;
+    double ane = NAN;
+    double total = 0;
+
+    EnergyReading operator-(const EnergyReading& other) const {
+        return { cpu - other.cpu, gpu - other.gpu, dram - other.dram, ane - other.ane, total - other.total };
+    }
+
+    EnergyReading& operator+=(const EnergyReading& other) {
+        const auto add = [](double a, double b) { return std::isnan(a) ? b : std::isnan(b) ? a : a + b; };
+        cpu = add(cpu, other.cpu);
+        gpu = add(gpu, other.gpu);
+        dram = add(dram, other.dram);
+        ane = add(ane, other.ane);
+        total += other.total;
+        return *this;
+    }
+};
+
+// Energy counters for the benchmark's energy mode, see PipelineBenchmark:
+// - macOS: the "Energy Model" channels of IOReport, the SoC's CPU, GPU, DRAM and ANE energy of the whole system. The
+//   framework is private, its library is loaded at runtime and the meter is unavailable if that fails.
+// - Otherwise on Apple silicon, e.g. on device: the energy billed to the process by the kernel (task_energy of
+//   TASK_POWER_INFO_V2), not broken down and without the work of other processes, e.g. the GPU driver's.
+// The readings are cumulative since the meter's creation, intervals are the difference of two readings.
+class EnergyMeter {
+public:
+    enum class Scope { system, process };
+
+    virtual ~EnergyMeter() = default;
+
+    virtual EnergyReading read() = 0;
+
+    virtual const char* source() const = 0;
+
+    virtual Scope scope() const = 0;
+
+    // Nullptr when the platform has no usable energy counters
+    static std::unique_ptr<EnergyMeter> make();
+};
+
+#if TARGET_OS_OSX
+
+class IOReportEnergyMeter : public EnergyMeter {
+    typedef struct __IOReportSubscription* IOReportSubscriptionRef;
+
+    CFDictionaryRef (*_copyChannelsInGroup)(CFStringRef group, CFStringRef subgroup, uint64_t, uint64_t, uint64_t);
+    IOReportSubscriptionRef (*_createSubscription)(void*, CFMutableDictionaryRef desiredChannels,
+                                                   CFMutableDictionaryRef* subscribedChannels, uint64_t, CFTypeRef);
+    CFDictionaryRef (*_createSamples)(IOReportSubscriptionRef subscription, CFMutableDictionaryRef subscribedChannels,
+                                      CFTypeRef);
+    CFDictionaryRef (*_createSamplesDelta)(CFDictionaryRef previous, CFDictionaryRef current, CFTypeRef);
+    int64_t (*_simpleGetIntegerValue)(CFDictionaryRef channel, int32_t);
+    CFStringRef (*_channelGetChannelName)(CFDictionaryRef channel);
+    CFStringRef (*_channelGetUnitLabel)(CFDictionaryRef channel);
+
+    void* _library = nullptr;
+    CFMutableDictionaryRef _channels = nullptr;
+    CFMutableDictionaryRef _subscribedChannels = nullptr;
+    IOReportSubscriptionRef _subscription = nullptr;
+    CFDictionaryRef _firstSample = nullptr;
+
+    template <typename F>
+    bool resolve(F* function, const char* name) {
+        *function = (F) dlsym(_library, name);
+        return *function != nullptr;
+    }
+
+    static std::string string(CFStringRef s) {
+        char buffer[256];
+        return s && CFStringGetCString(s, buffer, sizeof(buffer), kCFStringEncodingUTF8) ? buffer : "";
+    }
+
+    static double joules(int64_t value, const std::string& unit) {
+        return unit == "mJ" ? value * 1e-3 : unit == "uJ" ? value * 1e-6 : unit == "nJ" ? value * 1e-9 : value;
+    }
+
+public:
+    IOReportEnergyMeter() = default;
+
+    ~IOReportEnergyMeter() {
+        for (CFTypeRef object : { (CFTypeRef) _firstSample, (CFTypeRef) _subscription, (CFTypeRef) _subscribedChannels,
+                                  (CFTypeRef) _channels }) {
+            if (object) {
+                CFRelease(object);
+            }
+        }
+        if (_library) {
+            dlclose(_library);
+        }
+    }
+
+    bool open() {
+        _library = dlopen("/usr/lib/libIOReport.dylib", RTLD_LAZY);
+        if (!_library || !resolve(&_copyChannelsInGroup, "IOReportCopyChannelsInGroup") ||
+            !resolve(&_createSubscription, "IOReportCreateSubscription") ||
+            !resolve(&_createSamples, "IOReportCreateSamples") ||
+            !resolve(&_createSamplesDelta, "IOReportCreateSamplesDelta") ||
+            !resolve(&_simpleGetIntegerValue, "IOReportSimpleGetIntegerValue") ||
+            !resolve(&_channelGetChannelName, "IOReportChannelGetChannelName") ||
+            !resolve(&_channelGetUnitLabel, "IOReportChannelGetUnitLabel")) {
+            return false;
+        }
+
+        CFDictionaryRef channels = _copyChannelsInGroup(CFSTR("Energy Model"), nullptr, 0, 0, 0);
+        if (!channels) {
+            return false;
+        }
+        _channels = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, CFDictionaryGetCount(channels), channels);
+        CFRelease(channels);
+
+        _subscription = _createSubscription(nullptr, _channels, &_subscribedChannels, 0, nullptr);
+        if (!_subscription) {
+            return false;
+        }
+        _firstSample = _createSamples(_subscription, _subscribedChannels, nullptr);
+        return _firstSample != nullptr;
+    }
+
+    EnergyReading read() override {
+        EnergyReading reading = { 0, 0, 0, 0, 0 };
+
+        CFDictionaryRef sample = _createSamples(_subscription, _subscribedChannels, nullptr);
+        if (!sample) {
+            return reading;
+        }
+        CFDictionaryRef delta = _createSamplesDelta(_firstSample, sample, nullptr);
+        CFRelease(sample);
+        if (!delta) {
+            return reading;
+        }
+
+        // The CPU energy is reported per cluster (e.g. "EACC_CPU Energy", "PACC0_CPU Energy"), the channels of the
+        // individual cores are part of them and left out
+        const auto samples = (CFArrayRef) CFDictionaryGetValue(delta, CFSTR("IOReportChannels"));
+        for (CFIndex i = 0; samples && i < CFArrayGetCount(samples); i++) {
+            const auto channel = (CFDictionaryRef) CFArrayGetValueAtIndex(samples, i);
+            const auto name = string(_channelGetChannelName(channel));
+            const double energy = joules(_simpleGetIntegerValue(channel, 0), string(_channelGetUnitLabel(channel)));
+            if (name.ends_with("CPU Energy")) {
+                reading.cpu += energy;
+            } else if (name == "GPU Energy") {
+                reading.gpu += energy;
+            } else if (name.starts_with("DRAM")) {
+                reading.dram += energy;
+            } else if (name.starts_with("ANE")) {
+                reading.ane += energy;
+            }
+        }
+        CFRelease(delta);
+
+        reading.total = reading.cpu + reading.gpu + reading.dram + reading.ane;
+        return reading;
+    }
+
+    const char* source() const override {
+        return "ioreport";
+    }
+
+    Scope scope() const override {
+        return Scope::system;
+    }
+};
+
+#endif /* TARGET_OS_OSX */
+
+#if defined(__arm64__)
+
+class TaskEnergyMeter : public EnergyMeter {
+    uint64_t _start = 0;
+
+    static bool taskEnergy(uint64_t* nanojoules) {
+        task_power_info_v2_data_t info;
+        mach_msg_type_number_t count = TASK_POWER_INFO_V2_COUNT;
+        if (task_info(mach_task_self(), TASK_POWER_INFO_V2, (task_info_t) &info, &count) != KERN_SUCCESS) {
+            return false;
+        }
+        *nanojoules = info.task_energy;
+        return true;
+    }
+
+public:
+    bool open() {
+        return taskEnergy(&_start);
+    }
+
+    EnergyReading read() override {
+        uint64_t energy = _start;
+        taskEnergy(&energy);
+        EnergyReading reading;
+        reading.total = (energy - _start) * 1e-9;
+        return reading;
+    }
+
+    const char* source() const override {
+        return "task_energy";
+    }
+
+    Scope scope() const override {
+        return Scope::process;
+    }
+};
+
+#endif /* defined(__arm64__) */
+
+inline std::unique_ptr<EnergyMeter> EnergyMeter::make() {
+#if TARGET_OS_OSX
+    if (auto meter = std::make_unique<IOReportEnergyMeter>(); meter->open()) {
+        return meter;
+    }
+#endif
+#if defined(__arm64__)
+    if (auto meter = std::make_unique<TaskEnergyMeter>(); meter->open()) {
+        return meter;
+    }
+#endif
+    return nullptr;
+}
+
+#endif /* energyMeter_hpp */
@@ -0,0 +1,273 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef kernelBenchmark_hpp
+#define kernelBenchmark_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gls_mtl.hpp"
+#include "gls_mtl_image.hpp"
+#include "demosaic_kernels.hpp"
+
+// Microbenchmark of single kernel wrappers on synthetic textures, for the A/B comparison of alternative kernel
+// implementations: each variant is timed over a number of dispatches with the GPU timestamps, and the outputs of
+// two variants are compared (max error and PSNR). A variant encodes the work of one iteration from the shared
+// synthetic inputs into its float4 output, e.g. a Kernel wrapper of demosaic_kernels.hpp constructed once by the
+// variant's factory. addStandardVariants() registers the common ones, new kernel variants are added next to them.
+//
+// The GPU time of an iteration is the sum of its kernels' timestamps, or the command buffer GPU time without
+// timestamp counters support.
+class KernelBenchmark {
+public:
+    struct Options {
+        int width = 4032;
+        int height = 3024;
+        int iterations = 20;
+        int warmup = 2;
+        uint32_t seed = 1;
+    };
+
+    // Smooth structure plus noise, in [0, 1]: float4 (e.g. YCbCr, linear RGB), float2 (gradients), float and raw
+    struct Inputs {
+        gls::mtl_image_2d<gls::pixel_float4>::unique_ptr image;
+        gls::mtl_image_2d<gls::pixel_float2>::unique_ptr gradient;
+        gls::mtl_image_2d<gls::pixel_float>::unique_ptr luma;
+        gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr raw;
+    };
+
+    typedef std::function<void(MetalContext* context, const Inputs& inputs,
+                               gls::mtl_image_2d<gls::pixel_float4>* output)> variant_type;
+    // Called once per benchmark, kernel construction and pipeline state compilation stay out of the timings
+    typedef std::function<variant_type(MetalContext* context)> factory_type;
+
+    struct Timing {
+        std::string name;
+        std::vector<double> gpuMs;
+        double p50 = 0;
+        double p95 = 0;
+        double mean = 0;
+    };
+
+    struct Comparison {
+        double maxError;
+        double psnr;
+    };
+
+private:
+    MetalContext* _context;
+    const Options _options;
+    Inputs _inputs;
+    std::map<std::string, factory_type> _factories;
+    std::map<std::string, variant_type> _variants;
+    std::map<std::string, gls::mtl_image_2d<gls::pixel_float4>::unique_ptr> _outputs;
+
+    template <typename T, typename F>
+    typename gls::mtl_image_2d<T>::unique_ptr syntheticImage(std::mt19937* generator, F pixel) {
+        auto image = std::make_unique<gls::mtl_image_2d<T>>(_context->device(), _options.width, _options.height);
+        std::uniform_real_distribution<float> noise(-0.05, 0.05);
+        const auto mapped = image->mapImage();
+        mapped->apply([&](T* p, int x, int y) {
+            const float u = (float) x / _options.width, v = (float) y / _options.height;
+            // Edges and gradients at a few scales
+            const float structure = 0.5f + 0.25f * std::sin(40 * u) * std::cos(30 * v) + 0.2f * ((x / 64 + y / 64) % 2 ? 1 : -1) * u;
+            *p = pixel(structure, [&]() { return noise(*generator); });
+        });
+        return image;
+    }
+
+    static double percentile(std::vector<double> samples, double p) {
+        std::sort(samples.begin(), samples.end());
+        const int rank = (int) std::ceil(p * samples.size());
+        return samples[std::clamp(rank - 1, 0, (int) samples.size() - 1)];
+    }
+
+    variant_type& variant(const std::string& name) {
+        auto entry = _variants.find(name);
+        if (entry == _variants.end()) {
+            const auto factory = _factories.find(name);
+            if (factory == _factories.end()) {
+                throw std::runtime_error("KernelBenchmark: unknown variant " + name);
+            }
+            entry = _variants.emplace(name, factory->second(_context)).first;
+        }
+        return entry->second;
+    }
+
+    gls::mtl_image_2d<gls::pixel_float4>* output(const std::string& name) {
+        auto& image = _outputs[name];
+        if (!image) {
+            image = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(_context->device(), _options.width, _options.height);
+        }
+        return image.get();
+    }
+
+public:
+    KernelBenchmark(MetalContext* context, const Options& options) : _context(context), _options(options) {
+        std::mt19937 generator(options.seed);
+        const auto unit = [](float v) { return std::clamp(v, 0.0f, 1.0f); };
+        _inputs.image = syntheticImage<gls::pixel_float4>(&generator, [&](float s, auto noise) {
+            return gls::pixel_float4 { unit(s + noise()), 0.5f * noise(), 0.5f * noise(), 1 };
+        });
+        _inputs.gradient = syntheticImage<gls::pixel_float2>(&generator, [&](float s, auto noise) {
+            return gls::pixel_float2 { noise(), noise() };
+        });
+        _inputs.luma = syntheticImage<gls::pixel_float>(&generator, [&](float s, auto noise) {
+            return gls::pixel_float { unit(s + noise()) };
+        });
+        _inputs.raw = syntheticImage<gls::luma_pixel_16>(&generator, [&](float s, auto noise) {
+            return gls::luma_pixel_16 { (uint16_t) (0xffff * unit(s + noise())) };
+        });
+    }
+
+    const Inputs& inputs() const {
+        return _inputs;
+    }
+
+    void add(const std::string& name, factory_type factory) {
+        _factories[name] = std::move(factory);
+    }
+
+    std::vector<std::string> names() const {
+        std::vector<std::string> names;
+        for (const auto& [name, factory] : _factories) {
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    // The noise model parameters are those of a mid ISO capture
+    void addStandardVariants() {
+        const gls::Vector<3> var_a = { 1e-4, 5e-5, 5e-5 };
+        const gls::Vector<3> var_b = { 2e-5, 1e-5, 1e-5 };
+
+        add("despeckleImage", [=](MetalContext* context) -> variant_type {
+            auto kernel = std::make_shared<despeckleImageKernel>(context);
+            return [=](MetalContext* context, const Inputs& inputs, gls::mtl_image_2d<gls::pixel_float4>* output) {
+                (*kernel)(context, *inputs.image, var_a, var_b, output);
+            };
+        });
+
+        add("denoiseImage", [=](MetalContext* context) -> variant_type {
+            auto kernel = std::make_shared<denoiseImageKernel>(context);
+            return [=](MetalContext* context, const Inputs& inputs, gls::mtl_image_2d<gls::pixel_float4>* output) {
+                (*kernel)(context, *inputs.image, *inputs.gradient, var_a, var_b, /*thresholdMultipliers=*/ { 1, 1, 1 },
+                          /*chromaBoost=*/ 1, /*gradientBoost=*/ 1, /*gradientThreshold=*/ 1, output);
+            };
+        });
+
+        // The denoiser without the gradient guidance, e.g. against denoiseImage
+        add("denoiseImage/noGradient", [=](MetalContext* context) -> variant_type {
+            auto kernel = std::make_shared<denoiseImageKernel>(context);
+            return [=](MetalContext* context, const Inputs& inputs, gls::mtl_image_2d<gls::pixel_float4>* output) {
+                (*kernel)(context, *inputs.image, *inputs.gradient, var_a, var_b, /*thresholdMultipliers=*/ { 1, 1, 1 },
+                          /*chromaBoost=*/ 1, /*gradientBoost=*/ 0, /*gradientThreshold=*/ 1, output);
+            };
+        });
+    }
+
+    // Warmup and timed iterations, each iteration in its own command buffer
+    Timing time(const std::string& name) {
+        auto& encode = variant(name);
+        auto outputImage = output(name);
+
+        const bool timestamps = _context->isProfiling() || _context->enableProfiling();
+        Timing timing = { name };
+        for (int i = 0; i < _options.warmup + _options.iterations; i++) {
+            _context->clearKernelProfiles();
+            const double gpuTimeStart = _context->gpuTime();
+
+            encode(_context, _inputs, outputImage);
+            _context->waitForCompletion();
+
+            if (i < _options.warmup) {
+                continue;
+            }
+            double gpuMs = 0;
+            if (timestamps) {
+                for (const auto& profile : _context->kernelProfiles()) {
+                    gpuMs += profile.gpuTimeMs;
+                }
+            } else {
+                gpuMs = 1000 * (_context->gpuTime() - gpuTimeStart);
+            }
+            timing.gpuMs.push_back(gpuMs);
+        }
+
+        timing.p50 = percentile(timing.gpuMs, 0.5);
+        timing.p95 = percentile(timing.gpuMs, 0.95);
+        for (const auto ms : timing.gpuMs) {
+            timing.mean += ms / timing.gpuMs.size();
+        }
+        return timing;
+    }
+
+    // Of the outputs of the last runs of the two variants, over all four channels. A is the reference.
+    Comparison compare(const std::string& a, const std::string& b) {
+        const auto imageA = output(a)->mapImage();
+        const auto imageB = output(b)->mapImage();
+
+        double maxError = 0, squaredError = 0;
+        for (int y = 0; y < imageA->height; y++) {
+            for (int x = 0; x < imageA->width; x++) {
+                const auto& pa = (*imageA)[y][x];
+                const auto& pb = (*imageB)[y][x];
+                for (int c = 0; c < 4; c++) {
+                    const double diff = (double) pa[c] - (double) pb[c];
+                    maxError = std::max(maxError, std::abs(diff));
+                    squaredError += diff * diff;
+                }
+            }
+        }
+        const double mse = squaredError / (4.0 * imageA->width * imageA->height);
+        return { maxError, mse > 0 ? 10 * std::log10(1 / mse) : std::numeric_limits<double>::infinity() };
+    }
+
+    static void print(const Timing& timing, std::ostream& os = std::cout) {
+        os << std::setw(32) << std::left << timing.name << std::right << std::fixed << std::setprecision(3)
+           << " p50: " << std::setw(8) << timing.p50 << "ms p95: " << std::setw(8) << timing.p95
+           << "ms mean: " << std::setw(8) << timing.mean << "ms over " << timing.gpuMs.size() << " dispatches" << std::endl;
+    }
+
+    // Times variant a, and b if given: b is then compared against a
+    void run(const std::string& a, const std::string& b = "", std::ostream& os = std::cout) {
+        os << "Kernel benchmark, " << _options.width << " x " << _options.height << std::endl;
+        const auto timingA = time(a);
+        print(timingA, os);
+        if (b.empty()) {
+            return;
+        }
+        const auto timingB = time(b);
+        print(timingB, os);
+
+        const auto comparison = compare(a, b);
+        os << b << " vs " << a << ": " << std::setprecision(2) << timingA.p50 / timingB.p50 << "x, max error: "
+           << std::setprecision(6) << comparison.maxError << ", PSNR: " << std::setprecision(2) << comparison.psnr
+           << "dB" << std::endl;
+    }
+};
+
+#endif /* kernelBenchmark_hpp */
@@ -0,0 +1,207 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef parameterSweep_hpp
+#define parameterSweep_hpp
+
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "raw_converter.hpp"
+#include "demosaic_kernels.hpp"
+
+// Parameter sweep for the calibration and the tuning of the denoiser: one raw image is run through every combination
+// of the values of the parameter axes, and each result is scored against a reference rendering with
+// imageQualityKernel, e.g. a base ISO capture of the same chart.
+//
+// The runs go through the re-rendering cache of the converter: consecutive combinations share the work upstream of
+// the first parameter which differs, a change of the tone mapping only redoes the post processing and a change of
+// the DenoiseParameters of a level only denoises the levels from it down, see RawConverter::setRerenderCache. The
+// axes are expanded with the last one varying the fastest, list the downstream parameters last. The scores are
+// reduced on the GPU in stream, the CPU waits once per batch of runs.
+class ParameterSweep {
+public:
+    struct Axis {
+        std::string name;
+        std::vector<float> values;
+        std::function<void(DemosaicParameters* demosaicParameters, float value)> apply;
+    };
+
+    struct Result {
+        std::vector<float> values;  // One per axis
+        imageQualityKernel::Score score;
+    };
+
+private:
+    RawConverter* _rawConverter;
+    MetalContext* _context;
+    imageQualityKernel _imageQuality;
+    std::vector<Axis> _axes;
+
+    gls::mtl_image_2d<gls::luma_pixel_16>::unique_ptr _rawImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _referenceImage;
+    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr _outputImage;
+
+    template <typename T>
+    void allocate(typename gls::mtl_image_2d<T>::unique_ptr* image, const gls::size& size) {
+        if (!*image || (*image)->size() != size) {
+            *image = std::make_unique<gls::mtl_image_2d<T>>(_context->device(), size);
+        }
+    }
+
+public:
+    ParameterSweep(RawConverter* rawConverter) :
+        _rawConverter(rawConverter),
+        _context(rawConverter->context()),
+        _imageQuality(_context) { }
+
+    void addAxis(Axis axis) {
+        if (axis.values.empty()) {
+            throw std::runtime_error("ParameterSweep: no values for " + axis.name);
+        }
+        _axes.push_back(std::move(axis));
+    }
+
+    // Axis of a DenoiseParameters field of a pyramid level: luma, chroma, chromaBoost, gradientBoost,
+    // gradientThreshold or sharpening
+    static Axis denoiseAxis(const std::string& field, int level, std::vector<float> values) {
+        static const std::vector<std::pair<std::string, float DenoiseParameters::*>> fields = {
+            { "luma", &DenoiseParameters::luma },
+            { "chroma", &DenoiseParameters::chroma },
+            { "chromaBoost", &DenoiseParameters::chromaBoost },
+            { "gradientBoost", &DenoiseParameters::gradientBoost },
+            { "gradientThreshold", &DenoiseParameters::gradientThreshold },
+            { "sharpening", &DenoiseParameters::sharpening },
+        };
+        const auto entry = std::find_if(fields.begin(), fields.end(), [&](const auto& f) { return f.first == field; });
+        if (entry == fields.end()) {
+            throw std::runtime_error("ParameterSweep: unknown denoise parameter " + field);
+        }
+        if (level < 0 || level >= 5) {
+            throw std::runtime_error("ParameterSweep: no pyramid level " + std::to_string(level));
+        }
+        const auto member = entry->second;
+        return {
+            field + "." + std::to_string(level), std::move(values),
+            [member, level](DemosaicParameters* demosaicParameters, float value) {
+                demosaicParameters->denoiseParameters[level].*member = value;
+            }
+        };
+    }
+
+    size_t combinations() const {
+        size_t count = _axes.empty() ? 0 : 1;
+        for (const auto& axis : _axes) {
+            count *= axis.values.size();
+        }
+        return count;
+    }
+
+    // The reference the runs are scored against, the same size as the swept image
+    void renderReference(const gls::image<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters) {
+        allocate<gls::pixel_float4>(&_referenceImage, rawImage.size());
+
+        auto parameters = demosaicParameters;
+        _rawConverter->demosaicAsync(rawImage, &parameters, /*noiseReduction=*/ true, /*postProcess=*/ true,
+                                     _referenceImage.get()).done.get();
+    }
+
+    // Runs every combination of the axes on rawImage, starting from demosaicParameters. Returns the results sorted
+    // by SSIM, the best first.
+    std::vector<Result> run(const gls::image<gls::luma_pixel_16>& rawImage, const DemosaicParameters& demosaicParameters,
+                            int batchSize = 64) {
+        if (!_referenceImage || _referenceImage->size() != rawImage.size()) {
+            throw std::runtime_error("ParameterSweep: the reference doesn't match the image size");
+        }
+        const size_t count = combinations();
+        batchSize = std::max(batchSize, 1);
+
+        // Uploaded once, the runs only hash it
+        allocate<gls::luma_pixel_16>(&_rawImage, rawImage.size());
+        _rawImage->copyPixelsFrom(rawImage);
+        allocate<gls::pixel_float4>(&_outputImage, rawImage.size());
+        _imageQuality.reserve(_context, batchSize);
+
+        const bool rerenderCache = _rawConverter->rerenderCache();
+        _rawConverter->setRerenderCache(true);
+
+        std::vector<Result> results;
+        results.reserve(count);
+        for (size_t start = 0; start < count; start += batchSize) {
+            const int batch = (int) std::min((size_t) batchSize, count - start);
+
+            // The pipeline updates the parameters while the runs are encoded, each one has its own copy
+            std::vector<DemosaicParameters> parameters;
+            parameters.reserve(batch);
+            for (int slot = 0; slot < batch; slot++) {
+                Result result = { std::vector<float>(_axes.size()), {} };
+                auto& p = parameters.emplace_back(demosaicParameters);
+
+                // Mixed radix combination index, the last axis varies the fastest
+                size_t index = start + slot;
+                for (int a = (int) _axes.size() - 1; a >= 0; a--) {
+                    const auto& axis = _axes[a];
+                    result.values[a] = axis.values[index % axis.values.size()];
+                    index /= axis.values.size();
+                }
+                for (int a = 0; a < _axes.size(); a++) {
+                    _axes[a].apply(&p, result.values[a]);
+                }
+
+                _rawConverter->demosaicAsync(*_rawImage, &p, /*noiseReduction=*/ true, /*postProcess=*/ true, _outputImage.get());
+                _imageQuality(_context, *_outputImage, *_referenceImage, slot);
+                _context->submit();
+
+                results.push_back(std::move(result));
+            }
+            _context->waitForCompletion();
+
+            for (int slot = 0; slot < batch; slot++) {
+                results[start + slot].score = _imageQuality.score(slot);
+            }
+            std::cout << "ParameterSweep: " << start + batch << " of " << count << " combinations" << std::endl;
+        }
+
+        _rawConverter->setRerenderCache(rerenderCache);
+
+        std::stable_sort(results.begin(), results.end(), [](const Result& a, const Result& b) {
+            return a.score.ssim > b.score.ssim;
+        });
+        return results;
+    }
+
+    void writeCSV(std::ostream& os, const std::vector<Result>& results) const {
+        for (const auto& axis : _axes) {
+            os << axis.name << ",";
+        }
+        os << "psnr,ssim" << std::endl;
+        for (const auto& result : results) {
+            for (const auto value : result.values) {
+                os << value << ",";
+            }
+            os << std::fixed << std::setprecision(3) << result.score.psnr << "," << std::setprecision(5)
+               << result.score.ssim << std::defaultfloat << std::endl;
+        }
+    }
+};
+
+#endif /* parameterSweep_hpp */
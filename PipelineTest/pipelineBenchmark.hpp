@@ -0,0 +1,614 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef pipelineBenchmark_hpp
+#define pipelineBenchmark_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <mach/mach.h>
+
+#include "gls_tiff_metadata.hpp"
+#include "raw_converter.hpp"
+#include "demosaic_kernels.hpp"
+#include "dng_decoder.hpp"
+
+#include "CameraCalibration.hpp"
+
+#include "SURF.hpp"
+#include "Homography.hpp"
+
+#include "syntheticRaw.hpp"
+#include "energyMeter.hpp"
+
+// Performance regression benchmark: every DNG of a fixed corpus is run through the demosaic, the post processing, the
+// SURF detection, the matching against the previous frame of the corpus and FindHomography, for a number of warm
+// iterations after the warmup ones. The corpus can be synthetic, see SyntheticRawGenerator, for numbers reproducible
+// on any machine. The per-stage wall, CPU and GPU timings (p50/p95), the memory high-water mark
+// and the throughput are written as JSON for the CI to track.
+//
+// The GPU time of a stage is the sum of its kernels' timestamps, null when the device doesn't support the
+// timestamp counters. The CPU time is the process' CPU time, so it includes the work of the TaskScheduler workers.
+//
+// With a list of presets the corpus is run once per PipelinePreset, the stages are reported as <preset>/<stage>.
+// The quality option adds the PSNR of every corpus frame against the fp32, full resolution gradients baseline of
+// RawConverter::validatePrecision, for each preset, and the repeatability of the keypoints detected with the
+// half precision SURF scale space against the fp32 one.
+//
+// The energy option samples the energy counters of EnergyMeter around every stage and every measured iteration, and
+// reports the joules per image of each configuration and the joules of each stage. A faster kernel keeping the GPU at
+// higher clocks can cost more energy per image. The system wide counters include the idle power of the machine, run
+// the energy mode on an otherwise quiet system.
+class PipelineBenchmark {
+public:
+    struct Options {
+        int iterations = 10;
+        int warmup = 1;
+        // Empty runs the converter's current configuration
+        std::vector<PipelinePreset::Name> presets;
+        bool quality = false;
+        bool energy = false;
+    };
+
+private:
+    struct CorpusFrame {
+        std::string name;
+        gls::tiff_metadata dng_metadata, exif_metadata;
+        gls::image<gls::luma_pixel_16>::unique_ptr rawImage;
+        const CameraCalibration<5>* calibration;
+    };
+
+    struct Samples {
+        std::vector<double> wallMs;
+        std::vector<double> cpuMs;
+        std::vector<double> gpuMs;
+        std::vector<double> joules;
+    };
+
+    // Energy of the measured iterations of a configuration
+    struct EnergySamples {
+        std::string configuration;
+        int images = 0;
+        EnergyReading energy;
+    };
+
+    struct FrameFeatures {
+        gls::size size;
+        std::vector<KeyPoint> keypoints;
+        gls::image<float>::unique_ptr descriptors;
+    };
+
+    RawConverter* _rawConverter;
+    MetalContext* _context;
+    const Options _options;
+
+    convertToGrayscale _convertToGrayscale;
+
+    std::vector<CorpusFrame> _corpus;
+    // One detector and luma texture per image size of the corpus
+    std::map<std::pair<int, int>, std::unique_ptr<gls::SURF>> _surf;
+    std::map<std::pair<int, int>, gls::mtl_image_2d<float>::unique_ptr> _lumaImages;
+
+    // Stages in report order
+    std::vector<std::string> _stageNames;
+    std::map<std::string, Samples> _stages;
+    std::string _stagePrefix;
+    bool _gpuTiming = false;
+    bool _recording = false;
+
+    // PSNR of each corpus frame per configuration, in corpus order
+    std::vector<std::pair<std::string, std::vector<double>>> _quality;
+    // Of the half precision SURF scale space, in corpus order
+    std::vector<double> _surfRepeatability;
+
+    // Null without the energy option or without usable counters
+    std::unique_ptr<EnergyMeter> _energyMeter;
+    std::vector<EnergySamples> _energy;
+
+    size_t _peakFootprint = 0;
+    size_t _peakDeviceAllocated = 0;
+    double _measuredMs = 0;
+
+    static double cpuTimeMs() {
+        timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1.0e3 + ts.tv_nsec / 1.0e6;
+    }
+
+    // Current and peak physical footprint of the process, the figure jetsam enforces on iOS
+    static std::pair<size_t, size_t> physicalFootprint() {
+        task_vm_info_data_t vmInfo;
+        mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+        if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t) &vmInfo, &count) != KERN_SUCCESS) {
+            return { 0, 0 };
+        }
+        return { (size_t) vmInfo.phys_footprint, (size_t) vmInfo.ledger_phys_footprint_peak };
+    }
+
+    void sampleMemory() {
+        const auto [footprint, peakFootprint] = physicalFootprint();
+        _peakFootprint = std::max(_peakFootprint, std::max(footprint, peakFootprint));
+        _peakDeviceAllocated = std::max(_peakDeviceAllocated, (size_t) _context->device()->currentAllocatedSize());
+    }
+
+    // Times process() as the named stage, the GPU work it submits must be complete when it returns
+    template <typename F>
+    void stage(const std::string& stageName, F process) {
+        if (_gpuTiming) {
+            _context->clearKernelProfiles();
+        }
+        // The counters are read outside of the timed interval
+        const auto energyStart = _energyMeter ? _energyMeter->read() : EnergyReading();
+        const auto wallStart = std::chrono::steady_clock::now();
+        const double cpuStart = cpuTimeMs();
+
+        process();
+
+        const double cpuEnd = cpuTimeMs();
+        const auto wallEnd = std::chrono::steady_clock::now();
+        const auto energyEnd = _energyMeter ? _energyMeter->read() : EnergyReading();
+
+        sampleMemory();
+        if (!_recording) {
+            return;
+        }
+        const auto name = _stagePrefix + stageName;
+        if (!_stages.contains(name)) {
+            _stageNames.push_back(name);
+        }
+        auto& samples = _stages[name];
+        samples.wallMs.push_back(std::chrono::duration<double, std::milli>(wallEnd - wallStart).count());
+        samples.cpuMs.push_back(cpuEnd - cpuStart);
+        if (_gpuTiming) {
+            double gpuMs = 0;
+            for (const auto& profile : _context->kernelProfiles()) {
+                gpuMs += profile.gpuTimeMs;
+            }
+            samples.gpuMs.push_back(gpuMs);
+        }
+        if (_energyMeter) {
+            samples.joules.push_back((energyEnd - energyStart).total);
+        }
+    }
+
+    void addCorpusFrame(CorpusFrame&& frame) {
+        std::string model, lens_model;
+        getValue(frame.dng_metadata, TIFFTAG_MODEL, &model);
+        getValue(frame.exif_metadata, EXIFTAG_LENSMODEL, &lens_model);
+        frame.calibration = CameraCalibrationRegistry::shared().find(model, lens_model);
+        if (!frame.calibration) {
+            throw std::runtime_error("PipelineBenchmark: unknown device " + model + " for " + frame.name);
+        }
+        _corpus.push_back(std::move(frame));
+    }
+
+    gls::SURF* surf(const gls::size& size) {
+        const auto key = std::pair { size.width, size.height };
+        auto& instance = _surf[key];
+        if (!instance) {
+            instance = gls::SURF::makeInstance(_context, size.width, size.height,
+                                               /*max_features=*/ 1500, /*nOctaves=*/ 4, /*nOctaveLayers=*/ 2, /*hessianThreshold=*/ 0.02);
+            _lumaImages[key] = std::make_unique<gls::mtl_image_2d<float>>(_context->device(), size);
+        }
+        return instance.get();
+    }
+
+    void runFrame(CorpusFrame& frame, std::optional<FrameFeatures>* previous) {
+        auto demosaicParameters = frame.calibration->getDemosaicParameters(
+            *frame.rawImage, _rawConverter->xyz_rgb(), &frame.dng_metadata, &frame.exif_metadata);
+        _rawConverter->preset().apply(demosaicParameters.get());
+
+        gls::mtl_image_2d<gls::pixel_float4>* linearImage = nullptr;
+        stage("demosaic", [&]() {
+            linearImage = _rawConverter->demosaic(*frame.rawImage, demosaicParameters.get(), /*denoise=*/ true, /*postProcess=*/ false);
+        });
+
+        // The converter's textures are reused by the post processing, keep a copy of the linear image
+        gls::image<gls::pixel_float4> linearCopy(linearImage->width, linearImage->height);
+        {
+            const auto mapped = linearImage->mapImage();
+            linearCopy.apply([&](gls::pixel_float4* p, int x, int y) { *p = (*mapped)[y][x]; });
+        }
+
+        const auto size = linearImage->size();
+        auto detector = surf(size);
+        auto lumaImage = _lumaImages[{ size.width, size.height }].get();
+
+        FrameFeatures features = { size, {}, nullptr };
+        stage("surf_detect", [&]() {
+            _convertToGrayscale(_context, *linearImage, lumaImage, demosaicParameters->rgb_cam[0]);
+            _context->waitForCompletion();
+            detector->detectAndCompute(*lumaImage->mapImage(), &features.keypoints, &features.descriptors);
+        });
+
+        stage("postprocess", [&]() {
+            _rawConverter->postprocess(linearCopy, demosaicParameters.get());
+        });
+
+        if (*previous && (*previous)->size == size && (*previous)->descriptors && features.descriptors) {
+            gls::frame_vector<std::pair<Point2f, Point2f>> matches;
+            stage("surf_match", [&]() {
+                matches = detector->findMatches(*(*previous)->descriptors, (*previous)->keypoints,
+                                                *features.descriptors, features.keypoints);
+            });
+
+            stage("homography", [&]() {
+                std::vector<int> inliers;
+                gls::FindHomography(matches, /*threshold=*/ 1, /*max_iterations=*/ 2000, &inliers);
+            });
+        }
+        *previous = std::move(features);
+    }
+
+    static void writeStatistics(std::ostream& os, std::vector<double> samples) {
+        if (samples.empty()) {
+            os << "null";
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        // Nearest rank percentiles
+        const auto percentile = [&](double p) {
+            const int rank = (int) std::ceil(p * samples.size());
+            return samples[std::clamp(rank - 1, 0, (int) samples.size() - 1)];
+        };
+        double sum = 0;
+        for (const auto s : samples) {
+            sum += s;
+        }
+        os << "{ \"p50\": " << percentile(0.5) << ", \"p95\": " << percentile(0.95)
+           << ", \"mean\": " << sum / samples.size() << ", \"min\": " << samples.front()
+           << ", \"max\": " << samples.back() << " }";
+    }
+
+    static std::string jsonString(const std::string& s) {
+        std::string result = "\"";
+        for (const char c : s) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+            }
+            result += c;
+        }
+        return result + "\"";
+    }
+
+public:
+    PipelineBenchmark(RawConverter* rawConverter, const Options& options) :
+        _rawConverter(rawConverter),
+        _context(rawConverter->context()),
+        _options(options),
+        _convertToGrayscale(_context) { }
+
+    // The corpus files are decoded once, the decoding is not part of the benchmark
+    void addCorpusFile(const std::filesystem::path& path) {
+        CorpusFrame frame;
+        frame.name = path.filename().string();
+        frame.rawImage = DNGDecoder::read(path.string(), &frame.dng_metadata, &frame.exif_metadata);
+        addCorpusFrame(std::move(frame));
+    }
+
+    // Consecutive frames of a burst are matched against each other like those of a real burst
+    void addSyntheticBurst(const SyntheticRawGenerator& generator, int frames) {
+        const auto& parameters = generator.parameters();
+        auto burst = generator.burst(frames);
+        for (int i = 0; i < burst.size(); i++) {
+            CorpusFrame frame;
+            frame.name = "synthetic_" + std::to_string(parameters.width) + "x" + std::to_string(parameters.height) +
+                         "_iso" + std::to_string(parameters.iso) + "_" + std::to_string(i);
+            frame.dng_metadata = std::move(burst[i].dng_metadata);
+            frame.exif_metadata = std::move(burst[i].exif_metadata);
+            frame.rawImage = std::move(burst[i].rawImage);
+            addCorpusFrame(std::move(frame));
+        }
+    }
+
+    // Fraction of the reference keypoints with a keypoint of the same octave within a pixel in keypoints
+    static double repeatability(const std::vector<KeyPoint>& reference, const std::vector<KeyPoint>& keypoints) {
+        if (reference.empty()) {
+            return 1;
+        }
+        int repeated = 0;
+        for (const auto& r : reference) {
+            for (const auto& k : keypoints) {
+                const float dx = k.pt.x - r.pt.x;
+                const float dy = k.pt.y - r.pt.y;
+                if (k.octave == r.octave && dx * dx + dy * dy <= 1) {
+                    repeated++;
+                    break;
+                }
+            }
+        }
+        return repeated / (double) reference.size();
+    }
+
+    // Not timed: detects the keypoints of every corpus frame with the fp32 and the fp16 scale space
+    void measureSurfRepeatability() {
+        _surfRepeatability.clear();
+        for (auto& frame : _corpus) {
+            auto demosaicParameters = frame.calibration->getDemosaicParameters(
+                *frame.rawImage, _rawConverter->xyz_rgb(), &frame.dng_metadata, &frame.exif_metadata);
+            _rawConverter->preset().apply(demosaicParameters.get());
+            const auto linearImage = _rawConverter->demosaic(*frame.rawImage, demosaicParameters.get(), /*denoise=*/ true,
+                                                             /*postProcess=*/ false);
+            const auto size = linearImage->size();
+            const auto detector = surf(size);
+            auto lumaImage = _lumaImages[{ size.width, size.height }].get();
+            _convertToGrayscale(_context, *linearImage, lumaImage, demosaicParameters->rgb_cam[0]);
+            _context->waitForCompletion();
+            const auto luma = lumaImage->mapImage();
+
+            const auto halfDetector = gls::SURF::makeInstance(_context, size.width, size.height,
+                                                              /*max_features=*/ 1500, /*nOctaves=*/ 4, /*nOctaveLayers=*/ 2,
+                                                              /*hessianThreshold=*/ 0.02, gls::SURF::DescriptorType::SURF,
+                                                              /*halfPrecisionScaleSpace=*/ true);
+            std::vector<KeyPoint> keypoints, halfKeypoints;
+            detector->detectAndCompute(*luma, &keypoints, nullptr);
+            halfDetector->detectAndCompute(*luma, &halfKeypoints, nullptr);
+            _surfRepeatability.push_back(repeatability(keypoints, halfKeypoints));
+        }
+    }
+
+    // Not timed, validatePrecision runs the pipeline twice and reallocates the textures
+    void measureQuality(const std::string& configuration) {
+        std::vector<double> psnr;
+        for (auto& frame : _corpus) {
+            auto demosaicParameters = frame.calibration->getDemosaicParameters(
+                *frame.rawImage, _rawConverter->xyz_rgb(), &frame.dng_metadata, &frame.exif_metadata);
+            _rawConverter->preset().apply(demosaicParameters.get());
+            psnr.push_back(_rawConverter->validatePrecision(*frame.rawImage, *demosaicParameters));
+        }
+        _quality.push_back({ configuration, std::move(psnr) });
+    }
+
+    void runIterations(const std::string& configuration) {
+        EnergySamples energy = { configuration };
+        for (int iteration = 0; iteration < _options.warmup + _options.iterations; iteration++) {
+            _recording = iteration >= _options.warmup;
+
+            const auto energyStart = _energyMeter ? _energyMeter->read() : EnergyReading();
+            const auto start = std::chrono::steady_clock::now();
+            std::optional<FrameFeatures> previous;
+            for (auto& frame : _corpus) {
+                runFrame(frame, &previous);
+            }
+            const auto end = std::chrono::steady_clock::now();
+
+            if (_recording) {
+                _measuredMs += std::chrono::duration<double, std::milli>(end - start).count();
+                if (_energyMeter) {
+                    energy.energy += _energyMeter->read() - energyStart;
+                    energy.images += (int) _corpus.size();
+                }
+            }
+            std::cout << (_recording ? "Iteration " : "Warmup iteration ") << iteration << ": "
+                      << std::chrono::duration<double, std::milli>(end - start).count() << "ms" << std::endl;
+        }
+        if (_energyMeter) {
+            _energy.push_back(std::move(energy));
+        }
+    }
+
+    void run() {
+        if (_corpus.empty()) {
+            throw std::runtime_error("PipelineBenchmark: empty corpus");
+        }
+        _gpuTiming = _context->isProfiling() || _context->enableProfiling();
+        if (_options.energy && !_energyMeter) {
+            _energyMeter = EnergyMeter::make();
+            if (!_energyMeter) {
+                std::cout << "PipelineBenchmark: no energy counters on this platform, energy not measured" << std::endl;
+            }
+        }
+
+        _measuredMs = 0;
+        _quality.clear();
+        _surfRepeatability.clear();
+        _energy.clear();
+        if (_options.presets.empty()) {
+            runIterations("current");
+            if (_options.quality) {
+                measureQuality("current");
+                measureSurfRepeatability();
+            }
+            return;
+        }
+        const auto savedPreset = _rawConverter->preset();
+        for (const auto name : _options.presets) {
+            _stagePrefix = std::string(PipelinePreset::nameString(name)) + "/";
+            std::cout << "Preset " << PipelinePreset::nameString(name) << std::endl;
+            _rawConverter->setPreset(PipelinePreset::named(name));
+            runIterations(PipelinePreset::nameString(name));
+            if (_options.quality) {
+                measureQuality(PipelinePreset::nameString(name));
+            }
+        }
+        _stagePrefix.clear();
+        _rawConverter->setPreset(savedPreset);
+        // The scale space precision doesn't depend on the preset
+        if (_options.quality) {
+            measureSurfRepeatability();
+        }
+    }
+
+    void writeJSON(std::ostream& os) const {
+        double megapixels = 0;
+        for (const auto& frame : _corpus) {
+            megapixels += frame.rawImage->width * frame.rawImage->height / 1.0e6;
+        }
+        const double seconds = _measuredMs / 1.0e3;
+        // The corpus runs once per preset
+        const int runs = _options.iterations * std::max((int) _options.presets.size(), 1);
+        const int images = (int) _corpus.size() * runs;
+
+        os << std::fixed << std::setprecision(3);
+        os << "{\n";
+        os << "  \"device\": " << jsonString(_context->device()->name()->utf8String()) << ",\n";
+        os << "  \"iterations\": " << _options.iterations << ",\n";
+        os << "  \"warmup\": " << _options.warmup << ",\n";
+        if (!_options.presets.empty()) {
+            os << "  \"presets\": [";
+            for (int i = 0; i < _options.presets.size(); i++) {
+                os << (i > 0 ? ", " : "") << jsonString(PipelinePreset::nameString(_options.presets[i]));
+            }
+            os << "],\n";
+        }
+        os << "  \"gpu_timing\": " << (_gpuTiming ? "true" : "false") << ",\n";
+
+        os << "  \"corpus\": [\n";
+        for (int i = 0; i < _corpus.size(); i++) {
+            const auto& frame = _corpus[i];
+            os << "    { \"name\": " << jsonString(frame.name)
+               << ", \"width\": " << frame.rawImage->width << ", \"height\": " << frame.rawImage->height << " }"
+               << (i + 1 < _corpus.size() ? "," : "") << "\n";
+        }
+        os << "  ],\n";
+
+        os << "  \"stages\": {\n";
+        for (int i = 0; i < _stageNames.size(); i++) {
+            const auto& samples = _stages.at(_stageNames[i]);
+            os << "    " << jsonString(_stageNames[i]) << ": {\n";
+            os << "      \"samples\": " << samples.wallMs.size() << ",\n";
+            os << "      \"wall_ms\": ";
+            writeStatistics(os, samples.wallMs);
+            os << ",\n      \"cpu_ms\": ";
+            writeStatistics(os, samples.cpuMs);
+            os << ",\n      \"gpu_ms\": ";
+            writeStatistics(os, samples.gpuMs);
+            if (_energyMeter) {
+                os << ",\n      \"energy_j\": ";
+                writeStatistics(os, samples.joules);
+            }
+            os << "\n    }" << (i + 1 < _stageNames.size() ? "," : "") << "\n";
+        }
+        os << "  },\n";
+
+        os << "  \"memory\": {\n";
+        os << "    \"peak_footprint_mb\": " << _peakFootprint / (1024.0 * 1024.0) << ",\n";
+        os << "    \"peak_gpu_allocated_mb\": " << _peakDeviceAllocated / (1024.0 * 1024.0) << ",\n";
+        const auto& tracker = _context->memoryTracker();
+        os << "    \"peak_tracked_mb\": " << tracker.peakBytes() / (1024.0 * 1024.0) << ",\n";
+        os << "    \"tracked_owners\": {\n";
+        const auto owners = tracker.breakdown();
+        int owner = 0;
+        for (const auto& [name, stats] : owners) {
+            os << "      " << jsonString(name) << ": { \"live_mb\": " << stats.liveBytes / (1024.0 * 1024.0)
+               << ", \"peak_mb\": " << stats.peakBytes / (1024.0 * 1024.0) << " }"
+               << (++owner < owners.size() ? "," : "") << "\n";
+        }
+        os << "    }\n";
+        os << "  },\n";
+
+        if (!_quality.empty()) {
+            // Infinite PSNR, identical to the baseline, is written as null
+            const auto writePSNR = [&](double psnr) {
+                if (std::isfinite(psnr)) {
+                    os << psnr;
+                } else {
+                    os << "null";
+                }
+            };
+            os << "  \"quality\": {\n";
+            for (int i = 0; i < _quality.size(); i++) {
+                const auto& [configuration, psnr] = _quality[i];
+                double minPSNR = std::numeric_limits<double>::infinity();
+                os << "    " << jsonString(configuration) << ": { \"psnr_db\": {";
+                for (int j = 0; j < psnr.size(); j++) {
+                    os << (j > 0 ? ", " : " ") << jsonString(_corpus[j].name) << ": ";
+                    writePSNR(psnr[j]);
+                    minPSNR = std::min(minPSNR, psnr[j]);
+                }
+                os << " }, \"min_psnr_db\": ";
+                writePSNR(minPSNR);
+                os << " }" << (i + 1 < _quality.size() ? "," : "") << "\n";
+            }
+            os << "  },\n";
+        }
+
+        if (_energyMeter) {
+            // The components a source doesn't break down are null
+            const auto writeJoules = [&](double joules, int images) {
+                if (std::isfinite(joules) && images > 0) {
+                    os << joules / images;
+                } else {
+                    os << "null";
+                }
+            };
+            os << "  \"energy\": {\n";
+            os << "    \"source\": " << jsonString(_energyMeter->source()) << ",\n";
+            os << "    \"scope\": " << jsonString(_energyMeter->scope() == EnergyMeter::Scope::system ? "system" : "process") << ",\n";
+            os << "    \"configurations\": {\n";
+            for (int i = 0; i < _energy.size(); i++) {
+                const auto& [configuration, images, energy] = _energy[i];
+                os << "      " << jsonString(configuration) << ": { \"images\": " << images << ", \"joules_per_image\": ";
+                writeJoules(energy.total, images);
+                os << ", \"cpu_j_per_image\": ";
+                writeJoules(energy.cpu, images);
+                os << ", \"gpu_j_per_image\": ";
+                writeJoules(energy.gpu, images);
+                os << ", \"dram_j_per_image\": ";
+                writeJoules(energy.dram, images);
+                os << ", \"ane_j_per_image\": ";
+                writeJoules(energy.ane, images);
+                os << " }" << (i + 1 < _energy.size() ? "," : "") << "\n";
+            }
+            os << "    }\n";
+            os << "  },\n";
+        }
+
+        if (!_surfRepeatability.empty()) {
+            double minRepeatability = 1;
+            os << "  \"surf_fp16_repeatability\": { \"frames\": {";
+            for (int j = 0; j < _surfRepeatability.size(); j++) {
+                os << (j > 0 ? ", " : " ") << jsonString(_corpus[j].name) << ": " << _surfRepeatability[j];
+                minRepeatability = std::min(minRepeatability, _surfRepeatability[j]);
+            }
+            os << " }, \"min\": " << minRepeatability << " },\n";
+        }
+
+        os << "  \"throughput\": {\n";
+        os << "    \"images_per_second\": " << (seconds > 0 ? images / seconds : 0) << ",\n";
+        os << "    \"megapixels_per_second\": " << (seconds > 0 ? megapixels * runs / seconds : 0) << "\n";
+        os << "  }\n";
+        os << "}\n";
+    }
+
+    // To the given file, or the standard output for an empty path
+    void writeJSON(const std::filesystem::path& path) const {
+        if (path.empty()) {
+            writeJSON(std::cout);
+            return;
+        }
+        std::ofstream os(path);
+        if (!os) {
+            throw std::runtime_error("PipelineBenchmark: can't write " + path.string());
+        }
+        writeJSON(os);
+    }
+};
+
+#endif /* pipelineBenchmark_hpp */
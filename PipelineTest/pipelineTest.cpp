@@ -13,9 +13,17 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <atomic>
+#include <csignal>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <simd/simd.h>
 
 #include "gls_tiff_metadata.hpp"
@@ -23,6 +31,14 @@
 #include "tinyicc.hpp"
 
 #include "CameraCalibration.hpp"
+#include "dng_decoder.hpp"
+#include "ThreadPool.hpp"
+#include "gls_debug_dump.hpp"
+#include "gls_image_writer.hpp"
+
+#include "pipelineBenchmark.hpp"
+#include "kernelBenchmark.hpp"
+#include "parameterSweep.hpp"
 
 #include "CoreMLSupport.h"
 
@@ -49,118 +65,225 @@ void plotHistogram(const std::array<uint32_t, histogram_size>& histogram, const
 }
 
 template <typename T>
-void dumpGradientImage(const gls::mtl_image_2d<T>& image, const std::string& path) {
-    gls::image<gls::rgb_pixel> out(image.width, image.height);
-    const auto image_cpu = image.mapImage();
-    out.apply([&](gls::rgb_pixel* p, int x, int y) {
-        const auto& ip = (*image_cpu)[y][x];
-
-        // float direction = (1 + atan2(ip.y, ip.x) / M_PI) / 2;
-        // float direction = atan2(abs(ip.y), ip.x) / M_PI;
-        float direction = std::atan2(std::abs(ip.y), std::abs(ip.x)) / M_PI_2;
-        float magnitude = std::sqrt((float)(ip.x * ip.x + ip.y * ip.y));
-
-        uint8_t val = std::clamp(255 * std::sqrt(magnitude), 0.0f, 255.0f);
-
-        *p = gls::rgb_pixel{
-            (uint8_t)(val * std::lerp(1.0f, 0.0f, direction)),
-            0,
-            (uint8_t)(val * std::lerp(1.0f, 0.0f, 1 - direction)),
-        };
+void dumpGradientImage(MetalContext* context, const gls::mtl_image_2d<T>& image, const std::string& name) {
+    gls::DebugDumpService::shared().dump(context, image, name, [](const gls::image<T>& image, const std::string& path) {
+        gls::image<gls::rgb_pixel> out(image.width, image.height);
+        out.apply([&](gls::rgb_pixel* p, int x, int y) {
+            const auto& ip = image[y][x];
+
+            // float direction = (1 + atan2(ip.y, ip.x) / M_PI) / 2;
+            // float direction = atan2(abs(ip.y), ip.x) / M_PI;
+            float direction = std::atan2(std::abs(ip.y), std::abs(ip.x)) / M_PI_2;
+            float magnitude = std::sqrt((float)(ip.x * ip.x + ip.y * ip.y));
+
+            uint8_t val = std::clamp(255 * std::sqrt(magnitude), 0.0f, 255.0f);
+
+            *p = gls::rgb_pixel{
+                (uint8_t)(val * std::lerp(1.0f, 0.0f, direction)),
+                0,
+                (uint8_t)(val * std::lerp(1.0f, 0.0f, 1 - direction)),
+            };
+        });
+        out.write_png_file(path);
     });
-    out.write_png_file(path);
 }
 
+// Encodes in the background while the next image is processed, main() waits for the pending writes
+gls::ImageWriter& outputWriter() {
+    static gls::ImageWriter writer(/*threads=*/ 2);
+    return writer;
+}
+
+// The image is converted before returning, it can be reused right away
 template <typename pixel_type>
 void saveImage(const gls::image<gls::pixel_float4>& image, const std::string& path,
                gls::tiff_metadata* metadata,
                const std::vector<uint8_t>* icc_profile_data, float exposure_multiplier = 1.0) {
-    gls::image<pixel_type> saveImage(image.width, image.height);
-    saveImage.apply([&](pixel_type* p, int x, int y) {
-        float scale = std::numeric_limits<typename pixel_type::value_type>::max();
-
-        const auto& pi = image[y][x];
-        *p = {
-            (uint8_t) std::clamp(scale * exposure_multiplier * pi.red, 0.0f, scale),
-            (uint8_t) std::clamp(scale * exposure_multiplier * pi.green, 0.0f, scale),
-            (uint8_t) std::clamp(scale * exposure_multiplier * pi.blue, 0.0f, scale)
-        };
-    });
-    // saveImage.write_png_file(path, /*skip_alpha=*/true, icc_profile_data);
-    saveImage.write_tiff_file(path, gls::tiff_compression::NONE, metadata, icc_profile_data);
+    gls::ImageWriter::Options options = { .exposureMultiplier = exposure_multiplier };
+    // Strip parallel compressed output, only with the basic metadata
+    if (getenv("GLS_TIFF_DEFLATE")) {
+        options.format = gls::ImageWriter::Format::tiffDeflate;
+    }
+    outputWriter().write<pixel_type>(image, path, options, metadata, icc_profile_data);
 }
 
 static std::vector<unsigned char> read_binary_file(const std::string filename) {
-    std::ifstream file(filename, std::ios::binary);
-    file.unsetf(std::ios::skipws);
-
-    std::streampos file_size;
-    file.seekg(0, std::ios::end);
-    file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    std::vector<unsigned char> vec;
-    vec.reserve(file_size);
-    vec.insert(vec.begin(),
-               std::istream_iterator<unsigned char>(file),
-               std::istream_iterator<unsigned char>());
-    return (vec);
+    return gls::MappedFile::read(filename);
+}
+
+// Calibration lookup from the DNG's IFD0 and Exif IFD, before decoding the pixels
+static bool knownCamera(const DNGReader& reader) {
+    const auto model = reader.cameraModel();
+    const auto lensModel = reader.lensModel();
+    if (!CameraCalibrationRegistry::shared().find(model, lensModel)) {
+        std::cout << "Unknown Device - " << "model: " << model << ", Lens Model: " << lensModel << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Camera specific parameters of a raw image, null for unknown devices
+std::unique_ptr<DemosaicParameters> unpackRawImage(const gls::size& imageSize, const gls::Matrix<3, 3>& xyz_rgb,
+                                                   gls::tiff_metadata* dng_metadata, gls::tiff_metadata* exif_metadata) {
+    std::string make, model, lens_model;
+    getValue(*dng_metadata, TIFFTAG_MAKE, &make);
+    getValue(*dng_metadata, TIFFTAG_MODEL, &model);
+    getValue(*exif_metadata, EXIFTAG_LENSMODEL, &lens_model);
+
+    std::cout << "Make: " << make << ", model: " << model << ", Lens Model: " << lens_model << std::endl;
+
+    const auto calibration = CameraCalibrationRegistry::shared().find(model, lens_model);
+    if (!calibration) {
+        std::cout << "Unknown Device - " << "Make: " << make << ", model: " << model << std::endl;
+        return nullptr;
+    }
+    return calibration->getDemosaicParameters(imageSize, xyz_rgb, dng_metadata, exif_metadata);
 }
 
 void demosaicFile(RawConverter* rawConverter, std::filesystem::path input_path) {
     std::cout << "Processing File: " << input_path.filename() << std::endl;
 
+    if (!knownCamera(DNGReader(input_path.string()))) {
+        exit(-1);
+    }
+
     gls::tiff_metadata dng_metadata, exif_metadata;
     const auto rawImage =
-    gls::image<gls::luma_pixel_16>::read_dng_file(input_path.string(), &dng_metadata, &exif_metadata);
+    DNGDecoder::read(input_path.string(), &dng_metadata, &exif_metadata);
 
-    std::string make, model, lens_model;
-    if (!getValue(dng_metadata, TIFFTAG_MAKE, &make)) {
-        std::cout << "No make?" << std::endl;
+    auto demosaicParameters = unpackRawImage(rawImage->size(), rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
+    if (!demosaicParameters) {
+        exit(-1);
     }
-    if (!getValue(dng_metadata, TIFFTAG_MODEL, &model)) {
-        std::cout << "No Model?" << std::endl;
+    rawConverter->preset().apply(demosaicParameters.get());
+
+    // Quality cost of the reduced precision intermediates
+    if (getenv("GLS_VALIDATE_PRECISION")) {
+        rawConverter->validatePrecision(*rawImage, *demosaicParameters);
     }
-    if (!getValue(exif_metadata, EXIFTAG_LENSMODEL, &lens_model)) {
-        std::cout << "No Focal Lenght?" << std::endl;
+
+    // Out-of-core processing for large sensors, also when the full resolution intermediates exceed the GPU memory budget
+    int tileSize = 0;
+    if (const char* tileSizeString = getenv("GLS_TILE_SIZE")) {
+        tileSize = atoi(tileSizeString);
+    } else if (rawConverter->context()->memoryTracker().budget() > 0) {
+        try {
+            rawConverter->allocateTextures(rawImage->size());
+        } catch (const gls::gpu_budget_exceeded& e) {
+            std::cout << e.what() << ", falling back to tiled processing" << std::endl;
+            tileSize = 2048;
+        }
     }
+    if (tileSize > 0) {
+        gls::image<gls::pixel_float4> srgbImage(rawImage->width, rawImage->height);
 
-    std::cout << "Make: " << make << ", model: " << model << ", Focal length: " << lens_model << std::endl;
+        auto t_start = std::chrono::high_resolution_clock::now();
 
-    std::unique_ptr<DemosaicParameters> demosaicParameters;
-    if (make == "Apple" && (model == "iPhone 14 Pro" || model == "iPhone 14 Pro Max")) {
-        const std::string tele = "iPhone 14 Pro back camera 9mm f/2.8";
-        const std::string wide = "iPhone 14 Pro back camera 6.86mm f/1.78";
-        const std::string ultraWide = "iPhone 14 Pro back camera 2.22mm f/2.2";
-        const std::string tele_max = "iPhone 14 Pro Max back camera 9mm f/2.8";
-        const std::string wide_max = "iPhone 14 Pro Max back camera 6.86mm f/1.78";
-        const std::string ultraWide_max = "iPhone 14 Pro Max back camera 2.22mm f/2.2";
-        const std::string selfie = "iPhone 14 Pro front camera 2.69mm f/1.9";
-        const std::string selfie_max = "iPhone 14 Pro front camera 2.69mm f/1.9";
-
-        if (lens_model == tele || lens_model == tele_max) {
-            demosaicParameters = unpackiPhone14TeleRawImage(*rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
-        } else if (lens_model == wide || lens_model == wide_max) {
-            demosaicParameters = unpackiPhone14WideRawImage(*rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
-        } else if (lens_model == ultraWide || lens_model == ultraWide_max) {
-            demosaicParameters = unpackiPhone14UltraWideRawImage(*rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
-        } else if (lens_model == selfie || lens_model == selfie_max) {
-            demosaicParameters = unpackiPhone14SelfieRawImage(*rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
-        } else {
-            std::cout << "Unknown Camera - " << "Make: " << make << ", model: " << model << ", Lens Model: " << lens_model << " - Using Wide" << std::endl;
-            demosaicParameters = unpackiPhone14WideRawImage(*rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
-            // exit(-1);
+        rawConverter->demosaicTiled(*rawImage, demosaicParameters.get(), tileSize,
+                                    [&](const gls::image<gls::pixel_float4>& tile, int x, int y) {
+            for (int j = 0; j < tile.height; j++) {
+                std::copy(&tile[j][0], &tile[j][0] + tile.width, &srgbImage[y + j][x]);
+            }
+        });
+
+        auto t_end = std::chrono::high_resolution_clock::now();
+        double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+
+        std::cout << "Metal Pipeline Tiled Execution Time: " << (int)elapsed_time_ms
+                  << "ms for image of size: " << rawImage->width << " x " << rawImage->height << std::endl;
+
+        const auto output_path = input_path.parent_path() / input_path.filename().replace_extension("_t_g8bis.tif");
+        saveImage<gls::rgb_pixel_16>(srgbImage, output_path.string(), &dng_metadata, rawConverter->icc_profile_data());
+        return;
+    }
+
+    // Region of interest processing, as x,y,width,height
+    if (const char* roiString = getenv("GLS_ROI")) {
+        gls::rectangle roi = { 0, 0, 0, 0 };
+        sscanf(roiString, "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height);
+
+        auto t_start = std::chrono::high_resolution_clock::now();
+
+        std::unique_ptr<gls::image<gls::pixel_float4>> roiImage;
+        rawConverter->demosaicRegion(*rawImage, demosaicParameters.get(), roi,
+                                     [&](const gls::image<gls::pixel_float4>& region, int x, int y) {
+            roiImage = std::make_unique<gls::image<gls::pixel_float4>>(region.width, region.height);
+            for (int j = 0; j < region.height; j++) {
+                std::copy(&region[j][0], &region[j][0] + region.width, &(*roiImage)[j][0]);
+            }
+        });
+
+        auto t_end = std::chrono::high_resolution_clock::now();
+        double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+
+        std::cout << "Metal Pipeline ROI Execution Time: " << (int)elapsed_time_ms
+                  << "ms for region of size: " << roi.width << " x " << roi.height << std::endl;
+
+        const auto output_path = input_path.parent_path() / input_path.filename().replace_extension("_roi_g8bis.tif");
+        saveImage<gls::rgb_pixel_16>(*roiImage, output_path.string(), &dng_metadata, rawConverter->icc_profile_data());
+        return;
+    }
+
+    // Downscaled export with the given long side, see RawConverter::demosaicToSizeAsync
+    if (const char* longSideString = getenv("GLS_OUTPUT_LONG_SIDE")) {
+        const int outputLongSide = atoi(longSideString);
+        static const char* strategyNames[] = { "full resolution", "fused downscale", "binned downscale" };
+        const auto strategy = RawConverter::outputStrategy(rawImage->size(), outputLongSide);
+
+        auto t_start = std::chrono::high_resolution_clock::now();
+
+        const auto result = rawConverter->demosaicToSizeAsync(*rawImage, demosaicParameters.get(), outputLongSide);
+        result.done.get();
+
+        auto t_end = std::chrono::high_resolution_clock::now();
+        double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
+
+        std::cout << "Metal Pipeline Sized Execution Time: " << (int)elapsed_time_ms << "ms for output of size: "
+                  << result.image->width << " x " << result.image->height << " (" << strategyNames[(int) strategy] << ")"
+                  << std::endl;
+
+        const auto output_path = input_path.parent_path() / input_path.filename().replace_extension("_s_g8bis.tif");
+        saveImage<gls::rgb_pixel_16>(*result.image->mapImage(), output_path.string(), &dng_metadata, rawConverter->icc_profile_data());
+        return;
+    }
+
+    // Video rate processing, the same frame is streamed repeatedly
+    if (const char* streamFrames = getenv("GLS_STREAM_FRAMES")) {
+        StreamingRawConverter streamingConverter(NS::RetainPtr(rawConverter->context()->device()), *demosaicParameters,
+                                                 /*noiseReduction=*/ true, /*slotCount=*/ 3, /*statisticsInterval=*/ 8,
+                                                 rawConverter->icc_profile_data());
+
+        const int frames = atoi(streamFrames);
+        for (int i = 0; i < frames; i++) {
+            streamingConverter.submit(*rawImage);
         }
-    } else {
-        std::cout << "Unknown Device - " << "Make: " << make << ", model: " << model << std::endl;
-        exit(-1);
+        streamingConverter.waitForCompletion();
+
+        const auto statistics = streamingConverter.statistics();
+        std::cout << "Streamed " << statistics.frames << " frames of size " << rawImage->width << " x " << rawImage->height
+                  << ": " << std::setprecision(1) << std::fixed << statistics.fps << "fps, frame time "
+                  << statistics.meanFrameTime << "ms, jitter " << statistics.frameTimeJitter << "ms, max "
+                  << statistics.maxFrameTime << "ms" << std::endl;
+        return;
     }
 
     rawConverter->allocateTextures(rawImage->size());
 
+    // Upload at the given bit depth with GPU unpacking, the packing itself is not timed
+    std::vector<uint8_t> packedData;
+    PackedRawImage packedRawImage;
+    const char* packedBits = getenv("GLS_PACKED_RAW");
+    if (packedBits) {
+        packedRawImage = packRawImage(*rawImage, atoi(packedBits), &packedData);
+    }
+
     auto t_start = std::chrono::high_resolution_clock::now();
 
-    auto srgbImage = rawConverter->demosaic(*rawImage, demosaicParameters.get());
+    auto srgbImage = packedBits ? [&]() {
+        const auto result = rawConverter->demosaicAsync(packedRawImage, demosaicParameters.get());
+        result.done.get();
+        return result.image;
+    }() : rawConverter->demosaic(*rawImage, demosaicParameters.get());
 
     auto t_end = std::chrono::high_resolution_clock::now();
     double elapsed_time_ms = std::chrono::duration<double, std::milli>(t_end - t_start).count();
@@ -168,6 +291,19 @@ void demosaicFile(RawConverter* rawConverter, std::filesystem::path input_path)
     std::cout << "Metal Pipeline Execution Time: " << (int)elapsed_time_ms
               << "ms for image of size: " << rawImage->width << " x " << rawImage->height << std::endl;
 
+    if (rawConverter->context()->isProfiling()) {
+        rawConverter->context()->printKernelProfiles();
+        rawConverter->context()->clearKernelProfiles();
+    }
+
+    if (rawConverter->context()->isRecordingDispatches()) {
+        rawConverter->context()->printPipelineStateReport();
+    }
+
+    if (getenv("GLS_GPU_MEMORY")) {
+        rawConverter->context()->memoryTracker().print();
+    }
+
     const auto output_dir = input_path.parent_path(); // .parent_path() / "Classic";
     const auto filename = input_path.filename().replace_extension("_t_g8bis.tif");
     const auto output_path = output_dir / filename;
@@ -232,11 +368,326 @@ void demosaicDirectory(RawConverter* rawConverter, std::filesystem::path input_p
     }
 }
 
+static void listRawFiles(const std::filesystem::path& input_dir, std::vector<std::filesystem::path>* raw_files) {
+    std::vector<std::filesystem::path> directory_listing;
+    std::copy(std::filesystem::directory_iterator(input_dir), std::filesystem::directory_iterator(),
+              std::back_inserter(directory_listing));
+    std::sort(directory_listing.begin(), directory_listing.end());
+
+    for (const auto& input_path : directory_listing) {
+        if (input_path.filename().string().starts_with(".")) {
+            continue;
+        }
+
+        if (std::filesystem::directory_entry(input_path).is_regular_file()) {
+            const auto extension = input_path.extension();
+            if (extension == ".dng" || extension == ".DNG") {
+                raw_files->push_back(input_path);
+            }
+        } else if (std::filesystem::directory_entry(input_path).is_directory()) {
+            listRawFiles(input_path, raw_files);
+        }
+    }
+}
+
+struct DecodedRawFile {
+    std::filesystem::path path;
+    gls::tiff_metadata dng_metadata, exif_metadata;
+    gls::image<gls::luma_pixel_16>::unique_ptr rawImage;
+    std::optional<StreamedRawImage> streamedImage;  // Instead of rawImage, see DNGIOLoader
+    std::unique_ptr<DemosaicParameters> demosaicParameters;
+};
+
+static std::filesystem::path batchOutputPath(const std::filesystem::path& path) {
+    return path.parent_path() / path.filename().replace_extension("_t_g8bis.tif");
+}
+
+// Batch conversion of a list of DNGs: the files are read and unpacked on decodeThreads threads ahead of the GPU,
+// the tiles of a file in parallel on the TaskScheduler (see DNGDecoder), each decoded image runs on a converter
+// leased from converterPool (which bounds the images in GPU flight) and the TIFF outputs are encoded and written
+// on writerThreads threads. converterPool is a RawConverterPool or a
+// MultiDeviceRawConverterPool. With an ioLoader the uncompressed DNGs skip the decoder: their strips load straight
+// to GPU buffers, only for a pool of converters on the loader's device. Returns the number of files converted.
+template <typename ConverterPool>
+int batchDemosaicFiles(ConverterPool* converterPool, const gls::Matrix<3, 3>& xyz_rgb,
+                       const std::vector<std::filesystem::path>& raw_files, int decodeThreads, int writerThreads,
+                       const DNGIOLoader* ioLoader = nullptr) {
+    ThreadPool decodePool(decodeThreads, gls::QoS::utility);
+    ThreadPool writerPool(writerThreads, gls::QoS::utility);
+
+    // Bounded read ahead, the decoded images wait for a converter in memory
+    const int readAhead = 2 * decodeThreads;
+    std::deque<std::future<std::shared_ptr<DecodedRawFile>>> decoded;
+    size_t nextFile = 0;
+    auto enqueueDecode = [&]() {
+        while (nextFile < raw_files.size() && decoded.size() < readAhead) {
+            decoded.push_back(decodePool.enqueue([&xyz_rgb, ioLoader, path = raw_files[nextFile++]]() {
+                auto file = std::make_shared<DecodedRawFile>();
+                file->path = path;
+
+                // The unknown cameras are skipped without decoding their pixels
+                const DNGReader reader(path.string());
+                if (!knownCamera(reader)) {
+                    return file;
+                }
+                if (ioLoader) {
+                    if (const auto layout = reader.rawLayout()) {
+                        reader.readMetadata(&file->dng_metadata, &file->exif_metadata);
+                        file->demosaicParameters = unpackRawImage(reader.imageSize(), xyz_rgb, &file->dng_metadata, &file->exif_metadata);
+                        if (file->demosaicParameters) {
+                            file->streamedImage = ioLoader->load(path.string(), *layout);
+                        }
+                        return file;
+                    }
+                }
+                file->rawImage = DNGDecoder::read(reader, &file->dng_metadata, &file->exif_metadata);
+                file->demosaicParameters = unpackRawImage(file->rawImage->size(), xyz_rgb, &file->dng_metadata, &file->exif_metadata);
+                return file;
+            }));
+        }
+    };
+
+    std::vector<std::future<void>> written;
+    std::atomic<int> converted = 0;
+
+    enqueueDecode();
+    while (!decoded.empty()) {
+        std::shared_ptr<DecodedRawFile> file;
+        try {
+            file = decoded.front().get();
+        } catch (const std::exception& e) {
+            std::cout << "Couldn't read raw file: " << e.what() << std::endl;
+        }
+        decoded.pop_front();
+        enqueueDecode();
+
+        if (!file || !file->demosaicParameters) {
+            continue;
+        }
+
+        // Blocks while all the converters of the pool are in flight
+        auto rawConverter = std::make_shared<typename ConverterPool::Lease>(converterPool->checkout());
+        const auto result = file->streamedImage
+            ? (*rawConverter)->demosaicAsync(*file->streamedImage, file->demosaicParameters.get())
+            : (*rawConverter)->demosaicAsync(*file->rawImage, file->demosaicParameters.get());
+
+        written.push_back(writerPool.enqueue([file, rawConverter, result, &converted]() mutable {
+            result.done.get();
+            if (file->streamedImage && file->streamedImage->failed()) {
+                throw std::runtime_error("Couldn't load " + file->path.string());
+            }
+
+            // Convert to the output format and give the converter back to the pool before encoding
+            const auto srgbImage = result.image->mapImage();
+            gls::image<gls::rgb_pixel_16> outputImage(srgbImage->width, srgbImage->height);
+            gls::convertToOutput(*srgbImage, &outputImage);
+            // The pool's converters outlive the batch
+            const auto icc_profile_data = (*rawConverter)->icc_profile_data();
+            rawConverter = nullptr;
+
+            const auto output_path = batchOutputPath(file->path);
+            outputImage.write_tiff_file(output_path.string(), gls::tiff_compression::NONE, &file->dng_metadata, icc_profile_data);
+            converted++;
+        }));
+    }
+
+    for (auto& w : written) {
+        try {
+            w.get();
+        } catch (const std::exception& e) {
+            std::cout << "Couldn't write output file: " << e.what() << std::endl;
+        }
+    }
+    return converted;
+}
+
+// Batch conversion of a directory tree, see batchDemosaicFiles
+template <typename ConverterPool>
+void batchDemosaicDirectory(ConverterPool* converterPool, const gls::Matrix<3, 3>& xyz_rgb,
+                            std::filesystem::path input_path, int decodeThreads, int writerThreads,
+                            const DNGIOLoader* ioLoader = nullptr) {
+    auto input_dir = std::filesystem::directory_entry(input_path).is_directory() ? input_path : input_path.parent_path();
+    std::vector<std::filesystem::path> raw_files;
+    listRawFiles(input_dir, &raw_files);
+
+    std::cout << "Batch processing " << raw_files.size() << " files in: " << input_dir << std::endl;
+
+    auto t_start = std::chrono::high_resolution_clock::now();
+
+    const int converted = batchDemosaicFiles(converterPool, xyz_rgb, raw_files, decodeThreads, writerThreads, ioLoader);
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+    const double elapsed_time_s = std::chrono::duration<double>(t_end - t_start).count();
+
+    std::cout << "Batch converted " << converted << " of " << raw_files.size() << " files in " << std::setprecision(1) << std::fixed
+              << elapsed_time_s << "s: " << (elapsed_time_s > 0 ? 60 * converted / elapsed_time_s : 0) << " images/minute" << std::endl;
+}
+
+// Noise calibration of a series of captures of the same scene at different ISOs, e.g. the calibration files of a
+// camera: the frames are decoded and measured concurrently on the converters of converterPool, which have to be
+// created with calibrateFromImage. The measured noise models are written by ISO as the NLFData table of the
+// calibration sources of calibrationName to nlfFile, or to the standard output.
+template <typename ConverterPool>
+void calibrateNoiseSeries(ConverterPool* converterPool, const gls::Matrix<3, 3>& xyz_rgb,
+                          const std::vector<std::filesystem::path>& raw_files, int threads,
+                          const std::string& calibrationName, const std::filesystem::path& nlfFile) {
+    typedef std::pair<int, NoiseModel<5>> MeasuredNoiseModel;
+
+    // Every frame holds a converter while it is measured, the pool bounds the frames in flight
+    ThreadPool measurePool(threads, gls::QoS::utility);
+    std::vector<std::future<std::optional<MeasuredNoiseModel>>> measured;
+    for (const auto& path : raw_files) {
+        measured.push_back(measurePool.enqueue([converterPool, &xyz_rgb, path]() -> std::optional<MeasuredNoiseModel> {
+            gls::tiff_metadata dng_metadata, exif_metadata;
+            const auto rawImage = DNGDecoder::read(path.string(), &dng_metadata, &exif_metadata);
+            auto demosaicParameters = unpackRawImage(rawImage->size(), xyz_rgb, &dng_metadata, &exif_metadata);
+            if (!demosaicParameters) {
+                return std::nullopt;
+            }
+            auto rawConverter = converterPool->checkout();
+            rawConverter->demosaicAsync(*rawImage, demosaicParameters.get(), /*denoise=*/ true, /*postProcess=*/ false).done.get();
+            return MeasuredNoiseModel { demosaicParameters->iso, demosaicParameters->noiseModel };
+        }));
+    }
+
+    std::vector<MeasuredNoiseModel> noiseModels;
+    for (int i = 0; i < measured.size(); i++) {
+        try {
+            if (auto noiseModel = measured[i].get()) {
+                noiseModels.push_back(*noiseModel);
+            }
+        } catch (const std::exception& e) {
+            std::cout << "Couldn't calibrate " << raw_files[i] << ": " << e.what() << std::endl;
+        }
+    }
+    std::stable_sort(noiseModels.begin(), noiseModels.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    // One model per ISO, the first capture of each
+    const auto duplicates = std::unique(noiseModels.begin(), noiseModels.end(), [](const auto& a, const auto& b) { return a.first == b.first; });
+    if (duplicates != noiseModels.end()) {
+        std::cout << "Ignoring " << std::distance(duplicates, noiseModels.end()) << " captures with a repeated ISO" << std::endl;
+        noiseModels.erase(duplicates, noiseModels.end());
+    }
+
+    if (nlfFile.empty()) {
+        writeNLFData(std::cout, calibrationName, noiseModels);
+    } else {
+        std::ofstream nlfStream(nlfFile);
+        writeNLFData(nlfStream, calibrationName, noiseModels);
+    }
+}
+
+static volatile std::sig_atomic_t stopWatching = 0;
+
+// Conversion service: watches a directory tree and converts the DNGs landing in it in batches, on the converters of
+// converterPool which stay warm across batches (Metal contexts, pipeline states, calibrations). A file is taken
+// once its size and modification time hold over a scan interval, the ones with an output already are skipped.
+// After every batch the throughput and the queue depth are printed and, with a metrics file, written there as
+// JSON. Runs until SIGINT or SIGTERM.
+template <typename ConverterPool>
+void watchDirectory(ConverterPool* converterPool, const gls::Matrix<3, 3>& xyz_rgb, const std::filesystem::path& input_dir,
+                    int scanIntervalSeconds, int decodeThreads, int writerThreads, const DNGIOLoader* ioLoader = nullptr,
+                    const std::filesystem::path& metricsFile = {}) {
+    struct FileState {
+        uintmax_t size;
+        std::filesystem::file_time_type modified;
+
+        bool operator==(const FileState&) const = default;
+    };
+    std::map<std::filesystem::path, FileState> landing;
+    std::set<std::filesystem::path> taken;
+
+    int converted = 0, failed = 0, batches = 0;
+    double busySeconds = 0;
+    const auto started = std::chrono::steady_clock::now();
+
+    std::signal(SIGINT, [](int) { stopWatching = 1; });
+    std::signal(SIGTERM, [](int) { stopWatching = 1; });
+
+    std::cout << "Watching " << input_dir << " every " << scanIntervalSeconds << "s" << std::endl;
+
+    while (!stopWatching) {
+        std::vector<std::filesystem::path> raw_files;
+        try {
+            listRawFiles(input_dir, &raw_files);
+        } catch (const std::filesystem::filesystem_error& e) {
+            std::cout << "Couldn't scan " << input_dir << ": " << e.what() << std::endl;
+        }
+
+        std::vector<std::filesystem::path> ready;
+        for (const auto& path : raw_files) {
+            if (taken.contains(path)) {
+                continue;
+            }
+            std::error_code ec;
+            const FileState state = { std::filesystem::file_size(path, ec), std::filesystem::last_write_time(path, ec) };
+            if (ec) {
+                continue;
+            }
+            if (std::filesystem::exists(batchOutputPath(path))) {
+                taken.insert(path);
+                continue;
+            }
+            // Still being written if it changed since the last scan
+            const auto entry = landing.find(path);
+            if (entry != landing.end() && entry->second == state) {
+                landing.erase(entry);
+                taken.insert(path);
+                ready.push_back(path);
+            } else {
+                landing[path] = state;
+            }
+        }
+
+        if (!ready.empty()) {
+            const auto batchStart = std::chrono::steady_clock::now();
+            const int batchConverted = batchDemosaicFiles(converterPool, xyz_rgb, ready, decodeThreads, writerThreads, ioLoader);
+            const double batchSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+
+            converted += batchConverted;
+            failed += (int) ready.size() - batchConverted;
+            batches++;
+            busySeconds += batchSeconds;
+
+            const double uptimeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            const double imagesPerMinute = batchSeconds > 0 ? 60 * batchConverted / batchSeconds : 0;
+            std::cout << "Batch " << batches << ": " << batchConverted << " of " << ready.size() << " files in "
+                      << std::setprecision(1) << std::fixed << batchSeconds << "s, " << imagesPerMinute
+                      << " images/minute, " << landing.size() << " landing" << std::endl;
+
+            if (!metricsFile.empty()) {
+                // Replaced atomically, readers never see a partial file
+                const auto temporaryFile = std::filesystem::path(metricsFile.string() + ".tmp");
+                {
+                    std::ofstream json(temporaryFile);
+                    json << std::setprecision(3) << std::fixed << "{\n"
+                         << "  \"converted\": " << converted << ",\n"
+                         << "  \"failed\": " << failed << ",\n"
+                         << "  \"batches\": " << batches << ",\n"
+                         << "  \"queueDepth\": " << landing.size() << ",\n"
+                         << "  \"lastBatchImagesPerMinute\": " << imagesPerMinute << ",\n"
+                         << "  \"imagesPerBusyMinute\": " << (busySeconds > 0 ? 60 * converted / busySeconds : 0) << ",\n"
+                         << "  \"busySeconds\": " << busySeconds << ",\n"
+                         << "  \"uptimeSeconds\": " << uptimeSeconds << "\n"
+                         << "}" << std::endl;
+                }
+                std::error_code ec;
+                std::filesystem::rename(temporaryFile, metricsFile, ec);
+            }
+            // Look again right away, files may have landed during the batch
+            continue;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(scanIntervalSeconds));
+    }
+
+    std::cout << "Stopped watching " << input_dir << ", converted " << converted << " files, " << failed << " failed" << std::endl;
+}
+
 void fmenApplyToFile(RawConverter* rawConverter, std::filesystem::path input_path, std::vector<uint8_t>* icc_profile_data) {
     std::cout << "Processing File: " << input_path.filename() << std::endl;
 
     gls::tiff_metadata dng_metadata, exif_metadata;
-    const auto rawImage = gls::image<gls::luma_pixel_16>::read_dng_file(input_path.string(), &dng_metadata, &exif_metadata);
+    const auto rawImage = DNGDecoder::read(input_path.string(), &dng_metadata, &exif_metadata);
     auto demosaicParameters = unpackiPhone14TeleFEMNRawImage(*rawImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
 
     float baseline_exposure = 0;
@@ -257,7 +708,16 @@ void fmenApplyToFile(RawConverter* rawConverter, std::filesystem::path input_pat
     const auto filename = input_path.filename().replace_extension("_c_sharp.tiff");
     const auto output_path = output_dir / filename;
 
-    auto srgbImage = rawConverter->postprocess(processedImage, demosaicParameters.get());
+    // The model output is fp16, postprocess takes float
+    gls::image<gls::pixel_float4> rgbImage(processedImage.width, processedImage.height);
+    gls::parallel_for(0, rgbImage.height, /*grain=*/ 16, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            gls::convertToFloat(std::span((const gls::float16_t*) &processedImage[y][0], 4 * (size_t) rgbImage.width),
+                                std::span((float*) &rgbImage[y][0], 4 * (size_t) rgbImage.width));
+        }
+    });
+
+    auto srgbImage = rawConverter->postprocess(rgbImage, demosaicParameters.get());
     const auto srgbImageCpu = srgbImage->mapImage();
     saveImage<gls::rgb_pixel_16>(*srgbImageCpu, output_path.string(), &dng_metadata, rawConverter->icc_profile_data());
 
@@ -302,6 +762,151 @@ void fmenApplyToDirectory(RawConverter* rawConverter, std::filesystem::path inpu
     }
 }
 
+// Per-stage timings over the given number of warm iterations, written as JSON to GLS_BENCHMARK_JSON or the standard
+// output. The corpus is the DNGs of input_path, if given, and the synthetic bursts of GLS_BENCHMARK_SYNTHETIC, a comma
+// separated list of megapixels (e.g. "12,24,48,60"), of GLS_BENCHMARK_BURST frames at GLS_BENCHMARK_ISO.
+// GLS_BENCHMARK_PRESETS runs the corpus with each of the listed pipeline presets (e.g. "preview,max"), or "all".
+// GLS_BENCHMARK_QUALITY adds the PSNR of each preset against the full precision pipeline.
+// GLS_BENCHMARK_ENERGY adds the joules per image of each preset and the energy of each stage, see EnergyMeter.
+// Microbenchmark of the kernel variants in GLS_KERNEL_BENCHMARK, one or two comma separated names (e.g.
+// "denoiseImage,denoiseImage/noGradient"), or "list": the second is timed and compared against the first. The
+// synthetic textures are GLS_KERNEL_SIZE (e.g. "4032x3024"), GLS_KERNEL_ITERATIONS dispatches are timed.
+void benchmarkKernels(MetalContext* context, const std::string& variants) {
+    KernelBenchmark::Options options;
+    if (const char* size = getenv("GLS_KERNEL_SIZE")) {
+        if (sscanf(size, "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0) {
+            throw std::runtime_error(std::string("benchmarkKernels: malformed size ") + size);
+        }
+    }
+    if (const char* iterations = getenv("GLS_KERNEL_ITERATIONS")) {
+        options.iterations = std::max(atoi(iterations), 1);
+    }
+
+    KernelBenchmark benchmark(context, options);
+    benchmark.addStandardVariants();
+
+    if (variants == "list") {
+        for (const auto& name : benchmark.names()) {
+            std::cout << name << std::endl;
+        }
+        return;
+    }
+    const auto comma = variants.find(',');
+    benchmark.run(variants.substr(0, comma), comma != std::string::npos ? variants.substr(comma + 1) : "");
+}
+
+void benchmarkPipeline(RawConverter* rawConverter, int iterations, const std::filesystem::path& input_path) {
+    PipelineBenchmark::Options options;
+    options.iterations = std::max(iterations, 1);
+    if (const char* warmup = getenv("GLS_BENCHMARK_WARMUP")) {
+        options.warmup = std::max(atoi(warmup), 0);
+    }
+    if (const char* presets = getenv("GLS_BENCHMARK_PRESETS")) {
+        if (std::string(presets) == "all") {
+            options.presets = { PipelinePreset::preview, PipelinePreset::fast, PipelinePreset::balanced, PipelinePreset::max };
+        } else {
+            std::stringstream names(presets);
+            std::string name;
+            while (std::getline(names, name, ',')) {
+                options.presets.push_back(PipelinePreset::nameFromString(name));
+            }
+        }
+    }
+    options.quality = getenv("GLS_BENCHMARK_QUALITY") != nullptr;
+    options.energy = getenv("GLS_BENCHMARK_ENERGY") != nullptr;
+    PipelineBenchmark benchmark(rawConverter, options);
+
+    if (!input_path.empty()) {
+        std::vector<std::filesystem::path> raw_files;
+        listRawFiles(input_path, &raw_files);
+        for (const auto& raw_file : raw_files) {
+            benchmark.addCorpusFile(raw_file);
+        }
+    }
+
+    if (const char* synthetic = getenv("GLS_BENCHMARK_SYNTHETIC")) {
+        const char* burst = getenv("GLS_BENCHMARK_BURST");
+        const char* iso = getenv("GLS_BENCHMARK_ISO");
+
+        std::stringstream sizes(synthetic);
+        std::string megapixels;
+        while (std::getline(sizes, megapixels, ',')) {
+            auto parameters = SyntheticRawGenerator::Parameters::withMegapixels(std::stof(megapixels));
+            if (iso) {
+                parameters.iso = std::max(atoi(iso), 1);
+            }
+            benchmark.addSyntheticBurst(SyntheticRawGenerator(parameters), burst ? std::max(atoi(burst), 1) : 3);
+        }
+    }
+
+    benchmark.run();
+
+    const char* jsonFile = getenv("GLS_BENCHMARK_JSON");
+    benchmark.writeJSON(jsonFile ? std::filesystem::path(jsonFile) : std::filesystem::path());
+}
+
+// Denoiser parameter sweep of input_path scored against reference_path, a capture of the same scene (e.g. the base
+// ISO CalibrationEntry of a chart), see ParameterSweep. The axes are the semicolon separated list in GLS_SWEEP_AXES
+// of <DenoiseParameters field>.<pyramid level>=<comma separated values>, e.g. "luma.0=0.5,1,1.5;chroma.0=1,2,4".
+// The results, best SSIM first, are written as CSV to GLS_SWEEP_CSV or the standard output.
+void sweepParameters(RawConverter* rawConverter, const std::filesystem::path& input_path,
+                     const std::filesystem::path& reference_path) {
+    const auto loadImage = [&](const std::filesystem::path& path, std::unique_ptr<DemosaicParameters>* demosaicParameters) {
+        gls::tiff_metadata dng_metadata, exif_metadata;
+        auto rawImage = DNGDecoder::read(path.string(), &dng_metadata, &exif_metadata);
+        *demosaicParameters = unpackRawImage(rawImage->size(), rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
+        if (!*demosaicParameters) {
+            throw std::runtime_error("sweepParameters: unknown device for " + path.string());
+        }
+        rawConverter->preset().apply(demosaicParameters->get());
+        return rawImage;
+    };
+
+    ParameterSweep sweep(rawConverter);
+
+    const char* axes = getenv("GLS_SWEEP_AXES");
+    std::stringstream axesList(axes ? axes : "");
+    std::string axis;
+    while (std::getline(axesList, axis, ';')) {
+        const auto dot = axis.find('.');
+        const auto equals = axis.find('=');
+        if (dot == std::string::npos || equals == std::string::npos || equals < dot) {
+            throw std::runtime_error("sweepParameters: malformed axis " + axis);
+        }
+        std::vector<float> values;
+        std::stringstream valueList(axis.substr(equals + 1));
+        std::string value;
+        while (std::getline(valueList, value, ',')) {
+            values.push_back(std::stof(value));
+        }
+        sweep.addAxis(ParameterSweep::denoiseAxis(axis.substr(0, dot), std::stoi(axis.substr(dot + 1, equals - dot - 1)),
+                                                  std::move(values)));
+    }
+    if (sweep.combinations() == 0) {
+        throw std::runtime_error("sweepParameters: no axes in GLS_SWEEP_AXES");
+    }
+
+    std::unique_ptr<DemosaicParameters> referenceParameters;
+    const auto referenceImage = loadImage(reference_path, &referenceParameters);
+    sweep.renderReference(*referenceImage, *referenceParameters);
+
+    std::unique_ptr<DemosaicParameters> demosaicParameters;
+    const auto rawImage = loadImage(input_path, &demosaicParameters);
+
+    std::cout << "Sweeping " << sweep.combinations() << " combinations of " << input_path.filename() << std::endl;
+    const auto start = std::chrono::steady_clock::now();
+    const auto results = sweep.run(*rawImage, *demosaicParameters);
+    const auto end = std::chrono::steady_clock::now();
+    std::cout << "Sweep time: " << std::chrono::duration<double>(end - start).count() << "s" << std::endl;
+
+    if (const char* csvFile = getenv("GLS_SWEEP_CSV")) {
+        std::ofstream csv(csvFile);
+        sweep.writeCSV(csv, results);
+    } else {
+        sweep.writeCSV(std::cout, results);
+    }
+}
+
 int main(int argc, const char * argv[]) {
     // Read ICC color profile data
     auto icc_profile_data = read_binary_file("/System/Library/ColorSync/Profiles/Display P3.icc");
@@ -312,13 +917,178 @@ int main(int argc, const char * argv[]) {
     // FIXME: the address sanitizer doesn't like the profile data.
     RawConverter rawConverter(metalDevice, &icc_profile_data, /*calibrateFromImage=*/ false);
 
+    // Per-kernel GPU timing breakdown
+    if (getenv("GLS_PROFILE_KERNELS")) {
+        rawConverter.context()->enableProfiling();
+    }
+
+    // Register, SIMD width and threadgroup memory usage of the pipelines, with their dispatch shapes
+    if (getenv("GLS_PIPELINE_REPORT")) {
+        rawConverter.context()->recordDispatches();
+    }
+
+    // Command buffer labels and debug groups per stage and kernel, for Instruments' Metal System Trace
+    if (getenv("GLS_TRACE")) {
+        rawConverter.context()->enableTracing();
+    }
+
+    // The command buffers of the first pipeline run as a .gputrace document for Xcode, GLS_GPU_CAPTURE_COUNT of them.
+    // Outside of Xcode the capture needs MTL_CAPTURE_ENABLED=1.
+    if (const char* capturePath = getenv("GLS_GPU_CAPTURE")) {
+        const char* count = getenv("GLS_GPU_CAPTURE_COUNT");
+        rawConverter.context()->captureCommandBuffers(count ? std::max(atoi(count), 1) : 16, capturePath);
+    }
+
+    // Non-blocking dumps of the debug images to the given directory
+    if (const char* dumpDirectory = getenv("GLS_DUMP_DIR")) {
+        gls::DebugDumpService::shared().enable(dumpDirectory);
+    }
+
+    // Quality/performance preset of the whole pipeline: preview, fast, balanced or max
+    if (const char* preset = getenv("GLS_PRESET")) {
+        rawConverter.setPreset(PipelinePreset::named(PipelinePreset::nameFromString(preset)));
+    }
+
+    // Single pass tiled demosaic, for A/B comparisons against the three pass one
+    if (getenv("GLS_TILED_DEMOSAIC")) {
+        rawConverter.setTiledDemosaic(true);
+    }
+
+    // Demosaic graph intermediates without driver hazard tracking, see RawConverter::setUntrackedHazards
+    if (getenv("GLS_UNTRACKED_HAZARDS")) {
+        rawConverter.setUntrackedHazards(true);
+    }
+
+    // Stitched pointwise stages, see RawConverter::setPointwiseFusion
+    if (getenv("GLS_POINTWISE_FUSION")) {
+        rawConverter.setPointwiseFusion(true);
+    }
+
+    // The fused pointwise stages in tile memory, see RawConverter::setTileMemoryFusion
+    if (getenv("GLS_TILE_MEMORY_FUSION")) {
+        rawConverter.setTileMemoryFusion(true);
+    }
+
+    // Quad Bayer data binned or remosaiced regardless of the preset and the noise, see RawConverter::setQuadBayerMode
+    if (const char* quadBayerMode = getenv("GLS_QUAD_BAYER")) {
+        const std::string mode = quadBayerMode;
+        if (mode != "binning" && mode != "remosaic") {
+            throw std::runtime_error("GLS_QUAD_BAYER: unknown mode " + mode);
+        }
+        rawConverter.setQuadBayerMode(mode == "binning" ? RawConverter::QuadBayerMode::binning
+                                                        : RawConverter::QuadBayerMode::remosaic);
+    }
+
+    // Raw gradients at half resolution, see RawConverter::setHalfResolutionGradients
+    if (getenv("GLS_HALF_RES_GRADIENTS")) {
+        rawConverter.setHalfResolutionGradients(true);
+    }
+
+    // Budget of the tracked GPU allocations, larger images fall back to tiled processing
+    if (const char* budget = getenv("GLS_GPU_BUDGET_MB")) {
+        rawConverter.context()->memoryTracker().setBudget(atoll(budget) * 1024 * 1024);
+    }
+
+    // Threadgroup shape autotuning, winners are stored per device in the given file
+    if (const char* autotuneFile = getenv("GLS_AUTOTUNE_FILE")) {
+        rawConverter.context()->enableAutotune(autotuneFile);
+    }
+
+    if (const char* variants = getenv("GLS_KERNEL_BENCHMARK")) {
+        benchmarkKernels(rawConverter.context(), variants);
+        return 0;
+    }
+
+    if (const char* iterations = getenv("GLS_BENCHMARK")) {
+        benchmarkPipeline(&rawConverter, atoi(iterations), argc > 1 ? std::filesystem::path(argv[1]) : std::filesystem::path());
+        return 0;
+    }
+
     if (argc > 1) {
         auto input_path = std::filesystem::path(argv[1]);
 
+        // Noise calibration of the ISO series in the directory, written as the NLFData table of the named calibration
+        // class (e.g. Sonya6400Calibration) to GLS_NLF_FILE or the standard output, GLS_BATCH frames in flight
+        if (const char* calibrationName = getenv("GLS_CALIBRATE_NLF")) {
+            const char* framesInFlight = getenv("GLS_BATCH");
+            RawConverterPool converterPool([&]() {
+                return std::make_unique<RawConverter>(metalDevice, &icc_profile_data, /*calibrateFromImage=*/ true);
+            }, framesInFlight ? std::max(atoi(framesInFlight), 1) : 4);
+
+            std::vector<std::filesystem::path> raw_files;
+            listRawFiles(input_path, &raw_files);
+
+            const char* nlfFile = getenv("GLS_NLF_FILE");
+            calibrateNoiseSeries(&converterPool, rawConverter.xyz_rgb(), raw_files,
+                                 /*threads=*/ std::max((int) std::thread::hardware_concurrency(), 2), calibrationName,
+                                 nlfFile ? std::filesystem::path(nlfFile) : std::filesystem::path());
+            return 0;
+        }
+
+        // Scores the denoiser parameter combinations of GLS_SWEEP_AXES against the given reference DNG
+        if (const char* reference = getenv("GLS_SWEEP")) {
+            sweepParameters(&rawConverter, input_path, reference);
+            return 0;
+        }
+
+        // Batch conversion with the given number of images in GPU flight
+        if (const char* framesInFlight = getenv("GLS_BATCH")) {
+            const int threads = std::max((int) std::thread::hardware_concurrency(), 2);
+
+            // Conversion service on the directory, scanned every GLS_WATCH seconds, see watchDirectory
+            const char* watchInterval = getenv("GLS_WATCH");
+            const auto run = [&](auto* converterPool, const DNGIOLoader* ioLoader) {
+                if (watchInterval) {
+                    const char* metricsFile = getenv("GLS_METRICS_FILE");
+                    watchDirectory(converterPool, rawConverter.xyz_rgb(), input_path, std::max(atoi(watchInterval), 1),
+                                   /*decodeThreads=*/ threads / 2, /*writerThreads=*/ threads / 2, ioLoader,
+                                   metricsFile ? std::filesystem::path(metricsFile) : std::filesystem::path());
+                } else {
+                    batchDemosaicDirectory(converterPool, rawConverter.xyz_rgb(), input_path,
+                                           /*decodeThreads=*/ threads / 2, /*writerThreads=*/ threads / 2, ioLoader);
+                }
+            };
+            // A long running service has the remaining kernels built in the background before its first files land
+            const auto prewarm = [&](std::unique_ptr<RawConverter> converter) {
+                if (watchInterval) {
+                    converter->context()->prewarmKernels();
+                }
+                return converter;
+            };
+
+            // Spread over all the GPUs of the host, with the given number of images in flight per GPU
+            if (getenv("GLS_ALL_GPUS")) {
+                MultiDeviceRawConverterPool converterPool(MultiDeviceRawConverterPool::allDevices(),
+                                                          [&](NS::SharedPtr<MTL::Device> device) {
+                    return prewarm(std::make_unique<RawConverter>(device, &icc_profile_data, /*calibrateFromImage=*/ false));
+                }, /*noiseModelCache=*/ nullptr, std::max(atoi(framesInFlight), 1));
+
+                run(&converterPool, /*ioLoader=*/ nullptr);
+                converterPool.printStatistics();
+                return 0;
+            }
+
+            RawConverterPool converterPool([&]() {
+                return prewarm(std::make_unique<RawConverter>(metalDevice, &icc_profile_data, /*calibrateFromImage=*/ false));
+            }, std::max(atoi(framesInFlight), 1));
+
+            // Fast resource loading of the uncompressed DNGs
+            std::unique_ptr<DNGIOLoader> ioLoader;
+            if (getenv("GLS_IO_LOADER")) {
+                ioLoader = std::make_unique<DNGIOLoader>(metalDevice.get());
+            }
+
+            run(&converterPool, ioLoader.get());
+            return 0;
+        }
+
         // demosaicFile(&rawConverter, input_path);
 
         demosaicDirectory(&rawConverter, input_path);
 
+        outputWriter().wait();
+        gls::DebugDumpService::shared().disable();
+
         // fmenApplyToFile(&rawConverter, input_path, &icc_profile_data);
 
         // fmenApplyToDirectory(&rawConverter, input_path, &icc_profile_data);
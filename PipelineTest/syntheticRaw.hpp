@@ -0,0 +1,251 @@
+// Copyright (c) 2021-2023 Glass Imaging Inc.
+// Author: Fabio Riccardi <fabio@glass-imaging.com>
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef syntheticRaw_hpp
+#define syntheticRaw_hpp
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gls_image.hpp"
+#include "gls_linalg.hpp"
+#include "gls_tiff_metadata.hpp"
+
+#include "demosaic.hpp"
+#include "CameraCalibration.hpp"
+#include "TaskScheduler.hpp"
+
+// Synthetic Bayer frames for reproducible performance tests on any machine, no DNG corpus needed.
+//
+// The scene is procedural and defined in continuous coordinates: flat colored cells giving sharp edges and corners
+// for the feature detection, modulated by a few octaves of value noise for texture. Frames of a burst sample the
+// same scene through a global motion homography, mapping the reference's coordinates to the frame's like the
+// BurstMerger priors. The noise is the calibrated raw NLF of cameraModel at the given ISO: per CFA channel the
+// variance of a signal x, normalized to the [black, white] range, is rawNlf.first[c] * x + rawNlf.second[c].
+//
+// The DNG and EXIF metadata the calibrations expect (model, CFA pattern, levels, color matrix, neutral, ISO) come
+// with every frame, so the frames go through CameraCalibrationRegistry like the real ones. The output only depends
+// on the parameters and the seed, not on the thread count.
+class SyntheticRawGenerator {
+public:
+    struct Parameters {
+        int width = 4032;
+        int height = 3024;
+        BayerPattern bayerPattern = BayerPattern::rggb;
+        int iso = 100;
+        std::string cameraModel = "iPhone 11";
+        int blackLevel = 528;
+        int whiteLevel = 4095;
+        uint64_t seed = 0;
+
+        // 4:3 frame of about the given megapixels, with even dimensions
+        static Parameters withMegapixels(float megapixels) {
+            Parameters parameters;
+            const float width = std::sqrt(megapixels * 1.0e6 * 4 / 3);
+            parameters.width = 2 * (int) std::round(width / 2);
+            parameters.height = 2 * (int) std::round(width * 3 / 4 / 2);
+            return parameters;
+        }
+    };
+
+    struct Frame {
+        gls::image<gls::luma_pixel_16>::unique_ptr rawImage;
+        gls::tiff_metadata dng_metadata, exif_metadata;
+        gls::Matrix<3, 3> motion;
+    };
+
+private:
+    const Parameters _parameters;
+    RawNLF _rawNlf;
+
+    // Camera channel response to a white scene, the inverse of the white balance gains
+    static constexpr std::array<float, 3> kAsShotNeutral = { 0.5, 1.0, 0.65 };
+
+    // Sizes of the scene's cells and noise octaves, in pixels
+    static constexpr float kCellSize = 96;
+    static constexpr std::array<float, 3> kOctaves = { 192, 48, 12 };
+
+    static uint32_t hash(int32_t x, int32_t y, uint32_t seed) {
+        uint32_t h = (uint32_t) x * 0x8da6b343u ^ (uint32_t) y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        return h ^ (h >> 16);
+    }
+
+    static float unitHash(int32_t x, int32_t y, uint32_t seed) {
+        return (hash(x, y, seed) & 0xffffff) / (float) 0xffffff;
+    }
+
+    static float smootherstep(float t) {
+        return t * t * t * (t * (t * 6 - 15) + 10);
+    }
+
+    // Bilinearly interpolated lattice noise in [0, 1]
+    static float valueNoise(float x, float y, uint32_t seed) {
+        const float fx = std::floor(x), fy = std::floor(y);
+        const int ix = (int) fx, iy = (int) fy;
+        const float tx = smootherstep(x - fx), ty = smootherstep(y - fy);
+        const float v0 = std::lerp(unitHash(ix, iy, seed), unitHash(ix + 1, iy, seed), tx);
+        const float v1 = std::lerp(unitHash(ix, iy + 1, seed), unitHash(ix + 1, iy + 1, seed), tx);
+        return std::lerp(v0, v1, ty);
+    }
+
+    // Linear scene radiance of channel c at the reference coordinates (x, y)
+    float scene(float x, float y, int c) const {
+        const uint32_t seed = (uint32_t) _parameters.seed;
+        const int cellX = (int) std::floor(x / kCellSize), cellY = (int) std::floor(y / kCellSize);
+        const float cellColor = 0.05 + 0.85 * unitHash(cellX, cellY, seed + 1 + c);
+
+        float texture = 0, weight = 0.5;
+        for (int i = 0; i < kOctaves.size(); i++) {
+            texture += weight * valueNoise(x / kOctaves[i], y / kOctaves[i], seed + 7 + i);
+            weight /= 2;
+        }
+        return cellColor * (0.4 + 0.7 * texture);
+    }
+
+    static gls::Matrix<3, 3> translationRotation(float dx, float dy, float angle, float cx, float cy) {
+        const float c = std::cos(angle), s = std::sin(angle);
+        // Rotation around (cx, cy) followed by the translation
+        return gls::Matrix<3, 3> {
+            { c, -s, cx - c * cx + s * cy + dx },
+            { s, c, cy - s * cx - c * cy + dy },
+            { 0, 0, 1 },
+        };
+    }
+
+    void fillMetadata(Frame* frame) const {
+        // Camera primaries of linear sRGB with a green heavy channel response, XYZ to camera
+        const gls::Matrix<3, 3> xyz_srgb = {
+            { 3.2406, -1.5372, -0.4986 },
+            { -0.9689, 1.8758, 0.0415 },
+            { 0.0557, -0.2040, 1.0570 },
+        };
+        std::vector<float> color_matrix(9);
+        for (int j = 0; j < 3; j++) {
+            for (int i = 0; i < 3; i++) {
+                color_matrix[3 * j + i] = kAsShotNeutral[j] * xyz_srgb[j][i];
+            }
+        }
+
+        std::vector<uint8_t> cfaPattern(4);
+        const auto& offsets = bayerOffsets[_parameters.bayerPattern];
+        for (int c = 0; c < 4; c++) {
+            // CFA colors: 0 red, 1 green, 2 blue
+            cfaPattern[2 * offsets[c].y + offsets[c].x] = c == 3 ? 1 : c;
+        }
+
+        auto& dng_metadata = frame->dng_metadata;
+        dng_metadata.insert({ TIFFTAG_COLORMATRIX1, color_matrix });
+        dng_metadata.insert({ TIFFTAG_ASSHOTNEUTRAL, std::vector<float>(kAsShotNeutral.begin(), kAsShotNeutral.end()) });
+        dng_metadata.insert({ TIFFTAG_BASELINEEXPOSURE, 0.0f });
+        dng_metadata.insert({ TIFFTAG_CFAREPEATPATTERNDIM, std::vector<uint16_t>{ 2, 2 } });
+        dng_metadata.insert({ TIFFTAG_CFAPATTERN, cfaPattern });
+        dng_metadata.insert({ TIFFTAG_BLACKLEVEL, std::vector<float>{ (float) _parameters.blackLevel } });
+        dng_metadata.insert({ TIFFTAG_WHITELEVEL, std::vector<uint32_t>{ (uint32_t) _parameters.whiteLevel } });
+        dng_metadata.insert({ TIFFTAG_MODEL, _parameters.cameraModel });
+
+        auto& exif_metadata = frame->exif_metadata;
+        exif_metadata.insert({ EXIFTAG_ISOSPEEDRATINGS, std::vector<uint16_t>{ (uint16_t) _parameters.iso } });
+        exif_metadata.insert({ EXIFTAG_EXPOSURETIME, std::vector<float>{ 1.0f / 60 } });
+    }
+
+public:
+    SyntheticRawGenerator(const Parameters& parameters) : _parameters(parameters) {
+        if (_parameters.width < 2 || _parameters.height < 2 || _parameters.width % 2 || _parameters.height % 2) {
+            throw std::runtime_error("SyntheticRawGenerator: the frame size must be even");
+        }
+        const auto calibration = CameraCalibrationRegistry::shared().find(_parameters.cameraModel, "");
+        if (!calibration) {
+            throw std::runtime_error("SyntheticRawGenerator: no calibration for " + _parameters.cameraModel);
+        }
+        _rawNlf = calibration->nlfFromIso(_parameters.iso).rawNlf;
+    }
+
+    const Parameters& parameters() const {
+        return _parameters;
+    }
+
+    // Frame of the scene seen through motion, the noise of frames with different index is independent
+    Frame frame(int index, const gls::Matrix<3, 3>& motion = gls::Matrix<3, 3>::identity()) const {
+        Frame frame;
+        frame.motion = motion;
+        frame.rawImage = std::make_unique<gls::image<gls::luma_pixel_16>>(_parameters.width, _parameters.height);
+        fillMetadata(&frame);
+
+        // Frame to reference coordinates
+        const auto frameToScene = gls::inverse(motion);
+        const auto& offsets = bayerOffsets[_parameters.bayerPattern];
+        std::array<int, 4> cfaChannel;
+        for (int c = 0; c < 4; c++) {
+            cfaChannel[2 * offsets[c].y + offsets[c].x] = c;
+        }
+        const float range = (float) (_parameters.whiteLevel - _parameters.blackLevel);
+
+        auto& rawImage = *frame.rawImage;
+        gls::parallel_for(0, rawImage.height, /*grain=*/ 32, [&](int y0, int y1) {
+            for (int y = y0; y < y1; y++) {
+                std::mt19937 rng(hash(index, y, (uint32_t) _parameters.seed));
+                std::normal_distribution<float> gaussian;
+
+                // Homogeneous scene coordinates, stepping by the first column of frameToScene per pixel
+                float px = frameToScene[0][1] * y + frameToScene[0][2];
+                float py = frameToScene[1][1] * y + frameToScene[1][2];
+                float pw = frameToScene[2][1] * y + frameToScene[2][2];
+                for (int x = 0; x < rawImage.width; x++) {
+                    const int c = cfaChannel[2 * (y & 1) + (x & 1)];
+                    const int color = c == 3 ? 1 : c;
+                    const float signal = kAsShotNeutral[color] * scene(px / pw, py / pw, color);
+                    px += frameToScene[0][0];
+                    py += frameToScene[1][0];
+                    pw += frameToScene[2][0];
+                    const float variance = std::max(_rawNlf.first[c] * signal + _rawNlf.second[c], 0.0f);
+                    const float value = std::clamp(signal + std::sqrt(variance) * gaussian(rng), 0.0f, 1.0f);
+                    rawImage[y][x] = (uint16_t) std::lround(_parameters.blackLevel + value * range);
+                }
+            }
+        });
+        return frame;
+    }
+
+    // Burst with a random walk of global motion: per frame a translation of up to maxTranslation pixels and
+    // a rotation of up to maxRotation radians around the center. The first frame is the reference.
+    std::vector<Frame> burst(int count, float maxTranslation = 8, float maxRotation = 0.002) const {
+        std::mt19937 rng((uint32_t) _parameters.seed ^ 0x9e3779b9u);
+        std::uniform_real_distribution<float> uniform(-1, 1);
+
+        std::vector<Frame> frames;
+        auto motion = gls::Matrix<3, 3>::identity();
+        for (int i = 0; i < count; i++) {
+            if (i > 0) {
+                motion = translationRotation(maxTranslation * uniform(rng), maxTranslation * uniform(rng),
+                                             maxRotation * uniform(rng), _parameters.width / 2.0f,
+                                             _parameters.height / 2.0f) * motion;
+            }
+            frames.push_back(frame(i, motion));
+        }
+        return frames;
+    }
+};
+
+#endif /* syntheticRaw_hpp */
@@ -13,15 +13,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <string>
 #include <cmath>
 #include <chrono>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <ranges>
 #include <set>
+#include <thread>
+#include <tuple>
 
 #include "gls_logging.h"
 #include "gls_image.hpp"
@@ -29,9 +37,15 @@
 
 #include "raw_converter.hpp"
 #include "CameraCalibration.hpp"
+#include "dng_decoder.hpp"
 
 #include "SURF.hpp"
+#include "KeypointCache.hpp"
+#include "gls_image_writer.hpp"
 #include "Homography.hpp"
+#include "BurstMerger.hpp"
+#include "BurstFrameSelector.hpp"
+#include "HDRMerger.hpp"
 
 std::vector<std::filesystem::path> parseDirectory(const std::string& dir) {
     std::set<std::filesystem::path> directory_listing;
@@ -43,54 +57,64 @@ std::vector<std::filesystem::path> parseDirectory(const std::string& dir) {
     return std::vector<std::filesystem::path>(directory_listing.begin(), directory_listing.end());
 }
 
-gls::mtl_image_2d<gls::pixel_float4>* runPipeline(RawConverter* rawConverter,
-                                                  const std::filesystem::path& input_path,
-                                                  std::unique_ptr<DemosaicParameters>* demosaicParameters) {
-    gls::tiff_metadata dng_metadata, exif_metadata;
-    const auto inputImage = gls::image<gls::luma_pixel_16>::read_dng_file(input_path.string(), &dng_metadata, &exif_metadata);
+static std::vector<unsigned char> read_binary_file(const std::string filename) {
+    return gls::MappedFile::read(filename);
+}
 
-    if (*demosaicParameters == nullptr) {
-        const auto cameraCalibration = getiPhone14TeleCalibration(); // getLeicaQ2Calibration(); // getIPhone11Calibration();
-        *demosaicParameters = cameraCalibration->getDemosaicParameters(*inputImage, rawConverter->xyz_rgb(), &dng_metadata, &exif_metadata);
-    }
+// Read and parsed once per process, shared by all the converters
+static std::shared_ptr<const ColorProfileCache::Profile> displayP3Profile() {
+    const std::string path = "/System/Library/ColorSync/Profiles/Display P3.icc";
+    return ColorProfileCache::shared().profile(path, [&]() { return read_binary_file(path); });
+}
+
+// A decoded frame of a burst with its parameters
+struct BurstFrame {
+    gls::image<gls::luma_pixel_16>::unique_ptr image;
+    std::unique_ptr<DemosaicParameters> demosaicParameters;
+};
 
-    const auto demosaicedImage = rawConverter->demosaic(*inputImage, demosaicParameters->get(), /*noiseReduction=*/ true, /*postProcess=*/ true);
+// The first frame decoded sets up the burst's calibration, the others share its parameters
+BurstFrame decodeFrame(const std::filesystem::path& image_path, const gls::Matrix<3, 3>& xyz_rgb,
+                       std::unique_ptr<BurstCalibration>* burstCalibration) {
+    gls::tiff_metadata dng_metadata, exif_metadata;
+    auto inputImage = DNGDecoder::read(image_path.string(), &dng_metadata, &exif_metadata);
 
-    return demosaicedImage;
+    if (!*burstCalibration) {
+        *burstCalibration = std::make_unique<BurstCalibration>(inputImage->size(), xyz_rgb, &dng_metadata, &exif_metadata);
+    }
+    auto demosaicParameters = (*burstCalibration)->frameParameters(inputImage->size(), &dng_metadata, &exif_metadata);
+    return { std::move(inputImage), std::move(demosaicParameters) };
 }
 
-static std::vector<unsigned char> read_binary_file(const std::string filename) {
-    std::ifstream file(filename, std::ios::binary);
-    file.unsetf(std::ios::skipws);
-
-    std::streampos file_size;
-    file.seekg(0, std::ios::end);
-    file_size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    std::vector<unsigned char> vec;
-    vec.reserve(file_size);
-    vec.insert(vec.begin(),
-               std::istream_iterator<unsigned char>(file),
-               std::istream_iterator<unsigned char>());
-    return (vec);
+// Converts the frame with the default pipeline on the GPU: the converter writes its output and the registration luma
+// straight to the merger's frame textures, in the same pass. The frame's image must stay alive until done.
+std::shared_future<void> convertFrame(RawConverter* rawConverter, const BurstFrame& frame,
+                                      const BurstMerger::FrameTargets& targets) {
+    RawConverter::ExtraOutputs extraOutputs;
+    extraOutputs.luma = targets.lumaImage;
+    extraOutputs.lumaWeights = frame.demosaicParameters->rgb_cam[0];
+    rawConverter->setExtraOutputs(extraOutputs);
+
+    const auto result = rawConverter->demosaicAsync(*frame.image, frame.demosaicParameters.get(), /*noiseReduction=*/ true,
+                                                    /*postProcess=*/ true, targets.rgbImage);
+    rawConverter->setExtraOutputs(RawConverter::ExtraOutputs());
+    return result.done;
 }
 
-std::pair<gls::mtl_image_2d<float>::unique_ptr,
-          gls::mtl_image_2d<gls::pixel_float4>::unique_ptr> convertImage(RawConverter* rawConverter,
-                                                                         const convertToGrayscale& convertToGrayscale,
-                                                                         const std::string& image_path)
-{
-    auto context = rawConverter->context();
-    std::unique_ptr<DemosaicParameters> demosaicParameters = nullptr;
-    auto rgb_image_ptr = runPipeline(rawConverter, image_path, &demosaicParameters);
-    auto rgb_image = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(context->device(), rgb_image_ptr->size());
-    rgb_image->copyPixelsFrom(*rgb_image_ptr->mapImage());
-    const auto& transform = demosaicParameters->rgb_cam;
-    auto luma_image = std::make_unique<gls::mtl_image_2d<float>>(context->device(), rgb_image_ptr->size());
-    convertToGrayscale(context, *rgb_image, luma_image.get(), transform[0]);
+// Cheap alignment luma for the raw burst path: the half resolution green channel of the raw data, no demosaicing
+gls::mtl_image_2d<float>::unique_ptr rawLumaImage(MetalContext* context,
+                                                  const bayerToRawRGBAKernel& bayerToRawRGBA,
+                                                  const rawGreenToGrayscaleKernel& rawGreenToGrayscale,
+                                                  const gls::mtl_image_2d<gls::luma_pixel_16>& rawImage,
+                                                  const DemosaicParameters& demosaicParameters) {
+    gls::mtl_image_2d<gls::pixel_float4> rgbaImage(context->device(), rawImage.size() / 2);
+    auto luma_image = std::make_unique<gls::mtl_image_2d<float>>(context->device(), rawImage.size() / 2);
+
+    bayerToRawRGBA(context, rawImage, &rgbaImage, demosaicParameters.bayerPattern);
+    rawGreenToGrayscale(context, rgbaImage, luma_image.get(), demosaicParameters.black_level / 0xffff,
+                        demosaicParameters.scale_mul[1]);
     context->waitForCompletion();
-    return std::make_pair(std::move(luma_image), std::move(rgb_image));
+    return luma_image;
 }
 
 float sigmoid(float x, float s) {
@@ -144,23 +168,45 @@ std::array<gls::image<float>::unique_ptr, 4> RawChannels(const gls::image<gls::l
 
 std::array<gls::image<float>::unique_ptr, 4> RawChannels(const std::string& input_path) {
     gls::tiff_metadata dng_metadata, exif_metadata;
-    const auto inputImage = gls::image<gls::luma_pixel_16>::read_dng_file(input_path, &dng_metadata, &exif_metadata);
+    const auto inputImage = DNGDecoder::read(input_path, &dng_metadata, &exif_metadata);
 
     return RawChannels(*inputImage, dng_metadata, exif_metadata);
 }
 
+// Encodes in the background, the fused image can be reused once this returns
+gls::ImageWriter& fusedImageWriter() {
+    static gls::ImageWriter writer(/*threads=*/ 2);
+    return writer;
+}
+
 template <typename pixel_type>
 void saveFusedImage(const gls::image<pixel_type>& fused_image, const std::string& output_path) {
-    gls::image<gls::rgb_pixel> output(fused_image.size());
-    output.apply([&](gls::rgb_pixel* p, int x, int y) {
-        const auto& ip = fused_image[y][x];
-        *p = {
-            (uint8_t) (255 * std::clamp((float) ip.red, 0.0f, 1.0f)),
-            (uint8_t) (255 * std::clamp((float) ip.green, 0.0f, 1.0f)),
-            (uint8_t) (255 * std::clamp((float) ip.blue, 0.0f, 1.0f))
-        };
-    });
-    output.write_tiff_file(output_path);
+    fusedImageWriter().write<gls::rgb_pixel>(fused_image, output_path);
+}
+
+// Checks that the frames of a burst can be merged with its reference (the last frame): same camera and image size.
+// Only the IFDs of the memory mapped files are parsed, the pixels are decoded when the burst is processed.
+static bool mergeableBurst(const std::vector<std::filesystem::path>& burst) {
+    const auto signature = [](const std::filesystem::path& path) {
+        const DNGReader reader(path.string());
+        const auto size = reader.imageSize();
+        return std::make_tuple(reader.cameraModel(), size.width, size.height);
+    };
+
+    try {
+        const auto reference = signature(burst.back());
+        for (const auto& path : burst) {
+            if (signature(path) != reference) {
+                std::cout << "Skipping the burst of " << burst.back().filename() << ", " << path.filename()
+                          << " doesn't match its reference" << std::endl;
+                return false;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cout << "Skipping the burst of " << burst.back().filename() << ": " << e.what() << std::endl;
+        return false;
+    }
+    return true;
 }
 
 std::vector<std::vector<std::filesystem::path>> findBursts(std::vector<std::filesystem::path> input_files) {
@@ -174,7 +220,7 @@ std::vector<std::vector<std::filesystem::path>> findBursts(std::vector<std::file
         if (found != std::string::npos) {
             current_first = &f;
             current_found = found;
-            if (!current_burst.empty()) {
+            if (!current_burst.empty() && mergeableBurst(current_burst)) {
                 bursts.push_back(current_burst);
             }
             current_burst = { f };
@@ -185,7 +231,7 @@ std::vector<std::vector<std::filesystem::path>> findBursts(std::vector<std::file
             }
         }
     }
-    if (!current_burst.empty()) {
+    if (!current_burst.empty() && mergeableBurst(current_burst)) {
         bursts.push_back(current_burst);
         current_burst = {};
     }
@@ -194,6 +240,176 @@ std::vector<std::vector<std::filesystem::path>> findBursts(std::vector<std::file
     return bursts;
 }
 
+// Processes the bursts of a directory with K bursts in flight. The Metal device, the ICC profile and, for every
+// in flight burst, a RawConverter with its BurstMerger (kernels, textures and SURF detector) are created once for
+// the processor's lifetime. Each slot merges whole bursts on its own thread, so the CPU work of a burst (DNG
+// decoding, feature matching, RANSAC) overlaps with the GPU work of the others.
+class BurstProcessor {
+    // The registration has its own context: its GPU work (the feature detection, the residuals and the fusion) and
+    // its waits don't queue behind the conversion of the next frame
+    struct Slot {
+        std::unique_ptr<RawConverter> rawConverter;
+        std::unique_ptr<MetalContext> registrationContext;
+        std::unique_ptr<BurstMerger> burstMerger;
+        std::unique_ptr<BurstFrameSelector> frameSelector;
+    };
+
+    std::shared_ptr<const ColorProfileCache::Profile> _iccProfile;
+    NS::SharedPtr<MTL::Device> _metalDevice;
+    gls::KeypointCache _keypointCache;
+    std::vector<Slot> _slots;
+
+    std::mutex _statisticsMutex;
+    std::vector<double> _latencies;
+    double _registrationMs = 0;
+    double _hiddenRegistrationMs = 0;
+
+    void processBurst(Slot* slot, const std::vector<std::filesystem::path>& burst) {
+        const auto start = std::chrono::steady_clock::now();
+
+        // The burst is named after its last frame, which sets up the calibration
+        const auto& reference_image_path = burst.back();
+
+        // Every frame is decoded and scored first: the sharpest one is the reference, the blurred ones are never
+        // converted, the misaligned ones are dropped once registered
+        std::vector<std::filesystem::path> frame_paths = { burst.back() };
+        frame_paths.insert(frame_paths.end(), burst.begin(), burst.end() - 1);
+
+        auto frameSelector = slot->frameSelector.get();
+        frameSelector->reset();
+        std::unique_ptr<BurstCalibration> burstCalibration;
+        std::vector<BurstFrame> frames;
+        for (const auto& path : frame_paths) {
+            frames.push_back(decodeFrame(path, slot->rawConverter->xyz_rgb(), &burstCalibration));
+            frameSelector->addFrame(*frames.back().image, *frames.back().demosaicParameters);
+        }
+
+        const auto selectedFrames = frameSelector->sharpFrames();
+        const int referenceFrame = selectedFrames.front();
+        for (int i = 0; i < (int) frames.size(); i++) {
+            if (!frameSelector->sharp(i)) {
+                std::cout << "Dropping blurred frame " << frame_paths[i].filename() << ", sharpness "
+                          << frameSelector->score(i).sharpness << " of " << frameSelector->score(referenceFrame).sharpness
+                          << std::endl;
+            }
+        }
+
+        auto burstMerger = slot->burstMerger.get();
+        auto rawConverter = slot->rawConverter.get();
+        auto context = rawConverter->context();
+        burstMerger->reset();
+
+        // The GPU converts the next frame into the merger's staging textures while the CPU registers the current
+        // one, the registration time the GPU time covers is hidden
+        const auto frameSize = frames[referenceFrame].image->size();
+        auto conversion = convertFrame(rawConverter, frames[referenceFrame], burstMerger->nextFrameTargets(frameSize));
+        conversion.get();
+
+        int mergedFrames = 0;
+        double registrationMs = 0, hiddenMs = 0;
+        for (int k = 0; k < (int) selectedFrames.size(); k++) {
+            const int i = selectedFrames[k];
+            if (k > 0) {
+                burstMerger->adoptStagedFrame();
+            }
+            frames[i].image.reset();
+
+            const bool convertNext = k + 1 < (int) selectedFrames.size();
+            const double gpuTimeStart = context->gpuTime();
+            if (convertNext) {
+                conversion = convertFrame(rawConverter, frames[selectedFrames[k + 1]], burstMerger->stagingTargets(frameSize));
+            }
+
+            const auto acceptAlignment = [&](const gls::Matrix<3, 3>& homography) {
+                return frameSelector->aligned(referenceFrame, i, homography);
+            };
+            const auto registrationStart = std::chrono::steady_clock::now();
+            mergedFrames += burstMerger->addConvertedFrame(/*prior=*/ nullptr,
+                                                           i == referenceFrame ? nullptr : BurstMerger::alignment_check_type(acceptAlignment));
+            const std::chrono::duration<double, std::milli> registration = std::chrono::steady_clock::now() - registrationStart;
+            registrationMs += registration.count();
+
+            if (convertNext) {
+                conversion.get();
+                hiddenMs += std::min(registration.count(), 1000 * (context->gpuTime() - gpuTimeStart));
+            }
+        }
+
+        auto fused_image_cpu = burstMerger->fusedImage().mapImage();
+        const auto& stem = reference_image_path.stem().string();
+        const auto filename = stem.substr(0, stem.find("_" + std::to_string(burst.size()) + "_"));
+        saveFusedImage(*fused_image_cpu, reference_image_path.parent_path().parent_path() / "Fusion" / (filename + "_fullaRH.tiff"));
+
+        const std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - start;
+
+        std::lock_guard<std::mutex> guard(_statisticsMutex);
+        _latencies.push_back(latency.count());
+        _registrationMs += registrationMs;
+        _hiddenRegistrationMs += hiddenMs;
+        std::cout << "Merged " << mergedFrames << " of " << burst.size() << " frames of " << reference_image_path.filename() << " in "
+                  << latency.count() << "ms, registration: " << registrationMs << "ms, " << hiddenMs
+                  << "ms of it behind the GPU" << std::endl;
+    }
+
+public:
+    // With a keypoint cache directory the frames' features persist across runs, e.g. for tuning loops. The mesh warp
+    // registers the frames with per cell homographies, for the scenes with parallax.
+    BurstProcessor(int burstsInFlight = 2, const std::filesystem::path& keypointCacheDirectory = {}, bool meshWarp = false) :
+        _iccProfile(displayP3Profile()),
+        _keypointCache(/*capacity=*/ 64, keypointCacheDirectory) {
+        auto allMetalDevices = NS::TransferPtr(MTL::CopyAllDevices());
+        _metalDevice = NS::RetainPtr(allMetalDevices->object<MTL::Device>(0));
+
+        for (int i = 0; i < std::max(burstsInFlight, 1); i++) {
+            // FIXME: the address sanitizer doesn't like the profile data.
+            auto rawConverter = std::make_unique<RawConverter>(_metalDevice, &_iccProfile->data, /*calibrateFromImage=*/ false);
+            auto registrationContext = std::make_unique<MetalContext>(_metalDevice);
+            auto burstMerger = std::make_unique<BurstMerger>(registrationContext.get(), &_keypointCache);
+            burstMerger->setMeshWarp(meshWarp);
+            auto frameSelector = std::make_unique<BurstFrameSelector>(registrationContext.get());
+            _slots.push_back({ std::move(rawConverter), std::move(registrationContext), std::move(burstMerger),
+                               std::move(frameSelector) });
+        }
+    }
+
+    void process(const std::vector<std::vector<std::filesystem::path>>& bursts) {
+        std::atomic<int> nextBurst = 0;
+        std::vector<std::thread> workers;
+        for (auto& slot : _slots) {
+            workers.emplace_back([&, slot = &slot]() {
+                // Batch work, the registration's parallel_for helpers follow at the same class
+                gls::setThreadQoS(gls::QoS::utility);
+                for (int b = nextBurst++; b < (int) bursts.size(); b = nextBurst++) {
+                    if (bursts[b].size() > 1) {
+                        processBurst(slot, bursts[b]);
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void printStatistics() {
+        std::lock_guard<std::mutex> guard(_statisticsMutex);
+        if (_latencies.empty()) {
+            std::cout << "No bursts processed" << std::endl;
+            return;
+        }
+        auto latencies = _latencies;
+        std::sort(latencies.begin(), latencies.end());
+        const double mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        const auto percentile = [&](double p) { return latencies[std::min((size_t) (p * latencies.size()), latencies.size() - 1)]; };
+
+        std::cout << "Burst latency over " << latencies.size() << " bursts, " << _slots.size() << " in flight - min: "
+                  << latencies.front() << "ms, mean: " << mean << "ms, median: " << percentile(0.5)
+                  << "ms, p90: " << percentile(0.9) << "ms, max: " << latencies.back() << "ms" << std::endl;
+        std::cout << "Registration CPU time: " << _registrationMs << "ms, hidden behind the GPU: " << _hiddenRegistrationMs
+                  << "ms (" << (_registrationMs > 0 ? 100 * _hiddenRegistrationMs / _registrationMs : 0) << "%)" << std::endl;
+    }
+};
+
 int main_full(int argc, const char * argv[]) {
     if (argc < 2) {
         std::cout << "Please provide a directory path..." << std::endl;
@@ -202,62 +418,181 @@ int main_full(int argc, const char * argv[]) {
     const auto& input_files = parseDirectory(argv[1]);
     const auto& bursts = findBursts(input_files);
 
+    // GLS_MESH_WARP registers the frames with a mesh of homographies
+    BurstProcessor burstProcessor(/*burstsInFlight=*/ 2, /*keypointCacheDirectory=*/ {},
+                                  /*meshWarp=*/ getenv("GLS_MESH_WARP") != nullptr);
+    burstProcessor.process(bursts);
+    burstProcessor.printStatistics();
+
+    fusedImageWriter().wait();
+    return 0;
+}
+
+// Burst fusion in the raw domain: the frames are registered on their half resolution green channel and merged
+// in the Bayer domain, only the fused raw image goes through the full pipeline, with a denoise matched to the
+// merged noise level
+int main_raw(int argc, const char * argv[]) {
+    if (argc < 2) {
+        std::cout << "Please provide a directory path..." << std::endl;
+    }
+
+    const auto& input_files = parseDirectory(argv[1]);
+    const auto& bursts = findBursts(input_files);
+
+    // Read ICC color profile data
+    const auto iccProfile = displayP3Profile();
+
+    auto allMetalDevices = NS::TransferPtr(MTL::CopyAllDevices());
+    auto metalDevice = NS::RetainPtr(allMetalDevices->object<MTL::Device>(0));
+
+    // FIXME: the address sanitizer doesn't like the profile data.
+    RawConverter rawConverter(metalDevice, &iccProfile->data, /*calibrateFromImage=*/ false);
+    auto context = rawConverter.context();
+
+    bayerToRawRGBAKernel _bayerToRawRGBA(context);
+    rawGreenToGrayscaleKernel _rawGreenToGrayscale(context);
+    rawMergeKernel _rawMerge(context);
+
     for (const auto& burst : bursts) {
         if (burst.size() == 4) {
             const auto& reference_image_path = burst[3];
             std::cout << "Reference Image: " << reference_image_path.filename() << std::endl;
 
-            // Read ICC color profile data
-            auto icc_profile_data = read_binary_file("/System/Library/ColorSync/Profiles/Display P3.icc");
-
-            auto allMetalDevices = NS::TransferPtr(MTL::CopyAllDevices());
-            auto metalDevice = NS::RetainPtr(allMetalDevices->object<MTL::Device>(0));
+            const auto base_filename = reference_image_path.stem().string().substr(0, reference_image_path.stem().string().find("_4_"));
 
-            // FIXME: the address sanitizer doesn't like the profile data.
-            RawConverter rawConverter(metalDevice, &icc_profile_data, /*calibrateFromImage=*/ false);
-            auto context = rawConverter.context();
+            gls::tiff_metadata dng_metadata, exif_metadata;
+            // The tiles are decoded in parallel straight into the textures' memory
+            const auto reference_raw = DNGDecoder::readHostImage(context->device(), reference_image_path.string(),
+                                                                 &dng_metadata, &exif_metadata);
 
-            convertToGrayscale _convertToGrayscale(context);
-            RegisterAndFuseKernel _registerAndFuse(context);
+            auto demosaicParameters = CameraCalibrationRegistry::shared().getDemosaicParameters(*reference_raw->mapImage(), rawConverter.xyz_rgb(),
+                                                                                                &dng_metadata, &exif_metadata);
 
-            const auto reference_image = convertImage(&rawConverter, _convertToGrayscale, reference_image_path.string());
+            const auto& reference_image = *reference_raw;
+            _rawMerge.begin(context, reference_image, demosaicParameters->bayerPattern, demosaicParameters->scale_mul,
+                            demosaicParameters->black_level / 0xffff, demosaicParameters->noiseModel.rawNlf);
 
-            auto fused_image = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(context->device(), reference_image.first->size());
-            fused_image->copyPixelsFrom(*reference_image.second->mapImage());
+            const auto reference_luma = rawLumaImage(context, _bayerToRawRGBA, _rawGreenToGrayscale, reference_image, *demosaicParameters);
 
-            auto surf = gls::SURF::makeInstance(context, reference_image.first->width, reference_image.first->height,
+            auto surf = gls::SURF::makeInstance(context, reference_luma->width, reference_luma->height,
                                                 /*max_features=*/ 1500, /*nOctaves=*/ 4, /*nOctaveLayers=*/ 2, /*hessianThreshold=*/ 0.02);
 
-            auto reference_keypoints = std::make_unique<std::vector<KeyPoint>>();
-            gls::image<float>::unique_ptr reference_descriptors;
-            surf->detectAndCompute(*reference_image.first->mapImage(), reference_keypoints.get(), &reference_descriptors);
+            // The keypoints and their descriptors stay in Metal buffers, the frames reuse the same arrays
+            std::unique_ptr<KeyPoints> reference_keypoints;
+            surf->detectAndCompute(*reference_luma->mapImage(), &reference_keypoints);
 
             std::cout << "Found " << reference_keypoints->size() << " reference keypoints" << std::endl;
 
+            // The features of all the frames are detected first, to match them with the reference in one batch
+            std::array<gls::mtl_host_image_2d<gls::luma_pixel_16>::unique_ptr, 3> raw_images;
+            std::array<std::unique_ptr<KeyPoints>, 3> image_keypoints;
             for (int i = 0; i < 3; i++) {
-                const auto image = convertImage(&rawConverter, _convertToGrayscale, burst[i].string());
+                gls::tiff_metadata dng_metadata, exif_metadata;
+                raw_images[i] = DNGDecoder::readHostImage(context->device(), burst[i].string(), &dng_metadata, &exif_metadata);
 
-                auto image_keypoints = std::make_unique<std::vector<KeyPoint>>();
-                gls::image<float>::unique_ptr image_descriptors;
-                surf->detectAndCompute(*image.first->mapImage(), image_keypoints.get(), &image_descriptors);
+                // The burst shares the reference frame's exposure and white balance
+                const auto luma = rawLumaImage(context, _bayerToRawRGBA, _rawGreenToGrayscale, *raw_images[i], *demosaicParameters);
 
-                std::cout << "Found " << image_keypoints->size() << " keypoints for image " << i + 1 << std::endl;
+                surf->detectAndCompute(*luma->mapImage(), &image_keypoints[i]);
+
+                std::cout << "Found " << image_keypoints[i]->size() << " keypoints for image " << i + 1 << std::endl;
+            }
 
-                const auto matches = surf->findMatches(*reference_descriptors, *reference_keypoints, *image_descriptors, *image_keypoints);
+            const std::array<const KeyPoints*, 3> frames = { image_keypoints[0].get(), image_keypoints[1].get(), image_keypoints[2].get() };
+            const auto frame_matches = surf->findMatches(*reference_keypoints, frames);
 
+            for (int i = 0; i < 3; i++) {
                 std::vector<int> inliers;
-                const auto homography = gls::FindHomography(matches, /*threshold=*/ 1, /*max_iterations=*/ 2000, &inliers);
+                const auto homography = gls::FindHomography(frame_matches[i], /*threshold=*/ 1, /*max_iterations=*/ 2000, &inliers);
                 std::cout << "Homography:\n" << homography << std::endl;
                 std::cout << "Found " << inliers.size() << " inliers." << std::endl;
 
-                _registerAndFuse(context, *fused_image, *image.second, fused_image.get(), homography, i + 1);
+                // The homography is estimated on the half resolution planes, as the merge expects
+                _rawMerge.merge(context, *raw_images[i], homography);
+                context->waitForCompletion();
+                raw_images[i].reset();
             }
 
+            gls::mtl_image_2d<gls::luma_pixel_16> fused_raw(context->device(), { reference_image.width, reference_image.height });
+            _rawMerge.resolve(context, &fused_raw);
+            context->waitForCompletion();
+
+            const float effectiveFrames = _rawMerge.effectiveFrames();
+            std::cout << "Effective merged frames: " << effectiveFrames << std::endl;
+            mergedBurstParameters(demosaicParameters.get(), effectiveFrames);
+
+            // The merged raw is archived with the reference frame's metadata, encoded off the burst's critical path
+            fusedImageWriter().writeDNG(*fused_raw.mapImage(), (reference_image_path.parent_path().parent_path() / "Fusion" /
+                                                                (base_filename + "_rawaRH.dng")).string(),
+                                        dng_metadata, &exif_metadata);
+
+            const auto fused_image = rawConverter.demosaic(fused_raw, demosaicParameters.get(), /*denoise=*/ true, /*postProcess=*/ true);
             auto fused_image_cpu = fused_image->mapImage();
-            const auto filename = reference_image_path.stem().string().substr(0, reference_image_path.stem().string().find("_4_"));
-            saveFusedImage(*fused_image_cpu, reference_image_path.parent_path().parent_path() / "Fusion" / (filename + "_fullaRH.tiff"));
+            saveFusedImage(*fused_image_cpu, reference_image_path.parent_path().parent_path() / "Fusion" / (base_filename + "_rawaRH.tiff"));
+        } else {
+            std::cout << "Weird burst: " << burst[0].string() << std::endl;
         }
     }
+
+    fusedImageWriter().wait();
+    return 0;
+}
+
+// Exposure bracket HDR merge in the raw domain: the brackets of a set are registered and merged into one linear raw
+// image, which goes through a single pipeline run. The metered exposure, the median one, is the reference.
+int main_hdr(int argc, const char * argv[]) {
+    if (argc < 2) {
+        std::cout << "Please provide a directory path..." << std::endl;
+    }
+
+    const auto& input_files = parseDirectory(argv[1]);
+    const auto& bracketSets = findBursts(input_files);
+
+    const auto iccProfile = displayP3Profile();
+
+    auto allMetalDevices = NS::TransferPtr(MTL::CopyAllDevices());
+    auto metalDevice = NS::RetainPtr(allMetalDevices->object<MTL::Device>(0));
+
+    RawConverter rawConverter(metalDevice, &iccProfile->data, /*calibrateFromImage=*/ false);
+    auto context = rawConverter.context();
+
+    HDRMerger hdrMerger(context);
+
+    for (const auto& brackets : bracketSets) {
+        struct Bracket {
+            std::filesystem::path path;
+            std::unique_ptr<gls::mtl_image_2d<gls::luma_pixel_16>> image;
+            std::unique_ptr<DemosaicParameters> demosaicParameters;
+        };
+        std::vector<Bracket> loaded;
+        for (const auto& path : brackets) {
+            gls::tiff_metadata dng_metadata, exif_metadata;
+            auto raw_image = DNGDecoder::readHostImage(context->device(), path.string(), &dng_metadata, &exif_metadata);
+            auto demosaicParameters = CameraCalibrationRegistry::shared().getDemosaicParameters(*raw_image->mapImage(), rawConverter.xyz_rgb(),
+                                                                                                &dng_metadata, &exif_metadata);
+            loaded.push_back({ path, std::move(raw_image), std::move(demosaicParameters) });
+        }
+        std::sort(loaded.begin(), loaded.end(), [](const Bracket& a, const Bracket& b) {
+            return a.demosaicParameters->exposureTime < b.demosaicParameters->exposureTime;
+        });
+        // The reference goes first
+        std::rotate(loaded.begin(), loaded.begin() + loaded.size() / 2, loaded.begin() + loaded.size() / 2 + 1);
+
+        const auto& reference = loaded[0];
+        std::cout << "Reference Image: " << reference.path.filename() << std::endl;
+
+        hdrMerger.reset();
+        for (const auto& bracket : loaded) {
+            hdrMerger.addFrame(*bracket.image, *bracket.demosaicParameters, *reference.demosaicParameters);
+        }
+        const auto mergedRaw = hdrMerger.mergedRawImage(reference.demosaicParameters.get());
+
+        const auto hdr_image = rawConverter.demosaic(*mergedRaw, reference.demosaicParameters.get(), /*denoise=*/ true, /*postProcess=*/ true);
+        auto hdr_image_cpu = hdr_image->mapImage();
+        saveFusedImage(*hdr_image_cpu, reference.path.parent_path().parent_path() / "Fusion" / (reference.path.stem().string() + "_hdr.tiff"));
+    }
+
+    fusedImageWriter().wait();
     return 0;
 }
 
@@ -270,44 +605,55 @@ int main(int argc, const char * argv[]) {
     const auto& bursts = findBursts(input_files);
 
     // Read ICC color profile data
-    auto icc_profile_data = read_binary_file("/System/Library/ColorSync/Profiles/Display P3.icc");
+    const auto iccProfile = displayP3Profile();
 
     auto allMetalDevices = NS::TransferPtr(MTL::CopyAllDevices());
     auto metalDevice = NS::RetainPtr(allMetalDevices->object<MTL::Device>(0));
 
     // FIXME: the address sanitizer doesn't like the profile data.
-    RawConverter rawConverter(metalDevice, &icc_profile_data, /*calibrateFromImage=*/ false);
+    RawConverter rawConverter(metalDevice, &iccProfile->data, /*calibrateFromImage=*/ false);
     auto context = rawConverter.context();
-
-    RegisterAndFuseKernel _registerAndFuse(context);
-    RegisterBayerImageKernel _registerBayerImageKernel(context);
-
-    gls::mtl_image_2d<gls::pixel_float4>::unique_ptr fused_image = nullptr;
+    BurstFrameSelector frameSelector(context);
 
     for (const auto& burst : bursts) {
-        if (burst.size() == 4) {
-            const auto& reference_image_path = burst[3];
-            std::cout << "Reference Image: " << reference_image_path.filename() << std::endl;
+        if (burst.size() >= 2) {
+            const auto& last_image_path = burst.back();
+            const auto& last_stem = last_image_path.stem().string();
+            const auto base_filename = last_stem.substr(0, last_stem.find("_" + std::to_string(burst.size()) + "_"));
+
+            // The frames are decoded and scored on the GPU, the sharpest one is the reference and the blurred ones
+            // are dropped before the registration
+            std::vector<gls::image<gls::luma_pixel_16>::unique_ptr> rawImages;
+            std::vector<std::pair<gls::tiff_metadata, gls::tiff_metadata>> metadata(burst.size());
+            for (int i = 0; i < (int) burst.size(); i++) {
+                rawImages.push_back(DNGDecoder::read(burst[i].string(), &metadata[i].first, &metadata[i].second));
+            }
 
-            const auto base_filename = reference_image_path.stem().string().substr(0, reference_image_path.stem().string().find("_4_"));
+            auto demosaicParameters = CameraCalibrationRegistry::shared().getDemosaicParameters(*rawImages.back(), rawConverter.xyz_rgb(),
+                                                                                                &metadata.back().first, &metadata.back().second);
 
-            std::array<gls::image<gls::luma_pixel_16>::unique_ptr, 4> rawImages;
+            frameSelector.reset();
+            for (const auto& rawImage : rawImages) {
+                frameSelector.addFrame(*rawImage, *demosaicParameters);
+            }
+            const auto selectedFrames = frameSelector.sharpFrames();
+            const int reference = selectedFrames.front();
+            std::cout << "Reference Image: " << burst[reference].filename() << std::endl;
+            for (int i = 0; i < (int) burst.size(); i++) {
+                if (!frameSelector.sharp(i)) {
+                    std::cout << "Dropping blurred image " << burst[i].filename() << std::endl;
+                }
+            }
 
-            gls::tiff_metadata dng_metadata, exif_metadata;
-            rawImages[0] = gls::image<gls::luma_pixel_16>::read_dng_file(reference_image_path.string(), &dng_metadata, &exif_metadata);
-            const auto referenceChannels = RawChannels(*rawImages[0], dng_metadata, exif_metadata);
+            const auto referenceChannels = RawChannels(*rawImages[reference], metadata[reference].first, metadata[reference].second);
             const std::array<int, 2> channels = {1, 3};
             const int channel_count = 2;
 
             auto surf = gls::SURF::makeInstance(context, referenceChannels[1]->width, referenceChannels[1]->height,
                                                 /*max_features=*/ 1500, /*nOctaves=*/ 4, /*nOctaveLayers=*/ 2, /*hessianThreshold=*/ 0.02);
 
-            std::unique_ptr<DemosaicParameters> demosaicParameters = nullptr;
-            auto rgb_image_ptr = runPipeline(&rawConverter, reference_image_path.string(), &demosaicParameters);
-            if (!fused_image) {
-                fused_image = std::make_unique<gls::mtl_image_2d<gls::pixel_float4>>(context->device(), rgb_image_ptr->size());
-            }
-            fused_image->copyPixelsFrom(*rgb_image_ptr->mapImage());
+            // The reference frame starts the burst, the others are fused in the denoising pyramid as they are registered
+            rawConverter.fuseFrame(*rawImages[reference], demosaicParameters.get(), gls::Matrix<3, 3>::identity());
 
             std::array<gls::image<float>::unique_ptr, 2> reference_descriptors;
             std::array<std::unique_ptr<std::vector<KeyPoint>>, 2> reference_keypoints;
@@ -317,19 +663,16 @@ int main(int argc, const char * argv[]) {
                 std::cout << "Found " << reference_keypoints[c]->size() << " reference keypoints for channel " << channels[c] << std::endl;
             }
 
-            for (int i = 0; i < 3; i++) {
-                gls::tiff_metadata dng_metadata, exif_metadata;
-                rawImages[i + 1] = gls::image<gls::luma_pixel_16>::read_dng_file(burst[i].string(), &dng_metadata, &exif_metadata);
-                const auto imageChannels = RawChannels(*rawImages[i + 1], dng_metadata, exif_metadata);
+            for (const int i : selectedFrames | std::views::drop(1)) {
+                const auto imageChannels = RawChannels(*rawImages[i], metadata[i].first, metadata[i].second);
 
-                // const auto imageChannels = RawChannels(burst[i].string());
                 std::array<std::unique_ptr<std::vector<KeyPoint>>, 2> image_keypoints;
                 gls::Matrix<3, 3> homography = gls::Matrix<3, 3>::zeros();
                 for (int c = 0; c < channel_count; c++) {
                     std::array<gls::image<float>::unique_ptr, 2> image_descriptors;
                     image_keypoints[c] = std::make_unique<std::vector<KeyPoint>>();
                     surf->detectAndCompute(*imageChannels[channels[c]], image_keypoints[c].get(), &image_descriptors[c]);
-                    std::cout << "Found " << image_keypoints[c]->size() << " keypoints for channel " << channels[c] << " of image " << i + 1 << std::endl;
+                    std::cout << "Found " << image_keypoints[c]->size() << " keypoints for channel " << channels[c] << " of image " << i << std::endl;
                     const auto matches = surf->findMatches(*reference_descriptors[c], *reference_keypoints[c], *image_descriptors[c], *image_keypoints[c]);
                     std::vector<int> inliers;
                     const auto channel_homography = gls::FindHomography(matches, /*threshold=*/ 1, /*max_iterations=*/ 2000, &inliers);
@@ -341,16 +684,23 @@ int main(int argc, const char * argv[]) {
                 }
                 std::cout << "Homography:\n" << homography << std::endl;
 
-                auto rgb_image_ptr = runPipeline(&rawConverter, burst[i].string(), &demosaicParameters);
-                _registerAndFuse(context, *fused_image, *rgb_image_ptr, fused_image.get(), ScaleHomography(homography, 2), i + 1);
+                // The channels' homography is at half resolution
+                const auto rawHomography = ScaleHomography(homography, 2);
+                if (!frameSelector.aligned(reference, i, rawHomography)) {
+                    std::cout << "Dropping misaligned image " << burst[i].filename() << std::endl;
+                    continue;
+                }
+                rawConverter.fuseFrame(*rawImages[i], demosaicParameters.get(), rawHomography);
             }
 
+            const auto fused_image = rawConverter.demosaicFused(demosaicParameters.get());
             auto fused_image_cpu = fused_image->mapImage();
-            saveFusedImage(*fused_image_cpu, reference_image_path.parent_path().parent_path() / "Fusion" / (base_filename + "aRH_fork.tiff"));
+            saveFusedImage(*fused_image_cpu, last_image_path.parent_path().parent_path() / "Fusion" / (base_filename + "aRH_fork.tiff"));
         } else {
             std::cout << "Weird burst: " << burst[0].string() << std::endl;
         }
     }
 
+    fusedImageWriter().wait();
     return 0;
 }